@@ -23,6 +23,8 @@ import (
 
     "go.etcd.io/etcd/clientv3"
 
+    "github.com/golang/protobuf/ptypes"
+
     "github.com/container-storage-interface/spec/lib/go/csi"
 )
 
@@ -49,6 +51,21 @@ type InodeConfig struct
     Readonly bool `json:"readonly,omitempty"`
 }
 
+// Inode index and configuration read from etcd. RawConfig keeps all fields
+// of the configuration so that rewriting it doesn't lose unknown ones
+type InodeInfo struct
+{
+    Index InodeIndex
+    Config InodeConfig
+    RawConfig map[string]interface{}
+    IndexModRev int64
+    ConfigModRev int64
+}
+
+// Suffix of names of hidden layers created when a volume is cloned from another volume.
+// Such layers are removed automatically when none of the volumes use them anymore
+const CLONE_LAYER_MARK = "@csi-clone-"
+
 type ControllerServer struct
 {
     *Driver
@@ -114,6 +131,237 @@ func GetConnectionParams(params map[string]string) (map[string]string, []string,
     return ctxVars, etcdUrl, etcdPrefix
 }
 
+// Read inode configuration by ID. Returns nil if the inode doesn't exist
+func GetInodeById(cli *clientv3.Client, etcdPrefix string, poolId uint64, inodeId uint64) (*InodeInfo, error)
+{
+    inodeCfgKey := fmt.Sprintf("/config/inode/%d/%d", poolId, inodeId)
+    ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
+    resp, err := cli.Get(ctx, etcdPrefix+inodeCfgKey)
+    cancel()
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
+    }
+    if (len(resp.Kvs) == 0)
+    {
+        return nil, nil
+    }
+    info := &InodeInfo{
+        Index: InodeIndex{ Id: inodeId, PoolId: poolId },
+        ConfigModRev: resp.Kvs[0].ModRevision,
+    }
+    err = json.Unmarshal(resp.Kvs[0].Value, &info.Config)
+    if (err == nil)
+    {
+        err = json.Unmarshal(resp.Kvs[0].Value, &info.RawConfig)
+    }
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "invalid "+inodeCfgKey+" key in etcd: "+err.Error())
+    }
+    return info, nil
+}
+
+// Read inode index and configuration by name. Returns nil if the inode doesn't exist
+func GetInodeByName(cli *clientv3.Client, etcdPrefix string, name string) (*InodeInfo, error)
+{
+    ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
+    resp, err := cli.Get(ctx, etcdPrefix+"/index/image/"+name)
+    cancel()
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
+    }
+    if (len(resp.Kvs) == 0)
+    {
+        return nil, nil
+    }
+    var idx InodeIndex
+    err = json.Unmarshal(resp.Kvs[0].Value, &idx)
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "invalid /index/image/"+name+" key in etcd: "+err.Error())
+    }
+    info, err := GetInodeById(cli, etcdPrefix, idx.PoolId, idx.Id)
+    if (err != nil)
+    {
+        return nil, err
+    }
+    if (info == nil)
+    {
+        return nil, status.Error(codes.Internal, fmt.Sprintf("missing /config/inode/%d/%d key in etcd", idx.PoolId, idx.Id))
+    }
+    info.IndexModRev = resp.Kvs[0].ModRevision
+    return info, nil
+}
+
+// Get names of inodes which use <inodeId> from <poolId> as their parent layer
+func GetChildNames(cli *clientv3.Client, etcdPrefix string, poolId uint64, inodeId uint64) ([]string, error)
+{
+    ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
+    resp, err := cli.Get(ctx, etcdPrefix+"/config/inode/", clientv3.WithPrefix())
+    cancel()
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "failed to read keys from etcd: "+err.Error())
+    }
+    var names []string
+    for _, kv := range resp.Kvs
+    {
+        var childPool, childId uint64
+        var inodeCfg InodeConfig
+        if (json.Unmarshal(kv.Value, &inodeCfg) != nil || inodeCfg.ParentId != inodeId)
+        {
+            continue
+        }
+        fmt.Sscanf(string(kv.Key[len(etcdPrefix)+len("/config/inode/"):]), "%d/%d", &childPool, &childId)
+        if (inodeCfg.ParentPool == poolId || inodeCfg.ParentPool == 0 && childPool == poolId)
+        {
+            names = append(names, inodeCfg.Name)
+        }
+    }
+    return names, nil
+}
+
+// Create inode <inodeCfg> in <poolId> under the next free ID, registering it in the image index.
+// <cmps> and <ops> are added to the same transaction. Returns 0 if the transaction failed
+// because of a concurrent modification, the caller should re-check its state and retry then
+func CreateInode(cli *clientv3.Client, etcdPrefix string, poolId uint64, inodeCfg interface{}, name string,
+    cmps []clientv3.Cmp, ops []clientv3.Op) (uint64, error)
+{
+    // Find a free ID
+    // Create image metadata in a transaction verifying that the ID is still free
+    maxIdKey := fmt.Sprintf("%s/index/maxid/%d", etcdPrefix, poolId)
+    ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
+    resp, err := cli.Get(ctx, maxIdKey)
+    cancel()
+    if (err != nil)
+    {
+        return 0, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
+    }
+    var modRev int64
+    var nextId uint64
+    if (len(resp.Kvs) > 0)
+    {
+        var err error
+        nextId, err = strconv.ParseUint(string(resp.Kvs[0].Value), 10, 64)
+        if (err != nil)
+        {
+            return 0, status.Error(codes.Internal, maxIdKey+" contains invalid ID")
+        }
+        modRev = resp.Kvs[0].ModRevision
+        nextId++
+    }
+    else
+    {
+        nextId = 1
+    }
+    inodeIdxJson, _ := json.Marshal(InodeIndex{
+        Id: nextId,
+        PoolId: poolId,
+    })
+    inodeCfgJson, _ := json.Marshal(inodeCfg)
+    ctx, cancel = context.WithTimeout(context.Background(), ETCD_TIMEOUT)
+    txnResp, err := cli.Txn(ctx).If(append([]clientv3.Cmp{
+        clientv3.Compare(clientv3.ModRevision(maxIdKey), "=", modRev),
+        clientv3.Compare(clientv3.CreateRevision(fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, poolId, nextId)), "=", 0),
+    }, cmps...)...).Then(append([]clientv3.Op{
+        clientv3.OpPut(maxIdKey, fmt.Sprintf("%d", nextId)),
+        clientv3.OpPut(fmt.Sprintf("%s/index/image/%s", etcdPrefix, name), string(inodeIdxJson)),
+        clientv3.OpPut(fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, poolId, nextId), string(inodeCfgJson)),
+    }, ops...)...).Commit()
+    cancel()
+    if (err != nil)
+    {
+        return 0, status.Error(codes.Internal, "failed to commit transaction in etcd: "+err.Error())
+    }
+    if (!txnResp.Succeeded)
+    {
+        return 0, nil
+    }
+    return nextId, nil
+}
+
+// Turn image <name> into a read-only snapshot layer <snapName> and put a new writable layer
+// on top of it under the original name. No data is copied. Clients open images by name and
+// follow the rename, so it's safe to snapshot mapped images. Returns the snapshot layer
+func SnapshotInode(cli *clientv3.Client, etcdPrefix string, name string, snapName string) (*InodeInfo, error)
+{
+    for
+    {
+        snap, err := GetInodeByName(cli, etcdPrefix, snapName)
+        if (err != nil || snap != nil)
+        {
+            // Already created
+            return snap, err
+        }
+        src, err := GetInodeByName(cli, etcdPrefix, name)
+        if (err != nil)
+        {
+            return nil, err
+        }
+        if (src == nil)
+        {
+            return nil, status.Error(codes.NotFound, "volume "+name+" does not exist")
+        }
+        snapCfg := make(map[string]interface{})
+        topCfg := make(map[string]interface{})
+        for k, v := range src.RawConfig
+        {
+            snapCfg[k] = v
+            topCfg[k] = v
+        }
+        snapCfg["name"] = snapName
+        snapCfg["readonly"] = true
+        delete(topCfg, "parent_pool")
+        topCfg["parent_id"] = src.Index.Id
+        snapIdxJson, _ := json.Marshal(src.Index)
+        snapCfgJson, _ := json.Marshal(snapCfg)
+        srcCfgKey := fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, src.Index.PoolId, src.Index.Id)
+        topId, err := CreateInode(cli, etcdPrefix, src.Index.PoolId, topCfg, name, []clientv3.Cmp{
+            clientv3.Compare(clientv3.ModRevision(etcdPrefix+"/index/image/"+name), "=", src.IndexModRev),
+            clientv3.Compare(clientv3.ModRevision(srcCfgKey), "=", src.ConfigModRev),
+            clientv3.Compare(clientv3.CreateRevision(etcdPrefix+"/index/image/"+snapName), "=", 0),
+        }, []clientv3.Op{
+            clientv3.OpPut(srcCfgKey, string(snapCfgJson)),
+            clientv3.OpPut(etcdPrefix+"/index/image/"+snapName, string(snapIdxJson)),
+        })
+        if (err != nil)
+        {
+            return nil, err
+        }
+        if (topId != 0)
+        {
+            src.Config.Name = snapName
+            src.Config.Readonly = true
+            return src, nil
+        }
+        // Start over if the transaction fails
+    }
+}
+
+// Run vitastor-cli with connection parameters of the volume
+func InvokeCli(configPath string, etcdUrl []string, args ...string) error
+{
+    args = append(args, "--etcd_address", strings.Join(etcdUrl, ","))
+    if (configPath != "")
+    {
+        args = append(args, "--config_path", configPath)
+    }
+    c := exec.Command("/usr/bin/vitastor-cli", args...)
+    var stderr bytes.Buffer
+    c.Stdout = nil
+    c.Stderr = &stderr
+    err := c.Run()
+    stderrStr := string(stderr.Bytes())
+    if (err != nil)
+    {
+        klog.Errorf("vitastor-cli %s failed: %s, status %s\n", args[0], stderrStr, err)
+        return status.Error(codes.Internal, stderrStr+" (status "+err.Error()+")")
+    }
+    return nil
+}
+
 // Create the volume
 func (cs *ControllerServer) CreateVolume(ctx context.Context, req *csi.CreateVolumeRequest) (*csi.CreateVolumeResponse, error)
 {
@@ -153,6 +401,14 @@ func (cs *ControllerServer) CreateVolume(ctx context.Context, req *csi.CreateVol
     {
         return nil, status.Error(codes.InvalidArgument, "no etcdUrl in storage class configuration and no etcd_address in vitastor.conf")
     }
+    if (req.Parameters["blockDevice"] != "")
+    {
+        if (req.Parameters["blockDevice"] != "nbd" && req.Parameters["blockDevice"] != "ublk")
+        {
+            return nil, status.Error(codes.InvalidArgument, "blockDevice must be nbd or ublk")
+        }
+        ctxVars["blockDevice"] = req.Parameters["blockDevice"]
+    }
 
     // Connect to etcd
     cli, err := clientv3.New(clientv3.Config{
@@ -165,110 +421,99 @@ func (cs *ControllerServer) CreateVolume(ctx context.Context, req *csi.CreateVol
     }
     defer cli.Close()
 
-    var imageId uint64 = 0
+    // Volumes created from snapshots and clones of other volumes are new layers on top of
+    // the source, so they're created instantly regardless of the source size
+    var parent *InodeInfo
+    if src := req.GetVolumeContentSource(); src != nil
+    {
+        var srcId string
+        if (src.GetSnapshot() != nil)
+        {
+            srcId = src.GetSnapshot().GetSnapshotId()
+        }
+        else if (src.GetVolume() != nil)
+        {
+            srcId = src.GetVolume().GetVolumeId()
+        }
+        srcVars := make(map[string]string)
+        err := json.Unmarshal([]byte(srcId), &srcVars)
+        if (err != nil || srcVars["name"] == "")
+        {
+            return nil, status.Error(codes.InvalidArgument, "source volume or snapshot ID not in JSON format")
+        }
+        if (src.GetSnapshot() != nil)
+        {
+            parent, err = GetInodeByName(cli, etcdPrefix, srcVars["name"])
+            if (err == nil && parent == nil)
+            {
+                err = status.Error(codes.NotFound, "snapshot "+srcVars["name"]+" does not exist")
+            }
+        }
+        else
+        {
+            // Freeze the current state of the source volume in a hidden snapshot layer
+            parent, err = SnapshotInode(cli, etcdPrefix, srcVars["name"], srcVars["name"]+CLONE_LAYER_MARK+volName)
+        }
+        if (err != nil)
+        {
+            return nil, err
+        }
+        if (uint64(volSize) < parent.Config.Size)
+        {
+            volSize = int64(parent.Config.Size)
+        }
+    }
+
     for
     {
         // Check if the image exists
-        ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
-        resp, err := cli.Get(ctx, etcdPrefix+"/index/image/"+volName)
-        cancel()
+        existing, err := GetInodeByName(cli, etcdPrefix, volName)
         if (err != nil)
         {
-            return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
+            return nil, err
         }
-        if (len(resp.Kvs) > 0)
+        if (existing != nil)
         {
-            kv := resp.Kvs[0]
-            var v InodeIndex
-            err := json.Unmarshal(kv.Value, &v)
-            if (err != nil)
-            {
-                return nil, status.Error(codes.Internal, "invalid /index/image/"+volName+" key in etcd: "+err.Error())
-            }
-            poolId = v.PoolId
-            imageId = v.Id
-            inodeCfgKey := fmt.Sprintf("/config/inode/%d/%d", poolId, imageId)
-            ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
-            resp, err := cli.Get(ctx, etcdPrefix+inodeCfgKey)
-            cancel()
-            if (err != nil)
-            {
-                return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
-            }
-            if (len(resp.Kvs) == 0)
-            {
-                return nil, status.Error(codes.Internal, "missing "+inodeCfgKey+" key in etcd")
-            }
-            var inodeCfg InodeConfig
-            err = json.Unmarshal(resp.Kvs[0].Value, &inodeCfg)
-            if (err != nil)
-            {
-                return nil, status.Error(codes.Internal, "invalid "+inodeCfgKey+" key in etcd: "+err.Error())
-            }
-            if (inodeCfg.Size < uint64(volSize))
+            if (existing.Config.Size < uint64(volSize))
             {
                 return nil, status.Error(codes.Internal, "image "+volName+" is already created, but size is less than expected")
             }
+            break
         }
-        else
+        inodeCfg := InodeConfig{
+            Name: volName,
+            Size: uint64(volSize),
+        }
+        if (parent != nil)
         {
-            // Find a free ID
-            // Create image metadata in a transaction verifying that the image doesn't exist yet AND ID is still free
-            maxIdKey := fmt.Sprintf("%s/index/maxid/%d", etcdPrefix, poolId)
-            ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
-            resp, err := cli.Get(ctx, maxIdKey)
-            cancel()
-            if (err != nil)
+            inodeCfg.ParentId = parent.Index.Id
+            if (parent.Index.PoolId != poolId)
             {
-                return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
+                inodeCfg.ParentPool = parent.Index.PoolId
             }
-            var modRev int64
-            var nextId uint64
-            if (len(resp.Kvs) > 0)
+        }
+        // Create image metadata in a transaction verifying that the image doesn't exist yet
+        imageId, err := CreateInode(cli, etcdPrefix, poolId, inodeCfg, volName, []clientv3.Cmp{
+            clientv3.Compare(clientv3.CreateRevision(fmt.Sprintf("%s/index/image/%s", etcdPrefix, volName)), "=", 0),
+        }, nil)
+        if (err != nil)
+        {
+            return nil, err
+        }
+        if (imageId != 0)
+        {
+            if (parent != nil && req.Parameters["flatten"] == "true")
             {
-                var err error
-                nextId, err = strconv.ParseUint(string(resp.Kvs[0].Value), 10, 64)
-                if (err != nil)
+                // Detach the new volume from the source in background
+                go func(configPath string)
                 {
-                    return nil, status.Error(codes.Internal, maxIdKey+" contains invalid ID")
-                }
-                modRev = resp.Kvs[0].ModRevision
-                nextId++
+                    klog.Infof("flattening volume %s", volName)
+                    InvokeCli(configPath, etcdUrl, "flatten", volName)
+                }(ctxVars["configPath"])
             }
-            else
-            {
-                nextId = 1
-            }
-            inodeIdxJson, _ := json.Marshal(InodeIndex{
-                Id: nextId,
-                PoolId: poolId,
-            })
-            inodeCfgJson, _ := json.Marshal(InodeConfig{
-                Name: volName,
-                Size: uint64(volSize),
-            })
-            ctx, cancel = context.WithTimeout(context.Background(), ETCD_TIMEOUT)
-            txnResp, err := cli.Txn(ctx).If(
-                clientv3.Compare(clientv3.ModRevision(fmt.Sprintf("%s/index/maxid/%d", etcdPrefix, poolId)), "=", modRev),
-                clientv3.Compare(clientv3.CreateRevision(fmt.Sprintf("%s/index/image/%s", etcdPrefix, volName)), "=", 0),
-                clientv3.Compare(clientv3.CreateRevision(fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, poolId, nextId)), "=", 0),
-            ).Then(
-                clientv3.OpPut(fmt.Sprintf("%s/index/maxid/%d", etcdPrefix, poolId), fmt.Sprintf("%d", nextId)),
-                clientv3.OpPut(fmt.Sprintf("%s/index/image/%s", etcdPrefix, volName), string(inodeIdxJson)),
-                clientv3.OpPut(fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, poolId, nextId), string(inodeCfgJson)),
-            ).Commit()
-            cancel()
-            if (err != nil)
-            {
-                return nil, status.Error(codes.Internal, "failed to commit transaction in etcd: "+err.Error())
-            }
-            if (txnResp.Succeeded)
-            {
-                imageId = nextId
-                break
-            }
-            // Start over if the transaction fails
+            break
         }
+        // Start over if the transaction fails
     }
 
     ctxVars["name"] = volName
@@ -278,6 +523,7 @@ func (cs *ControllerServer) CreateVolume(ctx context.Context, req *csi.CreateVol
             // Ugly, but VolumeContext isn't passed to DeleteVolume :-(
             VolumeId: string(volumeIdJson),
             CapacityBytes: volSize,
+            ContentSource: req.GetVolumeContentSource(),
         },
     }, nil
 }
@@ -316,71 +562,29 @@ func (cs *ControllerServer) DeleteVolume(ctx context.Context, req *csi.DeleteVol
     defer cli.Close()
 
     // Find inode by name
-    ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
-    resp, err := cli.Get(ctx, etcdPrefix+"/index/image/"+volName)
-    cancel()
+    inode, err := GetInodeByName(cli, etcdPrefix, volName)
     if (err != nil)
     {
-        return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
+        return nil, err
     }
-    if (len(resp.Kvs) == 0)
+    if (inode == nil)
     {
         return nil, status.Error(codes.NotFound, "volume "+volName+" does not exist")
     }
-    var idx InodeIndex
-    err = json.Unmarshal(resp.Kvs[0].Value, &idx)
-    if (err != nil)
-    {
-        return nil, status.Error(codes.Internal, "invalid /index/image/"+volName+" key in etcd: "+err.Error())
-    }
 
-    // Get inode config
-    inodeCfgKey := fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, idx.PoolId, idx.Id)
-    ctx, cancel = context.WithTimeout(context.Background(), ETCD_TIMEOUT)
-    resp, err = cli.Get(ctx, inodeCfgKey)
-    cancel()
+    // Delete the inode by invoking vitastor-cli. Data of the volume is merged into its children,
+    // if there are any, i.e. if the volume is the source of clones
+    err = InvokeCli(ctxVars["configPath"], etcdUrl, "rm", volName)
     if (err != nil)
     {
-        return nil, status.Error(codes.Internal, "failed to read key from etcd: "+err.Error())
-    }
-    if (len(resp.Kvs) == 0)
-    {
-        return nil, status.Error(codes.NotFound, "volume "+volName+" does not exist")
-    }
-    var inodeCfg InodeConfig
-    err = json.Unmarshal(resp.Kvs[0].Value, &inodeCfg)
-    if (err != nil)
-    {
-        return nil, status.Error(codes.Internal, "invalid "+inodeCfgKey+" key in etcd: "+err.Error())
-    }
-
-    // Delete inode data by invoking vitastor-cli
-    args := []string{
-        "rm", "--etcd_address", strings.Join(etcdUrl, ","),
-        "--pool", fmt.Sprintf("%d", idx.PoolId),
-        "--inode", fmt.Sprintf("%d", idx.Id),
-    }
-    if (ctxVars["configPath"] != "")
-    {
-        args = append(args, "--config_path", ctxVars["configPath"])
-    }
-    c := exec.Command("/usr/bin/vitastor-cli", args...)
-    var stderr bytes.Buffer
-    c.Stdout = nil
-    c.Stderr = &stderr
-    err = c.Run()
-    stderrStr := string(stderr.Bytes())
-    if (err != nil)
-    {
-        klog.Errorf("vitastor-cli rm failed: %s, status %s\n", stderrStr, err)
-        return nil, status.Error(codes.Internal, stderrStr+" (status "+err.Error()+")")
+        return nil, err
     }
 
     // Delete inode config in etcd
-    ctx, cancel = context.WithTimeout(context.Background(), ETCD_TIMEOUT)
+    ctx, cancel := context.WithTimeout(context.Background(), ETCD_TIMEOUT)
     txnResp, err := cli.Txn(ctx).Then(
         clientv3.OpDelete(fmt.Sprintf("%s/index/image/%s", etcdPrefix, volName)),
-        clientv3.OpDelete(fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, idx.PoolId, idx.Id)),
+        clientv3.OpDelete(fmt.Sprintf("%s/config/inode/%d/%d", etcdPrefix, inode.Index.PoolId, inode.Index.Id)),
     ).Commit()
     cancel()
     if (err != nil)
@@ -392,6 +596,49 @@ func (cs *ControllerServer) DeleteVolume(ctx context.Context, req *csi.DeleteVol
         return nil, status.Error(codes.Internal, "failed to delete keys in etcd: transaction failed")
     }
 
+    // Remove hidden clone layers which were only used by this volume. Such a layer is also the parent
+    // of its source volume (or of a newer clone layer of the same source), so it's removed when that's
+    // its only remaining child, and vitastor-cli merges it into the child then
+    parentPool, parentId := inode.Config.ParentPool, inode.Config.ParentId
+    if (parentPool == 0)
+    {
+        parentPool = inode.Index.PoolId
+    }
+    for parentId != 0
+    {
+        parent, err := GetInodeById(cli, etcdPrefix, parentPool, parentId)
+        if (err != nil)
+        {
+            return nil, err
+        }
+        if (parent == nil || !strings.Contains(parent.Config.Name, CLONE_LAYER_MARK))
+        {
+            break
+        }
+        srcName := parent.Config.Name[0:strings.Index(parent.Config.Name, CLONE_LAYER_MARK)]
+        children, err := GetChildNames(cli, etcdPrefix, parentPool, parentId)
+        if (err != nil)
+        {
+            return nil, err
+        }
+        if (len(children) > 1 || len(children) == 1 && children[0] != srcName &&
+            !strings.HasPrefix(children[0], srcName+CLONE_LAYER_MARK))
+        {
+            // Still used by other clones
+            break
+        }
+        err = InvokeCli(ctxVars["configPath"], etcdUrl, "rm", parent.Config.Name)
+        if (err != nil)
+        {
+            return nil, err
+        }
+        parentId = parent.Config.ParentId
+        if (parent.Config.ParentPool != 0)
+        {
+            parentPool = parent.Config.ParentPool
+        }
+    }
+
     return &csi.DeleteVolumeResponse{}, nil
 }
 
@@ -490,6 +737,7 @@ func (cs *ControllerServer) ControllerGetCapabilities(ctx context.Context, req *
         csi.ControllerServiceCapability_RPC_LIST_VOLUMES,
         csi.ControllerServiceCapability_RPC_EXPAND_VOLUME,
         csi.ControllerServiceCapability_RPC_CREATE_DELETE_SNAPSHOT,
+        csi.ControllerServiceCapability_RPC_CLONE_VOLUME,
     } {
         controllerServerCapabilities = append(controllerServerCapabilities, functionControllerServerCapabilities(capability))
     }
@@ -502,13 +750,113 @@ func (cs *ControllerServer) ControllerGetCapabilities(ctx context.Context, req *
 // CreateSnapshot create snapshot of an existing PV
 func (cs *ControllerServer) CreateSnapshot(ctx context.Context, req *csi.CreateSnapshotRequest) (*csi.CreateSnapshotResponse, error)
 {
-    return nil, status.Error(codes.Unimplemented, "")
+    klog.Infof("received controller create snapshot request %+v", protosanitizer.StripSecrets(req))
+    if (req == nil)
+    {
+        return nil, status.Errorf(codes.InvalidArgument, "request cannot be empty")
+    }
+    if (req.GetName() == "" || req.GetSourceVolumeId() == "")
+    {
+        return nil, status.Error(codes.InvalidArgument, "name and source volume ID are required fields")
+    }
+
+    ctxVars := make(map[string]string)
+    err := json.Unmarshal([]byte(req.GetSourceVolumeId()), &ctxVars)
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "volume ID not in JSON format")
+    }
+    volName := ctxVars["name"]
+    snapName := volName+"@"+req.GetName()
+
+    _, etcdUrl, etcdPrefix := GetConnectionParams(ctxVars)
+    if (len(etcdUrl) == 0)
+    {
+        return nil, status.Error(codes.InvalidArgument, "no etcdUrl in storage class configuration and no etcd_address in vitastor.conf")
+    }
+
+    cli, err := clientv3.New(clientv3.Config{
+        DialTimeout: ETCD_TIMEOUT,
+        Endpoints: etcdUrl,
+    })
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "failed to connect to etcd at "+strings.Join(etcdUrl, ",")+": "+err.Error())
+    }
+    defer cli.Close()
+
+    // The snapshot becomes the parent layer of the volume, so it's created instantly
+    snap, err := SnapshotInode(cli, etcdPrefix, volName, snapName)
+    if (err != nil)
+    {
+        return nil, err
+    }
+
+    ctxVars["name"] = snapName
+    snapIdJson, _ := json.Marshal(ctxVars)
+    return &csi.CreateSnapshotResponse{
+        Snapshot: &csi.Snapshot{
+            SnapshotId: string(snapIdJson),
+            SourceVolumeId: req.GetSourceVolumeId(),
+            SizeBytes: int64(snap.Config.Size),
+            CreationTime: ptypes.TimestampNow(),
+            ReadyToUse: true,
+        },
+    }, nil
 }
 
 // DeleteSnapshot delete provided snapshot of a PV
 func (cs *ControllerServer) DeleteSnapshot(ctx context.Context, req *csi.DeleteSnapshotRequest) (*csi.DeleteSnapshotResponse, error)
 {
-    return nil, status.Error(codes.Unimplemented, "")
+    klog.Infof("received controller delete snapshot request %+v", protosanitizer.StripSecrets(req))
+    if (req == nil)
+    {
+        return nil, status.Error(codes.InvalidArgument, "request cannot be empty")
+    }
+
+    ctxVars := make(map[string]string)
+    err := json.Unmarshal([]byte(req.GetSnapshotId()), &ctxVars)
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "snapshot ID not in JSON format")
+    }
+    snapName := ctxVars["name"]
+
+    _, etcdUrl, etcdPrefix := GetConnectionParams(ctxVars)
+    if (len(etcdUrl) == 0)
+    {
+        return nil, status.Error(codes.InvalidArgument, "no etcdUrl in storage class configuration and no etcd_address in vitastor.conf")
+    }
+
+    cli, err := clientv3.New(clientv3.Config{
+        DialTimeout: ETCD_TIMEOUT,
+        Endpoints: etcdUrl,
+    })
+    if (err != nil)
+    {
+        return nil, status.Error(codes.Internal, "failed to connect to etcd at "+strings.Join(etcdUrl, ",")+": "+err.Error())
+    }
+    defer cli.Close()
+
+    snap, err := GetInodeByName(cli, etcdPrefix, snapName)
+    if (err != nil)
+    {
+        return nil, err
+    }
+    if (snap == nil)
+    {
+        // Already deleted
+        return &csi.DeleteSnapshotResponse{}, nil
+    }
+
+    // Merge the snapshot layer into its children (the volume and its clones) and remove it
+    err = InvokeCli(ctxVars["configPath"], etcdUrl, "rm", snapName)
+    if (err != nil)
+    {
+        return nil, err
+    }
+
+    return &csi.DeleteSnapshotResponse{}, nil
 }
 
 // ListSnapshots list the snapshots of a PV
@@ -49,6 +49,30 @@ func (ns *NodeServer) NodeUnstageVolume(ctx context.Context, req *csi.NodeUnstag
     return &csi.NodeUnstageVolumeResponse{}, nil
 }
 
+// Block device frontend of the volume: vitastor-nbd or vitastor-ublk (blockDevice: "ublk" in the storage class)
+func MapperPath(blockDevice string) string
+{
+    if (blockDevice == "ublk")
+    {
+        return "/usr/bin/vitastor-ublk"
+    }
+    return "/usr/bin/vitastor-nbd"
+}
+
+func UnmapDevice(devicePath string)
+{
+    blockDevice := "nbd"
+    if (strings.HasPrefix(devicePath, "/dev/ublkb"))
+    {
+        blockDevice = "ublk"
+    }
+    unmapOut, unmapErr := exec.Command(MapperPath(blockDevice), "unmap", devicePath).CombinedOutput()
+    if (unmapErr != nil)
+    {
+        klog.Errorf("failed to unmap %s device %s: %s, error: %v", blockDevice, devicePath, unmapOut, unmapErr)
+    }
+}
+
 func Contains(list []string, s string) bool
 {
     for i := 0; i < len(list); i++
@@ -105,7 +129,7 @@ func (ns *NodeServer) NodePublishVolume(ctx context.Context, req *csi.NodePublis
         return nil, status.Error(codes.InvalidArgument, "no etcdUrl in storage class configuration and no etcd_address in vitastor.conf")
     }
 
-    // Map NBD device
+    // Map NBD or ublk device
     // FIXME: Check if already mapped
     args := []string{
         "map", "--etcd_address", strings.Join(etcdUrl, ","),
@@ -120,14 +144,14 @@ func (ns *NodeServer) NodePublishVolume(ctx context.Context, req *csi.NodePublis
     {
         args = append(args, "--readonly", "1")
     }
-    c := exec.Command("/usr/bin/vitastor-nbd", args...)
+    c := exec.Command(MapperPath(ctxVars["blockDevice"]), args...)
     var stdout, stderr bytes.Buffer
     c.Stdout, c.Stderr = &stdout, &stderr
     err = c.Run()
     stdoutStr, stderrStr := string(stdout.Bytes()), string(stderr.Bytes())
     if (err != nil)
     {
-        klog.Errorf("vitastor-nbd map failed: %s, status %s\n", stdoutStr+stderrStr, err)
+        klog.Errorf("%s map failed: %s, status %s\n", MapperPath(ctxVars["blockDevice"]), stdoutStr+stderrStr, err)
         return nil, status.Error(codes.Internal, stdoutStr+stderrStr+" (status "+err.Error()+")")
     }
     devicePath := strings.TrimSpace(stdoutStr)
@@ -138,12 +162,8 @@ func (ns *NodeServer) NodePublishVolume(ctx context.Context, req *csi.NodePublis
     if (err != nil)
     {
         klog.Errorf("failed to get disk format for path %s, error: %v", err)
-        // unmap NBD device
-        unmapOut, unmapErr := exec.Command("/usr/bin/vitastor-nbd", "unmap", devicePath).CombinedOutput()
-        if (unmapErr != nil)
-        {
-            klog.Errorf("failed to unmap NBD device %s: %s, error: %v", devicePath, unmapOut, unmapErr)
-        }
+        // unmap the device
+        UnmapDevice(devicePath)
         return nil, err
     }
 
@@ -179,12 +199,8 @@ func (ns *NodeServer) NodePublishVolume(ctx context.Context, req *csi.NodePublis
             if (cmdErr != nil)
             {
                 klog.Errorf("failed to run mkfs error: %v, output: %v", cmdErr, string(cmdOut))
-                // unmap NBD device
-                unmapOut, unmapErr := exec.Command("/usr/bin/vitastor-nbd", "unmap", devicePath).CombinedOutput()
-                if (unmapErr != nil)
-                {
-                    klog.Errorf("failed to unmap NBD device %s: %s, error: %v", devicePath, unmapOut, unmapErr)
-                }
+                // unmap the device
+                UnmapDevice(devicePath)
                 return nil, status.Error(codes.Internal, cmdErr.Error())
             }
         }
@@ -204,12 +220,8 @@ func (ns *NodeServer) NodePublishVolume(ctx context.Context, req *csi.NodePublis
             "failed to mount device path (%s) to path (%s) for volume (%s) error: %s",
             devicePath, targetPath, volName, err,
         )
-        // unmap NBD device
-        unmapOut, unmapErr := exec.Command("/usr/bin/vitastor-nbd", "unmap", devicePath).CombinedOutput()
-        if (unmapErr != nil)
-        {
-            klog.Errorf("failed to unmap NBD device %s: %s, error: %v", devicePath, unmapOut, unmapErr)
-        }
+        // unmap the device
+        UnmapDevice(devicePath)
         return nil, status.Error(codes.Internal, err.Error())
     }
     return &csi.NodePublishVolumeResponse{}, nil
@@ -239,14 +251,10 @@ func (ns *NodeServer) NodeUnpublishVolume(ctx context.Context, req *csi.NodeUnpu
     {
         return nil, status.Error(codes.Internal, err.Error())
     }
-    // unmap NBD device
+    // unmap the device
     if (refCount == 1)
     {
-        unmapOut, unmapErr := exec.Command("/usr/bin/vitastor-nbd", "unmap", devicePath).CombinedOutput()
-        if (unmapErr != nil)
-        {
-            klog.Errorf("failed to unmap NBD device %s: %s, error: %v", devicePath, unmapOut, unmapErr)
-        }
+        UnmapDevice(devicePath)
     }
     return &csi.NodeUnpublishVolumeResponse{}, nil
 }
@@ -3,6 +3,7 @@
 
 module.exports = {
     scale_pg_count,
+    compact_pg_history,
 };
 
 function add_pg_history(new_pg_history, new_pg, prev_pgs, prev_pg_history, old_pg)
@@ -102,3 +103,52 @@ function scale_pg_count(prev_pgs, prev_pg_history, new_pg_history, new_pg_count)
         prev_pgs.splice(new_pg_count, old_pg_count-new_pg_count);
     }
 }
+
+// Reduce PG history to the minimal form which gives the same peering result.
+// OSDs only start a PG when every history set has a live OSD, so sets are stored
+// as sorted lists of non-zero OSDs, and sets containing another set are dropped
+// with their OSDs moved to all_peers. all_peers doesn't repeat OSDs from osd_sets
+// or from the current osd_set because OSDs always peer them anyway.
+// Keep in sync with compact_pg_history() in src/etcd_state_client.cpp
+function compact_pg_history(history, osd_set)
+{
+    const peers = {};
+    for (const osd_num of (history.all_peers||[]))
+    {
+        if (osd_num)
+            peers[osd_num] = Number(osd_num);
+    }
+    const sets = Object.values((history.osd_sets||[]).reduce((a, c) =>
+    {
+        const s = [ ...new Set(c.filter(osd_num => osd_num).map(Number)) ].sort((a, b) => a-b);
+        // A set without OSDs never blocks peering
+        if (s.length)
+            a[s.join(' ')] = s;
+        return a;
+    }, {})).sort((a, b) => a.length-b.length);
+    const osd_sets = [];
+    for (const s of sets)
+    {
+        if (osd_sets.find(kept => kept.every(osd_num => s.indexOf(osd_num) >= 0)))
+        {
+            for (const osd_num of s)
+                peers[osd_num] = osd_num;
+        }
+        else
+            osd_sets.push(s);
+    }
+    for (const s of osd_sets)
+    {
+        for (const osd_num of s)
+            delete peers[osd_num];
+    }
+    for (const osd_num of (osd_set||[]))
+        delete peers[osd_num];
+    const compacted = { epoch: history.epoch || 0 };
+    const all_peers = Object.values(peers).sort((a, b) => a-b);
+    if (all_peers.length)
+        compacted.all_peers = all_peers;
+    if (osd_sets.length)
+        compacted.osd_sets = osd_sets;
+    return compacted;
+}
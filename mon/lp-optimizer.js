@@ -393,6 +393,188 @@ async function optimize_change({ prev_pgs: prev_int_pgs, osd_tree, pg_size = 3,
     };
 }
 
+// Fast greedy placement for pools where the LP problem is too large to be solved quickly.
+// Keeps valid OSDs of previous PGs in their places, fills the rest with the least loaded OSDs
+// and then moves PGs from the most overloaded OSDs one by one while it improves the balance.
+// The result isn't as good as the LP solution, but it takes a fraction of a second even with
+// thousands of OSDs and PGs
+function optimize_greedy({ prev_pgs, osd_tree, pg_count, pg_size = 3, pg_minsize = 2, parity_space = 1 })
+{
+    if (!osd_tree)
+    {
+        return null;
+    }
+    pg_count = pg_count || (prev_pgs ? prev_pgs.length : 0);
+    if (!pg_count)
+    {
+        return null;
+    }
+    const all_weights = Object.assign({}, ...Object.values(osd_tree));
+    const total_weight = Object.values(all_weights).reduce((a, c) => Number(a) + Number(c), 0);
+    const domain_count = Object.keys(osd_tree).length;
+    const pg_effsize = Math.min(pg_minsize, domain_count)
+        + Math.max(0, Math.min(pg_size, domain_count) - pg_minsize) * parity_space;
+    const domain_of = {};
+    for (const domain in osd_tree)
+    {
+        for (const osd in osd_tree[domain])
+        {
+            domain_of[osd] = domain;
+        }
+    }
+    const osds = Object.keys(all_weights).filter(osd => Number(all_weights[osd]) > 0);
+    // Deviation of each OSD from its fair share, in PG slots
+    const dev = {};
+    for (const osd of osds)
+    {
+        dev[osd] = -all_weights[osd]/total_weight*pg_effsize*pg_count;
+    }
+    const slot_space = (i) => (i >= pg_minsize ? parity_space : 1);
+    const slots_per_osd = {};
+    const add_slot = (pg, i, osd) =>
+    {
+        pg[i] = osd;
+        dev[osd] += slot_space(i);
+        slots_per_osd[osd] = slots_per_osd[osd] || new Set();
+        slots_per_osd[osd].add(pg);
+    };
+    // The least loaded OSD from a failure domain not used by the PG (except the OSD being replaced)
+    const pick_osd = (pg, replaced) =>
+    {
+        const used = {};
+        for (const osd of pg)
+        {
+            if (osd !== NO_OSD && osd !== replaced)
+            {
+                used[domain_of[osd]] = true;
+            }
+        }
+        let best = null;
+        for (const osd of osds)
+        {
+            if (!used[domain_of[osd]] && osd !== replaced && (best === null || dev[osd] < dev[best]))
+            {
+                best = osd;
+            }
+        }
+        return best;
+    };
+    // Keep valid OSDs of previous PGs
+    const pgs = [];
+    for (let i = 0; i < pg_count; i++)
+    {
+        const prev = prev_pgs && prev_pgs[i] || [];
+        const pg = [];
+        const seen = {};
+        for (let j = 0; j < pg_size; j++)
+        {
+            const osd = prev[j] == null ? NO_OSD : ''+prev[j];
+            pg.push(NO_OSD);
+            if (dev[osd] != null && !seen[domain_of[osd]])
+            {
+                seen[domain_of[osd]] = true;
+                add_slot(pg, j, osd);
+            }
+        }
+        pgs.push(pg);
+    }
+    // Fill empty slots
+    const max_filled = Math.min(pg_size, domain_count);
+    for (const pg of pgs)
+    {
+        let filled = pg.filter(osd => osd !== NO_OSD).length;
+        for (let j = 0; j < pg_size && filled < max_filled; j++)
+        {
+            if (pg[j] === NO_OSD)
+            {
+                const osd = pick_osd(pg, null);
+                if (osd === null)
+                {
+                    break;
+                }
+                add_slot(pg, j, osd);
+                filled++;
+            }
+        }
+    }
+    // Move PGs from overloaded OSDs while it reduces the maximum deviation
+    const stuck = {};
+    while (true)
+    {
+        // A move is only useful when the source has at least 1 slot more than the destination
+        let min_dev = null;
+        for (const osd of osds)
+        {
+            if (min_dev === null || dev[osd] < min_dev)
+            {
+                min_dev = dev[osd];
+            }
+        }
+        let src = null;
+        for (const osd of osds)
+        {
+            if (!stuck[osd] && dev[osd] > min_dev+1 && (src === null || dev[osd] > dev[src]))
+            {
+                src = osd;
+            }
+        }
+        if (src === null)
+        {
+            break;
+        }
+        let best_pg = null, best_slot = -1, best_dst = null;
+        for (const pg of slots_per_osd[src] || [])
+        {
+            const i = pg.indexOf(src);
+            const dst = pick_osd(pg, src);
+            if (dst !== null && dev[dst] + slot_space(i) < dev[src] &&
+                (best_dst === null || dev[dst] < dev[best_dst]))
+            {
+                best_pg = pg;
+                best_slot = i;
+                best_dst = dst;
+            }
+        }
+        if (best_dst === null)
+        {
+            stuck[src] = true;
+            continue;
+        }
+        dev[src] -= slot_space(best_slot);
+        slots_per_osd[src].delete(best_pg);
+        add_slot(best_pg, best_slot, best_dst);
+        // The destination may now be able to move its PGs further
+        delete stuck[best_dst];
+    }
+    let differs = 0, osd_differs = 0;
+    if (prev_pgs)
+    {
+        for (let i = 0; i < pg_count; i++)
+        {
+            const prev = prev_pgs[i] || [];
+            if (pgs[i].join('_') != prev.join('_'))
+            {
+                differs++;
+            }
+            for (let j = 0; j < pg_size; j++)
+            {
+                if (pgs[i][j] != prev[j])
+                {
+                    osd_differs++;
+                }
+            }
+        }
+    }
+    return {
+        prev_pgs: prev_pgs || undefined,
+        int_pgs: pgs,
+        differs,
+        osd_differs,
+        space: pg_effsize * pg_list_space_efficiency(pgs, all_weights, pg_minsize, parity_space),
+        total_space: total_weight,
+    };
+}
+
 function print_change_stats(retval, detailed)
 {
     const new_pgs = retval.int_pgs;
@@ -715,6 +897,7 @@ module.exports = {
 
     optimize_initial,
     optimize_change,
+    optimize_greedy,
     print_change_stats,
     pg_weights_space_efficiency,
     pg_list_space_efficiency,
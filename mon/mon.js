@@ -33,6 +33,7 @@ const etcd_allow = new RegExp('^'+[
     'pg/state/[1-9]\\d*/[1-9]\\d*',
     'pg/stats/[1-9]\\d*/[1-9]\\d*',
     'pg/history/[1-9]\\d*/[1-9]\\d*',
+    'pg/scrub/[1-9]\\d*/[1-9]\\d*',
     'history/last_clean_pgs',
     'inode/stats/[1-9]\\d*/[1-9]\\d*',
     'pool/stats/[1-9]\\d*',
@@ -57,10 +58,23 @@ const etcd_tree = {
             mon_change_timeout: 1000, // ms. min: 100
             mon_stats_timeout: 1000, // ms. min: 100
             osd_out_time: 600, // seconds. min: 0
+            mon_lp_max_osds: 256, // pools with more OSDs are placed by the greedy heuristic and refined by LP in background
             placement_levels: { datacenter: 1, rack: 2, host: 3, osd: 4, ... },
             // client and osd
             tcp_header_buffer_size: 65536,
+            tcp_direct_read_threshold: 16384,
+            tcp_direct_read_replies: false, // receive large read replies without copying them from tcp_header_buffer
             use_sync_send_recv: false,
+            use_zerocopy_send: false,
+            zerocopy_send_threshold: 65536,
+            send_batch_delay_us: 0, // postpone small sends while the event loop is busy, 0 = disabled
+            send_batch_max_bytes: 16384,
+            use_multishot_recv: false,
+            multishot_recv_buffers: 256,
+            use_uring_poll: false, // wait for socket events with io_uring multishot poll instead of epoll
+            tcp_nodelay: true,
+            tcp_busy_poll_us: 0, // SO_BUSY_POLL of every connection, 0 = disabled
+            tcp_quickack: "auto", // "auto", "always" or "never"
             use_rdma: true,
             rdma_device: null, // for example, "rocep5s0f0"
             rdma_port_num: 1,
@@ -70,40 +84,80 @@ const etcd_tree = {
             rdma_max_send: 32,
             rdma_max_recv: 8,
             rdma_max_msg: 1048576,
+            rdma_max_srq: 0, // shared receive queue size for all RDMA connections, 0 = per-connection buffers
+            rdma_rendezvous_threshold: 0, // send buffers of at least this size with RDMA READ by the peer, 0 = disabled
+            rdma_max_inline: 256, // send messages of up to this size inline (copied into the send queue entry)
+            rdma_signal_interval: 16, // request a completion only for every Nth send of a batch and for the last one
+            rdma_poll_us: 0, // busy poll the completion queue for this time after completions before sleeping, 0 = disabled
             log_level: 0,
             block_size: 131072,
             disk_alignment: 4096,
             bitmap_granularity: 4096,
             immediate_commit: false, // 'all' or 'small'
             client_dirty_limit: 33554432,
+            client_enable_writeback: false, // acknowledge writes before sending them to OSDs until sync
+            client_readahead: 0, // bytes to prefetch ahead of sequential reads, 0 = disabled
+            client_qos: false, // also apply inode iops_limit and bandwidth_limit on clients
+            client_ec_parity: false, // calculate parity of whole-object EC/XOR writes on clients
             peer_connect_interval: 5, // seconds. min: 1
             peer_connect_timeout: 5, // seconds. min: 1
             osd_idle_timeout: 5, // seconds. min: 1
             osd_ping_timeout: 5, // seconds. min: 1
+            osd_peer_connections: 1, // TCP connections from each OSD to each peer OSD. min: 1, max: 64
             up_wait_retry_interval: 500, // ms. min: 50
+            read_from_replicas: false, // read clean replicated PGs from an OSD on the client's host
             // osd
             etcd_report_interval: 30, // min: 10
+            etcd_full_report_interval: 300, // seconds, unchanged statistics are only repeated this often
+            trace_sample: 0, // trace every Nth client operation, 0 = disabled
+            trace_buffer_size: 1024, // traces of completed operations kept by each OSD
             run_primary: true,
             bind_address: "0.0.0.0",
             bind_port: 0,
+            metrics_port: 0, // HTTP port for Prometheus metrics, 0 = disabled
+            metrics_address: "", // default is bind_address
             autosync_interval: 5,
+            autosync_writes: 0, // sync after this number of unsynced writes, 0 = only by autosync_interval
             client_queue_depth: 128, // unused
             recovery_queue_depth: 4,
             recovery_sync_batch: 16,
+            recovery_osd_queue_depth: 0, // max recovery ops per peer OSD, 0 = unlimited
+            rebalance_batch_size: 0, // misplaced objects with the same OSD set moved together, 0 = one by one
+            recovery_bandwidth_limit: 0, // MB/s
+            recovery_iops_limit: 0,
+            recovery_client_latency_target: 0, // us, back off recovery when client latency is higher
+            scrub_interval: 0, // seconds between deep scrubs of each PG, 0 = disabled
+            scrub_queue_depth: 1,
+            scrub_bandwidth_limit: 0, // MB/s
+            scrub_iops_limit: 0,
+            peering_log_size: 65536, // objects changed since active+clean to list incrementally, 0 = full listing
+            peering_queue_depth: 0, // PGs peered at the same time, 0 = unlimited
+            shutdown_drain_timeout: 0, // seconds to wait for primary PGs to move away on stop, 0 = stop immediately
+            layer_bitmap_cache_size: 262144, // parent layer bitmaps cached for chained reads, 0 = disabled
+            copy_up_reads: 0, // merge clone objects into the clone after this number of reads from parents, 0 = disabled
+            copy_up_queue_depth: 4, // background merges (copy-ups) at the same time
             readonly: false,
             no_recovery: false,
             no_rebalance: false,
             print_stats_interval: 3,
             slow_log_interval: 10,
+            ec_backend: "isal", // or "jerasure"
+            ec_decoding_cache: 256,
+            read_balance: "primary", // or "random", "least_queued", "lowest_latency"
+            pipeline_replication_threshold: 0, // forward replicated writes of at least this size between replicas, 0 = disabled
+            subop_batch_max: 0, // send up to this number of small subops to the same peer in one request, 0 = disabled
             // blockstore - fixed in superblock
             block_size,
             disk_alignment,
             journal_block_size,
             meta_block_size,
             bitmap_granularity,
+            data_csum_type: "none", // or "crc32c"
+            data_compression: false,
             journal_device,
             journal_offset,
             journal_size,
+            journal_stripe_size,
             disable_journal_fsync,
             data_device,
             data_offset,
@@ -115,11 +169,41 @@ const etcd_tree = {
             disable_device_lock,
             // blockstore - configurable
             max_write_iodepth,
+            max_read_iodepth: 128,
+            meta_read_iodepth: 4,
+            journal_read_iodepth: 4,
+            clean_db_checkpoint: "/var/lib/vitastor/osd1.ckpt",
+            compact_clean_db: false,
+            journal_multi_entries: false,
+            sync_max_delay_us: 0,
+            read_cache_size: 0,
+            journal_write_batch: 32,
+            journal_fua: false, // or true or "auto"
+            nvme_passthrough: false,
+            nvme_fua: false,
+            journal_dax: false,
+            discard_on_free: false,
+            discard_max_rate: 100,
+            discard_interval_ms: 1000,
+            small_object_size: 0,
+            csum_verify_rate: 1,
             min_flusher_count: 1,
             max_flusher_count: 256,
+            flusher_fill_low: 10,
+            flusher_fill_high: 50,
+            flusher_target_latency_us: 0,
+            flusher_sort_window: 0,
+            throttle_small_writes: false, // or true or "auto"
+            prio_weight_client: 8,
+            prio_weight_recovery: 2,
+            prio_weight_scrub: 1,
+            prio_max_iodepth_client: 0,
+            prio_max_iodepth_recovery: 0,
+            prio_max_iodepth_scrub: 0,
             inmemory_metadata,
             inmemory_journal,
             journal_sector_buffer_count,
+            journal_sector_buffer_max,
             journal_no_same_sector_overwrites,
         }, */
         global: {},
@@ -141,6 +225,8 @@ const etcd_tree = {
                 failure_domain: 'host',
                 max_osd_combinations: 10000,
                 pg_stripe_size: 4194304,
+                // compress full data blocks on OSDs with data_compression enabled
+                compression?: 'none' | 'lz4' | 'zstd',
                 root_node?: 'rack1',
                 // restrict pool to OSDs having all of these tags
                 osd_tags?: 'nvme' | [ 'nvme', ... ],
@@ -172,6 +258,8 @@ const etcd_tree = {
                     parent_pool?: <pool_id>,
                     parent_id?: <inode_t>,
                     readonly?: boolean,
+                    iops_limit?: uint64_t, // enforced by each primary OSD, 0 = unlimited
+                    bandwidth_limit?: uint64_t, // bytes per second
                 }
             }
         }, */
@@ -196,10 +284,10 @@ const etcd_tree = {
                 free: uint64_t, // bytes
                 host: string,
                 op_stats: {
-                    <string>: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
+                    <string>: { count: uint64_t, usec: uint64_t, bytes: uint64_t, usec_hist: { <bucket_start_usec>: uint64_t } },
                 },
                 subop_stats: {
-                    <string>: { count: uint64_t, usec: uint64_t },
+                    <string>: { count: uint64_t, usec: uint64_t, usec_hist: { <bucket_start_usec>: uint64_t } },
                 },
                 recovery_stats: {
                     degraded: { count: uint64_t, bytes: uint64_t },
@@ -257,12 +345,29 @@ const etcd_tree = {
                 },
             }, */
         },
+        scrub: {
+            /* <pool_id>: {
+                <pg_id>: {
+                    time: uint64_t,
+                    duration: uint64_t,
+                    primary: osd_num_t,
+                    object_count: uint64_t,
+                    skipped_count: uint64_t,
+                    inconsistent_count: uint64_t,
+                    inconsistent: { inode: uint64_t, stripe: uint64_t, version: uint64_t, osds: osd_num_t[] }[],
+                },
+            }, */
+        },
     },
     inode: {
         stats: {
             /* <pool_id>: {
                 <inode_t>: {
                     raw_used: uint64_t, // raw used bytes on OSDs
+                    used_bytes: uint64_t, // used bytes, i.e. raw_used without redundancy
+                    // only when the inode has compressed data
+                    compressed_raw?: uint64_t, // raw bytes of compressed blocks before compression
+                    compressed_stored?: uint64_t, // raw bytes of compressed blocks after compression
                     read: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
                     write: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
                     delete: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
@@ -274,6 +379,7 @@ const etcd_tree = {
         stats: {
             /* <pool_id>: {
                 used_raw_tb: float, // used raw space in the pool
+                used_bytes: uint64_t, // used space in the pool without redundancy, sum of inode used_bytes
                 total_raw_tb: float, // maximum amount of space in the pool
                 raw_to_usable: float, // raw to usable ratio
                 space_efficiency: float, // 0..1
@@ -282,10 +388,17 @@ const etcd_tree = {
     },
     stats: {
         /* op_stats: {
-            <string>: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
+            <string>: {
+                count: uint64_t, usec: uint64_t, bytes: uint64_t, usec_hist: { <bucket_start_usec>: uint64_t },
+                // for the last stats interval
+                usec_p50: uint64_t, usec_p99: uint64_t, usec_p999: uint64_t,
+            },
         },
         subop_stats: {
-            <string>: { count: uint64_t, usec: uint64_t },
+            <string>: {
+                count: uint64_t, usec: uint64_t, usec_hist: { <bucket_start_usec>: uint64_t },
+                usec_p50: uint64_t, usec_p99: uint64_t, usec_p999: uint64_t,
+            },
         },
         recovery_stats: {
             degraded: { count: uint64_t, bytes: uint64_t },
@@ -336,6 +449,11 @@ class Mon
         this.etcd_prefix = this.etcd_prefix.replace(/\/\/+/g, '/').replace(/^\/?(.*[^\/])\/?$/, '/$1');
         this.etcd_start_timeout = (config.etcd_start_timeout || 5) * 1000;
         this.state = JSON.parse(JSON.stringify(this.constructor.etcd_tree));
+        this.reset_stats_sums();
+        // Background LP runs for large pools: pool_id => tree hash, and their results
+        this.refining_pgs = {};
+        this.refined_pgs = {};
+        this.force_pg_recheck = false;
     }
 
     async start()
@@ -387,11 +505,13 @@ class Mon
         {
             this.config.mon_stats_timeout = 100;
         }
+        this.config.etcd_full_report_interval = Number(this.config.etcd_full_report_interval) || 300;
         this.config.mon_stats_interval = Number(this.config.mon_stats_interval) || 5000;
         if (this.config.mon_stats_interval < 100)
         {
             this.config.mon_stats_interval = 100;
         }
+        this.config.mon_lp_max_osds = Number(this.config.mon_lp_max_osds) || 256;
         // After this number of seconds, a dead OSD will be removed from PG distribution
         this.config.osd_out_time = Number(this.config.osd_out_time) || 0;
         if (!this.config.osd_out_time)
@@ -480,7 +600,8 @@ class Mon
                 {
                     this.parse_kv(e.kv);
                     const key = e.kv.key.substr(this.etcd_prefix.length);
-                    if (key.substr(0, 11) == '/osd/stats/' || key.substr(0, 10) == '/pg/stats/' || key.substr(0, 16) == '/osd/inodestats/')
+                    if (key.substr(0, 11) == '/osd/stats/' || key.substr(0, 10) == '/pg/stats/' ||
+                        key.substr(0, 16) == '/osd/inodestats/' || key.substr(0, 11) == '/osd/space/')
                     {
                         stats_changed = true;
                     }
@@ -590,6 +711,7 @@ class Mon
         ] }, this.etcd_start_timeout, -1);
         this.etcd_watch_revision = BigInt(res.header.revision)+BigInt(1);
         this.state = JSON.parse(JSON.stringify(this.constructor.etcd_tree));
+        this.reset_stats_sums();
         for (const response of res.responses)
         {
             for (const kv of response.response_range.kvs)
@@ -743,17 +865,27 @@ class Mon
 
     pick_primary(pool_id, osd_set, up_osds)
     {
-        let alive_set;
-        if (this.state.config.pools[pool_id].scheme === 'replicated')
-            alive_set = osd_set.filter(osd_num => osd_num && up_osds[osd_num]);
-        else
+        // OSDs draining before shutdown report primary_enabled: false and only stay primary if there are no others
+        const enabled = (osd_num) => this.state.osd.state[osd_num] && this.state.osd.state[osd_num].primary_enabled !== false;
+        let candidates = [ osd_set ];
+        if (this.state.config.pools[pool_id].scheme !== 'replicated')
         {
             // Prefer data OSDs for EC because they can actually read something without an additional network hop
             const pg_data_size = (this.state.config.pools[pool_id].pg_size||0) -
                 (this.state.config.pools[pool_id].parity_chunks||0);
-            alive_set = osd_set.slice(0, pg_data_size).filter(osd_num => osd_num && up_osds[osd_num]);
-            if (!alive_set.length)
-                alive_set = osd_set.filter(osd_num => osd_num && up_osds[osd_num]);
+            candidates = [ osd_set.slice(0, pg_data_size), osd_set ];
+        }
+        let alive_set = [];
+        for (const filter of [ enabled, osd_num => true ])
+        {
+            for (const set of candidates)
+            {
+                alive_set = set.filter(osd_num => osd_num && up_osds[osd_num] && filter(osd_num));
+                if (alive_set.length)
+                    break;
+            }
+            if (alive_set.length)
+                break;
         }
         if (!alive_set.length)
             return 0;
@@ -763,6 +895,14 @@ class Mon
     save_new_pgs_txn(request, pool_id, up_osds, prev_pgs, new_pgs, pg_history)
     {
         const pg_items = {};
+        // Only history keys which actually change are rewritten, otherwise large pools
+        // quickly hit etcd's max_txn_ops limit (128 by default). Keys are sorted because
+        // history written by OSDs may list them in a different order
+        const prev_history = {};
+        for (const pg in (this.state.pg.history[pool_id]||{}))
+        {
+            prev_history[pg-1] = stableStringify(this.state.pg.history[pool_id][pg]);
+        }
         this.reset_rng();
         new_pgs.map((osd_set, i) =>
         {
@@ -778,16 +918,18 @@ class Mon
                 pg_history[i].osd_sets = pg_history[i].osd_sets || [];
                 pg_history[i].osd_sets.push(prev_pgs[i]);
             }
-            if (pg_history[i] && pg_history[i].osd_sets)
+            if (pg_history[i])
             {
-                pg_history[i].osd_sets = Object.values(pg_history[i].osd_sets
-                    .reduce((a, c) => { a[c.join(' ')] = c; return a; }, {}));
+                pg_history[i] = PGUtil.compact_pg_history(pg_history[i], osd_set);
             }
         });
         for (let i = 0; i < new_pgs.length || i < prev_pgs.length; i++)
         {
-            // FIXME: etcd has max_txn_ops limit, and it's 128 by default
-            // Sooo we probably want to change our storage scheme for PG histories...
+            const new_history = pg_history[i] ? stableStringify(pg_history[i]) : null;
+            if (new_history === (prev_history[i] || null))
+            {
+                continue;
+            }
             request.compare.push({
                 key: b64(this.etcd_prefix+'/pg/history/'+pool_id+'/'+(i+1)),
                 target: 'MOD',
@@ -799,7 +941,7 @@ class Mon
                 request.success.push({
                     requestPut: {
                         key: b64(this.etcd_prefix+'/pg/history/'+pool_id+'/'+(i+1)),
-                        value: b64(JSON.stringify(pg_history[i])),
+                        value: b64(new_history),
                     },
                 });
             }
@@ -940,9 +1082,10 @@ class Mon
             pools: this.state.config.pools,
         };
         const tree_hash = sha1hex(stableStringify(tree_cfg));
-        if (this.state.config.pgs.hash != tree_hash)
+        if (this.state.config.pgs.hash != tree_hash || this.force_pg_recheck)
         {
-            // Something has changed
+            // Something has changed, or a background LP run found a better distribution
+            this.force_pg_recheck = false;
             const etcd_request = { compare: [], success: [] };
             for (const pool_id in (this.state.config.pgs||{}).items||{})
             {
@@ -1001,7 +1144,14 @@ class Mon
                     max_combinations: pool_cfg.max_osd_combinations,
                 };
                 let optimize_result;
-                if (old_pg_count > 0)
+                const refined = this.refined_pgs[pool_id];
+                delete this.refined_pgs[pool_id];
+                if (refined && refined.hash == tree_hash && refined.result.int_pgs.length == pool_cfg.pg_count &&
+                    old_pg_count == pool_cfg.pg_count)
+                {
+                    optimize_result = refined.result;
+                }
+                else if (old_pg_count > 0)
                 {
                     if (old_pg_count != pool_cfg.pg_count)
                     {
@@ -1026,22 +1176,13 @@ class Mon
                             pg.pop();
                         }
                     }
-                    if (!this.state.config.pgs.hash)
-                    {
-                        // Re-shuffle PGs
-                        optimize_result = await LPOptimizer.optimize_initial(optimize_cfg);
-                    }
-                    else
-                    {
-                        optimize_result = await LPOptimizer.optimize_change({
-                            prev_pgs,
-                            ...optimize_cfg,
-                        });
-                    }
+                    // Re-shuffle PGs if there's no hash
+                    optimize_result = await this.optimize_pool(pool_id, tree_hash, optimize_cfg,
+                        this.state.config.pgs.hash ? prev_pgs : null);
                 }
                 else
                 {
-                    optimize_result = await LPOptimizer.optimize_initial(optimize_cfg);
+                    optimize_result = await this.optimize_pool(pool_id, tree_hash, optimize_cfg, null);
                 }
                 if (old_pg_count != optimize_result.int_pgs.length)
                 {
@@ -1159,6 +1300,57 @@ class Mon
     // Schedule a recheck to run after a small timeout (1s)
     // If already scheduled, cancel previous timer and schedule it again
     // This is required for multiple change events to trigger at most 1 recheck in 1s
+    async optimize_pool(pool_id, tree_hash, optimize_cfg, prev_pgs)
+    {
+        const osd_count = Object.values(optimize_cfg.osd_tree).reduce((a, c) => a + Object.keys(c).length, 0);
+        if (osd_count <= this.config.mon_lp_max_osds)
+        {
+            delete this.refining_pgs[pool_id];
+            return prev_pgs
+                ? await LPOptimizer.optimize_change({ prev_pgs, ...optimize_cfg })
+                : await LPOptimizer.optimize_initial(optimize_cfg);
+        }
+        // The LP problem is too large to wait for it, so place PGs with the greedy heuristic now
+        // and try to improve the distribution with LP in background
+        const greedy_result = LPOptimizer.optimize_greedy({ prev_pgs, ...optimize_cfg });
+        this.refine_pgs(pool_id, tree_hash, optimize_cfg, greedy_result);
+        return greedy_result;
+    }
+
+    refine_pgs(pool_id, tree_hash, optimize_cfg, greedy_result)
+    {
+        this.refining_pgs[pool_id] = tree_hash;
+        LPOptimizer.optimize_change({ prev_pgs: greedy_result.int_pgs, ...optimize_cfg }).then(result =>
+        {
+            if (this.refining_pgs[pool_id] !== tree_hash)
+            {
+                // Outdated
+                return;
+            }
+            delete this.refining_pgs[pool_id];
+            // Only apply it when it's noticeably better, because it moves data again
+            if (this.state.config.pgs.hash !== tree_hash || result.space <= greedy_result.space*1.01)
+            {
+                return;
+            }
+            console.log(
+                `LP found a better distribution for pool ${pool_id}: `+
+                `${Math.round(result.space/(result.total_space||1)*10000)/100} % space efficiency instead of `+
+                `${Math.round(greedy_result.space/(greedy_result.total_space||1)*10000)/100} %`
+            );
+            this.refined_pgs[pool_id] = { hash: tree_hash, result };
+            this.force_pg_recheck = true;
+            this.schedule_recheck();
+        }).catch(e =>
+        {
+            if (this.refining_pgs[pool_id] === tree_hash)
+            {
+                delete this.refining_pgs[pool_id];
+            }
+            console.log(`Failed to refine PG distribution of pool ${pool_id} with LP: ${e}`);
+        });
+    }
+
     schedule_recheck()
     {
         if (this.recheck_timer)
@@ -1173,55 +1365,150 @@ class Mon
         }, this.config.mon_change_timeout || 1000);
     }
 
-    sum_op_stats()
+    reset_stats_sums()
     {
-        const op_stats = {}, subop_stats = {}, recovery_stats = {};
-        for (const osd in this.state.osd.stats)
+        // Cluster-wide sums of OSD and PG statistics as flat maps of 'path/to/value' => BigInt,
+        // and the last applied flattened value of each statistics key
+        this.stats_sums = { op: {}, inode: {}, objects: {} };
+        this.stats_flat = {};
+    }
+
+    // Apply the difference between the new and the previous value of a statistics key to the sums,
+    // so that each update only takes time proportional to the size of the changed key
+    update_stats_sums(key_parts, value)
+    {
+        const key = key_parts.join('/');
+        const flat = {};
+        let sums;
+        if (key_parts[0] == 'pg')
+        {
+            sums = this.stats_sums.objects;
+            for (const k of [ 'object', 'clean', 'misplaced', 'degraded', 'incomplete' ])
+            {
+                if (value && value[k+'_count'])
+                {
+                    flat[k] = BigInt(value[k+'_count']);
+                }
+            }
+        }
+        else if (key_parts[1] == 'stats')
         {
-            const st = this.state.osd.stats[osd]||{};
-            for (const op in st.op_stats||{})
+            sums = this.stats_sums.op;
+            for (const kind of [ 'op_stats', 'subop_stats', 'recovery_stats' ])
             {
-                op_stats[op] = op_stats[op] || { count: 0n, usec: 0n, bytes: 0n };
-                op_stats[op].count += BigInt(st.op_stats[op].count||0);
-                op_stats[op].usec += BigInt(st.op_stats[op].usec||0);
-                op_stats[op].bytes += BigInt(st.op_stats[op].bytes||0);
+                flatten_stats(value && value[kind], kind+'/', flat);
             }
-            for (const op in st.subop_stats||{})
+        }
+        else if (key_parts[1] == 'inodestats')
+        {
+            sums = this.stats_sums.inode;
+            flatten_stats(value, '', flat);
+        }
+        else
+        {
+            sums = this.stats_sums.inode;
+            for (const pool_id in value||{})
             {
-                subop_stats[op] = subop_stats[op] || { count: 0n, usec: 0n };
-                subop_stats[op].count += BigInt(st.subop_stats[op].count||0);
-                subop_stats[op].usec += BigInt(st.subop_stats[op].usec||0);
+                for (const inode_num in value[pool_id])
+                {
+                    // Inodes with compressed data are reported as { raw_used, compressed_raw, compressed_stored }
+                    const st = value[pool_id][inode_num];
+                    if (st instanceof Object)
+                    {
+                        for (const k of [ 'raw_used', 'compressed_raw', 'compressed_stored' ])
+                            flat[pool_id+'/'+inode_num+'/'+k] = BigInt(st[k]||0);
+                    }
+                    else
+                        flat[pool_id+'/'+inode_num+'/raw_used'] = BigInt(st||0);
+                }
             }
-            for (const op in st.recovery_stats||{})
+        }
+        const prev = this.stats_flat[key] || {};
+        for (const k in prev)
+        {
+            sums[k] = (sums[k] || 0n) - prev[k];
+            if (sums[k] == 0n && sums !== this.stats_sums.op)
             {
-                recovery_stats[op] = recovery_stats[op] || { count: 0n, bytes: 0n };
-                recovery_stats[op].count += BigInt(st.recovery_stats[op].count||0);
-                recovery_stats[op].bytes += BigInt(st.recovery_stats[op].bytes||0);
+                // Forget inodes which are not reported anymore, but keep all operation names
+                delete sums[k];
             }
         }
-        return { op_stats, subop_stats, recovery_stats };
+        for (const k in flat)
+        {
+            sums[k] = (sums[k] || 0n) + flat[k];
+        }
+        if (value)
+            this.stats_flat[key] = flat;
+        else
+            delete this.stats_flat[key];
     }
 
-    sum_object_counts()
+    sum_op_stats()
     {
-        const object_counts = { object: 0n, clean: 0n, misplaced: 0n, degraded: 0n, incomplete: 0n };
-        for (const pool_id in this.state.pg.stats)
+        const stats = unflatten_stats(this.stats_sums.op);
+        return {
+            op_stats: stats.op_stats || {},
+            subop_stats: stats.subop_stats || {},
+            recovery_stats: stats.recovery_stats || {},
+        };
+    }
+
+    // Calculate latency percentiles for the last stats interval from the difference
+    // of cumulative cluster-wide histograms. Histogram keys are bucket lower bounds in us
+    calc_latency_percentiles(stats)
+    {
+        const prev = this.prev_latency_hists || {};
+        this.prev_latency_hists = {};
+        for (const kind of [ 'op_stats', 'subop_stats' ])
         {
-            for (const pg_num in this.state.pg.stats[pool_id])
+            for (const op in stats[kind])
             {
-                const st = this.state.pg.stats[pool_id][pg_num];
-                if (st)
+                const hist = stats[kind][op].usec_hist;
+                if (!hist)
+                {
+                    continue;
+                }
+                const key = kind+'/'+op;
+                this.prev_latency_hists[key] = { ...hist };
+                const old = prev[key] || {};
+                const buckets = Object.keys(hist)
+                    .map(k => [ Number(k), hist[k] - (old[k] || 0n) ])
+                    .filter(b => b[1] > 0n)
+                    .sort((a, b) => a[0] - b[0]);
+                let total = 0n;
+                for (const b of buckets)
                 {
-                    for (const k in object_counts)
+                    total += b[1];
+                }
+                if (!total)
+                {
+                    continue;
+                }
+                for (const [ name, q ] of [ [ 'p50', 500n ], [ 'p99', 990n ], [ 'p999', 999n ] ])
+                {
+                    const want = (total*q + 999n) / 1000n;
+                    let cum = 0n;
+                    for (const b of buckets)
                     {
-                        if (st[k+'_count'])
+                        cum += b[1];
+                        if (cum >= want)
                         {
-                            object_counts[k] += BigInt(st[k+'_count']);
+                            stats[kind][op]['usec_'+name] = b[0];
+                            break;
                         }
                     }
                 }
             }
         }
+    }
+
+    sum_object_counts()
+    {
+        const object_counts = { object: 0n, clean: 0n, misplaced: 0n, degraded: 0n, incomplete: 0n };
+        for (const k in object_counts)
+        {
+            object_counts[k] = this.stats_sums.objects[k] || 0n;
+        }
         return object_counts;
     }
 
@@ -1230,59 +1517,61 @@ class Mon
         const inode_stats = {};
         const inode_stub = () => ({
             raw_used: 0n,
+            used_bytes: 0n,
             read: { count: 0n, usec: 0n, bytes: 0n },
             write: { count: 0n, usec: 0n, bytes: 0n },
             delete: { count: 0n, usec: 0n, bytes: 0n },
         });
-        const seen_pools = {};
-        for (const pool_id in this.state.config.pools)
-        {
-            seen_pools[pool_id] = true;
-            this.state.pool.stats[pool_id] = this.state.pool.stats[pool_id] || {};
-            this.state.pool.stats[pool_id].used_raw_tb = 0n;
-        }
-        for (const osd_num in this.state.osd.space)
+        const sums = unflatten_stats(this.stats_sums.inode);
+        for (const pool_id in sums)
         {
-            for (const pool_id in this.state.osd.space[osd_num])
+            inode_stats[pool_id] = {};
+            for (const inode_num in sums[pool_id])
             {
-                this.state.pool.stats[pool_id] = this.state.pool.stats[pool_id] || {};
-                if (!seen_pools[pool_id])
+                const st = inode_stats[pool_id][inode_num] = inode_stub();
+                const sum = sums[pool_id][inode_num];
+                st.raw_used = sum.raw_used || 0n;
+                if (sum.compressed_raw)
                 {
-                    this.state.pool.stats[pool_id].used_raw_tb = 0n;
-                    seen_pools[pool_id] = true;
+                    st.compressed_raw = sum.compressed_raw;
+                    st.compressed_stored = sum.compressed_stored || 0n;
                 }
-                inode_stats[pool_id] = inode_stats[pool_id] || {};
-                for (const inode_num in this.state.osd.space[osd_num][pool_id])
+                for (const op of [ 'read', 'write', 'delete' ])
                 {
-                    const u = BigInt(this.state.osd.space[osd_num][pool_id][inode_num]||0);
-                    inode_stats[pool_id][inode_num] = inode_stats[pool_id][inode_num] || inode_stub();
-                    inode_stats[pool_id][inode_num].raw_used += u;
-                    this.state.pool.stats[pool_id].used_raw_tb += u;
+                    for (const k of [ 'count', 'usec', 'bytes' ])
+                    {
+                        st[op][k] = sum[op] && sum[op][k] || 0n;
+                    }
                 }
             }
         }
-        for (const pool_id in seen_pools)
+        const seen_pools = {};
+        for (const pool_id in this.state.config.pools)
+        {
+            seen_pools[pool_id] = true;
+        }
+        for (const pool_id in inode_stats)
         {
-            const used = this.state.pool.stats[pool_id].used_raw_tb;
-            this.state.pool.stats[pool_id].used_raw_tb = Number(used)/1024/1024/1024/1024;
+            seen_pools[pool_id] = true;
         }
-        for (const osd_num in this.state.osd.inodestats)
+        for (const pool_id in seen_pools)
         {
-            const ist = this.state.osd.inodestats[osd_num];
-            for (const pool_id in ist)
+            this.state.pool.stats[pool_id] = this.state.pool.stats[pool_id] || {};
+            // Convert raw usage to usable: every object takes pg_size chunks of which data_chunks hold data
+            const pool_cfg = this.state.config.pools[pool_id];
+            const pg_size = BigInt(pool_cfg && pool_cfg.pg_size || 1);
+            const data_chunks = pool_cfg && pool_cfg.scheme != 'replicated'
+                ? pg_size - BigInt(pool_cfg.parity_chunks||0) : 1n;
+            let pool_raw = 0n, pool_used = 0n;
+            for (const inode_num in inode_stats[pool_id]||{})
             {
-                inode_stats[pool_id] = inode_stats[pool_id] || {};
-                for (const inode_num in ist[pool_id])
-                {
-                    inode_stats[pool_id][inode_num] = inode_stats[pool_id][inode_num] || inode_stub();
-                    for (const op of [ 'read', 'write', 'delete' ])
-                    {
-                        inode_stats[pool_id][inode_num][op].count += BigInt(ist[pool_id][inode_num][op].count||0);
-                        inode_stats[pool_id][inode_num][op].usec += BigInt(ist[pool_id][inode_num][op].usec||0);
-                        inode_stats[pool_id][inode_num][op].bytes += BigInt(ist[pool_id][inode_num][op].bytes||0);
-                    }
-                }
+                const st = inode_stats[pool_id][inode_num];
+                st.used_bytes = st.raw_used * data_chunks / pg_size;
+                pool_raw += st.raw_used;
+                pool_used += st.used_bytes;
             }
+            this.state.pool.stats[pool_id].used_raw_tb = Number(pool_raw)/1024/1024/1024/1024;
+            this.state.pool.stats[pool_id].used_bytes = pool_used;
         }
         return inode_stats;
     }
@@ -1342,33 +1631,44 @@ class Mon
         const inode_stats = this.sum_inode_stats();
         this.fix_stat_overflows(stats, (this.prev_stats = this.prev_stats || {}));
         this.fix_stat_overflows(inode_stats, (this.prev_inode_stats = this.prev_inode_stats || {}));
+        this.calc_latency_percentiles(stats);
         stats.object_counts = object_counts;
         this.serialize_bigints(stats);
         this.serialize_bigints(inode_stats);
+        // Skip values not changed since the last update, but repeat all of them every etcd_full_report_interval
+        const full = !this.stats_full_time || Date.now() >= this.stats_full_time + this.config.etcd_full_report_interval*1000;
+        const reported = full ? {} : { ...(this.reported_stats||{}) };
+        const put_changed = (key, value) =>
+        {
+            if (full || reported[key] !== value)
+            {
+                txn.push({ requestPut: { key: b64(this.etcd_prefix+key), value: b64(value) } });
+                reported[key] = value;
+            }
+        };
         txn.push({ requestPut: { key: b64(this.etcd_prefix+'/stats'), value: b64(JSON.stringify(stats)) } });
         for (const pool_id in inode_stats)
         {
             for (const inode_num in inode_stats[pool_id])
             {
-                txn.push({ requestPut: {
-                    key: b64(this.etcd_prefix+'/inode/stats/'+pool_id+'/'+inode_num),
-                    value: b64(JSON.stringify(inode_stats[pool_id][inode_num])),
-                } });
+                put_changed('/inode/stats/'+pool_id+'/'+inode_num, JSON.stringify(inode_stats[pool_id][inode_num]));
             }
         }
         for (const pool_id in this.state.pool.stats)
         {
             const pool_stats = { ...this.state.pool.stats[pool_id] };
             this.serialize_bigints(pool_stats);
-            txn.push({ requestPut: {
-                key: b64(this.etcd_prefix+'/pool/stats/'+pool_id),
-                value: b64(JSON.stringify(pool_stats)),
-            } });
+            put_changed('/pool/stats/'+pool_id, JSON.stringify(pool_stats));
         }
         if (txn.length)
         {
             await this.etcd_call('/kv/txn', { success: txn }, this.config.etcd_mon_timeout, 0);
         }
+        this.reported_stats = reported;
+        if (full)
+        {
+            this.stats_full_time = Date.now();
+        }
     }
 
     schedule_update_stats()
@@ -1425,6 +1725,11 @@ class Mon
             // Do not clear these to null
             kv.value = kv.value || {};
         }
+        if (key_parts[0] == 'osd' && (key_parts[1] == 'stats' || key_parts[1] == 'inodestats' || key_parts[1] == 'space') ||
+            key_parts[0] == 'pg' && key_parts[1] == 'stats')
+        {
+            this.update_stats_sums(key_parts, kv.value);
+        }
         cur[key_parts[key_parts.length-1]] = kv.value;
         if (key === 'config/global')
         {
@@ -1516,6 +1821,42 @@ class Mon
     }
 }
 
+// Add all integer values of <obj> to <out> as 'path/to/value' => BigInt
+function flatten_stats(obj, prefix, out)
+{
+    for (const k in obj||{})
+    {
+        const v = obj[k];
+        if (v && typeof v == 'object')
+        {
+            flatten_stats(v, prefix+k+'/', out);
+        }
+        else if (typeof v == 'number' && Number.isInteger(v) || typeof v == 'string' && /^\d+$/.exec(v))
+        {
+            out[prefix+k] = BigInt(v);
+        }
+    }
+}
+
+function unflatten_stats(flat)
+{
+    const res = {};
+    for (const k in flat)
+    {
+        const parts = k.split('/');
+        let cur = res;
+        for (let i = 0; i < parts.length-1; i++)
+        {
+            cur = (cur[parts[i]] = cur[parts[i]] || {});
+        }
+        cur[parts[parts.length-1]] = flat[k];
+    }
+    return res;
+}
+
+// Reuse connections to etcd between requests
+const etcd_agent = new http.Agent({ keepAlive: true });
+
 function POST(url, body, timeout)
 {
     return new Promise((ok, no) =>
@@ -1528,7 +1869,7 @@ function POST(url, body, timeout)
             req = null;
             ok({ error: 'timeout' });
         }, timeout) : null;
-        let req = http.request(url, { method: 'POST', headers: {
+        let req = http.request(url, { method: 'POST', agent: etcd_agent, headers: {
             'Content-Type': 'application/json',
             'Content-Length': body_text.length,
         } }, (res) =>
@@ -112,4 +112,31 @@ async function run()
     LPOptimizer.print_change_stats(res, false);
 }
 
-run().catch(console.error);
+// Greedy placement timing with 1000 OSDs in 100 hosts and 8192 PGs
+function run_greedy_bench()
+{
+    const big_tree = {};
+    for (let h = 1; h <= 100; h++)
+    {
+        big_tree['host'+h] = {};
+        for (let o = 1; o <= 10; o++)
+        {
+            big_tree['host'+h][(h-1)*10+o] = 3 + (o % 3);
+        }
+    }
+    const time = (title, fn) =>
+    {
+        const start = Date.now();
+        const res = fn();
+        console.log('\n'+title+': '+(Date.now()-start)+' ms');
+        LPOptimizer.print_change_stats(res, false);
+        return res;
+    };
+    let res = time('Greedy: 8192 PGs, size=3, 1000 OSDs', () => LPOptimizer.optimize_greedy({ osd_tree: big_tree, pg_size: 3, pg_count: 8192 }));
+    delete big_tree['host100'];
+    res = time('Greedy: removing host100', () => LPOptimizer.optimize_greedy({ prev_pgs: res.int_pgs, osd_tree: big_tree, pg_size: 3 }));
+    big_tree['host1'][1001] = 4;
+    res = time('Greedy: adding osd.1001', () => LPOptimizer.optimize_greedy({ prev_pgs: res.int_pgs, osd_tree: big_tree, pg_size: 3 }));
+}
+
+run().then(run_greedy_bench).catch(console.error);
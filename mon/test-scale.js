@@ -0,0 +1,58 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Placement recomputation time of the monitor at scale, complements test_cluster_sim which
+// only models the monitor. Usage:
+// node test-scale.js [--osds 1000] [--osds_per_host 10] [--pg_count 4096] [--pg_size 3] [--pg_minsize 2] [--fail_hosts 1] [--lp 0]
+// With --lp 1 the LP optimizer is also timed, it's much slower at this scale
+
+const LPOptimizer = require('./lp-optimizer.js');
+
+const opts = { osds: 1000, osds_per_host: 10, pg_count: 4096, pg_size: 3, pg_minsize: 2, fail_hosts: 1, lp: 0 };
+for (let i = 2; i < process.argv.length-1; i += 2)
+{
+    const key = process.argv[i].replace(/^--/, '');
+    if (!(key in opts) || isNaN(Number(process.argv[i+1])))
+    {
+        console.error('Invalid option: '+process.argv[i]);
+        process.exit(1);
+    }
+    opts[key] = Number(process.argv[i+1]);
+}
+
+async function time(title, fn)
+{
+    const start = Date.now();
+    const res = await fn();
+    console.log('\n'+title+': '+(Date.now()-start)+' ms');
+    LPOptimizer.print_change_stats(res, false);
+    return res;
+}
+
+async function run()
+{
+    const osd_tree = {};
+    for (let osd = 1; osd <= opts.osds; osd++)
+    {
+        const host = 'host'+Math.ceil(osd/opts.osds_per_host);
+        osd_tree[host] = osd_tree[host] || {};
+        osd_tree[host][osd] = 1;
+    }
+    const cfg = { pg_size: opts.pg_size, pg_minsize: opts.pg_minsize };
+    const title = opts.pg_count+' PGs, size='+opts.pg_size+', '+opts.osds+' OSDs';
+    let res = await time('Greedy: '+title, () => LPOptimizer.optimize_greedy({ osd_tree, pg_count: opts.pg_count, ...cfg }));
+    const prev_pgs = res.int_pgs;
+    const hosts = Object.keys(osd_tree);
+    for (let i = 0; i < opts.fail_hosts && i < hosts.length; i++)
+    {
+        delete osd_tree[hosts[hosts.length-1-i]];
+    }
+    const change = 'removing '+opts.fail_hosts+' host(s)';
+    res = await time('Greedy: '+change, () => LPOptimizer.optimize_greedy({ prev_pgs, osd_tree, ...cfg }));
+    if (opts.lp)
+    {
+        await time('LP: '+change, () => LPOptimizer.optimize_change({ prev_pgs, osd_tree, ...cfg }));
+    }
+}
+
+run().catch(console.error);
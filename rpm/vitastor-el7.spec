@@ -55,6 +55,7 @@ cp -r mon %buildroot/usr/lib/vitastor/mon
 %files
 %doc
 %_bindir/vitastor-dump-journal
+%_bindir/vitastor-disk
 %_bindir/vitastor-nbd
 %_bindir/vitastor-osd
 %_bindir/vitastor-cli
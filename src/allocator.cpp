@@ -15,11 +15,18 @@ allocator::allocator(uint64_t blocks)
     }
     uint64_t p2 = 1;
     total = 0;
+    levels = 0;
     while (p2 * 64 < blocks)
     {
+        level_offset[levels] = total;
+        level_words[levels] = p2;
+        levels++;
         total += p2;
         p2 = p2 * 64;
     }
+    level_offset[levels] = total;
+    level_words[levels] = (blocks+63) / 64;
+    levels++;
     total += (blocks+63) / 64;
     mask = new uint64_t[total];
     size = free = blocks;
@@ -43,13 +50,7 @@ bool allocator::get(uint64_t addr)
     {
         return false;
     }
-    uint64_t p2 = 1, offset = 0;
-    while (p2 * 64 < size)
-    {
-        offset += p2;
-        p2 = p2 * 64;
-    }
-    return ((mask[offset + addr/64] >> (addr % 64)) & 1);
+    return ((mask[level_offset[levels-1] + addr/64] >> (addr % 64)) & 1);
 }
 
 void allocator::set(uint64_t addr, bool value)
@@ -58,84 +59,149 @@ void allocator::set(uint64_t addr, bool value)
     {
         return;
     }
-    uint64_t p2 = 1, offset = 0;
-    while (p2 * 64 < size)
-    {
-        offset += p2;
-        p2 = p2 * 64;
-    }
     uint64_t cur_addr = addr;
     bool is_last = true;
     uint64_t value64 = value ? 1 : 0;
-    while (1)
+    for (int level = levels-1; level >= 0; level--)
     {
-        uint64_t last = offset + cur_addr/64;
+        uint64_t last = level_offset[level] + cur_addr/64;
         uint64_t bit = cur_addr % 64;
-        if (((mask[last] >> bit) & 1) != value64)
+        if (((mask[last] >> bit) & 1) == value64)
         {
-            if (is_last)
-            {
-                free += value ? -1 : 1;
-            }
-            if (value)
-            {
-                mask[last] = mask[last] | (1l << bit);
-                if (mask[last] != (!is_last || cur_addr/64 < size/64
-                    ? UINT64_MAX : last_one_mask))
-                {
-                    break;
-                }
-            }
-            else
-            {
-                mask[last] = mask[last] & ~(1l << bit);
-            }
-            is_last = false;
-            if (p2 > 1)
-            {
-                p2 = p2 / 64;
-                offset -= p2;
-                cur_addr /= 64;
-            }
-            else
+            break;
+        }
+        if (is_last)
+        {
+            free += value ? -1 : 1;
+        }
+        if (value)
+        {
+            mask[last] = mask[last] | (1l << bit);
+            if (mask[last] != (!is_last || cur_addr/64 < size/64
+                ? UINT64_MAX : last_one_mask))
             {
                 break;
             }
         }
         else
         {
+            mask[last] = mask[last] & ~(1l << bit);
+        }
+        is_last = false;
+        cur_addr /= 64;
+    }
+}
+
+uint64_t allocator::find_free_from(uint64_t start)
+{
+    // Go up while the rest of the current word is full, continuing from the next word
+    int level = levels-1;
+    uint64_t pos = start;
+    while (1)
+    {
+        uint64_t word = pos / 64;
+        if (word >= level_words[level])
+        {
+            return UINT64_MAX;
+        }
+        uint64_t m = ~mask[level_offset[level] + word] & (UINT64_MAX << (pos % 64));
+        if (m)
+        {
+            pos = word*64 + __builtin_ctzll(m);
             break;
         }
+        if (level == 0)
+        {
+            return UINT64_MAX;
+        }
+        level--;
+        pos = word+1;
     }
+    // Then go down through the first non-full words
+    while (level < levels-1)
+    {
+        level++;
+        if (pos >= level_words[level])
+        {
+            return UINT64_MAX;
+        }
+        uint64_t m = ~mask[level_offset[level] + pos];
+        if (!m)
+        {
+            return UINT64_MAX;
+        }
+        pos = pos*64 + __builtin_ctzll(m);
+    }
+    return pos < size ? pos : UINT64_MAX;
 }
 
-uint64_t allocator::find_free()
+// Returns the first used block in [start, end) or <end> if all of them are free
+uint64_t allocator::find_used(uint64_t start, uint64_t end)
 {
-    uint64_t p2 = 1, offset = 0, addr = 0, f, i;
-    while (p2 < size)
+    uint64_t *leaf = mask + level_offset[levels-1];
+    while (start < end)
     {
-        if (offset+addr >= total)
+        uint64_t m = leaf[start/64] & (UINT64_MAX << (start % 64));
+        if (m)
+        {
+            start = (start & ~63ul) + __builtin_ctzll(m);
+            return start < end ? start : end;
+        }
+        start = (start & ~63ul) + 64;
+    }
+    return end;
+}
+
+uint64_t allocator::find_free(uint64_t hint)
+{
+    if (hint >= size)
+    {
+        hint = 0;
+    }
+    uint64_t addr = find_free_from(hint);
+    if (addr == UINT64_MAX && hint > 0)
+    {
+        addr = find_free_from(0);
+    }
+    return addr;
+}
+
+uint64_t allocator::find_free_range(uint64_t count, uint64_t hint)
+{
+    if (!count || count > free)
+    {
+        return UINT64_MAX;
+    }
+    if (hint >= size)
+    {
+        hint = 0;
+    }
+    uint64_t start = hint;
+    bool wrapped = false;
+    while (1)
+    {
+        uint64_t addr = find_free_from(start);
+        if (wrapped && addr != UINT64_MAX && addr >= hint)
         {
             return UINT64_MAX;
         }
-        uint64_t m = mask[offset + addr];
-        for (i = 0, f = 1; i < 64; i++, f <<= 1)
+        if (addr == UINT64_MAX || addr+count > size)
         {
-            if (!(m & f))
+            if (wrapped || !hint)
             {
-                break;
+                return UINT64_MAX;
             }
+            wrapped = true;
+            start = 0;
+            continue;
         }
-        if (i == 64)
+        uint64_t used = find_used(addr, addr+count);
+        if (used == addr+count)
         {
-            // No space
-            return UINT64_MAX;
+            return addr;
         }
-        addr = (addr * 64) | i;
-        offset += p2;
-        p2 = p2 * 64;
+        start = used+1;
     }
-    return addr;
 }
 
 uint64_t allocator::get_free_count()
@@ -158,19 +224,33 @@ void bitmap_set(void *bitmap, uint64_t start, uint64_t len, uint64_t bitmap_gran
             return;
         }
     }
-    unsigned bit_start = start / bitmap_granularity;
-    unsigned bit_end = ((start + len) + bitmap_granularity - 1) / bitmap_granularity;
+    unsigned bit_start, bit_end;
+    if (!(bitmap_granularity & (bitmap_granularity-1)))
+    {
+        // Granularity is always a power of 2 with the blockstore, shift instead of dividing
+        int shift = __builtin_ctzll(bitmap_granularity);
+        bit_start = start >> shift;
+        bit_end = (start + len + bitmap_granularity - 1) >> shift;
+    }
+    else
+    {
+        bit_start = start / bitmap_granularity;
+        bit_end = ((start + len) + bitmap_granularity - 1) / bitmap_granularity;
+    }
+    // Set partial bytes bit by bit and whole bytes at once
+    while (bit_start < bit_end && (bit_start & 7))
+    {
+        ((uint8_t*)bitmap)[bit_start / 8] |= 1 << (bit_start % 8);
+        bit_start++;
+    }
+    if (bit_end - bit_start >= 8)
+    {
+        memset((uint8_t*)bitmap + bit_start/8, UINT8_MAX, (bit_end - bit_start) / 8);
+        bit_start += (bit_end - bit_start) & ~7u;
+    }
     while (bit_start < bit_end)
     {
-        if (!(bit_start & 7) && bit_end >= bit_start+8)
-        {
-            ((uint8_t*)bitmap)[bit_start / 8] = UINT8_MAX;
-            bit_start += 8;
-        }
-        else
-        {
-            ((uint8_t*)bitmap)[bit_start / 8] |= 1 << (bit_start % 8);
-            bit_start++;
-        }
+        ((uint8_t*)bitmap)[bit_start / 8] |= 1 << (bit_start % 8);
+        bit_start++;
     }
 }
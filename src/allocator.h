@@ -4,8 +4,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
+
+#define ALLOCATOR_MAX_LEVELS 8
 
 // Hierarchical bitmap allocator
+// The last level is the bitmap of blocks, every bit of upper levels is set
+// when the corresponding 64-bit word of the next level is full
 class allocator
 {
     uint64_t total;
@@ -13,13 +18,43 @@ class allocator
     uint64_t free;
     uint64_t last_one_mask;
     uint64_t *mask;
+    int levels;
+    uint64_t level_offset[ALLOCATOR_MAX_LEVELS], level_words[ALLOCATOR_MAX_LEVELS];
+    uint64_t find_free_from(uint64_t start);
+    uint64_t find_used(uint64_t start, uint64_t end);
 public:
     allocator(uint64_t blocks);
     ~allocator();
     bool get(uint64_t addr);
     void set(uint64_t addr, bool value);
-    uint64_t find_free();
+    // Returns the first free block at or after <hint>, wrapping around to the beginning
+    uint64_t find_free(uint64_t hint = 0);
+    // Returns the first block of <count> contiguous free blocks at or after <hint>, wrapping around
+    uint64_t find_free_range(uint64_t count, uint64_t hint = 0);
     uint64_t get_free_count();
 };
 
 void bitmap_set(void *bitmap, uint64_t start, uint64_t len, uint64_t bitmap_granularity);
+
+// Copy an object bitmap (or a bitmap with checksums). Common sizes are copied with fixed-size
+// moves instead of a memcpy() call: 4 bytes for 128K objects with 4K granularity, 8 for 256K, etc
+inline void bitmap_copy(void *dst, const void *src, uint32_t size)
+{
+    switch (size)
+    {
+    case 4:
+        memcpy(dst, src, 4);
+        break;
+    case 8:
+        memcpy(dst, src, 8);
+        break;
+    case 16:
+        memcpy(dst, src, 16);
+        break;
+    case 32:
+        memcpy(dst, src, 32);
+        break;
+    default:
+        memcpy(dst, src, size);
+    }
+}
@@ -0,0 +1,622 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+/**
+ * In-process micro-benchmarks of OSD hot paths:
+ *
+ * vitastor-bench msgr [options]
+ *   Client and server messengers connected over loopback TCP, the server replies immediately
+ *   like stub_uring_osd. Measures the messenger itself.
+ *
+ * vitastor-bench secondary --data_device <dev> [blockstore options] [options]
+ *   The same, but the server executes secondary reads and writes on a real blockstore.
+ *
+ * vitastor-bench blockstore --data_device <dev> [blockstore options] [options]
+ *   Reads and writes submitted directly to the blockstore, without the network.
+ *
+ * Options: --rw randread|randwrite|read|write (randread), --bs 4096, --iodepth 32,
+ * --conns 1 (number of connections in messenger modes), --runtime 10 (seconds),
+ * --size 1073741824 (size of the tested area), --sync_every 128 (writes between syncs
+ * in blockstore modes, 0 = don't sync), --port 11300 (first port in messenger modes).
+ * --use_uring_poll 1 waits for socket events with io_uring multishot poll instead of epoll,
+ * compare both with a large --conns to measure event loop overhead with many connections.
+ * Messenger options like --tcp_busy_poll_us, --tcp_quickack always|never or --tcp_nodelay 0
+ * are applied to both sides, so their latency effect can be compared in the same way.
+ *
+ * Reports IOPS, bandwidth, latency percentiles, CPU time and CPU cycles per operation.
+ * The blockstore is NOT formatted, use a device or file prepared for an OSD.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <stdexcept>
+
+#include "ringloop.h"
+#include "epoll_manager.h"
+#include "messenger.h"
+#include "blockstore.h"
+#include "latency_hist.h"
+
+#define BENCH_MSGR 1
+#define BENCH_SECONDARY 2
+#define BENCH_BLOCKSTORE 3
+
+struct bench_t
+{
+    int mode = 0;
+    bool write = false, random = true;
+    uint64_t bs = 4096, size = 1024*1024*1024;
+    int iodepth = 32, conns = 1, runtime = 10, port = 11300;
+    uint64_t sync_every = 128;
+
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    osd_messenger_t *server = NULL, *client = NULL;
+    blockstore_t *bstore = NULL;
+    uint64_t block_size = 0;
+    std::vector<int> listen_fds;
+    ring_consumer_t consumer;
+    void *write_buf = NULL, *read_buf = NULL;
+
+    bool stopping = false;
+    int inflight = 0, next_conn = 0;
+    uint64_t seq_pos = 0, writes_since_sync = 0, syncs_inflight = 0;
+    uint64_t op_count = 0, op_bytes = 0, lat_sum = 0, sync_count = 0;
+    latency_hist_t hist = { 0 };
+    timespec tv_start, tv_end, cpu_start, cpu_end;
+    int cycles_fd = -1;
+    uint64_t cycles = 0;
+
+    void parse_args(int narg, char *args[]);
+    void run();
+    void start_server();
+    void server_exec_op(osd_op_t *op);
+    void connect_client();
+    void submit();
+    void submit_msgr_op();
+    void submit_bs_op();
+    void submit_sync();
+    void op_done(timespec & tv_begin, uint64_t len);
+    void start_counters();
+    void stop_counters();
+    void print_results();
+};
+
+static uint64_t elapsed_us(const timespec & begin, const timespec & end)
+{
+    return (end.tv_sec - begin.tv_sec)*1000000 + (end.tv_nsec - begin.tv_nsec)/1000;
+}
+
+static int bind_local(int port)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    }
+    int enable = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0)
+    {
+        close(listen_fd);
+        throw std::runtime_error("bind to port "+std::to_string(port)+": "+strerror(errno));
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    return listen_fd;
+}
+
+void bench_t::parse_args(int narg, char *args[])
+{
+    json11::Json::object cfg;
+    std::string mode_str;
+    for (int i = 1; i < narg; i++)
+    {
+        if (args[i][0] == '-' && args[i][1] == '-' && i < narg-1)
+        {
+            char *opt = args[i]+2;
+            cfg[std::string(opt)] = std::string(args[++i]);
+        }
+        else if (mode_str == "")
+        {
+            mode_str = args[i];
+        }
+    }
+    mode = mode_str == "msgr" ? BENCH_MSGR : (mode_str == "secondary" ? BENCH_SECONDARY
+        : (mode_str == "blockstore" ? BENCH_BLOCKSTORE : 0));
+    if (!mode)
+    {
+        printf(
+            "USAGE: %s msgr|secondary|blockstore [--rw randread|randwrite|read|write] [--bs 4096] [--iodepth 32]\n"
+            "  [--conns 1] [--runtime 10] [--size 1073741824] [--sync_every 128] [--port 11300]\n"
+            "  [blockstore and messenger options]\n",
+            args[0]
+        );
+        exit(1);
+    }
+    std::string rw = cfg["rw"].string_value();
+    if (rw != "" && rw != "randread" && rw != "randwrite" && rw != "read" && rw != "write")
+        throw std::runtime_error("--rw must be one of randread, randwrite, read or write");
+    write = rw == "randwrite" || rw == "write";
+    random = rw == "" || rw == "randread" || rw == "randwrite";
+    if (cfg["bs"].string_value() != "")
+        bs = strtoull(cfg["bs"].string_value().c_str(), NULL, 10);
+    if (cfg["size"].string_value() != "")
+        size = strtoull(cfg["size"].string_value().c_str(), NULL, 10);
+    if (cfg["iodepth"].string_value() != "")
+        iodepth = strtoull(cfg["iodepth"].string_value().c_str(), NULL, 10);
+    if (cfg["conns"].string_value() != "")
+        conns = strtoull(cfg["conns"].string_value().c_str(), NULL, 10);
+    if (cfg["runtime"].string_value() != "")
+        runtime = strtoull(cfg["runtime"].string_value().c_str(), NULL, 10);
+    if (cfg["port"].string_value() != "")
+        port = strtoull(cfg["port"].string_value().c_str(), NULL, 10);
+    if (cfg["sync_every"].string_value() != "")
+        sync_every = strtoull(cfg["sync_every"].string_value().c_str(), NULL, 10);
+    if (!bs || bs % 512 || !iodepth || !conns || !runtime)
+        throw std::runtime_error("--bs must be a positive multiple of 512, --iodepth, --conns and --runtime must be positive");
+    if (cfg.find("use_rdma") == cfg.end())
+        cfg["use_rdma"] = false;
+    ringloop = new ring_loop_t(512);
+    epmgr = new epoll_manager_t(ringloop, cfg["use_uring_poll"] == "1" || cfg["use_uring_poll"] == "true");
+    if (mode != BENCH_MSGR)
+    {
+        blockstore_config_t bs_cfg;
+        for (auto & kv: cfg)
+        {
+            if (kv.second.is_string())
+                bs_cfg[kv.first] = kv.second.string_value();
+        }
+        bstore = new blockstore_t(bs_cfg, ringloop, epmgr->tfd);
+        while (!bstore->is_started())
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+        block_size = bstore->get_block_size();
+    }
+    else
+    {
+        block_size = 1 << DEFAULT_ORDER;
+    }
+    if (bs > block_size || block_size % bs)
+        throw std::runtime_error("--bs must divide the block size ("+std::to_string(block_size)+")");
+    if (size < block_size)
+        size = block_size;
+    if (mode != BENCH_BLOCKSTORE)
+    {
+        server = new osd_messenger_t();
+        server->osd_num = 1;
+        server->tfd = epmgr->tfd;
+        server->ringloop = ringloop;
+        server->repeer_pgs = [](osd_num_t) {};
+        server->exec_op = [this](osd_op_t *op) { server_exec_op(op); };
+        server->parse_config(cfg);
+        server->init();
+        // Both messengers share the ring, so only one of them may use provided buffers
+        cfg["use_multishot_recv"] = false;
+        client = new osd_messenger_t();
+        client->osd_num = 0;
+        client->tfd = epmgr->tfd;
+        client->ringloop = ringloop;
+        client->repeer_pgs = [](osd_num_t) {};
+        client->exec_op = [](osd_op_t *op) { delete op; };
+        client->parse_config(cfg);
+        client->init();
+    }
+    write_buf = memalign_or_die(MEM_ALIGNMENT, bs);
+    memset(write_buf, 0xAB, bs);
+    read_buf = memalign_or_die(MEM_ALIGNMENT, bs);
+}
+
+void bench_t::start_server()
+{
+    for (int i = 0; i < conns; i++)
+    {
+        int listen_fd = bind_local(port+i);
+        listen_fds.push_back(listen_fd);
+        epmgr->set_fd_handler(listen_fd, false, [this, listen_fd](int fd, int events)
+        {
+            server->accept_connections(listen_fd);
+        });
+    }
+}
+
+void bench_t::server_exec_op(osd_op_t *op)
+{
+    op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+    op->reply.hdr.id = op->req.hdr.id;
+    op->reply.hdr.opcode = op->req.hdr.opcode;
+    if (op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)
+    {
+        // Each connection goes to its own port and expects its own "OSD number"
+        sockaddr_in addr;
+        socklen_t addr_size = sizeof(addr);
+        getsockname(op->peer_fd, (sockaddr*)&addr, &addr_size);
+        std::string cfg_str = json11::Json(json11::Json::object {
+            { "osd_num", (uint64_t)(ntohs(addr.sin_port)-port+1) },
+            { "protocol_version", OSD_PROTOCOL_VERSION },
+        }).dump();
+        if (op->buf)
+            free(op->buf);
+        op->buf = malloc_or_die(cfg_str.size()+1);
+        memcpy(op->buf, cfg_str.c_str(), cfg_str.size()+1);
+        op->iov.push_back(op->buf, cfg_str.size()+1);
+        op->reply.hdr.retval = cfg_str.size()+1;
+    }
+    else if (op->req.hdr.opcode == OSD_OP_PING)
+    {
+        op->reply.hdr.retval = 0;
+    }
+    else if (mode == BENCH_SECONDARY && (op->req.hdr.opcode == OSD_OP_SEC_READ ||
+        op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE || op->req.hdr.opcode == OSD_OP_SEC_SYNC))
+    {
+        bool rd = op->req.hdr.opcode == OSD_OP_SEC_READ;
+        if (rd && op->req.sec_rw.len > 0)
+            op->buf = memalign_or_die(MEM_ALIGNMENT, op->req.sec_rw.len);
+        op->bs_op = new blockstore_op_t();
+        op->bs_op->opcode = rd ? BS_OP_READ : (op->req.hdr.opcode == OSD_OP_SEC_SYNC ? BS_OP_SYNC : BS_OP_WRITE_STABLE);
+        if (op->req.hdr.opcode != OSD_OP_SEC_SYNC)
+        {
+            op->bs_op->oid = op->req.sec_rw.oid;
+            op->bs_op->version = op->req.sec_rw.version;
+            op->bs_op->offset = op->req.sec_rw.offset;
+            op->bs_op->len = op->req.sec_rw.len;
+            op->bs_op->buf = op->buf;
+        }
+        op->bs_op->callback = [this, op](blockstore_op_t *bs_op)
+        {
+            op->reply.hdr.retval = bs_op->retval;
+            if (op->req.hdr.opcode == OSD_OP_SEC_READ || op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)
+                op->reply.sec_rw.version = bs_op->version;
+            if (op->req.hdr.opcode == OSD_OP_SEC_READ && bs_op->retval > 0)
+                op->iov.push_back(op->buf, bs_op->retval);
+            delete bs_op;
+            op->bs_op = NULL;
+            server->outbox_push(op);
+        };
+        bstore->enqueue_op(op->bs_op);
+        return;
+    }
+    else if (mode == BENCH_MSGR && op->req.hdr.opcode == OSD_OP_SEC_READ)
+    {
+        op->reply.hdr.retval = op->req.sec_rw.len;
+        op->iov.push_back(read_buf, op->req.sec_rw.len);
+    }
+    else if (mode == BENCH_MSGR && (op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE || op->req.hdr.opcode == OSD_OP_SEC_SYNC))
+    {
+        op->reply.hdr.retval = op->req.hdr.opcode == OSD_OP_SEC_SYNC ? 0 : op->req.sec_rw.len;
+    }
+    else
+    {
+        op->reply.hdr.retval = -EINVAL;
+    }
+    server->outbox_push(op);
+}
+
+void bench_t::connect_client()
+{
+    for (int i = 0; i < conns; i++)
+    {
+        client->connect_peer(i+1, json11::Json::object {
+            { "addresses", json11::Json::array { "127.0.0.1" } },
+            { "port", port+i },
+        });
+    }
+    timespec tv_wait, now;
+    clock_gettime(CLOCK_REALTIME, &tv_wait);
+    while (client->osd_peer_fds.size() < conns)
+    {
+        ringloop->loop();
+        ringloop->wait();
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (elapsed_us(tv_wait, now) > 10000000)
+            throw std::runtime_error("Failed to connect to the benchmark server");
+    }
+}
+
+void bench_t::submit()
+{
+    while (!stopping && inflight < iodepth && !syncs_inflight)
+    {
+        if (write && sync_every && mode != BENCH_MSGR && writes_since_sync >= sync_every)
+        {
+            // Writes are not flushed from the journal until they're synced
+            submit_sync();
+            break;
+        }
+        if (mode == BENCH_BLOCKSTORE)
+            submit_bs_op();
+        else
+            submit_msgr_op();
+    }
+}
+
+void bench_t::submit_sync()
+{
+    timespec tv_begin;
+    clock_gettime(CLOCK_REALTIME, &tv_begin);
+    writes_since_sync = 0;
+    if (mode == BENCH_BLOCKSTORE)
+    {
+        syncs_inflight++;
+        blockstore_op_t *op = new blockstore_op_t();
+        op->opcode = BS_OP_SYNC;
+        op->callback = [this](blockstore_op_t *op)
+        {
+            if (op->retval < 0)
+                throw std::runtime_error(std::string("sync failed: ")+strerror(-op->retval));
+            delete op;
+            syncs_inflight--;
+            sync_count++;
+            submit();
+        };
+        bstore->enqueue_op(op);
+        return;
+    }
+    for (auto & peer: client->osd_peer_fds)
+    {
+        syncs_inflight++;
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = peer.second;
+        op->req.sec_sync = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = client->next_subop_id++,
+                .opcode = OSD_OP_SEC_SYNC,
+            },
+        };
+        op->callback = [this](osd_op_t *op)
+        {
+            if (op->reply.hdr.retval < 0)
+                throw std::runtime_error(std::string("sync failed: ")+strerror(-op->reply.hdr.retval));
+            delete op;
+            syncs_inflight--;
+            if (!syncs_inflight)
+            {
+                sync_count++;
+                submit();
+            }
+        };
+        client->outbox_push(op);
+    }
+}
+
+static uint64_t next_offset(bench_t *b)
+{
+    uint64_t pos;
+    if (b->random)
+    {
+        pos = ((((uint64_t)lrand48()) << 31) | lrand48()) % (b->size / b->bs) * b->bs;
+    }
+    else
+    {
+        pos = b->seq_pos;
+        b->seq_pos = (b->seq_pos + b->bs) % (b->size / b->bs * b->bs);
+    }
+    return pos;
+}
+
+void bench_t::submit_msgr_op()
+{
+    uint64_t pos = next_offset(this);
+    auto peer_it = client->osd_peer_fds.find(1 + (next_conn++ % conns));
+    if (peer_it == client->osd_peer_fds.end())
+        throw std::runtime_error("Benchmark connection is closed");
+    osd_op_t *op = new osd_op_t();
+    op->op_type = OSD_OP_OUT;
+    op->peer_fd = peer_it->second;
+    op->req.sec_rw = {
+        .header = {
+            .magic = SECONDARY_OSD_OP_MAGIC,
+            .id = client->next_subop_id++,
+            .opcode = (uint64_t)(write ? OSD_OP_SEC_WRITE_STABLE : OSD_OP_SEC_READ),
+        },
+        .oid = {
+            .inode = 1,
+            .stripe = pos / block_size * block_size,
+        },
+        .version = write ? 0 : UINT64_MAX,
+        .offset = (uint32_t)(pos % block_size),
+        .len = (uint32_t)bs,
+    };
+    op->iov.push_back(write ? write_buf : read_buf, bs);
+    clock_gettime(CLOCK_REALTIME, &op->tv_begin);
+    op->callback = [this](osd_op_t *op)
+    {
+        if (op->reply.hdr.retval != bs)
+        {
+            throw std::runtime_error(
+                std::string(write ? "write" : "read")+" failed: retval = "+std::to_string(op->reply.hdr.retval)
+            );
+        }
+        op_done(op->tv_begin, bs);
+        delete op;
+    };
+    inflight++;
+    if (write)
+        writes_since_sync++;
+    client->outbox_push(op);
+}
+
+void bench_t::submit_bs_op()
+{
+    uint64_t pos = next_offset(this);
+    blockstore_op_t *op = new blockstore_op_t();
+    op->opcode = write ? BS_OP_WRITE_STABLE : BS_OP_READ;
+    op->oid = {
+        .inode = 1,
+        .stripe = pos / block_size * block_size,
+    };
+    op->version = write ? 0 : UINT64_MAX;
+    op->offset = pos % block_size;
+    op->len = bs;
+    op->buf = write ? write_buf : read_buf;
+    timespec *tv_begin = new timespec;
+    clock_gettime(CLOCK_REALTIME, tv_begin);
+    op->callback = [this, tv_begin](blockstore_op_t *op)
+    {
+        if (op->retval != bs)
+        {
+            throw std::runtime_error(
+                std::string(write ? "write" : "read")+" failed: retval = "+std::to_string(op->retval)
+            );
+        }
+        op_done(*tv_begin, bs);
+        delete tv_begin;
+        delete op;
+    };
+    inflight++;
+    if (write)
+        writes_since_sync++;
+    bstore->enqueue_op(op);
+}
+
+void bench_t::op_done(timespec & tv_begin, uint64_t len)
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t usec = elapsed_us(tv_begin, now);
+    inflight--;
+    if (stopping)
+    {
+        // Completed after the end of the measurement
+        return;
+    }
+    op_count++;
+    op_bytes += len;
+    lat_sum += usec;
+    hist.add(usec);
+    submit();
+}
+
+void bench_t::start_counters()
+{
+    // Count CPU cycles of the whole process if perf events are available
+    perf_event_attr attr = { 0 };
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (cycles_fd < 0)
+    {
+        attr.exclude_kernel = 1;
+        cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    clock_gettime(CLOCK_REALTIME, &tv_start);
+}
+
+void bench_t::stop_counters()
+{
+    clock_gettime(CLOCK_REALTIME, &tv_end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    if (cycles_fd >= 0)
+    {
+        if (read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles))
+            cycles = 0;
+        close(cycles_fd);
+        cycles_fd = -1;
+    }
+}
+
+void bench_t::run()
+{
+    if (server)
+    {
+        start_server();
+        connect_client();
+    }
+    consumer.loop = [this]()
+    {
+        if (client)
+        {
+            client->read_requests();
+            client->send_replies();
+        }
+        if (server)
+        {
+            server->read_requests();
+            server->send_replies();
+        }
+        ringloop->submit();
+    };
+    ringloop->register_consumer(&consumer);
+    epmgr->tfd->set_timer(runtime*1000, false, [this](int)
+    {
+        stopping = true;
+        stop_counters();
+    });
+    start_counters();
+    submit();
+    while (!stopping || inflight > 0 || syncs_inflight > 0)
+    {
+        ringloop->loop();
+        ringloop->wait();
+    }
+    ringloop->unregister_consumer(&consumer);
+    print_results();
+}
+
+void bench_t::print_results()
+{
+    uint64_t total_us = elapsed_us(tv_start, tv_end);
+    uint64_t cpu_ns = (cpu_end.tv_sec - cpu_start.tv_sec)*1000000000 + (cpu_end.tv_nsec - cpu_start.tv_nsec);
+    const char *mode_names[] = { "", "msgr", "secondary", "blockstore" };
+    printf(
+        "%s %s%s bs=%lu iodepth=%d%s: %lu iops, %.1f MB/s\n",
+        mode_names[mode], random ? "rand" : "", write ? "write" : "read", bs, iodepth,
+        mode == BENCH_BLOCKSTORE ? "" : (" conns="+std::to_string(conns)).c_str(),
+        total_us ? op_count*1000000/total_us : 0, total_us ? (double)op_bytes/total_us : 0.0
+    );
+    printf(
+        "  latency (us): avg=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu\n",
+        op_count ? lat_sum/op_count : 0, hist.percentile(op_count, 50), hist.percentile(op_count, 90),
+        hist.percentile(op_count, 99), hist.percentile(op_count, 99.9)
+    );
+    if (op_count)
+    {
+        if (cycles)
+            printf("  cpu: %lu ns/op, %lu cycles/op\n", cpu_ns/op_count, cycles/op_count);
+        else
+            printf("  cpu: %lu ns/op (cycle counter unavailable)\n", cpu_ns/op_count);
+    }
+    if (sync_count)
+        printf("  syncs: %lu\n", sync_count);
+}
+
+int main(int narg, char *args[])
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    setvbuf(stderr, NULL, _IONBF, 0);
+    bench_t *b = new bench_t();
+    try
+    {
+        b->parse_args(narg, args);
+        b->run();
+    }
+    catch (std::exception & e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -33,6 +33,11 @@ bool blockstore_t::is_safe_to_stop()
     return impl->is_safe_to_stop();
 }
 
+bool blockstore_t::has_checkpoint()
+{
+    return impl->has_checkpoint();
+}
+
 void blockstore_t::enqueue_op(blockstore_op_t *op)
 {
     impl->enqueue_op(op);
@@ -48,11 +53,31 @@ std::map<uint64_t, uint64_t> & blockstore_t::get_inode_space_stats()
     return impl->inode_space_stats;
 }
 
+std::map<uint64_t, std::pair<uint64_t, uint64_t>> & blockstore_t::get_inode_compr_stats()
+{
+    return impl->inode_compr_stats;
+}
+
+void blockstore_t::set_pool_compression(const std::map<uint64_t, int> & pool_compression)
+{
+    impl->set_pool_compression(pool_compression);
+}
+
 void blockstore_t::dump_diagnostics()
 {
     return impl->dump_diagnostics();
 }
 
+blockstore_flusher_stats_t blockstore_t::get_flusher_stats()
+{
+    return impl->get_flusher_stats();
+}
+
+blockstore_memory_stats_t blockstore_t::get_memory_stats()
+{
+    return impl->get_memory_stats();
+}
+
 uint32_t blockstore_t::get_block_size()
 {
     return impl->get_block_size();
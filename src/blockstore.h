@@ -44,6 +44,16 @@
 
 #define BS_OP_PRIVATE_DATA_SIZE 256
 
+#define BS_COMPRESS_NONE 0
+#define BS_COMPRESS_LZ4 1
+#define BS_COMPRESS_ZSTD 2
+
+// Priority classes of read, write and delete operations
+#define BS_PRIO_CLIENT 0
+#define BS_PRIO_RECOVERY 1
+#define BS_PRIO_SCRUB 2
+#define BS_PRIO_COUNT 3
+
 /*
 
 Blockstore opcode documentation:
@@ -124,6 +134,7 @@ Input:
 - offset = PG number
 - oid.inode = min inode number or 0 to list all inodes
 - version = max inode number or 0 to list all inodes
+- bitmap = NULL or blockstore_list_page_t* to only list a part of objects
 
 Output:
 - retval = total obj_ver_id count
@@ -131,15 +142,59 @@ Output:
 - buf = obj_ver_id array allocated by the blockstore. Stable versions come first.
   You must free it yourself after usage with free().
   Output includes all objects for which (((inode + stripe / <PG alignment>) % <PG count>) == <PG number>).
+- bitmap->next = object to continue listing from, or { 0, 0 } if all objects are listed
 
 */
 
+// BS_OP_LIST page. A page includes objects from <start> up to <max_count> clean objects
+// and <max_count> objects with unflushed versions, so it's at most 2*max_count objects
+struct blockstore_list_page_t
+{
+    object_id start;
+    uint64_t max_count;
+    object_id next;
+};
+
+struct blockstore_op_t;
+
+// Journal and flusher state for monitoring
+struct blockstore_flusher_stats_t
+{
+    uint64_t journal_used, journal_size;
+    uint64_t dirty_objects, flush_queue;
+    int active_flushers, target_flushers;
+    // Journal bytes per second freed at full speed, 0 if not measured yet
+    uint64_t flush_rate;
+};
+
+// Estimated memory usage of blockstore structures in bytes
+struct blockstore_memory_stats_t
+{
+    uint64_t clean_db, clean_bitmaps, metadata_buffer;
+    uint64_t dirty_db, unstable_writes, meta_sectors;
+    uint64_t journal_buffers, read_cache;
+};
+
+// Timings of a traced operation in microseconds, filled by the blockstore when it completes
+struct blockstore_op_trace_t
+{
+    // From enqueue_op() to the first submission attempt (includes priority class limits)
+    uint32_t queue_us;
+    // Waiting for free SQEs, journal space or buffers and free space on the data device
+    uint32_t wait_sqe_us, wait_journal_us, wait_free_us;
+    // From enqueue_op() to completion
+    uint32_t total_us;
+};
+
+// Finish callback, captures are stored inline in blockstore_op_t without heap allocation
+typedef small_function_t<void (blockstore_op_t*), 32> blockstore_op_callback_t;
+
 struct blockstore_op_t
 {
     // operation
     uint64_t opcode;
     // finish callback
-    std::function<void (blockstore_op_t*)> callback;
+    blockstore_op_callback_t callback;
     object_id oid;
     uint64_t version;
     uint32_t offset;
@@ -147,6 +202,10 @@ struct blockstore_op_t
     void *buf;
     void *bitmap;
     int retval;
+    // BS_PRIO_*, shares max_write_iodepth with other classes by weight
+    uint32_t priority;
+    // Timings are written here on completion if it's set, see blockstore_op_trace_t
+    blockstore_op_trace_t *trace = NULL;
 
     uint8_t private_data[BS_OP_PRIVATE_DATA_SIZE];
 };
@@ -177,6 +236,10 @@ public:
     // loop until it returns true.
     bool is_safe_to_stop();
 
+    // Returns true if the blockstore saves a metadata checkpoint when it's safe to stop,
+    // so it's worth waiting for is_safe_to_stop() before exiting
+    bool has_checkpoint();
+
     // Submission
     void enqueue_op(blockstore_op_t *op);
 
@@ -186,9 +249,21 @@ public:
     // Get per-inode space usage statistics
     std::map<uint64_t, uint64_t> & get_inode_space_stats();
 
+    // Get per-inode compression statistics: logical and stored bytes of compressed clean blocks
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> & get_inode_compr_stats();
+
+    // Set compression algorithms (BS_COMPRESS_*) for pools: { pool_id => algorithm }
+    void set_pool_compression(const std::map<uint64_t, int> & pool_compression);
+
     // Print diagnostics to stdout
     void dump_diagnostics();
 
+    // Get journal and flusher state
+    blockstore_flusher_stats_t get_flusher_stats();
+
+    // Get estimated memory usage
+    blockstore_memory_stats_t get_memory_stats();
+
     // FIXME rename to object_size
     uint32_t get_block_size();
     uint64_t get_block_count();
@@ -0,0 +1,198 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/mman.h>
+#include "blockstore_impl.h"
+
+// clean_db checkpoint is a copy of clean_db saved on a clean shutdown.
+// It's only valid while the journal superblock contains the same generation number:
+// the generation is changed on every start before the metadata area may be modified
+// (see blockstore_init_journal), so a checkpoint can't be loaded after the metadata
+// has been changed by a later run.
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t r = write(fd, buf, len);
+        if (r < 0 && errno != EINTR)
+            return false;
+        if (r > 0)
+        {
+            buf = (const uint8_t*)buf + r;
+            len -= r;
+        }
+    }
+    return true;
+}
+
+bool blockstore_impl_t::load_checkpoint()
+{
+    if (checkpoint_path == "")
+    {
+        return false;
+    }
+    // Read the checkpoint generation from the journal superblock
+    uint32_t generation = 0;
+    uint64_t journal_start = 0;
+    void *sb = memalign_or_die(MEM_ALIGNMENT, journal.block_size);
+    if (journal.dax_maps.size())
+    {
+        // DAX devices may not support read()
+        memcpy(sb, (uint8_t*)journal.dax_maps[0].addr + journal.offset, journal.block_size);
+    }
+    if (journal.dax_maps.size() || pread(journal.fd, sb, journal.block_size, journal.offset) == journal.block_size)
+    {
+        journal_entry_start *je_start = (journal_entry_start*)sb;
+        if (je_start->magic == JOURNAL_MAGIC &&
+            je_start->type == JE_START &&
+            je_start->size == sizeof(journal_entry_start) &&
+            je_crc32((journal_entry*)je_start) == je_start->crc32)
+        {
+            generation = je_start->generation;
+            journal_start = je_start->journal_start;
+        }
+    }
+    free(sb);
+    int fd = open(checkpoint_path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            printf("Failed to open clean_db checkpoint %s: %s\n", checkpoint_path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(clean_db_checkpoint_header_t))
+    {
+        printf("clean_db checkpoint %s is corrupt, scanning metadata\n", checkpoint_path.c_str());
+        close(fd);
+        return false;
+    }
+    void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        printf("Failed to mmap clean_db checkpoint %s: %s\n", checkpoint_path.c_str(), strerror(errno));
+        return false;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    clean_db_checkpoint_header_t *hdr = (clean_db_checkpoint_header_t*)buf;
+    clean_db_checkpoint_entry_t *entries = (clean_db_checkpoint_entry_t*)(hdr+1);
+    uint64_t bitmap_len = inmemory_meta ? 0 : block_count * clean_dyn_size;
+    const char *err = NULL;
+    if (hdr->magic != CLEAN_DB_CHECKPOINT_MAGIC ||
+        hdr->version != CLEAN_DB_CHECKPOINT_VERSION ||
+        crc32c(0, hdr, sizeof(clean_db_checkpoint_header_t)-4) != hdr->header_crc32)
+        err = "is corrupt";
+    else if (!generation || hdr->generation != generation || hdr->journal_start != journal_start)
+        err = "is stale";
+    else if (hdr->data_block_size != block_size ||
+        hdr->block_count != block_count ||
+        hdr->meta_len != meta_len ||
+        hdr->clean_entry_bitmap_size != clean_entry_bitmap_size ||
+        hdr->bitmap_len != bitmap_len)
+        err = "doesn't match OSD configuration";
+    else if (st.st_size != sizeof(clean_db_checkpoint_header_t) + hdr->entry_count*sizeof(clean_db_checkpoint_entry_t) + bitmap_len ||
+        crc32c(0, entries, st.st_size - sizeof(clean_db_checkpoint_header_t)) != hdr->data_crc32)
+        err = "is corrupt";
+    if (err)
+    {
+        printf("clean_db checkpoint %s %s, scanning metadata\n", checkpoint_path.c_str(), err);
+        munmap(buf, st.st_size);
+        return false;
+    }
+    // Entries are saved in clean_db order, so every insert goes to the end
+    for (uint64_t i = 0; i < hdr->entry_count; i++)
+    {
+        clean_db.set(entries[i].oid, (struct clean_entry){
+            .version = entries[i].version,
+            .location = entries[i].location,
+        });
+        data_alloc->set(entries[i].location >> block_order, true);
+        inode_space_stats[entries[i].oid.inode] += block_size;
+    }
+    if (bitmap_len)
+    {
+        memcpy(clean_bitmap, entries + hdr->entry_count, bitmap_len);
+    }
+    printf("Metadata entries loaded from checkpoint: %lu, free blocks: %lu / %lu\n",
+        hdr->entry_count, data_alloc->get_free_count(), block_count);
+    munmap(buf, st.st_size);
+    checkpoint_loaded = true;
+    return true;
+}
+
+void blockstore_impl_t::save_checkpoint()
+{
+    checkpoint_saved = true;
+    if (!journal.generation)
+    {
+        return;
+    }
+    std::string tmp_path = checkpoint_path+".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        printf("Failed to save clean_db checkpoint to %s: %s\n", tmp_path.c_str(), strerror(errno));
+        return;
+    }
+    clean_db_checkpoint_header_t hdr = {
+        .magic = CLEAN_DB_CHECKPOINT_MAGIC,
+        .version = CLEAN_DB_CHECKPOINT_VERSION,
+        .generation = journal.generation,
+        .journal_start = journal.used_start,
+        .data_block_size = block_size,
+        .block_count = block_count,
+        .meta_len = meta_len,
+        .clean_entry_bitmap_size = clean_entry_bitmap_size,
+        .entry_count = clean_db.size(),
+        .bitmap_len = inmemory_meta ? 0 : block_count * clean_dyn_size,
+        .data_crc32 = 0,
+        .header_crc32 = 0,
+    };
+    bool ok = write_all(fd, &hdr, sizeof(hdr));
+    std::vector<clean_db_checkpoint_entry_t> chunk;
+    chunk.reserve(65536);
+    auto flush_chunk = [&]()
+    {
+        hdr.data_crc32 = crc32c(hdr.data_crc32, chunk.data(), chunk.size()*sizeof(clean_db_checkpoint_entry_t));
+        ok = ok && write_all(fd, chunk.data(), chunk.size()*sizeof(clean_db_checkpoint_entry_t));
+        chunk.clear();
+    };
+    clean_db.for_each([&](const object_id & oid, const clean_entry & clean)
+    {
+        chunk.push_back((clean_db_checkpoint_entry_t){
+            .oid = oid,
+            .version = clean.version,
+            .location = clean.location,
+        });
+        if (chunk.size() >= 65536)
+            flush_chunk();
+    });
+    flush_chunk();
+    if (ok && hdr.bitmap_len)
+    {
+        hdr.data_crc32 = crc32c(hdr.data_crc32, clean_bitmap, hdr.bitmap_len);
+        ok = write_all(fd, clean_bitmap, hdr.bitmap_len);
+    }
+    hdr.header_crc32 = crc32c(0, &hdr, sizeof(hdr)-4);
+    ok = ok && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path.c_str(), checkpoint_path.c_str()) < 0)
+    {
+        printf("Failed to save clean_db checkpoint to %s: %s\n", tmp_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return;
+    }
+    printf("clean_db checkpoint saved: %lu entries\n", hdr.entry_count);
+}
+
+void blockstore_impl_t::invalidate_checkpoint()
+{
+    checkpoint_saved = false;
+    if (unlink(checkpoint_path.c_str()) < 0 && errno != ENOENT)
+    {
+        throw std::runtime_error("Failed to remove stale clean_db checkpoint "+checkpoint_path+": "+strerror(errno));
+    }
+}
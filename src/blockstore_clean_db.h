@@ -0,0 +1,201 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+// Clean object index (object_id => clean_entry) with two selectable representations:
+// - "full" (default): btree_map<object_id, clean_entry>, 32 bytes per object plus tree overhead.
+// - "compact": objects are grouped into segments of 2^32 stripe bytes of the same inode,
+//   and every segment is a btree_map keyed by the lower 32 bits of the stripe, storing only
+//   the version and the data block number. That's 16 bytes per object, so it takes about
+//   2 times less memory. Requires less than 2^32 data blocks.
+
+struct __attribute__((__packed__)) clean_compact_entry_t
+{
+    uint64_t version;
+    uint32_t block;
+};
+
+typedef btree::btree_map<uint32_t, clean_compact_entry_t> clean_segment_t;
+
+class blockstore_clean_db_t
+{
+    bool compact = false;
+    uint32_t block_order = 0;
+    uint64_t count = 0;
+    btree::btree_map<object_id, clean_entry> full;
+    // Segment key is the object ID with the lower 32 bits of the stripe cleared
+    std::map<object_id, clean_segment_t> segments;
+    // Consecutive lookups usually hit the same segment
+    std::map<object_id, clean_segment_t>::iterator last_seg = segments.end();
+
+    static inline object_id segment_key(const object_id & oid)
+    {
+        return (object_id){ .inode = oid.inode, .stripe = oid.stripe & ~(uint64_t)0xFFFFFFFF };
+    }
+
+    inline clean_segment_t *find_segment(const object_id & oid, bool create)
+    {
+        object_id key = segment_key(oid);
+        if (last_seg != segments.end() && last_seg->first == key)
+            return &last_seg->second;
+        auto seg_it = segments.find(key);
+        if (seg_it == segments.end())
+        {
+            if (!create)
+                return NULL;
+            seg_it = segments.emplace(key, clean_segment_t()).first;
+        }
+        last_seg = seg_it;
+        return &seg_it->second;
+    }
+
+public:
+    void init(bool compact, uint32_t block_order)
+    {
+        this->compact = compact;
+        this->block_order = block_order;
+    }
+
+    inline bool is_compact()
+    {
+        return compact;
+    }
+
+    inline uint64_t size()
+    {
+        return compact ? count : full.size();
+    }
+
+    inline bool get(const object_id & oid, clean_entry *entry)
+    {
+        if (!compact)
+        {
+            auto clean_it = full.find(oid);
+            if (clean_it == full.end())
+                return false;
+            *entry = clean_it->second;
+            return true;
+        }
+        clean_segment_t *seg = find_segment(oid, false);
+        if (!seg)
+            return false;
+        auto clean_it = seg->find((uint32_t)oid.stripe);
+        if (clean_it == seg->end())
+            return false;
+        *entry = (clean_entry){
+            .version = clean_it->second.version,
+            .location = (uint64_t)clean_it->second.block << block_order,
+        };
+        return true;
+    }
+
+    inline bool exists(const object_id & oid)
+    {
+        clean_entry entry;
+        return get(oid, &entry);
+    }
+
+    inline void set(const object_id & oid, const clean_entry & entry)
+    {
+        if (!compact)
+        {
+            // Fast path for inserts in the object ID order (checkpoint load)
+            if (!full.size() || full.rbegin()->first < oid)
+                full.insert(full.end(), std::make_pair(oid, entry));
+            else
+                full[oid] = entry;
+            return;
+        }
+        clean_segment_t *seg = find_segment(oid, true);
+        auto ins = seg->insert(std::make_pair((uint32_t)oid.stripe, (clean_compact_entry_t){
+            .version = entry.version,
+            .block = (uint32_t)(entry.location >> block_order),
+        }));
+        if (ins.second)
+            count++;
+        else
+        {
+            ins.first->second = (clean_compact_entry_t){
+                .version = entry.version,
+                .block = (uint32_t)(entry.location >> block_order),
+            };
+        }
+    }
+
+    inline void erase(const object_id & oid)
+    {
+        if (!compact)
+        {
+            full.erase(oid);
+            return;
+        }
+        clean_segment_t *seg = find_segment(oid, false);
+        if (seg && seg->erase((uint32_t)oid.stripe))
+        {
+            count--;
+            if (!seg->size())
+            {
+                segments.erase(last_seg);
+                last_seg = segments.end();
+            }
+        }
+    }
+
+    // Calls cb(oid, entry) for objects from <min_oid> to <max_oid> inclusive, in object ID order,
+    // until it returns false
+    template<class F> void for_each_while(const object_id & min_oid, const object_id & max_oid, F cb)
+    {
+        if (!compact)
+        {
+            for (auto clean_it = full.lower_bound(min_oid); clean_it != full.end() && !(max_oid < clean_it->first); clean_it++)
+                if (!cb(clean_it->first, clean_it->second))
+                    return;
+            return;
+        }
+        auto seg_it = segments.lower_bound(segment_key(min_oid));
+        for (; seg_it != segments.end() && !(max_oid < seg_it->first); seg_it++)
+        {
+            auto clean_it = seg_it->first == segment_key(min_oid)
+                ? seg_it->second.lower_bound((uint32_t)min_oid.stripe) : seg_it->second.begin();
+            for (; clean_it != seg_it->second.end(); clean_it++)
+            {
+                object_id oid = { .inode = seg_it->first.inode, .stripe = seg_it->first.stripe | clean_it->first };
+                if (max_oid < oid)
+                    return;
+                if (!cb(oid, (clean_entry){
+                    .version = clean_it->second.version,
+                    .location = (uint64_t)clean_it->second.block << block_order,
+                }))
+                    return;
+            }
+        }
+    }
+
+    // Calls cb(oid, entry) for all objects from <min_oid> to <max_oid> inclusive, in object ID order
+    template<class F> void for_each(const object_id & min_oid, const object_id & max_oid, F cb)
+    {
+        for_each_while(min_oid, max_oid, [&](const object_id & oid, const clean_entry & entry)
+        {
+            cb(oid, entry);
+            return true;
+        });
+    }
+
+    template<class F> void for_each(F cb)
+    {
+        for_each((object_id){ 0, 0 }, (object_id){ UINT64_MAX, UINT64_MAX }, cb);
+    }
+
+    // Approximate memory used by the index
+    uint64_t bytes_used()
+    {
+        if (!compact)
+            return full.bytes_used();
+        // std::map node is ~32 bytes of tree pointers plus the key and the value
+        uint64_t total = segments.size() * (32 + sizeof(object_id) + sizeof(clean_segment_t));
+        for (auto & seg: segments)
+            total += seg.second.bytes_used();
+        return total;
+    }
+};
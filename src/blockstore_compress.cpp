@@ -0,0 +1,79 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "blockstore.h"
+#include "blockstore_compress.h"
+
+// Fast levels: blocks are compressed in the event loop
+#define BS_ZSTD_LEVEL 1
+
+bs_compress_ctx_t::~bs_compress_ctx_t()
+{
+#ifdef WITH_ZSTD
+    if (zstd_cctx)
+        ZSTD_freeCCtx((ZSTD_CCtx*)zstd_cctx);
+    if (zstd_dctx)
+        ZSTD_freeDCtx((ZSTD_DCtx*)zstd_dctx);
+#endif
+}
+
+bool bs_compression_supported(int algo)
+{
+#ifdef WITH_LZ4
+    if (algo == BS_COMPRESS_LZ4)
+        return true;
+#endif
+#ifdef WITH_ZSTD
+    if (algo == BS_COMPRESS_ZSTD)
+        return true;
+#endif
+    return algo == BS_COMPRESS_NONE;
+}
+
+uint32_t bs_compress(bs_compress_ctx_t *ctx, int algo, const void *src, uint32_t src_len, void *dst, uint32_t dst_size)
+{
+#ifdef WITH_LZ4
+    if (algo == BS_COMPRESS_LZ4)
+    {
+        int r = LZ4_compress_default((const char*)src, (char*)dst, src_len, dst_size);
+        return r > 0 ? r : 0;
+    }
+#endif
+#ifdef WITH_ZSTD
+    if (algo == BS_COMPRESS_ZSTD)
+    {
+        if (!ctx->zstd_cctx)
+            ctx->zstd_cctx = ZSTD_createCCtx();
+        size_t r = ZSTD_compressCCtx((ZSTD_CCtx*)ctx->zstd_cctx, dst, dst_size, src, src_len, BS_ZSTD_LEVEL);
+        return ZSTD_isError(r) ? 0 : r;
+    }
+#endif
+    return 0;
+}
+
+bool bs_decompress(bs_compress_ctx_t *ctx, int algo, const void *src, uint32_t src_len, void *dst, uint32_t dst_len)
+{
+#ifdef WITH_LZ4
+    if (algo == BS_COMPRESS_LZ4)
+    {
+        return LZ4_decompress_safe((const char*)src, (char*)dst, src_len, dst_len) == dst_len;
+    }
+#endif
+#ifdef WITH_ZSTD
+    if (algo == BS_COMPRESS_ZSTD)
+    {
+        if (!ctx->zstd_dctx)
+            ctx->zstd_dctx = ZSTD_createDCtx();
+        size_t r = ZSTD_decompressDCtx((ZSTD_DCtx*)ctx->zstd_dctx, dst, dst_len, src, src_len);
+        return !ZSTD_isError(r) && r == dst_len;
+    }
+#endif
+    return false;
+}
@@ -0,0 +1,27 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+
+// Compression algorithms of data blocks, BS_COMPRESS_* (see blockstore.h)
+
+// Compression contexts reused between calls, created on first use. Each blockstore owns
+// its own contexts, so they're never shared between threads
+struct bs_compress_ctx_t
+{
+    void *zstd_cctx = NULL;
+    void *zstd_dctx = NULL;
+    ~bs_compress_ctx_t();
+};
+
+// Returns true if the algorithm is supported by this build
+bool bs_compression_supported(int algo);
+
+// Compress <src_len> bytes into at most <dst_size> bytes of <dst>.
+// Returns the compressed length or 0 if the data doesn't fit or the algorithm isn't supported
+uint32_t bs_compress(bs_compress_ctx_t *ctx, int algo, const void *src, uint32_t src_len, void *dst, uint32_t dst_size);
+
+// Decompress <src_len> bytes of <src>. Returns false unless they decompress into exactly <dst_len> bytes
+bool bs_decompress(bs_compress_ctx_t *ctx, int algo, const void *src, uint32_t src_len, void *dst, uint32_t dst_len);
@@ -0,0 +1,208 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <linux/falloc.h>
+#include "blockstore_impl.h"
+
+// Background discard of freed data blocks (discard_on_free). Blocks are only freed after
+// the metadata not referencing them anymore is fsynced, so discarding them is safe even
+// if the OSD crashes. Blocks being discarded are marked as used in the allocator so that
+// new writes don't get them until the discard completes
+
+static uint64_t discard_monotonic_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000ul + now.tv_nsec/1000;
+}
+
+void blockstore_impl_t::queue_discard(uint64_t block_num)
+{
+    if (discard_on_free)
+    {
+        discard_queue.insert(block_num);
+    }
+}
+
+void blockstore_impl_t::submit_discards()
+{
+    if (!discard_queue.size() || discard_in_flight > 0)
+    {
+        return;
+    }
+    uint64_t now_us = discard_monotonic_us();
+    if (now_us < discard_next_us)
+    {
+        if (!discard_timer_id)
+        {
+            discard_timer_id = tfd->set_timer_us(discard_next_us-now_us, false, [this](int timer_id)
+            {
+                discard_timer_id = 0;
+                ringloop->wakeup();
+            });
+        }
+        return;
+    }
+    // Discards have the lowest priority: they only take SQEs left free by other operations
+    int max_requests = ringloop->space_left() / 2;
+    if (max_requests <= 0)
+    {
+        return;
+    }
+    uint64_t max_blocks = discard_max_rate
+        ? ((discard_max_rate * discard_interval_ms / 1000) >> block_order) : UINT64_MAX;
+    if (!max_blocks)
+    {
+        max_blocks = 1;
+    }
+    // Coalesce adjacent blocks still free into ranges, the rest of the queue waits for the next batch
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    uint64_t blocks = 0;
+    auto it = discard_queue.begin();
+    for (; it != discard_queue.end() && blocks < max_blocks; it++)
+    {
+        uint64_t block_num = *it;
+        if (data_alloc->get(block_num))
+        {
+            // Already reused
+            continue;
+        }
+        if (ranges.size() && ranges.back().first + ranges.back().second == block_num)
+        {
+            ranges.back().second++;
+        }
+        else if (ranges.size() < (uint64_t)max_requests)
+        {
+            ranges.push_back({ block_num, 1 });
+        }
+        else
+        {
+            break;
+        }
+        blocks++;
+    }
+    discard_queue.erase(discard_queue.begin(), it);
+    for (auto & r: ranges)
+    {
+        for (uint64_t b = r.first; b < r.first+r.second; b++)
+        {
+            data_alloc->set(b, true);
+        }
+        uint64_t start = r.first, count = r.second;
+        discard_in_flight++;
+        if (data_blkdev && !data_uring_discard)
+        {
+            // The ioctl blocks, but the rate is limited and the device only has to drop the mapping
+            uint64_t range[2] = { data_offset + (start << block_order), count << block_order };
+            handle_discard_event(ioctl(data_fd, BLKDISCARD, range) < 0 ? -errno : 0, start, count, false);
+            continue;
+        }
+        io_uring_sqe *sqe = get_sqe();
+        ring_data_t *data = ((ring_data_t*)sqe->user_data);
+        data->iov = { 0 };
+        bool uring_discard = data_blkdev && data_uring_discard;
+        data->callback = [this, start, count, uring_discard](ring_data_t *data)
+        {
+            handle_discard_event(data->res, start, count, uring_discard);
+        };
+        prep_data_discard(sqe, data_offset + (start << block_order), count << block_order);
+    }
+    discard_next_us = now_us + discard_interval_ms*1000;
+}
+
+// Block devices are discarded with BLKDISCARD: punching a hole in a block device zeroes the range
+// (REQ_OP_WRITE_ZEROES) which is slower and doesn't have to deallocate anything. Files are punched
+void blockstore_impl_t::prep_data_discard(io_uring_sqe *sqe, uint64_t offset, uint64_t len)
+{
+#ifdef WITH_URING_DISCARD
+    if (data_blkdev && data_uring_discard)
+    {
+        ringloop->prep_discard(sqe, data_fd, offset, len);
+        return;
+    }
+#endif
+    ringloop->prep_fallocate(sqe, data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+// Punch the whole data block of a new small object, only the data written after it takes disk space then
+void blockstore_impl_t::prep_small_object_punch(io_uring_sqe *sqe, uint64_t block_num)
+{
+#ifdef IOSQE_IO_HARDLINK
+    ring_data_t *data = ((ring_data_t*)sqe->user_data);
+    data->iov = { 0 };
+    bool uring_discard = data_blkdev && data_uring_discard;
+    data->callback = [this, uring_discard](ring_data_t *data)
+    {
+        discard_in_flight--;
+        if ((data->res == -EOPNOTSUPP || data->res == -EINVAL) && uring_discard)
+        {
+            if (data_uring_discard)
+            {
+                printf("Kernel doesn't support io_uring discard (%s), using fallocate for small objects and ioctl for discard_on_free\n",
+                    strerror(-data->res));
+                data_uring_discard = false;
+            }
+        }
+        else if (data->res == -EOPNOTSUPP || data->res == -EINVAL)
+        {
+            if (small_object_size)
+            {
+                printf("Data device doesn't support discard (%s), disabling small_object_size\n", strerror(-data->res));
+                small_object_size = 0;
+            }
+        }
+        else if (data->res < 0)
+            discard_errors++;
+        else
+        {
+            discard_requests++;
+            discarded_bytes += block_size;
+        }
+    };
+    prep_data_discard(sqe, data_offset + (block_num << block_order), block_size);
+    sqe->flags |= IOSQE_IO_HARDLINK;
+    discard_in_flight++;
+#endif
+}
+
+void blockstore_impl_t::handle_discard_event(int res, uint64_t start, uint64_t count, bool uring_discard)
+{
+    live = true;
+    discard_in_flight--;
+    for (uint64_t b = start; b < start+count; b++)
+    {
+        data_alloc->set(b, false);
+    }
+    if ((res == -EOPNOTSUPP || res == -EINVAL) && uring_discard)
+    {
+        // Retry these blocks with the ioctl
+        if (data_uring_discard)
+        {
+            printf("Kernel doesn't support io_uring discard (%s), using BLKDISCARD ioctl\n", strerror(-res));
+            data_uring_discard = false;
+        }
+        for (uint64_t b = start; b < start+count; b++)
+        {
+            discard_queue.insert(b);
+        }
+    }
+    else if (res == -EOPNOTSUPP || res == -EINVAL)
+    {
+        if (discard_on_free)
+        {
+            printf("Data device doesn't support discard (%s), disabling discard_on_free\n", strerror(-res));
+            discard_on_free = false;
+        }
+        discard_queue.clear();
+    }
+    else if (res < 0)
+    {
+        discard_errors++;
+    }
+    else
+    {
+        discard_requests++;
+        discarded_bytes += count << block_order;
+    }
+    ringloop->wakeup();
+}
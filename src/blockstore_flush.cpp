@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "blockstore_impl.h"
+#include "blockstore_compress.h"
 
 journal_flusher_t::journal_flusher_t(blockstore_impl_t *bs)
 {
@@ -55,6 +56,20 @@ journal_flusher_co::journal_flusher_co()
         }
         wait_count--;
     };
+    data_callback_w = [this](ring_data_t* data)
+    {
+        simple_callback_w(data);
+        data_writes_left--;
+        if (!data_writes_left)
+        {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            flusher->add_data_write_latency(
+                (now.tv_sec - data_write_start.tv_sec)*1000000 +
+                (now.tv_nsec - data_write_start.tv_nsec)/1000
+            );
+        }
+    };
 }
 
 journal_flusher_t::~journal_flusher_t()
@@ -69,13 +84,86 @@ bool journal_flusher_t::is_active()
     return active_flushers > 0 || dequeuing;
 }
 
-void journal_flusher_t::loop()
+// Choose the number of flushers from the journal fill level, flush queue length and data write latency.
+// Flushing is kept slow while the journal is mostly empty so that it doesn't compete with
+// foreground writes for the data device, and is sped up as the journal fills.
+void journal_flusher_t::update_target_count()
 {
-    target_flusher_count = bs->write_iodepth*2;
+    uint64_t used = bs->journal.next_free >= bs->journal.used_start
+        ? bs->journal.next_free - bs->journal.used_start
+        : bs->journal.len - bs->journal.used_start + bs->journal.next_free - bs->journal.block_size;
+    journal_fill = used*100 / bs->journal.len;
+    if (trim_wanted > 0 || bs->journal.flush_journal || journal_fill >= bs->flusher_fill_high)
+    {
+        // Writes are waiting for journal space, flush at full speed
+        target_flusher_count = max_flusher_count;
+        target_reason = "full";
+        return;
+    }
+    if (journal_fill <= bs->flusher_fill_low)
+    {
+        target_flusher_count = min_flusher_count;
+        target_reason = "min";
+    }
+    else
+    {
+        // Scale linearly between the low and the high fill levels
+        target_flusher_count = min_flusher_count + (max_flusher_count-min_flusher_count) *
+            (journal_fill-bs->flusher_fill_low) / (bs->flusher_fill_high-bs->flusher_fill_low);
+        target_reason = "fill";
+    }
+    // There's no sense in running more flushers than there are objects to flush
+    if (target_flusher_count > flush_queue.size())
+    {
+        target_flusher_count = flush_queue.size();
+        target_reason = "queue";
+    }
+    // Back off when the data device is overloaded
+    if (bs->flusher_target_latency_us && data_write_lat_us > bs->flusher_target_latency_us)
+    {
+        int lat_target = (uint64_t)cur_flusher_count * bs->flusher_target_latency_us / data_write_lat_us;
+        if (target_flusher_count > lat_target)
+        {
+            target_flusher_count = lat_target;
+            target_reason = "latency";
+        }
+    }
     if (target_flusher_count < min_flusher_count)
         target_flusher_count = min_flusher_count;
-    else if (target_flusher_count > max_flusher_count)
-        target_flusher_count = max_flusher_count;
+}
+
+void journal_flusher_t::add_data_write_latency(uint64_t usec)
+{
+    // Exponential moving average with 1/8 weight of the new value
+    data_write_lat_us = data_write_lat_us ? (data_write_lat_us*7 + usec) / 8 : usec;
+}
+
+static uint64_t flush_now_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+// Measure the rate at which flushers free journal space, used by throttle_small_writes=auto.
+// Only time when flushers are running at full speed is measured, otherwise the rate would show
+// the slow background flushing or idle time instead of what the data device can actually do
+void journal_flusher_t::update_flush_busy()
+{
+    bool busy = active_flushers > 0 && !strcmp(target_reason, "full");
+    if (busy != flush_rate.busy)
+        flush_rate.set_busy(busy, flush_now_us());
+}
+
+void journal_flusher_t::add_flushed_journal(uint64_t bytes)
+{
+    if (flush_rate.busy)
+        flush_rate.add(bytes, flush_now_us());
+}
+
+void journal_flusher_t::loop()
+{
+    update_target_count();
     if (target_flusher_count > cur_flusher_count)
         cur_flusher_count = target_flusher_count;
     else if (target_flusher_count < cur_flusher_count)
@@ -87,8 +175,158 @@ void journal_flusher_t::loop()
             cur_flusher_count--;
         }
     }
+    update_flush_busy();
     for (int i = 0; (active_flushers > 0 || dequeuing) && i < cur_flusher_count; i++)
         co[i].loop();
+    update_flush_busy();
+    submit_meta_writes();
+}
+
+// Data device location the queued object will be flushed to, UINT64_MAX if unknown
+uint64_t journal_flusher_t::flush_target_loc(object_id oid)
+{
+    auto dirty_it = bs->dirty_db.find((obj_ver_id){ .oid = oid, .version = flush_versions[oid] });
+    if (dirty_it == bs->dirty_db.end())
+    {
+        return UINT64_MAX;
+    }
+    // The latest big write redirects the object to a new location
+    while (1)
+    {
+        if (IS_BIG_WRITE(dirty_it->second.state))
+            return dirty_it->second.location;
+        if (IS_DELETE(dirty_it->second.state) || dirty_it == bs->dirty_db.begin())
+            break;
+        dirty_it--;
+        if (dirty_it->first.oid != oid)
+            break;
+    }
+    clean_entry clean;
+    return bs->clean_db.get(oid, &clean) ? clean.location : UINT64_MAX;
+}
+
+// Move the object nearest to the last flushed location (in the ascending direction) among the
+// first <flusher_sort_window> queued objects to the front of the queue, like an elevator does.
+// The queue head is taken as is after <flusher_sort_window> skips so that it isn't starved.
+void journal_flusher_t::pick_nearest_flush()
+{
+    if (sort_skips >= bs->flusher_sort_window)
+    {
+        sort_skips = 0;
+        last_flush_loc = flush_target_loc(flush_queue.front());
+        return;
+    }
+    int window = flush_queue.size() < bs->flusher_sort_window ? flush_queue.size() : bs->flusher_sort_window;
+    int best = -1, lowest = 0;
+    uint64_t best_loc = UINT64_MAX, lowest_loc = UINT64_MAX;
+    for (int i = 0; i < window; i++)
+    {
+        uint64_t loc = flush_target_loc(flush_queue[i]);
+        if (loc >= last_flush_loc && (best < 0 || loc < best_loc))
+        {
+            best = i;
+            best_loc = loc;
+        }
+        if (loc < lowest_loc)
+        {
+            lowest = i;
+            lowest_loc = loc;
+        }
+    }
+    if (best < 0 || best_loc == UINT64_MAX)
+    {
+        // Reached the end of the device, start over from the lowest location
+        best = lowest;
+        best_loc = lowest_loc;
+    }
+    if (best > 0)
+    {
+        std::swap(flush_queue[0], flush_queue[best]);
+        sort_skips++;
+    }
+    else
+        sort_skips = 0;
+    last_flush_loc = best_loc;
+}
+
+void journal_flusher_t::queue_meta_write(flusher_meta_write_t & wr)
+{
+    wr.write_it = meta_writes.find(wr.sector);
+    if (wr.write_it == meta_writes.end())
+    {
+        wr.write_it = meta_writes.emplace(wr.sector, (meta_sector_write_t){
+            .buf = wr.buf,
+            .mod_seq = 0,
+            .written_seq = 0,
+            .waiters = 0,
+            .queued = false,
+            .writing = false,
+        }).first;
+    }
+    auto & mw = wr.write_it->second;
+    wr.write_seq = ++mw.mod_seq;
+    mw.waiters++;
+    if (!mw.queued)
+    {
+        mw.queued = true;
+        meta_write_queue.push_back(wr.write_it);
+    }
+    meta_write_requests++;
+}
+
+bool journal_flusher_t::meta_write_done(flusher_meta_write_t & wr)
+{
+    return wr.write_it->second.written_seq >= wr.write_seq;
+}
+
+void journal_flusher_t::release_meta_write(flusher_meta_write_t & wr)
+{
+    auto & mw = wr.write_it->second;
+    mw.waiters--;
+    if (!mw.waiters && !mw.queued && !mw.writing)
+    {
+        meta_writes.erase(wr.write_it);
+    }
+}
+
+void journal_flusher_t::submit_meta_writes()
+{
+    int j = 0;
+    for (int i = 0; i < meta_write_queue.size(); i++)
+    {
+        auto write_it = meta_write_queue[i];
+        // Only one write of a sector may be in flight, otherwise an older one may overwrite a newer one
+        io_uring_sqe *sqe = write_it->second.writing ? NULL : bs->get_sqe();
+        if (!sqe)
+        {
+            meta_write_queue[j++] = write_it;
+            continue;
+        }
+        ring_data_t *data = ((ring_data_t*)sqe->user_data);
+        uint64_t seq = write_it->second.mod_seq;
+        write_it->second.queued = false;
+        write_it->second.writing = true;
+        data->iov = (struct iovec){ write_it->second.buf, bs->meta_block_size };
+        data->callback = [this, write_it, seq](ring_data_t *data)
+        {
+            bs->live = true;
+            if (data->res != data->iov.iov_len)
+            {
+                throw std::runtime_error(
+                    "metadata write operation failed ("+std::to_string(data->res)+" != "+std::to_string(data->iov.iov_len)+
+                    "). in-memory state is corrupted. AAAAAAAaaaaaaaaa!!!111"
+                );
+            }
+            write_it->second.writing = false;
+            write_it->second.written_seq = seq;
+            bs->ringloop->wakeup();
+        };
+        bs->ringloop->prep_writev(
+            sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + write_it->first
+        );
+        meta_writes_submitted++;
+    }
+    meta_write_queue.resize(j);
 }
 
 void journal_flusher_t::enqueue_flush(obj_ver_id ov)
@@ -222,14 +460,30 @@ void journal_flusher_t::dump_diagnostics()
         break;
     }
     printf(
-        "Flusher: queued=%ld first=%s%lx:%lx trim_wanted=%d dequeuing=%d trimming=%d cur=%d target=%d active=%d syncing=%d\n",
+        "Flusher: queued=%ld first=%s%lx:%lx trim_wanted=%d dequeuing=%d trimming=%d cur=%d target=%d (%s)"
+        " active=%d syncing=%d journal_fill=%d%% data_write_lat=%luus flush_rate=%luB/s meta_writes=%lu/%lu\n",
         flush_queue.size(), unflushable_type, unflushable.oid.inode, unflushable.oid.stripe,
-        trim_wanted, dequeuing, trimming, cur_flusher_count, target_flusher_count,
-        active_flushers, syncing_flushers
+        trim_wanted, dequeuing, trimming, cur_flusher_count, target_flusher_count, target_reason,
+        active_flushers, syncing_flushers, journal_fill, data_write_lat_us, flush_rate.rate,
+        meta_writes_submitted, meta_write_requests
     );
 }
 
-bool journal_flusher_t::try_find_older(std::map<obj_ver_id, dirty_entry>::iterator & dirty_end, obj_ver_id & cur)
+void journal_flusher_t::get_stats(blockstore_flusher_stats_t & st)
+{
+    st.flush_queue = flush_queue.size();
+    st.active_flushers = active_flushers;
+    st.target_flushers = target_flusher_count;
+    st.flush_rate = flush_rate.rate;
+}
+
+void journal_flusher_t::get_memory_stats(blockstore_memory_stats_t & st)
+{
+    // Sector buffers are only allocated separately without in-memory metadata
+    st.meta_sectors = meta_sectors.size() * (sizeof(meta_sector_t) + 40 + (bs->inmemory_meta ? 0 : bs->meta_block_size));
+}
+
+bool journal_flusher_t::try_find_older(blockstore_dirty_db_t::iterator & dirty_end, obj_ver_id & cur)
 {
     bool found = false;
     while (dirty_end != bs->dirty_db.begin())
@@ -276,8 +530,6 @@ bool journal_flusher_co::loop()
         goto resume_4;
     else if (wait_state == 5)
         goto resume_5;
-    else if (wait_state == 6)
-        goto resume_6;
     else if (wait_state == 7)
         goto resume_7;
     else if (wait_state == 8)
@@ -292,8 +544,6 @@ bool journal_flusher_co::loop()
         goto resume_13;
     else if (wait_state == 14)
         goto resume_14;
-    else if (wait_state == 15)
-        goto resume_15;
     else if (wait_state == 16)
         goto resume_16;
     else if (wait_state == 17)
@@ -306,6 +556,10 @@ bool journal_flusher_co::loop()
         goto resume_20;
     else if (wait_state == 21)
         goto resume_21;
+    else if (wait_state == 22)
+        goto resume_22;
+    else if (wait_state == 23)
+        goto resume_23;
 resume_0:
     if (flusher->flush_queue.size() < flusher->min_flusher_count && !flusher->trim_wanted ||
         !flusher->flush_queue.size() || !flusher->dequeuing)
@@ -321,6 +575,10 @@ stop_flusher:
         wait_state = 0;
         return true;
     }
+    if (bs->flusher_sort_window > 1)
+    {
+        flusher->pick_nearest_flush();
+    }
     cur.oid = flusher->flush_queue.front();
     cur.version = flusher->flush_versions[cur.oid];
     flusher->flush_queue.pop_front();
@@ -415,8 +673,11 @@ stop_flusher:
         flusher->active_flushers++;
 resume_1:
         // Find it in clean_db
-        clean_it = bs->clean_db.find(cur.oid);
-        old_clean_loc = (clean_it != bs->clean_db.end() ? clean_it->second.location : UINT64_MAX);
+        {
+            clean_entry clean;
+            old_clean_loc = bs->clean_db.get(cur.oid, &clean) ? clean.location : UINT64_MAX;
+            old_clean_compr = old_clean_loc != UINT64_MAX ? bs->get_clean_compr(old_clean_loc) : 0;
+        }
         // Scan dirty versions of the object
         if (!scan_dirty(1))
         {
@@ -448,6 +709,81 @@ resume_1:
                 clean_loc = old_clean_loc;
             }
         }
+        // Full blocks of pools with compression enabled are compressed when they're written
+        base_compr = has_delete ? 0 : (clean_init_bitmap ? clean_init_compr : old_clean_compr);
+        compr_algo = has_delete ? BS_COMPRESS_NONE : bs->get_inode_compression(cur.oid.inode);
+        full_cover = v.size() > 0 && v[0].offset == 0 && v.back().offset + v.back().len == bs->block_size;
+        for (int i = 1; i < v.size() && full_cover; i++)
+        {
+            full_cover = v[i-1].offset + v[i-1].len == v[i].offset;
+        }
+        if (base_compr && v.size() && !full_cover)
+        {
+            // Compressed block can't be partially overwritten in place. Read and decompress it,
+            // merge new data into it and write the whole block into a new location
+            await_sqe(22);
+            compr_buf = buffer_alloc(
+                (BS_COMPR_LEN(base_compr) + bs->disk_alignment - 1) / bs->disk_alignment * bs->disk_alignment);
+            data->iov = (struct iovec){ compr_buf, (BS_COMPR_LEN(base_compr) + bs->disk_alignment - 1) / bs->disk_alignment * bs->disk_alignment };
+            data->callback = simple_callback_r;
+            bs->ringloop->prep_readv(sqe, bs->data_fd, &data->iov, 1, bs->data_offset + clean_loc);
+            wait_count++;
+        resume_23:
+            if (wait_count > 0)
+            {
+                wait_state = 23;
+                return false;
+            }
+            {
+                void *block_buf = buffer_alloc(bs->block_size);
+                if (!bs_decompress(&bs->compress_ctx, BS_COMPR_ALGO(base_compr), compr_buf, BS_COMPR_LEN(base_compr), block_buf, bs->block_size))
+                {
+                    char err[1024];
+                    snprintf(
+                        err, 1024, "Failed to decompress data block %lu of object %lx:%lx during flush",
+                        clean_loc >> bs->block_order, cur.oid.inode, cur.oid.stripe
+                    );
+                    throw std::runtime_error(err);
+                }
+                buffer_free(compr_buf);
+                compr_buf = NULL;
+                for (it = v.begin(); it != v.end(); it++)
+                {
+                    memcpy((uint8_t*)block_buf + it->offset, it->buf, it->len);
+                    buffer_free(it->buf);
+                }
+                v.clear();
+                v.push_back((copy_buffer_t){ .offset = 0, .len = bs->block_size, .buf = block_buf });
+                full_cover = true;
+            }
+            {
+                uint64_t new_loc = bs->data_alloc->find_free((clean_loc >> bs->block_order) + 1);
+                if (new_loc == UINT64_MAX)
+                {
+                    // No free space, retry after other flushes free some
+                    for (it = v.begin(); it != v.end(); it++)
+                    {
+                        buffer_free(it->buf);
+                    }
+                    v.clear();
+                    repeat_it = flusher->sync_to_repeat.find(cur.oid);
+                    if (repeat_it->second > cur.version)
+                        cur.version = repeat_it->second;
+                    flusher->sync_to_repeat.erase(repeat_it);
+                    flusher->enqueue_flush(cur);
+                    flusher->active_flushers--;
+                    wait_state = 0;
+                    return true;
+                }
+                bs->data_alloc->set(new_loc, true);
+                // Previous location is freed when the flush completes
+                clean_loc = new_loc << bs->block_order;
+                clean_init_bitmap = true;
+                clean_init_csums = NULL;
+                clean_bitmap_offset = 0;
+                clean_bitmap_len = bs->block_size;
+            }
+        }
         // Also we need to submit metadata read(s). We do read-modify-write cycle(s) for every operation.
     resume_2:
         if (!modify_meta_read(clean_loc, meta_new, 2))
@@ -487,24 +823,109 @@ resume_1:
         {
             new_clean_bitmap = (bs->inmemory_meta
                 ? meta_new.buf + meta_new.pos*bs->clean_entry_size + sizeof(clean_disk_entry)
-                : bs->clean_bitmap + (clean_loc >> bs->block_order)*(2*bs->clean_entry_bitmap_size));
+                : bs->clean_bitmap + (clean_loc >> bs->block_order)*bs->clean_dyn_size);
             if (clean_init_bitmap)
             {
                 memset(new_clean_bitmap, 0, bs->clean_entry_bitmap_size);
                 bitmap_set(new_clean_bitmap, clean_bitmap_offset, clean_bitmap_len, bs->bitmap_granularity);
             }
         }
-        for (it = v.begin(); it != v.end(); it++)
+        new_clean_csums = NULL;
+        if (bs->data_csum_size)
+        {
+            // Checksums of the big write are taken as is and checksums of copied small writes are
+            // calculated from their data. Old checksums stay valid because writes are always aligned
+            new_clean_csums = (uint32_t*)(bs->inmemory_meta
+                ? meta_new.buf + meta_new.pos*bs->clean_entry_size + sizeof(clean_disk_entry) + 2*bs->clean_entry_bitmap_size
+                : bs->clean_bitmap + (clean_loc >> bs->block_order)*bs->clean_dyn_size + 2*bs->clean_entry_bitmap_size);
+            if (clean_init_bitmap && clean_init_csums)
+            {
+                memcpy(new_clean_csums, clean_init_csums, bs->data_csum_size);
+            }
+        }
+        write_iov.clear();
+        write_iov.reserve(v.size());
+        data_writes_left = 0;
+        for (it = v.begin(), write_len = 0; it != v.end(); it++)
         {
             if (new_clean_bitmap)
             {
                 bitmap_set(new_clean_bitmap, it->offset, it->len, bs->bitmap_granularity);
             }
+            // Adjacent parts are written with one request of at most IOV_MAX buffers,
+            // write_len is used as the buffer count of the current request here
+            if (it == v.begin() || (it-1)->offset + (it-1)->len != it->offset || write_len >= IOV_MAX)
+            {
+                data_writes_left++;
+                write_len = 0;
+            }
+            write_len++;
+            write_iov.push_back((struct iovec){ it->buf, (size_t)it->len });
+            if (new_clean_csums)
+            {
+                bs->calc_block_csums(new_clean_csums, it->offset, &write_iov.back(), 1);
+            }
+        }
+        new_compr = v.size() ? 0 : base_compr;
+        if (compr_algo != BS_COMPRESS_NONE && full_cover)
+        {
+            // The whole block is overwritten: compress it and write in place. It's safe because
+            // the block is either new or all of its data is in the journal until the flush completes
+            void *block_buf = v[0].buf;
+            if (v.size() > 1)
+            {
+                block_buf = buffer_alloc(bs->block_size);
+                for (it = v.begin(); it != v.end(); it++)
+                    memcpy((uint8_t*)block_buf + it->offset, it->buf, it->len);
+            }
+            compr_buf = buffer_alloc(bs->block_size);
+            uint32_t compr_len = bs_compress(&bs->compress_ctx, compr_algo, block_buf, bs->block_size, compr_buf, bs->block_size - bs->disk_alignment);
+            if (block_buf != v[0].buf)
+                buffer_free(block_buf);
+            if (compr_len)
+            {
+                uint64_t aligned_len = (compr_len + bs->disk_alignment - 1) / bs->disk_alignment * bs->disk_alignment;
+                memset((uint8_t*)compr_buf + compr_len, 0, aligned_len - compr_len);
+                for (it = v.begin(); it != v.end(); it++)
+                    buffer_free(it->buf);
+                v.clear();
+                v.push_back((copy_buffer_t){ .offset = 0, .len = aligned_len, .buf = compr_buf });
+                write_iov.clear();
+                write_iov.push_back((struct iovec){ compr_buf, (size_t)aligned_len });
+                data_writes_left = 1;
+                new_compr = BS_COMPR_VALUE(compr_algo, compr_len);
+                // Compressed blocks are read bypassing the cache
+                bs->read_cache.invalidate(clean_loc, bs->block_size);
+            }
+            else
+                buffer_free(compr_buf);
+            compr_buf = NULL;
+        }
+        if (bs->data_compr_size)
+        {
+            memcpy((bs->inmemory_meta
+                ? meta_new.buf + meta_new.pos*bs->clean_entry_size + sizeof(clean_disk_entry)
+                : bs->clean_bitmap + (clean_loc >> bs->block_order)*bs->clean_dyn_size)
+                + 2*bs->clean_entry_bitmap_size + bs->data_csum_size, &new_compr, sizeof(uint32_t));
+        }
+        if (data_writes_left)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &data_write_start);
+        }
+        for (write_pos = 0; write_pos < v.size(); write_pos = write_end)
+        {
+            write_len = v[write_pos].len;
+            for (write_end = write_pos+1; write_end < v.size() && write_end-write_pos < IOV_MAX &&
+                v[write_end-1].offset + v[write_end-1].len == v[write_end].offset; write_end++)
+            {
+                write_len += v[write_end].len;
+            }
             await_sqe(4);
-            data->iov = (struct iovec){ it->buf, (size_t)it->len };
-            data->callback = simple_callback_w;
-            my_uring_prep_writev(
-                sqe, bs->data_fd, &data->iov, 1, bs->data_offset + clean_loc + it->offset
+            bs->read_cache.invalidate(clean_loc + v[write_pos].offset, write_len);
+            data->iov = (struct iovec){ v[write_pos].buf, (size_t)write_len }; // to check it in the callback
+            data->callback = data_callback_w;
+            bs->ringloop->prep_writev(
+                sqe, bs->data_fd, write_iov.data() + write_pos, write_end-write_pos, bs->data_offset + clean_loc + v[write_pos].offset
             );
             wait_count++;
         }
@@ -534,13 +955,7 @@ resume_1:
             }
             // zero out old metadata entry
             memset(meta_old.buf + meta_old.pos*bs->clean_entry_size, 0, bs->clean_entry_size);
-            await_sqe(15);
-            data->iov = (struct iovec){ meta_old.buf, bs->meta_block_size };
-            data->callback = simple_callback_w;
-            my_uring_prep_writev(
-                sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + meta_old.sector
-            );
-            wait_count++;
+            flusher->queue_meta_write(meta_old);
         }
         if (has_delete)
         {
@@ -568,27 +983,35 @@ resume_1:
             if (!bs->inmemory_meta)
             {
                 memcpy(&new_entry->bitmap, new_clean_bitmap, bs->clean_entry_bitmap_size);
+                if (new_clean_csums)
+                {
+                    memcpy((void*)(new_entry+1) + 2*bs->clean_entry_bitmap_size, new_clean_csums, bs->data_csum_size);
+                }
+                if (bs->data_compr_size)
+                {
+                    memcpy((void*)(new_entry+1) + 2*bs->clean_entry_bitmap_size + bs->data_csum_size, &new_compr, sizeof(uint32_t));
+                }
             }
             // copy latest external bitmap/attributes
             if (bs->clean_entry_bitmap_size)
             {
-                void *bmp_ptr = bs->clean_entry_bitmap_size > sizeof(void*) ? dirty_end->second.bitmap : &dirty_end->second.bitmap;
-                memcpy((void*)(new_entry+1) + bs->clean_entry_bitmap_size, bmp_ptr, bs->clean_entry_bitmap_size);
+                bitmap_copy((void*)(new_entry+1) + bs->clean_entry_bitmap_size, bs->get_dirty_dyn(dirty_end->second), bs->clean_entry_bitmap_size);
             }
         }
-        await_sqe(6);
-        data->iov = (struct iovec){ meta_new.buf, bs->meta_block_size };
-        data->callback = simple_callback_w;
-        my_uring_prep_writev(
-            sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + meta_new.sector
-        );
-        wait_count++;
+        flusher->queue_meta_write(meta_new);
     resume_7:
-        if (wait_count > 0)
+        // Wait for the metadata write(s) shared with other flushers
+        if (!flusher->meta_write_done(meta_new) ||
+            old_clean_loc != UINT64_MAX && old_clean_loc != clean_loc && !flusher->meta_write_done(meta_old))
         {
             wait_state = 7;
             return false;
         }
+        flusher->release_meta_write(meta_new);
+        if (old_clean_loc != UINT64_MAX && old_clean_loc != clean_loc)
+        {
+            flusher->release_meta_write(meta_old);
+        }
         // Done, free all buffers
         if (!bs->inmemory_meta)
         {
@@ -610,7 +1033,7 @@ resume_1:
         }
         for (it = v.begin(); it != v.end(); it++)
         {
-            free(it->buf);
+            buffer_free(it->buf);
         }
         v.clear();
         // And sync metadata (in batches - not per each operation!)
@@ -624,6 +1047,7 @@ resume_1:
         }
         // Update clean_db and dirty_db, free old data locations
         update_clean_db();
+        flusher->add_flushed_journal(flushed_journal_bytes);
 #ifdef BLOCKSTORE_DEBUG
         printf("Flushed %lx:%lx v%lu (%d copies, wr:%d, del:%d), %ld left\n", cur.oid.inode, cur.oid.stripe, cur.version,
             copy_count, has_writes, has_delete, flusher->flush_queue.size());
@@ -659,14 +1083,14 @@ resume_1:
                     .magic = JOURNAL_MAGIC,
                     .type = JE_START,
                     .size = sizeof(journal_entry_start),
-                    .reserved = 0,
+                    .generation = bs->journal.generation,
                     .journal_start = new_trim_pos,
                     .version = JOURNAL_VERSION,
                 };
                 ((journal_entry_start*)flusher->journal_superblock)->crc32 = je_crc32((journal_entry*)flusher->journal_superblock);
                 data->iov = (struct iovec){ flusher->journal_superblock, bs->journal_block_size };
                 data->callback = simple_callback_w;
-                my_uring_prep_writev(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset);
+                bs->ringloop->prep_writev(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset, bs->journal_rw_flags);
                 wait_count++;
             resume_13:
                 if (wait_count > 0)
@@ -676,10 +1100,14 @@ resume_1:
                 }
                 if (!bs->disable_journal_fsync)
                 {
-                    await_sqe(20);
-                    my_uring_prep_fsync(sqe, bs->journal.fd, IORING_FSYNC_DATASYNC);
-                    data->iov = { 0 };
-                    data->callback = simple_callback_w;
+                    for (journal_fsync_pos = 0; journal_fsync_pos < bs->journal.device_count(); journal_fsync_pos++)
+                    {
+                        await_sqe(20);
+                        bs->ringloop->prep_fsync(sqe, bs->journal.device_fd(journal_fsync_pos), IORING_FSYNC_DATASYNC);
+                        data->iov = { 0 };
+                        data->callback = simple_callback_w;
+                        wait_count++;
+                    }
                 resume_21:
                     if (wait_count > 0)
                     {
@@ -718,11 +1146,13 @@ bool journal_flusher_co::scan_dirty(int wait_base)
     v.clear();
     wait_count = 0;
     copy_count = 0;
+    flushed_journal_bytes = 0;
     clean_loc = UINT64_MAX;
     has_delete = false;
     has_writes = false;
     skip_copy = false;
     clean_init_bitmap = false;
+    clean_init_compr = 0;
     while (1)
     {
         if (!IS_STABLE(dirty_it->second.state))
@@ -738,6 +1168,7 @@ bool journal_flusher_co::scan_dirty(int wait_base)
         {
             // First we submit all reads
             has_writes = true;
+            flushed_journal_bytes += sizeof(journal_entry_small_write) + bs->dirty_dyn_size + dirty_it->second.len;
             if (dirty_it->second.len != 0)
             {
                 offset = dirty_it->second.offset;
@@ -752,7 +1183,7 @@ bool journal_flusher_co::scan_dirty(int wait_base)
                     {
                         submit_offset = dirty_it->second.location + offset - dirty_it->second.offset;
                         submit_len = it == v.end() || it->offset >= end_offset ? end_offset-offset : it->offset-offset;
-                        it = v.insert(it, (copy_buffer_t){ .offset = offset, .len = submit_len, .buf = memalign_or_die(MEM_ALIGNMENT, submit_len) });
+                        it = v.insert(it, (copy_buffer_t){ .offset = offset, .len = submit_len, .buf = buffer_alloc(submit_len) });
                         copy_count++;
                         if (bs->journal.inmemory)
                         {
@@ -765,8 +1196,8 @@ bool journal_flusher_co::scan_dirty(int wait_base)
                             await_sqe(0);
                             data->iov = (struct iovec){ it->buf, (size_t)submit_len };
                             data->callback = simple_callback_r;
-                            my_uring_prep_readv(
-                                sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset + submit_offset
+                            bs->ringloop->prep_readv(
+                                sqe, bs->journal.pos_fd(submit_offset), &data->iov, 1, bs->journal.pos_offset(submit_offset)
                             );
                             wait_count++;
                         }
@@ -781,8 +1212,11 @@ bool journal_flusher_co::scan_dirty(int wait_base)
         {
             // There is an unflushed big write. Copy small writes in its position
             has_writes = true;
+            flushed_journal_bytes += sizeof(journal_entry_big_write) + bs->dirty_dyn_size;
             clean_loc = dirty_it->second.location;
             clean_init_bitmap = true;
+            clean_init_csums = bs->data_csum_size ? bs->get_dirty_csums(dirty_it->second) : NULL;
+            clean_init_compr = bs->get_dirty_compr(dirty_it->second);
             clean_bitmap_offset = dirty_it->second.offset;
             clean_bitmap_len = dirty_it->second.len;
             skip_copy = true;
@@ -840,7 +1274,7 @@ bool journal_flusher_co::modify_meta_read(uint64_t meta_loc, flusher_meta_write_
         data->iov = (struct iovec){ wr.it->second.buf, bs->meta_block_size };
         data->callback = simple_callback_r;
         wr.submitted = true;
-        my_uring_prep_readv(
+        bs->ringloop->prep_readv(
             sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + wr.sector
         );
         wait_count++;
@@ -864,25 +1298,31 @@ void journal_flusher_co::update_clean_db()
             clean_loc >> bs->block_order);
 #endif
         bs->data_alloc->set(old_clean_loc >> bs->block_order, false);
+        bs->queue_discard(old_clean_loc >> bs->block_order);
+    }
+    if (old_clean_loc != UINT64_MAX)
+    {
+        bs->add_compr_stats(cur.oid.inode, old_clean_compr, -1);
     }
     if (has_delete)
     {
-        auto clean_it = bs->clean_db.find(cur.oid);
-        bs->clean_db.erase(clean_it);
+        bs->clean_db.erase(cur.oid);
 #ifdef BLOCKSTORE_DEBUG
         printf("Free block %lu from %lx:%lx v%lu (delete)\n",
             clean_loc >> bs->block_order,
             cur.oid.inode, cur.oid.stripe, cur.version);
 #endif
         bs->data_alloc->set(clean_loc >> bs->block_order, false);
+        bs->queue_discard(clean_loc >> bs->block_order);
         clean_loc = UINT64_MAX;
     }
     else
     {
-        bs->clean_db[cur.oid] = {
+        bs->clean_db.set(cur.oid, (clean_entry){
             .version = cur.version,
             .location = clean_loc,
-        };
+        });
+        bs->add_compr_stats(cur.oid.inode, new_compr, 1);
     }
     bs->erase_dirty(dirty_start, std::next(dirty_end), clean_loc);
 }
@@ -923,7 +1363,7 @@ bool journal_flusher_co::fsync_batch(bool fsync_meta, int wait_base)
                 await_sqe(0);
                 data->iov = { 0 };
                 data->callback = simple_callback_w;
-                my_uring_prep_fsync(sqe, fsync_meta ? bs->meta_fd : bs->data_fd, IORING_FSYNC_DATASYNC);
+                bs->ringloop->prep_fsync(sqe, fsync_meta ? bs->meta_fd : bs->data_fd, IORING_FSYNC_DATASYNC);
                 cur_sync->state = 1;
                 wait_count++;
             resume_2:
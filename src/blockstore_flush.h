@@ -22,12 +22,24 @@ struct flusher_sync_t
     int state;
 };
 
+// Metadata sector write shared by all flushers modifying the same sector
+struct meta_sector_write_t
+{
+    void *buf;
+    // Modifications are numbered, every write covers all modifications made before its submission
+    uint64_t mod_seq, written_seq;
+    int waiters;
+    bool queued, writing;
+};
+
 struct flusher_meta_write_t
 {
     uint64_t sector, pos;
     bool submitted;
     void *buf;
     std::map<uint64_t, meta_sector_t>::iterator it;
+    std::map<uint64_t, meta_sector_write_t>::iterator write_it;
+    uint64_t write_seq;
 };
 
 class journal_flusher_t;
@@ -44,22 +56,35 @@ class journal_flusher_co
     std::list<flusher_sync_t>::iterator cur_sync;
 
     obj_ver_id cur;
-    std::map<obj_ver_id, dirty_entry>::iterator dirty_it, dirty_start, dirty_end;
+    blockstore_dirty_db_t::iterator dirty_it, dirty_start, dirty_end;
     std::map<object_id, uint64_t>::iterator repeat_it;
-    std::function<void(ring_data_t*)> simple_callback_r, simple_callback_w;
+    ring_callback_t simple_callback_r, simple_callback_w, data_callback_w;
 
     bool skip_copy, has_delete, has_writes;
-    blockstore_clean_db_t::iterator clean_it;
     std::vector<copy_buffer_t> v;
     std::vector<copy_buffer_t>::iterator it;
     int copy_count;
+    // Journal space occupied by the flushed versions
+    uint64_t flushed_journal_bytes;
+    std::vector<iovec> write_iov;
+    int write_pos, write_end;
+    uint64_t write_len;
+    int data_writes_left;
+    timespec data_write_start;
     uint64_t clean_loc, old_clean_loc;
     flusher_meta_write_t meta_old, meta_new;
     bool clean_init_bitmap;
     uint64_t clean_bitmap_offset, clean_bitmap_len;
     void *new_clean_bitmap;
+    uint32_t *clean_init_csums, *new_clean_csums;
+    // Compression of the base block, of the old clean block and of the flushed block
+    uint32_t clean_init_compr, old_clean_compr, base_compr, new_compr;
+    int compr_algo;
+    bool full_cover;
+    void *compr_buf;
 
     uint64_t new_trim_pos;
+    int journal_fsync_pos;
 
     // local: scan_dirty()
     uint64_t offset, end_offset, submit_offset, submit_len;
@@ -81,6 +106,11 @@ class journal_flusher_t
     bool dequeuing;
     int min_flusher_count, max_flusher_count, cur_flusher_count, target_flusher_count;
     int flusher_start_threshold;
+    // Flusher count controller state: journal fill level in percent,
+    // moving average of data write latency and the factor that limited the target last time
+    int journal_fill = 0;
+    uint64_t data_write_lat_us = 0;
+    const char *target_reason = "min";
     journal_flusher_co *co;
     blockstore_impl_t *bs;
     friend class journal_flusher_co;
@@ -95,10 +125,30 @@ class journal_flusher_t
     std::map<object_id, uint64_t> sync_to_repeat;
 
     std::map<uint64_t, meta_sector_t> meta_sectors;
+    // Metadata sectors modified by flushers are written once per flusher loop
+    // iteration, whatever the number of objects changed in them
+    std::map<uint64_t, meta_sector_write_t> meta_writes;
+    std::vector<std::map<uint64_t, meta_sector_write_t>::iterator> meta_write_queue;
+    uint64_t meta_write_requests = 0, meta_writes_submitted = 0;
     std::deque<object_id> flush_queue;
     std::map<object_id, uint64_t> flush_versions;
-
-    bool try_find_older(std::map<obj_ver_id, dirty_entry>::iterator & dirty_end, obj_ver_id & cur);
+    // Elevator state for flush_queue reordering
+    uint64_t last_flush_loc = 0;
+    int sort_skips = 0;
+    // Journal space freed per second of flushing at full speed
+    busy_rate_t flush_rate;
+
+    bool try_find_older(blockstore_dirty_db_t::iterator & dirty_end, obj_ver_id & cur);
+    void update_target_count();
+    uint64_t flush_target_loc(object_id oid);
+    void pick_nearest_flush();
+    void queue_meta_write(flusher_meta_write_t & wr);
+    bool meta_write_done(flusher_meta_write_t & wr);
+    void release_meta_write(flusher_meta_write_t & wr);
+    void submit_meta_writes();
+    void add_data_write_latency(uint64_t usec);
+    void add_flushed_journal(uint64_t bytes);
+    void update_flush_busy();
 
 public:
     journal_flusher_t(blockstore_impl_t *bs);
@@ -112,4 +162,8 @@ public:
     void unshift_flush(obj_ver_id oid, bool force);
     void remove_flush(object_id oid);
     void dump_diagnostics();
+    void get_stats(blockstore_flusher_stats_t & st);
+    void get_memory_stats(blockstore_memory_stats_t & st);
+    // Journal bytes per second the flusher frees at full speed, 0 if not measured yet
+    uint64_t get_journal_flush_rate() { return flush_rate.rate; }
 };
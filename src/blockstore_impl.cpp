@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "blockstore_impl.h"
+#include "blockstore_compress.h"
 
 blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_t *ringloop, timerfd_manager_t *tfd)
 {
@@ -19,17 +20,22 @@ blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_t *
         open_data();
         open_meta();
         open_journal();
+        open_passthru();
         calc_lengths();
         data_alloc = new allocator(block_count);
+        register_fixed();
     }
     catch (std::exception & e)
     {
+        close_passthru();
         if (data_fd >= 0)
             close(data_fd);
         if (meta_fd >= 0 && meta_fd != data_fd)
             close(meta_fd);
         if (journal.fd >= 0 && journal.fd != meta_fd)
             close(journal.fd);
+        for (int i = 1; i < journal.stripe_fds.size(); i++)
+            close(journal.stripe_fds[i]);
         throw;
     }
     flusher = new journal_flusher_t(this);
@@ -37,22 +43,82 @@ blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_t *
 
 blockstore_impl_t::~blockstore_impl_t()
 {
+    if (discard_timer_id)
+        tfd->clear_timer(discard_timer_id);
     delete data_alloc;
     delete flusher;
     free(zero_object);
     ringloop->unregister_consumer(&ring_consumer);
+    unregister_fixed();
+    close_passthru();
     if (data_fd >= 0)
         close(data_fd);
     if (meta_fd >= 0 && meta_fd != data_fd)
         close(meta_fd);
     if (journal.fd >= 0 && journal.fd != meta_fd)
         close(journal.fd);
+    for (int i = 1; i < journal.stripe_fds.size(); i++)
+        close(journal.stripe_fds[i]);
     if (metadata_buffer)
         free(metadata_buffer);
     if (clean_bitmap)
         free(clean_bitmap);
 }
 
+// Devices and long-lived buffers are registered with the ring to use fixed files and buffers
+void blockstore_impl_t::register_fixed()
+{
+    ringloop->register_fd(data_fd);
+    ringloop->register_fd(meta_fd);
+    ringloop->register_fd(journal.fd);
+    for (int i = 1; i < journal.stripe_fds.size(); i++)
+        ringloop->register_fd(journal.stripe_fds[i]);
+    for (auto & map: journal.dax_maps)
+        ringloop->register_dax(map.fd, map.addr, map.size);
+    if (inmemory_meta)
+        ringloop->register_buffer(metadata_buffer, meta_len);
+    if (journal.inmemory)
+        ringloop->register_buffer(journal.buffer, journal.len);
+    else
+        ringloop->register_buffer(journal.sector_buf, journal.sector_max * journal_block_size);
+    // Flush copy buffers, compressed reads and OSD read buffers are allocated from the pool
+    buffer_pool_t & pool = thread_buffer_pool();
+    pool.use_hugepages = use_hugepages;
+    pool.for_each_chunk([this](void *buf, size_t len) { register_pool_chunk(buf, len); });
+    pool.on_new_chunk = [this](void *buf, size_t len) { register_pool_chunk(buf, len); };
+}
+
+void blockstore_impl_t::register_pool_chunk(void *buf, size_t len)
+{
+    // Fixed buffers are looked up linearly on every I/O, so only register the first chunks
+    if (fixed_pool_chunks < BUFFER_POOL_MAX_FIXED_CHUNKS && ringloop->register_buffer(buf, len))
+        fixed_pool_chunks++;
+}
+
+void blockstore_impl_t::unregister_fixed()
+{
+    ringloop->unregister_fd(data_fd);
+    ringloop->unregister_fd(meta_fd);
+    ringloop->unregister_fd(journal.fd);
+    for (int i = 1; i < journal.stripe_fds.size(); i++)
+        ringloop->unregister_fd(journal.stripe_fds[i]);
+    for (auto & map: journal.dax_maps)
+        ringloop->unregister_dax(map.fd);
+    if (inmemory_meta)
+        ringloop->unregister_buffer(metadata_buffer);
+    if (journal.inmemory)
+        ringloop->unregister_buffer(journal.buffer);
+    else
+        ringloop->unregister_buffer(journal.sector_buf);
+    buffer_pool_t & pool = thread_buffer_pool();
+    pool.on_new_chunk = NULL;
+    if (fixed_pool_chunks > 0)
+    {
+        pool.for_each_chunk([this](void *buf, size_t len) { ringloop->unregister_buffer(buf); });
+        fixed_pool_chunks = 0;
+    }
+}
+
 bool blockstore_impl_t::is_started()
 {
     return initialized == 10;
@@ -69,7 +135,8 @@ void blockstore_impl_t::loop()
     // FIXME: initialized == 10 is ugly
     if (initialized != 10)
     {
-        // read metadata, then journal
+        // read metadata, then journal. In-memory journal is read during the metadata scan,
+        // but its entries are only parsed after the scan because they're checked against clean_db
         if (initialized == 0)
         {
             metadata_init_reader = new blockstore_init_meta(this);
@@ -78,13 +145,20 @@ void blockstore_impl_t::loop()
         if (initialized == 1)
         {
             int res = metadata_init_reader->loop();
+            if (!journal_init_reader)
+            {
+                journal_init_reader = new blockstore_init_journal(this);
+            }
             if (!res)
             {
                 delete metadata_init_reader;
                 metadata_init_reader = NULL;
-                journal_init_reader = new blockstore_init_journal(this);
                 initialized = 2;
             }
+            else if (journal.inmemory)
+            {
+                journal_init_reader->loop();
+            }
         }
         if (initialized == 2)
         {
@@ -118,7 +192,17 @@ void blockstore_impl_t::loop()
         // has_writes == 0 - no writes before the current queue item
         // has_writes == 1 - some writes in progress
         // has_writes == 2 - tried to submit some writes, but failed
-        int has_writes = 0, op_idx = 0, new_idx = 0;
+        // Tracked per priority class, so that held back writes of one class don't block others.
+        // The order of writes to the same object is kept by dequeue_write() and dequeue_del()
+        int has_writes[BS_PRIO_COUNT] = { 0 }, op_idx = 0, new_idx = 0;
+        for (int i = 0; i < 2; i++)
+        {
+            prio_waiting[i] = prio_waiting_next[i];
+            prio_waiting_next[i] = 0;
+        }
+        // Journal data writes are only merged within one submission round
+        data_batch_sqe = NULL;
+        data_batch = NULL;
         for (; op_idx < submit_queue.size(); op_idx++, new_idx++)
         {
             auto op = submit_queue[op_idx];
@@ -128,7 +212,12 @@ void blockstore_impl_t::loop()
             // In all other cases we should stop submission
             if (PRIV(op)->wait_for)
             {
+                int prev_wait = PRIV(op)->wait_for;
                 check_wait(op);
+                if (op->trace && !PRIV(op)->wait_for)
+                {
+                    trace_wait_done(op, prev_wait);
+                }
                 if (PRIV(op)->wait_for == WAIT_SQE)
                 {
                     break;
@@ -137,11 +226,37 @@ void blockstore_impl_t::loop()
                 {
                     if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE)
                     {
-                        has_writes = 2;
+                        has_writes[op->priority] = 2;
                     }
                     continue;
                 }
             }
+            bool prio_start = (op->opcode == BS_OP_READ || op->opcode == BS_OP_WRITE ||
+                op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE) && !PRIV(op)->prio_in_flight;
+            if (prio_start)
+            {
+                if (op->opcode != BS_OP_READ && has_writes[op->priority] == 2)
+                {
+                    // Some writes of the same class already could not be submitted
+                    continue;
+                }
+                if (!prio_allows(op))
+                {
+                    // The class has used its share, let other classes take the free slots
+                    prio_waiting_next[PRIO_KIND(op)] |= (1 << op->priority);
+                    if (op->opcode != BS_OP_READ)
+                        has_writes[op->priority] = 2;
+                    continue;
+                }
+                // Count the operation before dequeueing because it may finish immediately
+                PRIV(op)->prio_in_flight = true;
+                prio_in_flight[PRIO_KIND(op)][op->priority]++;
+            }
+            if (op->trace && !PRIV(op)->trace_started)
+            {
+                PRIV(op)->trace_started = true;
+                op->trace->queue_us = trace_us_since(PRIV(op)->tv_trace);
+            }
             unsigned ring_space = ringloop->space_left();
             unsigned prev_sqe_pos = ringloop->save();
             // 0 = can't submit
@@ -154,23 +269,23 @@ void blockstore_impl_t::loop()
             }
             else if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE)
             {
-                if (has_writes == 2)
+                if (has_writes[op->priority] == 2)
                 {
                     // Some writes already could not be submitted
                     continue;
                 }
                 wr_st = dequeue_write(op);
-                has_writes = wr_st > 0 ? 1 : 2;
+                has_writes[op->priority] = wr_st > 0 ? 1 : 2;
             }
             else if (op->opcode == BS_OP_DELETE)
             {
-                if (has_writes == 2)
+                if (has_writes[op->priority] == 2)
                 {
                     // Some writes already could not be submitted
                     continue;
                 }
                 wr_st = dequeue_del(op);
-                has_writes = wr_st > 0 ? 1 : 2;
+                has_writes[op->priority] = wr_st > 0 ? 1 : 2;
             }
             else if (op->opcode == BS_OP_SYNC)
             {
@@ -178,15 +293,20 @@ void blockstore_impl_t::loop()
                 // wait for all big writes to complete, submit data device fsync
                 // wait for the data device fsync to complete, then submit journal writes for big writes
                 // then submit an fsync operation
-                if (has_writes)
+                bool prev_writes = false;
+                for (int i = 0; i < BS_PRIO_COUNT; i++)
+                    prev_writes = prev_writes || has_writes[i];
+                if (prev_writes && PRIV(op)->op_state != SYNC_WAIT_GROUP)
                 {
                     // Can't submit SYNC before previous writes
                     continue;
                 }
-                wr_st = continue_sync(op, false);
+                wr_st = continue_sync(op, false, op_idx);
                 if (wr_st != 2)
                 {
-                    has_writes = wr_st > 0 ? 1 : 2;
+                    // Writes of all classes after the SYNC wait for it
+                    for (int i = 0; i < BS_PRIO_COUNT; i++)
+                        has_writes[i] = wr_st > 0 ? 1 : 2;
                 }
             }
             else if (op->opcode == BS_OP_STABLE)
@@ -209,7 +329,17 @@ void blockstore_impl_t::loop()
             }
             if (wr_st == 0)
             {
+                if (prio_start && !PRIV(op)->op_state)
+                {
+                    // Not started, don't occupy the slot of the class
+                    finish_prio(op);
+                    prio_waiting_next[PRIO_KIND(op)] |= (1 << op->priority);
+                }
                 ringloop->restore(prev_sqe_pos);
+                if (op->trace && PRIV(op)->wait_for)
+                {
+                    clock_gettime(CLOCK_REALTIME, &PRIV(op)->tv_trace_wait);
+                }
                 if (PRIV(op)->wait_for == WAIT_SQE)
                 {
                     PRIV(op)->wait_detail = 1 + ring_space;
@@ -226,9 +356,12 @@ void blockstore_impl_t::loop()
             }
             submit_queue.resize(new_idx);
         }
+        data_batch_sqe = NULL;
+        data_batch = NULL;
         if (!readonly)
         {
             flusher->loop();
+            submit_discards();
         }
         int ret = ringloop->submit();
         if (ret < 0)
@@ -244,11 +377,50 @@ void blockstore_impl_t::loop()
     }
 }
 
+// Check if a new operation of its priority class may be started. A class is limited by its
+// prio_max_iodepth and, while other classes have operations waiting, by its weighted share
+// of max_read_iodepth for reads or max_write_iodepth for writes and deletes. Otherwise a single
+// class may use all slots
+bool blockstore_impl_t::prio_allows(blockstore_op_t *op)
+{
+    unsigned cls = op->priority;
+    int kind = PRIO_KIND(op);
+    unsigned *in_flight = prio_in_flight[kind];
+    if (prio_max_iodepth[cls] && in_flight[cls] >= prio_max_iodepth[cls])
+    {
+        return false;
+    }
+    unsigned waiting = (prio_waiting[kind] | prio_waiting_next[kind]) & ~(1 << cls);
+    if (!waiting)
+    {
+        return true;
+    }
+    unsigned total_weight = 0;
+    for (int i = 0; i < BS_PRIO_COUNT; i++)
+    {
+        if (i == cls || (waiting & (1 << i)) || in_flight[i] > 0)
+            total_weight += prio_weight[i];
+    }
+    unsigned share = (kind ? max_read_iodepth : max_write_iodepth) * prio_weight[cls] / total_weight;
+    return in_flight[cls] < (share > 0 ? share : 1);
+}
+
+void blockstore_impl_t::trace_wait_done(blockstore_op_t *op, int wait_for)
+{
+    uint32_t us = trace_us_since(PRIV(op)->tv_trace_wait);
+    if (wait_for == WAIT_SQE)
+        op->trace->wait_sqe_us += us;
+    else if (wait_for == WAIT_JOURNAL || wait_for == WAIT_JOURNAL_BUFFER)
+        op->trace->wait_journal_us += us;
+    else if (wait_for == WAIT_FREE)
+        op->trace->wait_free_us += us;
+}
+
 bool blockstore_impl_t::is_safe_to_stop()
 {
     // It's safe to stop blockstore when there are no in-flight operations,
     // no in-progress syncs and flusher isn't doing anything
-    if (submit_queue.size() > 0 || !readonly && flusher->is_active())
+    if (submit_queue.size() > 0 || !readonly && flusher->is_active() || discard_in_flight > 0)
     {
         return false;
     }
@@ -269,6 +441,10 @@ bool blockstore_impl_t::is_safe_to_stop()
         }
         return false;
     }
+    if (has_checkpoint() && !checkpoint_saved && initialized == 10)
+    {
+        save_checkpoint();
+    }
     return true;
 }
 
@@ -336,18 +512,25 @@ void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
         ((op->opcode == BS_OP_READ || op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE) && (
             op->offset >= block_size ||
             op->len > block_size-op->offset ||
-            (op->len % disk_alignment)
+            (op->len % disk_alignment) ||
+            // Checksummed writes must cover whole checksum blocks
+            data_csum_type != BLOCKSTORE_CSUM_NONE && op->opcode != BS_OP_READ && (op->offset % disk_alignment)
         )) ||
         readonly && op->opcode != BS_OP_READ && op->opcode != BS_OP_LIST)
     {
         // Basic verification not passed
         op->retval = -EINVAL;
-        std::function<void (blockstore_op_t*)>(op->callback)(op);
+        blockstore_op_callback_t(op->callback)(op);
         return;
     }
+    if (checkpoint_saved && op->opcode != BS_OP_READ && op->opcode != BS_OP_LIST)
+    {
+        // The metadata may change after this operation, so the checkpoint becomes stale
+        invalidate_checkpoint();
+    }
     if (op->opcode == BS_OP_SYNC_STAB_ALL)
     {
-        std::function<void(blockstore_op_t*)> *old_callback = new std::function<void(blockstore_op_t*)>(op->callback);
+        blockstore_op_callback_t *old_callback = new blockstore_op_callback_t(op->callback);
         op->opcode = BS_OP_SYNC;
         op->callback = [this, old_callback](blockstore_op_t *op)
         {
@@ -385,14 +568,23 @@ void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
     }
     if ((op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE) && !enqueue_write(op))
     {
-        std::function<void (blockstore_op_t*)>(op->callback)(op);
+        blockstore_op_callback_t(op->callback)(op);
         return;
     }
+    if (op->priority >= BS_PRIO_COUNT)
+    {
+        op->priority = BS_PRIO_CLIENT;
+    }
     // Call constructor without allocating memory. We'll call destructor before returning op back
     new ((void*)op->private_data) blockstore_op_private_t;
     PRIV(op)->wait_for = 0;
     PRIV(op)->op_state = 0;
     PRIV(op)->pending_ops = 0;
+    if (op->trace)
+    {
+        *op->trace = (blockstore_op_trace_t){ 0 };
+        clock_gettime(CLOCK_REALTIME, &PRIV(op)->tv_trace);
+    }
     submit_queue.push_back(op);
     ringloop->wakeup();
 }
@@ -433,8 +625,26 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
         FINISH_OP(op);
         return;
     }
+    object_id min_oid = { .inode = 0, .stripe = 0 }, max_oid = { .inode = UINT64_MAX, .stripe = UINT64_MAX };
+    if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
+    {
+        min_oid.inode = min_inode;
+        max_oid.inode = max_inode;
+    }
+    blockstore_list_page_t *page = (blockstore_list_page_t*)op->bitmap;
+    uint64_t max_count = page ? page->max_count : 0;
+    if (page && min_oid < page->start)
+    {
+        min_oid = page->start;
+    }
+    // End of the page (exclusive), inode=0 means there's no end
+    object_id end_oid = { .inode = 0, .stripe = 0 };
     // Copy clean_db entries (sorted)
     int stable_count = 0, stable_alloc = clean_db.size() / (pg_count ? pg_count : 1);
+    if (max_count && stable_alloc > max_count)
+    {
+        stable_alloc = max_count;
+    }
     obj_ver_id *stable = (obj_ver_id*)malloc(sizeof(obj_ver_id) * stable_alloc);
     if (!stable)
     {
@@ -443,38 +653,37 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
         return;
     }
     {
-        auto clean_it = clean_db.begin(), clean_end = clean_db.end();
-        if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
-        {
-            clean_it = clean_db.lower_bound({
-                .inode = min_inode,
-                .stripe = 0,
-            });
-            clean_end = clean_db.upper_bound({
-                .inode = max_inode,
-                .stripe = UINT64_MAX,
-            });
-        }
-        for (; clean_it != clean_end; clean_it++)
+        clean_db.for_each_while(min_oid, max_oid, [&](const object_id & oid, const clean_entry & clean)
         {
-            if (!pg_count || ((clean_it->first.stripe / pg_stripe_size) % pg_count) == list_pg) // like map_to_pg()
+            if (!pg_count || ((oid.stripe / pg_stripe_size) % pg_count) == list_pg) // like map_to_pg()
             {
+                if (max_count && stable_count >= max_count)
+                {
+                    end_oid = oid;
+                    return false;
+                }
                 if (stable_count >= stable_alloc)
                 {
                     stable_alloc += 32768;
-                    stable = (obj_ver_id*)realloc(stable, sizeof(obj_ver_id) * stable_alloc);
+                    obj_ver_id *new_stable = (obj_ver_id*)realloc(stable, sizeof(obj_ver_id) * stable_alloc);
+                    if (!new_stable)
+                        free(stable);
+                    stable = new_stable;
                     if (!stable)
-                    {
-                        op->retval = -ENOMEM;
-                        FINISH_OP(op);
-                        return;
-                    }
+                        return false;
                 }
                 stable[stable_count++] = {
-                    .oid = clean_it->first,
-                    .version = clean_it->second.version,
+                    .oid = oid,
+                    .version = clean.version,
                 };
             }
+            return true;
+        });
+        if (!stable)
+        {
+            op->retval = -ENOMEM;
+            FINISH_OP(op);
+            return;
         }
     }
     int clean_stable_count = stable_count;
@@ -482,25 +691,38 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
     int unstable_count = 0, unstable_alloc = 0;
     obj_ver_id *unstable = NULL;
     {
-        auto dirty_it = dirty_db.begin(), dirty_end = dirty_db.end();
-        if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
+        auto dirty_it = dirty_db.lower_bound({ .oid = min_oid, .version = 0 });
+        auto dirty_end = dirty_db.upper_bound({ .oid = max_oid, .version = UINT64_MAX });
+        if (max_count)
         {
-            dirty_it = dirty_db.lower_bound({
-                .oid = {
-                    .inode = min_inode,
-                    .stripe = 0,
-                },
-                .version = 0,
-            });
-            dirty_end = dirty_db.upper_bound({
-                .oid = {
-                    .inode = max_inode,
-                    .stripe = UINT64_MAX,
-                },
-                .version = UINT64_MAX,
-            });
+            // Also limit the number of objects with dirty versions
+            uint64_t dirty_count = 0;
+            object_id last_oid = {};
+            for (auto it = dirty_it; it != dirty_end && (!end_oid.inode || it->first.oid < end_oid); it++)
+            {
+                if ((!pg_count || ((it->first.oid.stripe / pg_stripe_size) % pg_count) == list_pg) &&
+                    (!dirty_count || !(it->first.oid == last_oid)))
+                {
+                    if (dirty_count >= max_count)
+                    {
+                        end_oid = it->first.oid;
+                        break;
+                    }
+                    dirty_count++;
+                    last_oid = it->first.oid;
+                }
+            }
+            while (end_oid.inode && stable_count > 0 && !(stable[stable_count-1].oid < end_oid))
+            {
+                stable_count--;
+            }
+        }
+        if (page)
+        {
+            page->next = end_oid;
         }
-        for (; dirty_it != dirty_end; dirty_it++)
+        clean_stable_count = stable_count;
+        for (; dirty_it != dirty_end && (!end_oid.inode || dirty_it->first.oid < end_oid); dirty_it++)
         {
             if (!pg_count || ((dirty_it->first.oid.stripe / pg_stripe_size) % pg_count) == list_pg) // like map_to_pg()
             {
@@ -596,8 +818,98 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
     FINISH_OP(op);
 }
 
+void blockstore_impl_t::set_pool_compression(const std::map<uint64_t, int> & new_compression)
+{
+    for (auto & pp: new_compression)
+    {
+        auto old_it = pool_compression.find(pp.first);
+        if ((old_it == pool_compression.end() || old_it->second != pp.second) && pp.second != BS_COMPRESS_NONE)
+        {
+            if (!data_compr_size)
+                printf("Compression is enabled for pool %lu, but this OSD has data_compression disabled, data will be stored uncompressed\n", pp.first);
+            else if (!bs_compression_supported(pp.second))
+                printf("Compression algorithm of pool %lu is not supported by this build, data will be stored uncompressed\n", pp.first);
+        }
+    }
+    pool_compression = new_compression;
+}
+
+int blockstore_impl_t::get_inode_compression(uint64_t inode)
+{
+    if (!data_compr_size || pool_compression.empty())
+        return BS_COMPRESS_NONE;
+    auto it = pool_compression.find(INODE_POOL(inode));
+    return it != pool_compression.end() && bs_compression_supported(it->second) ? it->second : BS_COMPRESS_NONE;
+}
+
+void blockstore_impl_t::add_compr_stats(uint64_t inode, uint32_t compr, int sign)
+{
+    if (!compr)
+        return;
+    auto & st = inode_compr_stats[inode];
+    st.first += sign*(int64_t)block_size;
+    st.second += sign*(int64_t)BS_COMPR_LEN(compr);
+    if (!st.first)
+        inode_compr_stats.erase(inode);
+}
+
 void blockstore_impl_t::dump_diagnostics()
 {
+    printf(
+        "clean_db: %s, %lu objects, %lu bytes\n", clean_db.is_compact() ? "compact" : "btree",
+        clean_db.size(), clean_db.bytes_used()
+    );
+    printf(
+        "syncs: %lu, with fsync: %lu (%.2f syncs per fsync)\n", sync_op_count, sync_fsync_count,
+        sync_fsync_count ? (double)sync_op_count/sync_fsync_count : 0.0
+    );
+    if (read_cache.enabled())
+    {
+        printf(
+            "read_cache: %lu/%lu bytes used, %lu hits, %lu misses (%.1f%% hit rate)\n",
+            read_cache.bytes_used(), read_cache.size(), read_cache.hits, read_cache.misses,
+            read_cache.hits+read_cache.misses ? 100.0*read_cache.hits/(read_cache.hits+read_cache.misses) : 0.0
+        );
+    }
+    if (discard_on_free || discard_requests)
+    {
+        printf(
+            "discard: %lu blocks queued, %d requests in flight, %lu bytes discarded with %lu requests, %lu errors\n",
+            discard_queue.size(), discard_in_flight, discarded_bytes, discard_requests, discard_errors
+        );
+    }
     journal.dump_diagnostics();
     flusher->dump_diagnostics();
 }
+
+blockstore_flusher_stats_t blockstore_impl_t::get_flusher_stats()
+{
+    blockstore_flusher_stats_t st = {
+        .journal_used = journal.next_free >= journal.used_start
+            ? journal.next_free - journal.used_start
+            : journal.len - journal.used_start + journal.next_free - journal.block_size,
+        .journal_size = journal.len,
+        .dirty_objects = dirty_db.size(),
+    };
+    flusher->get_stats(st);
+    return st;
+}
+
+// Map and hash table nodes are estimated with the usual libstdc++ overhead:
+// 32 bytes per std::map node, 16 bytes per unordered_map node plus 8 bytes per bucket
+blockstore_memory_stats_t blockstore_impl_t::get_memory_stats()
+{
+    blockstore_memory_stats_t st = {
+        .clean_db = clean_db.bytes_used(),
+        .clean_bitmaps = clean_bitmap ? block_count*clean_dyn_size : 0,
+        .metadata_buffer = inmemory_meta ? meta_len : 0,
+        .dirty_db = dirty_db.size() * (sizeof(blockstore_dirty_db_t::value_type) + 32 +
+            (dirty_dyn_size > sizeof(void*) ? dirty_dyn_size : 0)),
+        .unstable_writes = unstable_writes.size() * (sizeof(std::pair<object_id, uint64_t>) + 16) +
+            unstable_writes.bucket_count() * sizeof(void*),
+        .journal_buffers = (journal.inmemory ? journal.len : 0) + journal.sector_max*journal.block_size,
+        .read_cache = read_cache.bytes_used(),
+    };
+    flusher->get_memory_stats(st);
+    return st;
+}
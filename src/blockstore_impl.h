@@ -9,6 +9,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 #include <linux/fs.h>
@@ -16,12 +17,19 @@
 #include <vector>
 #include <list>
 #include <deque>
+#include <set>
 #include <new>
 
 #include "cpp-btree/btree_map.h"
 
 #include "malloc_or_die.h"
+#include "slab_allocator.h"
+#include "buffer_pool.h"
 #include "allocator.h"
+#include "numa_affinity.h"
+#include "busy_rate.h"
+#include "blockstore_compress.h"
+#include "osd_id.h"
 
 //#define BLOCKSTORE_DEBUG
 
@@ -45,6 +53,19 @@
 #define IMMEDIATE_SMALL 1
 #define IMMEDIATE_ALL 2
 
+#define JOURNAL_FUA_NONE 0
+#define JOURNAL_FUA_ALWAYS 1
+#define JOURNAL_FUA_AUTO 2
+
+#define BLOCKSTORE_CSUM_NONE 0
+#define BLOCKSTORE_CSUM_CRC32C 1
+
+// Compression of a full data block: algorithm (BS_COMPRESS_*) in the upper 4 bits and
+// compressed length in the lower 28 bits, 0 = the block isn't compressed
+#define BS_COMPR_VALUE(algo, len) (((uint32_t)(algo) << 28) | (uint32_t)(len))
+#define BS_COMPR_ALGO(c) ((c) >> 28)
+#define BS_COMPR_LEN(c) ((c) & 0x0FFFFFFF)
+
 #define BS_ST_TYPE_MASK 0x0F
 #define BS_ST_WORKFLOW_MASK 0xF0
 #define IS_IN_FLIGHT(st) (((st) & 0xF0) <= BS_ST_SUBMITTED)
@@ -54,6 +75,18 @@
 #define IS_BIG_WRITE(st) (((st) & 0x0F) == BS_ST_BIG_WRITE)
 #define IS_DELETE(st) (((st) & 0x0F) == BS_ST_DELETE)
 
+// Sync operation states
+#define SYNC_HAS_SMALL 1
+#define SYNC_HAS_BIG 2
+#define SYNC_DATA_SYNC_SENT 3
+#define SYNC_DATA_SYNC_DONE 4
+#define SYNC_JOURNAL_WRITE_SENT 5
+#define SYNC_JOURNAL_WRITE_DONE 6
+#define SYNC_JOURNAL_SYNC_SENT 7
+#define SYNC_DONE 8
+#define SYNC_DELAYED 9
+#define SYNC_WAIT_GROUP 10
+
 #define BS_SUBMIT_GET_SQE(sqe, data) \
     BS_SUBMIT_GET_ONLY_SQE(sqe); \
     struct ring_data_t *data = ((ring_data_t*)sqe->user_data)
@@ -93,11 +126,52 @@ struct __attribute__((__packed__)) blockstore_meta_header_t
     uint32_t meta_block_size;
     uint32_t data_block_size;
     uint32_t bitmap_granularity;
+    // Zero in metadata created before data checksums were added, which is the same as "none"
+    uint32_t data_csum_type;
+    // Zero in metadata created before data compression was added
+    uint32_t data_compression;
+};
+
+// "VCLEANDB"
+#define CLEAN_DB_CHECKPOINT_MAGIC 0x42444E41454C4356l
+#define CLEAN_DB_CHECKPOINT_VERSION 1
+
+// clean_db checkpoint file: header, <entry_count> entries in object ID order,
+// then <bitmap_len> bytes of clean_bitmap (when metadata isn't kept in memory)
+struct __attribute__((__packed__)) clean_db_checkpoint_header_t
+{
+    uint64_t magic;
+    uint64_t version;
+    uint64_t generation;
+    uint64_t journal_start;
+    uint64_t data_block_size;
+    uint64_t block_count;
+    uint64_t meta_len;
+    uint64_t clean_entry_bitmap_size;
+    uint64_t entry_count;
+    uint64_t bitmap_len;
+    uint32_t data_crc32;
+    uint32_t header_crc32;
+};
+
+struct __attribute__((__packed__)) clean_db_checkpoint_entry_t
+{
+    object_id oid;
+    uint64_t version;
+    uint64_t location;
+};
+
+// Several small write data blocks written to the journal with one request
+struct journal_data_batch_t
+{
+    std::vector<iovec> iov;
+    std::vector<blockstore_op_t*> ops;
 };
 
 // 32 bytes = 24 bytes + block bitmap (4 bytes by default) + external attributes (also bitmap, 4 bytes by default)
-// per "clean" entry on disk with fixed metadata tables
-// FIXME: maybe add crc32's to metadata
+// per "clean" entry on disk with fixed metadata tables, plus crc32c of every bitmap_granularity
+// block of data (128 bytes by default) when data checksums are enabled, plus the compression
+// value (4 bytes, see BS_COMPR_VALUE) when data compression is enabled
 struct __attribute__((__packed__)) clean_disk_entry
 {
     object_id oid;
@@ -122,6 +196,7 @@ struct __attribute__((__packed__)) dirty_entry
     uint32_t len;      // data length
     uint64_t journal_sector; // journal sector used for this entry
     void* bitmap;   // either external bitmap itself when it fits, or a pointer to it when it doesn't
+                    // (followed by data checksums and compression value of big writes when they're enabled)
 };
 
 // - Sync must be submitted after previous writes/deletes (not before!)
@@ -155,8 +230,33 @@ struct fulfill_read_t
     uint64_t offset, len;
 };
 
+// Data checksums of blocks fully covered by one data device read, verified when it completes
+struct read_csum_check_t
+{
+    uint64_t buf_offset, location, fill_id;
+    std::vector<uint32_t> csums;
+};
+
+// Part of a compressed block requested by a read operation
+struct read_compr_part_t
+{
+    uint8_t *buf;
+    uint64_t offset, len;
+};
+
+// Read of a compressed block, decompressed and verified once when it completes
+struct read_compr_t
+{
+    uint64_t location;
+    uint32_t compr;
+    std::vector<uint32_t> csums;
+    std::vector<read_compr_part_t> parts;
+};
+
 #define PRIV(op) ((blockstore_op_private_t*)(op)->private_data)
-#define FINISH_OP(op) PRIV(op)->~blockstore_op_private_t(); std::function<void (blockstore_op_t*)>(op->callback)(op)
+// Reads and writes are limited by priority classes separately
+#define PRIO_KIND(op) ((op)->opcode == BS_OP_READ ? 1 : 0)
+#define FINISH_OP(op) finish_prio(op); finish_trace(op); PRIV(op)->~blockstore_op_private_t(); blockstore_op_callback_t(op->callback)(op)
 
 struct blockstore_op_private_t
 {
@@ -165,9 +265,16 @@ struct blockstore_op_private_t
     uint64_t wait_detail;
     int pending_ops;
     int op_state;
+    // Counted in prio_in_flight of its priority class
+    bool prio_in_flight = false;
+    // Traced operations: enqueue time and the start of the current wait
+    bool trace_started = false;
+    timespec tv_trace, tv_trace_wait;
 
     // Read
     std::vector<fulfill_read_t> read_vec;
+    // Compressed block read in progress, other parts of the same block are added to it
+    read_compr_t *read_compr = NULL;
 
     // Sync, write
     uint64_t min_flushed_journal_sector, max_flushed_journal_sector;
@@ -181,13 +288,18 @@ struct blockstore_op_private_t
     // Sync
     std::vector<obj_ver_id> sync_big_writes, sync_small_writes;
     int sync_small_checked, sync_big_checked;
+    uint64_t sync_group;
 };
 
 // https://github.com/algorithm-ninja/cpp-btree
 // https://github.com/greg7mdp/sparsepp/ was used previously, but it was TERRIBLY slow after resizing
 // with sparsepp, random reads dropped to ~700 iops very fast with just as much as ~32k objects in the DB
-typedef btree::btree_map<object_id, clean_entry> blockstore_clean_db_t;
-typedef std::map<obj_ver_id, dirty_entry> blockstore_dirty_db_t;
+#include "blockstore_clean_db.h"
+#include "blockstore_read_cache.h"
+// dirty_db must keep iterators valid across inserts and erases because flushers hold them
+// across suspensions, so it's still an std::map, but with nodes allocated from a slab pool
+typedef std::map<obj_ver_id, dirty_entry, std::less<obj_ver_id>,
+    slab_allocator_t<std::pair<const obj_ver_id, dirty_entry>>> blockstore_dirty_db_t;
 
 #include "blockstore_init.h"
 
@@ -214,41 +326,111 @@ class blockstore_impl_t
     bool disable_flock = false;
     // It is safe to disable fsync() if drive write cache is writethrough
     bool disable_data_fsync = false, disable_meta_fsync = false, disable_journal_fsync = false;
+    // Write the journal with RWF_DSYNC (FUA) instead of separate journal fsyncs:
+    // always or only on devices which report FUA support in /sys/block/*/queue/fua
+    int journal_fua = JOURNAL_FUA_NONE;
     // Enable if you want every operation to be executed with an "implicit fsync"
     // Suitable only for server SSDs with capacitors, requires disabled data and journal fsyncs
     int immediate_commit = IMMEDIATE_NONE;
     bool inmemory_meta = false;
+    // Allocate the in-memory metadata and journal buffers from transparent huge pages
+    bool use_hugepages = false;
+    // Number of I/O buffer pool chunks registered as io_uring fixed buffers
+    int fixed_pool_chunks = 0;
     // Maximum and minimum flusher count
     unsigned max_flusher_count, min_flusher_count;
+    // Journal fill levels (percent) at which flusher count starts to grow from min and reaches max
+    int flusher_fill_low = 10, flusher_fill_high = 50;
+    // Reduce flusher count when average data write latency exceeds this value (0 = don't)
+    uint64_t flusher_target_latency_us = 0;
+    // Flush queued objects in the order of their data location within this many first queue entries (0 = FIFO)
+    int flusher_sort_window = 0;
     // Maximum queue depth
     unsigned max_write_iodepth = 128;
+    // Number of reads shared by priority classes by weight, like max_write_iodepth for writes
+    unsigned max_read_iodepth = 128;
+    // Number of parallel metadata reads during startup
+    unsigned meta_read_iodepth = 4;
+    // Number of parallel journal reads during startup
+    unsigned journal_read_iodepth = 4;
+    // Path to the clean_db checkpoint file. If set, clean_db is saved there on a clean
+    // shutdown and loaded on the next start instead of scanning the metadata area
+    std::string checkpoint_path;
+    // Use the compact clean_db representation (~2 times less memory, a bit slower lookups)
+    bool compact_clean_db = false;
+    // Size of the clean data read cache in RAM (0 = disabled)
+    uint64_t read_cache_size = 0;
+    // Write stabilize and rollback requests as compact multi-object journal entries
+    bool journal_multi_entries = false;
+    // Maximum time to delay a sync waiting for in-flight writes to sync them together (0 = don't wait)
+    uint64_t sync_max_delay_us = 0;
+    // Maximum number of adjacent small writes merged into one journal data write (1 = don't merge)
+    unsigned journal_write_batch = 32;
     // Enable small (journaled) write throttling, useful for the SSD+HDD case
     bool throttle_small_writes = false;
+    // Throttle by the measured journal flush rate instead of throttle_target_* (throttle_small_writes=auto)
+    bool throttle_auto = false;
     // Target data device iops, bandwidth and parallelism for throttling (100/100/1 is the default for HDD)
     int throttle_target_iops = 100;
     int throttle_target_mbs = 100;
     int throttle_target_parallelism = 1;
     // Minimum difference in microseconds between target and real execution times to throttle the response
     int throttle_threshold_us = 50;
+    // Send I/O of NVMe devices through their generic char devices (/dev/ngXnY) as passthrough commands
+    bool nvme_passthrough = false;
+    // Write to passthrough devices with FUA instead of separate fsyncs if they support it
+    bool nvme_fua = false;
+    // Map journal devices into memory (persistent memory with DAX) and write the journal with CPU stores
+    bool journal_dax = false;
+    // Data checksum type: BLOCKSTORE_CSUM_NONE or BLOCKSTORE_CSUM_CRC32C (per bitmap_granularity block)
+    uint32_t data_csum_type = BLOCKSTORE_CSUM_NONE;
+    // Fraction of reads from the data device to verify checksums for (0 = never, 1 = always)
+    double csum_verify_rate = 1;
+    // Allow to compress data blocks of pools with compression enabled. Changes the metadata format
+    bool data_compression = false;
+    // Weights of client, recovery and scrub operations in max_write_iodepth and max_read_iodepth
+    // when more than one class is waiting
+    unsigned prio_weight[BS_PRIO_COUNT] = { 8, 2, 1 };
+    // Maximum number of in-flight writes and, separately, reads of each class (0 = only limited by the weight)
+    unsigned prio_max_iodepth[BS_PRIO_COUNT] = { 0, 0, 0 };
+    // Discard freed data blocks on the data device in the background
+    bool discard_on_free = false;
+    // Maximum discard rate in bytes per second (0 = unlimited) and the interval between discard batches
+    uint64_t discard_max_rate = 100*1024*1024;
+    uint64_t discard_interval_ms = 1000;
+    // Objects created by a write smaller than this have the rest of their data block punched out
+    // so that they only take the space of the written data on thin-provisioned data devices (0 = disabled)
+    uint64_t small_object_size = 0;
     /******* END OF OPTIONS *******/
 
     struct ring_consumer_t ring_consumer;
 
     blockstore_clean_db_t clean_db;
+    blockstore_read_cache_t read_cache;
     uint8_t *clean_bitmap = NULL;
     blockstore_dirty_db_t dirty_db;
     std::vector<blockstore_op_t*> submit_queue;
     std::vector<obj_ver_id> unsynced_big_writes, unsynced_small_writes;
     int unsynced_big_write_count = 0;
     allocator *data_alloc = NULL;
+    uint64_t next_alloc_hint = 0;
     uint8_t *zero_object;
 
     uint32_t block_order;
     uint64_t block_count;
     uint32_t clean_entry_bitmap_size = 0, clean_entry_size = 0;
+    // Size of data checksums of one block, size of the compression value (0 or 4), size of the
+    // in-memory bitmap & checksum area of one clean entry (2 bitmaps + checksums + compression)
+    // and of one dirty entry (1 bitmap + checksums + compression)
+    uint32_t data_csum_size = 0, data_compr_size = 0, clean_dyn_size = 0, dirty_dyn_size = 0;
+    double csum_verify_acc = 0;
 
     int meta_fd;
     int data_fd;
+    // NVMe generic char devices used for passthrough: block device fd => char device fd
+    std::map<int, int> passthru_fds;
+    // RWF_DSYNC if journal writes are write-through
+    int journal_rw_flags = 0;
     uint64_t meta_size, meta_area, meta_len;
     uint64_t data_size, data_len;
 
@@ -257,12 +439,35 @@ class blockstore_impl_t
     struct journal_t journal;
     journal_flusher_t *flusher;
     int write_iodepth = 0;
+    // Started and not finished operations of each priority class, writes and deletes [0] and reads [1]
+    // separately, and bitmasks of classes which had operations held back in the previous and current
+    // submission rounds
+    unsigned prio_in_flight[2][BS_PRIO_COUNT] = { { 0 } };
+    unsigned prio_waiting[2] = { 0 }, prio_waiting_next[2] = { 0 };
+    // Data write of the last small write prepared in the current submission round.
+    // Data of the next small writes is appended to it while it's adjacent in the journal
+    io_uring_sqe *data_batch_sqe = NULL;
+    journal_data_batch_t *data_batch = NULL;
+    blockstore_op_t *data_batch_op = NULL;
+    uint64_t data_batch_start = 0, data_batch_end = 0;
 
     bool live = false, queue_stall = false;
     ring_loop_t *ringloop;
     timerfd_manager_t *tfd;
 
     bool stop_sync_submitted;
+    // Syncs completed with one fsync form a group
+    uint64_t sync_groups_started = 0, sync_groups_done = 0;
+    uint64_t sync_op_count = 0, sync_fsync_count = 0;
+    bool checkpoint_loaded = false, checkpoint_saved = false;
+    // Freed data blocks waiting for discard and discard statistics
+    std::set<uint64_t> discard_queue;
+    // Block devices are discarded with BLKDISCARD instead of punching holes, with io_uring
+    // while the kernel supports it (Linux 6.12+) and with a synchronous ioctl otherwise
+    bool data_blkdev = false, data_uring_discard = true;
+    int discard_in_flight = 0, discard_timer_id = 0;
+    uint64_t discard_next_us = 0;
+    uint64_t discard_requests = 0, discarded_bytes = 0, discard_errors = 0;
 
     inline struct io_uring_sqe* get_sqe()
     {
@@ -280,35 +485,88 @@ class blockstore_impl_t
     void open_data();
     void open_meta();
     void open_journal();
+    void map_journal_dax(int fd, uint64_t *size);
+    void open_passthru();
+    void close_passthru();
+    void register_fixed();
+    void unregister_fixed();
+    void register_pool_chunk(void *buf, size_t len);
     uint8_t* get_clean_entry_bitmap(uint64_t block_loc, int offset);
+    // Bitmap, checksums and compression of a dirty entry are stored in place of the pointer when they fit
+    inline void* get_dirty_dyn(dirty_entry & e) { return dirty_dyn_size > sizeof(void*) ? e.bitmap : &e.bitmap; }
+    uint32_t* get_dirty_csums(dirty_entry & e);
+    uint32_t get_dirty_compr(dirty_entry & e);
+    uint32_t get_clean_compr(uint64_t block_loc);
+    void set_dirty_compr(dirty_entry & e, uint32_t compr);
+    int get_inode_compression(uint64_t inode);
+    void add_compr_stats(uint64_t inode, uint32_t compr, int sign);
+    void calc_block_csums(uint32_t *csums, uint32_t offset, const iovec *iov, int iovcnt);
+
+    // clean_db checkpoint
+    bool load_checkpoint();
+    void save_checkpoint();
+    void invalidate_checkpoint();
 
     // Asynchronous init
     int initialized;
     int metadata_buf_size;
-    blockstore_init_meta* metadata_init_reader;
-    blockstore_init_journal* journal_init_reader;
+    blockstore_init_meta* metadata_init_reader = NULL;
+    blockstore_init_journal* journal_init_reader = NULL;
 
     void check_wait(blockstore_op_t *op);
 
+    // Priority classes
+    bool prio_allows(blockstore_op_t *op);
+    inline void finish_prio(blockstore_op_t *op)
+    {
+        if (PRIV(op)->prio_in_flight)
+        {
+            PRIV(op)->prio_in_flight = false;
+            prio_in_flight[PRIO_KIND(op)][op->priority]--;
+        }
+    }
+
+    // Tracing, only done for operations with op->trace set
+    static inline uint32_t trace_us_since(const timespec & tv)
+    {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return (now.tv_sec - tv.tv_sec)*1000000 + (now.tv_nsec - tv.tv_nsec)/1000;
+    }
+    void trace_wait_done(blockstore_op_t *op, int wait_for);
+    inline void finish_trace(blockstore_op_t *op)
+    {
+        if (op->trace)
+            op->trace->total_us = trace_us_since(PRIV(op)->tv_trace);
+    }
+
     // Read
     int dequeue_read(blockstore_op_t *read_op);
     int fulfill_read(blockstore_op_t *read_op, uint64_t &fulfilled, uint32_t item_start, uint32_t item_end,
-        uint32_t item_state, uint64_t item_version, uint64_t item_location);
+        uint32_t item_state, uint64_t item_version, uint64_t item_location, uint32_t *item_csums = NULL, uint32_t item_compr = 0);
     int fulfill_read_push(blockstore_op_t *op, void *buf, uint64_t offset, uint64_t len,
-        uint32_t item_state, uint64_t item_version);
+        uint32_t item_state, uint64_t item_version, uint32_t *item_csums, uint32_t item_compr);
+    int fulfill_read_compressed(blockstore_op_t *op, void *buf, uint64_t offset, uint64_t len,
+        uint32_t *item_csums, uint32_t item_compr);
+    bool verify_read_csums(uint8_t *buf, uint64_t offset, const std::vector<uint32_t> & csums);
     void handle_read_event(ring_data_t *data, blockstore_op_t *op);
 
     // Write
     bool enqueue_write(blockstore_op_t *op);
+    bool prev_write_in_flight(blockstore_dirty_db_t::iterator dirty_it);
     void cancel_all_writes(blockstore_op_t *op, blockstore_dirty_db_t::iterator dirty_it, int retval);
     int dequeue_write(blockstore_op_t *op);
     int dequeue_del(blockstore_op_t *op);
     int continue_write(blockstore_op_t *op);
     void release_journal_sectors(blockstore_op_t *op);
+    bool prepare_journal_sector_write(int sector, io_uring_sqe *sqe, ring_callback_t cb, journal_sector_batch_t *batch = NULL);
+    int prepare_multi_journal_entries(blockstore_op_t *op, uint16_t type, ring_callback_t cb);
     void handle_write_event(ring_data_t *data, blockstore_op_t *op);
+    void append_journal_data_batch(blockstore_op_t *op);
 
     // Sync
-    int continue_sync(blockstore_op_t *op, bool queue_has_in_progress_sync);
+    int continue_sync(blockstore_op_t *op, bool queue_has_in_progress_sync, int queue_pos);
+    void group_syncs(int leader_pos, uint64_t group);
     void handle_sync_event(ring_data_t *data, blockstore_op_t *op);
     void ack_sync(blockstore_op_t *op);
 
@@ -329,6 +587,13 @@ class blockstore_impl_t
     // List
     void process_list(blockstore_op_t *op);
 
+    // Discard of freed data blocks
+    void queue_discard(uint64_t block_num);
+    void submit_discards();
+    void prep_data_discard(io_uring_sqe *sqe, uint64_t offset, uint64_t len);
+    void handle_discard_event(int res, uint64_t start, uint64_t count, bool uring_discard);
+    void prep_small_object_punch(io_uring_sqe *sqe, uint64_t block_num);
+
 public:
 
     blockstore_impl_t(blockstore_config_t & config, ring_loop_t *ringloop, timerfd_manager_t *tfd);
@@ -346,6 +611,9 @@ public:
     // loop until it returns true.
     bool is_safe_to_stop();
 
+    // Returns true if clean_db is saved to a checkpoint when it's safe to stop
+    inline bool has_checkpoint() { return checkpoint_path != "" && !readonly; }
+
     // Returns true if stalled
     bool is_stalled();
 
@@ -360,10 +628,21 @@ public:
 
     // Space usage statistics
     std::map<uint64_t, uint64_t> inode_space_stats;
+    // Logical and stored size of compressed clean blocks per inode
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> inode_compr_stats;
+    // Compression algorithms of pools
+    std::map<uint64_t, int> pool_compression;
+    bs_compress_ctx_t compress_ctx;
+
+    // Set compression algorithms of pools
+    void set_pool_compression(const std::map<uint64_t, int> & new_compression);
 
     // Print diagnostics to stdout
     void dump_diagnostics();
 
+    blockstore_flusher_stats_t get_flusher_stats();
+    blockstore_memory_stats_t get_memory_stats();
+
     inline uint32_t get_block_size() { return block_size; }
     inline uint64_t get_block_count() { return block_count; }
     inline uint64_t get_free_block_count() { return data_alloc->get_free_count(); }
@@ -1,6 +1,8 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <algorithm>
+
 #include "blockstore_impl.h"
 
 #define GET_SQE() \
@@ -31,13 +33,22 @@ void blockstore_init_meta::handle_event(ring_data_t *data)
             std::string(": ") + strerror(-data->res)
         );
     }
-    prev_done = data->res > 0 ? submitted : 0;
-    done_len = data->res;
-    done_pos = metadata_read;
-    metadata_read += data->res;
     submitted = 0;
 }
 
+void blockstore_init_meta::handle_read_event(ring_data_t *data, bs_init_meta_read *rd)
+{
+    if (data->res != rd->len)
+    {
+        throw std::runtime_error(
+            std::string("read metadata failed at offset ") + std::to_string(rd->pos) +
+            std::string(": ") + (data->res < 0 ? strerror(-data->res) : "short read")
+        );
+    }
+    rd->done = true;
+    submitted--;
+}
+
 int blockstore_init_meta::loop()
 {
     if (wait_state == 1)
@@ -52,14 +63,18 @@ int blockstore_init_meta::loop()
     if (bs->inmemory_meta)
         metadata_buffer = bs->metadata_buffer;
     else
-        metadata_buffer = memalign(MEM_ALIGNMENT, 2*bs->metadata_buf_size);
+    {
+        metadata_buffer = memalign(MEM_ALIGNMENT, bs->meta_read_iodepth*bs->metadata_buf_size);
+        for (int i = bs->meta_read_iodepth-1; i >= 0; i--)
+            free_bufs.push_back(i);
+    }
     if (!metadata_buffer)
         throw std::runtime_error("Failed to allocate metadata read buffer");
     // Read superblock
     GET_SQE();
     data->iov = { metadata_buffer, bs->meta_block_size };
     data->callback = [this](ring_data_t *data) { handle_event(data); };
-    my_uring_prep_readv(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset);
+    bs->ringloop->prep_readv(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset);
     bs->ringloop->submit();
     submitted = 1;
 resume_1:
@@ -78,6 +93,8 @@ resume_1:
             hdr->meta_block_size = bs->meta_block_size;
             hdr->data_block_size = bs->block_size;
             hdr->bitmap_granularity = bs->bitmap_granularity;
+            hdr->data_csum_type = bs->data_csum_type;
+            hdr->data_compression = bs->data_compression;
         }
         if (bs->readonly)
         {
@@ -89,7 +106,7 @@ resume_1:
             GET_SQE();
             data->iov = (struct iovec){ metadata_buffer, bs->meta_block_size };
             data->callback = [this](ring_data_t *data) { handle_event(data); };
-            my_uring_prep_writev(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset);
+            bs->ringloop->prep_writev(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset);
             bs->ringloop->submit();
             submitted = 1;
         resume_3:
@@ -117,77 +134,96 @@ resume_1:
         }
         if (hdr->meta_block_size != bs->meta_block_size ||
             hdr->data_block_size != bs->block_size ||
-            hdr->bitmap_granularity != bs->bitmap_granularity)
+            hdr->bitmap_granularity != bs->bitmap_granularity ||
+            hdr->data_csum_type != bs->data_csum_type ||
+            hdr->data_compression != bs->data_compression)
         {
             printf(
                 "Configuration stored in metadata superblock"
-                " (meta_block_size=%u, data_block_size=%u, bitmap_granularity=%u)"
-                " differs from OSD configuration (%lu/%u/%lu).\n",
-                hdr->meta_block_size, hdr->data_block_size, hdr->bitmap_granularity,
-                bs->meta_block_size, bs->block_size, bs->bitmap_granularity
+                " (meta_block_size=%u, data_block_size=%u, bitmap_granularity=%u, data_csum_type=%u, data_compression=%u)"
+                " differs from OSD configuration (%lu/%u/%lu/%u/%u).\n",
+                hdr->meta_block_size, hdr->data_block_size, hdr->bitmap_granularity, hdr->data_csum_type, hdr->data_compression,
+                bs->meta_block_size, bs->block_size, bs->bitmap_granularity, bs->data_csum_type, bs->data_compression
             );
             exit(1);
         }
     }
     // Skip superblock
     bs->meta_offset += bs->meta_block_size;
-    prev_done = 0;
-    done_len = 0;
-    done_pos = 0;
     metadata_read = 0;
-    // Read the rest of the metadata
+    if (!zero_on_init && bs->load_checkpoint() && !bs->inmemory_meta)
+    {
+        // clean_db is loaded from the checkpoint, the metadata area isn't needed in memory
+        metadata_read = bs->meta_len;
+    }
+    // Read the rest of the metadata with up to meta_read_iodepth requests in flight,
+    // parsing finished buffers in order while the next ones are being read
     while (1)
     {
     resume_2:
-        if (submitted)
-        {
-            wait_state = 2;
-            return 1;
-        }
-        if (metadata_read < bs->meta_len)
+        while (metadata_read < bs->meta_len && reads.size() < bs->meta_read_iodepth)
         {
             GET_SQE();
-            data->iov = {
-                metadata_buffer + (bs->inmemory_meta
-                    ? metadata_read
-                    : (prev == 1 ? bs->metadata_buf_size : 0)),
-                bs->meta_len - metadata_read > bs->metadata_buf_size ? bs->metadata_buf_size : bs->meta_len - metadata_read,
-            };
-            data->callback = [this](ring_data_t *data) { handle_event(data); };
+            int buf_index = -1;
+            if (!bs->inmemory_meta)
+            {
+                buf_index = free_bufs.back();
+                free_bufs.pop_back();
+            }
+            reads.push_back((bs_init_meta_read){
+                .buf = metadata_buffer + (bs->inmemory_meta ? metadata_read : buf_index*bs->metadata_buf_size),
+                .pos = metadata_read,
+                .len = bs->meta_len - metadata_read > bs->metadata_buf_size ? bs->metadata_buf_size : bs->meta_len - metadata_read,
+                .buf_index = buf_index,
+                .done = false,
+            });
+            // deque::push_back() doesn't invalidate references to other elements
+            bs_init_meta_read *rd = &reads.back();
+            data->iov = { rd->buf, rd->len };
+            data->callback = [this, rd](ring_data_t *data) { handle_read_event(data, rd); };
             if (!zero_on_init)
-                my_uring_prep_readv(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + metadata_read);
+                bs->ringloop->prep_readv(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + metadata_read);
             else
             {
                 // Fill metadata with zeroes
                 memset(data->iov.iov_base, 0, data->iov.iov_len);
-                my_uring_prep_writev(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + metadata_read);
+                bs->ringloop->prep_writev(sqe, bs->meta_fd, &data->iov, 1, bs->meta_offset + metadata_read);
             }
+            metadata_read += rd->len;
+            submitted++;
             bs->ringloop->submit();
-            submitted = (prev == 1 ? 2 : 1);
-            prev = submitted;
         }
-        if (prev_done)
+        while (reads.size() > 0 && reads.front().done)
         {
-            void *done_buf = bs->inmemory_meta
-                ? (metadata_buffer + done_pos)
-                : (metadata_buffer + (prev_done == 2 ? bs->metadata_buf_size : 0));
-            unsigned count = bs->meta_block_size / bs->clean_entry_size;
-            for (int sector = 0; sector < done_len; sector += bs->meta_block_size)
+            bs_init_meta_read & rd = reads.front();
+            if (!bs->checkpoint_loaded)
+                handle_entries(rd.buf, rd.len, bs->block_order);
+            if (rd.buf_index >= 0)
             {
-                // handle <count> entries
-                handle_entries(done_buf + sector, count, bs->block_order);
-                done_cnt += count;
+                free_bufs.push_back(rd.buf_index);
             }
-            prev_done = 0;
-            done_len = 0;
+            reads.pop_front();
         }
-        if (!submitted)
+        if (!reads.size() && metadata_read >= bs->meta_len)
         {
             break;
         }
+        if (reads.size() > 0 && !reads.front().done)
+        {
+            wait_state = 2;
+            return 1;
+        }
     }
     // metadata read finished
-    printf("Metadata entries loaded: %lu, free blocks: %lu / %lu\n", entries_loaded, bs->data_alloc->get_free_count(), bs->block_count);
+    if (!bs->checkpoint_loaded)
+        printf("Metadata entries loaded: %lu, free blocks: %lu / %lu\n", entries_loaded, bs->data_alloc->get_free_count(), bs->block_count);
+    if (bs->data_compr_size)
+    {
+        bs->clean_db.for_each([this](const object_id & oid, const clean_entry & clean)
+        {
+            bs->add_compr_stats(oid.inode, bs->get_clean_compr(clean.location), 1);
+        });
+    }
     if (!bs->inmemory_meta)
     {
         free(metadata_buffer);
@@ -196,7 +232,7 @@ resume_1:
     if (zero_on_init && !bs->disable_meta_fsync)
     {
         GET_SQE();
-        my_uring_prep_fsync(sqe, bs->meta_fd, IORING_FSYNC_DATASYNC);
+        bs->ringloop->prep_fsync(sqe, bs->meta_fd, IORING_FSYNC_DATASYNC);
         data->iov = { 0 };
         data->callback = [this](ring_data_t *data) { handle_event(data); };
         submitted = 1;
@@ -211,51 +247,74 @@ resume_1:
     return 0;
 }
 
-void blockstore_init_meta::handle_entries(void* entries, unsigned count, int block_order)
+void blockstore_init_meta::handle_entries(void *buf, uint64_t len, int block_order)
 {
-    for (unsigned i = 0; i < count; i++)
+    // Entries of the whole buffer are sorted by object ID before inserting them into clean_db,
+    // so that consecutive inserts hit neighbouring btree nodes instead of random ones
+    sorted_entries.clear();
+    unsigned count = bs->meta_block_size / bs->clean_entry_size;
+    for (uint64_t sector = 0; sector < len; sector += bs->meta_block_size)
     {
-        clean_disk_entry *entry = (clean_disk_entry*)(entries + i*bs->clean_entry_size);
-        if (!bs->inmemory_meta && bs->clean_entry_bitmap_size)
+        void *entries = buf + sector;
+        for (unsigned i = 0; i < count; i++)
         {
-            memcpy(bs->clean_bitmap + (done_cnt+i)*2*bs->clean_entry_bitmap_size, &entry->bitmap, 2*bs->clean_entry_bitmap_size);
+            clean_disk_entry *entry = (clean_disk_entry*)(entries + i*bs->clean_entry_size);
+            if (!bs->inmemory_meta && bs->clean_dyn_size)
+            {
+                memcpy(bs->clean_bitmap + (done_cnt+i)*bs->clean_dyn_size, &entry->bitmap, bs->clean_dyn_size);
+            }
+            if (entry->oid.inode > 0)
+            {
+                sorted_entries.push_back((bs_init_meta_entry){
+                    .oid = entry->oid,
+                    .version = entry->version,
+                    .block = done_cnt+i,
+                });
+            }
         }
-        if (entry->oid.inode > 0)
+        done_cnt += count;
+    }
+    // Stable sort keeps on-disk order for duplicate object IDs
+    std::stable_sort(sorted_entries.begin(), sorted_entries.end(), [](const bs_init_meta_entry & a, const bs_init_meta_entry & b)
+    {
+        return a.oid < b.oid;
+    });
+    for (auto & entry: sorted_entries)
+    {
+        clean_entry clean;
+        bool exists = bs->clean_db.get(entry.oid, &clean);
+        if (!exists || clean.version < entry.version)
         {
-            auto clean_it = bs->clean_db.find(entry->oid);
-            if (clean_it == bs->clean_db.end() || clean_it->second.version < entry->version)
+            if (exists)
             {
-                if (clean_it != bs->clean_db.end())
-                {
-                    // free the previous block
-#ifdef BLOCKSTORE_DEBUG
-                    printf("Free block %lu from %lx:%lx v%lu (new location is %lu)\n",
-                        clean_it->second.location >> block_order,
-                        clean_it->first.inode, clean_it->first.stripe, clean_it->second.version,
-                        done_cnt+i);
-#endif
-                    bs->data_alloc->set(clean_it->second.location >> block_order, false);
-                }
-                else
-                {
-                    bs->inode_space_stats[entry->oid.inode] += bs->block_size;
-                }
-                entries_loaded++;
+                // free the previous block
 #ifdef BLOCKSTORE_DEBUG
-                printf("Allocate block (clean entry) %lu: %lx:%lx v%lu\n", done_cnt+i, entry->oid.inode, entry->oid.stripe, entry->version);
+                printf("Free block %lu from %lx:%lx v%lu (new location is %lu)\n",
+                    clean.location >> block_order,
+                    entry.oid.inode, entry.oid.stripe, clean.version,
+                    entry.block);
 #endif
-                bs->data_alloc->set(done_cnt+i, true);
-                bs->clean_db[entry->oid] = (struct clean_entry){
-                    .version = entry->version,
-                    .location = (done_cnt+i) << block_order,
-                };
+                bs->data_alloc->set(clean.location >> block_order, false);
             }
             else
             {
+                bs->inode_space_stats[entry.oid.inode] += bs->block_size;
+            }
+            bs->clean_db.set(entry.oid, (struct clean_entry){
+                .version = entry.version,
+                .location = entry.block << block_order,
+            });
+            entries_loaded++;
 #ifdef BLOCKSTORE_DEBUG
-                printf("Old clean entry %lu: %lx:%lx v%lu\n", done_cnt+i, entry->oid.inode, entry->oid.stripe, entry->version);
+            printf("Allocate block (clean entry) %lu: %lx:%lx v%lu\n", entry.block, entry.oid.inode, entry.oid.stripe, entry.version);
+#endif
+            bs->data_alloc->set(entry.block, true);
+        }
+        else
+        {
+#ifdef BLOCKSTORE_DEBUG
+            printf("Old clean entry %lu: %lx:%lx v%lu\n", entry.block, entry.oid.inode, entry.oid.stripe, entry.version);
 #endif
-            }
         }
     }
 }
@@ -274,28 +333,17 @@ blockstore_init_journal::blockstore_init_journal(blockstore_impl_t *bs)
     };
 }
 
-void blockstore_init_journal::handle_event(ring_data_t *data1)
+void blockstore_init_journal::handle_event(ring_data_t *data1, bs_init_journal_read *rd)
 {
-    if (data1->res <= 0)
+    if (data1->res != rd->len)
     {
         throw std::runtime_error(
-            std::string("read journal failed at offset ") + std::to_string(journal_pos) +
-            std::string(": ") + strerror(-data1->res)
+            std::string("read journal failed at offset ") + std::to_string(rd->pos) +
+            std::string(": ") + (data1->res < 0 ? strerror(-data1->res) : "short read")
         );
     }
-    done.push_back({
-        .buf = submitted_buf,
-        .pos = journal_pos,
-        .len = (uint64_t)data1->res,
-    });
-    journal_pos += data1->res;
-    if (journal_pos >= bs->journal.len)
-    {
-        // Continue from the beginning
-        journal_pos = bs->journal.block_size;
-        wrapped = true;
-    }
-    submitted_buf = NULL;
+    rd->done = true;
+    reads_submitted--;
 }
 
 int blockstore_init_journal::loop()
@@ -314,6 +362,10 @@ int blockstore_init_journal::loop()
         goto resume_6;
     else if (wait_state == 7)
         goto resume_7;
+    else if (wait_state == 8)
+        goto resume_8;
+    else if (wait_state == 9)
+        goto resume_9;
     printf("Reading blockstore journal\n");
     if (!bs->journal.inmemory)
         submitted_buf = memalign_or_die(MEM_ALIGNMENT, 2*bs->journal.block_size);
@@ -326,7 +378,7 @@ int blockstore_init_journal::loop()
     data = ((ring_data_t*)sqe->user_data);
     data->iov = { submitted_buf, bs->journal.block_size };
     data->callback = simple_callback;
-    my_uring_prep_readv(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset);
+    bs->ringloop->prep_readv(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset);
     bs->ringloop->submit();
     wait_count = 1;
 resume_1:
@@ -348,7 +400,7 @@ resume_1:
             .magic = JOURNAL_MAGIC,
             .type = JE_START,
             .size = sizeof(journal_entry_start),
-            .reserved = 0,
+            .generation = 0,
             .journal_start = bs->journal.block_size,
             .version = JOURNAL_VERSION,
         };
@@ -365,7 +417,7 @@ resume_1:
             GET_SQE();
             data->iov = (struct iovec){ submitted_buf, 2*bs->journal.block_size };
             data->callback = simple_callback;
-            my_uring_prep_writev(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset);
+            bs->ringloop->prep_writev(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset, bs->journal_rw_flags);
             wait_count++;
             bs->ringloop->submit();
         resume_6:
@@ -376,11 +428,14 @@ resume_1:
             }
             if (!bs->disable_journal_fsync)
             {
-                GET_SQE();
-                my_uring_prep_fsync(sqe, bs->journal.fd, IORING_FSYNC_DATASYNC);
-                data->iov = { 0 };
-                data->callback = simple_callback;
-                wait_count++;
+                for (int i = 0; i < bs->journal.device_count(); i++)
+                {
+                    GET_SQE();
+                    bs->ringloop->prep_fsync(sqe, bs->journal.device_fd(i), IORING_FSYNC_DATASYNC);
+                    data->iov = { 0 };
+                    data->callback = simple_callback;
+                    wait_count++;
+                }
                 bs->ringloop->submit();
             }
         resume_4:
@@ -418,37 +473,68 @@ resume_1:
             exit(1);
         }
         next_free = journal_pos = bs->journal.used_start = je_start->journal_start;
+        bs->journal.generation = je_start->generation;
         if (!bs->journal.inmemory)
             free(submitted_buf);
         submitted_buf = NULL;
         crc32_last = 0;
-        // Read journal
+        clock_gettime(CLOCK_MONOTONIC, &replay_start);
+        // Read journal with up to journal_read_iodepth requests in flight,
+        // parsing finished buffers in order while the next ones are being read
         while (1)
         {
         resume_2:
-            if (submitted_buf)
-            {
-                wait_state = 2;
-                return 1;
-            }
-            if (!wrapped || journal_pos < bs->journal.used_start)
+            while ((!wrapped || journal_pos < bs->journal.used_start) && reads.size() < bs->journal_read_iodepth)
             {
                 GET_SQE();
                 uint64_t end = bs->journal.len;
                 if (journal_pos < bs->journal.used_start)
                     end = bs->journal.used_start;
-                if (!bs->journal.inmemory)
-                    submitted_buf = memalign_or_die(MEM_ALIGNMENT, JOURNAL_BUFFER_SIZE);
-                else
-                    submitted_buf = bs->journal.buffer + journal_pos;
-                data->iov = {
-                    submitted_buf,
-                    end - journal_pos < JOURNAL_BUFFER_SIZE ? end - journal_pos : JOURNAL_BUFFER_SIZE,
-                };
-                data->callback = [this](ring_data_t *data1) { handle_event(data1); };
-                my_uring_prep_readv(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset + journal_pos);
+                if (bs->journal.stripe_fds.size() > 1 && end > (journal_pos/bs->journal.stripe_size + 1)*bs->journal.stripe_size)
+                {
+                    // Every read is done from one device
+                    end = (journal_pos/bs->journal.stripe_size + 1)*bs->journal.stripe_size;
+                }
+                reads.push_back((bs_init_journal_read){
+                    .buf = bs->journal.inmemory
+                        ? bs->journal.buffer + journal_pos
+                        : memalign_or_die(MEM_ALIGNMENT, JOURNAL_BUFFER_SIZE),
+                    .pos = journal_pos,
+                    .len = end - journal_pos < JOURNAL_BUFFER_SIZE ? end - journal_pos : JOURNAL_BUFFER_SIZE,
+                    .done = false,
+                });
+                // deque::push_back() doesn't invalidate references to other elements
+                bs_init_journal_read *rd = &reads.back();
+                data->iov = { rd->buf, rd->len };
+                data->callback = [this, rd](ring_data_t *data1) { handle_event(data1, rd); };
+                bs->ringloop->prep_readv(sqe, bs->journal.pos_fd(journal_pos), &data->iov, 1, bs->journal.pos_offset(journal_pos));
+                reads_submitted++;
+                journal_pos += rd->len;
+                if (journal_pos >= bs->journal.len)
+                {
+                    // Continue from the beginning
+                    journal_pos = bs->journal.block_size;
+                    wrapped = true;
+                }
                 bs->ringloop->submit();
             }
+            while (reads.size() > 0 && reads.front().done)
+            {
+                bs_init_journal_read & rd = reads.front();
+                done.push_back({
+                    .buf = rd.buf,
+                    .pos = rd.pos,
+                    .len = rd.len,
+                });
+                bytes_read += rd.len;
+                reads.pop_front();
+            }
+            if (bs->metadata_init_reader)
+            {
+                // Only read ahead until the metadata is loaded
+                wait_state = 2;
+                return 1;
+            }
             while (done.size() > 0)
             {
                 handle_res = handle_journal_part(done[0].buf, done[0].pos, done[0].len);
@@ -461,7 +547,10 @@ resume_1:
                         GET_SQE();
                         data->iov = { init_write_buf, bs->journal.block_size };
                         data->callback = simple_callback;
-                        my_uring_prep_writev(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset + init_write_sector);
+                        bs->ringloop->prep_writev(
+                            sqe, bs->journal.pos_fd(init_write_sector), &data->iov, 1,
+                            bs->journal.pos_offset(init_write_sector), bs->journal_rw_flags
+                        );
                         wait_count++;
                         bs->ringloop->submit();
                     resume_7:
@@ -472,11 +561,14 @@ resume_1:
                         }
                         if (!bs->disable_journal_fsync)
                         {
-                            GET_SQE();
-                            data->iov = { 0 };
-                            data->callback = simple_callback;
-                            my_uring_prep_fsync(sqe, bs->journal.fd, IORING_FSYNC_DATASYNC);
-                            wait_count++;
+                            for (int i = 0; i < bs->journal.device_count(); i++)
+                            {
+                                GET_SQE();
+                                data->iov = { 0 };
+                                data->callback = simple_callback;
+                                bs->ringloop->prep_fsync(sqe, bs->journal.device_fd(i), IORING_FSYNC_DATASYNC);
+                                wait_count++;
+                            }
                             bs->ringloop->submit();
                         }
                     resume_5:
@@ -486,18 +578,23 @@ resume_1:
                             return 1;
                         }
                     }
-                    // wait for the next read to complete, then stop
+                    // wait for the remaining read-ahead requests to complete, then stop
                 resume_3:
-                    if (submitted_buf)
+                    if (reads_submitted > 0)
                     {
                         wait_state = 3;
                         return 1;
                     }
                     // free buffers
                     if (!bs->journal.inmemory)
+                    {
                         for (auto & e: done)
                             free(e.buf);
+                        for (auto & rd: reads)
+                            free(rd.buf);
+                    }
                     done.clear();
+                    reads.clear();
                     break;
                 }
                 else if (handle_res == 1)
@@ -515,11 +612,80 @@ resume_1:
                     break;
                 }
             }
-            if (!submitted_buf)
+            if (!reads.size())
             {
                 break;
             }
+            if (!reads.front().done)
+            {
+                wait_state = 2;
+                return 1;
+            }
         }
+        timespec replay_end;
+        clock_gettime(CLOCK_MONOTONIC, &replay_end);
+        double replay_time = (replay_end.tv_sec - replay_start.tv_sec) + (replay_end.tv_nsec - replay_start.tv_nsec) / 1000000000.0;
+        printf(
+            "Journal read: %lu MB in %.3f s (%.1f MB/s)\n", bytes_read / 1024 / 1024, replay_time,
+            replay_time > 0 ? bytes_read / 1024.0 / 1024.0 / replay_time : 0.0
+        );
+    }
+    if (!bs->readonly && (bs->checkpoint_path != "" || bs->journal.generation != 0))
+    {
+        // Change checkpoint generation before the metadata may be modified, so that
+        // the checkpoint saved by the previous run can't be loaded after it
+        if (bs->checkpoint_path == "")
+            bs->journal.generation = 0;
+        else if (!++bs->journal.generation)
+            bs->journal.generation = 1;
+        if (!bs->journal.inmemory)
+            submitted_buf = memalign_or_die(MEM_ALIGNMENT, bs->journal.block_size);
+        else
+            submitted_buf = bs->journal.buffer;
+        memset(submitted_buf, 0, bs->journal.block_size);
+        *((journal_entry_start*)submitted_buf) = {
+            .crc32 = 0,
+            .magic = JOURNAL_MAGIC,
+            .type = JE_START,
+            .size = sizeof(journal_entry_start),
+            .generation = bs->journal.generation,
+            .journal_start = bs->journal.used_start,
+            .version = JOURNAL_VERSION,
+        };
+        ((journal_entry_start*)submitted_buf)->crc32 = je_crc32((journal_entry*)submitted_buf);
+        GET_SQE();
+        data->iov = (struct iovec){ submitted_buf, bs->journal.block_size };
+        data->callback = simple_callback;
+        bs->ringloop->prep_writev(sqe, bs->journal.fd, &data->iov, 1, bs->journal.offset, bs->journal_rw_flags);
+        wait_count++;
+        bs->ringloop->submit();
+    resume_8:
+        if (wait_count > 0)
+        {
+            wait_state = 8;
+            return 1;
+        }
+        if (!bs->disable_journal_fsync)
+        {
+            for (int i = 0; i < bs->journal.device_count(); i++)
+            {
+                GET_SQE();
+                bs->ringloop->prep_fsync(sqe, bs->journal.device_fd(i), IORING_FSYNC_DATASYNC);
+                data->iov = { 0 };
+                data->callback = simple_callback;
+                wait_count++;
+            }
+            bs->ringloop->submit();
+        }
+    resume_9:
+        if (wait_count > 0)
+        {
+            wait_state = 9;
+            return 1;
+        }
+        if (!bs->journal.inmemory)
+            free(submitted_buf);
+        submitted_buf = NULL;
     }
     for (auto ov: double_allocs)
     {
@@ -598,11 +764,8 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
 #endif
                 // oid, version, offset, len
                 uint64_t prev_free = next_free;
-                if (next_free + je->small_write.len > bs->journal.len)
-                {
-                    // data continues from the beginning of the journal
-                    next_free = bs->journal.block_size;
-                }
+                // data may continue from the beginning of the journal or from the next journal stripe
+                next_free = bs->journal.data_location(next_free, je->small_write.len);
                 uint64_t location = next_free;
                 next_free += je->small_write.len;
                 if (next_free >= bs->journal.len)
@@ -656,9 +819,9 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                     init_write_sector = proc_pos;
                     return 0;
                 }
-                auto clean_it = bs->clean_db.find(je->small_write.oid);
-                if (clean_it == bs->clean_db.end() ||
-                    clean_it->second.version < je->small_write.version)
+                clean_entry clean;
+                if (!bs->clean_db.get(je->small_write.oid, &clean) ||
+                    clean.version < je->small_write.version)
                 {
                     obj_ver_id ov = {
                         .oid = je->small_write.oid,
@@ -666,7 +829,7 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                     };
                     void *bmp = NULL;
                     void *bmp_from = (void*)je + sizeof(journal_entry_small_write);
-                    if (bs->clean_entry_bitmap_size <= sizeof(void*))
+                    if (bs->dirty_dyn_size <= sizeof(void*))
                     {
                         memcpy(&bmp, bmp_from, bs->clean_entry_bitmap_size);
                     }
@@ -676,7 +839,7 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                         // allocations for entry bitmaps. This can only be fixed by using
                         // a patched map with dynamic entry size, but not the btree_map,
                         // because it doesn't keep iterators valid all the time.
-                        bmp = malloc_or_die(bs->clean_entry_bitmap_size);
+                        bmp = calloc_or_die(1, bs->dirty_dyn_size);
                         memcpy(bmp, bmp_from, bs->clean_entry_bitmap_size);
                     }
                     bs->dirty_db.emplace(ov, (dirty_entry){
@@ -735,9 +898,9 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                         erase_dirty_object(dirty_it);
                     }
                 }
-                auto clean_it = bs->clean_db.find(je->big_write.oid);
-                if (clean_it == bs->clean_db.end() ||
-                    clean_it->second.version < je->big_write.version)
+                clean_entry clean;
+                if (!bs->clean_db.get(je->big_write.oid, &clean) ||
+                    clean.version < je->big_write.version)
                 {
                     // oid, version, block
                     obj_ver_id ov = {
@@ -745,10 +908,11 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                         .version = je->big_write.version,
                     };
                     void *bmp = NULL;
+                    // Big write entries also carry data checksums after the bitmap
                     void *bmp_from = (void*)je + sizeof(journal_entry_big_write);
-                    if (bs->clean_entry_bitmap_size <= sizeof(void*))
+                    if (bs->dirty_dyn_size <= sizeof(void*))
                     {
-                        memcpy(&bmp, bmp_from, bs->clean_entry_bitmap_size);
+                        memcpy(&bmp, bmp_from, bs->dirty_dyn_size);
                     }
                     else
                     {
@@ -756,8 +920,8 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                         // allocations for entry bitmaps. This can only be fixed by using
                         // a patched map with dynamic entry size, but not the btree_map,
                         // because it doesn't keep iterators valid all the time.
-                        bmp = malloc_or_die(bs->clean_entry_bitmap_size);
-                        memcpy(bmp, bmp_from, bs->clean_entry_bitmap_size);
+                        bmp = malloc_or_die(bs->dirty_dyn_size);
+                        memcpy(bmp, bmp_from, bs->dirty_dyn_size);
                     }
                     auto dirty_it = bs->dirty_db.emplace(ov, (dirty_entry){
                         .state = (BS_ST_BIG_WRITE | BS_ST_SYNCED),
@@ -826,6 +990,27 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                 };
                 bs->mark_rolled_back(ov);
             }
+            else if (je->type == JE_STABLE_MULTI || je->type == JE_ROLLBACK_MULTI)
+            {
+                const uint8_t *item = je->multi.data, *end = (uint8_t*)je + je->size;
+                obj_ver_id ov = { 0 };
+                for (uint32_t i = 0; i < je->multi.count; i++)
+                {
+                    if (!je_multi_decode(item, end, ov))
+                    {
+                        printf("Journal entry at %08lx is corrupt: bad object version list\n", proc_pos);
+                        exit(1);
+                    }
+#ifdef BLOCKSTORE_DEBUG
+                    printf("je_%s oid=%lx:%lx ver=%lu\n", je->type == JE_STABLE_MULTI ? "stable" : "rollback",
+                        ov.oid.inode, ov.oid.stripe, ov.version);
+#endif
+                    if (je->type == JE_STABLE_MULTI)
+                        bs->mark_stable(ov, true);
+                    else
+                        bs->mark_rolled_back(ov);
+                }
+            }
             else if (je->type == JE_DELETE)
             {
 #ifdef BLOCKSTORE_DEBUG
@@ -841,9 +1026,9 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                     dirty_it--;
                     dirty_exists = dirty_it->first.oid == je->del.oid;
                 }
-                auto clean_it = bs->clean_db.find(je->del.oid);
-                bool clean_exists = (clean_it != bs->clean_db.end() &&
-                    clean_it->second.version < je->del.version);
+                clean_entry clean;
+                bool clean_exists = (bs->clean_db.get(je->del.oid, &clean) &&
+                    clean.version < je->del.version);
                 if (!clean_exists && dirty_exists)
                 {
                     // Clean entry doesn't exist. This means that the delete is already flushed.
@@ -901,9 +1086,9 @@ void blockstore_init_journal::erase_dirty_object(blockstore_dirty_db_t::iterator
             break;
         }
     }
-    auto clean_it = bs->clean_db.find(oid);
-    uint64_t clean_loc = clean_it != bs->clean_db.end()
-        ? clean_it->second.location : UINT64_MAX;
+    clean_entry clean;
+    uint64_t clean_loc = bs->clean_db.get(oid, &clean)
+        ? clean.location : UINT64_MAX;
     if (exists && clean_loc == UINT64_MAX)
     {
         bs->inode_space_stats[oid.inode] -= bs->block_size;
@@ -3,6 +3,21 @@
 
 #pragma once
 
+struct bs_init_meta_read
+{
+    void *buf;
+    uint64_t pos, len;
+    int buf_index;
+    bool done;
+};
+
+struct bs_init_meta_entry
+{
+    object_id oid;
+    uint64_t version;
+    uint64_t block;
+};
+
 class blockstore_init_meta
 {
     blockstore_impl_t *bs;
@@ -10,13 +25,18 @@ class blockstore_init_meta
     bool zero_on_init = false;
     void *metadata_buffer = NULL;
     uint64_t metadata_read = 0;
-    int prev = 0, prev_done = 0, done_len = 0, submitted = 0;
-    uint64_t done_cnt = 0, done_pos = 0;
+    int submitted = 0;
+    uint64_t done_cnt = 0;
     uint64_t entries_loaded = 0;
+    // Metadata area is read with several requests in flight, and parsed in order
+    std::deque<bs_init_meta_read> reads;
+    std::vector<int> free_bufs;
+    std::vector<bs_init_meta_entry> sorted_entries;
     struct io_uring_sqe *sqe;
     struct ring_data_t *data;
-    void handle_entries(void *entries, unsigned count, int block_order);
+    void handle_entries(void *buf, uint64_t len, int block_order);
     void handle_event(ring_data_t *data);
+    void handle_read_event(ring_data_t *data, bs_init_meta_read *rd);
 public:
     blockstore_init_meta(blockstore_impl_t *bs);
     int loop();
@@ -28,6 +48,13 @@ struct bs_init_journal_done
     uint64_t pos, len;
 };
 
+struct bs_init_journal_read
+{
+    void *buf;
+    uint64_t pos, len;
+    bool done;
+};
+
 class blockstore_init_journal
 {
     blockstore_impl_t *bs;
@@ -37,19 +64,24 @@ class blockstore_init_journal
     bool started = false;
     uint64_t next_free;
     std::vector<bs_init_journal_done> done;
+    // Journal is read ahead with several requests in flight, completed reads are moved to <done> in order
+    std::deque<bs_init_journal_read> reads;
+    int reads_submitted = 0;
+    uint64_t bytes_read = 0;
+    timespec replay_start;
     std::vector<obj_ver_id> double_allocs;
     uint64_t journal_pos = 0;
     uint64_t continue_pos = 0;
     void *init_write_buf = NULL;
     uint64_t init_write_sector = 0;
     bool wrapped = false;
-    void *submitted_buf;
+    void *submitted_buf = NULL;
     struct io_uring_sqe *sqe;
     struct ring_data_t *data;
     journal_entry_start *je_start;
-    std::function<void(ring_data_t*)> simple_callback;
+    ring_callback_t simple_callback;
     int handle_journal_part(void *buf, uint64_t done_pos, uint64_t len);
-    void handle_event(ring_data_t *data);
+    void handle_event(ring_data_t *data, bs_init_journal_read *rd);
     void erase_dirty_object(blockstore_dirty_db_t::iterator dirty_it);
 public:
     blockstore_init_journal(blockstore_impl_t* bs);
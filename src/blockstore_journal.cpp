@@ -1,6 +1,8 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <sys/mman.h>
+#include <algorithm>
 #include "blockstore_impl.h"
 
 blockstore_journal_check_t::blockstore_journal_check_t(blockstore_impl_t *bs)
@@ -55,6 +57,12 @@ int blockstore_journal_check_t::check_available(blockstore_op_t *op, int entries
         next_sector = ((next_sector + 1) % bs->journal.sector_count);
         if (next_sector == first_sector)
         {
+            if (bs->journal.grow_sector_buffers())
+            {
+                // Retry with more buffers
+                PRIV(op)->wait_for = WAIT_JOURNAL_BUFFER;
+                return 0;
+            }
             // next_sector may wrap when all sectors are flushed and the incoming batch is too big
             // This is an error condition, we can't wait for anything in this case
             throw std::runtime_error(
@@ -66,6 +74,11 @@ int blockstore_journal_check_t::check_available(blockstore_op_t *op, int entries
             bs->journal.sector_info[next_sector].dirty)
         {
             // No memory buffer available. Wait for it.
+            PRIV(op)->wait_for = WAIT_JOURNAL_BUFFER;
+            if (bs->journal.grow_sector_buffers())
+            {
+                return 0;
+            }
             int used = 0, dirty = 0;
             for (int i = 0; i < bs->journal.sector_count; i++)
             {
@@ -82,23 +95,22 @@ int blockstore_journal_check_t::check_available(blockstore_op_t *op, int entries
             // In fact, it's even more rare than "ran out of journal space", so print a warning
             printf(
                 "Ran out of journal sector buffers: %d/%lu buffers used (%d dirty), next buffer (%ld)"
-                " is %s and flushed %lu times. Consider increasing \'journal_sector_buffer_count\'\n",
+                " is %s and flushed %lu times. Consider increasing \'journal_sector_buffer_max\'\n",
                 used, bs->journal.sector_count, dirty, next_sector,
                 bs->journal.sector_info[next_sector].dirty ? "dirty" : "not dirty",
                 bs->journal.sector_info[next_sector].flush_count
             );
-            PRIV(op)->wait_for = WAIT_JOURNAL_BUFFER;
             return 0;
         }
     }
     if (data_after > 0)
     {
-        next_pos = next_pos + data_after;
-        if (next_pos > bs->journal.len)
+        uint64_t data_pos = bs->journal.data_location(next_pos, data_after);
+        if (data_pos < next_pos)
         {
-            next_pos = bs->journal.block_size + data_after;
             right_dir = false;
         }
+        next_pos = data_pos + data_after;
     }
     if (!right_dir && next_pos >= bs->journal.used_start-bs->journal.block_size)
     {
@@ -153,22 +165,155 @@ journal_entry* prefill_single_journal_entry(journal_t & journal, uint16_t type,
     return je;
 }
 
-void prepare_journal_sector_write(journal_t & journal, int cur_sector, io_uring_sqe *sqe, std::function<void(ring_data_t*)> cb)
+// Prepare the write of a journal sector. With <batch>, a sector adjacent to the previous one both on disk
+// and in memory is appended to its write: <sqe> isn't used then and false is returned
+bool blockstore_impl_t::prepare_journal_sector_write(int cur_sector, io_uring_sqe *sqe, ring_callback_t cb, journal_sector_batch_t *batch)
 {
     journal.sector_info[cur_sector].dirty = false;
     journal.sector_info[cur_sector].written = true;
     journal.sector_info[cur_sector].flush_count++;
+    void *buf = (journal.inmemory
+        ? journal.buffer + journal.sector_info[cur_sector].offset
+        : journal.sector_buf + journal.block_size*cur_sector);
+    if (batch && batch->sqe)
+    {
+        ring_data_t *data = ((ring_data_t*)batch->sqe->user_data);
+        if (batch->offset + data->iov.iov_len == journal.sector_info[cur_sector].offset &&
+            (uint8_t*)data->iov.iov_base + data->iov.iov_len == buf &&
+            journal.same_stripe(batch->offset, data->iov.iov_len + journal.block_size))
+        {
+            // Prepare the previous SQE again with the extended buffer
+            data->iov.iov_len += journal.block_size;
+            data->passthru = false;
+            ringloop->prep_writev(
+                batch->sqe, journal.pos_fd(batch->offset), &data->iov, 1, journal.pos_offset(batch->offset), journal_rw_flags
+            );
+            return false;
+        }
+    }
     ring_data_t *data = ((ring_data_t*)sqe->user_data);
-    data->iov = (struct iovec){
-        (journal.inmemory
-            ? journal.buffer + journal.sector_info[cur_sector].offset
-            : journal.sector_buf + journal.block_size*cur_sector),
-        journal.block_size
-    };
+    data->iov = (struct iovec){ buf, journal.block_size };
     data->callback = cb;
-    my_uring_prep_writev(
-        sqe, journal.fd, &data->iov, 1, journal.offset + journal.sector_info[cur_sector].offset
+    ringloop->prep_writev(
+        sqe, journal.pos_fd(journal.sector_info[cur_sector].offset), &data->iov, 1,
+        journal.pos_offset(journal.sector_info[cur_sector].offset), journal_rw_flags
     );
+    if (batch)
+    {
+        batch->sqe = sqe;
+        batch->offset = journal.sector_info[cur_sector].offset;
+    }
+    return true;
+}
+
+// Prepare JE_STABLE_MULTI or JE_ROLLBACK_MULTI entries for all object versions from <op>.
+// All entries are padded to the same size so that check_available() can count sectors exactly.
+// Returns 0 if the op must wait for journal space or SQEs, 1 if the writes are prepared
+int blockstore_impl_t::prepare_multi_journal_entries(blockstore_op_t *op, uint16_t type, ring_callback_t cb)
+{
+    std::vector<obj_ver_id> list((obj_ver_id*)op->buf, (obj_ver_id*)op->buf + op->len);
+    std::sort(list.begin(), list.end());
+    // Encode versions into chunks, each one fitting into a journal sector
+    uint32_t max_payload = journal.block_size - sizeof(journal_entry_multi);
+    std::vector<uint8_t> encoded(list.size() * JE_MULTI_MAX_ITEM);
+    std::vector<uint32_t> chunk_pos, chunk_count;
+    obj_ver_id prev = { 0 };
+    uint32_t pos = 0;
+    for (auto & ov: list)
+    {
+        uint8_t item[JE_MULTI_MAX_ITEM];
+        int len = je_multi_encode(item, prev, ov);
+        if (!chunk_pos.size() || pos + len - chunk_pos.back() > max_payload)
+        {
+            // Start a new entry, every entry is decoded independently
+            chunk_pos.push_back(pos);
+            chunk_count.push_back(0);
+            prev = { 0 };
+            len = je_multi_encode(item, prev, ov);
+        }
+        memcpy(encoded.data() + pos, item, len);
+        pos += len;
+        chunk_count.back()++;
+        prev = ov;
+    }
+    chunk_pos.push_back(pos);
+    int entries = chunk_count.size();
+    uint32_t entry_size = entries > 1 ? journal.block_size : sizeof(journal_entry_multi) + pos;
+    // Check journal space
+    blockstore_journal_check_t space_check(this);
+    if (!space_check.check_available(op, entries, entry_size, 0))
+    {
+        return 0;
+    }
+    // There is sufficient space. Get SQEs
+    struct io_uring_sqe *sqe[space_check.sectors_to_write];
+    for (int i = 0; i < space_check.sectors_to_write; i++)
+    {
+        BS_SUBMIT_GET_SQE_DECL(sqe[i]);
+    }
+    // Prepare and submit journal entries
+    int s = 0, cur_sector = -1;
+    journal_sector_batch_t batch;
+    for (int i = 0; i < entries; i++)
+    {
+        if (!journal.entry_fits(entry_size) &&
+            journal.sector_info[journal.cur_sector].dirty)
+        {
+            if (cur_sector == -1)
+                PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
+            if (prepare_journal_sector_write(journal.cur_sector, sqe[s], cb, &batch))
+                s++;
+            cur_sector = journal.cur_sector;
+        }
+        journal_entry_multi *je = (journal_entry_multi*)prefill_single_journal_entry(journal, type, entry_size);
+        je->count = chunk_count[i];
+        uint32_t len = chunk_pos[i+1] - chunk_pos[i];
+        memcpy(je->data, encoded.data() + chunk_pos[i], len);
+        memset(je->data + len, 0, entry_size - sizeof(journal_entry_multi) - len);
+        je->crc32 = je_crc32((journal_entry*)je);
+        journal.crc32_last = je->crc32;
+    }
+    if (prepare_journal_sector_write(journal.cur_sector, sqe[s], cb, &batch))
+        s++;
+    // Return SQEs left unused because adjacent sectors were merged into one write
+    ringloop->restore(ringloop->save() - (space_check.sectors_to_write - s));
+    if (cur_sector == -1)
+        PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
+    PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
+    PRIV(op)->pending_ops = s;
+    return 1;
+}
+
+// Position of <data_len> bytes of small write data written at <pos> or after it: data doesn't wrap
+// around the end of the journal and, when the journal is striped, doesn't cross stripe boundaries
+uint64_t journal_t::data_location(uint64_t pos, uint64_t data_len)
+{
+    if (pos + data_len > len)
+    {
+        pos = block_size;
+    }
+    if (!same_stripe(pos, data_len) && data_len <= stripe_size)
+    {
+        pos = (pos / stripe_size + 1) * stripe_size;
+        if (pos + data_len > len)
+        {
+            // stripe_size is at least block_size + data block size so the data fits into the first stripe
+            pos = block_size;
+        }
+    }
+    return pos;
+}
+
+// Double the number of sector buffers in use, up to sector_max. It's only done when the last buffer
+// isn't being written, so that sector ranges of in-flight writes don't wrap around the old count
+bool journal_t::grow_sector_buffers()
+{
+    if (sector_count >= sector_max || sector_info[sector_count-1].flush_count > 0)
+    {
+        return false;
+    }
+    sector_count = sector_count*2 < sector_max ? sector_count*2 : sector_max;
+    return true;
 }
 
 journal_t::~journal_t()
@@ -179,6 +324,9 @@ journal_t::~journal_t()
         free(sector_info);
     if (buffer)
         free(buffer);
+    for (auto & map: dax_maps)
+        munmap(map.addr, map.size);
+    dax_maps.clear();
     sector_buf = NULL;
     sector_info = NULL;
     buffer = NULL;
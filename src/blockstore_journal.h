@@ -27,7 +27,9 @@
 #define JE_ROLLBACK    0x06
 #define JE_SMALL_WRITE_INSTANT 0x07
 #define JE_BIG_WRITE_INSTANT   0x08
-#define JE_MAX         0x08
+#define JE_STABLE_MULTI        0x09
+#define JE_ROLLBACK_MULTI      0x0A
+#define JE_MAX         0x0A
 
 // crc32c comes first to ease calculation and is equal to crc32()
 struct __attribute__((__packed__)) journal_entry_start
@@ -36,7 +38,8 @@ struct __attribute__((__packed__)) journal_entry_start
     uint16_t magic;
     uint16_t type;
     uint32_t size;
-    uint32_t reserved;
+    // Generation of the clean_db checkpoint matching the metadata area, 0 if there is none
+    uint32_t generation;
     uint64_t journal_start;
     uint64_t version;
 };
@@ -76,6 +79,8 @@ struct __attribute__((__packed__)) journal_entry_big_write
     uint64_t location;
     // small_write and big_write entries are followed by the "external" bitmap
     // its size is dynamic and included in journal entry's <size> field
+    // big_write entries are then followed by crc32c of every bitmap_granularity block
+    // of the object when data checksums are enabled
     uint8_t bitmap[];
 };
 
@@ -101,6 +106,70 @@ struct __attribute__((__packed__)) journal_entry_rollback
     uint64_t version;
 };
 
+// Several stabilized or rolled back object versions in one entry
+struct __attribute__((__packed__)) journal_entry_multi
+{
+    uint32_t crc32;
+    uint16_t magic;
+    uint16_t type;
+    uint32_t size;
+    uint32_t crc32_prev;
+    uint32_t count;
+    // Followed by <count> object versions sorted by object ID, each encoded as 3 varints:
+    // inode delta from the previous one, stripe (delta from the previous one if inode is the same)
+    // and version. The rest of the entry up to <size> is zero padding
+    uint8_t data[];
+};
+
+// Maximum length of one encoded object version in journal_entry_multi
+#define JE_MULTI_MAX_ITEM 30
+
+inline int je_multi_put_varint(uint8_t *buf, uint64_t v)
+{
+    int n = 0;
+    while (v >= 0x80)
+    {
+        buf[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+inline bool je_multi_get_varint(const uint8_t *&buf, const uint8_t *end, uint64_t & v)
+{
+    v = 0;
+    for (int shift = 0; buf < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *(buf++);
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline int je_multi_encode(uint8_t *buf, const obj_ver_id & prev, const obj_ver_id & ov)
+{
+    int n = je_multi_put_varint(buf, ov.oid.inode - prev.oid.inode);
+    n += je_multi_put_varint(buf+n, ov.oid.inode == prev.oid.inode ? ov.oid.stripe - prev.oid.stripe : ov.oid.stripe);
+    n += je_multi_put_varint(buf+n, ov.version);
+    return n;
+}
+
+inline bool je_multi_decode(const uint8_t *&buf, const uint8_t *end, obj_ver_id & ov)
+{
+    uint64_t inode_delta, stripe, version;
+    if (!je_multi_get_varint(buf, end, inode_delta) ||
+        !je_multi_get_varint(buf, end, stripe) ||
+        !je_multi_get_varint(buf, end, version))
+        return false;
+    ov.oid.stripe = inode_delta ? stripe : ov.oid.stripe + stripe;
+    ov.oid.inode += inode_delta;
+    ov.version = version;
+    return true;
+}
+
 struct __attribute__((__packed__)) journal_entry_del
 {
     uint32_t crc32;
@@ -130,6 +199,7 @@ struct __attribute__((__packed__)) journal_entry
         journal_entry_stable stable;
         journal_entry_rollback rollback;
         journal_entry_del del;
+        journal_entry_multi multi;
     };
 };
 
@@ -147,10 +217,32 @@ struct journal_sector_info_t
     bool dirty;
 };
 
+// Previous sector write of an operation writing multiple journal sectors,
+// the next sector is appended to it if it's adjacent on disk and in memory
+struct journal_sector_batch_t
+{
+    io_uring_sqe *sqe = NULL;
+    uint64_t offset = 0;
+};
+
+// Journal device mapped into memory with DAX
+struct journal_dax_map_t
+{
+    int fd;
+    void *addr;
+    uint64_t size;
+};
+
 struct journal_t
 {
     int fd;
     uint64_t device_size;
+    // Journal striped over multiple devices: stripe_size chunks of the journal are placed
+    // on stripe_fds round-robin, stripe_fds[0] == fd. Empty if there is only one device
+    std::vector<int> stripe_fds;
+    uint64_t stripe_size = 0;
+    // DAX mappings of journal devices, their I/O is done by ring_loop_t with CPU loads and stores
+    std::vector<journal_dax_map_t> dax_maps;
     bool inmemory = false;
     bool flush_journal = false;
     void *buffer = NULL;
@@ -164,11 +256,15 @@ struct journal_t
     // End of the last block not used for writing anymore
     uint64_t dirty_start = 0;
     uint32_t crc32_last = 0;
+    // clean_db checkpoint generation, stored in the journal superblock
+    uint32_t generation = 0;
 
     // Current sector(s) used for writing
     void *sector_buf = NULL;
     journal_sector_info_t *sector_info = NULL;
     uint64_t sector_count;
+    // Buffers are allocated for sector_max sectors, sector_count grows up to it when they run out
+    uint64_t sector_max = 0;
     bool no_same_sector_overwrites = false;
     int cur_sector = 0;
     int in_sector_pos = 0;
@@ -181,11 +277,38 @@ struct journal_t
     bool trim();
     uint64_t get_trim_pos();
     void dump_diagnostics();
+    bool grow_sector_buffers();
+    uint64_t data_location(uint64_t pos, uint64_t data_len);
     inline bool entry_fits(int size)
     {
         return !(block_size - in_sector_pos < size ||
             no_same_sector_overwrites && sector_info[cur_sector].written);
     }
+    // Journal devices, they all have to be fsynced to make journal writes durable
+    inline int device_count()
+    {
+        return stripe_fds.size() > 1 ? stripe_fds.size() : 1;
+    }
+    inline int device_fd(int i)
+    {
+        return stripe_fds.size() > 1 ? stripe_fds[i] : fd;
+    }
+    // Device and device offset of the journal position <pos>
+    inline int pos_fd(uint64_t pos)
+    {
+        return stripe_fds.size() > 1 ? stripe_fds[(pos / stripe_size) % stripe_fds.size()] : fd;
+    }
+    inline uint64_t pos_offset(uint64_t pos)
+    {
+        return offset + (stripe_fds.size() > 1
+            ? (pos / stripe_size / stripe_fds.size()) * stripe_size + pos % stripe_size
+            : pos);
+    }
+    // Check if <data_len> bytes at <pos> are on the same device and may be written with one request
+    inline bool same_stripe(uint64_t pos, uint64_t data_len)
+    {
+        return stripe_fds.size() <= 1 || !data_len || pos / stripe_size == (pos + data_len - 1) / stripe_size;
+    }
 };
 
 struct blockstore_journal_check_t
@@ -200,5 +323,3 @@ struct blockstore_journal_check_t
 };
 
 journal_entry* prefill_single_journal_entry(journal_t & journal, uint16_t type, uint32_t size);
-
-void prepare_journal_sector_write(journal_t & journal, int sector, io_uring_sqe *sqe, std::function<void(ring_data_t*)> cb);
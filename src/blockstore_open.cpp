@@ -2,6 +2,10 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <libgen.h>
+#include <limits.h>
 #include "blockstore_impl.h"
 
 static uint32_t is_power_of_two(uint64_t value)
@@ -19,6 +23,40 @@ static uint32_t is_power_of_two(uint64_t value)
     return l;
 }
 
+static std::string read_sysfs(const std::string & path)
+{
+    char buf[256];
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return "";
+    int r = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (r <= 0)
+        return "";
+    while (r > 0 && (buf[r-1] == '\n' || buf[r-1] == ' '))
+        r--;
+    return std::string(buf, r);
+}
+
+// Get the sysfs directory of the whole disk which block device <fd> is or is a partition of
+static std::string get_sysfs_disk(int fd, uint64_t *start)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode))
+        return "";
+    char sys_path[PATH_MAX];
+    std::string link = "/sys/dev/block/"+std::to_string(major(st.st_rdev))+":"+std::to_string(minor(st.st_rdev));
+    if (!realpath(link.c_str(), sys_path))
+        return "";
+    *start = 0;
+    if (read_sysfs(std::string(sys_path)+"/partition") != "")
+    {
+        *start = strtoull(read_sysfs(std::string(sys_path)+"/start").c_str(), NULL, 10) * 512;
+        return dirname(sys_path);
+    }
+    return sys_path;
+}
+
 void blockstore_impl_t::parse_config(blockstore_config_t & config)
 {
     // Parse
@@ -64,9 +102,13 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     meta_offset = strtoull(config["meta_offset"].c_str(), NULL, 10);
     block_size = strtoull(config["block_size"].c_str(), NULL, 10);
     inmemory_meta = config["inmemory_metadata"] != "false";
+    use_hugepages = config["use_hugepages"] == "true" || config["use_hugepages"] == "1" || config["use_hugepages"] == "yes";
     journal_device = config["journal_device"];
     journal.offset = strtoull(config["journal_offset"].c_str(), NULL, 10);
+    journal.stripe_size = strtoull(config["journal_stripe_size"].c_str(), NULL, 10);
     journal.sector_count = strtoull(config["journal_sector_buffer_count"].c_str(), NULL, 10);
+    journal.sector_max = config["journal_sector_buffer_max"] != ""
+        ? strtoull(config["journal_sector_buffer_max"].c_str(), NULL, 10) : 1024;
     journal.no_same_sector_overwrites = config["journal_no_same_sector_overwrites"] == "true" ||
         config["journal_no_same_sector_overwrites"] == "1" || config["journal_no_same_sector_overwrites"] == "yes";
     journal.inmemory = config["inmemory_journal"] != "false";
@@ -78,12 +120,68 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     if (!max_flusher_count)
         max_flusher_count = strtoull(config["flusher_count"].c_str(), NULL, 10);
     min_flusher_count = strtoull(config["min_flusher_count"].c_str(), NULL, 10);
+    if (config["flusher_fill_low"] != "")
+        flusher_fill_low = strtoull(config["flusher_fill_low"].c_str(), NULL, 10);
+    if (config["flusher_fill_high"] != "")
+        flusher_fill_high = strtoull(config["flusher_fill_high"].c_str(), NULL, 10);
+    flusher_target_latency_us = strtoull(config["flusher_target_latency_us"].c_str(), NULL, 10);
+    flusher_sort_window = strtoull(config["flusher_sort_window"].c_str(), NULL, 10);
     max_write_iodepth = strtoull(config["max_write_iodepth"].c_str(), NULL, 10);
-    throttle_small_writes = config["throttle_small_writes"] == "true" || config["throttle_small_writes"] == "1" || config["throttle_small_writes"] == "yes";
+    max_read_iodepth = strtoull(config["max_read_iodepth"].c_str(), NULL, 10);
+    meta_read_iodepth = strtoull(config["meta_read_iodepth"].c_str(), NULL, 10);
+    journal_read_iodepth = strtoull(config["journal_read_iodepth"].c_str(), NULL, 10);
+    checkpoint_path = config["clean_db_checkpoint"];
+    compact_clean_db = config["compact_clean_db"] == "true" || config["compact_clean_db"] == "1" || config["compact_clean_db"] == "yes";
+    journal_write_batch = strtoull(config["journal_write_batch"].c_str(), NULL, 10);
+    read_cache_size = strtoull(config["read_cache_size"].c_str(), NULL, 10);
+    sync_max_delay_us = strtoull(config["sync_max_delay_us"].c_str(), NULL, 10);
+    journal_multi_entries = config["journal_multi_entries"] == "true" || config["journal_multi_entries"] == "1" || config["journal_multi_entries"] == "yes";
+    throttle_auto = config["throttle_small_writes"] == "auto";
+    throttle_small_writes = throttle_auto || config["throttle_small_writes"] == "true" ||
+        config["throttle_small_writes"] == "1" || config["throttle_small_writes"] == "yes";
     throttle_target_iops = strtoull(config["throttle_target_iops"].c_str(), NULL, 10);
     throttle_target_mbs = strtoull(config["throttle_target_mbs"].c_str(), NULL, 10);
     throttle_target_parallelism = strtoull(config["throttle_target_parallelism"].c_str(), NULL, 10);
     throttle_threshold_us = strtoull(config["throttle_threshold_us"].c_str(), NULL, 10);
+    nvme_passthrough = config["nvme_passthrough"] == "true" || config["nvme_passthrough"] == "1" || config["nvme_passthrough"] == "yes";
+    nvme_fua = config["nvme_fua"] == "true" || config["nvme_fua"] == "1" || config["nvme_fua"] == "yes";
+    journal_dax = config["journal_dax"] == "true" || config["journal_dax"] == "1" || config["journal_dax"] == "yes";
+    if (config["data_csum_type"] == "crc32c")
+    {
+        data_csum_type = BLOCKSTORE_CSUM_CRC32C;
+    }
+    else if (config["data_csum_type"] != "" && config["data_csum_type"] != "none")
+    {
+        throw std::runtime_error("data_csum_type must be one of \"none\" or \"crc32c\"");
+    }
+    data_compression = config["data_compression"] == "true" || config["data_compression"] == "1" || config["data_compression"] == "yes";
+    const char *prio_names[BS_PRIO_COUNT] = { "client", "recovery", "scrub" };
+    for (int i = 0; i < BS_PRIO_COUNT; i++)
+    {
+        if (config["prio_weight_"+std::string(prio_names[i])] != "")
+            prio_weight[i] = strtoull(config["prio_weight_"+std::string(prio_names[i])].c_str(), NULL, 10);
+        prio_max_iodepth[i] = strtoull(config["prio_max_iodepth_"+std::string(prio_names[i])].c_str(), NULL, 10);
+        if (!prio_weight[i])
+            throw std::runtime_error("prio_weight_"+std::string(prio_names[i])+" must be positive");
+    }
+    discard_on_free = config["discard_on_free"] == "true" || config["discard_on_free"] == "1" || config["discard_on_free"] == "yes";
+    if (config["discard_max_rate"] != "")
+        discard_max_rate = strtoull(config["discard_max_rate"].c_str(), NULL, 10) * 1024 * 1024;
+    if (config["discard_interval_ms"] != "")
+        discard_interval_ms = strtoull(config["discard_interval_ms"].c_str(), NULL, 10);
+    small_object_size = strtoull(config["small_object_size"].c_str(), NULL, 10);
+    if (config["csum_verify_rate"] != "")
+    {
+        csum_verify_rate = strtod(config["csum_verify_rate"].c_str(), NULL);
+    }
+    if (config["journal_fua"] == "auto")
+    {
+        journal_fua = JOURNAL_FUA_AUTO;
+    }
+    else if (config["journal_fua"] == "true" || config["journal_fua"] == "1" || config["journal_fua"] == "yes")
+    {
+        journal_fua = JOURNAL_FUA_ALWAYS;
+    }
     // Validate
     if (!block_size)
     {
@@ -101,10 +199,30 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     {
         min_flusher_count = 1;
     }
+    if (flusher_fill_low < 0 || flusher_fill_high > 100 || flusher_fill_low >= flusher_fill_high)
+    {
+        throw std::runtime_error("flusher_fill_low and flusher_fill_high must satisfy 0 <= low < high <= 100");
+    }
     if (!max_write_iodepth)
     {
         max_write_iodepth = 128;
     }
+    if (!max_read_iodepth)
+    {
+        max_read_iodepth = 128;
+    }
+    if (!meta_read_iodepth)
+    {
+        meta_read_iodepth = 4;
+    }
+    if (!journal_read_iodepth)
+    {
+        journal_read_iodepth = 4;
+    }
+    if (!journal_write_batch)
+    {
+        journal_write_batch = 32;
+    }
     if (!disk_alignment)
     {
         disk_alignment = 4096;
@@ -145,6 +263,15 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     {
         throw std::runtime_error("Block size must be a multiple of sparse write tracking granularity");
     }
+    if (data_csum_type != BLOCKSTORE_CSUM_NONE && bitmap_granularity != disk_alignment)
+    {
+        // Then every write covers whole checksum blocks and they never have to be read back
+        throw std::runtime_error("Data checksums require bitmap_granularity to be equal to disk_alignment");
+    }
+    if (csum_verify_rate < 0 || csum_verify_rate > 1)
+    {
+        throw std::runtime_error("csum_verify_rate must be between 0 and 1");
+    }
     if (journal_device == meta_device || meta_device == "" && journal_device == data_device)
     {
         journal_device = "";
@@ -161,10 +288,24 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     {
         throw std::runtime_error("journal_offset must be a multiple of journal_block_size = "+std::to_string(journal_block_size));
     }
+    if (!journal.stripe_size)
+    {
+        journal.stripe_size = 2*block_size;
+    }
+    if (journal.stripe_size % journal_block_size || journal.stripe_size < block_size + journal_block_size)
+    {
+        // Small write data never crosses stripe boundaries, so any of it must fit into one stripe after the superblock
+        throw std::runtime_error("journal_stripe_size must be a multiple of journal_block_size = "+std::to_string(journal_block_size)+
+            " and at least block_size + journal_block_size = "+std::to_string(block_size + journal_block_size));
+    }
     if (journal.sector_count < 2)
     {
         journal.sector_count = 32;
     }
+    if (journal.sector_max < journal.sector_count)
+    {
+        journal.sector_max = journal.sector_count;
+    }
     if (metadata_buf_size < 65536)
     {
         metadata_buf_size = 4*1024*1024;
@@ -177,6 +318,11 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     {
         disable_journal_fsync = disable_meta_fsync;
     }
+    if (journal_fua == JOURNAL_FUA_ALWAYS)
+    {
+        // Journal writes are durable on completion
+        disable_journal_fsync = true;
+    }
     if (immediate_commit != IMMEDIATE_NONE && !disable_journal_fsync)
     {
         throw std::runtime_error("immediate_commit requires disable_journal_fsync");
@@ -203,7 +349,15 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     }
     // init some fields
     clean_entry_bitmap_size = block_size / bitmap_granularity / 8;
-    clean_entry_size = sizeof(clean_disk_entry) + 2*clean_entry_bitmap_size;
+    data_csum_size = data_csum_type != BLOCKSTORE_CSUM_NONE ? block_size / bitmap_granularity * 4 : 0;
+    data_compr_size = data_compression ? sizeof(uint32_t) : 0;
+    clean_dyn_size = 2*clean_entry_bitmap_size + data_csum_size + data_compr_size;
+    dirty_dyn_size = clean_entry_bitmap_size + data_csum_size + data_compr_size;
+    clean_entry_size = sizeof(clean_disk_entry) + clean_dyn_size;
+    if (clean_entry_size > meta_block_size)
+    {
+        throw std::runtime_error("Metadata entry doesn't fit into meta_block_size, increase it or bitmap_granularity");
+    }
     journal.block_size = journal_block_size;
     journal.next_free = journal_block_size;
     journal.used_start = journal_block_size;
@@ -246,6 +400,11 @@ void blockstore_impl_t::calc_lengths()
     }
     // journal
     journal.len = (journal.fd == data_fd ? data_size : (journal.fd == meta_fd ? meta_size : journal.device_size)) - journal.offset;
+    if (journal.stripe_fds.size() > 1)
+    {
+        // device_size is the size of the smallest device, only whole stripes are used on each of them
+        journal.len = journal.len / journal.stripe_size * journal.stripe_size * journal.stripe_fds.size();
+    }
     if (journal.fd == data_fd && journal.offset <= data_offset)
     {
         journal.len = data_offset - journal.offset;
@@ -257,6 +416,12 @@ void blockstore_impl_t::calc_lengths()
     }
     // required metadata size
     block_count = data_len / block_size;
+    if (compact_clean_db && block_count > UINT32_MAX)
+    {
+        throw std::runtime_error("compact_clean_db only supports data devices with less than 2^32 blocks");
+    }
+    clean_db.init(compact_clean_db, block_order);
+    read_cache.init(read_cache_size, bitmap_granularity);
     meta_len = (1 + (block_count - 1 + meta_block_size / clean_entry_size) / (meta_block_size / clean_entry_size)) * meta_block_size;
     if (meta_area < meta_len)
     {
@@ -264,13 +429,14 @@ void blockstore_impl_t::calc_lengths()
     }
     if (inmemory_meta)
     {
-        metadata_buffer = memalign(MEM_ALIGNMENT, meta_len);
+        metadata_buffer = use_hugepages ? alloc_huge_buffer(meta_len) : memalign(MEM_ALIGNMENT, meta_len);
         if (!metadata_buffer)
             throw std::runtime_error("Failed to allocate memory for the metadata");
     }
-    else if (clean_entry_bitmap_size)
+    else if (clean_dyn_size)
     {
-        clean_bitmap = (uint8_t*)malloc(block_count * 2*clean_entry_bitmap_size);
+        clean_bitmap = (uint8_t*)(use_hugepages ? alloc_huge_buffer(block_count * clean_dyn_size)
+            : malloc(block_count * clean_dyn_size));
         if (!clean_bitmap)
             throw std::runtime_error("Failed to allocate memory for the metadata sparse write bitmap");
     }
@@ -289,7 +455,7 @@ void blockstore_impl_t::calc_lengths()
     }
     if (journal.inmemory)
     {
-        journal.buffer = memalign(MEM_ALIGNMENT, journal.len);
+        journal.buffer = use_hugepages ? alloc_huge_buffer(journal.len) : memalign(MEM_ALIGNMENT, journal.len);
         if (!journal.buffer)
             throw std::runtime_error("Failed to allocate memory for journal");
     }
@@ -330,6 +496,8 @@ void blockstore_impl_t::open_data()
         throw std::runtime_error("Failed to open data device");
     }
     check_size(data_fd, &data_size, "data device");
+    struct stat st;
+    data_blkdev = fstat(data_fd, &st) == 0 && S_ISBLK(st.st_mode);
     if (data_offset >= data_size)
     {
         throw std::runtime_error("data_offset exceeds device size = "+std::to_string(data_size));
@@ -375,19 +543,57 @@ void blockstore_impl_t::open_journal()
 {
     if (journal_device != "")
     {
-        journal.fd = open(journal_device.c_str(), O_DIRECT|O_RDWR);
-        if (journal.fd == -1)
+        // A comma-separated list of devices means that the journal is striped over them
+        std::vector<std::string> devices;
+        journal.device_size = 0;
+        for (size_t pos = 0; pos <= journal_device.size(); )
+        {
+            size_t next = journal_device.find(',', pos);
+            if (next == std::string::npos)
+                next = journal_device.size();
+            if (next > pos)
+                devices.push_back(journal_device.substr(pos, next-pos));
+            pos = next+1;
+        }
+        for (auto & dev: devices)
         {
-            throw std::runtime_error("Failed to open journal device");
+            if (devices.size() > 1 && (dev == data_device || dev == meta_device))
+            {
+                throw std::runtime_error("Striped journal devices must be separate from data and metadata devices");
+            }
+            // Device DAX (/dev/daxX.Y) only supports mmap
+            int fd = open(dev.c_str(), journal_dax ? O_RDWR : O_DIRECT|O_RDWR);
+            if (fd == -1)
+            {
+                throw std::runtime_error("Failed to open journal device "+dev);
+            }
+            if (journal.fd < 0)
+                journal.fd = fd;
+            if (devices.size() > 1)
+                journal.stripe_fds.push_back(fd);
+            uint64_t size = 0;
+            if (journal_dax)
+                map_journal_dax(fd, &size);
+            else
+                check_size(fd, &size, "journal device");
+            if (!journal.device_size || size < journal.device_size)
+                journal.device_size = size;
+            if (!disable_flock && flock(fd, LOCK_EX|LOCK_NB) != 0)
+            {
+                throw std::runtime_error(std::string("Failed to lock journal device: ") + strerror(errno));
+            }
         }
-        check_size(journal.fd, &journal.device_size, "journal device");
-        if (!disable_flock && flock(journal.fd, LOCK_EX|LOCK_NB) != 0)
+        if (journal.offset >= journal.device_size)
         {
-            throw std::runtime_error(std::string("Failed to lock journal device: ") + strerror(errno));
+            throw std::runtime_error("journal_offset exceeds device size");
         }
     }
     else
     {
+        if (journal_dax)
+        {
+            throw std::runtime_error("journal_dax requires a separate journal_device");
+        }
         journal.fd = meta_fd;
         journal.device_size = 0;
         if (journal.offset >= data_size)
@@ -395,15 +601,156 @@ void blockstore_impl_t::open_journal()
             throw std::runtime_error("journal_offset exceeds device size");
         }
     }
-    journal.sector_info = (journal_sector_info_t*)calloc(journal.sector_count, sizeof(journal_sector_info_t));
+    if (journal_dax)
+    {
+        // Journal writes are durable when they complete
+        disable_journal_fsync = true;
+    }
+    else if (journal_fua == JOURNAL_FUA_AUTO && !disable_journal_fsync)
+    {
+        // Only use write-through journal writes if the device handles them with one FUA write,
+        // the kernel emulates RWF_DSYNC with a write and a flush otherwise
+        bool all_fua = true;
+        for (int i = 0; i < journal.device_count(); i++)
+        {
+            uint64_t start = 0;
+            std::string disk_path = get_sysfs_disk(journal.device_fd(i), &start);
+            all_fua = all_fua && disk_path != "" && read_sysfs(disk_path+"/queue/fua") == "1";
+        }
+        if (all_fua)
+        {
+            disable_journal_fsync = true;
+            journal_rw_flags = RWF_DSYNC;
+        }
+    }
+    else if (journal_fua == JOURNAL_FUA_ALWAYS)
+    {
+        journal_rw_flags = RWF_DSYNC;
+    }
+    journal.sector_info = (journal_sector_info_t*)calloc(journal.sector_max, sizeof(journal_sector_info_t));
     if (!journal.sector_info)
     {
         throw std::bad_alloc();
     }
     if (!journal.inmemory)
     {
-        journal.sector_buf = (uint8_t*)memalign(MEM_ALIGNMENT, journal.sector_count * journal_block_size);
+        journal.sector_buf = (uint8_t*)memalign(MEM_ALIGNMENT, journal.sector_max * journal_block_size);
         if (!journal.sector_buf)
             throw std::bad_alloc();
     }
 }
+
+// Map a persistent memory journal device into memory: device DAX (/dev/daxX.Y)
+// or a file on a filesystem mounted with -o dax
+void blockstore_impl_t::map_journal_dax(int fd, uint64_t *size)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        throw std::runtime_error(std::string("Failed to stat journal device: ") + strerror(errno));
+    }
+    if (S_ISCHR(st.st_mode))
+    {
+        std::string sys_path = "/sys/dev/char/"+std::to_string(major(st.st_rdev))+":"+std::to_string(minor(st.st_rdev))+"/size";
+        *size = strtoull(read_sysfs(sys_path).c_str(), NULL, 10);
+        if (!*size)
+        {
+            throw std::runtime_error("Failed to get the size of DAX journal device from "+sys_path);
+        }
+    }
+    else
+    {
+        check_size(fd, size, "journal device");
+    }
+#ifdef MAP_SYNC
+    // MAP_SYNC guarantees that the mapping is persistent memory and CPU cache flushes make writes durable
+    void *addr = mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_SHARED_VALIDATE|MAP_SYNC, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("Failed to map journal device with MAP_SYNC, it must be a DAX device or a file on a DAX filesystem: ") + strerror(errno));
+    }
+    journal.dax_maps.push_back((journal_dax_map_t){ .fd = fd, .addr = addr, .size = *size });
+#else
+    throw std::runtime_error("journal_dax is not supported, Vitastor is built without MAP_SYNC support");
+#endif
+}
+
+// Find NVMe generic char devices (/dev/ngXnY) of the block devices and send their I/O there.
+// Devices which aren't NVMe namespaces or partitions of them are silently left as is
+void blockstore_impl_t::open_passthru()
+{
+    if (!nvme_passthrough)
+        return;
+#ifdef WITH_NVME_PASSTHRU
+    std::vector<int> fds = { data_fd, meta_fd };
+    for (int i = 0; i < journal.device_count(); i++)
+        fds.push_back(journal.device_fd(i));
+    int journal_fua_devices = 0;
+    for (int fd: fds)
+    {
+        if (passthru_fds.find(fd) != passthru_fds.end())
+            continue;
+        // Passthrough commands address the whole namespace
+        uint64_t start = 0;
+        std::string ns_path = get_sysfs_disk(fd, &start);
+        if (ns_path == "")
+            continue;
+        int ctrl_num = 0, ns_num = 0;
+        std::string ns_name = ns_path.substr(ns_path.rfind('/')+1);
+        if (sscanf(ns_name.c_str(), "nvme%dn%d", &ctrl_num, &ns_num) != 2)
+            continue;
+        int nsid = ioctl(fd, NVME_IOCTL_ID);
+        int sectsize = 0;
+        if (nsid <= 0 || ioctl(fd, BLKSSZGET, &sectsize) < 0 || sectsize <= 0)
+            continue;
+        unsigned lba_shift = 0;
+        while ((1 << lba_shift) < sectsize)
+            lba_shift++;
+        uint64_t max_len = strtoull(read_sysfs(ns_path+"/queue/max_hw_sectors_kb").c_str(), NULL, 10) * 1024;
+        unsigned max_vecs = strtoull(read_sysfs(ns_path+"/queue/max_segments").c_str(), NULL, 10);
+        bool fua = nvme_fua && read_sysfs(ns_path+"/queue/fua") == "1";
+        std::string ng_name = "/dev/ng"+std::to_string(ctrl_num)+"n"+std::to_string(ns_num);
+        int ng_fd = open(ng_name.c_str(), O_RDWR);
+        if (ng_fd < 0)
+        {
+            printf("Failed to open %s for NVMe passthrough: %s\n", ng_name.c_str(), strerror(errno));
+            continue;
+        }
+        if (!ringloop->register_nvme_passthru(fd, ng_fd, nsid, lba_shift, start, max_len ? max_len : 128*1024, max_vecs ? max_vecs : 1, fua))
+        {
+            printf("NVMe passthrough is not supported by io_uring, big SQEs are required (Linux 5.19+)\n");
+            close(ng_fd);
+            return;
+        }
+        passthru_fds[fd] = ng_fd;
+        printf("Using NVMe passthrough for %s%s\n", ng_name.c_str(), fua ? " with FUA writes" : "");
+        if (fua)
+        {
+            // Writes are already durable on completion
+            if (fd == data_fd)
+                disable_data_fsync = true;
+            if (fd == meta_fd)
+                disable_meta_fsync = true;
+            for (int i = 0; i < journal.device_count(); i++)
+                if (fd == journal.device_fd(i))
+                    journal_fua_devices++;
+            if (journal_fua_devices == journal.device_count())
+                disable_journal_fsync = true;
+        }
+    }
+#else
+    printf("NVMe passthrough is not supported, Vitastor is built without IORING_SETUP_SQE128 support\n");
+#endif
+}
+
+void blockstore_impl_t::close_passthru()
+{
+    for (auto & p: passthru_fds)
+    {
+#ifdef WITH_NVME_PASSTHRU
+        ringloop->unregister_nvme_passthru(p.first);
+#endif
+        close(p.second);
+    }
+    passthru_fds.clear();
+}
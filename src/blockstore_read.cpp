@@ -2,9 +2,10 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "blockstore_impl.h"
+#include "blockstore_compress.h"
 
 int blockstore_impl_t::fulfill_read_push(blockstore_op_t *op, void *buf, uint64_t offset, uint64_t len,
-    uint32_t item_state, uint64_t item_version)
+    uint32_t item_state, uint64_t item_version, uint32_t *item_csums, uint32_t item_compr)
 {
     if (!len)
     {
@@ -27,22 +28,155 @@ int blockstore_impl_t::fulfill_read_push(blockstore_op_t *op, void *buf, uint64_
         memcpy(buf, journal.buffer + offset, len);
         return 1;
     }
+    if (item_compr && !IS_JOURNAL(item_state))
+    {
+        return fulfill_read_compressed(op, buf, offset, len, item_csums, item_compr);
+    }
+    bool use_cache = !IS_JOURNAL(item_state) && read_cache.cacheable(offset, len);
+    if (use_cache && read_cache.read(offset, len, buf))
+    {
+        return 1;
+    }
     BS_SUBMIT_GET_SQE(sqe, data);
     data->iov = (struct iovec){ buf, len };
     PRIV(op)->pending_ops++;
-    my_uring_prep_readv(
+    ringloop->prep_readv(
         sqe,
-        IS_JOURNAL(item_state) ? journal.fd : data_fd,
+        IS_JOURNAL(item_state) ? journal.pos_fd(offset) : data_fd,
         &data->iov, 1,
-        (IS_JOURNAL(item_state) ? journal.offset : data_offset) + offset
+        IS_JOURNAL(item_state) ? journal.pos_offset(offset) : data_offset + offset
     );
-    data->callback = [this, op](ring_data_t *data) { handle_read_event(data, op); };
+    // Remember checksums of all blocks fully covered by the read, they may change before it completes
+    read_csum_check_t *chk = NULL;
+    if (item_csums && !IS_JOURNAL(item_state))
+    {
+        uint64_t blk_start = ((offset % block_size) + bitmap_granularity - 1) / bitmap_granularity;
+        uint64_t blk_end = ((offset % block_size) + len) / bitmap_granularity;
+        if (blk_end > blk_start)
+        {
+            uint64_t buf_offset = blk_start*bitmap_granularity - (offset % block_size);
+            chk = new read_csum_check_t{
+                .buf_offset = buf_offset,
+                .location = offset + buf_offset,
+                .fill_id = use_cache ? read_cache.start_fill(offset, len) : 0,
+                .csums = std::vector<uint32_t>(item_csums + blk_start, item_csums + blk_end),
+            };
+        }
+    }
+    if (chk)
+    {
+        data->callback = [this, op, chk](ring_data_t *data)
+        {
+            bool ok = data->res == data->iov.iov_len;
+            if (ok && !verify_read_csums((uint8_t*)data->iov.iov_base + chk->buf_offset, chk->location, chk->csums))
+            {
+                ok = false;
+                op->retval = -EDOM;
+            }
+            if (chk->fill_id)
+                read_cache.finish_fill(chk->fill_id, data->iov.iov_base, ok);
+            delete chk;
+            handle_read_event(data, op);
+        };
+    }
+    else if (use_cache)
+    {
+        uint64_t fill_id = read_cache.start_fill(offset, len);
+        data->callback = [this, op, fill_id](ring_data_t *data)
+        {
+            read_cache.finish_fill(fill_id, data->iov.iov_base, data->res == data->iov.iov_len);
+            handle_read_event(data, op);
+        };
+    }
+    else
+        data->callback = [this, op](ring_data_t *data) { handle_read_event(data, op); };
+    return 1;
+}
+
+// Compressed blocks are always read and decompressed as a whole, bypassing the read cache.
+// A block partially overwritten by journal entries is read in several parts, they share
+// one read and decompression
+int blockstore_impl_t::fulfill_read_compressed(blockstore_op_t *op, void *buf, uint64_t offset, uint64_t len,
+    uint32_t *item_csums, uint32_t item_compr)
+{
+    uint64_t block_loc = offset - (offset % block_size);
+    read_compr_t *prev = PRIV(op)->read_compr;
+    if (prev && prev->location == block_loc && prev->compr == item_compr)
+    {
+        prev->parts.push_back((read_compr_part_t){ .buf = (uint8_t*)buf, .offset = offset % block_size, .len = len });
+        return 1;
+    }
+    BS_SUBMIT_GET_SQE(sqe, data);
+    uint64_t read_len = (BS_COMPR_LEN(item_compr) + disk_alignment - 1) / disk_alignment * disk_alignment;
+    read_compr_t *rc = new read_compr_t{
+        .location = block_loc,
+        .compr = item_compr,
+        // Remember checksums, they may change before the read completes
+        .csums = item_csums ? std::vector<uint32_t>(item_csums, item_csums + block_size/bitmap_granularity) : std::vector<uint32_t>(),
+        .parts = { (read_compr_part_t){ .buf = (uint8_t*)buf, .offset = offset % block_size, .len = len } },
+    };
+    PRIV(op)->read_compr = rc;
+    data->iov = (struct iovec){ buffer_alloc(read_len), (size_t)read_len };
+    PRIV(op)->pending_ops++;
+    ringloop->prep_readv(sqe, data_fd, &data->iov, 1, data_offset + block_loc);
+    data->callback = [this, op, rc](ring_data_t *data)
+    {
+        if (PRIV(op)->read_compr == rc)
+            PRIV(op)->read_compr = NULL;
+        if (data->res == data->iov.iov_len)
+        {
+            auto & first = rc->parts[0];
+            uint8_t *block_buf = rc->parts.size() == 1 && first.offset == 0 && first.len == block_size
+                ? first.buf : (uint8_t*)buffer_alloc(block_size);
+            bool ok = bs_decompress(&compress_ctx, BS_COMPR_ALGO(rc->compr), data->iov.iov_base, BS_COMPR_LEN(rc->compr), block_buf, block_size);
+            if (!ok)
+            {
+                printf(
+                    "Failed to decompress data block at data device offset 0x%lx (compressed length %u)\n",
+                    data_offset + rc->location, BS_COMPR_LEN(rc->compr)
+                );
+            }
+            else if (rc->csums.size())
+            {
+                ok = verify_read_csums(block_buf, rc->location, rc->csums);
+            }
+            if (!ok)
+                op->retval = -EDOM;
+            else if (block_buf != first.buf)
+            {
+                for (auto & part: rc->parts)
+                    memcpy(part.buf, block_buf + part.offset, part.len);
+            }
+            if (block_buf != first.buf)
+                buffer_free(block_buf);
+        }
+        buffer_free(data->iov.iov_base);
+        delete rc;
+        handle_read_event(data, op);
+    };
     return 1;
 }
 
+bool blockstore_impl_t::verify_read_csums(uint8_t *buf, uint64_t offset, const std::vector<uint32_t> & csums)
+{
+    for (size_t i = 0; i < csums.size(); i++)
+    {
+        uint32_t crc = crc32c(0, buf + i*bitmap_granularity, bitmap_granularity);
+        if (crc != csums[i])
+        {
+            printf(
+                "Data checksum mismatch at data device offset 0x%lx: crc32c %08x != %08x\n",
+                data_offset + offset + i*bitmap_granularity, crc, csums[i]
+            );
+            return false;
+        }
+    }
+    return true;
+}
+
 // FIXME I've seen a bug here so I want some tests
 int blockstore_impl_t::fulfill_read(blockstore_op_t *read_op, uint64_t &fulfilled, uint32_t item_start, uint32_t item_end,
-    uint32_t item_state, uint64_t item_version, uint64_t item_location)
+    uint32_t item_state, uint64_t item_version, uint64_t item_location, uint32_t *item_csums, uint32_t item_compr)
 {
     uint32_t cur_start = item_start;
     if (cur_start < read_op->offset + read_op->len && item_end > read_op->offset)
@@ -77,7 +211,7 @@ int blockstore_impl_t::fulfill_read(blockstore_op_t *read_op, uint64_t &fulfille
                 if (!fulfill_read_push(read_op,
                     read_op->buf + el.offset - read_op->offset,
                     item_location + el.offset - item_start,
-                    el.len, item_state, item_version))
+                    el.len, item_state, item_version, item_csums, item_compr))
                 {
                     return 0;
                 }
@@ -105,20 +239,75 @@ uint8_t* blockstore_impl_t::get_clean_entry_bitmap(uint64_t block_loc, int offse
         clean_entry_bitmap = (uint8_t*)(metadata_buffer + sector + pos*clean_entry_size + sizeof(clean_disk_entry) + offset);
     }
     else
-        clean_entry_bitmap = (uint8_t*)(clean_bitmap + meta_loc*2*clean_entry_bitmap_size + offset);
+        clean_entry_bitmap = (uint8_t*)(clean_bitmap + meta_loc*clean_dyn_size + offset);
     return clean_entry_bitmap;
 }
 
+uint32_t* blockstore_impl_t::get_dirty_csums(dirty_entry & e)
+{
+    return (uint32_t*)((uint8_t*)get_dirty_dyn(e) + clean_entry_bitmap_size);
+}
+
+uint32_t blockstore_impl_t::get_dirty_compr(dirty_entry & e)
+{
+    if (!data_compr_size)
+        return 0;
+    uint32_t compr;
+    memcpy(&compr, (uint8_t*)get_dirty_dyn(e) + clean_entry_bitmap_size + data_csum_size, sizeof(uint32_t));
+    return compr;
+}
+
+void blockstore_impl_t::set_dirty_compr(dirty_entry & e, uint32_t compr)
+{
+    if (data_compr_size)
+        memcpy((uint8_t*)get_dirty_dyn(e) + clean_entry_bitmap_size + data_csum_size, &compr, sizeof(uint32_t));
+}
+
+uint32_t blockstore_impl_t::get_clean_compr(uint64_t block_loc)
+{
+    if (!data_compr_size)
+        return 0;
+    uint32_t compr;
+    memcpy(&compr, get_clean_entry_bitmap(block_loc, 2*clean_entry_bitmap_size + data_csum_size), sizeof(uint32_t));
+    return compr;
+}
+
+// Calculate checksums of bitmap_granularity blocks of data starting at <offset> within the object
+void blockstore_impl_t::calc_block_csums(uint32_t *csums, uint32_t offset, const iovec *iov, int iovcnt)
+{
+    uint32_t crc = 0, block_left = bitmap_granularity;
+    csums += offset / bitmap_granularity;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        uint8_t *buf = (uint8_t*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            uint32_t n = left < block_left ? left : block_left;
+            crc = crc32c(crc, buf, n);
+            buf += n;
+            left -= n;
+            block_left -= n;
+            if (!block_left)
+            {
+                *(csums++) = crc;
+                crc = 0;
+                block_left = bitmap_granularity;
+            }
+        }
+    }
+}
+
 int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
 {
-    auto clean_it = clean_db.find(read_op->oid);
+    clean_entry clean;
+    bool clean_found = clean_db.get(read_op->oid, &clean);
     auto dirty_it = dirty_db.upper_bound((obj_ver_id){
         .oid = read_op->oid,
         .version = UINT64_MAX,
     });
     if (dirty_it != dirty_db.begin())
         dirty_it--;
-    bool clean_found = clean_it != clean_db.end();
     bool dirty_found = (dirty_it != dirty_db.end() && dirty_it->first.oid == read_op->oid);
     if (!clean_found && !dirty_found)
     {
@@ -132,6 +321,17 @@ int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
     uint64_t fulfilled = 0;
     PRIV(read_op)->pending_ops = 0;
     uint64_t result_version = 0;
+    bool verify_csums = false;
+    if (data_csum_size && csum_verify_rate > 0)
+    {
+        // Verify the configured share of reads: every read with rate = 1, every other with 0.5 and so on
+        csum_verify_acc += csum_verify_rate;
+        if (csum_verify_acc >= 1)
+        {
+            csum_verify_acc -= 1;
+            verify_csums = true;
+        }
+    }
     if (dirty_found)
     {
         while (dirty_it->first.oid == read_op->oid)
@@ -151,12 +351,13 @@ int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
                     result_version = dirty_it->first.version;
                     if (read_op->bitmap)
                     {
-                        void *bmp_ptr = (clean_entry_bitmap_size > sizeof(void*) ? dirty_it->second.bitmap : &dirty_it->second.bitmap);
-                        memcpy(read_op->bitmap, bmp_ptr, clean_entry_bitmap_size);
+                        bitmap_copy(read_op->bitmap, get_dirty_dyn(dirty_it->second), clean_entry_bitmap_size);
                     }
                 }
                 if (!fulfill_read(read_op, fulfilled, dirty.offset, dirty.offset + dirty.len,
-                    dirty.state, dirty_it->first.version, dirty.location + (IS_JOURNAL(dirty.state) ? 0 : dirty.offset)))
+                    dirty.state, dirty_it->first.version, dirty.location + (IS_JOURNAL(dirty.state) ? 0 : dirty.offset),
+                    verify_csums && IS_BIG_WRITE(dirty.state) ? get_dirty_csums(dirty) : NULL,
+                    IS_BIG_WRITE(dirty.state) ? get_dirty_compr(dirty) : 0))
                 {
                     // need to wait. undo added requests, don't dequeue op
                     PRIV(read_op)->read_vec.clear();
@@ -170,22 +371,25 @@ int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
             dirty_it--;
         }
     }
-    if (clean_it != clean_db.end())
+    if (clean_found)
     {
         if (!result_version)
         {
-            result_version = clean_it->second.version;
+            result_version = clean.version;
             if (read_op->bitmap)
             {
-                void *bmp_ptr = get_clean_entry_bitmap(clean_it->second.location, clean_entry_bitmap_size);
+                void *bmp_ptr = get_clean_entry_bitmap(clean.location, clean_entry_bitmap_size);
                 memcpy(read_op->bitmap, bmp_ptr, clean_entry_bitmap_size);
             }
         }
         if (fulfilled < read_op->len)
         {
+            uint32_t *clean_csums = verify_csums
+                ? (uint32_t*)get_clean_entry_bitmap(clean.location, 2*clean_entry_bitmap_size) : NULL;
+            uint32_t clean_compr = get_clean_compr(clean.location);
             if (!clean_entry_bitmap_size)
             {
-                if (!fulfill_read(read_op, fulfilled, 0, block_size, (BS_ST_BIG_WRITE | BS_ST_STABLE), 0, clean_it->second.location))
+                if (!fulfill_read(read_op, fulfilled, 0, block_size, (BS_ST_BIG_WRITE | BS_ST_STABLE), 0, clean.location, clean_csums, clean_compr))
                 {
                     // need to wait. undo added requests, don't dequeue op
                     PRIV(read_op)->read_vec.clear();
@@ -194,7 +398,7 @@ int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
             }
             else
             {
-                uint8_t *clean_entry_bitmap = get_clean_entry_bitmap(clean_it->second.location, 0);
+                uint8_t *clean_entry_bitmap = get_clean_entry_bitmap(clean.location, 0);
                 uint64_t bmp_start = 0, bmp_end = 0, bmp_size = block_size/bitmap_granularity;
                 while (bmp_start < bmp_size)
                 {
@@ -217,7 +421,7 @@ int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
                     {
                         if (!fulfill_read(read_op, fulfilled, bmp_start * bitmap_granularity,
                             bmp_end * bitmap_granularity, (BS_ST_BIG_WRITE | BS_ST_STABLE), 0,
-                            clean_it->second.location + bmp_start * bitmap_granularity))
+                            clean.location + bmp_start * bitmap_granularity, clean_csums, clean_compr))
                         {
                             // need to wait. undo added requests, don't dequeue op
                             PRIV(read_op)->read_vec.clear();
@@ -287,8 +491,7 @@ int blockstore_impl_t::read_bitmap(object_id oid, uint64_t target_version, void
                     *result_version = dirty_it->first.version;
                 if (bitmap)
                 {
-                    void *bmp_ptr = (clean_entry_bitmap_size > sizeof(void*) ? dirty_it->second.bitmap : &dirty_it->second.bitmap);
-                    memcpy(bitmap, bmp_ptr, clean_entry_bitmap_size);
+                    bitmap_copy(bitmap, get_dirty_dyn(dirty_it->second), clean_entry_bitmap_size);
                 }
                 return 0;
             }
@@ -297,14 +500,14 @@ int blockstore_impl_t::read_bitmap(object_id oid, uint64_t target_version, void
             dirty_it--;
         }
     }
-    auto clean_it = clean_db.find(oid);
-    if (clean_it != clean_db.end())
+    clean_entry clean;
+    if (clean_db.get(oid, &clean))
     {
         if (result_version)
-            *result_version = clean_it->second.version;
+            *result_version = clean.version;
         if (bitmap)
         {
-            void *bmp_ptr = get_clean_entry_bitmap(clean_it->second.location, clean_entry_bitmap_size);
+            void *bmp_ptr = get_clean_entry_bitmap(clean.location, clean_entry_bitmap_size);
             memcpy(bitmap, bmp_ptr, clean_entry_bitmap_size);
         }
         return 0;
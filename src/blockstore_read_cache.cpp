@@ -0,0 +1,120 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <string.h>
+#include "malloc_or_die.h"
+#include "blockstore_read_cache.h"
+
+blockstore_read_cache_t::~blockstore_read_cache_t()
+{
+    if (arena)
+        free(arena);
+}
+
+void blockstore_read_cache_t::init(uint64_t size, uint64_t page_size)
+{
+    this->page_size = page_size;
+    this->max_pages = page_size ? size / page_size : 0;
+    if (max_pages > UINT32_MAX)
+        max_pages = UINT32_MAX;
+    if (max_pages > 0)
+    {
+        // Memory is only touched when pages are filled
+        arena = (uint8_t*)malloc_or_die(max_pages * page_size);
+    }
+}
+
+uint32_t blockstore_read_cache_t::alloc_page()
+{
+    if (free_slots.size())
+    {
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+    return next_slot++;
+}
+
+void blockstore_read_cache_t::free_page(std::unordered_map<uint64_t, cache_page_t>::iterator page_it)
+{
+    free_slots.push_back(page_it->second.slot);
+    lru.erase(page_it->second.lru_it);
+    pages.erase(page_it);
+}
+
+bool blockstore_read_cache_t::read(uint64_t offset, uint64_t len, void *buf)
+{
+    for (uint64_t pos = 0; pos < len; pos += page_size)
+    {
+        if (pages.find((offset+pos) / page_size) == pages.end())
+        {
+            misses++;
+            return false;
+        }
+    }
+    for (uint64_t pos = 0; pos < len; pos += page_size)
+    {
+        auto & page = pages[(offset+pos) / page_size];
+        memcpy((uint8_t*)buf + pos, arena + page.slot*page_size, page_size);
+        lru.splice(lru.end(), lru, page.lru_it);
+    }
+    hits++;
+    return true;
+}
+
+uint64_t blockstore_read_cache_t::start_fill(uint64_t offset, uint64_t len)
+{
+    uint64_t id = next_fill_id++;
+    fills[id] = (cache_fill_t){ .offset = offset, .len = len, .invalidated = false };
+    return id;
+}
+
+void blockstore_read_cache_t::finish_fill(uint64_t fill_id, void *buf, bool ok)
+{
+    auto fill_it = fills.find(fill_id);
+    if (fill_it == fills.end())
+        return;
+    cache_fill_t fill = fill_it->second;
+    fills.erase(fill_it);
+    if (!ok || fill.invalidated)
+        return;
+    for (uint64_t pos = 0; pos < fill.len; pos += page_size)
+    {
+        uint64_t key = (fill.offset+pos) / page_size;
+        auto page_it = pages.find(key);
+        if (page_it == pages.end())
+        {
+            if (pages.size() >= max_pages)
+            {
+                // Evict the least recently used page
+                free_page(pages.find(lru.front()));
+            }
+            page_it = pages.emplace(key, (cache_page_t){
+                .slot = alloc_page(),
+                .lru_it = lru.insert(lru.end(), key),
+            }).first;
+        }
+        else
+            lru.splice(lru.end(), lru, page_it->second.lru_it);
+        memcpy(arena + page_it->second.slot*page_size, (uint8_t*)buf + pos, page_size);
+    }
+}
+
+void blockstore_read_cache_t::invalidate(uint64_t offset, uint64_t len)
+{
+    if (!max_pages)
+        return;
+    for (auto & fill: fills)
+    {
+        if (fill.second.offset < offset+len && fill.second.offset+fill.second.len > offset)
+            fill.second.invalidated = true;
+    }
+    if (!pages.size())
+        return;
+    for (uint64_t key = offset / page_size; key*page_size < offset+len; key++)
+    {
+        auto page_it = pages.find(key);
+        if (page_it != pages.end())
+            free_page(page_it);
+    }
+}
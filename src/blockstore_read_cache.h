@@ -0,0 +1,78 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+// Bounded LRU cache of data device contents in RAM, used for clean data reads.
+// Pages are identified by their data device location, so every write to the data
+// device must invalidate the corresponding range. Reads already in flight
+// during an invalidation don't fill the cache with their (possibly stale) data.
+class blockstore_read_cache_t
+{
+    struct cache_page_t
+    {
+        uint32_t slot;
+        std::list<uint64_t>::iterator lru_it;
+    };
+
+    struct cache_fill_t
+    {
+        uint64_t offset, len;
+        bool invalidated;
+    };
+
+    uint64_t page_size = 0, max_pages = 0;
+    uint8_t *arena = NULL;
+    std::vector<uint32_t> free_slots;
+    uint32_t next_slot = 0;
+    std::unordered_map<uint64_t, cache_page_t> pages;
+    // Most recently used pages are in the end
+    std::list<uint64_t> lru;
+    std::map<uint64_t, cache_fill_t> fills;
+    uint64_t next_fill_id = 1;
+
+    uint32_t alloc_page();
+    void free_page(std::unordered_map<uint64_t, cache_page_t>::iterator page_it);
+
+public:
+    uint64_t hits = 0, misses = 0;
+
+    ~blockstore_read_cache_t();
+    void init(uint64_t size, uint64_t page_size);
+
+    inline bool enabled()
+    {
+        return max_pages > 0;
+    }
+
+    // Only page-aligned ranges are cached
+    inline bool cacheable(uint64_t offset, uint64_t len)
+    {
+        return max_pages > 0 && !(offset % page_size) && !(len % page_size);
+    }
+
+    inline uint64_t bytes_used()
+    {
+        return pages.size() * page_size;
+    }
+
+    inline uint64_t size()
+    {
+        return max_pages * page_size;
+    }
+
+    // Copy cached data to <buf> if the whole range is cached
+    bool read(uint64_t offset, uint64_t len, void *buf);
+    // Remember that a read of the range is submitted, returns fill ID for finish_fill()
+    uint64_t start_fill(uint64_t offset, uint64_t len);
+    // Put data read from the device to the cache, if it wasn't invalidated during the read
+    void finish_fill(uint64_t fill_id, void *buf, bool ok);
+    // Forget the range, called before writing to it
+    void invalidate(uint64_t offset, uint64_t len);
+};
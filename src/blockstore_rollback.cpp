@@ -68,6 +68,15 @@ skip_ov:
         FINISH_OP(op);
         return 2;
     }
+    if (journal_multi_entries)
+    {
+        if (!prepare_multi_journal_entries(op, JE_ROLLBACK_MULTI, [this, op](ring_data_t *data) { handle_rollback_event(data, op); }))
+        {
+            return 0;
+        }
+        PRIV(op)->op_state = 1;
+        return 1;
+    }
     // Check journal space
     blockstore_journal_check_t space_check(this);
     if (!space_check.check_available(op, todo, sizeof(journal_entry_rollback), 0))
@@ -83,6 +92,7 @@ skip_ov:
     // Prepare and submit journal entries
     auto cb = [this, op](ring_data_t *data) { handle_rollback_event(data, op); };
     int s = 0, cur_sector = -1;
+    journal_sector_batch_t batch;
     for (i = 0, v = (obj_ver_id*)op->buf; i < op->len; i++, v++)
     {
         if (!journal.entry_fits(sizeof(journal_entry_rollback)) &&
@@ -90,7 +100,8 @@ skip_ov:
         {
             if (cur_sector == -1)
                 PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
-            prepare_journal_sector_write(journal, journal.cur_sector, sqe[s++], cb);
+            if (prepare_journal_sector_write(journal.cur_sector, sqe[s], cb, &batch))
+                s++;
             cur_sector = journal.cur_sector;
         }
         journal_entry_rollback *je = (journal_entry_rollback*)
@@ -100,8 +111,10 @@ skip_ov:
         je->crc32 = je_crc32((journal_entry*)je);
         journal.crc32_last = je->crc32;
     }
-    prepare_journal_sector_write(journal, journal.cur_sector, sqe[s++], cb);
-    assert(s == space_check.sectors_to_write);
+    if (prepare_journal_sector_write(journal.cur_sector, sqe[s], cb, &batch))
+        s++;
+    // Return SQEs left unused because adjacent sectors were merged into one write
+    ringloop->restore(ringloop->save() - (space_check.sectors_to_write - s));
     if (cur_sector == -1)
         PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
     PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
@@ -126,14 +139,21 @@ resume_2:
 resume_3:
     if (!disable_journal_fsync)
     {
-        io_uring_sqe *sqe;
-        BS_SUBMIT_GET_SQE_DECL(sqe);
-        ring_data_t *data = ((ring_data_t*)sqe->user_data);
-        my_uring_prep_fsync(sqe, journal.fd, IORING_FSYNC_DATASYNC);
-        data->iov = { 0 };
-        data->callback = [this, op](ring_data_t *data) { handle_rollback_event(data, op); };
+        int fsyncs = journal.device_count();
+        io_uring_sqe *sqe[fsyncs];
+        for (int i = 0; i < fsyncs; i++)
+        {
+            BS_SUBMIT_GET_SQE_DECL(sqe[i]);
+        }
+        for (int i = 0; i < fsyncs; i++)
+        {
+            ring_data_t *data = ((ring_data_t*)sqe[i]->user_data);
+            ringloop->prep_fsync(sqe[i], journal.device_fd(i), IORING_FSYNC_DATASYNC);
+            data->iov = { 0 };
+            data->callback = [this, op](ring_data_t *data) { handle_rollback_event(data, op); };
+        }
         PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 0;
-        PRIV(op)->pending_ops = 1;
+        PRIV(op)->pending_ops = fsyncs;
         PRIV(op)->op_state = 4;
         return 1;
     }
@@ -256,6 +276,7 @@ void blockstore_impl_t::erase_dirty(blockstore_dirty_db_t::iterator dirty_start,
                 dirty_it->first.oid.inode, dirty_it->first.oid.stripe, dirty_it->first.version);
 #endif
             data_alloc->set(dirty_it->second.location >> block_order, false);
+            queue_discard(dirty_it->second.location >> block_order);
         }
         int used = --journal.used_sectors[dirty_it->second.journal_sector];
 #ifdef BLOCKSTORE_DEBUG
@@ -268,7 +289,7 @@ void blockstore_impl_t::erase_dirty(blockstore_dirty_db_t::iterator dirty_start,
         {
             journal.used_sectors.erase(dirty_it->second.journal_sector);
         }
-        if (clean_entry_bitmap_size > sizeof(void*))
+        if (dirty_dyn_size > sizeof(void*))
         {
             free(dirty_it->second.bitmap);
             dirty_it->second.bitmap = NULL;
@@ -54,8 +54,8 @@ int blockstore_impl_t::dequeue_stable(blockstore_op_t *op)
         auto dirty_it = dirty_db.find(*v);
         if (dirty_it == dirty_db.end())
         {
-            auto clean_it = clean_db.find(v->oid);
-            if (clean_it == clean_db.end() || clean_it->second.version < v->version)
+            clean_entry clean;
+            if (!clean_db.get(v->oid, &clean) || clean.version < v->version)
             {
                 // No such object version
                 op->retval = -ENOENT;
@@ -91,6 +91,15 @@ int blockstore_impl_t::dequeue_stable(blockstore_op_t *op)
         FINISH_OP(op);
         return 2;
     }
+    if (journal_multi_entries)
+    {
+        if (!prepare_multi_journal_entries(op, JE_STABLE_MULTI, [this, op](ring_data_t *data) { handle_stable_event(data, op); }))
+        {
+            return 0;
+        }
+        PRIV(op)->op_state = 1;
+        return 1;
+    }
     // Check journal space
     blockstore_journal_check_t space_check(this);
     if (!space_check.check_available(op, todo, sizeof(journal_entry_stable), 0))
@@ -106,6 +115,7 @@ int blockstore_impl_t::dequeue_stable(blockstore_op_t *op)
     // Prepare and submit journal entries
     auto cb = [this, op](ring_data_t *data) { handle_stable_event(data, op); };
     int s = 0, cur_sector = -1;
+    journal_sector_batch_t batch;
     for (i = 0, v = (obj_ver_id*)op->buf; i < op->len; i++, v++)
     {
         // FIXME: Only stabilize versions that aren't stable yet
@@ -114,7 +124,8 @@ int blockstore_impl_t::dequeue_stable(blockstore_op_t *op)
         {
             if (cur_sector == -1)
                 PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
-            prepare_journal_sector_write(journal, journal.cur_sector, sqe[s++], cb);
+            if (prepare_journal_sector_write(journal.cur_sector, sqe[s], cb, &batch))
+                s++;
             cur_sector = journal.cur_sector;
         }
         journal_entry_stable *je = (journal_entry_stable*)
@@ -124,8 +135,10 @@ int blockstore_impl_t::dequeue_stable(blockstore_op_t *op)
         je->crc32 = je_crc32((journal_entry*)je);
         journal.crc32_last = je->crc32;
     }
-    prepare_journal_sector_write(journal, journal.cur_sector, sqe[s++], cb);
-    assert(s == space_check.sectors_to_write);
+    if (prepare_journal_sector_write(journal.cur_sector, sqe[s], cb, &batch))
+        s++;
+    // Return SQEs left unused because adjacent sectors were merged into one write
+    ringloop->restore(ringloop->save() - (space_check.sectors_to_write - s));
     if (cur_sector == -1)
         PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
     PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
@@ -150,14 +163,21 @@ resume_2:
 resume_3:
     if (!disable_journal_fsync)
     {
-        io_uring_sqe *sqe;
-        BS_SUBMIT_GET_SQE_DECL(sqe);
-        ring_data_t *data = ((ring_data_t*)sqe->user_data);
-        my_uring_prep_fsync(sqe, journal.fd, IORING_FSYNC_DATASYNC);
-        data->iov = { 0 };
-        data->callback = [this, op](ring_data_t *data) { handle_stable_event(data, op); };
+        int fsyncs = journal.device_count();
+        io_uring_sqe *sqe[fsyncs];
+        for (int i = 0; i < fsyncs; i++)
+        {
+            BS_SUBMIT_GET_SQE_DECL(sqe[i]);
+        }
+        for (int i = 0; i < fsyncs; i++)
+        {
+            ring_data_t *data = ((ring_data_t*)sqe[i]->user_data);
+            ringloop->prep_fsync(sqe[i], journal.device_fd(i), IORING_FSYNC_DATASYNC);
+            data->iov = { 0 };
+            data->callback = [this, op](ring_data_t *data) { handle_stable_event(data, op); };
+        }
         PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 0;
-        PRIV(op)->pending_ops = 1;
+        PRIV(op)->pending_ops = fsyncs;
         PRIV(op)->op_state = 4;
         return 1;
     }
@@ -205,8 +225,7 @@ void blockstore_impl_t::mark_stable(const obj_ver_id & v, bool forget_dirty)
                     }
                     if (exists == -1)
                     {
-                        auto clean_it = clean_db.find(v.oid);
-                        exists = clean_it != clean_db.end() ? 1 : 0;
+                        exists = clean_db.exists(v.oid) ? 1 : 0;
                     }
                     if (!exists)
                     {
@@ -232,9 +251,9 @@ void blockstore_impl_t::mark_stable(const obj_ver_id & v, bool forget_dirty)
                         break;
                     }
                 }
-                auto clean_it = clean_db.find(v.oid);
-                uint64_t clean_loc = clean_it != clean_db.end()
-                    ? clean_it->second.location : UINT64_MAX;
+                clean_entry clean;
+                uint64_t clean_loc = clean_db.get(v.oid, &clean)
+                    ? clean.location : UINT64_MAX;
                 erase_dirty(dirty_it, erase_end, clean_loc);
                 break;
             }
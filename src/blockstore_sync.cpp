@@ -3,16 +3,7 @@
 
 #include "blockstore_impl.h"
 
-#define SYNC_HAS_SMALL 1
-#define SYNC_HAS_BIG 2
-#define SYNC_DATA_SYNC_SENT 3
-#define SYNC_DATA_SYNC_DONE 4
-#define SYNC_JOURNAL_WRITE_SENT 5
-#define SYNC_JOURNAL_WRITE_DONE 6
-#define SYNC_JOURNAL_SYNC_SENT 7
-#define SYNC_DONE 8
-
-int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_progress_sync)
+int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_progress_sync, int queue_pos)
 {
     if (immediate_commit == IMMEDIATE_ALL)
     {
@@ -21,9 +12,48 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
         FINISH_OP(op);
         return 2;
     }
+    if (PRIV(op)->op_state == SYNC_WAIT_GROUP)
+    {
+        // Our writes are synced by a previous sync
+        if (sync_groups_done < PRIV(op)->sync_group)
+        {
+            return 1;
+        }
+        ack_sync(op);
+        return 2;
+    }
+    if (PRIV(op)->op_state == 0 && sync_max_delay_us > 0 && write_iodepth > 0)
+    {
+        // Wait a bit for writes submitted after this sync so that they're synced together
+        clock_gettime(CLOCK_REALTIME, &PRIV(op)->tv_begin);
+        PRIV(op)->op_state = SYNC_DELAYED;
+        tfd->set_timer_us(sync_max_delay_us, false, [this](int timer_id)
+        {
+            ringloop->wakeup();
+        });
+        return 1;
+    }
+    if (PRIV(op)->op_state == SYNC_DELAYED)
+    {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t waited_us = (now.tv_sec - PRIV(op)->tv_begin.tv_sec)*1000000 +
+            (now.tv_nsec - PRIV(op)->tv_begin.tv_nsec)/1000;
+        if (write_iodepth > 0 && waited_us < sync_max_delay_us)
+        {
+            return 1;
+        }
+        PRIV(op)->op_state = 0;
+    }
     if (PRIV(op)->op_state == 0)
     {
         stop_sync_submitted = false;
+        PRIV(op)->sync_group = ++sync_groups_started;
+        group_syncs(queue_pos, PRIV(op)->sync_group);
+        if (unsynced_big_writes.size() > 0 || unsynced_small_writes.size() > 0)
+        {
+            sync_fsync_count++;
+        }
         unsynced_big_write_count -= unsynced_big_writes.size();
         PRIV(op)->sync_big_writes.swap(unsynced_big_writes);
         PRIV(op)->sync_small_writes.swap(unsynced_small_writes);
@@ -45,7 +75,7 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
         {
             // Write out the last journal sector if it happens to be dirty
             BS_SUBMIT_GET_ONLY_SQE(sqe);
-            prepare_journal_sector_write(journal, journal.cur_sector, sqe, [this, op](ring_data_t *data) { handle_sync_event(data, op); });
+            prepare_journal_sector_write(journal.cur_sector, sqe, [this, op](ring_data_t *data) { handle_sync_event(data, op); });
             PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
             PRIV(op)->pending_ops = 1;
             PRIV(op)->op_state = SYNC_JOURNAL_WRITE_SENT;
@@ -62,7 +92,7 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
         if (!disable_data_fsync)
         {
             BS_SUBMIT_GET_SQE(sqe, data);
-            my_uring_prep_fsync(sqe, data_fd, IORING_FSYNC_DATASYNC);
+            ringloop->prep_fsync(sqe, data_fd, IORING_FSYNC_DATASYNC);
             data->iov = { 0 };
             data->callback = [this, op](ring_data_t *data) { handle_sync_event(data, op); };
             PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 0;
@@ -81,11 +111,11 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
         // Check space in the journal and journal memory buffers
         blockstore_journal_check_t space_check(this);
         if (!space_check.check_available(op, PRIV(op)->sync_big_writes.size(),
-            sizeof(journal_entry_big_write) + clean_entry_bitmap_size, JOURNAL_STABILIZE_RESERVATION))
+            sizeof(journal_entry_big_write) + dirty_dyn_size, JOURNAL_STABILIZE_RESERVATION))
         {
             return 0;
         }
-        // Get SQEs. Don't bother about merging, submit each journal sector as a separate request
+        // Get SQEs. Adjacent journal sectors are merged into one request, unused SQEs are returned
         struct io_uring_sqe *sqe[space_check.sectors_to_write];
         for (int i = 0; i < space_check.sectors_to_write; i++)
         {
@@ -94,20 +124,22 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
         // Prepare and submit journal entries
         auto it = PRIV(op)->sync_big_writes.begin();
         int s = 0, cur_sector = -1;
+        journal_sector_batch_t batch;
         while (it != PRIV(op)->sync_big_writes.end())
         {
-            if (!journal.entry_fits(sizeof(journal_entry_big_write) + clean_entry_bitmap_size) &&
+            if (!journal.entry_fits(sizeof(journal_entry_big_write) + dirty_dyn_size) &&
                 journal.sector_info[journal.cur_sector].dirty)
             {
                 if (cur_sector == -1)
                     PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
-                prepare_journal_sector_write(journal, journal.cur_sector, sqe[s++], [this, op](ring_data_t *data) { handle_sync_event(data, op); });
+                if (prepare_journal_sector_write(journal.cur_sector, sqe[s], [this, op](ring_data_t *data) { handle_sync_event(data, op); }, &batch))
+                    s++;
                 cur_sector = journal.cur_sector;
             }
             auto & dirty_entry = dirty_db.at(*it);
             journal_entry_big_write *je = (journal_entry_big_write*)prefill_single_journal_entry(
                 journal, (dirty_entry.state & BS_ST_INSTANT) ? JE_BIG_WRITE_INSTANT : JE_BIG_WRITE,
-                sizeof(journal_entry_big_write) + clean_entry_bitmap_size
+                sizeof(journal_entry_big_write) + dirty_dyn_size
             );
             dirty_entry.journal_sector = journal.sector_info[journal.cur_sector].offset;
             journal.used_sectors[journal.sector_info[journal.cur_sector].offset]++;
@@ -123,14 +155,15 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
             je->offset = dirty_entry.offset;
             je->len = dirty_entry.len;
             je->location = dirty_entry.location;
-            memcpy((void*)(je+1), (clean_entry_bitmap_size > sizeof(void*)
-                ? dirty_entry.bitmap : &dirty_entry.bitmap), clean_entry_bitmap_size);
+            bitmap_copy((void*)(je+1), get_dirty_dyn(dirty_entry), dirty_dyn_size);
             je->crc32 = je_crc32((journal_entry*)je);
             journal.crc32_last = je->crc32;
             it++;
         }
-        prepare_journal_sector_write(journal, journal.cur_sector, sqe[s++], [this, op](ring_data_t *data) { handle_sync_event(data, op); });
-        assert(s == space_check.sectors_to_write);
+        if (prepare_journal_sector_write(journal.cur_sector, sqe[s], [this, op](ring_data_t *data) { handle_sync_event(data, op); }, &batch))
+            s++;
+        // Return SQEs left unused because adjacent sectors were merged into one write
+        ringloop->restore(ringloop->save() - (space_check.sectors_to_write - s));
         if (cur_sector == -1)
             PRIV(op)->min_flushed_journal_sector = 1 + journal.cur_sector;
         PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
@@ -142,12 +175,21 @@ int blockstore_impl_t::continue_sync(blockstore_op_t *op, bool queue_has_in_prog
     {
         if (!disable_journal_fsync)
         {
-            BS_SUBMIT_GET_SQE(sqe, data);
-            my_uring_prep_fsync(sqe, journal.fd, IORING_FSYNC_DATASYNC);
-            data->iov = { 0 };
-            data->callback = [this, op](ring_data_t *data) { handle_sync_event(data, op); };
+            int fsyncs = journal.device_count();
+            io_uring_sqe *sqe[fsyncs];
+            for (int i = 0; i < fsyncs; i++)
+            {
+                BS_SUBMIT_GET_SQE_DECL(sqe[i]);
+            }
+            for (int i = 0; i < fsyncs; i++)
+            {
+                ring_data_t *data = ((ring_data_t*)sqe[i]->user_data);
+                ringloop->prep_fsync(sqe[i], journal.device_fd(i), IORING_FSYNC_DATASYNC);
+                data->iov = { 0 };
+                data->callback = [this, op](ring_data_t *data) { handle_sync_event(data, op); };
+            }
             PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 0;
-            PRIV(op)->pending_ops = 1;
+            PRIV(op)->pending_ops = fsyncs;
             PRIV(op)->op_state = SYNC_JOURNAL_SYNC_SENT;
             return 1;
         }
@@ -200,8 +242,32 @@ void blockstore_impl_t::handle_sync_event(ring_data_t *data, blockstore_op_t *op
     }
 }
 
+// Syncs following the current one with only reads between them don't have anything else
+// to sync, so they're completed together with it instead of waiting and syncing again
+void blockstore_impl_t::group_syncs(int leader_pos, uint64_t group)
+{
+    for (int i = leader_pos+1; i < submit_queue.size(); i++)
+    {
+        blockstore_op_t *op = submit_queue[i];
+        if (op->opcode == BS_OP_SYNC && PRIV(op)->op_state == 0)
+        {
+            PRIV(op)->op_state = SYNC_WAIT_GROUP;
+            PRIV(op)->sync_group = group;
+        }
+        else if (op->opcode != BS_OP_READ && op->opcode != BS_OP_LIST)
+        {
+            break;
+        }
+    }
+}
+
 void blockstore_impl_t::ack_sync(blockstore_op_t *op)
 {
+    if (sync_groups_done < PRIV(op)->sync_group)
+    {
+        sync_groups_done = PRIV(op)->sync_group;
+    }
+    sync_op_count++;
     // Handle states
     for (auto it = PRIV(op)->sync_big_writes.begin(); it != PRIV(op)->sync_big_writes.end(); it++)
     {
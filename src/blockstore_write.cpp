@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "blockstore_impl.h"
+#include "blockstore_compress.h"
 
 bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
 {
@@ -10,9 +11,9 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
     bool wait_big = false, wait_del = false;
     void *bmp = NULL;
     uint64_t version = 1;
-    if (!is_del && clean_entry_bitmap_size > sizeof(void*))
+    if (!is_del && dirty_dyn_size > sizeof(void*))
     {
-        bmp = calloc_or_die(1, clean_entry_bitmap_size);
+        bmp = calloc_or_die(1, dirty_dyn_size);
     }
     if (dirty_db.size() > 0)
     {
@@ -32,8 +33,8 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
                 : ((dirty_it->second.state & BS_ST_WORKFLOW_MASK) == BS_ST_WAIT_BIG);
             if (!is_del && !deleted)
             {
-                if (clean_entry_bitmap_size > sizeof(void*))
-                    memcpy(bmp, dirty_it->second.bitmap, clean_entry_bitmap_size);
+                if (dirty_dyn_size > sizeof(void*))
+                    bitmap_copy(bmp, dirty_it->second.bitmap, clean_entry_bitmap_size);
                 else
                     bmp = dirty_it->second.bitmap;
             }
@@ -41,14 +42,14 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
     }
     if (!found)
     {
-        auto clean_it = clean_db.find(op->oid);
-        if (clean_it != clean_db.end())
+        clean_entry clean;
+        if (clean_db.get(op->oid, &clean))
         {
-            version = clean_it->second.version + 1;
+            version = clean.version + 1;
             if (!is_del)
             {
-                void *bmp_ptr = get_clean_entry_bitmap(clean_it->second.location, clean_entry_bitmap_size);
-                memcpy((clean_entry_bitmap_size > sizeof(void*) ? bmp : &bmp), bmp_ptr, clean_entry_bitmap_size);
+                void *bmp_ptr = get_clean_entry_bitmap(clean.location, clean_entry_bitmap_size);
+                bitmap_copy((dirty_dyn_size > sizeof(void*) ? bmp : &bmp), bmp_ptr, clean_entry_bitmap_size);
             }
         }
         else
@@ -89,7 +90,7 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
         {
             // Invalid version requested
             op->retval = -EEXIST;
-            if (!is_del && clean_entry_bitmap_size > sizeof(void*))
+            if (!is_del && dirty_dyn_size > sizeof(void*))
             {
                 free(bmp);
             }
@@ -135,23 +136,31 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
         if (op->bitmap)
         {
             // Only allow to overwrite part of the object bitmap respective to the write's offset/len
-            uint8_t *bmp_ptr = (uint8_t*)(clean_entry_bitmap_size > sizeof(void*) ? bmp : &bmp);
-            uint32_t bit = op->offset/bitmap_granularity;
-            uint32_t bits_left = op->len/bitmap_granularity;
-            while (!(bit % 8) && bits_left > 8)
+            uint8_t *bmp_ptr = (uint8_t*)(dirty_dyn_size > sizeof(void*) ? bmp : &bmp);
+            if (op->offset == 0 && op->len == block_size)
             {
-                // Copy bytes
-                bmp_ptr[bit/8] = ((uint8_t*)op->bitmap)[bit/8];
-                bit += 8;
-                bits_left -= 8;
+                // Full overwrite, take the whole bitmap
+                bitmap_copy(bmp_ptr, op->bitmap, clean_entry_bitmap_size);
             }
-            while (bits_left > 0)
+            else
             {
-                // Copy bits
-                bmp_ptr[bit/8] = (bmp_ptr[bit/8] & ~(1 << (bit%8)))
-                    | (((uint8_t*)op->bitmap)[bit/8] & (1 << bit%8));
-                bit++;
-                bits_left--;
+                uint32_t bit = op->offset/bitmap_granularity;
+                uint32_t bits_left = op->len/bitmap_granularity;
+                while (!(bit % 8) && bits_left > 8)
+                {
+                    // Copy bytes
+                    bmp_ptr[bit/8] = ((uint8_t*)op->bitmap)[bit/8];
+                    bit += 8;
+                    bits_left -= 8;
+                }
+                while (bits_left > 0)
+                {
+                    // Copy bits
+                    bmp_ptr[bit/8] = (bmp_ptr[bit/8] & ~(1 << (bit%8)))
+                        | (((uint8_t*)op->bitmap)[bit/8] & (1 << bit%8));
+                    bit++;
+                    bits_left--;
+                }
             }
         }
     }
@@ -174,7 +183,7 @@ void blockstore_impl_t::cancel_all_writes(blockstore_op_t *op, blockstore_dirty_
 {
     while (dirty_it != dirty_db.end() && dirty_it->first.oid == op->oid)
     {
-        if (clean_entry_bitmap_size > sizeof(void*))
+        if (dirty_dyn_size > sizeof(void*))
             free(dirty_it->second.bitmap);
         dirty_db.erase(dirty_it++);
     }
@@ -195,6 +204,21 @@ void blockstore_impl_t::cancel_all_writes(blockstore_op_t *op, blockstore_dirty_
     FINISH_OP(op);
 }
 
+// Check if the previous version of the object is queued and not submitted yet. Writes of
+// different priority classes may be held back independently, but journal entries of one
+// object must still be submitted in the order of versions
+bool blockstore_impl_t::prev_write_in_flight(blockstore_dirty_db_t::iterator dirty_it)
+{
+    if (dirty_it == dirty_db.begin())
+    {
+        return false;
+    }
+    auto prev_it = dirty_it;
+    prev_it--;
+    return prev_it->first.oid == dirty_it->first.oid &&
+        (prev_it->second.state & BS_ST_WORKFLOW_MASK) == BS_ST_IN_FLIGHT;
+}
+
 // First step of the write algorithm: dequeue operation and submit initial write(s)
 int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
 {
@@ -242,6 +266,10 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
             .version = op->version,
         }, e).first;
     }
+    if (prev_write_in_flight(dirty_it))
+    {
+        return 0;
+    }
     if (write_iodepth >= max_write_iodepth)
     {
         return 0;
@@ -250,12 +278,16 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
     {
         blockstore_journal_check_t space_check(this);
         if (!space_check.check_available(op, unsynced_big_write_count + 1,
-            sizeof(journal_entry_big_write) + clean_entry_bitmap_size, JOURNAL_STABILIZE_RESERVATION))
+            sizeof(journal_entry_big_write) + dirty_dyn_size, JOURNAL_STABILIZE_RESERVATION))
         {
             return 0;
         }
         // Big (redirect) write
-        uint64_t loc = data_alloc->find_free();
+        // Allocate the block after the previous location of the object or after the last allocated
+        // block, so that sequentially written objects stay physically contiguous on HDDs
+        clean_entry clean;
+        uint64_t loc = data_alloc->find_free(clean_db.get(op->oid, &clean)
+            ? (clean.location >> block_order) + 1 : next_alloc_hint);
         if (loc == UINT64_MAX)
         {
             // no space
@@ -268,6 +300,15 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
             cancel_all_writes(op, dirty_it, -ENOSPC);
             return 2;
         }
+        // A small object is written into a block which may hold old data, punch the block first.
+        // The punch is hard-linked to the data write, so the write goes after it even if it fails
+        io_uring_sqe *punch_sqe = NULL;
+#ifdef IOSQE_IO_HARDLINK
+        if (op->len < small_object_size && op->len < block_size)
+        {
+            BS_SUBMIT_GET_SQE_DECL(punch_sqe);
+        }
+#endif
         write_iodepth++;
         BS_SUBMIT_GET_SQE(sqe, data);
         dirty_it->second.location = loc << block_order;
@@ -279,6 +320,7 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
         );
 #endif
         data_alloc->set(loc, true);
+        next_alloc_hint = loc+1;
         uint64_t stripe_offset = (op->offset % bitmap_granularity);
         uint64_t stripe_end = (op->offset + op->len) % bitmap_granularity;
         // Zero fill up to bitmap_granularity
@@ -294,8 +336,52 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
             PRIV(op)->iov_zerofill[vcnt++] = (struct iovec){ zero_object, stripe_end };
         }
         data->iov.iov_len = op->len + stripe_offset + stripe_end; // to check it in the callback
-        data->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
-        my_uring_prep_writev(
+        if (data_csum_type != BLOCKSTORE_CSUM_NONE)
+        {
+            calc_block_csums(get_dirty_csums(dirty_it->second), op->offset - stripe_offset, PRIV(op)->iov_zerofill, vcnt);
+        }
+        // Compress full blocks of pools with compression enabled. Checksums are always
+        // calculated from uncompressed data. Only store compressed data if it saves at
+        // least one disk_alignment sector
+        uint32_t compr = 0;
+        void *compr_buf = NULL;
+        int compr_algo = op->offset == 0 && op->len == block_size ? get_inode_compression(op->oid.inode) : BS_COMPRESS_NONE;
+        if (compr_algo != BS_COMPRESS_NONE)
+        {
+            compr_buf = buffer_alloc(block_size);
+            uint32_t compr_len = bs_compress(&compress_ctx, compr_algo, op->buf, block_size, compr_buf, block_size - disk_alignment);
+            if (compr_len)
+            {
+                compr = BS_COMPR_VALUE(compr_algo, compr_len);
+                uint32_t aligned_len = (compr_len + disk_alignment - 1) / disk_alignment * disk_alignment;
+                memset((uint8_t*)compr_buf + compr_len, 0, aligned_len - compr_len);
+                PRIV(op)->iov_zerofill[0] = (struct iovec){ compr_buf, aligned_len };
+                vcnt = 1;
+                data->iov.iov_len = aligned_len;
+            }
+            else
+            {
+                buffer_free(compr_buf);
+                compr_buf = NULL;
+            }
+        }
+        set_dirty_compr(dirty_it->second, compr);
+        read_cache.invalidate(loc << block_order, block_size);
+        if (compr_buf)
+        {
+            data->callback = [this, op, compr_buf](ring_data_t *data)
+            {
+                buffer_free(compr_buf);
+                handle_write_event(data, op);
+            };
+        }
+        else
+            data->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
+        if (punch_sqe)
+        {
+            prep_small_object_punch(punch_sqe, loc);
+        }
+        ringloop->prep_writev(
             sqe, data_fd, PRIV(op)->iov_zerofill, vcnt, data_offset + (loc << block_order) + op->offset - stripe_offset
         );
         PRIV(op)->pending_ops = 1;
@@ -318,7 +404,7 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
         blockstore_journal_check_t space_check(this);
         if (unsynced_big_write_count &&
             !space_check.check_available(op, unsynced_big_write_count,
-                sizeof(journal_entry_big_write) + clean_entry_bitmap_size, 0)
+                sizeof(journal_entry_big_write) + dirty_dyn_size, 0)
             || !space_check.check_available(op, 1,
                 sizeof(journal_entry_small_write) + clean_entry_bitmap_size, op->len + JOURNAL_STABILIZE_RESERVATION))
         {
@@ -333,8 +419,16 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
             // Write current journal sector only if it's dirty and full, or in the immediate_commit mode
             BS_SUBMIT_GET_SQE_DECL(sqe1);
         }
+        // Data may be appended to the previous journal data write if it directly follows it.
+        // The journal entry doesn't move data when it fits into the current sector
+        bool merge_data = op->len > 0 && data_batch_sqe &&
+            journal.next_free == data_batch_end && journal.next_free + op->len <= journal.len &&
+            journal.same_stripe(data_batch_start, data_batch_end + op->len - data_batch_start) &&
+            journal.entry_fits(sizeof(journal_entry_small_write) + clean_entry_bitmap_size) &&
+            (data_batch ? data_batch->ops.size() : 1) < journal_write_batch &&
+            (data_batch ? data_batch->iov.size() : 1) < IOV_MAX;
         struct io_uring_sqe *sqe2 = NULL;
-        if (op->len > 0)
+        if (op->len > 0 && !merge_data)
         {
             BS_SUBMIT_GET_SQE_DECL(sqe2);
         }
@@ -344,7 +438,7 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
         {
             if (sqe1)
             {
-                prepare_journal_sector_write(journal, journal.cur_sector, sqe1, cb);
+                prepare_journal_sector_write(journal.cur_sector, sqe1, cb);
                 PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
                 PRIV(op)->pending_ops++;
             }
@@ -368,19 +462,19 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
         );
 #endif
         // Figure out where data will be
-        journal.next_free = (journal.next_free + op->len) <= journal.len ? journal.next_free : journal_block_size;
+        journal.next_free = journal.data_location(journal.next_free, op->len);
         je->oid = op->oid;
         je->version = op->version;
         je->offset = op->offset;
         je->len = op->len;
         je->data_offset = journal.next_free;
         je->crc32_data = crc32c(0, op->buf, op->len);
-        memcpy((void*)(je+1), (clean_entry_bitmap_size > sizeof(void*) ? dirty_it->second.bitmap : &dirty_it->second.bitmap), clean_entry_bitmap_size);
+        bitmap_copy((void*)(je+1), get_dirty_dyn(dirty_it->second), clean_entry_bitmap_size);
         je->crc32 = je_crc32((journal_entry*)je);
         journal.crc32_last = je->crc32;
         if (immediate_commit != IMMEDIATE_NONE)
         {
-            prepare_journal_sector_write(journal, journal.cur_sector, sqe1, cb);
+            prepare_journal_sector_write(journal.cur_sector, sqe1, cb);
             PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
             PRIV(op)->pending_ops++;
         }
@@ -392,12 +486,24 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
                 // Copy data
                 memcpy(journal.buffer + journal.next_free, op->buf, op->len);
             }
-            ring_data_t *data2 = ((ring_data_t*)sqe2->user_data);
-            data2->iov = (struct iovec){ op->buf, op->len };
-            data2->callback = cb;
-            my_uring_prep_writev(
-                sqe2, journal.fd, &data2->iov, 1, journal.offset + journal.next_free
-            );
+            if (merge_data)
+            {
+                append_journal_data_batch(op);
+            }
+            else
+            {
+                ring_data_t *data2 = ((ring_data_t*)sqe2->user_data);
+                data2->iov = (struct iovec){ op->buf, op->len };
+                data2->callback = cb;
+                ringloop->prep_writev(
+                    sqe2, journal.pos_fd(journal.next_free), &data2->iov, 1, journal.pos_offset(journal.next_free), journal_rw_flags
+                );
+                data_batch_sqe = sqe2;
+                data_batch = NULL;
+                data_batch_op = op;
+                data_batch_start = journal.next_free;
+                data_batch_end = journal.next_free + op->len;
+            }
             PRIV(op)->pending_ops++;
         }
         else
@@ -424,6 +530,36 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
     return 1;
 }
 
+// Append data of a small write to the previous journal data write which is not submitted yet
+void blockstore_impl_t::append_journal_data_batch(blockstore_op_t *op)
+{
+    ring_data_t *data = ((ring_data_t*)data_batch_sqe->user_data);
+    if (!data_batch)
+    {
+        data_batch = new journal_data_batch_t;
+        data_batch->iov.push_back(data->iov);
+        data_batch->ops.push_back(data_batch_op);
+        journal_data_batch_t *batch = data_batch;
+        data->callback = [this, batch](ring_data_t *data)
+        {
+            for (auto op: batch->ops)
+            {
+                handle_write_event(data, op);
+            }
+            delete batch;
+        };
+    }
+    data_batch->iov.push_back((struct iovec){ op->buf, op->len });
+    data_batch->ops.push_back(op);
+    // Total length to check it in the callback
+    data->iov.iov_len += op->len;
+    ringloop->prep_writev(
+        data_batch_sqe, journal.pos_fd(data_batch_start), data_batch->iov.data(), data_batch->iov.size(),
+        journal.pos_offset(data_batch_start), journal_rw_flags
+    );
+    data_batch_end += op->len;
+}
+
 int blockstore_impl_t::continue_write(blockstore_op_t *op)
 {
     int op_state = PRIV(op)->op_state;
@@ -450,7 +586,7 @@ resume_2:
         BS_SUBMIT_GET_SQE_DECL(sqe);
         journal_entry_big_write *je = (journal_entry_big_write*)prefill_single_journal_entry(
             journal, op->opcode == BS_OP_WRITE_STABLE ? JE_BIG_WRITE_INSTANT : JE_BIG_WRITE,
-            sizeof(journal_entry_big_write) + clean_entry_bitmap_size
+            sizeof(journal_entry_big_write) + dirty_dyn_size
         );
         dirty_it->second.journal_sector = journal.sector_info[journal.cur_sector].offset;
         journal.used_sectors[journal.sector_info[journal.cur_sector].offset]++;
@@ -466,10 +602,10 @@ resume_2:
         je->offset = op->offset;
         je->len = op->len;
         je->location = dirty_it->second.location;
-        memcpy((void*)(je+1), (clean_entry_bitmap_size > sizeof(void*) ? dirty_it->second.bitmap : &dirty_it->second.bitmap), clean_entry_bitmap_size);
+        bitmap_copy((void*)(je+1), get_dirty_dyn(dirty_it->second), dirty_dyn_size);
         je->crc32 = je_crc32((journal_entry*)je);
         journal.crc32_last = je->crc32;
-        prepare_journal_sector_write(journal, journal.cur_sector, sqe,
+        prepare_journal_sector_write(journal.cur_sector, sqe,
             [this, op](ring_data_t *data) { handle_write_event(data, op); });
         PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
         PRIV(op)->pending_ops = 1;
@@ -549,11 +685,28 @@ resume_4:
             uint64_t journal_free_space = journal.next_free < used_start
                 ? (used_start - journal.next_free)
                 : (journal.len - journal.next_free + used_start - journal.block_size);
-            uint64_t ref_us =
-                (write_iodepth <= throttle_target_parallelism ? 100 : 100*write_iodepth/throttle_target_parallelism)
-                * (1000000/throttle_target_iops + op->len*1000000/throttle_target_mbs/1024/1024)
-                / 100;
-            ref_us -= ref_us * journal_free_space / journal.len;
+            uint64_t ref_us;
+            uint64_t flush_bps = throttle_auto ? flusher->get_journal_flush_rate() : 0;
+            if (flush_bps)
+            {
+                // Online model: match the journal fill rate to the measured flush rate.
+                // <write_iodepth> parallel writes taking <ref_us> each fill the journal with
+                // write_iodepth*len/ref_us bytes per second. Flushers are at full speed above
+                // flusher_fill_high, so don't throttle below it and reach the flush rate when full
+                uint64_t fill = 100 - journal_free_space*100/journal.len;
+                ref_us = fill <= flusher_fill_high ? 0 : write_iodepth
+                    * (op->len + sizeof(journal_entry_small_write) + dirty_dyn_size) * 1000000 / flush_bps
+                    * (fill - flusher_fill_high) / (100 - flusher_fill_high);
+            }
+            else
+            {
+                // Static model, also used until the flush rate is measured
+                ref_us =
+                    (write_iodepth <= throttle_target_parallelism ? 100 : 100*write_iodepth/throttle_target_parallelism)
+                    * (1000000/throttle_target_iops + op->len*1000000/throttle_target_mbs/1024/1024)
+                    / 100;
+                ref_us -= ref_us * journal_free_space / journal.len;
+            }
             if (ref_us > exec_us + throttle_threshold_us)
             {
                 // Pause reply
@@ -638,6 +791,10 @@ int blockstore_impl_t::dequeue_del(blockstore_op_t *op)
         .version = op->version,
     });
     assert(dirty_it != dirty_db.end());
+    if (prev_write_in_flight(dirty_it))
+    {
+        return 0;
+    }
     blockstore_journal_check_t space_check(this);
     if (!space_check.check_available(op, 1, sizeof(journal_entry_del), JOURNAL_STABILIZE_RESERVATION))
     {
@@ -658,7 +815,7 @@ int blockstore_impl_t::dequeue_del(blockstore_op_t *op)
     {
         if (sqe)
         {
-            prepare_journal_sector_write(journal, journal.cur_sector, sqe, cb);
+            prepare_journal_sector_write(journal.cur_sector, sqe, cb);
             PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
             PRIV(op)->pending_ops++;
         }
@@ -687,7 +844,7 @@ int blockstore_impl_t::dequeue_del(blockstore_op_t *op)
     dirty_it->second.state = BS_ST_DELETE | BS_ST_SUBMITTED;
     if (immediate_commit != IMMEDIATE_NONE)
     {
-        prepare_journal_sector_write(journal, journal.cur_sector, sqe, cb);
+        prepare_journal_sector_write(journal.cur_sector, sqe, cb);
         PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 1 + journal.cur_sector;
         PRIV(op)->pending_ops++;
     }
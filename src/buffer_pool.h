@@ -0,0 +1,141 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <map>
+#include <vector>
+#include <functional>
+
+#include "malloc_or_die.h"
+
+// Size classes from 4 KB to 4 MB, buffers are carved from 4 MB chunks aligned to huge pages
+#define BUFFER_POOL_MIN_ORDER 12
+#define BUFFER_POOL_MAX_ORDER 22
+#define BUFFER_POOL_CHUNK_SIZE (1ul << BUFFER_POOL_MAX_ORDER)
+#define BUFFER_POOL_CHUNK_ALIGN (2*1024*1024)
+// Maximum number of chunks registered as io_uring fixed buffers by the blockstore
+#define BUFFER_POOL_MAX_FIXED_CHUNKS 16
+
+// Pool of aligned I/O buffers in power-of-2 size classes. Freed buffers are kept in per-class
+// free lists and chunks are only returned to the system when the pool itself is destroyed,
+// so temporary buffers of flushes, compressed reads and EC reads/RMW don't call memalign/free
+// in the steady state, and chunks may be registered as io_uring fixed buffers.
+// Larger buffers are allocated directly. Buffers must be freed by the thread that allocated them.
+class buffer_pool_t
+{
+    // Chunk start => size class
+    std::map<uint8_t*, int> chunks;
+    std::vector<void*> free_bufs[BUFFER_POOL_MAX_ORDER-BUFFER_POOL_MIN_ORDER+1];
+    uint64_t used_bytes = 0;
+
+    static inline int size_order(size_t size)
+    {
+        int order = BUFFER_POOL_MIN_ORDER;
+        while ((1ul << order) < size)
+            order++;
+        return order;
+    }
+
+    void add_chunk(int order)
+    {
+        uint8_t *chunk = (uint8_t*)memalign_or_die(BUFFER_POOL_CHUNK_ALIGN, BUFFER_POOL_CHUNK_SIZE);
+        if (use_hugepages)
+        {
+            // Best-effort: transparent huge pages may be disabled
+            madvise(chunk, BUFFER_POOL_CHUNK_SIZE, MADV_HUGEPAGE);
+        }
+        chunks[chunk] = order;
+        auto & fl = free_bufs[order-BUFFER_POOL_MIN_ORDER];
+        for (size_t pos = BUFFER_POOL_CHUNK_SIZE; pos > 0; pos -= (1ul << order))
+            fl.push_back(chunk + pos - (1ul << order));
+        if (on_new_chunk)
+            on_new_chunk(chunk, BUFFER_POOL_CHUNK_SIZE);
+    }
+
+public:
+    bool use_hugepages = false;
+    // Called for every new chunk, for example to register it as an io_uring fixed buffer
+    std::function<void(void*, size_t)> on_new_chunk;
+
+    ~buffer_pool_t()
+    {
+        for (auto & cp: chunks)
+            free(cp.first);
+    }
+
+    void *alloc(size_t size)
+    {
+        if (size > BUFFER_POOL_CHUNK_SIZE)
+            return memalign_or_die(1ul << BUFFER_POOL_MIN_ORDER, size);
+        int order = size_order(size);
+        auto & fl = free_bufs[order-BUFFER_POOL_MIN_ORDER];
+        if (!fl.size())
+            add_chunk(order);
+        void *buf = fl.back();
+        fl.pop_back();
+        used_bytes += (1ul << order);
+        return buf;
+    }
+
+    // Buffers not allocated by this pool are passed to free()
+    void release(void *buf)
+    {
+        auto it = chunks.upper_bound((uint8_t*)buf);
+        if (it != chunks.begin())
+        {
+            it--;
+            if ((uint8_t*)buf < it->first + BUFFER_POOL_CHUNK_SIZE)
+            {
+                free_bufs[it->second-BUFFER_POOL_MIN_ORDER].push_back(buf);
+                used_bytes -= (1ul << it->second);
+                return;
+            }
+        }
+        free(buf);
+    }
+
+    void for_each_chunk(std::function<void(void*, size_t)> cb)
+    {
+        for (auto & cp: chunks)
+            cb(cp.first, BUFFER_POOL_CHUNK_SIZE);
+    }
+
+    inline size_t get_chunk_count() { return chunks.size(); }
+    inline uint64_t get_used_bytes() { return used_bytes; }
+    inline uint64_t get_allocated_bytes() { return chunks.size() * BUFFER_POOL_CHUNK_SIZE; }
+};
+
+// Per-thread pool shared by the blockstore and the OSD. It's created on the first allocation,
+// so freeing buffers in threads that never allocated from it is just free()
+inline buffer_pool_t *& thread_buffer_pool_ptr()
+{
+    static thread_local buffer_pool_t *pool = NULL;
+    return pool;
+}
+
+inline buffer_pool_t & thread_buffer_pool()
+{
+    buffer_pool_t *& pool = thread_buffer_pool_ptr();
+    if (!pool)
+        pool = new buffer_pool_t();
+    return *pool;
+}
+
+inline void *buffer_alloc(size_t size)
+{
+    return thread_buffer_pool().alloc(size);
+}
+
+inline void buffer_free(void *buf)
+{
+    buffer_pool_t *pool = thread_buffer_pool_ptr();
+    if (pool)
+        pool->release(buf);
+    else
+        free(buf);
+}
@@ -0,0 +1,47 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+
+// Moving average of the rate of work done while busy, in units per second. Only busy time
+// counts, so idle gaps between bursts don't lower the estimate. Time is passed by the caller
+// so that it's only read when the busy state changes or work is done
+struct busy_rate_t
+{
+    // Busy time of one measurement window
+    uint64_t window_us = 1000000;
+    bool busy = false;
+    uint64_t busy_start_us = 0, busy_us = 0, amount = 0;
+    // Moving average with 1/4 weight of the new window, 0 if not measured yet
+    uint64_t rate = 0;
+
+    void set_busy(bool is_busy, uint64_t now_us)
+    {
+        if (is_busy == busy)
+            return;
+        if (is_busy)
+            busy_start_us = now_us;
+        else
+            busy_us += now_us - busy_start_us;
+        busy = is_busy;
+    }
+
+    // Work done outside of busy periods isn't counted
+    void add(uint64_t done, uint64_t now_us)
+    {
+        if (!busy)
+            return;
+        amount += done;
+        uint64_t total_us = busy_us + now_us - busy_start_us;
+        if (total_us >= window_us)
+        {
+            uint64_t cur = amount*1000000/total_us;
+            rate = rate ? (rate*3 + cur) / 4 : cur;
+            amount = 0;
+            busy_us = 0;
+            busy_start_us = now_us;
+        }
+    }
+};
@@ -60,6 +60,7 @@ void cli_tool_t::help()
         "  Remove inode data without changing metadata.\n"
         "  --wait-list means first retrieve objects listings and then remove it.\n"
         "  --wait-list requires more memory, but allows to show correct stats.\n"
+        "  Objects are deleted by primary OSDs in batches unless --offload 0 or --wait-list is given.\n"
         "\n"
         "%s merge-data [OPTIONS] <from> <to> [--target <target>]\n"
         "  Merge layer data without changing metadata. Merge <from>..<to> to <target>.\n"
@@ -75,14 +76,34 @@ void cli_tool_t::help()
         "  of children \"to be rebased\", but only if that child itself is readonly or if\n"
         "  --writers-stopped 1 is specified\n"
         "\n"
+        "%s bench [OPTIONS] [--pool <pool>] [--rw randwrite] [--bs 4096] [--runtime 10] [--json]\n"
+        "  Create a temporary image, benchmark it with --iodepth parallel operations and remove it.\n"
+        "  Reports IOPS, latency percentiles and per-OSD and per-PG latencies, marking OSDs and PGs\n"
+        "  with average latency above --slow_factor (default 2) x median of averages as slow.\n"
+        "  --pool may be omitted if there is only one pool. Other options:\n"
+        "  --rw read|write|randread|randwrite  Workload type (default randwrite)\n"
+        "  --size N            Temporary image size in bytes (default 1 GB)\n"
+        "  --fsync N           Sync after every N writes (default only at the end)\n"
+        "  --prefill 1|0       Fill the image before reading (default 1)\n"
+        "  --image <name>      Temporary image name (default bench-<hostname>-<pid>)\n"
+        "\n"
+        "%s traces <osd_number> [--count N] [--min_us N]\n"
+        "  Print traces of sampled operations recorded by an OSD (see trace_sample), newest first.\n"
+        "  --count limits the number of printed traces, --min_us skips operations faster than N us.\n"
+        "\n"
+        "%s memory <osd_number> [--pgs N]\n"
+        "  Print estimated memory usage of OSD structures in bytes. --pgs N also lists N PGs\n"
+        "  with the largest object state maps.\n"
+        "\n"
         "OPTIONS (global):\n"
         "  --etcd_address <etcd_address>\n"
         "  --iodepth N         Send N operations in parallel to each OSD when possible (default 32)\n"
         "  --parallel_osds M   Work with M osds in parallel when possible (default 4)\n"
         "  --progress 1|0      Report progress (default 1)\n"
         "  --cas 1|0           Use online CAS writes when possible (default auto)\n"
+        "  --offload 1|0       Merge data on OSDs instead of copying it through this host when possible (default 1)\n"
         ,
-        exe_name, exe_name, exe_name, exe_name
+        exe_name, exe_name, exe_name, exe_name, exe_name, exe_name, exe_name
     );
     exit(0);
 }
@@ -196,6 +217,21 @@ void cli_tool_t::run(json11::Json cfg)
         // Remove multiple snapshots and rebase their children
         action_cb = start_snap_rm(cfg);
     }
+    else if (cmd[0] == "bench")
+    {
+        // Benchmark the cluster using a temporary image
+        action_cb = start_bench(cfg);
+    }
+    else if (cmd[0] == "traces")
+    {
+        // Print operation traces of an OSD
+        action_cb = start_traces(cfg);
+    }
+    else if (cmd[0] == "memory")
+    {
+        // Print memory usage of an OSD
+        action_cb = start_memory(cfg);
+    }
     else
     {
         fprintf(stderr, "unknown command: %s\n", cmd[0].string_value().c_str());
@@ -212,7 +248,7 @@ void cli_tool_t::run(json11::Json cfg)
     list_first = cfg["wait-list"].uint64_value() ? true : false;
     // Create client
     ringloop = new ring_loop_t(512);
-    epmgr = new epoll_manager_t(ringloop);
+    epmgr = new epoll_manager_t(ringloop, cfg["use_uring_poll"].bool_value() || cfg["use_uring_poll"].uint64_value());
     cli = new cluster_client_t(ringloop, epmgr->tfd, cfg);
     cli->on_ready([this]()
     {
@@ -14,6 +14,9 @@ struct rm_inode_t;
 struct snap_merger_t;
 struct snap_flattener_t;
 struct snap_remover_t;
+struct cli_bench_t;
+struct cli_traces_t;
+struct cli_memory_t;
 
 class epoll_manager_t;
 class cluster_client_t;
@@ -48,9 +51,15 @@ public:
     friend struct snap_merger_t;
     friend struct snap_flattener_t;
     friend struct snap_remover_t;
+    friend struct cli_bench_t;
+    friend struct cli_traces_t;
+    friend struct cli_memory_t;
 
     std::function<bool(void)> start_rm(json11::Json);
     std::function<bool(void)> start_merge(json11::Json);
     std::function<bool(void)> start_flatten(json11::Json);
     std::function<bool(void)> start_snap_rm(json11::Json);
+    std::function<bool(void)> start_bench(json11::Json);
+    std::function<bool(void)> start_traces(json11::Json);
+    std::function<bool(void)> start_memory(json11::Json);
 };
@@ -0,0 +1,628 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Cluster benchmark: creates a temporary image, runs a read or write workload on it
+// through cluster_client_t, attributes op part latencies to responding OSDs and PGs
+// to find slow ones, and then removes the image
+
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <algorithm>
+#include "cli.h"
+#include "cluster_client.h"
+#include "latency_hist.h"
+#include "base64.h"
+
+// Give up creating the temporary image after this number of etcd transaction conflicts
+#define BENCH_CREATE_ATTEMPTS 10
+// Number of slow PGs to list
+#define BENCH_MAX_SLOW_PGS 10
+
+struct bench_stat_t
+{
+    uint64_t count = 0, sum = 0, max = 0;
+    osd_num_t osd_num = 0;
+
+    void add(uint64_t usec)
+    {
+        count++;
+        sum += usec;
+        if (max < usec)
+            max = usec;
+    }
+
+    uint64_t avg() const
+    {
+        return count ? sum/count : 0;
+    }
+};
+
+struct cli_bench_t
+{
+    cli_tool_t *parent;
+
+    // -- CONFIGURATION --
+    std::string pool_name;
+    std::string image_name;
+    bool write = true, random = true;
+    uint64_t bs = 4096;
+    uint64_t size = 1024*1024*1024;
+    uint64_t runtime_us = 10000000;
+    // sync after every <fsync_interval> writes, 0 = only at the end
+    uint64_t fsync_interval = 0;
+    // fill the image before reading so that OSDs actually read data
+    bool prefill = true;
+    // OSDs and PGs with average latency above median*<slow_factor> are reported as slow
+    double slow_factor = 2;
+    bool json_output = false;
+
+    // -- STATE --
+    int state = 0;
+    pool_id_t pool_id = 0;
+    inode_t inode = 0;
+    int create_attempts = 0;
+    uint64_t iodepth = 0, buf_size = 0;
+    std::vector<void*> bufs;
+    std::vector<int> free_bufs;
+    std::vector<timespec> buf_start;
+    int in_flight = 0;
+    bool measure = false, stopping = false, failed = false;
+    uint64_t cur_bs = 0, next_offset = 0;
+    uint64_t writes_since_sync = 0;
+    bool sync_in_flight = false;
+    timespec phase_start;
+    uint64_t elapsed_us = 0;
+    uint64_t op_count = 0, op_bytes = 0, lat_sum = 0, lat_max = 0;
+    latency_hist_t hist = { 0 };
+    std::map<osd_num_t, bench_stat_t> osd_stats;
+    std::map<pg_num_t, bench_stat_t> pg_stats;
+    std::function<bool(void)> rm_cb;
+
+    ~cli_bench_t()
+    {
+        for (auto buf: bufs)
+            free(buf);
+    }
+
+    void resolve_pool()
+    {
+        auto & pools = parent->cli->st_cli.pool_config;
+        if (pool_name == "")
+        {
+            if (pools.size() != 1)
+            {
+                fprintf(stderr, "%s, specify it with --pool\n", pools.size() ? "There are multiple pools" : "No pools found");
+                exit(1);
+            }
+            pool_id = pools.begin()->first;
+            return;
+        }
+        for (auto & pp: pools)
+        {
+            if (pp.second.name == pool_name || std::to_string(pp.first) == pool_name)
+            {
+                pool_id = pp.first;
+                return;
+            }
+        }
+        fprintf(stderr, "Pool %s not found\n", pool_name.c_str());
+        exit(1);
+    }
+
+    void create_image()
+    {
+        std::string maxid_key = base64_encode(parent->cli->st_cli.etcd_prefix+"/index/maxid/"+std::to_string(pool_id));
+        parent->waiting++;
+        parent->cli->st_cli.etcd_txn(json11::Json::object {
+            { "success", json11::Json::array {
+                json11::Json::object {
+                    { "request_range", json11::Json::object {
+                        { "key", maxid_key },
+                    } },
+                },
+            } },
+        }, ETCD_SLOW_TIMEOUT, [this, maxid_key](std::string err, json11::Json res)
+        {
+            if (err != "")
+            {
+                fprintf(stderr, "Error reading max inode ID of pool %u: %s\n", pool_id, err.c_str());
+                exit(1);
+            }
+            uint64_t max_id = 0, maxid_rev = 0;
+            auto kvs = res["responses"][0]["response_range"]["kvs"];
+            if (kvs.array_items().size())
+            {
+                auto kv = parent->cli->st_cli.parse_etcd_kv(kvs[0]);
+                max_id = kv.value.uint64_value();
+                maxid_rev = kv.mod_revision;
+            }
+            // Images created by older tools may be missing from the index
+            for (auto & ic: parent->cli->st_cli.inode_config)
+            {
+                if (INODE_POOL(ic.first) == pool_id && INODE_NO_POOL(ic.first) > max_id)
+                    max_id = INODE_NO_POOL(ic.first);
+            }
+            put_image(max_id+1, maxid_key, maxid_rev);
+        });
+    }
+
+    void put_image(uint64_t id, std::string maxid_key, uint64_t maxid_rev)
+    {
+        std::string cfg_key = base64_encode(parent->cli->st_cli.etcd_prefix+
+            "/config/inode/"+std::to_string(pool_id)+"/"+std::to_string(id));
+        std::string idx_key = base64_encode(parent->cli->st_cli.etcd_prefix+"/index/image/"+image_name);
+        parent->cli->st_cli.etcd_txn(json11::Json::object {
+            { "compare", json11::Json::array {
+                json11::Json::object {
+                    { "target", "MOD" },
+                    { "key", maxid_key },
+                    { "result", "LESS" },
+                    { "mod_revision", maxid_rev+1 },
+                },
+                json11::Json::object {
+                    { "target", "MOD" },
+                    { "key", cfg_key },
+                    { "result", "LESS" },
+                    { "mod_revision", 1 },
+                },
+                json11::Json::object {
+                    { "target", "MOD" },
+                    { "key", idx_key },
+                    { "result", "LESS" },
+                    { "mod_revision", 1 },
+                },
+            } },
+            { "success", json11::Json::array {
+                json11::Json::object {
+                    { "request_put", json11::Json::object {
+                        { "key", maxid_key },
+                        { "value", base64_encode(json11::Json(id).dump()) },
+                    } },
+                },
+                json11::Json::object {
+                    { "request_put", json11::Json::object {
+                        { "key", cfg_key },
+                        { "value", base64_encode(json11::Json(json11::Json::object {
+                            { "name", image_name },
+                            { "size", size },
+                        }).dump()) },
+                    } },
+                },
+                json11::Json::object {
+                    { "request_put", json11::Json::object {
+                        { "key", idx_key },
+                        { "value", base64_encode(json11::Json(json11::Json::object {
+                            { "id", id },
+                            { "pool_id", (uint64_t)pool_id },
+                        }).dump()) },
+                    } },
+                },
+            } },
+        }, ETCD_SLOW_TIMEOUT, [this, id](std::string err, json11::Json res)
+        {
+            if (err != "")
+            {
+                fprintf(stderr, "Error creating temporary image %s: %s\n", image_name.c_str(), err.c_str());
+                exit(1);
+            }
+            if (!res["succeeded"].bool_value())
+            {
+                // Someone else allocated an inode number or the name is taken, retry
+                if (++create_attempts >= BENCH_CREATE_ATTEMPTS)
+                {
+                    fprintf(stderr, "Failed to create temporary image %s: too many conflicts\n", image_name.c_str());
+                    exit(1);
+                }
+                parent->waiting--;
+                create_image();
+                return;
+            }
+            inode = INODE_WITH_POOL(pool_id, id);
+            if (!json_output)
+                printf("Created temporary image %s (inode %lu in pool %u)\n", image_name.c_str(), id, pool_id);
+            parent->waiting--;
+            parent->ringloop->wakeup();
+        });
+    }
+
+    void delete_image()
+    {
+        std::string cfg_key = base64_encode(parent->cli->st_cli.etcd_prefix+
+            "/config/inode/"+std::to_string(pool_id)+"/"+std::to_string(INODE_NO_POOL(inode)));
+        std::string idx_key = base64_encode(parent->cli->st_cli.etcd_prefix+"/index/image/"+image_name);
+        parent->waiting++;
+        parent->cli->st_cli.etcd_txn(json11::Json::object {
+            { "success", json11::Json::array {
+                json11::Json::object {
+                    { "request_delete_range", json11::Json::object {
+                        { "key", cfg_key },
+                    } },
+                },
+                json11::Json::object {
+                    { "request_delete_range", json11::Json::object {
+                        { "key", idx_key },
+                    } },
+                },
+            } },
+        }, ETCD_SLOW_TIMEOUT, [this](std::string err, json11::Json res)
+        {
+            parent->waiting--;
+            if (err != "")
+            {
+                fprintf(stderr, "Error deleting temporary image %s: %s\n", image_name.c_str(), err.c_str());
+                exit(1);
+            }
+            if (!json_output)
+                printf("Temporary image %s deleted\n", image_name.c_str());
+            parent->ringloop->wakeup();
+        });
+    }
+
+    void start_phase(uint64_t phase_bs, bool phase_measure)
+    {
+        cur_bs = phase_bs;
+        measure = phase_measure;
+        stopping = false;
+        next_offset = 0;
+        writes_since_sync = 0;
+        clock_gettime(CLOCK_REALTIME, &phase_start);
+        if (measure)
+        {
+            parent->cli->on_part_done = [this](cluster_op_part_t *part, uint64_t usec)
+            {
+                if (part->op.req.hdr.opcode != OSD_OP_READ && part->op.req.hdr.opcode != OSD_OP_WRITE)
+                    return;
+                osd_stats[part->osd_num].add(usec);
+                auto & pg_st = pg_stats[part->pg_num];
+                pg_st.osd_num = part->osd_num;
+                pg_st.add(usec);
+            };
+        }
+    }
+
+    // Returns true when the phase is finished and all its ops are completed
+    bool continue_phase(bool phase_write, bool phase_random, bool until_full)
+    {
+        timespec tv_now;
+        clock_gettime(CLOCK_REALTIME, &tv_now);
+        elapsed_us = (tv_now.tv_sec - phase_start.tv_sec)*1000000 + (tv_now.tv_nsec - phase_start.tv_nsec)/1000;
+        if (!until_full && elapsed_us >= runtime_us)
+            stopping = true;
+        while (!stopping && !failed && free_bufs.size() > 0)
+        {
+            if (until_full && next_offset >= size)
+            {
+                stopping = true;
+                break;
+            }
+            if (phase_write && fsync_interval && writes_since_sync >= fsync_interval)
+            {
+                if (!sync_in_flight)
+                    submit_sync();
+                break;
+            }
+            uint64_t offset = next_offset;
+            if (phase_random)
+                offset = (lrand48() % (size/cur_bs)) * cur_bs;
+            else
+                next_offset = next_offset+cur_bs >= size && !until_full ? 0 : next_offset+cur_bs;
+            submit_op(phase_write, offset);
+        }
+        return (stopping || failed) && !in_flight && !sync_in_flight;
+    }
+
+    void submit_op(bool op_write, uint64_t offset)
+    {
+        int slot = free_bufs.back();
+        free_bufs.pop_back();
+        clock_gettime(CLOCK_REALTIME, &buf_start[slot]);
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = op_write ? OSD_OP_WRITE : OSD_OP_READ;
+        op->inode = inode;
+        op->offset = offset;
+        op->len = cur_bs;
+        op->iov.push_back(bufs[slot], cur_bs);
+        op->callback = [this, slot](cluster_op_t *op)
+        {
+            in_flight--;
+            free_bufs.push_back(slot);
+            if (op->retval != (int)op->len)
+            {
+                fprintf(
+                    stderr, "%s at offset %lu failed: %s (code %d)\n", op->opcode == OSD_OP_WRITE ? "Write" : "Read",
+                    op->offset, strerror(op->retval < 0 ? -op->retval : EIO), op->retval
+                );
+                failed = true;
+            }
+            else if (measure)
+            {
+                timespec tv_end;
+                clock_gettime(CLOCK_REALTIME, &tv_end);
+                uint64_t usec = (tv_end.tv_sec - buf_start[slot].tv_sec)*1000000 +
+                    (tv_end.tv_nsec - buf_start[slot].tv_nsec)/1000;
+                op_count++;
+                op_bytes += op->len;
+                lat_sum += usec;
+                if (lat_max < usec)
+                    lat_max = usec;
+                hist.add(usec);
+            }
+            if (op->opcode == OSD_OP_WRITE)
+                writes_since_sync++;
+            delete op;
+            parent->ringloop->wakeup();
+        };
+        in_flight++;
+        parent->cli->execute(op);
+    }
+
+    void submit_sync()
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_SYNC;
+        op->callback = [this](cluster_op_t *op)
+        {
+            sync_in_flight = false;
+            if (op->retval != 0)
+            {
+                fprintf(stderr, "Sync failed: %s (code %d)\n", strerror(-op->retval), op->retval);
+                failed = true;
+            }
+            delete op;
+            parent->ringloop->wakeup();
+        };
+        sync_in_flight = true;
+        writes_since_sync = 0;
+        parent->cli->execute(op);
+    }
+
+    template<class K> static uint64_t median_avg(const std::map<K, bench_stat_t> & stats)
+    {
+        std::vector<uint64_t> avgs;
+        for (auto & sp: stats)
+            avgs.push_back(sp.second.avg());
+        if (!avgs.size())
+            return 0;
+        std::nth_element(avgs.begin(), avgs.begin() + avgs.size()/2, avgs.end());
+        return avgs[avgs.size()/2];
+    }
+
+    void print_results()
+    {
+        uint64_t osd_median = median_avg(osd_stats), pg_median = median_avg(pg_stats);
+        std::vector<std::pair<uint64_t, pg_num_t>> slow_pgs;
+        for (auto & pp: pg_stats)
+        {
+            if (pp.second.avg() > pg_median*slow_factor)
+                slow_pgs.push_back({ pp.second.avg(), pp.first });
+        }
+        std::sort(slow_pgs.begin(), slow_pgs.end(), std::greater<std::pair<uint64_t, pg_num_t>>());
+        const char *rw_name = random ? (write ? "randwrite" : "randread") : (write ? "write" : "read");
+        if (json_output)
+        {
+            json11::Json::array osds, pgs;
+            for (auto & op: osd_stats)
+            {
+                osds.push_back(json11::Json::object {
+                    { "osd_num", op.first },
+                    { "ops", op.second.count },
+                    { "avg_us", op.second.avg() },
+                    { "max_us", op.second.max },
+                    { "slow", op.second.avg() > osd_median*slow_factor },
+                });
+            }
+            for (auto & pp: pg_stats)
+            {
+                pgs.push_back(json11::Json::object {
+                    { "pg_num", (uint64_t)pp.first },
+                    { "osd_num", pp.second.osd_num },
+                    { "ops", pp.second.count },
+                    { "avg_us", pp.second.avg() },
+                    { "max_us", pp.second.max },
+                    { "slow", pp.second.avg() > pg_median*slow_factor },
+                });
+            }
+            printf("%s\n", json11::Json(json11::Json::object {
+                { "rw", rw_name },
+                { "bs", bs },
+                { "iodepth", iodepth },
+                { "pool_id", (uint64_t)pool_id },
+                { "runtime_us", elapsed_us },
+                { "iops", elapsed_us ? op_count*1000000/elapsed_us : 0 },
+                { "bandwidth", elapsed_us ? op_bytes*1000000/elapsed_us : 0 },
+                { "lat_avg_us", op_count ? lat_sum/op_count : 0 },
+                { "lat_p50_us", hist.percentile(op_count, 50) },
+                { "lat_p90_us", hist.percentile(op_count, 90) },
+                { "lat_p99_us", hist.percentile(op_count, 99) },
+                { "lat_p999_us", hist.percentile(op_count, 99.9) },
+                { "lat_max_us", lat_max },
+                { "osds", osds },
+                { "pgs", pgs },
+            }).dump().c_str());
+            return;
+        }
+        printf(
+            "%s bs=%lu iodepth=%lu pool=%u: %lu iops, %.1f MB/s\n",
+            rw_name, bs, iodepth, pool_id,
+            elapsed_us ? op_count*1000000/elapsed_us : 0, elapsed_us ? (double)op_bytes/elapsed_us : 0.0
+        );
+        printf(
+            "  latency (us): avg=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu\n",
+            op_count ? lat_sum/op_count : 0, hist.percentile(op_count, 50), hist.percentile(op_count, 90),
+            hist.percentile(op_count, 99), hist.percentile(op_count, 99.9), lat_max
+        );
+        printf("Per-OSD latency (us), median of averages %lu:\n", osd_median);
+        for (auto & op: osd_stats)
+        {
+            printf(
+                "  OSD %-6lu ops=%-9lu avg=%-7lu max=%-7lu%s\n", op.first, op.second.count,
+                op.second.avg(), op.second.max, op.second.avg() > osd_median*slow_factor ? " SLOW" : ""
+            );
+        }
+        if (!slow_pgs.size())
+        {
+            printf("No slow PGs, median of average PG latencies is %lu us\n", pg_median);
+            return;
+        }
+        printf("Slow PGs (average latency above %.1f x median %lu us): %lu of %lu\n",
+            slow_factor, pg_median, slow_pgs.size(), pg_stats.size());
+        for (int i = 0; i < slow_pgs.size() && i < BENCH_MAX_SLOW_PGS; i++)
+        {
+            auto & st = pg_stats[slow_pgs[i].second];
+            printf(
+                "  PG %u/%-6u OSD %-6lu ops=%-9lu avg=%-7lu max=%lu\n", pool_id,
+                slow_pgs[i].second, st.osd_num, st.count, st.avg(), st.max
+            );
+        }
+    }
+
+    bool is_done()
+    {
+        return state == 100;
+    }
+
+    void loop()
+    {
+        if (state == 1)
+            goto resume_1;
+        else if (state == 2)
+            goto resume_2;
+        else if (state == 3)
+            goto resume_3;
+        else if (state == 4)
+            goto resume_4;
+        else if (state == 5)
+            goto resume_5;
+        else if (state == 6)
+            goto resume_6;
+        else if (state == 100)
+            goto resume_100;
+        resolve_pool();
+        if (!bs || bs % parent->cli->get_bs_bitmap_granularity())
+        {
+            fprintf(stderr, "Block size must be a non-zero multiple of %u\n", parent->cli->get_bs_bitmap_granularity());
+            exit(1);
+        }
+        if (size < bs || size % bs)
+        {
+            fprintf(stderr, "Image size must be a non-zero multiple of the block size\n");
+            exit(1);
+        }
+        iodepth = parent->iodepth;
+        buf_size = std::max(bs, parent->cli->get_bs_block_size());
+        bufs.resize(iodepth);
+        buf_start.resize(iodepth);
+        for (int i = 0; i < iodepth; i++)
+        {
+            bufs[i] = malloc_or_die(buf_size);
+            for (uint64_t j = 0; j+sizeof(long) <= buf_size; j += sizeof(long))
+                *(long*)(bufs[i]+j) = lrand48();
+            free_bufs.push_back(i);
+        }
+        // Create the temporary image
+        create_image();
+        state = 1;
+resume_1:
+        if (parent->waiting > 0)
+            return;
+        if (!write && prefill)
+        {
+            // Fill the image so that reads hit real data
+            if (!json_output)
+                printf("Filling the image before reading...\n");
+            start_phase(std::min(size, parent->cli->get_bs_block_size()), false);
+            state = 2;
+resume_2:
+            if (!continue_phase(true, false, true))
+                return;
+        }
+        // Run the benchmark
+        start_phase(bs, true);
+        state = 3;
+resume_3:
+        if (!continue_phase(write, random, false))
+            return;
+        parent->cli->on_part_done = NULL;
+        if (write && !failed)
+        {
+            submit_sync();
+            state = 4;
+resume_4:
+            if (sync_in_flight)
+                return;
+        }
+        if (!failed)
+            print_results();
+        // Remove data and the image
+        rm_cb = parent->start_rm(json11::Json::object {
+            { "inode", inode },
+            { "pool", (uint64_t)pool_id },
+        });
+        state = 5;
+resume_5:
+        if (!rm_cb())
+            return;
+        rm_cb = NULL;
+        delete_image();
+        state = 6;
+resume_6:
+        if (parent->waiting > 0)
+            return;
+        if (failed)
+            exit(1);
+        state = 100;
+resume_100:
+        return;
+    }
+};
+
+std::function<bool(void)> cli_tool_t::start_bench(json11::Json cfg)
+{
+    auto bench = new cli_bench_t();
+    bench->parent = this;
+    bench->pool_name = cfg["pool"].is_string() ? cfg["pool"].string_value() : (cfg["pool"].is_null() ? "" : std::to_string(cfg["pool"].uint64_value()));
+    std::string rw = cfg["rw"].is_null() ? "randwrite" : cfg["rw"].string_value();
+    if (rw != "read" && rw != "write" && rw != "randread" && rw != "randwrite")
+    {
+        fprintf(stderr, "--rw must be one of read, write, randread, randwrite\n");
+        exit(1);
+    }
+    bench->random = rw.substr(0, 4) == "rand";
+    bench->write = rw.substr(rw.size()-5) == "write";
+    if (!cfg["bs"].is_null())
+        bench->bs = cfg["bs"].uint64_value();
+    if (!cfg["size"].is_null())
+        bench->size = cfg["size"].uint64_value();
+    if (!cfg["runtime"].is_null())
+        bench->runtime_us = cfg["runtime"].uint64_value()*1000000;
+    bench->fsync_interval = cfg["fsync"].uint64_value();
+    if (!cfg["prefill"].is_null())
+        bench->prefill = cfg["prefill"].uint64_value() ? true : false;
+    if (!cfg["slow_factor"].is_null())
+        bench->slow_factor = cfg["slow_factor"].is_string()
+            ? atof(cfg["slow_factor"].string_value().c_str()) : cfg["slow_factor"].number_value();
+    if (bench->slow_factor < 1)
+        bench->slow_factor = 1;
+    bench->json_output = cfg["json"].uint64_value() ? true : false;
+    if (bench->json_output)
+        progress = false;
+    if (cfg["image"].is_string())
+        bench->image_name = cfg["image"].string_value();
+    else
+    {
+        char hostname[256] = { 0 };
+        gethostname(hostname, sizeof(hostname)-1);
+        bench->image_name = "bench-"+std::string(hostname)+"-"+std::to_string(getpid());
+    }
+    return [bench]()
+    {
+        bench->loop();
+        if (bench->is_done())
+        {
+            delete bench;
+            return true;
+        }
+        return false;
+    };
+}
@@ -17,6 +17,8 @@ struct snap_flattener_t
     int use_cas = 1;
     // interval between fsyncs
     int fsync_interval = 128;
+    // merge data on OSDs when possible
+    bool offload = true;
 
     std::string top_parent_name;
     inode_t target_id = 0;
@@ -72,6 +74,7 @@ struct snap_flattener_t
             { "delete-source", false },
             { "cas", use_cas },
             { "fsync-interval", fsync_interval },
+            { "offload", offload ? 1 : 0 },
         });
         // Wait for it
 resume_1:
@@ -111,6 +114,8 @@ std::function<bool(void)> cli_tool_t::start_flatten(json11::Json cfg)
         flattener->fsync_interval = 128;
     if (!cfg["cas"].is_null())
         flattener->use_cas = cfg["cas"].uint64_value() ? 2 : 0;
+    if (!cfg["offload"].is_null())
+        flattener->offload = cfg["offload"].uint64_value() ? true : false;
     return [flattener]()
     {
         flattener->loop();
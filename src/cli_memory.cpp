@@ -0,0 +1,103 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "cli.h"
+#include "cluster_client.h"
+
+// Print estimated memory usage of OSD structures (see osd_memory.cpp)
+struct cli_memory_t
+{
+    cli_tool_t *parent;
+
+    osd_num_t osd_num = 0;
+    uint64_t max_pgs = 0;
+
+    int state = 0;
+    bool sent = false;
+    bool done = false;
+
+    void send_request()
+    {
+        auto peer_it = parent->cli->msgr.osd_peer_fds.find(osd_num);
+        if (peer_it == parent->cli->msgr.osd_peer_fds.end())
+        {
+            if (parent->cli->st_cli.peer_states.find(osd_num) == parent->cli->st_cli.peer_states.end())
+            {
+                fprintf(stderr, "OSD %lu is down\n", osd_num);
+                exit(1);
+            }
+            // Initiate connection and wait for it
+            parent->cli->msgr.connect_peer(osd_num, parent->cli->st_cli.peer_states[osd_num]);
+            return;
+        }
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = peer_it->second;
+        op->req = (osd_any_op_t){
+            .show_memory = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = parent->cli->next_op_id(),
+                    .opcode = OSD_OP_SHOW_MEMORY,
+                },
+                .max_pgs = max_pgs,
+            },
+        };
+        op->callback = [this](osd_op_t *op)
+        {
+            if (op->reply.hdr.retval < 0)
+            {
+                fprintf(stderr, "Failed to get memory usage from OSD %lu (retval=%ld)\n", osd_num, op->reply.hdr.retval);
+                exit(1);
+            }
+            std::string json_err;
+            json11::Json mem = json11::Json::parse(std::string((char*)op->buf), json_err);
+            if (json_err != "")
+            {
+                fprintf(stderr, "OSD %lu returned bad JSON: %s\n", osd_num, json_err.c_str());
+                exit(1);
+            }
+            printf("%s\n", mem.dump().c_str());
+            delete op;
+            done = true;
+        };
+        sent = true;
+        parent->cli->msgr.outbox_push(op);
+    }
+
+    void loop()
+    {
+        if (!sent)
+        {
+            send_request();
+        }
+        if (done)
+        {
+            state = 100;
+        }
+    }
+};
+
+std::function<bool(void)> cli_tool_t::start_memory(json11::Json cfg)
+{
+    json11::Json::array cmd = cfg["command"].array_items();
+    auto mem = new cli_memory_t();
+    mem->parent = this;
+    mem->osd_num = cmd.size() > 1 ? cmd[1].uint64_value() : 0;
+    if (!mem->osd_num)
+    {
+        fprintf(stderr, "OSD number is missing\n");
+        exit(1);
+    }
+    mem->max_pgs = cfg["pgs"].uint64_value();
+    return [mem]()
+    {
+        mem->loop();
+        if (mem->state == 100)
+        {
+            delete mem;
+            return true;
+        }
+        return false;
+    };
+}
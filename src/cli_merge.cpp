@@ -1,6 +1,7 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <time.h>
 #include "cli.h"
 #include "cluster_client.h"
 #include "cpp-btree/safe_btree_set.h"
@@ -36,6 +37,8 @@ struct snap_merger_t
     bool check_delete_source = false;
     // interval between fsyncs
     int fsync_interval = 128;
+    // merge data on OSDs (OSD_OP_MERGE) instead of copying it through this client, when possible
+    bool offload = true;
 
     // -- STATE --
     inode_t target;
@@ -54,6 +57,7 @@ struct snap_merger_t
     uint64_t last_written_offset = 0;
     int deleted_unsynced = 0;
     uint64_t processed = 0, to_process = 0;
+    timespec merge_start;
 
     void start_merge()
     {
@@ -151,11 +155,24 @@ struct snap_merger_t
             // <to> has children itself, no need for CAS
             use_cas = 0;
         }
+        if (offload)
+        {
+            // OSDs only read parents from the same pool, so all parents of <target> must be there
+            cur = target_cfg;
+            while (offload && cur->parent_id != 0 && cur->parent_id != target_cfg->num)
+            {
+                auto it = parent->cli->st_cli.inode_config.find(cur->parent_id);
+                offload = INODE_POOL(cur->parent_id) == INODE_POOL(target_cfg->num) &&
+                    it != parent->cli->st_cli.inode_config.end();
+                if (offload)
+                    cur = &it->second;
+            }
+        }
         sources.erase(target);
         printf(
             "Merging %ld layer(s) into target %s%s (inode %lu in pool %u)\n",
             sources.size(), target_cfg->name.c_str(),
-            use_cas ? " online (with CAS)" : "", INODE_NO_POOL(target), INODE_POOL(target)
+            offload ? " on OSDs" : (use_cas ? " online (with CAS)" : ""), INODE_NO_POOL(target), INODE_POOL(target)
         );
         target_block_size = get_block_size(target);
     }
@@ -251,17 +268,21 @@ struct snap_merger_t
         processed = 0;
         to_process = merge_offsets.size();
         oit = merge_offsets.begin();
+        clock_gettime(CLOCK_REALTIME, &merge_start);
     resume_5:
         // Now read, overwrite and optionally delete offsets one by one
         while (in_flight < parent->iodepth*parent->parallel_osds && oit != merge_offsets.end())
         {
             in_flight++;
-            read_and_write(*oit);
+            if (offload)
+                merge_on_osd(*oit);
+            else
+                read_and_write(*oit);
             oit++;
             processed++;
             if (parent->progress && !(processed % 128))
             {
-                printf("\rOverwriting blocks: %lu/%lu", processed, to_process);
+                printf("\rOverwriting blocks: %lu/%lu, %.1f MB/s", processed, to_process, get_merge_speed(processed-in_flight));
             }
         }
         if (in_flight > 0 || oit != merge_offsets.end())
@@ -271,7 +292,7 @@ struct snap_merger_t
         }
         if (parent->progress)
         {
-            printf("\rOverwriting blocks: %lu/%lu\n", to_process, to_process);
+            printf("\rOverwriting blocks: %lu/%lu, %.1f MB/s\n", to_process, to_process, get_merge_speed(to_process));
         }
         // Done
         printf("Done, layers from %s to %s merged into %s\n", from_name.c_str(), to_name.c_str(), target_name.c_str());
@@ -371,6 +392,57 @@ struct snap_merger_t
         parent->cli->execute(op);
     }
 
+    // Average speed of processing <done> blocks since the start of overwriting, in MB/s
+    double get_merge_speed(uint64_t done)
+    {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        double sec = (now.tv_sec - merge_start.tv_sec) + (now.tv_nsec - merge_start.tv_nsec)/1000000000.0;
+        return sec > 0 ? done*target_block_size/sec/1024/1024 : 0;
+    }
+
+    // Ask the primary OSD to merge <offset> of <target> with its parents itself,
+    // so that the data isn't transferred through this client at all
+    void merge_on_osd(uint64_t offset)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_MERGE;
+        op->inode = target;
+        op->offset = offset;
+        op->len = 0;
+        op->flags = OSD_OP_IGNORE_READONLY;
+        op->callback = [this](cluster_op_t *op)
+        {
+            uint64_t offset = op->offset;
+            int retval = op->retval;
+            delete op;
+            if (retval == -EINTR)
+            {
+                // Object was modified during merge, OSD refused to overwrite it - repeat
+                merge_on_osd(offset);
+                return;
+            }
+            if (retval == -EINVAL && offload)
+            {
+                // OSDs are too old to support OSD_OP_MERGE
+                fprintf(stderr, "\nOSDs can't merge data, falling back to copying it through the client\n");
+                offload = false;
+            }
+            if (!offload)
+            {
+                read_and_write(offset);
+                return;
+            }
+            if (retval != 0)
+            {
+                fprintf(stderr, "error merging target at offset %lx: %s\n", offset, strerror(-retval));
+                exit(1);
+            }
+            finish_offset(offset);
+        };
+        parent->cli->execute(op);
+    }
+
     // Read <offset> from <to>, write it to <target> and optionally delete it
     // from all layers except <target> after fsync'ing
     void read_and_write(uint64_t offset)
@@ -510,44 +582,50 @@ struct snap_merger_t
     {
         if (!rwo->todo)
         {
-            if (last_written_offset < rwo->op.offset+target_block_size)
-            {
-                last_written_offset = rwo->op.offset+target_block_size;
-            }
-            if (delete_source)
+            uint64_t offset = rwo->op.offset;
+            free(rwo->buf);
+            delete rwo;
+            finish_offset(offset);
+        }
+    }
+
+    void finish_offset(uint64_t offset)
+    {
+        if (last_written_offset < offset+target_block_size)
+        {
+            last_written_offset = offset+target_block_size;
+        }
+        if (delete_source)
+        {
+            deleted_unsynced++;
+            if (deleted_unsynced >= fsync_interval)
             {
-                deleted_unsynced++;
-                if (deleted_unsynced >= fsync_interval)
+                uint64_t from = last_fsync_offset, to = last_written_offset;
+                cluster_op_t *subop = new cluster_op_t;
+                subop->opcode = OSD_OP_SYNC;
+                subop->callback = [this, from, to](cluster_op_t *subop)
                 {
-                    uint64_t from = last_fsync_offset, to = last_written_offset;
-                    cluster_op_t *subop = new cluster_op_t;
-                    subop->opcode = OSD_OP_SYNC;
-                    subop->callback = [this, from, to](cluster_op_t *subop)
+                    delete subop;
+                    // We can now delete source data between <from> and <to>
+                    // But to do this we have to keep all object lists in memory :-(
+                    for (auto & lp: layer_list_pos)
                     {
-                        delete subop;
-                        // We can now delete source data between <from> and <to>
-                        // But to do this we have to keep all object lists in memory :-(
-                        for (auto & lp: layer_list_pos)
+                        auto & layer_list = layer_lists.at(lp.first);
+                        uint64_t layer_block = layer_block_size.at(lp.first);
+                        int cur_pos = lp.second;
+                        while (cur_pos < layer_list.size() && layer_list[cur_pos]+layer_block < to)
                         {
-                            auto & layer_list = layer_lists.at(lp.first);
-                            uint64_t layer_block = layer_block_size.at(lp.first);
-                            int cur_pos = lp.second;
-                            while (cur_pos < layer_list.size() && layer_list[cur_pos]+layer_block < to)
-                            {
-                                delete_offset(lp.first, layer_list[cur_pos]);
-                                cur_pos++;
-                            }
-                            lp.second = cur_pos;
+                            delete_offset(lp.first, layer_list[cur_pos]);
+                            cur_pos++;
                         }
-                    };
-                    parent->cli->execute(subop);
-                }
+                        lp.second = cur_pos;
+                    }
+                };
+                parent->cli->execute(subop);
             }
-            free(rwo->buf);
-            delete rwo;
-            in_flight--;
-            continue_merge_reent();
         }
+        in_flight--;
+        continue_merge_reent();
     }
 };
 
@@ -570,6 +648,8 @@ std::function<bool(void)> cli_tool_t::start_merge(json11::Json cfg)
         merger->fsync_interval = 128;
     if (!cfg["cas"].is_null())
         merger->use_cas = cfg["cas"].uint64_value() ? 2 : 0;
+    if (!cfg["offload"].is_null())
+        merger->offload = cfg["offload"].uint64_value() ? true : false;
     return [merger]()
     {
         merger->continue_merge_reent();
@@ -3,11 +3,15 @@
 
 #include "cli.h"
 #include "cluster_client.h"
+#include "pg_states.h"
 
 #define RM_LISTING 1
 #define RM_REMOVING 2
 #define RM_END 3
 
+// Objects deleted by one OSD_OP_DELETE_RANGE request
+#define RM_RANGE_COUNT 1024
+
 struct rm_pg_t
 {
     pg_num_t pg_num;
@@ -19,10 +23,21 @@ struct rm_pg_t
     int in_flight = 0;
 };
 
+// PG processed with OSD_OP_DELETE_RANGE
+struct rm_range_pg_t
+{
+    pg_num_t pg_num;
+    uint64_t next_offset = 0;
+    bool in_flight = false;
+    bool done = false;
+};
+
 struct rm_inode_t
 {
     uint64_t inode = 0;
     pool_id_t pool_id = 0;
+    // delete objects on primary OSDs with OSD_OP_DELETE_RANGE when possible
+    bool offload = true;
 
     cli_tool_t *parent = NULL;
     inode_list_t *lister = NULL;
@@ -31,8 +46,142 @@ struct rm_inode_t
     uint64_t pgs_to_list = 0;
     bool lists_done = false;
     int state = 0;
+    std::vector<rm_range_pg_t> range_pgs;
+    int range_in_flight = 0;
+    uint64_t range_pgs_done = 0;
+    // PGs which couldn't be processed on OSDs and must be listed and deleted object by object
+    std::set<pg_num_t> range_failed_pgs;
 
-    void start_delete()
+    bool start_range_delete()
+    {
+        auto pool_it = parent->cli->st_cli.pool_config.find(pool_id);
+        if (pool_it == parent->cli->st_cli.pool_config.end())
+        {
+            return false;
+        }
+        for (auto & pg_item: pool_it->second.pg_config)
+        {
+            range_pgs.push_back((rm_range_pg_t){ .pg_num = pg_item.first });
+        }
+        return true;
+    }
+
+    // Send the next OSD_OP_DELETE_RANGE for <rpg> to its primary OSD, return false if it's not connected yet
+    bool send_range_op(rm_range_pg_t *rpg)
+    {
+        auto & pg_cfg = parent->cli->st_cli.pool_config.at(pool_id).pg_config.at(rpg->pg_num);
+        if (pg_cfg.pause || !pg_cfg.cur_primary || !(pg_cfg.cur_state & PG_ACTIVE))
+        {
+            // Leave inactive PGs to the listing
+            range_failed_pgs.insert(rpg->pg_num);
+            rpg->done = true;
+            range_pgs_done++;
+            return true;
+        }
+        if (parent->cli->msgr.osd_peer_fds.find(pg_cfg.cur_primary) == parent->cli->msgr.osd_peer_fds.end())
+        {
+            // Initiate connection
+            parent->cli->msgr.connect_peer(pg_cfg.cur_primary, parent->cli->st_cli.peer_states[pg_cfg.cur_primary]);
+            return false;
+        }
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = parent->cli->msgr.osd_peer_fds[pg_cfg.cur_primary];
+        op->req = (osd_any_op_t){
+            .delete_range = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = parent->cli->next_op_id(),
+                    .opcode = OSD_OP_DELETE_RANGE,
+                },
+                .inode = inode,
+                .start_offset = rpg->next_offset,
+                .pg_num = rpg->pg_num,
+                .max_count = RM_RANGE_COUNT,
+                .iodepth = (uint32_t)parent->iodepth,
+            },
+        };
+        op->callback = [this, rpg](osd_op_t *op)
+        {
+            rpg->in_flight = false;
+            range_in_flight--;
+            if (op->reply.hdr.retval < 0)
+            {
+                if (op->reply.hdr.retval == -EINVAL && offload)
+                {
+                    fprintf(stderr, "OSDs can't delete object ranges, falling back to deleting objects one by one\n");
+                    offload = false;
+                }
+                else if (op->reply.hdr.retval != -EBUSY && op->reply.hdr.retval != -EINVAL)
+                {
+                    fprintf(stderr, "Failed to remove objects from PG %u (retval=%ld)\n", rpg->pg_num, op->reply.hdr.retval);
+                }
+                range_failed_pgs.insert(rpg->pg_num);
+                rpg->done = true;
+                range_pgs_done++;
+            }
+            else
+            {
+                total_done += op->reply.hdr.retval;
+                rpg->next_offset = op->reply.delete_range.next_offset;
+                if (rpg->next_offset == UINT64_MAX)
+                {
+                    rpg->done = true;
+                    range_pgs_done++;
+                }
+            }
+            delete op;
+            continue_range_delete();
+        };
+        rpg->in_flight = true;
+        range_in_flight++;
+        parent->cli->msgr.outbox_push(op);
+        return true;
+    }
+
+    void continue_range_delete()
+    {
+        for (int i = 0; i < range_pgs.size() && offload && range_in_flight < parent->parallel_osds; i++)
+        {
+            if (!range_pgs[i].done && !range_pgs[i].in_flight && !send_range_op(&range_pgs[i]))
+            {
+                break;
+            }
+        }
+        if (parent->progress)
+        {
+            printf("\rRemoved %lu objects, %lu/%lu PGs done", total_done, range_pgs_done, range_pgs.size());
+        }
+        if (!range_in_flight && (range_pgs_done >= range_pgs.size() || !offload))
+        {
+            if (parent->progress && range_pgs.size())
+            {
+                printf("\n");
+            }
+            for (auto & rpg: range_pgs)
+            {
+                if (!rpg.done)
+                {
+                    // Not processed because OSDs can't delete object ranges
+                    range_failed_pgs.insert(rpg.pg_num);
+                }
+            }
+            if (range_failed_pgs.size())
+            {
+                // List and delete remaining objects of these PGs only
+                state = 1;
+                start_delete(range_failed_pgs);
+            }
+            else
+            {
+                printf("Done, inode %lu in pool %u data removed\n", INODE_NO_POOL(inode), pool_id);
+                state = 2;
+            }
+        }
+    }
+
+    // List and delete objects of <only_pgs> or of all PGs if it's empty
+    void start_delete(const std::set<pg_num_t> & only_pgs = std::set<pg_num_t>())
     {
         lister = parent->cli->list_inode_start(inode, [this](inode_list_t *lst,
             std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)
@@ -55,9 +204,12 @@ struct rm_inode_t
             {
                 lists_done = true;
             }
-            pgs_to_list--;
+            if (status & INODE_LIST_PG_DONE)
+            {
+                pgs_to_list--;
+            }
             continue_delete();
-        });
+        }, only_pgs);
         if (!lister)
         {
             fprintf(stderr, "Failed to list inode %lu from pool %u objects\n", INODE_NO_POOL(inode), INODE_POOL(inode));
@@ -152,14 +304,26 @@ struct rm_inode_t
     {
         if (state == 0)
         {
-            start_delete();
-            state = 1;
+            if (offload && !parent->list_first && start_range_delete())
+            {
+                state = 3;
+                continue_range_delete();
+            }
+            else
+            {
+                start_delete();
+                state = 1;
+            }
         }
         else if (state == 1)
         {
             continue_delete();
         }
-        else if (state == 2)
+        else if (state == 3)
+        {
+            continue_range_delete();
+        }
+        if (state == 2)
         {
             return true;
         }
@@ -183,6 +347,8 @@ std::function<bool(void)> cli_tool_t::start_rm(json11::Json cfg)
         fprintf(stderr, "pool is missing\n");
         exit(1);
     }
+    if (!cfg["offload"].is_null())
+        remover->offload = cfg["offload"].uint64_value() ? true : false;
     return [remover]()
     {
         if (remover->loop())
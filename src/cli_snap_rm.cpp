@@ -52,6 +52,8 @@ struct snap_remover_t
     int use_cas = 1;
     // interval between fsyncs
     int fsync_interval = 128;
+    // merge data on OSDs when possible
+    bool offload = true;
 
     std::map<inode_t,int> sources;
     std::map<inode_t,uint64_t> inode_used;
@@ -285,10 +287,15 @@ resume_9:
                 }
                 inode = INODE_WITH_POOL(pool_id, inode);
                 auto & pool_cfg = pool_cfg_it->second;
-                uint64_t used_bytes = kv.value["raw_used"].uint64_value() / pool_cfg.pg_size;
-                if (pool_cfg.scheme != POOL_SCHEME_REPLICATED)
+                uint64_t used_bytes = kv.value["used_bytes"].uint64_value();
+                if (kv.value["used_bytes"].is_null())
                 {
-                    used_bytes *= (pool_cfg.pg_size - pool_cfg.parity_chunks);
+                    // Statistics from an older monitor
+                    used_bytes = kv.value["raw_used"].uint64_value() / pool_cfg.pg_size;
+                    if (pool_cfg.scheme != POOL_SCHEME_REPLICATED)
+                    {
+                        used_bytes *= (pool_cfg.pg_size - pool_cfg.parity_chunks);
+                    }
                 }
                 inode_used[inode] = used_bytes;
             }
@@ -510,6 +517,7 @@ resume_9:
             { "delete-source", false },
             { "cas", use_cas },
             { "fsync-interval", fsync_interval },
+            { "offload", offload ? 1 : 0 },
         });
     }
 
@@ -525,6 +533,7 @@ resume_9:
             { "inode", inode },
             { "pool", (uint64_t)INODE_POOL(inode) },
             { "fsync-interval", fsync_interval },
+            { "offload", offload ? 1 : 0 },
         });
     }
 };
@@ -550,6 +559,8 @@ std::function<bool(void)> cli_tool_t::start_snap_rm(json11::Json cfg)
         snap_remover->fsync_interval = 128;
     if (!cfg["cas"].is_null())
         snap_remover->use_cas = cfg["cas"].uint64_value() ? 2 : 0;
+    if (!cfg["offload"].is_null())
+        snap_remover->offload = cfg["offload"].uint64_value() ? true : false;
     if (!cfg["writers_stopped"].is_null())
         snap_remover->writers_stopped = true;
     return [snap_remover]()
@@ -0,0 +1,106 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "cli.h"
+#include "cluster_client.h"
+
+// Print operation traces collected by an OSD (see trace_sample)
+struct cli_traces_t
+{
+    cli_tool_t *parent;
+
+    osd_num_t osd_num = 0;
+    uint64_t max_count = 0;
+    uint64_t min_us = 0;
+
+    int state = 0;
+    bool sent = false;
+    bool done = false;
+
+    void send_request()
+    {
+        auto peer_it = parent->cli->msgr.osd_peer_fds.find(osd_num);
+        if (peer_it == parent->cli->msgr.osd_peer_fds.end())
+        {
+            if (parent->cli->st_cli.peer_states.find(osd_num) == parent->cli->st_cli.peer_states.end())
+            {
+                fprintf(stderr, "OSD %lu is down\n", osd_num);
+                exit(1);
+            }
+            // Initiate connection and wait for it
+            parent->cli->msgr.connect_peer(osd_num, parent->cli->st_cli.peer_states[osd_num]);
+            return;
+        }
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = peer_it->second;
+        op->req = (osd_any_op_t){
+            .show_traces = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = parent->cli->next_op_id(),
+                    .opcode = OSD_OP_SHOW_TRACES,
+                },
+                .max_count = max_count,
+                .min_us = min_us,
+            },
+        };
+        op->callback = [this](osd_op_t *op)
+        {
+            if (op->reply.hdr.retval < 0)
+            {
+                fprintf(stderr, "Failed to get traces from OSD %lu (retval=%ld)\n", osd_num, op->reply.hdr.retval);
+                exit(1);
+            }
+            std::string json_err;
+            json11::Json traces = json11::Json::parse(std::string((char*)op->buf), json_err);
+            if (json_err != "")
+            {
+                fprintf(stderr, "OSD %lu returned bad JSON: %s\n", osd_num, json_err.c_str());
+                exit(1);
+            }
+            printf("%s\n", traces.dump().c_str());
+            delete op;
+            done = true;
+        };
+        sent = true;
+        parent->cli->msgr.outbox_push(op);
+    }
+
+    void loop()
+    {
+        if (!sent)
+        {
+            send_request();
+        }
+        if (done)
+        {
+            state = 100;
+        }
+    }
+};
+
+std::function<bool(void)> cli_tool_t::start_traces(json11::Json cfg)
+{
+    json11::Json::array cmd = cfg["command"].array_items();
+    auto traces = new cli_traces_t();
+    traces->parent = this;
+    traces->osd_num = cmd.size() > 1 ? cmd[1].uint64_value() : 0;
+    if (!traces->osd_num)
+    {
+        fprintf(stderr, "OSD number is missing\n");
+        exit(1);
+    }
+    traces->max_count = cfg["count"].uint64_value();
+    traces->min_us = cfg["min_us"].uint64_value();
+    return [traces]()
+    {
+        traces->loop();
+        if (traces->state == 100)
+        {
+            delete traces;
+            return true;
+        }
+        return false;
+    };
+}
@@ -3,18 +3,39 @@
 
 #include <stdexcept>
 #include <assert.h>
+#include <unistd.h>
 #include "cluster_client.h"
+#include "osd_rmw.h"
+#include "pg_states.h"
 
 #define SCRAP_BUFFER_SIZE 4*1024*1024
 #define PART_SENT 1
 #define PART_DONE 2
 #define PART_ERROR 4
+// Part is a read sent to a secondary OSD
+#define PART_REPLICA 8
+// Replica read failed, read from the primary
+#define PART_NO_REPLICA 16
 #define CACHE_DIRTY 1
 #define CACHE_FLUSHING 2
 #define CACHE_REPEATING 3
+// Write-back buffer not sent to OSDs yet
+#define CACHE_WRITEBACK 4
+// Write-back buffer being sent
+#define CACHE_WRITING 5
 #define OP_FLUSH_BUFFER 0x02
+// Write of write-back buffers, they're already in dirty_buffers
+#define OP_WRITEBACK 0x10
+// Maximum number of adjacent write-back buffers sent with one write
+#define MAX_WRITEBACK_IOV 256
+// Maximum size of a dirty buffer grown by appending adjacent writes
+#define MAX_DIRTY_BUFFER_MERGE 1048576
+// Read-ahead prefetch or a read which shouldn't use read-ahead
+#define OP_NO_READAHEAD 0x20
+// Number of sequential reads after which read-ahead starts
+#define READAHEAD_SEQ_READS 2
 
-cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config)
+cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config, bool etcd_mirror)
 {
     config = osd_messenger_t::read_config(config);
 
@@ -39,8 +60,9 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
             // determine WHICH dirty_buffers are now obsolete and repeat them
             for (auto & wr: dirty_buffers)
             {
+                // Write-back buffers which aren't sent yet or are being sent don't need repeating
                 if (affects_osd(wr.first.inode, wr.first.stripe, wr.second.len, peer_osd) &&
-                    wr.second.state != CACHE_REPEATING)
+                    (wr.second.state == CACHE_DIRTY || wr.second.state == CACHE_FLUSHING))
                 {
                     // FIXME: Flush in larger parts
                     flush_buffer(wr.first, &wr.second);
@@ -65,6 +87,7 @@ cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd
     st_cli.on_change_hook = [this](std::map<std::string, etcd_kv_t> & changes) { on_change_hook(changes); };
     st_cli.on_load_pgs_hook = [this](bool success) { on_load_pgs_hook(success); };
 
+    st_cli.mirror_mode = etcd_mirror;
     st_cli.parse_config(config);
     st_cli.load_global_config();
 
@@ -90,11 +113,29 @@ cluster_client_t::~cluster_client_t()
         free(bp.second.buf);
     }
     dirty_buffers.clear();
+    for (auto & rp: readahead)
+    {
+        for (auto & bp: rp.second.bufs)
+        {
+            free(bp.second->buf);
+            if (bp.second->bitmap)
+                free(bp.second->bitmap);
+            delete bp.second;
+        }
+    }
+    readahead.clear();
+    if (qos_timer_id >= 0)
+    {
+        tfd->clear_timer(qos_timer_id);
+        qos_timer_id = -1;
+    }
     if (ringloop)
     {
         ringloop->unregister_consumer(&consumer);
     }
     free(scrap_buffer);
+    if (zero_buffer)
+        free(zero_buffer);
 }
 
 cluster_op_t::~cluster_op_t()
@@ -125,7 +166,7 @@ void cluster_client_t::calc_wait(cluster_op_t *op)
                 op->prev_wait++;
             }
         }
-        if (!op->prev_wait && pgs_loaded)
+        if (!op->prev_wait && pgs_loaded && !executing_batch)
             continue_rw(op);
     }
     else if (op->opcode == OSD_OP_SYNC)
@@ -137,7 +178,7 @@ void cluster_client_t::calc_wait(cluster_op_t *op)
                 op->prev_wait++;
             }
         }
-        if (!op->prev_wait && pgs_loaded)
+        if (!op->prev_wait && pgs_loaded && !executing_batch)
             continue_sync(op);
     }
     else /* if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP) */
@@ -154,7 +195,7 @@ void cluster_client_t::calc_wait(cluster_op_t *op)
                 break;
             }
         }
-        if (!op->prev_wait && pgs_loaded)
+        if (!op->prev_wait && pgs_loaded && !executing_batch)
             continue_rw(op);
     }
 }
@@ -207,6 +248,12 @@ void cluster_client_t::erase_op(cluster_op_t *op)
 {
     uint64_t opcode = op->opcode, flags = op->flags;
     cluster_op_t *next = op->next;
+    if ((opcode == OSD_OP_WRITE && !(flags & OP_FLUSH_BUFFER) || opcode == OSD_OP_DELETE || opcode == OSD_OP_MERGE) &&
+        readahead.size() > 0)
+    {
+        // Prefetched data may be older than the write
+        invalidate_readahead(op->inode, op->offset, op->len);
+    }
     if (op->prev)
         op->prev->next = op->next;
     if (op->next)
@@ -314,6 +361,12 @@ void cluster_client_t::on_load_config_hook(json11::Json::object & config)
     {
         client_max_dirty_ops = DEFAULT_CLIENT_MAX_DIRTY_OPS;
     }
+    // Local option overrides the global one
+    json11::Json writeback = this->config["client_enable_writeback"].is_null()
+        ? config["client_enable_writeback"] : this->config["client_enable_writeback"];
+    enable_writeback = writeback.bool_value() || writeback.uint64_value() || writeback == "true" || writeback == "1";
+    client_readahead = this->config["client_readahead"].is_null()
+        ? config["client_readahead"].uint64_value() : this->config["client_readahead"].uint64_value();
     up_wait_retry_interval = config["up_wait_retry_interval"].uint64_value();
     if (!up_wait_retry_interval)
     {
@@ -323,6 +376,25 @@ void cluster_client_t::on_load_config_hook(json11::Json::object & config)
     {
         up_wait_retry_interval = 50;
     }
+    json11::Json qos = this->config["client_qos"].is_null() ? config["client_qos"] : this->config["client_qos"];
+    client_qos = qos.bool_value() || qos.uint64_value() || qos == "true" || qos == "1";
+    if (!client_qos)
+    {
+        inode_qos.clear();
+    }
+    json11::Json ec_parity = this->config["client_ec_parity"].is_null()
+        ? config["client_ec_parity"] : this->config["client_ec_parity"];
+    client_ec_parity = ec_parity.bool_value() || ec_parity.uint64_value() || ec_parity == "true" || ec_parity == "1";
+    read_from_replicas = config["read_from_replicas"].bool_value() ||
+        config["read_from_replicas"].uint64_value();
+    if (read_from_replicas && client_host == "")
+    {
+        std::vector<char> hostname;
+        hostname.resize(1024);
+        while (gethostname(hostname.data(), hostname.size()) < 0 && errno == ENAMETOOLONG)
+            hostname.resize(hostname.size()+1024);
+        client_host = std::string(hostname.data(), strnlen(hostname.data(), hostname.size()));
+    }
     msgr.parse_config(config);
     msgr.parse_config(this->config);
     st_cli.load_pgs();
@@ -418,8 +490,8 @@ void cluster_client_t::on_ready(std::function<void(void)> fn)
  */
 void cluster_client_t::execute(cluster_op_t *op)
 {
-    if (op->opcode != OSD_OP_SYNC && op->opcode != OSD_OP_READ &&
-        op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_WRITE)
+    if (op->opcode != OSD_OP_SYNC && op->opcode != OSD_OP_READ && op->opcode != OSD_OP_READ_BITMAP &&
+        op->opcode != OSD_OP_WRITE && op->opcode != OSD_OP_DELETE && op->opcode != OSD_OP_MERGE)
     {
         op->retval = -EINVAL;
         std::function<void(cluster_op_t*)>(op->callback)(op);
@@ -427,6 +499,14 @@ void cluster_client_t::execute(cluster_op_t *op)
     }
     op->cur_inode = op->inode;
     op->retval = 0;
+    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE || op->opcode == OSD_OP_MERGE) && readahead.size() > 0)
+    {
+        invalidate_readahead(op->inode, op->offset, op->len);
+    }
+    if (op->opcode == OSD_OP_DELETE && dirty_buffers.size() > 0)
+    {
+        zero_dirty_buffers(op->inode, op->offset, op->len);
+    }
     if (op->opcode == OSD_OP_WRITE && !immediate_commit)
     {
         if (dirty_bytes >= client_max_dirty_bytes || dirty_ops >= client_max_dirty_ops)
@@ -452,6 +532,20 @@ void cluster_client_t::execute(cluster_op_t *op)
         }
         dirty_bytes += op->len;
         dirty_ops++;
+        if (enable_writeback && write_back(op))
+        {
+            return;
+        }
+    }
+    else if (op->opcode == OSD_OP_READ && enable_writeback && dirty_buffers.size() > 0 &&
+        pgs_loaded && read_from_writeback(op, true))
+    {
+        return;
+    }
+    else if (op->opcode == OSD_OP_READ && client_readahead > 0 && pgs_loaded &&
+        !(op->flags & OP_NO_READAHEAD) && read_ahead(op))
+    {
+        return;
     }
     else if (op->opcode == OSD_OP_SYNC)
     {
@@ -468,7 +562,7 @@ void cluster_client_t::execute(cluster_op_t *op)
         op_queue_tail = op_queue_head = op;
     if (!immediate_commit)
         calc_wait(op);
-    else if (pgs_loaded)
+    else if (pgs_loaded && !executing_batch)
     {
         if (op->opcode == OSD_OP_SYNC)
             continue_sync(op);
@@ -477,24 +571,51 @@ void cluster_client_t::execute(cluster_op_t *op)
     }
 }
 
-void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers)
+void cluster_client_t::execute_batch(cluster_op_t **ops, int count)
+{
+    if (continuing_ops || executing_batch)
+    {
+        // Called from a completion callback inside continue_ops(): start operations one by one
+        for (int i = 0; i < count; i++)
+            execute(ops[i]);
+        return;
+    }
+    bool hold_sends = msgr.hold_sends;
+    msgr.hold_sends = true;
+    executing_batch = true;
+    for (int i = 0; i < count; i++)
+    {
+        execute(ops[i]);
+    }
+    executing_batch = false;
+    continue_ops();
+    msgr.hold_sends = hold_sends;
+    if (!ringloop && !hold_sends)
+    {
+        // With a ring loop, send_replies() is called by the loop anyway
+        msgr.send_replies();
+    }
+}
+
+void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers, bool writeback)
 {
     // Save operation for replay when one of PGs goes out of sync
     // (primary OSD drops our connection in this case)
+    // Buffers never overlap, so only the previous one may contain the beginning of the write
     auto dirty_it = dirty_buffers.lower_bound((object_id){
         .inode = op->inode,
         .stripe = op->offset,
     });
-    while (dirty_it != dirty_buffers.begin())
+    if (dirty_it != dirty_buffers.begin())
     {
-        dirty_it--;
-        if (dirty_it->first.inode != op->inode ||
-            (dirty_it->first.stripe + dirty_it->second.len) <= op->offset)
+        auto prev_it = std::prev(dirty_it);
+        if (prev_it->first.inode == op->inode &&
+            (prev_it->first.stripe + prev_it->second.len) > op->offset)
         {
-            dirty_it++;
-            break;
+            dirty_it = prev_it;
         }
     }
+    int new_state = writeback ? CACHE_WRITEBACK : CACHE_DIRTY;
     uint64_t pos = op->offset, len = op->len, iov_idx = 0, iov_pos = 0;
     while (len > 0)
     {
@@ -513,16 +634,38 @@ void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_
         }
         if (new_len > 0)
         {
-            dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){
-                .inode = op->inode,
-                .stripe = pos,
-            }, (cluster_buffer_t){
-                .buf = malloc_or_die(new_len),
-                .len = new_len,
-            });
+            auto prev_it = dirty_it != dirty_buffers.begin() ? std::prev(dirty_it) : dirty_buffers.end();
+            if (prev_it != dirty_buffers.end() && prev_it->first.inode == op->inode &&
+                prev_it->first.stripe + prev_it->second.len == pos && prev_it->second.state == new_state &&
+                !prev_it->second.refs && prev_it->second.len + new_len <= MAX_DIRTY_BUFFER_MERGE)
+            {
+                // Append to the previous buffer instead of allocating a new one. Its capacity
+                // is doubled when it's exceeded, so sequential writes are copied in amortized O(1)
+                auto & wr = prev_it->second;
+                if (wr.len + new_len > wr.cap)
+                {
+                    wr.cap = wr.cap*2 < wr.len + new_len ? wr.len + new_len : wr.cap*2;
+                    wr.cap = wr.cap > MAX_DIRTY_BUFFER_MERGE ? MAX_DIRTY_BUFFER_MERGE : wr.cap;
+                    wr.buf = realloc_or_die(wr.buf, wr.cap);
+                }
+                wr.len += new_len;
+                dirty_it = prev_it;
+            }
+            else
+            {
+                dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){
+                    .inode = op->inode,
+                    .stripe = pos,
+                }, (cluster_buffer_t){
+                    .buf = malloc_or_die(new_len),
+                    .len = new_len,
+                    .cap = new_len,
+                });
+            }
         }
         // FIXME: Split big buffers into smaller ones on overwrites. But this will require refcounting
-        dirty_it->second.state = CACHE_DIRTY;
+        if (writeback || dirty_it->second.state != CACHE_WRITEBACK)
+            dirty_it->second.state = new_state;
         uint64_t cur_len = (dirty_it->first.stripe + dirty_it->second.len - pos);
         if (cur_len > len)
         {
@@ -558,6 +701,7 @@ void cluster_client_t::copy_write(cluster_op_t *op, std::map<object_id, cluster_
 void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
 {
     wr->state = CACHE_REPEATING;
+    wr->refs++;
     cluster_op_t *op = new cluster_op_t;
     op->flags = OSD_OP_IGNORE_READONLY|OP_FLUSH_BUFFER;
     op->opcode = OSD_OP_WRITE;
@@ -567,6 +711,7 @@ void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
     op->iov.push_back(wr->buf, wr->len);
     op->callback = [wr](cluster_op_t* op)
     {
+        wr->refs--;
         if (wr->state == CACHE_REPEATING)
         {
             wr->state = CACHE_DIRTY;
@@ -585,6 +730,428 @@ void cluster_client_t::flush_buffer(const object_id & oid, cluster_buffer_t *wr)
     continue_rw(op);
 }
 
+// Copy a write to write-back buffers and complete it without sending it to OSDs.
+// When buffers already hold <client_max_dirty_bytes>, the write is sent as usual and
+// completes after OSDs write it, and so do following writes until a sync frees memory
+bool cluster_client_t::write_back(cluster_op_t *op)
+{
+    if (!pgs_loaded || op->version || (op->flags & (OP_FLUSH_BUFFER|OP_WRITEBACK)) ||
+        !op->len || op->offset % bs_bitmap_granularity || op->len % bs_bitmap_granularity)
+    {
+        return false;
+    }
+    if (writeback_held_bytes + op->len > client_max_dirty_bytes)
+    {
+        return false;
+    }
+    pool_id_t pool_id = INODE_POOL(op->inode);
+    if (!pool_id || st_cli.pool_config.find(pool_id) == st_cli.pool_config.end())
+    {
+        return false;
+    }
+    if (!(op->flags & OSD_OP_IGNORE_READONLY))
+    {
+        auto ino_it = st_cli.inode_config.find(op->inode);
+        if (ino_it != st_cli.inode_config.end() && ino_it->second.readonly)
+        {
+            // Fail it as usual
+            return false;
+        }
+    }
+    copy_write(op, dirty_buffers, true);
+    writeback_bytes += op->len;
+    writeback_held_bytes += op->len;
+    op->retval = op->len;
+    std::function<void(cluster_op_t*)>(op->callback)(op);
+    return true;
+}
+
+static void copy_to_iov(osd_op_buf_list_t & iov, uint64_t pos, uint8_t *src, uint64_t len)
+{
+    for (int i = 0; i < iov.count && len > 0; i++)
+    {
+        if (pos >= iov.buf[i].iov_len)
+        {
+            pos -= iov.buf[i].iov_len;
+            continue;
+        }
+        uint64_t cur = iov.buf[i].iov_len - pos;
+        cur = cur < len ? cur : len;
+        memcpy((uint8_t*)iov.buf[i].iov_base + pos, src, cur);
+        src += cur;
+        len -= cur;
+        pos = 0;
+    }
+}
+
+// Allocate and clear the bitmap of a read completed without sending it to OSDs
+void cluster_client_t::reset_read_bitmap(cluster_op_t *op)
+{
+    unsigned bitmap_size = (op->len / bs_bitmap_granularity + 7) / 8;
+    bitmap_size = bitmap_size < 8 ? 8 : bitmap_size;
+    if (op->bitmap_buf_size < bitmap_size)
+    {
+        op->bitmap_buf = realloc_or_die(op->bitmap_buf, bitmap_size);
+        op->bitmap_buf_size = bitmap_size;
+    }
+    memset(op->bitmap_buf, 0, bitmap_size);
+}
+
+// Mark write-back and unsynced buffers in the bitmap of a READ_BITMAP operation
+void cluster_client_t::mark_writeback_bitmap(cluster_op_t *op)
+{
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->inode));
+    if (pool_it == st_cli.pool_config.end())
+        return;
+    auto & pool_cfg = pool_it->second;
+    uint64_t pg_block_size = bs_block_size * (pool_cfg.scheme == POOL_SCHEME_REPLICATED
+        ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t op_end = op->offset + pg_block_size;
+    auto it = dirty_buffers.lower_bound((object_id){
+        .inode = op->inode,
+        .stripe = op->offset,
+    });
+    if (it != dirty_buffers.begin())
+    {
+        auto prev_it = std::prev(it);
+        if (prev_it->first.inode == op->inode && prev_it->first.stripe + prev_it->second.len > op->offset)
+            it = prev_it;
+    }
+    for (; it != dirty_buffers.end() && it->first.inode == op->inode && it->first.stripe < op_end; it++)
+    {
+        uint64_t begin = it->first.stripe < op->offset ? op->offset : it->first.stripe;
+        uint64_t end = it->first.stripe + it->second.len;
+        end = end > op_end ? op_end : end;
+        for (uint64_t bmp_loc = (begin - op->offset)/bs_bitmap_granularity;
+            bmp_loc < (end - op->offset + bs_bitmap_granularity - 1)/bs_bitmap_granularity; bmp_loc++)
+        {
+            ((uint8_t*)op->bitmap_buf)[bmp_loc/8] |= (1 << (bmp_loc%8));
+        }
+    }
+}
+
+// Copy data of write-back and unsynced buffers overlapping a read to it. With <full_only>, only do it
+// if they cover the whole read and complete the read then. Returns false if it's not covered
+bool cluster_client_t::read_from_writeback(cluster_op_t *op, bool full_only)
+{
+    uint64_t op_end = op->offset + op->len;
+    auto it = dirty_buffers.lower_bound((object_id){
+        .inode = op->inode,
+        .stripe = op->offset,
+    });
+    if (it != dirty_buffers.begin())
+    {
+        auto prev_it = std::prev(it);
+        if (prev_it->first.inode == op->inode && prev_it->first.stripe + prev_it->second.len > op->offset)
+            it = prev_it;
+    }
+    if (full_only)
+    {
+        if (!op->len || op->offset % bs_bitmap_granularity || op->len % bs_bitmap_granularity)
+            return false;
+        uint64_t pos = op->offset;
+        for (auto cov_it = it; pos < op_end && cov_it != dirty_buffers.end() &&
+            cov_it->first.inode == op->inode && cov_it->first.stripe <= pos; cov_it++)
+        {
+            pos = cov_it->first.stripe + cov_it->second.len;
+        }
+        if (pos < op_end)
+            return false;
+        reset_read_bitmap(op);
+    }
+    for (; it != dirty_buffers.end() && it->first.inode == op->inode && it->first.stripe < op_end; it++)
+    {
+        uint64_t begin = it->first.stripe < op->offset ? op->offset : it->first.stripe;
+        uint64_t end = it->first.stripe + it->second.len;
+        end = end > op_end ? op_end : end;
+        copy_to_iov(op->iov, begin - op->offset, (uint8_t*)it->second.buf + begin - it->first.stripe, end - begin);
+        // The data is present in the current layer
+        for (uint64_t bmp_loc = (begin - op->offset)/bs_bitmap_granularity; bmp_loc < (end - op->offset)/bs_bitmap_granularity; bmp_loc++)
+        {
+            ((uint8_t*)op->bitmap_buf)[bmp_loc/8] |= (1 << (bmp_loc%8));
+        }
+    }
+    if (full_only)
+    {
+        op->version = 0;
+        op->retval = op->len;
+        std::function<void(cluster_op_t*)>(op->callback)(op);
+    }
+    return true;
+}
+
+// Send write-back buffers with writes placed before <sync_op> in the queue, adjacent buffers
+// are coalesced. Returns the number of writes, <sync_op> waits for all of them
+int cluster_client_t::flush_writeback(cluster_op_t *sync_op)
+{
+    std::vector<cluster_op_t*> writes;
+    auto it = dirty_buffers.begin();
+    while (it != dirty_buffers.end())
+    {
+        if (it->second.state != CACHE_WRITEBACK)
+        {
+            it++;
+            continue;
+        }
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_WRITE;
+        op->flags = OSD_OP_IGNORE_READONLY|OP_WRITEBACK;
+        op->cur_inode = op->inode = it->first.inode;
+        op->offset = it->first.stripe;
+        op->len = 0;
+        std::vector<cluster_buffer_t*> bufs;
+        do
+        {
+            it->second.state = CACHE_WRITING;
+            it->second.refs++;
+            op->iov.push_back(it->second.buf, it->second.len);
+            op->len += it->second.len;
+            bufs.push_back(&it->second);
+            it++;
+        } while (it != dirty_buffers.end() && it->second.state == CACHE_WRITEBACK &&
+            it->first.inode == op->inode && it->first.stripe == op->offset+op->len &&
+            bufs.size() < MAX_WRITEBACK_IOV);
+        op->callback = [this, bufs](cluster_op_t *op)
+        {
+            bool ok = op->retval == op->len;
+            for (auto wr: bufs)
+            {
+                wr->refs--;
+                // The buffer may be overwritten and become CACHE_WRITEBACK again in the meantime
+                if (wr->state == CACHE_WRITING)
+                {
+                    wr->state = ok ? CACHE_DIRTY : CACHE_WRITEBACK;
+                    if (!ok)
+                        writeback_bytes += wr->len;
+                }
+            }
+            if (!ok)
+                writeback_error = op->retval;
+            delete op;
+        };
+        // Insert before the sync
+        op->next = sync_op;
+        op->prev = sync_op->prev;
+        if (sync_op->prev)
+            sync_op->prev->next = op;
+        else
+            op_queue_head = op;
+        sync_op->prev = op;
+        inc_wait(op->opcode, op->flags, op->next, 1);
+        writes.push_back(op);
+    }
+    writeback_bytes = 0;
+    if (writes.size() > 0)
+    {
+        sync_op->state = 2;
+        for (auto op: writes)
+            continue_rw(op);
+    }
+    return writes.size();
+}
+
+// Detect sequential reads of an inode and prefetch whole objects up to <client_readahead> bytes
+// ahead of them. Returns true if the read is served from or waits for prefetched data
+bool cluster_client_t::read_ahead(cluster_op_t *op)
+{
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->inode));
+    if (pool_it == st_cli.pool_config.end() || !pool_it->second.real_pg_count)
+    {
+        return false;
+    }
+    auto & ra = readahead[op->inode];
+    if (op->offset == ra.next_offset)
+    {
+        ra.seq_reads++;
+    }
+    else
+    {
+        ra.seq_reads = 0;
+    }
+    ra.next_offset = op->offset + op->len;
+    // Free prefetched data which is already read or, if the stream is interrupted, all of it
+    for (auto it = ra.bufs.begin(); it != ra.bufs.end() &&
+        (!ra.seq_reads || it->first + it->second->len <= op->offset); )
+    {
+        if (it->second->done)
+        {
+            free(it->second->buf);
+            free(it->second->bitmap);
+            delete it->second;
+            ra.bufs.erase(it++);
+        }
+        else
+            it++;
+    }
+    if (ra.seq_reads >= READAHEAD_SEQ_READS)
+    {
+        auto & pool_cfg = pool_it->second;
+        uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        uint64_t pg_block_size = bs_block_size * pg_data_size;
+        uint64_t end = op->offset + op->len + client_readahead;
+        auto ino_it = st_cli.inode_config.find(op->inode);
+        if (ino_it != st_cli.inode_config.end() && ino_it->second.size > 0 && end > ino_it->second.size)
+        {
+            end = ino_it->second.size;
+        }
+        // Objects are in different PGs, so they're read in parallel
+        for (uint64_t stripe = (op->offset / pg_block_size) * pg_block_size; stripe < end; stripe += pg_block_size)
+        {
+            if (ra.bufs.find(stripe) == ra.bufs.end())
+            {
+                prefetch(ra, op->inode, stripe, pg_block_size);
+            }
+        }
+    }
+    return read_from_readahead(ra, op);
+}
+
+// Serve a read from prefetched data or make it wait for the prefetch if it's in progress.
+// Returns false if the read isn't fully covered by it
+bool cluster_client_t::read_from_readahead(cluster_readahead_t & ra, cluster_op_t *op)
+{
+    uint64_t op_end = op->offset + op->len;
+    auto it = ra.bufs.upper_bound(op->offset);
+    if (it == ra.bufs.begin())
+    {
+        return false;
+    }
+    it--;
+    uint64_t pos = op->offset;
+    cluster_readahead_buf_t *wait_for = NULL;
+    for (auto cov_it = it; pos < op_end && cov_it != ra.bufs.end() && cov_it->first <= pos; cov_it++)
+    {
+        if (!cov_it->second->done && !wait_for)
+            wait_for = cov_it->second;
+        pos = cov_it->first + cov_it->second->len;
+    }
+    if (pos < op_end)
+    {
+        return false;
+    }
+    if (wait_for)
+    {
+        wait_for->waiting.push_back(op);
+        return true;
+    }
+    reset_read_bitmap(op);
+    for (; it != ra.bufs.end() && it->first < op_end; it++)
+    {
+        auto rb = it->second;
+        uint64_t begin = it->first < op->offset ? op->offset : it->first;
+        uint64_t end = it->first + rb->len > op_end ? op_end : it->first + rb->len;
+        copy_to_iov(op->iov, begin - op->offset, (uint8_t*)rb->buf + begin - it->first, end - begin);
+        for (uint64_t cur = begin; cur < end; cur += bs_bitmap_granularity)
+        {
+            unsigned src_loc = (cur - it->first)/bs_bitmap_granularity;
+            unsigned dst_loc = (cur - op->offset)/bs_bitmap_granularity;
+            if ((((uint8_t*)rb->bitmap)[src_loc/8] >> (src_loc%8)) & 1)
+                ((uint8_t*)op->bitmap_buf)[dst_loc/8] |= (1 << (dst_loc%8));
+        }
+    }
+    if (dirty_buffers.size() > 0)
+    {
+        // Unsynced writes are newer than prefetched data
+        read_from_writeback(op, false);
+    }
+    op->version = 0;
+    op->retval = op->len;
+    std::function<void(cluster_op_t*)>(op->callback)(op);
+    return true;
+}
+
+void cluster_client_t::prefetch(cluster_readahead_t & ra, inode_t inode, uint64_t offset, uint64_t len)
+{
+    auto rb = new cluster_readahead_buf_t;
+    rb->buf = malloc_or_die(len);
+    rb->len = len;
+    ra.bufs[offset] = rb;
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->flags = OP_NO_READAHEAD;
+    op->inode = inode;
+    op->offset = offset;
+    op->len = len;
+    op->iov.push_back(rb->buf, len);
+    uint64_t write_gen = ra.write_gen;
+    op->callback = [this, &ra, rb, write_gen](cluster_op_t *op)
+    {
+        std::vector<cluster_op_t*> waiting;
+        waiting.swap(rb->waiting);
+        if (op->retval == op->len && ra.write_gen == write_gen)
+        {
+            rb->done = true;
+            rb->bitmap = op->bitmap_buf;
+            op->bitmap_buf = op->part_bitmaps = NULL;
+            op->bitmap_buf_size = 0;
+        }
+        else
+        {
+            // Failed or overwritten in the meantime
+            ra.bufs.erase(op->offset);
+            free(rb->buf);
+            delete rb;
+        }
+        delete op;
+        for (auto rop: waiting)
+        {
+            if (!read_from_readahead(ra, rop))
+            {
+                rop->flags |= OP_NO_READAHEAD;
+                execute(rop);
+            }
+        }
+    };
+    execute(op);
+}
+
+// Drop prefetched data overlapping a write
+void cluster_client_t::invalidate_readahead(inode_t inode, uint64_t offset, uint64_t len)
+{
+    auto ra_it = readahead.find(inode);
+    if (ra_it == readahead.end())
+    {
+        return;
+    }
+    auto & ra = ra_it->second;
+    ra.write_gen++;
+    auto it = ra.bufs.upper_bound(offset);
+    if (it != ra.bufs.begin())
+        it--;
+    while (it != ra.bufs.end() && it->first < offset+len)
+    {
+        if (it->second->done && it->first + it->second->len > offset)
+        {
+            free(it->second->buf);
+            free(it->second->bitmap);
+            delete it->second;
+            ra.bufs.erase(it++);
+        }
+        else
+            it++;
+    }
+}
+
+// Deleted objects read as zeroes, so buffered writes must not bring their old data back when they're
+// repeated or flushed after the delete. Buffers being sent are left as is, like any concurrent write
+void cluster_client_t::zero_dirty_buffers(inode_t inode, uint64_t offset, uint64_t len)
+{
+    auto it = dirty_buffers.lower_bound((object_id){ .inode = inode, .stripe = offset });
+    if (it != dirty_buffers.begin())
+        it--;
+    while (it != dirty_buffers.end() && (it->first.inode < inode ||
+        it->first.inode == inode && it->first.stripe < offset+len))
+    {
+        uint64_t begin = it->first.stripe < offset ? offset : it->first.stripe;
+        uint64_t end = it->first.stripe+it->second.len > offset+len ? offset+len : it->first.stripe+it->second.len;
+        if (it->first.inode == inode && begin < end && !it->second.refs)
+        {
+            memset((uint8_t*)it->second.buf + begin - it->first.stripe, 0, end - begin);
+        }
+        it++;
+    }
+}
+
 int cluster_client_t::continue_rw(cluster_op_t *op)
 {
     if (op->state == 0)
@@ -617,8 +1184,44 @@ resume_0:
             // Postpone operations to unknown pools
             return 0;
         }
+        if (op->opcode == OSD_OP_DELETE || op->opcode == OSD_OP_MERGE)
+        {
+            // Only whole objects can be deleted or merged, len=0 means the object at <offset>
+            auto & pool_cfg = st_cli.pool_config[pool_id];
+            uint64_t pg_block_size = bs_block_size *
+                (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+            if (op->offset % pg_block_size || op->len % pg_block_size)
+            {
+                op->retval = -EINVAL;
+                erase_op(op);
+                return 1;
+            }
+        }
+    }
+    if (client_qos && (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) &&
+        !(op->flags & (OP_FLUSH_BUFFER|OP_WRITEBACK)))
+    {
+        auto ino_it = st_cli.inode_config.find(op->inode);
+        if (ino_it != st_cli.inode_config.end() && (ino_it->second.iops_limit || ino_it->second.bandwidth_limit))
+        {
+            uint64_t wait_us = inode_qos[op->inode].take(ino_it->second.iops_limit, ino_it->second.bandwidth_limit,
+                op->opcode == OSD_OP_DELETE ? 0 : op->len);
+            if (wait_us > 0)
+            {
+                // Postpone the operation until the inode QoS limit allows it
+                if (qos_timer_id < 0)
+                {
+                    qos_timer_id = tfd->set_timer((wait_us+999)/1000, false, [this](int)
+                    {
+                        qos_timer_id = -1;
+                        continue_ops();
+                    });
+                }
+                return 0;
+            }
+        }
     }
-    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
+    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE || op->opcode == OSD_OP_MERGE)
     {
         if (!(op->flags & OSD_OP_IGNORE_READONLY))
         {
@@ -630,7 +1233,7 @@ resume_0:
                 return 1;
             }
         }
-        if (op->opcode == OSD_OP_WRITE && !immediate_commit && !(op->flags & OP_FLUSH_BUFFER))
+        if (op->opcode == OSD_OP_WRITE && !immediate_commit && !(op->flags & (OP_FLUSH_BUFFER|OP_WRITEBACK)))
         {
             copy_write(op, dirty_buffers);
         }
@@ -718,6 +1321,16 @@ resume_3:
                 op->done_count = 0;
                 goto resume_1;
             }
+            if (enable_writeback && dirty_buffers.size() > 0)
+            {
+                // Buffered writes are newer than the data read from OSDs
+                read_from_writeback(op, false);
+            }
+        }
+        else if (op->opcode == OSD_OP_READ_BITMAP && enable_writeback && dirty_buffers.size() > 0)
+        {
+            // Buffered writes are also allocated
+            mark_writeback_bitmap(op);
         }
         op->retval = op->len;
         erase_op(op);
@@ -743,7 +1356,9 @@ resume_3:
         {
             for (int i = 0; i < op->parts.size(); i++)
             {
-                op->parts[i].flags = 0;
+                // Only resend failed parts
+                if (!(op->parts[i].flags & PART_DONE))
+                    op->parts[i].flags &= PART_NO_REPLICA;
             }
             goto resume_2;
         }
@@ -869,13 +1484,14 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
             if (end == begin)
                 op->done_count++;
         }
-        else if (op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_DELETE)
+        else if (op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_DELETE && op->opcode != OSD_OP_MERGE)
         {
             add_iov(end-begin, false, op, iov_idx, iov_pos, op->parts[i].iov, NULL, 0);
         }
         op->parts[i].parent = op;
         op->parts[i].offset = begin;
-        op->parts[i].len = op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_DELETE ? 0 : (uint32_t)(end - begin);
+        op->parts[i].len = op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_DELETE ||
+            op->opcode == OSD_OP_MERGE ? 0 : (uint32_t)(end - begin);
         op->parts[i].pg_num = pg_num;
         op->parts[i].osd_num = 0;
         op->parts[i].flags = 0;
@@ -902,6 +1518,37 @@ bool cluster_client_t::affects_osd(uint64_t inode, uint64_t offset, uint64_t len
     return false;
 }
 
+// Secondary OSDs only serve reads of clean replicated PGs without parent layers in the same pool
+osd_num_t cluster_client_t::pick_read_osd(cluster_op_t *op, pool_config_t & pool_cfg, pg_config_t & pg_cfg)
+{
+    osd_num_t primary_osd = pg_cfg.cur_primary;
+    if (pool_cfg.scheme != POOL_SCHEME_REPLICATED || pg_cfg.cur_state != PG_ACTIVE)
+        return primary_osd;
+    auto ino_it = st_cli.inode_config.find(op->cur_inode);
+    if (ino_it != st_cli.inode_config.end() && ino_it->second.parent_id &&
+        INODE_POOL(ino_it->second.parent_id) == INODE_POOL(op->cur_inode))
+    {
+        return primary_osd;
+    }
+    auto peer_it = st_cli.peer_states.find(primary_osd);
+    if (peer_it != st_cli.peer_states.end() && peer_it->second["host"] == client_host)
+        return primary_osd;
+    for (auto osd: pg_cfg.target_set)
+    {
+        if (!osd || osd == primary_osd)
+            continue;
+        peer_it = st_cli.peer_states.find(osd);
+        if (peer_it == st_cli.peer_states.end() || peer_it->second["host"] != client_host)
+            continue;
+        if (msgr.osd_peer_fds.find(osd) != msgr.osd_peer_fds.end())
+            return osd;
+        // Use the primary until the connection is established
+        if (msgr.wanted_peers.find(osd) == msgr.wanted_peers.end())
+            msgr.connect_peer(osd, peer_it->second);
+    }
+    return primary_osd;
+}
+
 bool cluster_client_t::try_send(cluster_op_t *op, int i)
 {
     auto part = &op->parts[i];
@@ -911,6 +1558,15 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
         !pg_it->second.pause && pg_it->second.cur_primary)
     {
         osd_num_t primary_osd = pg_it->second.cur_primary;
+        if (read_from_replicas && op->opcode == OSD_OP_READ && !(part->flags & PART_NO_REPLICA))
+        {
+            osd_num_t read_osd = pick_read_osd(op, pool_cfg, pg_it->second);
+            if (read_osd != primary_osd)
+            {
+                part->flags |= PART_REPLICA;
+                primary_osd = read_osd;
+            }
+        }
         auto peer_it = msgr.osd_peer_fds.find(primary_osd);
         if (peer_it != msgr.osd_peer_fds.end())
         {
@@ -928,6 +1584,15 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                 if (ino_it != st_cli.inode_config.end())
                     meta_rev = ino_it->second.mod_revision;
             }
+            uint64_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+            bool send_parity = client_ec_parity && op->opcode == OSD_OP_WRITE && pool_cfg.scheme != POOL_SCHEME_REPLICATED &&
+                part->len == bs_block_size*pg_data_size && !(part->offset % (bs_block_size*pg_data_size));
+            if (part->op.buf)
+            {
+                // Parity of the previous attempt
+                free(part->op.buf);
+                part->op.buf = NULL;
+            }
             part->op = (osd_op_t){
                 .op_type = OSD_OP_OUT,
                 .peer_fd = peer_fd,
@@ -940,8 +1605,10 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                     .inode = op->cur_inode,
                     .offset = part->offset,
                     .len = part->len,
+                    .flags = send_parity ? OSD_WRITE_PARITY : 0u,
                     .meta_revision = meta_rev,
                     .version = op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE ? op->version : 0,
+                    .parity_len = send_parity ? (uint32_t)(bs_block_size*pool_cfg.parity_chunks) : 0,
                 } },
                 .bitmap = (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP ? op->part_bitmaps + pg_bitmap_size*i : NULL),
                 .bitmap_len = (unsigned)(op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP ? pg_bitmap_size : 0),
@@ -951,6 +1618,12 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                 },
             };
             part->op.iov = part->iov;
+            if (send_parity)
+            {
+                // Freed with the operation
+                part->op.buf = calc_write_parity(pool_cfg, part);
+                part->op.iov.push_back(part->op.buf, bs_block_size*pool_cfg.parity_chunks);
+            }
             msgr.outbox_push(&part->op);
             return true;
         }
@@ -962,10 +1635,72 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
     return false;
 }
 
+// Calculate parity chunks of a whole-object write to an EC/XOR pool with the same code as OSDs
+void* cluster_client_t::calc_write_parity(pool_config_t & pool_cfg, cluster_op_part_t *part)
+{
+    int pg_size = pool_cfg.pg_size, pg_data_size = pool_cfg.pg_size-pool_cfg.parity_chunks;
+    // Parity chunks go first, followed by a contiguous copy of data if the write is scattered
+    void *parity_buf = memalign_or_die(MEM_ALIGNMENT, (part->iov.count > 1 ? pg_size : pool_cfg.parity_chunks)*bs_block_size);
+    void *data_buf = part->iov.buf[0].iov_base;
+    if (part->iov.count > 1)
+    {
+        data_buf = parity_buf + pool_cfg.parity_chunks*bs_block_size;
+        uint64_t pos = 0;
+        for (int i = 0; i < part->iov.count; i++)
+        {
+            memcpy(data_buf + pos, part->iov.buf[i].iov_base, part->iov.buf[i].iov_len);
+            pos += part->iov.buf[i].iov_len;
+        }
+    }
+    osd_rmw_stripe_t stripes[pg_size];
+    void *parity_bufs[pool_cfg.parity_chunks];
+    memset(stripes, 0, sizeof(stripes));
+    for (int role = 0; role < pg_data_size; role++)
+    {
+        stripes[role].read_buf = data_buf + role*bs_block_size;
+    }
+    for (int i = 0; i < pool_cfg.parity_chunks; i++)
+    {
+        parity_bufs[i] = parity_buf + i*bs_block_size;
+    }
+    if (pool_cfg.scheme == POOL_SCHEME_XOR)
+    {
+        calc_full_parity_xor(stripes, pg_size, parity_bufs, NULL, bs_block_size, 0);
+    }
+    else
+    {
+        uint64_t key = (uint64_t)pg_size | ((uint64_t)pg_data_size) << 32;
+        if (ec_parity_schemes.find(key) == ec_parity_schemes.end())
+        {
+            use_jerasure(pg_size, pg_data_size, true);
+            ec_parity_schemes.insert(key);
+        }
+        calc_full_parity_jerasure(stripes, pg_size, pg_data_size, parity_bufs, NULL, bs_block_size, 0);
+    }
+    return parity_buf;
+}
+
 int cluster_client_t::continue_sync(cluster_op_t *op)
 {
     if (op->state == 1)
         goto resume_1;
+    if (op->state == 0 && writeback_bytes > 0 && flush_writeback(op) > 0)
+    {
+        // Write-back buffers are sent first, the sync continues when they're written.
+        // Don't touch <op> here, it may already be completed
+        return 0;
+    }
+    if (op->state == 2)
+    {
+        op->state = 0;
+        if (writeback_error)
+        {
+            op->retval = writeback_error;
+            writeback_error = 0;
+            erase_op(op);
+            return 1;
+        }
+    }
     if (immediate_commit || !dirty_osds.size())
     {
         // Sync is not required in the immediate_commit mode or if there are no dirty_osds
@@ -1035,6 +1770,7 @@ resume_1:
     }
     else
     {
+        writeback_held_bytes = 0;
         for (auto uw_it = dirty_buffers.begin(); uw_it != dirty_buffers.end(); )
         {
             if (uw_it->second.state == CACHE_FLUSHING)
@@ -1043,7 +1779,10 @@ resume_1:
                 dirty_buffers.erase(uw_it++);
             }
             else
+            {
+                writeback_held_bytes += uw_it->second.len;
                 uw_it++;
+            }
         }
     }
     erase_op(op);
@@ -1091,32 +1830,46 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     int expected = part->op.req.hdr.opcode == OSD_OP_SYNC ? 0 : part->op.req.rw.len;
     if (part->op.reply.hdr.retval != expected)
     {
-        // Operation failed, retry
-        if (part->op.reply.hdr.retval == -EPIPE)
+        if ((part->flags & PART_REPLICA) && part->op.reply.hdr.retval == -EPIPE)
         {
-            // Mark op->up_wait = true before stopping the client
-            op->up_wait = true;
-            if (!retry_timeout_id)
+            // The replica refused the read because its view of the PG state differs. The PG isn't
+            // down because of that, so the part is retried with the primary without waiting for
+            // up_wait_retry_interval as soon as other parts of the operation complete
+            part->flags |= PART_NO_REPLICA;
+        }
+        else
+        {
+            // Operation failed, retry
+            if (part->op.reply.hdr.retval == -EPIPE)
             {
-                retry_timeout_id = tfd->set_timer(up_wait_retry_interval, false, [this](int)
+                // Mark op->up_wait = true before stopping the client
+                op->up_wait = true;
+                if (!retry_timeout_id)
                 {
-                    retry_timeout_id = 0;
-                    continue_ops(true);
-                });
+                    retry_timeout_id = tfd->set_timer(up_wait_retry_interval, false, [this](int)
+                    {
+                        retry_timeout_id = 0;
+                        continue_ops(true);
+                    });
+                }
+            }
+            if (!op->retval || op->retval == -EPIPE)
+            {
+                // Don't overwrite other errors with -EPIPE
+                op->retval = part->op.reply.hdr.retval;
+            }
+            if (part->flags & PART_REPLICA)
+            {
+                part->flags |= PART_NO_REPLICA;
+            }
+            if (op->retval != -EINTR && op->retval != -EIO)
+            {
+                fprintf(
+                    stderr, "%s operation failed on OSD %lu: retval=%ld (expected %d), dropping connection\n",
+                    osd_op_names[part->op.req.hdr.opcode], part->osd_num, part->op.reply.hdr.retval, expected
+                );
+                msgr.stop_client(part->op.peer_fd);
             }
-        }
-        if (!op->retval || op->retval == -EPIPE)
-        {
-            // Don't overwrite other errors with -EPIPE
-            op->retval = part->op.reply.hdr.retval;
-        }
-        if (op->retval != -EINTR && op->retval != -EIO)
-        {
-            fprintf(
-                stderr, "%s operation failed on OSD %lu: retval=%ld (expected %d), dropping connection\n",
-                osd_op_names[part->op.req.hdr.opcode], part->osd_num, part->op.reply.hdr.retval, expected
-            );
-            msgr.stop_client(part->op.peer_fd);
         }
         part->flags |= PART_ERROR;
     }
@@ -1126,6 +1879,13 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
         dirty_osds.insert(part->osd_num);
         part->flags |= PART_DONE;
         op->done_count++;
+        if (on_part_done)
+        {
+            timespec tv_end;
+            clock_gettime(CLOCK_REALTIME, &tv_end);
+            on_part_done(part, (tv_end.tv_sec - part->op.tv_begin.tv_sec)*1000000 +
+                (tv_end.tv_nsec - part->op.tv_begin.tv_nsec)/1000);
+        }
         if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP)
         {
             copy_part_bitmap(op, part);
@@ -5,6 +5,8 @@
 
 #include "messenger.h"
 #include "etcd_state_client.h"
+#include "inode_qos.h"
+#include "slab_allocator.h"
 
 #define MIN_BLOCK_SIZE 4*1024
 #define MAX_BLOCK_SIZE 128*1024*1024
@@ -12,6 +14,7 @@
 #define DEFAULT_CLIENT_MAX_DIRTY_OPS 1024
 #define INODE_LIST_DONE 1
 #define INODE_LIST_HAS_UNSTABLE 2
+#define INODE_LIST_PG_DONE 4
 #define OSD_OP_READ_BITMAP OSD_OP_SEC_READ_BMP
 
 #define OSD_OP_IGNORE_READONLY 0x08
@@ -47,6 +50,9 @@ struct cluster_op_t
     void *bitmap_buf = NULL;
     std::function<void(cluster_op_t*)> callback;
     ~cluster_op_t();
+    // Ops are recycled through a per-thread pool
+    static void *operator new(size_t size) { return thread_slab_pool<cluster_op_t>().alloc(size); }
+    static void operator delete(void *ptr) { thread_slab_pool<cluster_op_t>().release(ptr); }
 protected:
     int state = 0;
     uint64_t cur_inode; // for snapshot reads
@@ -68,6 +74,30 @@ struct cluster_buffer_t
     void *buf;
     uint64_t len;
     int state;
+    // Allocated size of <buf>, adjacent writes are appended to the buffer while it fits
+    uint64_t cap;
+    // Number of writes sending <buf>, it can't be reallocated while they're in progress
+    int refs;
+};
+
+// One prefetched object
+struct cluster_readahead_buf_t
+{
+    void *buf = NULL, *bitmap = NULL;
+    uint64_t len = 0;
+    bool done = false;
+    // Reads waiting for the prefetch to complete
+    std::vector<cluster_op_t*> waiting;
+};
+
+// Sequential read stream of one inode
+struct cluster_readahead_t
+{
+    uint64_t next_offset = UINT64_MAX;
+    int seq_reads = 0;
+    // Incremented by writes, prefetches started before a write are discarded
+    uint64_t write_gen = 0;
+    std::map<uint64_t, cluster_readahead_buf_t*> bufs;
 };
 
 struct inode_list_t;
@@ -84,11 +114,26 @@ class cluster_client_t
     std::map<pool_id_t, uint64_t> pg_counts;
     // WARNING: initially true so execute() doesn't create fake sync
     bool immediate_commit = true;
-    // FIXME: Implement inmemory_commit mode. Note that it requires to return overlapping reads from memory.
+    // Write-back mode: acknowledge writes once they're copied to dirty_buffers and only send them
+    // on sync or when dirty limits are exceeded. Overlapping reads are served from the buffers
+    bool enable_writeback = false;
     uint64_t client_max_dirty_bytes = 0;
     uint64_t client_max_dirty_ops = 0;
+    // Prefetch this number of bytes ahead of sequential reads, 0 = disabled
+    uint64_t client_readahead = 0;
     int log_level;
     int up_wait_retry_interval = 500; // ms
+    // Read from a replica on the same host instead of the primary OSD when the PG is clean
+    bool read_from_replicas = false;
+    // Calculate parity of whole-object writes to EC/XOR pools and send it to the primary OSD
+    bool client_ec_parity = false;
+    // (pg_size, data chunks) pairs with initialized EC matrices
+    std::set<uint64_t> ec_parity_schemes;
+    std::string client_host;
+    // Also apply per-inode QoS limits on the client to smooth the load before it reaches OSDs
+    bool client_qos = false;
+    std::map<inode_t, inode_qos_bucket_t> inode_qos;
+    int qos_timer_id = -1;
 
     int retry_timeout_id = 0;
     uint64_t op_id = 1;
@@ -97,40 +142,76 @@ class cluster_client_t
     std::map<object_id, cluster_buffer_t> dirty_buffers;
     std::set<osd_num_t> dirty_osds;
     uint64_t dirty_bytes = 0, dirty_ops = 0;
+    // Write-back buffers not sent to OSDs yet, and the last error of sending them
+    uint64_t writeback_bytes = 0;
+    // Memory held by buffers until a sync frees them: increased by write-back writes and
+    // recalculated from the remaining buffers after each sync. Limited by client_max_dirty_bytes
+    uint64_t writeback_held_bytes = 0;
+    int writeback_error = 0;
+    std::map<inode_t, cluster_readahead_t> readahead;
 
     void *scrap_buffer = NULL;
     unsigned scrap_buffer_size = 0;
+    // Zeroes for write-zeroes requests, allocated on first use
+    void *zero_buffer = NULL;
 
     bool pgs_loaded = false;
     ring_consumer_t consumer;
     std::vector<std::function<void(void)>> on_ready_hooks;
     std::vector<inode_list_t*> lists;
     int continuing_ops = 0;
+    bool executing_batch = false;
 
 public:
     etcd_state_client_t st_cli;
     osd_messenger_t msgr;
     json11::Json config;
+    // Called for every successfully completed op part with its latency in microseconds,
+    // used by "vitastor-cli bench" to attribute latency to OSDs and PGs
+    std::function<void(cluster_op_part_t *part, uint64_t usec)> on_part_done;
 
-    cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config);
+    // With <etcd_mirror>, the client doesn't connect to etcd and receives its state with st_cli.apply_mirror_*()
+    cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json & config, bool etcd_mirror = false);
     ~cluster_client_t();
     void execute(cluster_op_t *op);
+    // Queue all operations first and then start them with one continue_ops(), so that
+    // messages to each OSD are sent together even without a ring loop
+    void execute_batch(cluster_op_t **ops, int count);
     bool is_ready();
     void on_ready(std::function<void(void)> fn);
 
-    static void copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers);
+    static void copy_write(cluster_op_t *op, std::map<object_id, cluster_buffer_t> & dirty_buffers, bool writeback = false);
     void continue_ops(bool up_retry = false);
+    // Objects of each PG are passed to <callback> in parts, the last one has INODE_LIST_PG_DONE in status.
+    // Only PGs from <only_pgs> are listed if it's not empty
     inode_list_t *list_inode_start(inode_t inode,
-        std::function<void(inode_list_t* lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)> callback);
+        std::function<void(inode_list_t* lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)> callback,
+        const std::set<pg_num_t> & only_pgs = std::set<pg_num_t>());
     int list_pg_count(inode_list_t *lst);
     void list_inode_next(inode_list_t *lst, int next_pgs);
+    // Discard or zero a range of a block device image, callback receives 0 or a negative error code
+    void discard(inode_t inode, uint64_t offset, uint64_t len, bool write_zeroes, bool no_hole,
+        std::function<void(int)> callback);
     inline uint32_t get_bs_bitmap_granularity() { return bs_bitmap_granularity; }
     inline uint64_t get_bs_block_size() { return bs_block_size; }
+    inline bool uses_cache() { return enable_writeback || client_readahead; }
     uint64_t next_op_id();
 
 protected:
     bool affects_osd(uint64_t inode, uint64_t offset, uint64_t len, osd_num_t osd);
+    osd_num_t pick_read_osd(cluster_op_t *op, pool_config_t & pool_cfg, pg_config_t & pg_cfg);
     void flush_buffer(const object_id & oid, cluster_buffer_t *wr);
+    bool write_back(cluster_op_t *op);
+    void reset_read_bitmap(cluster_op_t *op);
+    bool read_from_writeback(cluster_op_t *op, bool full_only);
+    void mark_writeback_bitmap(cluster_op_t *op);
+    bool read_ahead(cluster_op_t *op);
+    bool read_from_readahead(cluster_readahead_t & ra, cluster_op_t *op);
+    void prefetch(cluster_readahead_t & ra, inode_t inode, uint64_t offset, uint64_t len);
+    void invalidate_readahead(inode_t inode, uint64_t offset, uint64_t len);
+    void zero_dirty_buffers(inode_t inode, uint64_t offset, uint64_t len);
+    cluster_op_t *zero_op(uint64_t offset, uint64_t len);
+    int flush_writeback(cluster_op_t *sync_op);
     void on_load_config_hook(json11::Json::object & config);
     void on_load_pgs_hook(bool success);
     void on_change_hook(std::map<std::string, etcd_kv_t> & changes);
@@ -138,6 +219,7 @@ protected:
     int continue_rw(cluster_op_t *op);
     void slice_rw(cluster_op_t *op);
     bool try_send(cluster_op_t *op, int i);
+    void* calc_write_parity(pool_config_t & pool_cfg, cluster_op_part_t *part);
     int continue_sync(cluster_op_t *op);
     void send_sync(cluster_op_t *op, cluster_op_part_t *part);
     void handle_op_part(cluster_op_part_t *part);
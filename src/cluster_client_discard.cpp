@@ -0,0 +1,103 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include "cluster_client.h"
+
+#define ZERO_BUFFER_SIZE 1024*1024
+
+struct discard_op_t
+{
+    int left = 0;
+    int retval = 0;
+    std::function<void(int)> callback;
+};
+
+// Block device discard and write-zeroes: whole objects in the range are deleted and, with <write_zeroes>,
+// unaligned ends are filled with zeroes. Objects of clones are never deleted by write-zeroes because
+// reads would then show the data of the parent, and neither are objects with <no_hole>
+void cluster_client_t::discard(inode_t inode, uint64_t offset, uint64_t len, bool write_zeroes, bool no_hole,
+    std::function<void(int)> callback)
+{
+    uint64_t del_begin = offset, del_end = offset;
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(inode));
+    auto ino_it = st_cli.inode_config.find(inode);
+    if (pool_it != st_cli.pool_config.end() && bs_block_size > 0 && !no_hole &&
+        (!write_zeroes || ino_it != st_cli.inode_config.end() && !ino_it->second.parent_id))
+    {
+        auto & pool_cfg = pool_it->second;
+        uint64_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        uint64_t pg_block_size = bs_block_size * pg_data_size;
+        del_begin = ((offset + pg_block_size - 1) / pg_block_size) * pg_block_size;
+        del_end = ((offset + len) / pg_block_size) * pg_block_size;
+        if (del_end < del_begin)
+            del_end = del_begin;
+    }
+    std::vector<cluster_op_t*> subops;
+    if (del_end > del_begin)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_DELETE;
+        op->offset = del_begin;
+        op->len = del_end - del_begin;
+        subops.push_back(op);
+    }
+    if (write_zeroes)
+    {
+        if (del_end == del_begin)
+        {
+            subops.push_back(zero_op(offset, len));
+        }
+        else
+        {
+            if (del_begin > offset)
+                subops.push_back(zero_op(offset, del_begin - offset));
+            if (offset + len > del_end)
+                subops.push_back(zero_op(del_end, offset + len - del_end));
+        }
+    }
+    if (!subops.size())
+    {
+        // Discard of partial objects is just ignored
+        callback(0);
+        return;
+    }
+    discard_op_t *dop = new discard_op_t;
+    dop->left = subops.size();
+    dop->callback = callback;
+    for (auto op: subops)
+    {
+        op->inode = inode;
+        op->callback = [dop](cluster_op_t *op)
+        {
+            if (op->retval != op->len && !dop->retval)
+            {
+                dop->retval = op->retval < 0 ? op->retval : -EIO;
+            }
+            delete op;
+            if (!--dop->left)
+            {
+                dop->callback(dop->retval);
+                delete dop;
+            }
+        };
+        execute(op);
+    }
+}
+
+cluster_op_t *cluster_client_t::zero_op(uint64_t offset, uint64_t len)
+{
+    if (!zero_buffer)
+    {
+        zero_buffer = malloc_or_die(ZERO_BUFFER_SIZE);
+        memset(zero_buffer, 0, ZERO_BUFFER_SIZE);
+    }
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->offset = offset;
+    op->len = len;
+    for (uint64_t pos = 0; pos < len; pos += ZERO_BUFFER_SIZE)
+    {
+        op->iov.push_back(zero_buffer, len-pos < ZERO_BUFFER_SIZE ? len-pos : ZERO_BUFFER_SIZE);
+    }
+    return op;
+}
@@ -5,6 +5,9 @@
 #include "pg_states.h"
 #include "cluster_client.h"
 
+// Objects are listed in pages, so a PG is returned to the callback in parts
+#define INODE_LIST_PAGE_SIZE 65536
+
 struct inode_list_t;
 
 struct inode_list_pg_t;
@@ -27,6 +30,8 @@ struct inode_list_pg_t
     int done = 0;
     std::vector<inode_list_osd_t> list_osds;
     std::set<object_id> objects;
+    // current page start and the minimal end of pages received from all OSDs
+    object_id start_oid = {}, next_oid = {};
 };
 
 struct inode_list_t
@@ -41,7 +46,8 @@ struct inode_list_t
 };
 
 inode_list_t* cluster_client_t::list_inode_start(inode_t inode,
-    std::function<void(inode_list_t* lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)> callback)
+    std::function<void(inode_list_t* lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)> callback,
+    const std::set<pg_num_t> & only_pgs)
 {
     int skipped_pgs = 0;
     pool_id_t pool_id = INODE_POOL(inode);
@@ -61,6 +67,10 @@ inode_list_t* cluster_client_t::list_inode_start(inode_t inode,
     auto pool_cfg = st_cli.pool_config[pool_id];
     for (auto & pg_item: pool_cfg.pg_config)
     {
+        if (only_pgs.size() && only_pgs.find(pg_item.first) == only_pgs.end())
+        {
+            continue;
+        }
         auto & pg = pg_item.second;
         if (pg.pause || !pg.cur_primary || !(pg.cur_state & PG_ACTIVE))
         {
@@ -213,6 +223,8 @@ void cluster_client_t::send_list(inode_list_osd_t *cur_list)
             .pg_stripe_size = pool_cfg.pg_stripe_size,
             .min_inode = cur_list->pg->lst->inode,
             .max_inode = cur_list->pg->lst->inode,
+            .start_oid = cur_list->pg->start_oid,
+            .max_count = INODE_LIST_PAGE_SIZE,
         },
     };
     op->callback = [this, cur_list](osd_op_t *op)
@@ -247,6 +259,13 @@ void cluster_client_t::send_list(inode_list_osd_t *cur_list)
                 oid.stripe = oid.stripe & ~STRIPE_MASK;
                 cur_list->pg->objects.insert(oid);
             }
+            // OSDs without pagination support return all objects and next_oid = 0
+            object_id next_oid = op->reply.sec_list.next_oid;
+            next_oid.stripe = next_oid.stripe & ~STRIPE_MASK;
+            if (next_oid.inode && (!cur_list->pg->next_oid.inode || next_oid < cur_list->pg->next_oid))
+            {
+                cur_list->pg->next_oid = next_oid;
+            }
         }
         delete op;
         auto lst = cur_list->pg->lst;
@@ -255,18 +274,37 @@ void cluster_client_t::send_list(inode_list_osd_t *cur_list)
         if (pg->done >= pg->list_osds.size())
         {
             int status = 0;
-            lst->done_pgs++;
-            if (lst->done_pgs >= lst->pgs.size())
-            {
-                status |= INODE_LIST_DONE;
-            }
             if (pg->has_unstable)
             {
                 status |= INODE_LIST_HAS_UNSTABLE;
             }
-            lst->callback(lst, std::move(pg->objects), pg->pg_num, pg->cur_primary, status);
-            lst->pgs[pg->pos] = NULL;
-            delete pg;
+            if (pg->next_oid.inode)
+            {
+                // Objects after the end of the shortest page are listed again with the next page
+                std::set<object_id> objects = std::move(pg->objects);
+                objects.erase(objects.lower_bound(pg->next_oid), objects.end());
+                pg->objects.clear();
+                pg->start_oid = pg->next_oid;
+                pg->next_oid = {};
+                pg->sent = pg->done = 0;
+                for (auto & list_osd: pg->list_osds)
+                {
+                    list_osd.sent = false;
+                }
+                lst->callback(lst, std::move(objects), pg->pg_num, pg->cur_primary, status);
+            }
+            else
+            {
+                status |= INODE_LIST_PG_DONE;
+                lst->done_pgs++;
+                if (lst->done_pgs >= lst->pgs.size())
+                {
+                    status |= INODE_LIST_DONE;
+                }
+                lst->pgs[pg->pos] = NULL;
+                lst->callback(lst, std::move(pg->objects), pg->pg_num, pg->cur_primary, status);
+                delete pg;
+            }
         }
         continue_listing(lst);
     };
@@ -31,6 +31,8 @@
 /* Version history:
    1.0  10 Feb 2013  First version
    1.1   1 Aug 2013  Correct comments on why three crc instructions in parallel
+   Altered for Vitastor: runtime dispatch, VPCLMULQDQ folding (x86-64) and
+   CRC32+PMULL (ARMv8) versions
  */
 
 #include <stdio.h>
@@ -39,6 +41,15 @@
 #include <unistd.h>
 #include "crc32c.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
@@ -344,31 +355,229 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
 #endif
 }
 
-/* Check for SSE 4.2.  SSE 4.2 was first supported in Nehalem processors
-   introduced in November, 2008.  This does not check for the existence of the
-   cpuid instruction itself, which was introduced on the 486SL in 1992, so this
-   will fail on earlier x86 processors.  cpuid works on all Pentium and later
-   processors. */
-#define SSE42(have) \
-    do { \
-        uint32_t eax, ecx; \
-        eax = 1; \
-        __asm__("cpuid" \
-            : "=c"(ecx) \
-            : "a"(eax) \
-            : "%ebx", "%edx"); \
-        (have) = (ecx >> 20) & 1; \
-    } while (0)
-
-/* Compute a CRC-32C.  If the crc32 instruction is available, use the hardware
-   version.  Otherwise, use the software version. */
-uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+/* x^n modulo the CRC-32C polynomial, bit-reflected like crc values, so that
+   bit 31 is x^0. Used to calculate constants for carry-less multiplication.
+   A 32-bit reflected value a placed in the low half of a 64-bit register means
+   a*x^32 there, and clmul(a, b) of such 64-bit values is a*b*x in the 128-bit
+   result, so multiplying a crc by x^(n-33) mod P and feeding the low 64 bits
+   of the product to the crc32 instruction with zero crc gives crc*x^n mod P. */
+static uint32_t crc32c_xpow(uint64_t n)
 {
-#ifndef __x86_64__
-    return crc32c_sw(crc, buf, len);
-#else
-    int sse42;
-    SSE42(sse42);
-    return sse42 ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+    uint32_t v = 0x80000000;
+    while (n--)
+        v = v & 1 ? (v >> 1) ^ POLY : v >> 1;
+    return v;
+}
+
+#if defined(__x86_64__)
+
+/* Folding constants: a 128-bit part of data is moved D bytes forward by
+   multiplying its low (older) half by x^(8D+31) and its high half by x^(8D-33) */
+static uint64_t crc32c_fold_256[2], crc32c_fold_64[2], crc32c_fold_48[2], crc32c_fold_32[2], crc32c_fold_16[2];
+
+static void crc32c_fold_const(uint64_t *k, size_t d)
+{
+    k[0] = crc32c_xpow(8*d+31);
+    k[1] = crc32c_xpow(8*d-33);
+}
+
+static void crc32c_init_vpclmul(void)
+{
+    crc32c_fold_const(crc32c_fold_256, 256);
+    crc32c_fold_const(crc32c_fold_64, 64);
+    crc32c_fold_const(crc32c_fold_48, 48);
+    crc32c_fold_const(crc32c_fold_32, 32);
+    crc32c_fold_const(crc32c_fold_16, 16);
+}
+
+__attribute__((target("avx512f,avx512bw,vpclmulqdq,pclmul,sse4.2")))
+static inline __m512i crc32c_fold512(__m512i x, __m512i k, __m512i next)
+{
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11), next, 0x96);
+}
+
+__attribute__((target("pclmul,sse4.2")))
+static inline __m128i crc32c_fold128(__m128i x, const uint64_t *k, __m128i next)
+{
+    __m128i kk = _mm_loadu_si128((const __m128i*)k);
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, kk, 0x00), _mm_clmulepi64_si128(x, kk, 0x11)), next);
+}
+
+/* Compute CRC-32C by folding 256-byte blocks with 512-bit carry-less multiplications
+   (Ice Lake, Zen 4 and newer). The folded remainder and the tail less than 256 bytes
+   are fed to the crc32 instruction. */
+__attribute__((target("avx512f,avx512bw,vpclmulqdq,pclmul,sse4.2")))
+static uint32_t crc32c_vpclmul(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = (const unsigned char*)buf;
+    if (len < 512)
+        return crc32c_hw(crc, buf, len);
+    __m512i x0 = _mm512_loadu_si512(next), x1 = _mm512_loadu_si512(next+64),
+        x2 = _mm512_loadu_si512(next+128), x3 = _mm512_loadu_si512(next+192);
+    /* processing data with some initial crc is the same as processing it with
+       zero crc and the initial crc xor-ed into its first 4 bytes */
+    x0 = _mm512_xor_si512(x0, _mm512_castsi128_si512(_mm_cvtsi32_si128(crc ^ 0xffffffff)));
+    next += 256;
+    len -= 256;
+    __m512i k = _mm512_set_epi64(crc32c_fold_256[1], crc32c_fold_256[0], crc32c_fold_256[1], crc32c_fold_256[0],
+        crc32c_fold_256[1], crc32c_fold_256[0], crc32c_fold_256[1], crc32c_fold_256[0]);
+    while (len >= 256)
+    {
+        x0 = crc32c_fold512(x0, k, _mm512_loadu_si512(next));
+        x1 = crc32c_fold512(x1, k, _mm512_loadu_si512(next+64));
+        x2 = crc32c_fold512(x2, k, _mm512_loadu_si512(next+128));
+        x3 = crc32c_fold512(x3, k, _mm512_loadu_si512(next+192));
+        next += 256;
+        len -= 256;
+    }
+    /* fold 4 512-bit registers into one and then 4 128-bit lanes into one */
+    k = _mm512_set_epi64(crc32c_fold_64[1], crc32c_fold_64[0], crc32c_fold_64[1], crc32c_fold_64[0],
+        crc32c_fold_64[1], crc32c_fold_64[0], crc32c_fold_64[1], crc32c_fold_64[0]);
+    x1 = crc32c_fold512(x0, k, x1);
+    x2 = crc32c_fold512(x1, k, x2);
+    x3 = crc32c_fold512(x2, k, x3);
+    __m128i lanes[4];
+    _mm512_storeu_si512(lanes, x3);
+    __m128i r = lanes[3];
+    r = crc32c_fold128(lanes[0], crc32c_fold_48, r);
+    r = crc32c_fold128(lanes[1], crc32c_fold_32, r);
+    r = crc32c_fold128(lanes[2], crc32c_fold_16, r);
+    /* the crc of the remainder is the crc of all data processed so far */
+    uint64_t crc0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(r));
+    crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(r, 1));
+    return crc32c_hw((uint32_t)crc0 ^ 0xffffffff, next, len);
+}
+
+#elif defined(__aarch64__)
+
+/* Constants to shift a crc by LONG and SHORT zero bytes with one PMULL */
+static uint64_t crc32c_pmull_long, crc32c_pmull_short;
+
+static void crc32c_init_armv8(void)
+{
+    crc32c_pmull_long = crc32c_xpow(8*LONG-33);
+    crc32c_pmull_short = crc32c_xpow(8*SHORT-33);
+}
+
+__attribute__((target("arch=armv8-a+crc+crypto")))
+static inline uint32_t crc32c_shift_pmull(uint64_t k, uint32_t crc)
+{
+    return __crc32cd(0, vgetq_lane_u64(vreinterpretq_u64_p128(vmull_p64((poly64_t)crc, (poly64_t)k)), 0));
+}
+
+/* Compute CRC-32C using ARMv8 CRC32 instructions, three streams in parallel like
+   crc32c_hw(), with crcs of the streams combined using PMULL instead of tables
+   (Neoverse, Ampere Altra and similar). */
+__attribute__((target("arch=armv8-a+crc+crypto")))
+static uint32_t crc32c_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = (const unsigned char*)buf;
+    const unsigned char *end;
+    uint32_t crc0, crc1, crc2;
+
+    crc0 = crc ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0)
+    {
+        crc0 = __crc32cb(crc0, *next);
+        next++;
+        len--;
+    }
+    while (len >= LONG*3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do
+        {
+            crc0 = __crc32cd(crc0, *(const uint64_t*)next);
+            crc1 = __crc32cd(crc1, *(const uint64_t*)(next + LONG));
+            crc2 = __crc32cd(crc2, *(const uint64_t*)(next + 2*LONG));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift_pmull(crc32c_pmull_long, crc0) ^ crc1;
+        crc0 = crc32c_shift_pmull(crc32c_pmull_long, crc0) ^ crc2;
+        next += LONG*2;
+        len -= LONG*3;
+    }
+    while (len >= SHORT*3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do
+        {
+            crc0 = __crc32cd(crc0, *(const uint64_t*)next);
+            crc1 = __crc32cd(crc1, *(const uint64_t*)(next + SHORT));
+            crc2 = __crc32cd(crc2, *(const uint64_t*)(next + 2*SHORT));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift_pmull(crc32c_pmull_short, crc0) ^ crc1;
+        crc0 = crc32c_shift_pmull(crc32c_pmull_short, crc0) ^ crc2;
+        next += SHORT*2;
+        len -= SHORT*3;
+    }
+    end = next + (len - (len & 7));
+    while (next < end)
+    {
+        crc0 = __crc32cd(crc0, *(const uint64_t*)next);
+        next += 8;
+    }
+    len &= 7;
+    while (len)
+    {
+        crc0 = __crc32cb(crc0, *next);
+        next++;
+        len--;
+    }
+    return crc0 ^ 0xffffffff;
+}
+
+#endif
+
+/* Implementations supported by the CPU, the fastest first */
+static struct crc32c_impl_t crc32c_impl_list[4];
+static int crc32c_impl_ready = 0;
+
+static void crc32c_init_impls(void)
+{
+    int n = 0;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("vpclmulqdq") && __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_init_vpclmul();
+        crc32c_impl_list[n++] = (struct crc32c_impl_t){ "vpclmulqdq", crc32c_vpclmul };
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_impl_list[n++] = (struct crc32c_impl_t){ "sse4.2", crc32c_hw };
+    }
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    if ((hwcap & HWCAP_CRC32) && (hwcap & HWCAP_PMULL))
+    {
+        crc32c_init_armv8();
+        crc32c_impl_list[n++] = (struct crc32c_impl_t){ "armv8-crc32-pmull", crc32c_armv8 };
+    }
 #endif
+    crc32c_impl_list[n++] = (struct crc32c_impl_t){ "sw", crc32c_sw };
+    crc32c_impl_list[n] = (struct crc32c_impl_t){ NULL, NULL };
+    __atomic_store_n(&crc32c_impl_ready, 1, __ATOMIC_RELEASE);
+}
+
+const struct crc32c_impl_t *crc32c_impls(void)
+{
+    if (!__atomic_load_n(&crc32c_impl_ready, __ATOMIC_ACQUIRE))
+        crc32c_init_impls();
+    return crc32c_impl_list;
+}
+
+/* Compute a CRC-32C with the fastest version supported by the CPU. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    if (!__atomic_load_n(&crc32c_impl_ready, __ATOMIC_ACQUIRE))
+        crc32c_init_impls();
+    return crc32c_impl_list[0].fn(crc, buf, len);
 }
@@ -12,6 +12,17 @@
 extern "C" {
 #endif
 uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// One CRC-32C implementation, for tests and benchmarks
+struct crc32c_impl_t
+{
+    const char *name;
+    uint32_t (*fn)(uint32_t crc, const void *buf, size_t len);
+};
+
+// Implementations supported by the CPU, the fastest first (it's used by crc32c()),
+// terminated by an entry with NULL name
+const struct crc32c_impl_t *crc32c_impls(void);
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,70 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "malloc_or_die.h"
+
+#define DISK_MAP_READ_SIZE 16*1024*1024
+
+// Read-only view of a region of a device or file for offline tools. The region is mapped
+// so that the kernel reads it with large readahead requests; if the device can't be mapped,
+// it's read into memory with large sequential reads instead of sector-sized ones
+struct disk_map_t
+{
+    uint8_t *buf = NULL;
+    void *map_addr = NULL;
+    size_t map_len = 0;
+
+    // Returns false and prints an error if the region can't be read
+    bool map(int fd, uint64_t offset, uint64_t len)
+    {
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t map_offset = offset & ~(page-1);
+        map_len = len + offset - map_offset;
+        map_addr = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_offset);
+        if (map_addr != MAP_FAILED)
+        {
+            madvise(map_addr, map_len, MADV_SEQUENTIAL);
+            buf = (uint8_t*)map_addr + (offset - map_offset);
+            return true;
+        }
+        map_addr = NULL;
+        map_len = 0;
+        buf = (uint8_t*)memalign_or_die(page, len);
+        for (uint64_t pos = 0; pos < len; )
+        {
+            ssize_t r = pread(fd, buf+pos, len-pos < DISK_MAP_READ_SIZE ? len-pos : DISK_MAP_READ_SIZE, offset+pos);
+            if (r <= 0)
+            {
+                printf("Failed to read %lu bytes at offset %lu\n", len, offset);
+                unmap();
+                return false;
+            }
+            pos += r;
+        }
+        return true;
+    }
+
+    void unmap()
+    {
+        if (map_addr)
+            munmap(map_addr, map_len);
+        else if (buf)
+            free(buf);
+        buf = NULL;
+        map_addr = NULL;
+        map_len = 0;
+    }
+
+    ~disk_map_t()
+    {
+        unmap();
+    }
+};
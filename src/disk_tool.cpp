@@ -0,0 +1,586 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Offline disk tools. Currently only "fsck": a read-only consistency check of the metadata
+// area, the allocator state derived from it and the journal, done in multiple threads
+
+#define _LARGEFILE64_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blockstore_impl.h"
+#include "crc32c.h"
+#include "disk_map.h"
+
+// Only this number of problems of each check is printed, all of them are counted
+#define FSCK_MAX_PRINTED 100
+
+struct fsck_meta_entry_t
+{
+    object_id oid;
+    uint64_t version;
+    uint64_t block;
+};
+
+struct fsck_small_write_t
+{
+    uint64_t journal_pos;
+    uint64_t data_offset;
+    uint32_t len;
+    uint32_t crc32_data;
+};
+
+struct fsck_result_t
+{
+    uint64_t errors = 0, warnings = 0;
+
+    void error(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    void warning(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+void fsck_result_t::error(const char *fmt, ...)
+{
+    if (errors++ < FSCK_MAX_PRINTED)
+    {
+        va_list args;
+        va_start(args, fmt);
+        printf("error: ");
+        vprintf(fmt, args);
+        printf("\n");
+        va_end(args);
+    }
+}
+
+void fsck_result_t::warning(const char *fmt, ...)
+{
+    if (warnings++ < FSCK_MAX_PRINTED)
+    {
+        va_list args;
+        va_start(args, fmt);
+        printf("warning: ");
+        vprintf(fmt, args);
+        printf("\n");
+        va_end(args);
+    }
+}
+
+struct disk_fsck_t
+{
+    int threads = 0;
+    const char *meta_device = NULL;
+    uint64_t meta_offset = 0, meta_len = 0;
+    // Several comma-separated journal devices mean a journal striped over them, like in the OSD
+    std::vector<std::string> journal_devices;
+    uint32_t journal_block = 0;
+    // journal_len is the length on each device, the total length when it's striped
+    uint64_t journal_offset = 0, journal_len = 0, journal_stripe_size = 0;
+
+    fsck_result_t res;
+
+    // Metadata
+    disk_map_t meta;
+    blockstore_meta_header_t hdr;
+    uint32_t clean_entry_size = 0, entries_per_block = 0;
+    uint64_t block_count = 0;
+    // Latest clean entry of every object, sorted by object ID
+    std::vector<fsck_meta_entry_t> clean;
+    // Allocator state: blocks used by the latest clean entries
+    std::vector<uint64_t> used_blocks;
+    uint64_t used_count = 0;
+
+    // Journal, one map per device
+    std::vector<disk_map_t> journal_maps;
+    uint64_t journal_entries = 0, journal_sectors = 0;
+    uint64_t journal_type_count[JE_MAX+1] = { 0 };
+    std::vector<fsck_small_write_t> small_writes;
+
+    int run();
+    bool check_meta();
+    void check_meta_range(uint64_t start_block, uint64_t end_block, std::vector<fsck_meta_entry_t> & out, fsck_result_t & r);
+    void check_alloc();
+    bool check_journal();
+    uint8_t *journal_ptr(uint64_t pos);
+    uint64_t data_location(uint64_t pos, uint64_t data_len);
+    int check_journal_sector(uint64_t & pos, uint32_t & crc32_last, bool & started);
+    void check_big_write(journal_entry *je, uint64_t pos);
+    void check_small_write_data();
+    const fsck_meta_entry_t *find_clean(const object_id & oid);
+    template<class F> void run_parallel(uint64_t count, F fn);
+};
+
+// Split [0, count) into <threads> ranges and run fn(thread, start, end) for each of them in parallel
+template<class F> void disk_fsck_t::run_parallel(uint64_t count, F fn)
+{
+    std::vector<std::thread> workers;
+    uint64_t per_thread = (count + threads - 1) / threads;
+    for (int i = 0; i < threads; i++)
+    {
+        uint64_t start = i*per_thread, end = start+per_thread < count ? start+per_thread : count;
+        workers.push_back(std::thread([&fn, i, start, end]() { fn(i, start, end < start ? start : end); }));
+    }
+    for (auto & t: workers)
+        t.join();
+}
+
+bool disk_fsck_t::check_meta()
+{
+    if (meta_len < sizeof(hdr))
+    {
+        printf("Metadata area of %lu bytes is too small to contain the superblock\n", meta_len);
+        return false;
+    }
+    int fd = open(meta_device, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open metadata device %s: %s\n", meta_device, strerror(errno));
+        return false;
+    }
+    bool ok = meta.map(fd, meta_offset, meta_len);
+    close(fd);
+    if (!ok)
+        return false;
+    memcpy(&hdr, meta.buf, sizeof(hdr));
+    if (hdr.zero != 0 || hdr.magic != BLOCKSTORE_META_MAGIC || hdr.version != BLOCKSTORE_META_VERSION)
+    {
+        printf("Metadata superblock is invalid or empty\n");
+        return false;
+    }
+    if (!hdr.meta_block_size || hdr.meta_block_size % MEM_ALIGNMENT || hdr.meta_block_size > meta_len ||
+        !hdr.data_block_size || !hdr.bitmap_granularity || hdr.data_block_size % hdr.bitmap_granularity)
+    {
+        printf(
+            "Metadata superblock has invalid parameters: meta_block_size=%u block_size=%u bitmap_granularity=%u\n",
+            hdr.meta_block_size, hdr.data_block_size, hdr.bitmap_granularity
+        );
+        return false;
+    }
+    // Same as in blockstore_impl_t::parse_config()
+    uint32_t bitmap_size = hdr.data_block_size / hdr.bitmap_granularity / 8;
+    uint32_t csum_size = hdr.data_csum_type != BLOCKSTORE_CSUM_NONE ? hdr.data_block_size / hdr.bitmap_granularity * 4 : 0;
+    clean_entry_size = sizeof(clean_disk_entry) + 2*bitmap_size + csum_size + (hdr.data_compression ? sizeof(uint32_t) : 0);
+    entries_per_block = hdr.meta_block_size / clean_entry_size;
+    if (!entries_per_block)
+    {
+        printf("Metadata entry size %u is larger than meta_block_size %u\n", clean_entry_size, hdr.meta_block_size);
+        return false;
+    }
+    // The first block is the superblock
+    uint64_t meta_blocks = meta_len / hdr.meta_block_size - 1;
+    block_count = meta_blocks * entries_per_block;
+    printf(
+        "Metadata: block_size=%u bitmap_granularity=%u meta_block_size=%u entry_size=%u, up to %lu data blocks\n",
+        hdr.data_block_size, hdr.bitmap_granularity, hdr.meta_block_size, clean_entry_size, block_count
+    );
+    // Every thread checks and sorts entries of its part of the metadata area
+    std::vector<std::vector<fsck_meta_entry_t>> parts(threads);
+    std::vector<fsck_result_t> part_res(threads);
+    run_parallel(meta_blocks, [&](int i, uint64_t start, uint64_t end)
+    {
+        check_meta_range(start, end, parts[i], part_res[i]);
+    });
+    uint64_t total = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        total += parts[i].size();
+        res.errors += part_res[i].errors;
+        res.warnings += part_res[i].warnings;
+    }
+    // Merge sorted parts, entries of the same object stay in on-disk order
+    std::vector<fsck_meta_entry_t> all;
+    all.reserve(total);
+    for (int i = 0; i < threads; i++)
+    {
+        uint64_t mid = all.size();
+        all.insert(all.end(), parts[i].begin(), parts[i].end());
+        parts[i].clear();
+        parts[i].shrink_to_fit();
+        std::inplace_merge(all.begin(), all.begin()+mid, all.end(), [](const fsck_meta_entry_t & a, const fsck_meta_entry_t & b)
+        {
+            return a.oid < b.oid;
+        });
+    }
+    // Only the latest version of each object is used on start, older blocks are freed
+    for (uint64_t i = 0; i < all.size(); )
+    {
+        uint64_t j = i+1, latest = i;
+        for (; j < all.size() && all[j].oid == all[i].oid; j++)
+        {
+            if (all[j].version > all[latest].version)
+                latest = j;
+        }
+        for (uint64_t k = i; k < j; k++)
+        {
+            if (k == latest)
+                continue;
+            if (all[k].version == all[latest].version)
+            {
+                res.error("object %lx:%lx v%lu is present in both block %lu and block %lu",
+                    all[k].oid.inode, all[k].oid.stripe, all[k].version, all[k].block, all[latest].block);
+            }
+            else
+            {
+                res.warning("stale entry of object %lx:%lx v%lu in block %lu, v%lu is in block %lu",
+                    all[k].oid.inode, all[k].oid.stripe, all[k].version, all[k].block, all[latest].version, all[latest].block);
+            }
+        }
+        clean.push_back(all[latest]);
+        i = j;
+    }
+    printf("Metadata: %lu entries, %lu objects\n", total, clean.size());
+    return true;
+}
+
+void disk_fsck_t::check_meta_range(uint64_t start_block, uint64_t end_block, std::vector<fsck_meta_entry_t> & out, fsck_result_t & r)
+{
+    for (uint64_t mb = start_block; mb < end_block; mb++)
+    {
+        uint8_t *entries = meta.buf + (mb+1)*hdr.meta_block_size;
+        for (uint32_t i = 0; i < entries_per_block; i++)
+        {
+            clean_disk_entry *entry = (clean_disk_entry*)(entries + i*clean_entry_size);
+            uint64_t block = mb*entries_per_block + i;
+            if (!entry->oid.inode)
+            {
+                if (entry->version)
+                    r.error("empty entry of block %lu has non-zero version %lu", block, entry->version);
+                continue;
+            }
+            if (!entry->version)
+                r.error("object %lx:%lx in block %lu has zero version", entry->oid.inode, entry->oid.stripe, block);
+            out.push_back((fsck_meta_entry_t){ .oid = entry->oid, .version = entry->version, .block = block });
+        }
+    }
+    std::stable_sort(out.begin(), out.end(), [](const fsck_meta_entry_t & a, const fsck_meta_entry_t & b)
+    {
+        return a.oid < b.oid;
+    });
+}
+
+void disk_fsck_t::check_alloc()
+{
+    used_blocks.resize((block_count+63)/64);
+    for (auto & e: clean)
+    {
+        used_blocks[e.block/64] |= (1ul << (e.block%64));
+        used_count++;
+    }
+    printf("Allocator: %lu of %lu blocks used, %lu free\n", used_count, block_count, block_count-used_count);
+}
+
+const fsck_meta_entry_t *disk_fsck_t::find_clean(const object_id & oid)
+{
+    auto it = std::lower_bound(clean.begin(), clean.end(), oid, [](const fsck_meta_entry_t & e, const object_id & oid)
+    {
+        return e.oid < oid;
+    });
+    return it != clean.end() && it->oid == oid ? &*it : NULL;
+}
+
+void disk_fsck_t::check_big_write(journal_entry *je, uint64_t pos)
+{
+    if (!meta.buf)
+        return;
+    uint64_t block = je->big_write.location / hdr.data_block_size;
+    if (je->big_write.location % hdr.data_block_size || block >= block_count)
+    {
+        res.error("journal offset %08lx: big_write of %lx:%lx v%lu has invalid location %08lx",
+            pos, je->big_write.oid.inode, je->big_write.oid.stripe, je->big_write.version, je->big_write.location);
+        return;
+    }
+    auto cl = find_clean(je->big_write.oid);
+    if (cl && cl->version >= je->big_write.version)
+    {
+        // Already flushed
+        return;
+    }
+    if (used_blocks[block/64] & (1ul << (block%64)))
+    {
+        // Not flushed yet, its block must be free in metadata
+        res.error("journal offset %08lx: block %lu of unflushed big_write %lx:%lx v%lu is used by another object",
+            pos, block, je->big_write.oid.inode, je->big_write.oid.stripe, je->big_write.version);
+    }
+}
+
+// Same as journal_t::pos_fd() and pos_offset(): stripe_size chunks are placed on devices round-robin
+uint8_t *disk_fsck_t::journal_ptr(uint64_t pos)
+{
+    if (journal_maps.size() <= 1)
+        return journal_maps[0].buf + pos;
+    uint64_t stripe = pos / journal_stripe_size;
+    return journal_maps[stripe % journal_maps.size()].buf +
+        (stripe / journal_maps.size()) * journal_stripe_size + pos % journal_stripe_size;
+}
+
+// Same as journal_t::data_location(): small write data doesn't wrap around the end of the journal
+// and doesn't cross stripe boundaries
+uint64_t disk_fsck_t::data_location(uint64_t pos, uint64_t data_len)
+{
+    if (pos + data_len > journal_len)
+        pos = journal_block;
+    if (journal_maps.size() > 1 && data_len && data_len <= journal_stripe_size &&
+        pos / journal_stripe_size != (pos + data_len - 1) / journal_stripe_size)
+    {
+        pos = (pos / journal_stripe_size + 1) * journal_stripe_size;
+        if (pos + data_len > journal_len)
+            pos = journal_block;
+    }
+    return pos;
+}
+
+// Same traversal as in dump_journal.cpp: entries are followed by the data of their small writes
+int disk_fsck_t::check_journal_sector(uint64_t & pos, uint32_t & crc32_last, bool & started)
+{
+    uint8_t *buf = journal_ptr(pos);
+    uint64_t sector_pos = pos;
+    uint32_t in_pos = 0;
+    int entries = 0;
+    bool wrapped = false;
+    pos += journal_block;
+    while (in_pos < journal_block)
+    {
+        journal_entry *je = (journal_entry*)(buf + in_pos);
+        if (je->magic != JOURNAL_MAGIC || je->type < JE_MIN || je->type > JE_MAX ||
+            je->size < JE_START_LEGACY_SIZE || je->size > journal_block-in_pos ||
+            started && je->crc32_prev != crc32_last || je_crc32(je) != je->crc32)
+        {
+            break;
+        }
+        started = true;
+        crc32_last = je->crc32;
+        journal_type_count[je->type]++;
+        if (je->type == JE_SMALL_WRITE || je->type == JE_SMALL_WRITE_INSTANT)
+        {
+            uint64_t data_pos = data_location(pos, je->small_write.len);
+            if (data_pos < pos)
+                wrapped = true;
+            pos = data_pos;
+            if (pos != je->small_write.data_offset)
+            {
+                res.error("journal offset %08lx: small_write of %lx:%lx v%lu has data at %08lx, expected %08lx",
+                    sector_pos, je->small_write.oid.inode, je->small_write.oid.stripe, je->small_write.version,
+                    je->small_write.data_offset, pos);
+            }
+            if (je->small_write.data_offset + je->small_write.len > journal_len ||
+                data_location(je->small_write.data_offset, je->small_write.len) != je->small_write.data_offset)
+            {
+                res.error("journal offset %08lx: small_write of %lx:%lx v%lu has data outside of the journal or crossing a stripe",
+                    sector_pos, je->small_write.oid.inode, je->small_write.oid.stripe, je->small_write.version);
+            }
+            else
+            {
+                small_writes.push_back((fsck_small_write_t){
+                    .journal_pos = sector_pos,
+                    .data_offset = je->small_write.data_offset,
+                    .len = je->small_write.len,
+                    .crc32_data = je->small_write.crc32_data,
+                });
+            }
+            pos += je->small_write.len;
+            if (pos >= journal_len)
+            {
+                pos = journal_block;
+                wrapped = true;
+            }
+        }
+        else if (je->type == JE_BIG_WRITE || je->type == JE_BIG_WRITE_INSTANT)
+        {
+            check_big_write(je, sector_pos);
+        }
+        in_pos += je->size;
+        entries++;
+    }
+    if (wrapped)
+    {
+        pos = journal_len;
+    }
+    return entries;
+}
+
+void disk_fsck_t::check_small_write_data()
+{
+    std::vector<fsck_result_t> part_res(threads);
+    run_parallel(small_writes.size(), [&](int i, uint64_t start, uint64_t end)
+    {
+        for (uint64_t j = start; j < end; j++)
+        {
+            auto & sw = small_writes[j];
+            if (crc32c(0, journal_ptr(sw.data_offset), sw.len) != sw.crc32_data)
+                part_res[i].error("journal offset %08lx: small_write data at %08lx has invalid crc32", sw.journal_pos, sw.data_offset);
+        }
+    });
+    for (int i = 0; i < threads; i++)
+    {
+        res.errors += part_res[i].errors;
+        res.warnings += part_res[i].warnings;
+    }
+}
+
+bool disk_fsck_t::check_journal()
+{
+    uint64_t dev_len = journal_len;
+    if (journal_devices.size() > 1)
+    {
+        // Same defaults and checks as in blockstore_impl_t::parse_config()
+        if (!journal_stripe_size)
+            journal_stripe_size = 2*hdr.data_block_size;
+        if (journal_stripe_size % journal_block || journal_stripe_size < hdr.data_block_size + journal_block)
+        {
+            printf("Journal stripe size must be a multiple of journal block size and at least block_size + journal block size\n");
+            return false;
+        }
+        // Only whole stripes are used on each device
+        dev_len = journal_len / journal_stripe_size * journal_stripe_size;
+        journal_len = dev_len * journal_devices.size();
+        if (!dev_len)
+        {
+            printf("Journal length is less than one stripe\n");
+            return false;
+        }
+    }
+    journal_maps.resize(journal_devices.size());
+    for (size_t i = 0; i < journal_devices.size(); i++)
+    {
+        int fd = open(journal_devices[i].c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            printf("Failed to open journal device %s: %s\n", journal_devices[i].c_str(), strerror(errno));
+            return false;
+        }
+        bool ok = journal_maps[i].map(fd, journal_offset, dev_len);
+        close(fd);
+        if (!ok)
+            return false;
+    }
+    journal_entry *je = (journal_entry*)journal_ptr(0);
+    if (je->magic != JOURNAL_MAGIC || je->type != JE_START || je->size > journal_block || je_crc32(je) != je->crc32)
+    {
+        printf("Journal superblock is invalid\n");
+        return false;
+    }
+    if (je->start.journal_start < journal_block || je->start.journal_start >= journal_len ||
+        je->start.journal_start % journal_block)
+    {
+        res.error("journal start %08lx is invalid", je->start.journal_start);
+        return true;
+    }
+    uint64_t pos = je->start.journal_start;
+    uint32_t crc32_last = 0;
+    bool started = false;
+    while (true)
+    {
+        if (pos + journal_block > journal_len)
+            pos = journal_block;
+        uint64_t sector_pos = pos;
+        int entries = check_journal_sector(pos, crc32_last, started);
+        if (entries <= 0)
+        {
+            pos = sector_pos;
+            break;
+        }
+        journal_entries += entries;
+        journal_sectors++;
+        if (journal_sectors*journal_block > journal_len)
+        {
+            res.error("journal never ends, the entry chain wraps around the whole journal");
+            break;
+        }
+    }
+    check_small_write_data();
+    printf(
+        "Journal: start=%08lx end=%08lx, %lu entries in %lu sectors: %lu small writes, %lu big writes,"
+        " %lu stable, %lu rollback, %lu stable_multi, %lu rollback_multi, %lu delete\n",
+        je->start.journal_start, pos, journal_entries, journal_sectors,
+        journal_type_count[JE_SMALL_WRITE] + journal_type_count[JE_SMALL_WRITE_INSTANT],
+        journal_type_count[JE_BIG_WRITE] + journal_type_count[JE_BIG_WRITE_INSTANT],
+        journal_type_count[JE_STABLE], journal_type_count[JE_ROLLBACK],
+        journal_type_count[JE_STABLE_MULTI], journal_type_count[JE_ROLLBACK_MULTI],
+        journal_type_count[JE_DELETE]
+    );
+    return true;
+}
+
+int disk_fsck_t::run()
+{
+    if (!check_meta())
+        return 1;
+    check_alloc();
+    if (journal_devices.size() && !check_journal())
+        return 1;
+    printf("%lu errors, %lu warnings\n", res.errors, res.warnings);
+    return res.errors ? 1 : 0;
+}
+
+static void help(const char *exe)
+{
+    printf(
+        "Vitastor offline disk tool\n"
+        "(c) Vitaliy Filippov, 2019+ (VNPL-1.1)\n\n"
+        "USAGE:\n"
+        "%s fsck [--threads N] [--journal_stripe_size N] <meta_file> <meta_offset> <meta_len> [<journal_file> <journal_block_size> <journal_offset> <journal_len>]\n"
+        "  Check the metadata area, the allocator state derived from it and the journal of a stopped OSD.\n"
+        "  Duplicate and stale object entries, blocks used by unflushed big writes and broken small write\n"
+        "  data are reported. Areas are read with large sequential requests in N threads (default: all CPUs).\n"
+        "  A comma-separated list of journal files checks a journal striped over them in chunks of\n"
+        "  --journal_stripe_size bytes (default: 2*block_size), <journal_len> is then the length on each device.\n"
+        "  Exits with code 1 if errors are found.\n",
+        exe
+    );
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    disk_fsck_t self;
+    std::vector<char*> args;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--threads") && i < argc-1)
+            self.threads = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--journal_stripe_size") && i < argc-1)
+            self.journal_stripe_size = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            help(argv[0]);
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() < 1 || strcmp(args[0], "fsck") != 0 || args.size() != 4 && args.size() != 8)
+    {
+        help(argv[0]);
+    }
+    if (!self.threads)
+    {
+        self.threads = std::thread::hardware_concurrency();
+        if (!self.threads)
+            self.threads = 1;
+    }
+    self.meta_device = args[1];
+    self.meta_offset = strtoull(args[2], NULL, 10);
+    self.meta_len = strtoull(args[3], NULL, 10);
+    if (args.size() == 8)
+    {
+        for (char *dev = strtok(args[4], ","); dev; dev = strtok(NULL, ","))
+            self.journal_devices.push_back(dev);
+        self.journal_block = strtoul(args[5], NULL, 10);
+        self.journal_offset = strtoull(args[6], NULL, 10);
+        self.journal_len = strtoull(args[7], NULL, 10);
+        if (self.journal_block < MEM_ALIGNMENT || (self.journal_block % MEM_ALIGNMENT) ||
+            self.journal_block > 128*1024 || self.journal_len < 2*self.journal_block)
+        {
+            printf("Invalid journal block size or length\n");
+            return 1;
+        }
+    }
+    return self.run();
+}
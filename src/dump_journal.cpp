@@ -18,6 +18,7 @@
 
 #include "blockstore_impl.h"
 #include "crc32c.h"
+#include "disk_map.h"
 
 struct journal_dump_t
 {
@@ -29,6 +30,8 @@ struct journal_dump_t
     bool all;
     bool started;
     int fd;
+    // The whole journal is mapped or read at once instead of reading it sector by sector
+    disk_map_t journal;
     uint32_t crc32_last;
 
     int dump_block(void *buf);
@@ -58,20 +61,25 @@ int main(int argc, char *argv[])
         printf("Invalid journal block size\n");
         return 1;
     }
-    self.fd = open(self.journal_device, O_DIRECT|O_RDONLY);
+    self.fd = open(self.journal_device, O_RDONLY);
     if (self.fd == -1)
     {
         printf("Failed to open journal\n");
         return 1;
     }
-    void *data = memalign(MEM_ALIGNMENT, self.journal_block);
+    if (self.journal_len < self.journal_block || !self.journal.map(self.fd, self.journal_offset, self.journal_len))
+    {
+        printf("Failed to read journal\n");
+        close(self.fd);
+        return 1;
+    }
+    void *data;
     self.journal_pos = 0;
     if (self.all)
     {
-        while (self.journal_pos < self.journal_len)
+        while (self.journal_pos + self.journal_block <= self.journal_len)
         {
-            int r = pread(self.fd, data, self.journal_block, self.journal_offset+self.journal_pos);
-            assert(r == self.journal_block);
+            data = self.journal.buf + self.journal_pos;
             uint64_t s;
             for (s = 0; s < self.journal_block; s += 8)
             {
@@ -97,10 +105,9 @@ int main(int argc, char *argv[])
     }
     else
     {
-        int r = pread(self.fd, data, self.journal_block, self.journal_offset+self.journal_pos);
-        assert(r == self.journal_block);
+        data = self.journal.buf;
         journal_entry *je = (journal_entry*)(data);
-        if (je->magic != JOURNAL_MAGIC || je->type != JE_START || je_crc32(je) != je->crc32)
+        if (je->magic != JOURNAL_MAGIC || je->type != JE_START || je->size > self.journal_block || je_crc32(je) != je->crc32)
         {
             printf("offset %08lx: journal superblock is invalid\n", self.journal_pos);
         }
@@ -112,12 +119,11 @@ int main(int argc, char *argv[])
             self.journal_pos = je->start.journal_start;
             while (1)
             {
-                if (self.journal_pos >= self.journal_len)
+                if (self.journal_pos + self.journal_block > self.journal_len)
                     self.journal_pos = self.journal_block;
-                r = pread(self.fd, data, self.journal_block, self.journal_offset+self.journal_pos);
-                assert(r == self.journal_block);
+                data = self.journal.buf + self.journal_pos;
                 printf("offset %08lx:\n", self.journal_pos);
-                r = self.dump_block(data);
+                int r = self.dump_block(data);
                 if (r <= 0)
                 {
                     printf("end of the journal\n");
@@ -126,7 +132,7 @@ int main(int argc, char *argv[])
             }
         }
     }
-    free(data);
+    self.journal.unmap();
     close(self.fd);
     return 0;
 }
@@ -141,6 +147,7 @@ int journal_dump_t::dump_block(void *buf)
     {
         journal_entry *je = (journal_entry*)(buf + pos);
         if (je->magic != JOURNAL_MAGIC || je->type < JE_MIN || je->type > JE_MAX ||
+            je->size < JE_START_LEGACY_SIZE || je->size > journal_block-pos ||
             !all && started && je->crc32_prev != crc32_last)
         {
             break;
@@ -182,15 +189,18 @@ int journal_dump_t::dump_block(void *buf)
                 journal_pos = journal_block;
                 wrapped = true;
             }
-            uint32_t data_crc32 = 0;
-            void *data = memalign(MEM_ALIGNMENT, je->small_write.len);
-            assert(pread(fd, data, je->small_write.len, journal_offset+je->small_write.data_offset) == je->small_write.len);
-            data_crc32 = crc32c(0, data, je->small_write.len);
-            free(data);
-            printf(
-                " data_crc32=%08x%s", je->small_write.crc32_data,
-                (data_crc32 != je->small_write.crc32_data) ? " (invalid)" : " (valid)"
-            );
+            if (je->small_write.data_offset + je->small_write.len > journal_len)
+            {
+                printf(" data_crc32=%08x (out of journal)", je->small_write.crc32_data);
+            }
+            else
+            {
+                uint32_t data_crc32 = crc32c(0, journal.buf + je->small_write.data_offset, je->small_write.len);
+                printf(
+                    " data_crc32=%08x%s", je->small_write.crc32_data,
+                    (data_crc32 != je->small_write.crc32_data) ? " (invalid)" : " (valid)"
+                );
+            }
             printf("\n");
         }
         else if (je->type == JE_BIG_WRITE || je->type == JE_BIG_WRITE_INSTANT)
@@ -209,6 +219,16 @@ int journal_dump_t::dump_block(void *buf)
         {
             printf("je_rollback oid=%lx:%lx ver=%lu\n", je->rollback.oid.inode, je->rollback.oid.stripe, je->rollback.version);
         }
+        else if (je->type == JE_STABLE_MULTI || je->type == JE_ROLLBACK_MULTI)
+        {
+            printf("je_%s_multi count=%u\n", je->type == JE_STABLE_MULTI ? "stable" : "rollback", je->multi.count);
+            const uint8_t *item = je->multi.data, *end = (uint8_t*)je + je->size;
+            obj_ver_id ov = { 0 };
+            for (uint32_t i = 0; i < je->multi.count && je_multi_decode(item, end, ov); i++)
+            {
+                printf("  oid=%lx:%lx ver=%lu\n", ov.oid.inode, ov.oid.stripe, ov.version);
+            }
+        }
         else if (je->type == JE_DELETE)
         {
             printf("je_delete oid=%lx:%lx ver=%lu\n", je->del.oid.inode, je->del.oid.stripe, je->del.version);
@@ -10,9 +10,12 @@
 
 #define MAX_EPOLL_EVENTS 64
 
-epoll_manager_t::epoll_manager_t(ring_loop_t *ringloop)
+epoll_manager_t::epoll_manager_t(ring_loop_t *ringloop, bool uring_poll)
 {
     this->ringloop = ringloop;
+#ifdef IORING_POLL_ADD_MULTI
+    this->uring_poll = uring_poll;
+#endif
 
     epoll_fd = epoll_create(1);
     if (epoll_fd < 0)
@@ -22,7 +25,10 @@ epoll_manager_t::epoll_manager_t(ring_loop_t *ringloop)
 
     tfd = new timerfd_manager_t([this](int fd, bool wr, std::function<void(int, int)> handler) { set_fd_handler(fd, wr, handler); });
 
-    handle_epoll_events();
+    if (!this->uring_poll)
+    {
+        handle_epoll_events();
+    }
 }
 
 epoll_manager_t::~epoll_manager_t()
@@ -37,6 +43,38 @@ epoll_manager_t::~epoll_manager_t()
 
 void epoll_manager_t::set_fd_handler(int fd, bool wr, std::function<void(int, int)> handler)
 {
+    if (uring_poll)
+    {
+        if (handler != NULL)
+        {
+            auto poll_it = uring_polls.find(fd);
+            epoll_handlers[fd] = handler;
+            if (poll_it == uring_polls.end() || poll_it->second.wr != wr)
+            {
+                // (Re)add the poll with new events
+                if (poll_it != uring_polls.end() && poll_it->second.data)
+                {
+                    cancel_uring_poll(poll_it->second.data);
+                }
+                uring_polls[fd] = (uring_poll_t){ .gen = ++poll_gen, .wr = wr, .data = NULL };
+                start_uring_poll(fd, poll_gen);
+            }
+        }
+        else
+        {
+            auto poll_it = uring_polls.find(fd);
+            if (poll_it != uring_polls.end())
+            {
+                if (poll_it->second.data)
+                {
+                    cancel_uring_poll(poll_it->second.data);
+                }
+                uring_polls.erase(poll_it);
+            }
+            epoll_handlers.erase(fd);
+        }
+        return;
+    }
     if (handler != NULL)
     {
         bool exists = epoll_handlers.find(fd) != epoll_handlers.end();
@@ -93,3 +131,111 @@ void epoll_manager_t::handle_epoll_events()
         }
     } while (nfds == MAX_EPOLL_EVENTS);
 }
+
+void epoll_manager_t::start_uring_poll(int fd, uint64_t gen)
+{
+#ifdef IORING_POLL_ADD_MULTI
+    io_uring_sqe *sqe = ringloop->get_sqe();
+    if (!sqe)
+    {
+        ringloop->wait_sqe([this, fd, gen]()
+        {
+            auto poll_it = uring_polls.find(fd);
+            if (poll_it != uring_polls.end() && poll_it->second.gen == gen && !poll_it->second.data)
+                start_uring_poll(fd, gen);
+        });
+        return;
+    }
+    auto & poll = uring_polls.at(fd);
+    ring_data_t *data = ((ring_data_t*)sqe->user_data);
+    poll.data = data;
+    // Edge-triggered like the epoll mode
+    my_uring_prep_poll_multishot(sqe, fd, (poll.wr ? EPOLLOUT : 0) | EPOLLIN | EPOLLRDHUP | EPOLLET);
+    data->callback = [this, fd, gen](ring_data_t *data)
+    {
+        handle_uring_poll(fd, gen, data->res, data->more);
+    };
+    ringloop->wakeup();
+#endif
+}
+
+void epoll_manager_t::cancel_uring_poll(ring_data_t *poll_data)
+{
+    io_uring_sqe *sqe = ringloop->get_sqe();
+    if (!sqe)
+    {
+        ringloop->wait_sqe([this, poll_data]() { cancel_uring_poll(poll_data); });
+        return;
+    }
+    ring_data_t *data = ((ring_data_t*)sqe->user_data);
+    // The poll itself then completes with -ECANCELED and is ignored
+    my_uring_prep_poll_remove(sqe, poll_data);
+    data->callback = [](ring_data_t *data) {};
+    ringloop->wakeup();
+}
+
+void epoll_manager_t::handle_uring_poll(int fd, uint64_t gen, int res, bool more)
+{
+    auto poll_it = uring_polls.find(fd);
+    if (poll_it == uring_polls.end() || poll_it->second.gen != gen)
+    {
+        // Removed or re-added
+        return;
+    }
+    if (!more)
+    {
+        poll_it->second.data = NULL;
+    }
+    if (res == -EINVAL)
+    {
+        // Multishot poll isn't supported by the kernel
+        fprintf(stderr, "io_uring multishot poll is not supported (Linux 5.13+ required), falling back to epoll\n");
+        fallback_to_epoll();
+        return;
+    }
+    bool failed = res < 0;
+    if (failed && res != -ECANCELED)
+    {
+        // Let the owner find out what's wrong, like with EPOLLERR
+        res = EPOLLERR;
+    }
+    if (res > 0)
+    {
+        auto cb_it = epoll_handlers.find(fd);
+        if (cb_it != epoll_handlers.end())
+        {
+            auto & cb = cb_it->second;
+            cb(fd, res);
+        }
+    }
+    if (!more && !failed)
+    {
+        // Poll was terminated by the kernel, i.e. on CQ overflow, re-add it if the fd is still polled
+        poll_it = uring_polls.find(fd);
+        if (poll_it != uring_polls.end() && poll_it->second.gen == gen && !poll_it->second.data)
+        {
+            start_uring_poll(fd, gen);
+        }
+    }
+}
+
+void epoll_manager_t::fallback_to_epoll()
+{
+    uring_poll = false;
+    for (auto & pp: uring_polls)
+    {
+        if (pp.second.data)
+        {
+            cancel_uring_poll(pp.second.data);
+        }
+        epoll_event ev;
+        ev.data.fd = pp.first;
+        ev.events = (pp.second.wr ? EPOLLOUT : 0) | EPOLLIN | EPOLLRDHUP | EPOLLET;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pp.first, &ev) < 0)
+        {
+            throw std::runtime_error(std::string("epoll_ctl: ") + strerror(errno));
+        }
+    }
+    uring_polls.clear();
+    handle_epoll_events();
+}
@@ -13,8 +13,27 @@ class epoll_manager_t
     int epoll_fd;
     ring_loop_t *ringloop;
     std::map<int, std::function<void(int, int)>> epoll_handlers;
+
+    // io_uring mode: every fd is polled with its own multishot IORING_OP_POLL_ADD
+    // instead of one epoll fd polled through the ring
+    struct uring_poll_t
+    {
+        // Changes when the poll is re-added, stale completions are ignored
+        uint64_t gen;
+        bool wr;
+        // Active poll request, NULL if it's not submitted yet or finished
+        ring_data_t *data;
+    };
+    bool uring_poll = false;
+    uint64_t poll_gen = 0;
+    std::map<int, uring_poll_t> uring_polls;
+
+    void start_uring_poll(int fd, uint64_t gen);
+    void cancel_uring_poll(ring_data_t *data);
+    void handle_uring_poll(int fd, uint64_t gen, int res, bool more);
+    void fallback_to_epoll();
 public:
-    epoll_manager_t(ring_loop_t *ringloop);
+    epoll_manager_t(ring_loop_t *ringloop, bool uring_poll = false);
     ~epoll_manager_t();
     void set_fd_handler(int fd, bool wr, std::function<void(int, int)> handler);
     void handle_epoll_events();
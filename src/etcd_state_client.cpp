@@ -1,6 +1,8 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
+#include <algorithm>
+#include <set>
 #include "osd_ops.h"
 #include "pg_states.h"
 #include "etcd_state_client.h"
@@ -23,6 +25,11 @@ etcd_state_client_t::~etcd_state_client_t()
         etcd_watch_ws->close();
         etcd_watch_ws = NULL;
     }
+    if (etcd_http_pool)
+    {
+        http_pool_destroy(etcd_http_pool);
+        etcd_http_pool = NULL;
+    }
 #endif
 }
 
@@ -68,9 +75,14 @@ void etcd_state_client_t::etcd_call(std::string api, json11::Json payload, int t
         "Host: "+etcd_address+"\r\n"
         "Content-Type: application/json\r\n"
         "Content-Length: "+std::to_string(req.size())+"\r\n"
-        "Connection: close\r\n"
+        "Connection: keep-alive\r\n"
         "\r\n"+req;
-    http_request_json(tfd, etcd_address, req, timeout, callback);
+    if (!etcd_http_pool)
+    {
+        // Reuse connections instead of opening a new one for every request
+        etcd_http_pool = http_pool_create(tfd);
+    }
+    http_request_json(tfd, etcd_address, req, timeout, callback, etcd_http_pool);
 }
 
 void etcd_state_client_t::add_etcd_url(std::string addr)
@@ -179,6 +191,13 @@ void etcd_state_client_t::start_etcd_watcher()
                     }
                     parse_state(kv.second);
                 }
+                if (on_mirror_state_hook != NULL && changes.size() > 0)
+                {
+                    std::vector<etcd_kv_t> kvs;
+                    for (auto & kv: changes)
+                        kvs.push_back(kv.second);
+                    on_mirror_state_hook(kvs, false);
+                }
                 // React to changes
                 if (on_change_hook != NULL)
                 {
@@ -244,6 +263,10 @@ void etcd_state_client_t::start_etcd_watcher()
 
 void etcd_state_client_t::load_global_config()
 {
+    if (mirror_mode)
+    {
+        return;
+    }
     etcd_call("/kv/range", json11::Json::object {
         { "key", base64_encode(etcd_prefix+"/config/global") }
     }, ETCD_SLOW_TIMEOUT, [this](std::string err, json11::Json data)
@@ -271,12 +294,20 @@ void etcd_state_client_t::load_global_config()
         {
             bs_block_size = DEFAULT_BLOCK_SIZE;
         }
+        if (on_mirror_config_hook != NULL)
+        {
+            on_mirror_config_hook(global_config);
+        }
         on_load_config_hook(global_config);
     });
 }
 
 void etcd_state_client_t::load_pgs()
 {
+    if (mirror_mode)
+    {
+        return;
+    }
     json11::Json::array txn = {
         json11::Json::object {
             { "request_range", json11::Json::object {
@@ -339,14 +370,21 @@ void etcd_state_client_t::load_pgs()
         {
             etcd_watch_revision = data["header"]["revision"].uint64_value();
         }
+        std::vector<etcd_kv_t> kvs;
         for (auto & res: data["responses"].array_items())
         {
             for (auto & kv_json: res["response_range"]["kvs"].array_items())
             {
                 auto kv = parse_etcd_kv(kv_json);
                 parse_state(kv);
+                if (on_mirror_state_hook != NULL)
+                    kvs.push_back(kv);
             }
         }
+        if (on_mirror_state_hook != NULL)
+        {
+            on_mirror_state_hook(kvs, true);
+        }
         on_load_pgs_hook(true);
         start_etcd_watcher();
     });
@@ -367,6 +405,41 @@ void etcd_state_client_t::load_pgs()
 }
 #endif
 
+void etcd_state_client_t::apply_mirror_config(json11::Json::object global_config)
+{
+    bs_block_size = global_config["block_size"].uint64_value();
+    if (!bs_block_size)
+    {
+        bs_block_size = DEFAULT_BLOCK_SIZE;
+    }
+    if (on_mirror_config_hook != NULL)
+    {
+        on_mirror_config_hook(global_config);
+    }
+    on_load_config_hook(global_config);
+}
+
+// <loaded> means that <kvs> is the full state loaded from etcd, otherwise it's a batch of changes
+void etcd_state_client_t::apply_mirror_state(const std::vector<etcd_kv_t> & kvs, bool loaded)
+{
+    std::map<std::string, etcd_kv_t> changes;
+    for (auto & kv: kvs)
+    {
+        parse_state(kv);
+        if (!loaded)
+            changes[kv.key] = kv;
+    }
+    // Mirrored state may be mirrored further
+    if (on_mirror_state_hook != NULL)
+    {
+        on_mirror_state_hook(kvs, loaded);
+    }
+    if (loaded)
+        on_load_pgs_hook(true);
+    else if (on_change_hook != NULL)
+        on_change_hook(changes);
+}
+
 void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
 {
     const std::string & key = kv.key;
@@ -468,6 +541,15 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
             uint64_t min_stripe_size = bs_block_size * (pc.scheme == POOL_SCHEME_REPLICATED ? 1 : (pc.pg_size-pc.parity_chunks));
             if (pc.pg_stripe_size < min_stripe_size)
                 pc.pg_stripe_size = min_stripe_size;
+            // Compression
+            pc.compression = pool_item.second["compression"].string_value();
+            if (pc.compression == "none")
+                pc.compression = "";
+            else if (pc.compression != "" && pc.compression != "lz4" && pc.compression != "zstd")
+            {
+                fprintf(stderr, "Pool %u has invalid compression (must be one of \"none\", \"lz4\" or \"zstd\"), data won't be compressed\n", pool_id);
+                pc.compression = "";
+            }
             // Save
             pc.real_pg_count = this->pool_config[pool_id].real_pg_count;
             std::swap(pc.pg_config, this->pool_config[pool_id].pg_config);
@@ -583,6 +665,8 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
             {
                 pg_cfg.all_peers.push_back(pg_osd.uint64_value());
             }
+            // Histories written by older versions may have duplicate or redundant sets
+            compact_pg_history(pg_cfg.target_history, pg_cfg.all_peers, std::vector<osd_num_t>());
             // Read epoch
             pg_cfg.epoch = value["epoch"].uint64_value();
             if (on_change_pg_history_hook != NULL)
@@ -680,7 +764,7 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
             if (it != this->inode_config.end() && it->second.name != "")
             {
                 auto n_it = this->inode_by_name.find(it->second.name);
-                if (n_it->second == inode_num)
+                if (n_it != this->inode_by_name.end() && n_it->second == inode_num)
                 {
                     this->inode_by_name.erase(n_it);
                     for (auto w: watches)
@@ -722,6 +806,8 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
                     .parent_id = parent_inode_num,
                     .readonly = value["readonly"].bool_value(),
                     .mod_revision = kv.mod_revision,
+                    .iops_limit = value["iops_limit"].uint64_value(),
+                    .bandwidth_limit = value["bandwidth_limit"].uint64_value(),
                 };
                 this->inode_config[inode_num] = cfg;
                 if (cfg.name != "")
@@ -782,5 +868,67 @@ json11::Json::object & etcd_state_client_t::serialize_inode_cfg(inode_config_t *
     {
         new_cfg["readonly"] = true;
     }
+    if (cfg->iops_limit)
+    {
+        new_cfg["iops_limit"] = cfg->iops_limit;
+    }
+    if (cfg->bandwidth_limit)
+    {
+        new_cfg["bandwidth_limit"] = cfg->bandwidth_limit;
+    }
     return new_cfg;
 }
+
+void compact_pg_history(std::vector<std::vector<osd_num_t>> & target_history, std::vector<osd_num_t> & all_peers,
+    const std::vector<osd_num_t> & target_set)
+{
+    std::set<osd_num_t> peers(all_peers.begin(), all_peers.end());
+    std::vector<std::vector<osd_num_t>> sets;
+    for (auto & hist_item: target_history)
+    {
+        std::vector<osd_num_t> hist_set;
+        for (auto pg_osd: hist_item)
+        {
+            if (pg_osd != 0)
+                hist_set.push_back(pg_osd);
+        }
+        // A set without OSDs never blocks peering
+        if (hist_set.size())
+        {
+            std::sort(hist_set.begin(), hist_set.end());
+            hist_set.erase(std::unique(hist_set.begin(), hist_set.end()), hist_set.end());
+            sets.push_back(hist_set);
+        }
+    }
+    // Smaller sets first so that each set only has to be compared with the already kept ones
+    std::sort(sets.begin(), sets.end(), [](const std::vector<osd_num_t> & a, const std::vector<osd_num_t> & b)
+    {
+        return a.size() < b.size() || a.size() == b.size() && a < b;
+    });
+    target_history.clear();
+    for (auto & hist_set: sets)
+    {
+        bool redundant = false;
+        for (auto & kept: target_history)
+        {
+            if (std::includes(hist_set.begin(), hist_set.end(), kept.begin(), kept.end()))
+            {
+                redundant = true;
+                break;
+            }
+        }
+        if (redundant)
+            peers.insert(hist_set.begin(), hist_set.end());
+        else
+            target_history.push_back(hist_set);
+    }
+    for (auto & hist_set: target_history)
+    {
+        for (auto pg_osd: hist_set)
+            peers.erase(pg_osd);
+    }
+    for (auto pg_osd: target_set)
+        peers.erase(pg_osd);
+    peers.erase(0);
+    all_peers.assign(peers.begin(), peers.end());
+}
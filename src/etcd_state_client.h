@@ -50,6 +50,8 @@ struct pool_config_t
     std::string failure_domain;
     uint64_t max_osd_combinations;
     uint64_t pg_stripe_size;
+    // Data compression algorithm: "lz4", "zstd" or empty (none)
+    std::string compression;
     std::map<pg_num_t, pg_config_t> pg_config;
 };
 
@@ -62,6 +64,8 @@ struct inode_config_t
     bool readonly;
     // Change revision of the metadata in etcd
     uint64_t mod_revision;
+    // QoS limits, 0 = unlimited
+    uint64_t iops_limit, bandwidth_limit;
 };
 
 struct inode_watch_t
@@ -71,12 +75,22 @@ struct inode_watch_t
 };
 
 struct websocket_t;
+struct http_pool_t;
+
+// Reduce PG history to the minimal form which gives the same peering result: a PG only
+// starts when every history set has a live OSD, so sets are stored as sorted lists of
+// non-zero OSDs, and sets containing another set are dropped with their OSDs moved to
+// <all_peers>. OSDs already listed in sets or in <target_set> are removed from <all_peers>
+void compact_pg_history(std::vector<std::vector<osd_num_t>> & target_history, std::vector<osd_num_t> & all_peers,
+    const std::vector<osd_num_t> & target_set);
 
 struct etcd_state_client_t
 {
 protected:
     std::vector<inode_watch_t*> watches;
     websocket_t *etcd_watch_ws = NULL;
+    // keep-alive connections for etcd_call()
+    http_pool_t *etcd_http_pool = NULL;
     uint64_t bs_block_size = DEFAULT_BLOCK_SIZE;
     void add_etcd_url(std::string);
 public:
@@ -99,6 +113,12 @@ public:
     std::function<void(pool_id_t, pg_num_t)> on_change_pg_history_hook;
     std::function<void(osd_num_t)> on_change_osd_state_hook;
 
+    // Mirror mode: don't talk to etcd and receive the state of another client with apply_mirror_*()
+    bool mirror_mode = false;
+    // Called with the loaded global config and with each batch of loaded or changed keys, to mirror them
+    std::function<void(const json11::Json::object &)> on_mirror_config_hook;
+    std::function<void(const std::vector<etcd_kv_t> &, bool)> on_mirror_state_hook;
+
     json11::Json::object & serialize_inode_cfg(inode_config_t *cfg);
     etcd_kv_t parse_etcd_kv(const json11::Json & kv_json);
     void etcd_call(std::string api, json11::Json payload, int timeout, std::function<void(std::string, json11::Json)> callback);
@@ -108,6 +128,8 @@ public:
     void load_pgs();
     void parse_state(const etcd_kv_t & kv);
     void parse_config(const json11::Json & config);
+    void apply_mirror_config(json11::Json::object global_config);
+    void apply_mirror_state(const std::vector<etcd_kv_t> & kvs, bool loaded);
     inode_watch_t* watch_inode(std::string name);
     void close_watch(inode_watch_t* watch);
     ~etcd_state_client_t();
@@ -17,6 +17,8 @@
 //
 // fio -thread -ioengine=./libfio_cluster.so -name=test -bs=4k -direct=1 -iodepth=32 -rw=randread \
 //     -etcd=127.0.0.1:2379 [-etcd_prefix=/vitastor] -image=testimg
+//
+// Add -client_threads=N to handle OSD connections in N worker threads when one core isn't enough
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -33,6 +35,8 @@ struct sec_data
     vitastor_c *cli = NULL;
     void *watch = NULL;
     bool last_sync = false;
+    /* The list of queued, but not yet submitted io_u structs. */
+    std::vector<io_u*> queued;
     /* The list of completed io_u structs. */
     std::vector<io_u*> completed;
     uint64_t inflight = 0;
@@ -55,6 +59,7 @@ struct sec_options
     int rdma_port_num = 0;
     int rdma_gid_index = 0;
     int rdma_mtu = 0;
+    int client_threads = 0;
 };
 
 static struct fio_option options[] = {
@@ -181,6 +186,16 @@ static struct fio_option options[] = {
         .category = FIO_OPT_C_ENGINE,
         .group  = FIO_OPT_G_FILENAME,
     },
+    {
+        .name   = "client_threads",
+        .lname  = "Client worker threads",
+        .type   = FIO_OPT_INT,
+        .off1   = offsetof(struct sec_options, client_threads),
+        .help   = "Handle OSD connections in this number of worker threads (0 = in the fio thread)",
+        .def    = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group  = FIO_OPT_G_FILENAME,
+    },
     {
         .name = NULL,
     },
@@ -233,8 +248,8 @@ static int sec_setup(struct thread_data *td)
     {
         o->inode = 0;
     }
-    bsd->cli = vitastor_c_create_uring(o->config_path, o->etcd_host, o->etcd_prefix,
-        o->use_rdma, o->rdma_device, o->rdma_port_num, o->rdma_gid_index, o->rdma_mtu, o->cluster_log);
+    bsd->cli = vitastor_c_create_uring_threads(o->config_path, o->etcd_host, o->etcd_prefix,
+        o->use_rdma, o->rdma_device, o->rdma_port_num, o->rdma_gid_index, o->rdma_mtu, o->cluster_log, o->client_threads);
     if (o->image)
     {
         bsd->watch = NULL;
@@ -298,7 +313,6 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
 {
     sec_options *opt = (sec_options*)td->eo;
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    struct iovec iov;
 
     fio_ro_check(td, io);
     if (io->ddir == DDIR_SYNC && bsd->last_sync)
@@ -310,12 +324,9 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
     io->error = 0;
     bsd->inflight++;
 
-    uint64_t inode = opt->image ? vitastor_c_inode_get_num(bsd->watch) : opt->inode;
     switch (io->ddir)
     {
     case DDIR_READ:
-        iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        vitastor_c_read(bsd->cli, inode, io->offset, io->xfer_buflen, &iov, 1, read_callback, io);
         bsd->last_sync = false;
         break;
     case DDIR_WRITE:
@@ -324,18 +335,17 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
             io->error = EROFS;
             return FIO_Q_COMPLETED;
         }
-        iov = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        vitastor_c_write(bsd->cli, inode, io->offset, io->xfer_buflen, 0, &iov, 1, io_callback, io);
         bsd->last_sync = false;
         break;
     case DDIR_SYNC:
-        vitastor_c_sync(bsd->cli, io_callback, io);
         bsd->last_sync = true;
         break;
     default:
         io->error = EINVAL;
         return FIO_Q_COMPLETED;
     }
+    /* Operations are submitted to Vitastor together in sec_commit(). */
+    bsd->queued.push_back(io);
 
     if (opt->trace)
     {
@@ -356,6 +366,37 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
     return FIO_Q_QUEUED;
 }
 
+static int sec_commit(struct thread_data *td)
+{
+    sec_options *opt = (sec_options*)td->eo;
+    sec_data *bsd = (sec_data*)td->io_ops_data;
+    if (!bsd->queued.size())
+        return 0;
+    uint64_t inode = opt->image ? vitastor_c_inode_get_num(bsd->watch) : opt->inode;
+    std::vector<iovec> iovs(bsd->queued.size());
+    std::vector<vitastor_c_op> ops(bsd->queued.size());
+    for (int i = 0; i < bsd->queued.size(); i++)
+    {
+        io_u *io = bsd->queued[i];
+        iovs[i] = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
+        ops[i] = {
+            .opcode = io->ddir == DDIR_READ ? VITASTOR_C_OP_READ :
+                (io->ddir == DDIR_WRITE ? VITASTOR_C_OP_WRITE : VITASTOR_C_OP_SYNC),
+            .inode = inode,
+            .offset = io->offset,
+            .len = io->xfer_buflen,
+            .version = 0,
+            .iov = &iovs[i],
+            .iovcnt = 1,
+            .cb = read_callback,
+            .opaque = io,
+        };
+    }
+    bsd->queued.clear();
+    vitastor_c_submit_batch(bsd->cli, ops.data(), ops.size());
+    return 0;
+}
+
 static int sec_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
 {
     sec_data *bsd = (sec_data*)td->io_ops_data;
@@ -407,6 +448,7 @@ struct ioengine_ops ioengine = {
     .setup              = sec_setup,
     .init               = sec_init,
     .queue              = sec_queue,
+    .commit             = sec_commit,
     .getevents          = sec_getevents,
     .event              = sec_event,
     .cleanup            = sec_cleanup,
@@ -19,10 +19,29 @@
 // fio -thread -ioengine=./libfio_blockstore.so -name=test -bs=128k -direct=1 -fsync=32 -iodepth=32 -rw=write \
 //     -bs_config='{"data_device":"./test_data.bin"}' -size=1000M
 //
+// Journal commit latency, write + fsync vs write-through (FUA) journal writes:
+//
+// fio -thread -ioengine=./libfio_blockstore.so -name=test -bs=4k -direct=1 -fsync=1 -iodepth=1 -rw=randwrite \
+//     -bs_config='{"data_device":"/dev/nvme0n1p2","journal_fua":"false"}' -size=1000M
+// fio -thread -ioengine=./libfio_blockstore.so -name=test -bs=4k -direct=1 -fsync=1 -iodepth=1 -rw=randwrite \
+//     -bs_config='{"data_device":"/dev/nvme0n1p2","journal_fua":"auto"}' -size=1000M
+//
 // Random read (run with -iodepth=32 or -iodepth=1):
 //
 // fio -thread -ioengine=./libfio_blockstore.so -name=test -bs=4k -direct=1 -iodepth=32 -rw=randread \
 //     -bs_config='{"data_device":"./test_data.bin"}' -size=1000M
+//
+// Several jobs driving one blockstore (use different -offset's for writes):
+//
+// fio -thread -ioengine=./libfio_blockstore.so -name=test -bs=4k -direct=1 -iodepth=32 -rw=randread \
+//     -bs_config='{"data_device":"./test_data.bin"}' -bs_shared=1 -numjobs=4 -size=1000M
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "blockstore.h"
 #include "epoll_manager.h"
@@ -30,13 +49,40 @@
 
 #include "json11/json11.hpp"
 
+// Blockstore shared by all jobs with the same bs_config (-bs_shared=1). It runs in its own thread,
+// jobs pass operations to it through a queue and an eventfd
+struct bs_shared_t
+{
+    std::string key;
+    int refs = 0;
+    std::thread thread;
+    int efd = -1;
+    std::mutex mu;
+    std::vector<blockstore_op_t*> submitted;
+    bool stop = false;
+    std::condition_variable started_cv;
+    bool started = false;
+    std::string error;
+    blockstore_t *bs = NULL;
+};
+
+static std::mutex bs_shared_mu;
+static std::map<std::string, bs_shared_t*> bs_shared;
+
 struct bs_data
 {
     blockstore_t *bs;
     epoll_manager_t *epmgr;
     ring_loop_t *ringloop;
+    bs_shared_t *shared = NULL;
+    /* Operations queued for the shared blockstore until bs_commit(). */
+    std::vector<blockstore_op_t*> queued;
     /* The list of completed io_u structs. */
     std::vector<io_u*> completed;
+    /* Completions from the shared blockstore thread, moved to <completed> by bs_getevents(). */
+    std::mutex done_mu;
+    std::condition_variable done_cv;
+    std::vector<io_u*> done;
     int op_n = 0, inflight = 0;
     bool last_sync = false;
 };
@@ -45,6 +91,7 @@ struct bs_options
 {
     int __pad;
     char *json_config = NULL;
+    int shared = 0;
 };
 
 static struct fio_option options[] = {
@@ -57,6 +104,16 @@ static struct fio_option options[] = {
         .category = FIO_OPT_C_ENGINE,
         .group  = FIO_OPT_G_FILENAME,
     },
+    {
+        .name   = "bs_shared",
+        .lname  = "Share Blockstore between jobs",
+        .type   = FIO_OPT_BOOL,
+        .off1   = offsetof(struct bs_options, shared),
+        .help   = "Run one Blockstore in a separate thread for all jobs with the same bs_config",
+        .def    = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group  = FIO_OPT_G_FILENAME,
+    },
     {
         .name = NULL,
     },
@@ -89,10 +146,100 @@ static int bs_setup(struct thread_data *td)
     return 0;
 }
 
+static void bs_shared_loop(bs_shared_t *sh, blockstore_config_t config)
+{
+    ring_loop_config_t ring_cfg;
+    ring_cfg.big_sqe = config["nvme_passthrough"] == "true" || config["nvme_passthrough"] == "1" || config["nvme_passthrough"] == "yes";
+    ring_loop_t *ringloop = new ring_loop_t(512, ring_cfg);
+    epoll_manager_t *epmgr = new epoll_manager_t(ringloop);
+    blockstore_t *bs = NULL;
+    try
+    {
+        bs = new blockstore_t(config, ringloop, epmgr->tfd);
+        while (1)
+        {
+            ringloop->loop();
+            if (bs->is_started())
+                break;
+            ringloop->wait();
+        }
+    }
+    catch (std::exception & e)
+    {
+        std::lock_guard<std::mutex> lock(sh->mu);
+        sh->error = e.what();
+        sh->started = true;
+        sh->started_cv.notify_all();
+        delete epmgr;
+        delete ringloop;
+        return;
+    }
+    bool stopping = false;
+    epmgr->set_fd_handler(sh->efd, false, [&](int fd, int events)
+    {
+        // Reset the eventfd before taking operations so that later submissions wake us up again
+        uint64_t count;
+        read(sh->efd, &count, sizeof(count));
+        std::vector<blockstore_op_t*> ops;
+        {
+            std::lock_guard<std::mutex> lock(sh->mu);
+            ops.swap(sh->submitted);
+            stopping = sh->stop;
+        }
+        for (auto op: ops)
+        {
+            bs->enqueue_op(op);
+        }
+        ringloop->wakeup();
+    });
+    {
+        std::lock_guard<std::mutex> lock(sh->mu);
+        sh->bs = bs;
+        sh->started = true;
+        sh->started_cv.notify_all();
+    }
+    while (1)
+    {
+        ringloop->loop();
+        if (stopping && bs->is_safe_to_stop())
+            break;
+        if (!ringloop->has_work())
+            ringloop->wait();
+    }
+    epmgr->set_fd_handler(sh->efd, false, NULL);
+    delete bs;
+    delete epmgr;
+    delete ringloop;
+}
+
+static void bs_shared_post(bs_shared_t *sh)
+{
+    uint64_t one = 1;
+    write(sh->efd, &one, sizeof(one));
+}
+
 static void bs_cleanup(struct thread_data *td)
 {
     bs_data *bsd = (bs_data*)td->io_ops_data;
-    if (bsd)
+    if (bsd && bsd->shared)
+    {
+        std::lock_guard<std::mutex> lock(bs_shared_mu);
+        bs_shared_t *sh = bsd->shared;
+        if (!--sh->refs)
+        {
+            {
+                std::lock_guard<std::mutex> lock(sh->mu);
+                sh->stop = true;
+            }
+            bs_shared_post(sh);
+            sh->thread.join();
+            close(sh->efd);
+            bs_shared.erase(sh->key);
+            delete sh;
+        }
+        delete bsd;
+    }
+    else if (bsd)
     {
         while (1)
         {
@@ -131,7 +278,40 @@ static int bs_init(struct thread_data *td)
                 config[p.first] = p.second.dump();
         }
     }
-    bsd->ringloop = new ring_loop_t(512);
+    if (o->shared)
+    {
+        std::lock_guard<std::mutex> lock(bs_shared_mu);
+        std::string key = o->json_config ? o->json_config : "";
+        bs_shared_t *sh = bs_shared[key];
+        if (!sh)
+        {
+            sh = bs_shared[key] = new bs_shared_t;
+            sh->key = key;
+            sh->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+            if (sh->efd < 0)
+            {
+                td_verror(td, errno, "eventfd");
+                bs_shared.erase(key);
+                delete sh;
+                return 1;
+            }
+            sh->thread = std::thread(bs_shared_loop, sh, config);
+        }
+        sh->refs++;
+        bsd->shared = sh;
+        std::unique_lock<std::mutex> started_lock(sh->mu);
+        sh->started_cv.wait(started_lock, [sh]() { return sh->started; });
+        if (sh->error != "")
+        {
+            log_err("fio: blockstore initialization failed: %s\n", sh->error.c_str());
+            return 1;
+        }
+        bsd->bs = sh->bs;
+        return 0;
+    }
+    ring_loop_config_t ring_cfg;
+    ring_cfg.big_sqe = config["nvme_passthrough"] == "true" || config["nvme_passthrough"] == "1" || config["nvme_passthrough"] == "yes";
+    bsd->ringloop = new ring_loop_t(512, ring_cfg);
     bsd->epmgr = new epoll_manager_t(bsd->ringloop);
     bsd->bs = new blockstore_t(config, bsd->ringloop, bsd->epmgr->tfd);
     while (1)
@@ -146,6 +326,20 @@ static int bs_init(struct thread_data *td)
     return 0;
 }
 
+/* Called in the blockstore thread, which is a separate thread with -bs_shared=1. */
+static void bs_complete(bs_data *bsd, io_u *io)
+{
+    if (!bsd->shared)
+    {
+        bsd->inflight--;
+        bsd->completed.push_back(io);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(bsd->done_mu);
+    bsd->done.push_back(io);
+    bsd->done_cv.notify_one();
+}
+
 /* Begin read or write request. */
 static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
 {
@@ -165,6 +359,7 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
 
     blockstore_op_t *op = new blockstore_op_t;
     op->callback = NULL;
+    op->priority = BS_PRIO_CLIENT;
 
     switch (io->ddir)
     {
@@ -181,9 +376,7 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
         op->callback = [io, n](blockstore_op_t *op)
         {
             io->error = op->retval < 0 ? -op->retval : 0;
-            bs_data *bsd = (bs_data*)io->engine_data;
-            bsd->inflight--;
-            bsd->completed.push_back(io);
+            bs_complete((bs_data*)io->engine_data, io);
 #ifdef BLOCKSTORE_DEBUG
             printf("--- OP_READ %llx n=%d retval=%d\n", io, n, op->retval);
 #endif
@@ -203,9 +396,7 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
         op->callback = [io, n](blockstore_op_t *op)
         {
             io->error = op->retval < 0 ? -op->retval : 0;
-            bs_data *bsd = (bs_data*)io->engine_data;
-            bsd->inflight--;
-            bsd->completed.push_back(io);
+            bs_complete((bs_data*)io->engine_data, io);
 #ifdef BLOCKSTORE_DEBUG
             printf("--- OP_WRITE %llx n=%d retval=%d\n", io, n, op->retval);
 #endif
@@ -217,10 +408,8 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
         op->opcode = BS_OP_SYNC_STAB_ALL;
         op->callback = [io, n](blockstore_op_t *op)
         {
-            bs_data *bsd = (bs_data*)io->engine_data;
             io->error = op->retval < 0 ? -op->retval : 0;
-            bsd->completed.push_back(io);
-            bsd->inflight--;
+            bs_complete((bs_data*)io->engine_data, io);
 #ifdef BLOCKSTORE_DEBUG
             printf("--- OP_SYNC %llx n=%d retval=%d\n", io, n, op->retval);
 #endif
@@ -238,7 +427,15 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
 #endif
     io->error = 0;
     bsd->inflight++;
-    bsd->bs->enqueue_op(op);
+    if (bsd->shared)
+    {
+        /* Operations are passed to the shared blockstore together in bs_commit(). */
+        bsd->queued.push_back(op);
+    }
+    else
+    {
+        bsd->bs->enqueue_op(op);
+    }
     bsd->op_n++;
 
     if (io->error != 0)
@@ -246,9 +443,32 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
     return FIO_Q_QUEUED;
 }
 
+static int bs_commit(struct thread_data *td)
+{
+    bs_data *bsd = (bs_data*)td->io_ops_data;
+    if (!bsd->queued.size())
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(bsd->shared->mu);
+        bsd->shared->submitted.insert(bsd->shared->submitted.end(), bsd->queued.begin(), bsd->queued.end());
+    }
+    bsd->queued.clear();
+    bs_shared_post(bsd->shared);
+    return 0;
+}
+
 static int bs_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
 {
     bs_data *bsd = (bs_data*)td->io_ops_data;
+    if (bsd->shared)
+    {
+        std::unique_lock<std::mutex> lock(bsd->done_mu);
+        bsd->done_cv.wait(lock, [&]() { return bsd->completed.size() + bsd->done.size() >= min; });
+        bsd->inflight -= bsd->done.size();
+        bsd->completed.insert(bsd->completed.end(), bsd->done.begin(), bsd->done.end());
+        bsd->done.clear();
+        return bsd->completed.size();
+    }
     // FIXME timeout
     while (true)
     {
@@ -298,6 +518,7 @@ struct ioengine_ops ioengine = {
     .setup              = bs_setup,
     .init               = bs_init,
     .queue              = bs_queue,
+    .commit             = bs_commit,
     .getevents          = bs_getevents,
     .event              = bs_event,
     .cleanup            = bs_cleanup,
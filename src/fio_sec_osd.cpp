@@ -8,7 +8,7 @@
 // Random write:
 //
 // fio -thread -ioengine=./libfio_sec_osd.so -name=test -bs=4k -direct=1 -fsync=16 -iodepth=16 -rw=randwrite \
-//     -host=127.0.0.1 -port=11203 [-block_size_order=17] [-single_primary=1] -size=1000M
+//     -host=127.0.0.1 -port=11203 [-osd_num=1] [-single_primary=1] -size=1000M
 //
 // Linear write:
 //
@@ -19,29 +19,41 @@
 //
 // fio -thread -ioengine=./libfio_sec_osd.so -name=test -bs=4k -direct=1 -iodepth=32 -rw=randread \
 //     -host=127.0.0.1 -port=11203 -size=1000M
+//
+// Each job has its own event loop and connection, so use -numjobs to load the OSD from several threads.
+// Block size is taken from the OSD, -block_size_order is only used if the OSD doesn't report it
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <time.h>
 
 #include <vector>
-#include <unordered_map>
 
-#include "rw_blocking.h"
+#include "epoll_manager.h"
+#include "messenger.h"
 #include "osd_ops.h"
 #include "fio_headers.h"
 
+#define SEC_CONNECT_TIMEOUT 10
+
 struct sec_data
 {
-    int connect_fd;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    osd_messenger_t *msgr = NULL;
+    ring_consumer_t consumer;
+    osd_num_t osd_num = 0;
+    int peer_fd = -1;
     /* block_size = 1 << block_order (128KB by default) */
     uint64_t block_order = 17, block_size = 1 << 17;
-    std::unordered_map<uint64_t, io_u*> queue;
+    /* Read bitmaps aren't checked, so they're all read into one buffer */
+    void *bitmap_buf = NULL;
+    uint32_t bitmap_len = 0;
     bool last_sync = false;
+    bool trace = false;
+    /* Operations queued by fio, but not yet sent. */
+    std::vector<osd_op_t*> queued;
     /* The list of completed io_u structs. */
     std::vector<io_u*> completed;
-    uint64_t op_n = 0, inflight = 0;
+    uint64_t inflight = 0;
 };
 
 struct sec_options
@@ -49,6 +61,7 @@ struct sec_options
     int __pad;
     char *host = NULL;
     int port = 0;
+    int osd_num = 0;
     int single_primary = 0;
     int trace = 0;
     int block_order = 17;
@@ -73,12 +86,22 @@ static struct fio_option options[] = {
         .category = FIO_OPT_C_ENGINE,
         .group  = FIO_OPT_G_FILENAME,
     },
+    {
+        .name   = "osd_num",
+        .lname  = "Test Secondary OSD number",
+        .type   = FIO_OPT_INT,
+        .off1   = offsetof(struct sec_options, osd_num),
+        .help   = "Number of the tested OSD, checked after connecting",
+        .def    = "1",
+        .category = FIO_OPT_C_ENGINE,
+        .group  = FIO_OPT_G_FILENAME,
+    },
     {
         .name   = "block_size_order",
         .lname  = "Blockstore block size order",
         .type   = FIO_OPT_INT,
         .off1   = offsetof(struct sec_options, block_order),
-        .help   = "Blockstore block size order (size = 2^order)",
+        .help   = "Blockstore block size order (size = 2^order), used if the OSD doesn't report it",
         .category = FIO_OPT_C_ENGINE,
         .group  = FIO_OPT_G_FILENAME,
     },
@@ -139,54 +162,156 @@ static void sec_cleanup(struct thread_data *td)
     sec_data *bsd = (sec_data*)td->io_ops_data;
     if (bsd)
     {
-        close(bsd->connect_fd);
+        if (bsd->msgr)
+        {
+            if (bsd->peer_fd >= 0)
+                bsd->msgr->stop_client(bsd->peer_fd, true);
+            bsd->ringloop->unregister_consumer(&bsd->consumer);
+            delete bsd->msgr;
+        }
+        if (bsd->epmgr)
+            delete bsd->epmgr;
+        if (bsd->ringloop)
+            delete bsd->ringloop;
+        if (bsd->bitmap_buf)
+            free(bsd->bitmap_buf);
         delete bsd;
     }
 }
 
+/* Run the event loop until <done> returns true or <timeout> seconds pass. */
+static bool sec_wait(sec_data *bsd, std::function<bool()> done, int timeout)
+{
+    time_t start = time(NULL);
+    while (true)
+    {
+        bsd->ringloop->loop();
+        if (done())
+            return true;
+        if (timeout > 0 && time(NULL)-start >= timeout)
+            return false;
+        bsd->ringloop->wait();
+    }
+}
+
 /* Connect to the server from each thread. */
 static int sec_init(struct thread_data *td)
 {
     sec_options *o = (sec_options*)td->eo;
     sec_data *bsd = (sec_data*)td->io_ops_data;
     bsd->block_order = o->block_order == 0 ? 17 : o->block_order;
-    bsd->block_size = 1 << o->block_order;
-
-    struct sockaddr_in addr;
-    int r;
-    if ((r = inet_pton(AF_INET, o->host ? o->host : "127.0.0.1", &addr.sin_addr)) != 1)
+    bsd->block_size = 1 << bsd->block_order;
+    bsd->osd_num = o->osd_num ? o->osd_num : 1;
+    bsd->trace = o->trace ? true : false;
+
+    bsd->ringloop = new ring_loop_t(512);
+    bsd->epmgr = new epoll_manager_t(bsd->ringloop);
+    bsd->msgr = new osd_messenger_t();
+    osd_messenger_t *msgr = bsd->msgr;
+    msgr->osd_num = 0;
+    msgr->tfd = bsd->epmgr->tfd;
+    msgr->ringloop = bsd->ringloop;
+    msgr->repeer_pgs = [bsd](osd_num_t peer_osd)
+    {
+        auto fd_it = bsd->msgr->osd_peer_fds.find(peer_osd);
+        bsd->peer_fd = fd_it != bsd->msgr->osd_peer_fds.end() ? fd_it->second : -1;
+    };
+    msgr->exec_op = [bsd](osd_op_t *op)
+    {
+        // Garbage in
+        fprintf(stderr, "Incoming garbage from peer %d\n", op->peer_fd);
+        bsd->msgr->stop_client(op->peer_fd);
+        delete op;
+    };
+    // Secondary operations are small and sent in batches, so TCP is used without RDMA
+    msgr->parse_config(json11::Json::object { { "use_rdma", false } });
+    msgr->init();
+    bsd->consumer.loop = [bsd]()
+    {
+        bsd->msgr->read_requests();
+        bsd->msgr->send_replies();
+        bsd->ringloop->submit();
+    };
+    bsd->ringloop->register_consumer(&bsd->consumer);
+
+    msgr->connect_peer(bsd->osd_num, json11::Json::object {
+        { "addresses", json11::Json::array { std::string(o->host ? o->host : "127.0.0.1") } },
+        { "port", o->port ? o->port : 11203 },
+    });
+    if (!sec_wait(bsd, [bsd]() { return bsd->peer_fd >= 0; }, SEC_CONNECT_TIMEOUT))
     {
-        fprintf(stderr, "server address: %s%s\n", o->host ? o->host : "127.0.0.1", r == 0 ? " is not valid" : ": no ipv4 support");
+        fprintf(stderr, "Failed to connect to OSD %lu in %d seconds\n", bsd->osd_num, SEC_CONNECT_TIMEOUT);
         return 1;
     }
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(o->port ? o->port : 11203);
 
-    bsd->connect_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (bsd->connect_fd < 0)
+    // Get block size and bitmap granularity from the OSD
+    json11::Json osd_config;
+    osd_op_t *op = new osd_op_t();
+    op->op_type = OSD_OP_OUT;
+    op->peer_fd = bsd->peer_fd;
+    op->req = (osd_any_op_t){
+        .show_conf = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = msgr->next_subop_id++,
+                .opcode = OSD_OP_SHOW_CONFIG,
+            },
+        },
+    };
+    bool config_done = false;
+    op->callback = [&](osd_op_t *op)
     {
-        perror("socket");
+        std::string json_err;
+        if (op->reply.hdr.retval >= 0)
+            osd_config = json11::Json::parse(std::string((char*)op->buf), json_err);
+        config_done = true;
+        delete op;
+    };
+    msgr->outbox_push(op);
+    if (!sec_wait(bsd, [&]() { return config_done; }, SEC_CONNECT_TIMEOUT) || !osd_config.is_object())
+    {
+        fprintf(stderr, "Failed to get configuration of OSD %lu\n", bsd->osd_num);
         return 1;
     }
-    if (connect(bsd->connect_fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    if (osd_config["block_size"].uint64_value())
     {
-        perror("connect");
-        return 1;
+        bsd->block_size = osd_config["block_size"].uint64_value();
+        bsd->block_order = 0;
+        while ((1ul << bsd->block_order) < bsd->block_size)
+            bsd->block_order++;
     }
-    int one = 1;
-    setsockopt(bsd->connect_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
-
-    // FIXME: read config (block size) from OSD
+    uint64_t bitmap_granularity = osd_config["bitmap_granularity"].uint64_value();
+    // Primary OSDs return bitmaps of all data chunks, and a PG has at most 256 OSDs
+    bsd->bitmap_len = 256 * (bsd->block_size / (bitmap_granularity ? bitmap_granularity : 4096) + 7) / 8;
+    bsd->bitmap_buf = malloc_or_die(bsd->bitmap_len);
 
     return 0;
 }
 
+static void sec_op_callback(sec_data *bsd, io_u *io, osd_op_t *op)
+{
+    int64_t retval = op->reply.hdr.retval;
+    if (io->ddir == DDIR_SYNC ? retval != 0 : retval != io->xfer_buflen)
+    {
+        fprintf(stderr, "%s failed: retval = %ld instead of %llu\n", io->ddir == DDIR_READ ? "Read" :
+            (io->ddir == DDIR_WRITE ? "Write" : "Sync"), retval, io->ddir == DDIR_SYNC ? 0 : io->xfer_buflen);
+        io->error = retval < 0 ? -retval : EIO;
+    }
+    if (bsd->trace)
+    {
+        printf("--- %s # %ld\n", io->ddir == DDIR_READ ? "READ" :
+            (io->ddir == DDIR_WRITE ? "WRITE" : "SYNC"), op->req.hdr.id);
+    }
+    bsd->inflight--;
+    bsd->completed.push_back(io);
+    delete op;
+}
+
 /* Begin read or write request. */
 static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
 {
     sec_options *opt = (sec_options*)td->eo;
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    int n = bsd->op_n;
 
     fio_ro_check(td, io);
     if (io->ddir == DDIR_SYNC && bsd->last_sync)
@@ -195,157 +320,122 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
     }
 
     io->engine_data = bsd;
-    osd_any_op_t op = { 0 };
-
-    op.hdr.magic = SECONDARY_OSD_OP_MAGIC;
-    op.hdr.id = n;
+    osd_op_t *op = new osd_op_t();
+    op->op_type = OSD_OP_OUT;
+    op->req = { 0 };
+    op->req.hdr.magic = SECONDARY_OSD_OP_MAGIC;
+    op->req.hdr.id = bsd->msgr->next_subop_id++;
     switch (io->ddir)
     {
     case DDIR_READ:
         if (!opt->single_primary)
         {
-            op.hdr.opcode = OSD_OP_SEC_READ;
-            op.sec_rw.oid = {
+            op->req.hdr.opcode = OSD_OP_SEC_READ;
+            op->req.sec_rw.oid = {
                 .inode = 1,
                 .stripe = io->offset >> bsd->block_order,
             };
-            op.sec_rw.version = UINT64_MAX; // last unstable
-            op.sec_rw.offset = io->offset % bsd->block_size;
-            op.sec_rw.len = io->xfer_buflen;
+            op->req.sec_rw.version = UINT64_MAX; // last unstable
+            op->req.sec_rw.offset = io->offset % bsd->block_size;
+            op->req.sec_rw.len = io->xfer_buflen;
         }
         else
         {
-            op.hdr.opcode = OSD_OP_READ;
-            op.rw.inode = 1;
-            op.rw.offset = io->offset;
-            op.rw.len = io->xfer_buflen;
+            op->req.hdr.opcode = OSD_OP_READ;
+            op->req.rw.inode = 1;
+            op->req.rw.offset = io->offset;
+            op->req.rw.len = io->xfer_buflen;
         }
+        op->bitmap = bsd->bitmap_buf;
+        op->bitmap_len = bsd->bitmap_len;
+        op->iov.push_back(io->xfer_buf, io->xfer_buflen);
         bsd->last_sync = false;
         break;
     case DDIR_WRITE:
         if (!opt->single_primary)
         {
-            op.hdr.opcode = OSD_OP_SEC_WRITE;
-            op.sec_rw.oid = {
+            op->req.hdr.opcode = OSD_OP_SEC_WRITE;
+            op->req.sec_rw.oid = {
                 .inode = 1,
                 .stripe = io->offset >> bsd->block_order,
             };
-            op.sec_rw.version = 0; // assign automatically
-            op.sec_rw.offset = io->offset % bsd->block_size;
-            op.sec_rw.len = io->xfer_buflen;
+            op->req.sec_rw.version = 0; // assign automatically
+            op->req.sec_rw.offset = io->offset % bsd->block_size;
+            op->req.sec_rw.len = io->xfer_buflen;
         }
         else
         {
-            op.hdr.opcode = OSD_OP_WRITE;
-            op.rw.inode = 1;
-            op.rw.offset = io->offset;
-            op.rw.len = io->xfer_buflen;
+            op->req.hdr.opcode = OSD_OP_WRITE;
+            op->req.rw.inode = 1;
+            op->req.rw.offset = io->offset;
+            op->req.rw.len = io->xfer_buflen;
         }
+        op->iov.push_back(io->xfer_buf, io->xfer_buflen);
         bsd->last_sync = false;
         break;
     case DDIR_SYNC:
         if (!opt->single_primary)
         {
             // Allowed only for testing: sync & stabilize all unstable object versions
-            op.hdr.opcode = OSD_OP_TEST_SYNC_STAB_ALL;
+            op->req.hdr.opcode = OSD_OP_TEST_SYNC_STAB_ALL;
         }
         else
         {
-            op.hdr.opcode = OSD_OP_SYNC;
+            op->req.hdr.opcode = OSD_OP_SYNC;
         }
         // fio sends 32 syncs with -fsync=32. we omit 31 of them even though
         // generally it may not be 100% correct (FIXME: fix fio itself)
         bsd->last_sync = true;
         break;
     default:
+        delete op;
         io->error = EINVAL;
         return FIO_Q_COMPLETED;
     }
 
     if (opt->trace)
     {
-        printf("+++ %s # %d\n", io->ddir == DDIR_READ ? "READ" :
-            (io->ddir == DDIR_WRITE ? "WRITE" : "SYNC"), n);
+        printf("+++ %s # %ld\n", io->ddir == DDIR_READ ? "READ" :
+            (io->ddir == DDIR_WRITE ? "WRITE" : "SYNC"), op->req.hdr.id);
     }
 
     io->error = 0;
+    op->callback = [bsd, io](osd_op_t *op) { sec_op_callback(bsd, io, op); };
     bsd->inflight++;
-    bsd->op_n++;
-    bsd->queue[n] = io;
-
-    iovec iov[2] = { { .iov_base = op.buf, .iov_len = OSD_PACKET_SIZE } };
-    int iovcnt = 1, wtotal = OSD_PACKET_SIZE;
-    if (io->ddir == DDIR_WRITE)
-    {
-        iov[1] = { .iov_base = io->xfer_buf, .iov_len = io->xfer_buflen };
-        wtotal += io->xfer_buflen;
-        iovcnt++;
-    }
-    if (writev_blocking(bsd->connect_fd, iov, iovcnt) != wtotal)
-    {
-        perror("writev");
-        exit(1);
-    }
+    /* Operations are sent together in sec_commit(). */
+    bsd->queued.push_back(op);
 
-    if (io->error != 0)
-        return FIO_Q_COMPLETED;
     return FIO_Q_QUEUED;
 }
 
-static int sec_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
+static int sec_commit(struct thread_data *td)
 {
-    sec_options *opt = (sec_options*)td->eo;
     sec_data *bsd = (sec_data*)td->io_ops_data;
-    // FIXME timeout, at least poll. Now it's the stupidest implementation possible
-    osd_any_reply_t reply;
-    while (bsd->completed.size() < min)
+    if (!bsd->queued.size())
+        return 0;
+    for (auto op: bsd->queued)
     {
-        read_blocking(bsd->connect_fd, reply.buf, OSD_PACKET_SIZE);
-        if (reply.hdr.magic != SECONDARY_OSD_REPLY_MAGIC)
-        {
-            fprintf(stderr, "bad reply: magic = %lx instead of %lx\n", reply.hdr.magic, SECONDARY_OSD_REPLY_MAGIC);
-            exit(1);
-        }
-        auto it = bsd->queue.find(reply.hdr.id);
-        if (it == bsd->queue.end())
-        {
-            fprintf(stderr, "bad reply: op id %lx missing in local queue\n", reply.hdr.id);
-            exit(1);
-        }
-        io_u* io = it->second;
-        bsd->queue.erase(it);
-        if (io->ddir == DDIR_READ)
-        {
-            if (reply.hdr.retval != io->xfer_buflen)
-            {
-                fprintf(stderr, "Short read: retval = %ld instead of %llu\n", reply.hdr.retval, io->xfer_buflen);
-                exit(1);
-            }
-            read_blocking(bsd->connect_fd, io->xfer_buf, io->xfer_buflen);
-        }
-        else if (io->ddir == DDIR_WRITE)
-        {
-            if (reply.hdr.retval != io->xfer_buflen)
-            {
-                fprintf(stderr, "Short write: retval = %ld instead of %llu\n", reply.hdr.retval, io->xfer_buflen);
-                exit(1);
-            }
-        }
-        else if (io->ddir == DDIR_SYNC)
-        {
-            if (reply.hdr.retval != 0)
-            {
-                fprintf(stderr, "Sync failed: retval = %ld\n", reply.hdr.retval);
-                exit(1);
-            }
-        }
-        if (opt->trace)
+        if (bsd->peer_fd < 0)
         {
-            printf("--- %s # %ld\n", io->ddir == DDIR_READ ? "READ" :
-                (io->ddir == DDIR_WRITE ? "WRITE" : "SYNC"), reply.hdr.id);
+            // The connection is lost
+            op->reply.hdr.retval = -EPIPE;
+            std::function<void(osd_op_t*)>(op->callback)(op);
+            continue;
         }
-        bsd->completed.push_back(io);
+        op->peer_fd = bsd->peer_fd;
+        bsd->msgr->outbox_push(op);
     }
+    bsd->queued.clear();
+    // Send everything with one submission
+    bsd->ringloop->loop();
+    return 0;
+}
+
+static int sec_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
+{
+    sec_data *bsd = (sec_data*)td->io_ops_data;
+    // FIXME timeout
+    sec_wait(bsd, [&]() { return bsd->completed.size() >= min; }, 0);
     return bsd->completed.size();
 }
 
@@ -387,6 +477,7 @@ struct ioengine_ops ioengine = {
     .setup              = sec_setup,
     .init               = sec_init,
     .queue              = sec_queue,
+    .commit             = sec_commit,
     .getevents          = sec_getevents,
     .event              = sec_event,
     .cleanup            = sec_cleanup,
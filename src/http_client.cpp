@@ -20,16 +20,32 @@
 #include "timerfd_manager.h"
 
 #define READ_BUFFER_SIZE 9000
+#define HTTP_POOL_MAX_IDLE 16
 
 static int extract_port(std::string & host);
 static std::string trim(const std::string & in);
 static std::string ws_format_frame(int type, uint64_t size);
 static bool ws_parse_frame(std::string & buf, int & type, std::string & res);
 
-// FIXME: Use keepalive
+struct http_pool_t
+{
+    timerfd_manager_t *tfd;
+    int refs = 1;
+    bool destroyed = false;
+    // Idle connections by host
+    std::map<std::string, std::vector<int>> idle_fds;
+};
+
+static int http_pool_take(http_pool_t *pool, const std::string & host);
+static void http_pool_put(http_pool_t *pool, const std::string & host, int fd);
+static void http_pool_unref(http_pool_t *pool);
+
 struct http_co_t
 {
     timerfd_manager_t *tfd;
+    http_pool_t *pool = NULL;
+    // the connection was taken from the pool, so the server may have already closed it
+    bool reused_connection = false;
 
     int request_timeout = 0;
     std::string host;
@@ -60,7 +76,8 @@ struct http_co_t
     ~http_co_t();
     inline void stackin() { onstack++; }
     inline void stackout() { onstack--; if (!onstack && ended) end(); }
-    inline void end() { ended = true; if (!onstack) { delete this; } }
+    void end();
+    bool keepalive_possible();
     void start_connection();
     void handle_events();
     void handle_connect_result();
@@ -90,13 +107,18 @@ void http_request(timerfd_manager_t *tfd, const std::string & host, const std::s
     handler->request = request;
     handler->callback = callback;
     handler->ws.co = handler;
+    if (options.pool)
+    {
+        handler->pool = options.pool;
+        handler->pool->refs++;
+    }
     handler->start_connection();
 }
 
 void http_request_json(timerfd_manager_t *tfd, const std::string & host, const std::string & request,
-    int timeout, std::function<void(std::string, json11::Json r)> callback)
+    int timeout, std::function<void(std::string, json11::Json r)> callback, http_pool_t *pool)
 {
-    http_request(tfd, host, request, { .timeout = timeout }, [callback](const http_response_t* res)
+    http_request(tfd, host, request, { .timeout = timeout, .pool = pool }, [callback](const http_response_t* res)
     {
         if (res->error_code != 0)
         {
@@ -180,15 +202,162 @@ http_co_t::~http_co_t()
     }
     parsed.eof = true;
     callback(&parsed);
+    if (pool)
+    {
+        http_pool_unref(pool);
+        pool = NULL;
+    }
+}
+
+http_pool_t* http_pool_create(timerfd_manager_t *tfd)
+{
+    http_pool_t *pool = new http_pool_t();
+    pool->tfd = tfd;
+    return pool;
+}
+
+void http_pool_destroy(http_pool_t *pool)
+{
+    for (auto & kv: pool->idle_fds)
+    {
+        for (int fd: kv.second)
+        {
+            pool->tfd->set_fd_handler(fd, false, NULL);
+            close(fd);
+        }
+    }
+    pool->idle_fds.clear();
+    pool->destroyed = true;
+    http_pool_unref(pool);
+}
+
+static void http_pool_unref(http_pool_t *pool)
+{
+    pool->refs--;
+    if (!pool->refs)
+    {
+        delete pool;
+    }
+}
+
+static int http_pool_take(http_pool_t *pool, const std::string & host)
+{
+    auto it = pool->idle_fds.find(host);
+    if (it == pool->idle_fds.end() || !it->second.size())
+    {
+        return -1;
+    }
+    int fd = it->second.back();
+    it->second.pop_back();
+    return fd;
+}
+
+static void http_pool_put(http_pool_t *pool, const std::string & host, int fd)
+{
+    auto & fds = pool->idle_fds[host];
+    if (pool->destroyed || fds.size() >= HTTP_POOL_MAX_IDLE)
+    {
+        pool->tfd->set_fd_handler(fd, false, NULL);
+        close(fd);
+        return;
+    }
+    fds.push_back(fd);
+    // The server may close an idle connection, and it shouldn't send anything else
+    pool->tfd->set_fd_handler(fd, false, [pool, host](int fd, int epoll_events)
+    {
+        auto & fds = pool->idle_fds[host];
+        for (int i = 0; i < fds.size(); i++)
+        {
+            if (fds[i] == fd)
+            {
+                fds.erase(fds.begin()+i, fds.begin()+i+1);
+                break;
+            }
+        }
+        pool->tfd->set_fd_handler(fd, false, NULL);
+        close(fd);
+    });
+}
+
+// The whole response is received and nothing else, so the connection may be used for the next request
+bool http_co_t::keepalive_possible()
+{
+    if (!pool || parsed.error_code != 0 || peer_fd < 0 ||
+        parsed.headers["connection"] == "close")
+    {
+        return false;
+    }
+    return state == HTTP_CO_HEADERS_RECEIVED && target_response_size > 0 && response.size() == target_response_size ||
+        state == HTTP_CO_CHUNKED && parsed.eof && response == "0\r\n\r\n";
+}
+
+void http_co_t::end()
+{
+    ended = true;
+    if (onstack)
+    {
+        return;
+    }
+    if (reused_connection && !parsed.error_code && response.size() == 0 &&
+        (state == HTTP_CO_SENDING_REQUEST || state == HTTP_CO_REQUEST_SENT))
+    {
+        // The server closed the idle connection before receiving the request, retry with a new one
+        tfd->set_fd_handler(peer_fd, false, NULL);
+        close(peer_fd);
+        peer_fd = -1;
+        reused_connection = false;
+        ended = false;
+        sent = 0;
+        epoll_events = 0;
+        start_connection();
+        return;
+    }
+    if (keepalive_possible())
+    {
+        http_pool_put(pool, host, peer_fd);
+        peer_fd = -1;
+    }
+    delete this;
 }
 
 void http_co_t::start_connection()
 {
     stackin();
-    int port = extract_port(host);
+    if (request_timeout > 0 && timeout_id < 0)
+    {
+        timeout_id = tfd->set_timer(request_timeout, false, [this](int timer_id)
+        {
+            timeout_id = -1;
+            if (response.length() == 0)
+            {
+                parsed.error_code = ETIME;
+            }
+            end();
+        });
+    }
+    if (pool)
+    {
+        peer_fd = http_pool_take(pool, host);
+        if (peer_fd >= 0)
+        {
+            reused_connection = true;
+            epoll_events = 0;
+            tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+            {
+                this->epoll_events |= epoll_events;
+                handle_events();
+            });
+            state = HTTP_CO_SENDING_REQUEST;
+            submit_send();
+            stackout();
+            return;
+        }
+    }
+    std::string addr_host = host;
+    int port = extract_port(addr_host);
     struct sockaddr_in addr;
     int r;
-    if ((r = inet_pton(AF_INET, host.c_str(), &addr.sin_addr)) != 1)
+    if ((r = inet_pton(AF_INET, addr_host.c_str(), &addr.sin_addr)) != 1)
     {
         parsed.error_code = ENXIO;
         stackout();
@@ -206,17 +375,6 @@ void http_co_t::start_connection()
         return;
     }
     fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
-    if (request_timeout > 0)
-    {
-        timeout_id = tfd->set_timer(request_timeout, false, [this](int timer_id)
-        {
-            if (response.length() == 0)
-            {
-                parsed.error_code = ETIME;
-            }
-            end();
-        });
-    }
     epoll_events = 0;
     // Finally call connect
     r = ::connect(peer_fd, (sockaddr*)&addr, sizeof(addr));
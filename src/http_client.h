@@ -17,10 +17,14 @@
 
 class timerfd_manager_t;
 
+struct http_pool_t;
+
 struct http_options_t
 {
     int timeout;
     bool want_streaming;
+    // keep the connection open after the response and reuse idle connections from this pool
+    http_pool_t *pool;
 };
 
 struct http_response_t
@@ -51,11 +55,17 @@ uint64_t stoull_full(const std::string & str, int base = 10);
 
 std::string strtolower(const std::string & in);
 
+// Pool of idle keep-alive connections. It's destroyed when http_pool_destroy() is called
+// and all requests using it are finished
+http_pool_t* http_pool_create(timerfd_manager_t *tfd);
+
+void http_pool_destroy(http_pool_t *pool);
+
 void http_request(timerfd_manager_t *tfd, const std::string & host, const std::string & request,
     const http_options_t & options, std::function<void(const http_response_t *response)> callback);
 
 void http_request_json(timerfd_manager_t *tfd, const std::string & host, const std::string & request,
-    int timeout, std::function<void(std::string, json11::Json r)> callback);
+    int timeout, std::function<void(std::string, json11::Json r)> callback, http_pool_t *pool = NULL);
 
 websocket_t* open_websocket(timerfd_manager_t *tfd, const std::string & host, const std::string & path,
     int timeout, std::function<void(const http_response_t *msg)> callback);
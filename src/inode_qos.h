@@ -0,0 +1,50 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Token buckets of per-inode QoS limits (iops_limit and bandwidth_limit in /config/inode/...).
+// Buckets hold up to 1 second of the limit. Bandwidth is allowed to be overdrawn by one
+// operation, otherwise operations larger than the limit would never pass
+struct inode_qos_bucket_t
+{
+    timespec refill_time = { 0 };
+    double iops_tokens = 0, bytes_tokens = 0;
+
+    // Take one operation of <len> bytes from the buckets. Returns 0 if it may proceed
+    // or the number of microseconds to wait before trying again
+    uint64_t take(uint64_t iops_limit, uint64_t bandwidth_limit, uint64_t len)
+    {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (!refill_time.tv_sec)
+        {
+            iops_tokens = iops_limit;
+            bytes_tokens = bandwidth_limit;
+        }
+        else
+        {
+            double elapsed = (now.tv_sec - refill_time.tv_sec) + (now.tv_nsec - refill_time.tv_nsec)/1000000000.0;
+            iops_tokens += elapsed*iops_limit;
+            if (iops_tokens > iops_limit)
+                iops_tokens = iops_limit;
+            bytes_tokens += elapsed*bandwidth_limit;
+            if (bytes_tokens > bandwidth_limit)
+                bytes_tokens = bandwidth_limit;
+        }
+        refill_time = now;
+        double wait = 0;
+        if (iops_limit && iops_tokens < 1)
+            wait = (1-iops_tokens) / iops_limit;
+        if (bandwidth_limit && bytes_tokens < 0 && -bytes_tokens / bandwidth_limit > wait)
+            wait = -bytes_tokens / bandwidth_limit;
+        if (wait > 0)
+            return (uint64_t)(wait*1000000)+1;
+        iops_tokens--;
+        bytes_tokens -= len;
+        return 0;
+    }
+};
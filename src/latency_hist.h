@@ -0,0 +1,55 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+
+// Log-linear latency histogram: values below 2^LAT_HIST_SUB_BITS get their own buckets,
+// every next power of 2 is split into 2^LAT_HIST_SUB_BITS equal buckets, so the relative
+// error is at most 1/2^LAT_HIST_SUB_BITS (12.5%). Values up to 2^32 us (~71 min) are tracked,
+// larger ones go to the last bucket. Fixed size, so adding a value is just an increment.
+#define LAT_HIST_SUB_BITS 3
+#define LAT_HIST_MAX_BITS 32
+#define LAT_HIST_BUCKETS ((LAT_HIST_MAX_BITS-LAT_HIST_SUB_BITS+1) << LAT_HIST_SUB_BITS)
+
+struct latency_hist_t
+{
+    uint64_t buckets[LAT_HIST_BUCKETS];
+
+    static inline int bucket(uint64_t usec)
+    {
+        if (usec < (1 << LAT_HIST_SUB_BITS))
+            return usec;
+        int shift = 63 - __builtin_clzll(usec) - LAT_HIST_SUB_BITS;
+        int b = ((shift+1) << LAT_HIST_SUB_BITS) + ((usec >> shift) & ((1 << LAT_HIST_SUB_BITS)-1));
+        return b < LAT_HIST_BUCKETS ? b : LAT_HIST_BUCKETS-1;
+    }
+
+    // Lowest value that falls into bucket <b>
+    static inline uint64_t bucket_start(int b)
+    {
+        if (b < (1 << LAT_HIST_SUB_BITS))
+            return b;
+        int shift = (b >> LAT_HIST_SUB_BITS) - 1;
+        return ((uint64_t)((1 << LAT_HIST_SUB_BITS) + (b & ((1 << LAT_HIST_SUB_BITS)-1)))) << shift;
+    }
+
+    inline void add(uint64_t usec)
+    {
+        buckets[bucket(usec)]++;
+    }
+
+    // Approximate <pct>-th percentile of <count> added values (lower bound of its bucket)
+    inline uint64_t percentile(uint64_t count, double pct) const
+    {
+        uint64_t target = count*pct/100, sum = 0;
+        for (int b = 0; b < LAT_HIST_BUCKETS; b++)
+        {
+            sum += buckets[b];
+            if (sum > target)
+                return bucket_start(b);
+        }
+        return 0;
+    }
+};
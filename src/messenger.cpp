@@ -12,12 +12,29 @@
 
 void osd_messenger_t::init()
 {
+#ifdef IORING_CQE_F_NOTIF
+    zerocopy_send_supported = ringloop && ringloop->is_op_supported(IORING_OP_SENDMSG_ZC);
+#endif
+    if (use_zerocopy_send && !zerocopy_send_supported)
+    {
+        fprintf(stderr, "[OSD %lu] Zero-copy send requires io_uring SENDMSG_ZC support (Linux 6.1+), using regular send\n", osd_num);
+    }
+#ifdef IORING_RECV_MULTISHOT
+    if (use_multishot_recv && ringloop && !use_sync_send_recv)
+    {
+        multishot_recv_supported = ringloop->setup_buf_ring(MSGR_BUF_GROUP, multishot_recv_buffers, receive_buffer_size);
+    }
+#endif
+    if (use_multishot_recv && !multishot_recv_supported)
+    {
+        fprintf(stderr, "[OSD %lu] Multishot receive requires io_uring provided buffer rings (Linux 6.0+), using regular receive\n", osd_num);
+    }
 #ifdef WITH_RDMA
     if (use_rdma)
     {
         rdma_context = msgr_rdma_context_t::create(
             rdma_device != "" ? rdma_device.c_str() : NULL,
-            rdma_port_num, rdma_gid_index, rdma_mtu
+            rdma_port_num, rdma_gid_index, rdma_mtu, rdma_rendezvous_threshold > 0
         );
         if (!rdma_context)
         {
@@ -27,12 +44,17 @@ void osd_messenger_t::init()
         {
             rdma_max_sge = rdma_max_sge < rdma_context->attrx.orig_attr.max_sge
                 ? rdma_max_sge : rdma_context->attrx.orig_attr.max_sge;
+            if (rdma_max_srq > 0 && !rdma_context->create_srq(rdma_max_srq, rdma_max_msg))
+            {
+                fprintf(stderr, "[OSD %lu] Proceeding with per-connection RDMA receive buffers\n", osd_num);
+            }
             fprintf(stderr, "[OSD %lu] RDMA initialized successfully\n", osd_num);
             fcntl(rdma_context->channel->fd, F_SETFL, fcntl(rdma_context->channel->fd, F_GETFL, 0) | O_NONBLOCK);
             tfd->set_fd_handler(rdma_context->channel->fd, false, [this](int notify_fd, int epoll_events)
             {
                 handle_rdma_events();
             });
+            rdma_poll_consumer.loop = [this]() { busy_poll_rdma(); };
             handle_rdma_events();
         }
     }
@@ -120,6 +142,10 @@ osd_messenger_t::~osd_messenger_t()
         stop_client(clients.begin()->first, true, true);
     }
 #ifdef WITH_RDMA
+    if (rdma_polling)
+    {
+        ringloop->unregister_consumer(&rdma_poll_consumer);
+    }
     if (rdma_context)
     {
         delete rdma_context;
@@ -127,6 +153,30 @@ osd_messenger_t::~osd_messenger_t()
 #endif
 }
 
+osd_msgr_memory_stats_t osd_messenger_t::get_memory_stats()
+{
+    osd_msgr_memory_stats_t st = { 0 };
+    for (auto & cp: clients)
+    {
+        osd_client_t *cl = cp.second;
+        st.clients += sizeof(osd_client_t) + cl->dirty_pgs.size()*(sizeof(pool_pg_num_t) + 32);
+        if (cl->in_buf)
+            st.receive_buffers += receive_buffer_size;
+        st.send_lists += (cl->send_list.capacity() + cl->next_send_list.capacity()) * sizeof(iovec) +
+            (cl->outbox.capacity() + cl->next_outbox.capacity()) * sizeof(msgr_sendp_t);
+        st.sent_ops += cl->sent_ops.size();
+#ifdef WITH_RDMA
+        if (cl->rdma_conn && cl->rdma_conn->recv_buf)
+            st.rdma_buffers += cl->rdma_conn->max_recv * cl->rdma_conn->max_msg;
+#endif
+    }
+#ifdef WITH_RDMA
+    if (rdma_context)
+        st.rdma_buffers += rdma_context->srq_size * rdma_context->srq_buf_size;
+#endif
+    return st;
+}
+
 void osd_messenger_t::parse_config(const json11::Json & config)
 {
 #ifdef WITH_RDMA
@@ -153,12 +203,43 @@ void osd_messenger_t::parse_config(const json11::Json & config)
     this->rdma_max_msg = config["rdma_max_msg"].uint64_value();
     if (!this->rdma_max_msg || this->rdma_max_msg > 128*1024*1024)
         this->rdma_max_msg = 1024*1024;
+    this->rdma_max_srq = config["rdma_max_srq"].uint64_value();
+    this->rdma_rendezvous_threshold = config["rdma_rendezvous_threshold"].uint64_value();
+    if (this->rdma_rendezvous_threshold > 0 && this->rdma_rendezvous_threshold < 4096)
+    {
+        // Operation headers must always be sent inline
+        this->rdma_rendezvous_threshold = 4096;
+    }
+    this->rdma_max_inline = config["rdma_max_inline"].is_null() ? 256 : config["rdma_max_inline"].uint64_value();
+    this->rdma_signal_interval = config["rdma_signal_interval"].uint64_value();
+    if (!this->rdma_signal_interval)
+        this->rdma_signal_interval = 16;
+    this->rdma_poll_us = config["rdma_poll_us"].uint64_value();
 #endif
     this->receive_buffer_size = (uint32_t)config["tcp_header_buffer_size"].uint64_value();
     if (!this->receive_buffer_size || this->receive_buffer_size > 1024*1024*1024)
         this->receive_buffer_size = 65536;
+    this->direct_read_threshold = (uint32_t)config["tcp_direct_read_threshold"].uint64_value();
+    if (!this->direct_read_threshold || this->direct_read_threshold > this->receive_buffer_size)
+        this->direct_read_threshold = this->receive_buffer_size < 16384 ? this->receive_buffer_size : 16384;
+    this->direct_read_replies = config["tcp_direct_read_replies"].bool_value() ||
+        config["tcp_direct_read_replies"].uint64_value();
     this->use_sync_send_recv = config["use_sync_send_recv"].bool_value() ||
         config["use_sync_send_recv"].uint64_value();
+    this->use_zerocopy_send = config["use_zerocopy_send"].bool_value() ||
+        config["use_zerocopy_send"].uint64_value();
+    this->zerocopy_send_threshold = config["zerocopy_send_threshold"].uint64_value();
+    if (!this->zerocopy_send_threshold)
+        this->zerocopy_send_threshold = 65536;
+    this->use_multishot_recv = config["use_multishot_recv"].bool_value() ||
+        config["use_multishot_recv"].uint64_value();
+    this->multishot_recv_buffers = config["multishot_recv_buffers"].uint64_value();
+    if (!this->multishot_recv_buffers || this->multishot_recv_buffers > 32768)
+        this->multishot_recv_buffers = 256;
+    this->send_batch_delay_us = config["send_batch_delay_us"].uint64_value();
+    this->send_batch_max_bytes = config["send_batch_max_bytes"].uint64_value();
+    if (!this->send_batch_max_bytes)
+        this->send_batch_max_bytes = 16384;
     this->peer_connect_interval = config["peer_connect_interval"].uint64_value();
     if (!this->peer_connect_interval)
         this->peer_connect_interval = 5;
@@ -171,9 +252,50 @@ void osd_messenger_t::parse_config(const json11::Json & config)
     this->osd_ping_timeout = config["osd_ping_timeout"].uint64_value();
     if (!this->osd_ping_timeout)
         this->osd_ping_timeout = 5;
+    this->tcp_nodelay = config["tcp_nodelay"].is_null() || config["tcp_nodelay"].bool_value() ||
+        config["tcp_nodelay"].uint64_value();
+    this->tcp_busy_poll_us = config["tcp_busy_poll_us"].uint64_value();
+    std::string quickack = config["tcp_quickack"].string_value();
+    this->tcp_quickack = quickack == "always" ? MSGR_QUICKACK_ALWAYS
+        : (quickack == "never" ? MSGR_QUICKACK_NEVER : MSGR_QUICKACK_AUTO);
     this->log_level = config["log_level"].uint64_value();
 }
 
+void osd_messenger_t::set_socket_options(int peer_fd)
+{
+    int one = 1;
+    if (tcp_nodelay)
+    {
+        setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (tcp_busy_poll_us)
+    {
+        // Busy-poll the device queue for up to this time in blocking receives and poll/epoll of the socket.
+        // Values above net.core.busy_read require CAP_NET_ADMIN, the error is only reported once
+        int busy_poll = tcp_busy_poll_us;
+        if (setsockopt(peer_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0)
+        {
+            fprintf(stderr, "[OSD %lu] Failed to set SO_BUSY_POLL to %d: %s\n", osd_num, busy_poll, strerror(errno));
+            tcp_busy_poll_us = 0;
+        }
+    }
+    if (tcp_quickack != MSGR_QUICKACK_AUTO)
+    {
+        int quickack = tcp_quickack == MSGR_QUICKACK_ALWAYS ? 1 : 0;
+        setsockopt(peer_fd, SOL_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+    }
+}
+
+// TCP_QUICKACK isn't permanent, the kernel returns to delayed ACKs by itself, so it's set again after receives
+void osd_messenger_t::rearm_quickack(osd_client_t *cl)
+{
+    if (tcp_quickack == MSGR_QUICKACK_ALWAYS && cl->peer_state == PEER_CONNECTED)
+    {
+        int one = 1;
+        setsockopt(cl->peer_fd, SOL_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+}
+
 void osd_messenger_t::connect_peer(uint64_t peer_osd, json11::Json peer_state)
 {
     if (wanted_peers.find(peer_osd) == wanted_peers.end())
@@ -249,7 +371,8 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     clients[peer_fd]->peer_state = PEER_CONNECTING;
     clients[peer_fd]->connect_timeout_id = -1;
     clients[peer_fd]->osd_num = peer_osd;
-    clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+    if (!multishot_recv_supported)
+        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
     tfd->set_fd_handler(peer_fd, true, [this](int peer_fd, int epoll_events)
     {
         // Either OUT (connected) or HUP
@@ -267,6 +390,62 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     }
 }
 
+void osd_messenger_t::connect_peer_extra(osd_client_t *main_cl)
+{
+    for (int i = 1; i < peer_connections; i++)
+    {
+        int peer_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (peer_fd < 0)
+        {
+            fprintf(stderr, "Failed to open extra connection to OSD %lu: %s\n", main_cl->osd_num, strerror(errno));
+            return;
+        }
+        fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
+        int r = connect(peer_fd, (sockaddr*)&main_cl->peer_addr, sizeof(main_cl->peer_addr));
+        if (r < 0 && errno != EINPROGRESS)
+        {
+            fprintf(stderr, "Failed to open extra connection to OSD %lu: %s\n", main_cl->osd_num, strerror(errno));
+            close(peer_fd);
+            return;
+        }
+        auto cl = new osd_client_t();
+        clients[peer_fd] = cl;
+        cl->peer_addr = main_cl->peer_addr;
+        cl->peer_port = main_cl->peer_port;
+        cl->peer_fd = peer_fd;
+        cl->peer_state = PEER_CONNECTING;
+        cl->osd_num = main_cl->osd_num;
+        cl->main_peer_fd = main_cl->peer_fd;
+        if (!multishot_recv_supported)
+            cl->in_buf = malloc_or_die(receive_buffer_size);
+        tfd->set_fd_handler(peer_fd, true, [this](int peer_fd, int epoll_events)
+        {
+            handle_connect_epoll(peer_fd);
+        });
+        if (peer_connect_timeout > 0)
+        {
+            cl->connect_timeout_id = tfd->set_timer(1000*peer_connect_timeout, false, [this, peer_fd](int timer_id)
+            {
+                stop_client(peer_fd, true);
+            });
+        }
+    }
+}
+
+int osd_messenger_t::get_peer_fd(osd_num_t peer_osd, uint64_t hash)
+{
+    int peer_fd = osd_peer_fds.at(peer_osd);
+    auto ex_it = osd_peer_extra_fds.find(peer_osd);
+    if (ex_it != osd_peer_extra_fds.end())
+    {
+        // Object numbers have many zero low bits, so mix them before taking the remainder
+        uint64_t n = ((hash * 0x9E3779B97F4A7C15ul) >> 32) % (ex_it->second.size()+1);
+        if (n > 0)
+            peer_fd = ex_it->second[n-1];
+    }
+    return peer_fd;
+}
+
 void osd_messenger_t::handle_connect_epoll(int peer_fd)
 {
     auto cl = clients[peer_fd];
@@ -284,17 +463,32 @@ void osd_messenger_t::handle_connect_epoll(int peer_fd)
     }
     if (result != 0)
     {
+        bool is_extra = cl->main_peer_fd >= 0;
         stop_client(peer_fd, true);
-        on_connect_peer(peer_osd, -result);
+        if (!is_extra)
+            on_connect_peer(peer_osd, -result);
         return;
     }
-    int one = 1;
-    setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_socket_options(peer_fd);
     cl->peer_state = PEER_CONNECTED;
-    tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+    if (multishot_recv_supported)
     {
-        handle_peer_epoll(peer_fd, epoll_events);
-    });
+        tfd->set_fd_handler(peer_fd, false, NULL);
+        start_multishot_recv(cl);
+    }
+    else
+    {
+        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+        {
+            handle_peer_epoll(peer_fd, epoll_events);
+        });
+    }
+    if (cl->main_peer_fd >= 0)
+    {
+        // The main connection has already checked the peer
+        osd_peer_extra_fds[peer_osd].push_back(peer_fd);
+        return;
+    }
     // Check OSD number
     check_peer_config(cl);
 }
@@ -380,12 +574,13 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
 #ifdef WITH_RDMA
     if (rdma_context)
     {
-        cl->rdma_conn = msgr_rdma_connection_t::create(rdma_context, rdma_max_send, rdma_max_recv, rdma_max_sge, rdma_max_msg);
+        cl->rdma_conn = msgr_rdma_connection_t::create(rdma_context, cl->peer_fd, rdma_max_send, rdma_max_recv, rdma_max_sge, rdma_max_msg, rdma_max_inline);
         if (cl->rdma_conn)
         {
             json11::Json payload = json11::Json::object {
                 { "connect_rdma", cl->rdma_conn->addr.to_string() },
                 { "rdma_max_msg", cl->rdma_conn->max_msg },
+                { "rdma_rendezvous", true },
             };
             std::string payload_str = payload.dump();
             op->req.show_conf.json_len = payload_str.size();
@@ -463,18 +658,31 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
                 {
                     cl->rdma_conn->max_msg = server_max_msg;
                 }
+                if (config["rdma_rendezvous"].bool_value())
+                {
+                    cl->rdma_conn->rdv_threshold = rdma_rendezvous_threshold;
+                }
                 if (log_level > 0)
                 {
                     fprintf(stderr, "Connected to OSD %lu using RDMA\n", cl->osd_num);
                 }
                 cl->peer_state = PEER_RDMA;
                 tfd->set_fd_handler(cl->peer_fd, false, NULL);
-                // Add the initial receive request
-                try_recv_rdma(cl);
+                // Add the initial receive request or handle messages received before switching
+                if (!try_recv_rdma(cl))
+                {
+                    delete op;
+                    return;
+                }
             }
         }
 #endif
         osd_peer_fds[cl->osd_num] = cl->peer_fd;
+        if (peer_connections > 1 && cl->peer_state == PEER_CONNECTED)
+        {
+            // Spread data subops over more TCP streams (and NIC queues) to this peer
+            connect_peer_extra(cl);
+        }
         on_connect_peer(cl->osd_num, cl->peer_fd);
         delete op;
     };
@@ -491,22 +699,33 @@ void osd_messenger_t::accept_connections(int listen_fd)
     {
         assert(peer_fd != 0);
         char peer_str[256];
-        fprintf(stderr, "[OSD %lu] new client %d: connection from %s port %d\n", this->osd_num, peer_fd,
-            inet_ntop(AF_INET, &addr.sin_addr, peer_str, 256), ntohs(addr.sin_port));
+        // CPU which handled the last packet of the connection, i.e. the CPU of its NIC receive queue,
+        // shows if RSS steers clients to the CPU this OSD runs on
+        int incoming_cpu = -1;
+        socklen_t cpu_len = sizeof(incoming_cpu);
+        getsockopt(peer_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &cpu_len);
+        fprintf(stderr, "[OSD %lu] new client %d: connection from %s port %d, incoming CPU %d\n", this->osd_num, peer_fd,
+            inet_ntop(AF_INET, &addr.sin_addr, peer_str, 256), ntohs(addr.sin_port), incoming_cpu);
         fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
-        int one = 1;
-        setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+        set_socket_options(peer_fd);
         clients[peer_fd] = new osd_client_t();
         clients[peer_fd]->peer_addr = addr;
         clients[peer_fd]->peer_port = ntohs(addr.sin_port);
         clients[peer_fd]->peer_fd = peer_fd;
         clients[peer_fd]->peer_state = PEER_CONNECTED;
-        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
-        // Add FD to epoll
-        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+        if (multishot_recv_supported)
         {
-            handle_peer_epoll(peer_fd, epoll_events);
-        });
+            start_multishot_recv(clients[peer_fd]);
+        }
+        else
+        {
+            clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+            // Add FD to epoll
+            tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+            {
+                handle_peer_epoll(peer_fd, epoll_events);
+            });
+        }
         // Try to accept next connection
         peer_addr_size = sizeof(addr);
     }
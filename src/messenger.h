@@ -16,12 +16,16 @@
 #include "json11/json11.hpp"
 #include "msgr_op.h"
 #include "timerfd_manager.h"
+#include "latency_hist.h"
 #include <ringloop.h>
 
 #ifdef WITH_RDMA
 #include "msgr_rdma.h"
 #endif
 
+// Provided buffer group for multishot receive
+#define MSGR_BUF_GROUP 1
+
 #define CL_READ_HDR 1
 #define CL_READ_DATA 2
 #define CL_READ_REPLY_DATA 3
@@ -39,12 +43,26 @@
 #define MSGR_SENDP_HDR 1
 #define MSGR_SENDP_FREE 2
 
+// tcp_quickack: leave delayed ACKs to the kernel, re-enable quick ACKs after every receive, or disable them
+#define MSGR_QUICKACK_AUTO 0
+#define MSGR_QUICKACK_ALWAYS 1
+#define MSGR_QUICKACK_NEVER 2
+
 struct msgr_sendp_t
 {
     osd_op_t *op;
     int flags;
 };
 
+// State of a zero-copy send: ops with buffers that must live until the kernel notification
+struct msgr_zc_send_t
+{
+    bool sent = false;
+    std::vector<osd_op_t*> free_ops;
+};
+
+struct ring_data_t;
+
 struct osd_client_t
 {
     int refs = 0;
@@ -57,6 +75,8 @@ struct osd_client_t
     int ping_time_remaining = 0;
     int idle_time_remaining = 0;
     osd_num_t osd_num = 0;
+    // Main connection of an extra connection to the same OSD peer, -1 for main connections
+    int main_peer_fd = -1;
 
     void *in_buf = NULL;
 
@@ -72,6 +92,10 @@ struct osd_client_t
     int read_remaining = 0;
     int read_state = 0;
     osd_op_buf_list_t recv_list;
+    // Sent reads whose replies should be received directly (see direct_read_replies)
+    int direct_replies_inflight = 0;
+    // Multishot recv in progress, its ring data
+    ring_data_t *multishot_data = NULL;
 
     // Incoming operations
     std::vector<osd_op_t*> received_ops;
@@ -85,6 +109,8 @@ struct osd_client_t
     // Write state
     msghdr write_msg = { 0 };
     int write_state = 0;
+    // When the first postponed small send was queued, 0 = not postponed
+    uint64_t send_delay_start_us = 0;
     std::vector<iovec> send_list, next_send_list;
     std::vector<msgr_sendp_t> outbox, next_outbox;
 
@@ -113,6 +139,17 @@ struct osd_op_stats_t
     uint64_t op_stat_bytes[OSD_OP_MAX+1] = { 0 };
     uint64_t subop_stat_sum[OSD_OP_MAX+1] = { 0 };
     uint64_t subop_stat_count[OSD_OP_MAX+1] = { 0 };
+    latency_hist_t op_stat_hist[OSD_OP_MAX+1] = { 0 };
+    latency_hist_t subop_stat_hist[OSD_OP_MAX+1] = { 0 };
+    // Socket sends, bytes sent by them and sends postponed to batch more replies
+    uint64_t send_count = 0, send_bytes = 0, send_delayed = 0;
+};
+
+// Estimated memory usage of connections in bytes, <sent_ops> is the number of operations waiting for replies
+struct osd_msgr_memory_stats_t
+{
+    uint64_t clients, receive_buffers, send_lists, rdma_buffers;
+    uint64_t sent_ops;
 };
 
 struct osd_messenger_t
@@ -121,12 +158,30 @@ protected:
     int keepalive_timer_id = -1;
 
     uint32_t receive_buffer_size = 0;
+    // Payloads of at least this size are read directly into operation buffers, bypassing in_buf
+    uint32_t direct_read_threshold = 0;
+    // Read only headers into in_buf while large read replies are expected, so that their payload
+    // always goes directly to operation buffers instead of being copied from in_buf
+    bool direct_read_replies = false;
     int peer_connect_interval = 0;
     int peer_connect_timeout = 0;
     int osd_idle_timeout = 0;
     int osd_ping_timeout = 0;
     int log_level = 0;
     bool use_sync_send_recv = false;
+    bool use_zerocopy_send = false, zerocopy_send_supported = false;
+    uint64_t zerocopy_send_threshold = 0;
+    // Small sends are postponed for up to send_batch_delay_us while the event loop is busy
+    uint64_t send_batch_delay_us = 0, send_batch_max_bytes = 0;
+    uint64_t send_batch_cqe_count = 0;
+    // Receive with multishot recv into a provided buffer ring shared by all clients instead of
+    // per-client buffers
+    bool use_multishot_recv = false, multishot_recv_supported = false;
+    uint64_t multishot_recv_buffers = 0;
+    // Per-socket TCP options: TCP_NODELAY, SO_BUSY_POLL and the TCP_QUICKACK policy
+    bool tcp_nodelay = true;
+    uint64_t tcp_busy_poll_us = 0;
+    int tcp_quickack = MSGR_QUICKACK_AUTO;
 
 #ifdef WITH_RDMA
     bool use_rdma = true;
@@ -134,7 +189,12 @@ protected:
     uint64_t rdma_port_num = 1, rdma_gid_index = 0, rdma_mtu = 0;
     msgr_rdma_context_t *rdma_context = NULL;
     uint64_t rdma_max_sge = 0, rdma_max_send = 0, rdma_max_recv = 8;
-    uint64_t rdma_max_msg = 0;
+    uint64_t rdma_max_msg = 0, rdma_max_srq = 0, rdma_rendezvous_threshold = 0;
+    // Inline data size, sends per signaled completion and the CQ busy polling window
+    uint64_t rdma_max_inline = 0, rdma_signal_interval = 0, rdma_poll_us = 0;
+    bool rdma_polling = false;
+    uint64_t rdma_poll_until_us = 0;
+    ring_consumer_t rdma_poll_consumer;
 #endif
 
     std::vector<int> read_ready_clients;
@@ -144,12 +204,19 @@ protected:
 public:
     timerfd_manager_t *tfd;
     ring_loop_t *ringloop;
+    // Without a ring loop, messages are sent immediately unless <hold_sends> is set.
+    // In that case they're sent together by the next send_replies()
+    bool hold_sends = false;
     // osd_num_t is only for logging and asserts
     osd_num_t osd_num;
     uint64_t next_subop_id = 1;
     std::map<int, osd_client_t*> clients;
     std::map<osd_num_t, osd_wanted_peer_t> wanted_peers;
     std::map<uint64_t, int> osd_peer_fds;
+    // Connected extra TCP connections to OSD peers, used for data subops along with the main one
+    std::map<uint64_t, std::vector<int>> osd_peer_extra_fds;
+    // Total number of TCP connections to open to each OSD peer (osd_peer_connections)
+    int peer_connections = 1;
     // op statistics
     osd_op_stats_t stats;
 
@@ -157,24 +224,30 @@ public:
     void parse_config(const json11::Json & config);
     void connect_peer(uint64_t osd_num, json11::Json peer_state);
     void stop_client(int peer_fd, bool force = false, bool force_delete = false);
+    int get_peer_fd(osd_num_t peer_osd, uint64_t hash);
     void outbox_push(osd_op_t *cur_op);
+    bool is_direct_read_reply(osd_op_t *op);
     std::function<void(osd_op_t*)> exec_op;
     std::function<void(osd_num_t)> repeer_pgs;
+    // Called when a connection to an OSD peer is stopped, before its FD number may be reused
+    std::function<void(int)> cancel_peer_ops;
     void read_requests();
     void send_replies();
     void accept_connections(int listen_fd);
+    osd_msgr_memory_stats_t get_memory_stats();
     ~osd_messenger_t();
 
     static json11::Json read_config(const json11::Json & config);
 
 #ifdef WITH_RDMA
     bool is_rdma_enabled();
-    bool connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg);
+    bool connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg, bool client_rendezvous);
 #endif
 
 protected:
     void try_connect_peer(uint64_t osd_num);
     void try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port);
+    void connect_peer_extra(osd_client_t *main_cl);
     void handle_peer_epoll(int peer_fd, int epoll_events);
     void handle_connect_epoll(int peer_fd);
     void on_connect_peer(osd_num_t peer_osd, int peer_fd);
@@ -182,20 +255,31 @@ protected:
     void cancel_osd_ops(osd_client_t *cl);
     void cancel_op(osd_op_t *op);
 
+    void set_socket_options(int peer_fd);
+    void rearm_quickack(osd_client_t *cl);
     bool try_send(osd_client_t *cl);
+    bool is_zerocopy_worth(osd_client_t *cl);
+    bool should_delay_send(osd_client_t *cl, bool loop_busy, uint64_t & now_us);
     void measure_exec(osd_op_t *cur_op);
-    void handle_send(int result, osd_client_t *cl);
+    void handle_send(int result, osd_client_t *cl, std::vector<osd_op_t*> *defer_free = NULL);
 
     bool handle_read(int result, osd_client_t *cl);
+    void start_multishot_recv(osd_client_t *cl);
+    void handle_multishot_recv(osd_client_t *cl, int result, unsigned cqe_flags, bool more);
     bool handle_read_buffer(osd_client_t *cl, void *curbuf, int remain);
     bool handle_finished_read(osd_client_t *cl);
-    void handle_op_hdr(osd_client_t *cl);
+    bool handle_op_hdr(osd_client_t *cl);
     bool handle_reply_hdr(osd_client_t *cl);
     void handle_reply_ready(osd_op_t *op);
 
 #ifdef WITH_RDMA
     bool try_send_rdma(osd_client_t *cl);
     bool try_recv_rdma(osd_client_t *cl);
+    void finish_rdma_send(osd_client_t *cl);
+    bool try_read_rdma(osd_client_t *cl);
+    bool handle_rdma_recv(osd_client_t *cl, void *buf, uint32_t len, ibv_wc *wc);
     void handle_rdma_events();
+    void busy_poll_rdma();
+    int poll_rdma_cq();
 #endif
 };
@@ -0,0 +1,232 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+
+#include "metrics.h"
+#include "messenger.h"
+#include "timerfd_manager.h"
+
+#define METRICS_MAX_REQUEST 16384
+
+static std::string add_label(const std::string & labels, const std::string & label)
+{
+    return "{" + (labels != "" ? labels + "," : "") + label + "}";
+}
+
+// Latency histogram with power-of-2 microsecond bounds. The log-linear histogram is much finer,
+// but that many series would be too expensive to store
+static void add_latency_hist(std::string & out, const std::string & name, const std::string & labels,
+    const latency_hist_t & hist, uint64_t count, uint64_t sum)
+{
+    uint64_t cum = 0;
+    int b = 0;
+    for (int bit = 0; bit <= LAT_HIST_MAX_BITS; bit++)
+    {
+        for (; b < LAT_HIST_BUCKETS && latency_hist_t::bucket_start(b) < (1ul << bit); b++)
+            cum += hist.buckets[b];
+        out += name+"_bucket"+add_label(labels, "le=\""+std::to_string(1ul << bit)+"\"")+" "+std::to_string(cum)+"\n";
+    }
+    out += name+"_bucket"+add_label(labels, "le=\"+Inf\"")+" "+std::to_string(count)+"\n";
+    out += name+"_sum{"+labels+"} "+std::to_string(sum)+"\n";
+    out += name+"_count{"+labels+"} "+std::to_string(count)+"\n";
+}
+
+void metrics_add_op_stats(std::string & out, const std::string & prefix, const std::string & labels,
+    const osd_op_stats_t & stats, bool ops, bool subops)
+{
+    for (int kind = 0; kind < 2; kind++)
+    {
+        if (kind == 0 ? !ops : !subops)
+            continue;
+        std::string name = prefix + (kind == 0 ? "_op" : "_subop");
+        const uint64_t *counts = kind == 0 ? stats.op_stat_count : stats.subop_stat_count;
+        const uint64_t *sums = kind == 0 ? stats.op_stat_sum : stats.subop_stat_sum;
+        const latency_hist_t *hists = kind == 0 ? stats.op_stat_hist : stats.subop_stat_hist;
+        out += "# TYPE "+name+"_latency_usec histogram\n";
+        for (int i = OSD_OP_MIN; i <= OSD_OP_MAX; i++)
+        {
+            // Skip operations which never happened to keep the output short
+            if (counts[i])
+            {
+                std::string op_labels = (labels != "" ? labels+"," : "") + "op=\""+osd_op_names[i]+"\"";
+                add_latency_hist(out, name+"_latency_usec", op_labels, hists[i], counts[i], sums[i]);
+            }
+        }
+        if (kind == 0)
+        {
+            out += "# TYPE "+name+"_bytes counter\n";
+            for (int i = OSD_OP_MIN; i <= OSD_OP_MAX; i++)
+            {
+                if (counts[i])
+                    out += name+"_bytes"+add_label(labels, std::string("op=\"")+osd_op_names[i]+"\"")+" "+std::to_string(stats.op_stat_bytes[i])+"\n";
+            }
+        }
+    }
+}
+
+void metrics_add_json(std::string & out, const std::string & prefix, const std::string & labels, const json11::Json & value)
+{
+    if (value.is_object())
+    {
+        for (auto & kv: value.object_items())
+        {
+            std::string key = kv.first;
+            for (auto & c: key)
+            {
+                if (!isalnum(c))
+                    c = '_';
+            }
+            metrics_add_json(out, prefix+"_"+key, labels, kv.second);
+        }
+    }
+    else if (value.is_number() || value.is_bool())
+    {
+        double v = value.is_bool() ? (value.bool_value() ? 1 : 0) : value.number_value();
+        char buf[64];
+        if (v == (double)(uint64_t)v)
+            snprintf(buf, sizeof(buf), "%lu", (uint64_t)v);
+        else
+            snprintf(buf, sizeof(buf), "%g", v);
+        out += "# TYPE "+prefix+" gauge\n";
+        out += prefix+"{"+labels+"} "+buf+"\n";
+    }
+}
+
+metrics_server_t::metrics_server_t(timerfd_manager_t *tfd, std::function<std::string()> get_metrics)
+{
+    this->tfd = tfd;
+    this->get_metrics = get_metrics;
+}
+
+metrics_server_t::~metrics_server_t()
+{
+    while (conns.size())
+    {
+        close_conn(conns.begin()->first);
+    }
+    if (listen_fd >= 0)
+    {
+        tfd->set_fd_handler(listen_fd, false, NULL);
+        close(listen_fd);
+    }
+}
+
+void metrics_server_t::start(const std::string & bind_address, int port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    }
+    int enable = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    sockaddr_in addr = { 0 };
+    int r;
+    if ((r = inet_pton(AF_INET, bind_address.c_str(), &addr.sin_addr)) != 1)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+        throw std::runtime_error("metrics bind address "+bind_address+(r == 0 ? " is not valid" : ": no ipv4 support"));
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0)
+    {
+        std::string err = std::string("metrics listener: ") + strerror(errno);
+        close(listen_fd);
+        listen_fd = -1;
+        throw std::runtime_error(err);
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    tfd->set_fd_handler(listen_fd, false, [this](int fd, int events)
+    {
+        accept_conns();
+    });
+}
+
+void metrics_server_t::accept_conns()
+{
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        conns[fd] = conn_t();
+        tfd->set_fd_handler(fd, false, [this](int fd, int events)
+        {
+            handle_conn(fd, events);
+        });
+    }
+}
+
+void metrics_server_t::handle_conn(int fd, int events)
+{
+    auto it = conns.find(fd);
+    if (it == conns.end())
+    {
+        return;
+    }
+    conn_t & conn = it->second;
+    if (!conn.replying)
+    {
+        char buf[4096];
+        int r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0)
+        {
+            conn.buf.append(buf, r);
+        }
+        if (r == 0 || r < 0 && errno != EAGAIN || conn.buf.size() > METRICS_MAX_REQUEST)
+        {
+            close_conn(fd);
+            return;
+        }
+        if (conn.buf.find("\r\n\r\n") == std::string::npos)
+        {
+            return;
+        }
+        std::string body, status = "200 OK";
+        if (conn.buf.substr(0, 13) == "GET /metrics " || conn.buf.substr(0, 6) == "GET / ")
+            body = get_metrics();
+        else
+            status = "404 Not Found";
+        conn.buf = "HTTP/1.1 "+status+"\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: "+std::to_string(body.size())+"\r\n"
+            "Connection: close\r\n\r\n"+body;
+        conn.replying = true;
+        tfd->set_fd_handler(fd, true, [this](int fd, int events)
+        {
+            handle_conn(fd, events);
+        });
+    }
+    while (conn.sent < conn.buf.size())
+    {
+        // The scraper may disconnect at any time, don't die from SIGPIPE
+        int r = send(fd, conn.buf.data()+conn.sent, conn.buf.size()-conn.sent, MSG_NOSIGNAL);
+        if (r < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if (r <= 0)
+        {
+            break;
+        }
+        conn.sent += r;
+    }
+    close_conn(fd);
+}
+
+void metrics_server_t::close_conn(int fd)
+{
+    tfd->set_fd_handler(fd, false, NULL);
+    close(fd);
+    conns.erase(fd);
+}
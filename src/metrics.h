@@ -0,0 +1,47 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <functional>
+#include "json11/json11.hpp"
+
+class timerfd_manager_t;
+struct osd_op_stats_t;
+
+// Prometheus text exposition format (also accepted as OpenMetrics by scrapers)
+
+// Operation counters and latency histograms of the messenger. <labels> are added to every
+// sample, for example "osd_num=\"1\"". Subops are operations sent to OSDs, for clients it's
+// all of their operations
+void metrics_add_op_stats(std::string & out, const std::string & prefix, const std::string & labels,
+    const osd_op_stats_t & stats, bool ops, bool subops);
+
+// All numeric values of a JSON object as gauges, nested keys are joined with '_'
+void metrics_add_json(std::string & out, const std::string & prefix, const std::string & labels, const json11::Json & value);
+
+// Minimal HTTP listener answering GET requests with the output of <get_metrics>
+struct metrics_server_t
+{
+    struct conn_t
+    {
+        std::string buf;
+        size_t sent = 0;
+        bool replying = false;
+    };
+
+    timerfd_manager_t *tfd = NULL;
+    std::function<std::string()> get_metrics;
+    int listen_fd = -1;
+    std::map<int, conn_t> conns;
+
+    metrics_server_t(timerfd_manager_t *tfd, std::function<std::string()> get_metrics);
+    ~metrics_server_t();
+    // Throws std::runtime_error on errors
+    void start(const std::string & bind_address, int port);
+    void accept_conns();
+    void handle_conn(int fd, int events);
+    void close_conn(int fd);
+};
@@ -6,6 +6,10 @@
 #include <assert.h>
 
 #include "messenger.h"
+#include "mock_sim.h"
+
+std::function<void(osd_messenger_t *msgr, osd_op_t *op)> sim_outbox_push_hook;
+std::function<void(osd_messenger_t *msgr, uint64_t peer_osd)> sim_connect_peer_hook;
 
 void osd_messenger_t::init()
 {
@@ -22,6 +26,10 @@ osd_messenger_t::~osd_messenger_t()
 void osd_messenger_t::outbox_push(osd_op_t *cur_op)
 {
     clients[cur_op->peer_fd]->sent_ops[cur_op->req.hdr.id] = cur_op;
+    if (sim_outbox_push_hook)
+    {
+        sim_outbox_push_hook(this, cur_op);
+    }
 }
 
 void osd_messenger_t::parse_config(const json11::Json & config)
@@ -33,6 +41,10 @@ void osd_messenger_t::connect_peer(uint64_t peer_osd, json11::Json peer_state)
     wanted_peers[peer_osd] = (osd_wanted_peer_t){
         .port = 1,
     };
+    if (sim_connect_peer_hook)
+    {
+        sim_connect_peer_hook(this, peer_osd);
+    }
 }
 
 void osd_messenger_t::read_requests()
@@ -0,0 +1,22 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+
+struct osd_op_t;
+struct osd_messenger_t;
+
+// Virtual time of deterministic simulations. Timers of the mock timerfd_manager_t
+// (mock/timerfd_manager.cpp) are also scheduled here, so they only fire when the
+// simulation advances the clock with sim_step()
+uint64_t sim_now_us();
+void sim_schedule(uint64_t delay_us, std::function<void()> cb);
+// Run all events of the earliest time point, returns false when there are no events left
+bool sim_step();
+
+// Called by the mock messenger for every operation sent to an OSD and for every connection attempt
+extern std::function<void(osd_messenger_t *msgr, osd_op_t *op)> sim_outbox_push_hook;
+extern std::function<void(osd_messenger_t *msgr, uint64_t peer_osd)> sim_connect_peer_hook;
@@ -0,0 +1,118 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// timerfd_manager_t running on the virtual clock instead of a timerfd
+
+#include <map>
+#include "timerfd_manager.h"
+#include "mock_sim.h"
+
+struct sim_event_key_t
+{
+    uint64_t at_us, seq;
+};
+
+inline bool operator < (const sim_event_key_t & a, const sim_event_key_t & b)
+{
+    return a.at_us < b.at_us || a.at_us == b.at_us && a.seq < b.seq;
+}
+
+static uint64_t sim_cur_us = 0, sim_seq = 0;
+static std::map<sim_event_key_t, std::function<void()>> sim_events;
+
+uint64_t sim_now_us()
+{
+    return sim_cur_us;
+}
+
+void sim_schedule(uint64_t delay_us, std::function<void()> cb)
+{
+    sim_events[(sim_event_key_t){ .at_us = sim_cur_us+delay_us, .seq = sim_seq++ }] = cb;
+}
+
+bool sim_step()
+{
+    if (!sim_events.size())
+    {
+        return false;
+    }
+    sim_cur_us = sim_events.begin()->first.at_us;
+    // Events added by callbacks for the same time point are also run here
+    while (sim_events.size() && sim_events.begin()->first.at_us == sim_cur_us)
+    {
+        auto cb = std::move(sim_events.begin()->second);
+        sim_events.erase(sim_events.begin());
+        cb();
+    }
+    return true;
+}
+
+// Timers are kept in timerfd_manager_t::timers, cleared ones are just skipped when they fire
+static void sim_schedule_timer(std::unordered_map<int, timerfd_timer_t*> *timers, timerfd_timer_t *t)
+{
+    int timer_id = t->id;
+    sim_schedule(t->next_us-sim_now_us(), [timers, timer_id]()
+    {
+        auto it = timers->find(timer_id);
+        if (it == timers->end())
+        {
+            return;
+        }
+        timerfd_timer_t *t = it->second;
+        auto cb = t->callback;
+        if (t->repeat)
+        {
+            t->next_us += t->micros;
+            sim_schedule_timer(timers, t);
+        }
+        else
+        {
+            timers->erase(it);
+            delete t;
+        }
+        cb(timer_id);
+    });
+}
+
+timerfd_manager_t::timerfd_manager_t(std::function<void(int, bool, std::function<void(int, int)>)> set_fd_handler)
+{
+    this->set_fd_handler = set_fd_handler;
+    this->timerfd = -1;
+}
+
+timerfd_manager_t::~timerfd_manager_t()
+{
+    for (auto & tp: timers)
+    {
+        delete tp.second;
+    }
+    timers.clear();
+}
+
+int timerfd_manager_t::set_timer(uint64_t millis, bool repeat, std::function<void(int)> callback)
+{
+    return set_timer_us(millis*1000, repeat, callback);
+}
+
+int timerfd_manager_t::set_timer_us(uint64_t micros, bool repeat, std::function<void(int)> callback)
+{
+    timerfd_timer_t *t = new timerfd_timer_t();
+    t->id = id++;
+    t->micros = micros;
+    t->next_us = sim_now_us()+micros;
+    t->repeat = repeat;
+    t->callback = callback;
+    timers[t->id] = t;
+    sim_schedule_timer(&timers, t);
+    return t->id;
+}
+
+void timerfd_manager_t::clear_timer(int timer_id)
+{
+    auto it = timers.find(timer_id);
+    if (it != timers.end())
+    {
+        delete it->second;
+        timers.erase(it);
+    }
+}
@@ -4,6 +4,70 @@
 #include <assert.h>
 
 #include "msgr_op.h"
+#include "slab_allocator.h"
+#include "buffer_pool.h"
+
+// Subop arrays are at most pg_size items long, larger arrays go to malloc
+#define OSD_OP_POOL_MAX_ARRAY 32
+
+// Array pools are indexed by item count. Like thread_slab_pool(), they are never freed
+// and share used counts between threads
+static thread_local slab_pool_t **osd_op_array_pools = NULL;
+static std::atomic<int64_t> osd_op_array_used[OSD_OP_POOL_MAX_ARRAY];
+
+// The choice between the pool and malloc only depends on the size, so arrays
+// may be freed by a different thread than the one that allocated them
+static slab_pool_t *get_array_pool(size_t size)
+{
+    size_t n = size / sizeof(osd_op_t);
+    if (n >= OSD_OP_POOL_MAX_ARRAY)
+        return NULL;
+    if (!osd_op_array_pools)
+        osd_op_array_pools = (slab_pool_t**)calloc_or_die(OSD_OP_POOL_MAX_ARRAY, sizeof(slab_pool_t*));
+    if (!osd_op_array_pools[n])
+        osd_op_array_pools[n] = new slab_pool_t(n > 4 ? 16 : 64, &osd_op_array_used[n]);
+    return osd_op_array_pools[n];
+}
+
+void *osd_op_t::operator new(size_t size)
+{
+    return thread_slab_pool<osd_op_t>().alloc(size);
+}
+
+void osd_op_t::operator delete(void *ptr, size_t size)
+{
+    thread_slab_pool<osd_op_t>().release(ptr);
+}
+
+void *osd_op_t::operator new[](size_t size)
+{
+    slab_pool_t *pool = get_array_pool(size);
+    if (pool)
+        return pool->alloc(size);
+    return malloc_or_die(size);
+}
+
+void osd_op_t::operator delete[](void *ptr, size_t size)
+{
+    slab_pool_t *pool = get_array_pool(size);
+    if (pool)
+        pool->release(ptr);
+    else
+        free(ptr);
+}
+
+osd_op_pool_stats_t get_osd_op_pool_stats()
+{
+    slab_pool_t & pool = thread_slab_pool<osd_op_t>();
+    osd_op_pool_stats_t st = { .used = pool.get_used_count(), .allocated_bytes = pool.get_allocated_bytes() };
+    for (int i = 0; i < OSD_OP_POOL_MAX_ARRAY; i++)
+    {
+        st.used += osd_op_array_used[i].load(std::memory_order_relaxed) * i;
+        if (osd_op_array_pools && osd_op_array_pools[i])
+            st.allocated_bytes += osd_op_array_pools[i]->get_allocated_bytes();
+    }
+    return st;
+}
 
 osd_op_t::~osd_op_t()
 {
@@ -11,12 +75,16 @@ osd_op_t::~osd_op_t()
     assert(!op_data);
     if (rmw_buf)
     {
-        free(rmw_buf);
+        buffer_free(rmw_buf);
+    }
+    if (trace)
+    {
+        free(trace);
     }
     if (buf)
     {
         // Note: reusing osd_op_t WILL currently lead to memory leaks
         // So we don't reuse it, but free it every time
-        free(buf);
+        buffer_free(buf);
     }
 }
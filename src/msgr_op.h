@@ -152,6 +152,8 @@ struct blockstore_op_t;
 
 struct osd_primary_op_data_t;
 
+struct osd_op_trace_t;
+
 struct osd_op_t
 {
     timespec tv_begin = { 0 }, tv_end = { 0 };
@@ -168,8 +170,27 @@ struct osd_op_t
     void *rmw_buf = NULL;
     osd_primary_op_data_t* op_data = NULL;
     std::function<void(osd_op_t*)> callback;
+    // Non-zero for traced operations, outgoing operations carry it in req.trace.trace_id
+    uint64_t trace_id = 0;
+    // Stage timestamps, only allocated by the OSD for traced operations
+    osd_op_trace_t *trace = NULL;
 
     osd_op_buf_list_t iov;
 
     ~osd_op_t();
+
+    // osd_op_t and small osd_op_t arrays (subops) are recycled through per-thread pools
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+    static void *operator new[](size_t size);
+    static void operator delete[](void *ptr, size_t size);
+};
+
+struct osd_op_pool_stats_t
+{
+    uint64_t used, allocated_bytes;
 };
+
+// Statistics of osd_op_t pools: memory allocated by the calling thread's pools and operations
+// used in all threads, as operations may be freed by a different thread than the one that allocated them
+osd_op_pool_stats_t get_osd_op_pool_stats();
@@ -6,6 +6,16 @@
 #include "msgr_rdma.h"
 #include "messenger.h"
 
+// Work request types, stored in the lowest 2 bits of wr_id
+#define RDMA_WR_RECV 0
+#define RDMA_WR_SEND 1
+#define RDMA_WR_READ 2
+#define RDMA_WR_ACK 3
+
+// Immediate data of rendezvous messages
+#define RDMA_IMM_RDV 1
+#define RDMA_IMM_RDV_ACK 2
+
 std::string msgr_rdma_address_t::to_string()
 {
     char msg[sizeof "0000:00000000:00000000:00000000000000000000000000000000"];
@@ -29,6 +39,15 @@ bool msgr_rdma_address_t::from_string(const char *str, msgr_rdma_address_t *dest
 
 msgr_rdma_context_t::~msgr_rdma_context_t()
 {
+    if (srq)
+        ibv_destroy_srq(srq);
+    if (srq_mr)
+        ibv_dereg_mr(srq_mr);
+    if (srq_buf)
+        free(srq_buf);
+    for (auto & mr_it: mr_chunks)
+        ibv_dereg_mr(mr_it.second.mr);
+    mr_chunks.clear();
     if (cq)
         ibv_destroy_cq(cq);
     if (channel)
@@ -43,20 +62,28 @@ msgr_rdma_context_t::~msgr_rdma_context_t()
 
 msgr_rdma_connection_t::~msgr_rdma_connection_t()
 {
-    ctx->used_max_cqe -= max_send+max_recv;
+    ctx->used_max_cqe -= max_send+RDMA_RDV_SEND_WR+max_recv;
     if (qp)
+    {
+        ctx->srq_clients.erase(qp->qp_num);
         ibv_destroy_qp(qp);
-    if (recv_buffers.size())
-        for (auto b: recv_buffers)
-            free(b);
+    }
+    release_mrs(send_mrs);
+    release_mrs(read_mrs);
+    release_rdv_mr();
+    if (recv_mr)
+        ibv_dereg_mr(recv_mr);
+    if (recv_buf)
+        free(recv_buf);
 }
 
-msgr_rdma_context_t *msgr_rdma_context_t::create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu)
+msgr_rdma_context_t *msgr_rdma_context_t::create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu, bool remote_read)
 {
     int res;
     ibv_device **dev_list = NULL;
     msgr_rdma_context_t *ctx = new msgr_rdma_context_t();
     ctx->mtu = mtu;
+    ctx->remote_read = remote_read;
 
     srand48(time(NULL));
     dev_list = ibv_get_device_list(NULL);
@@ -128,20 +155,32 @@ msgr_rdma_context_t *msgr_rdma_context_t::create(const char *ib_devname, uint8_t
             goto cleanup;
         }
         if (!(ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
-            !(ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) ||
             !(ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_SEND) ||
             !(ctx->attrx.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_RECV))
         {
-            fprintf(stderr, "The RDMA device isn't implicit ODP (On-Demand Paging) capable or does not support RC send and receive with ODP\n");
+            fprintf(stderr, "The RDMA device isn't ODP (On-Demand Paging) capable or does not support RC send and receive with ODP\n");
             goto cleanup;
         }
-    }
-
-    ctx->mr = ibv_reg_mr(ctx->pd, NULL, SIZE_MAX, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND);
-    if (!ctx->mr)
-    {
-        fprintf(stderr, "Couldn't register RDMA memory region\n");
-        goto cleanup;
+        if (ctx->attrx.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)
+        {
+            // Register the whole address space at once
+            ctx->mr = ibv_reg_mr(ctx->pd, NULL, SIZE_MAX, ctx->mr_access);
+        }
+        if (!ctx->mr)
+        {
+            // Without implicit ODP, op buffers are sent from explicit ODP regions registered on demand
+            // in RDMA_MR_CHUNK sized chunks. ODP regions follow remapping of the address space, so
+            // caching them is safe even when buffers are freed and memory is returned to the OS.
+            fprintf(stderr, "The RDMA device isn't implicit ODP capable, registering memory in %d MB chunks\n", RDMA_MR_CHUNK/1024/1024);
+        }
+        ctx->max_rd_atomic = ctx->attrx.orig_attr.max_qp_init_rd_atom < RDMA_MAX_READS
+            ? ctx->attrx.orig_attr.max_qp_init_rd_atom : RDMA_MAX_READS;
+        ctx->max_dest_rd_atomic = ctx->attrx.orig_attr.max_qp_rd_atom < RDMA_MAX_READS
+            ? ctx->attrx.orig_attr.max_qp_rd_atom : RDMA_MAX_READS;
+        if (!ctx->max_rd_atomic)
+            ctx->max_rd_atomic = 1;
+        if (!ctx->max_dest_rd_atomic)
+            ctx->max_dest_rd_atomic = 1;
     }
 
     ctx->channel = ibv_create_comp_channel(ctx->context);
@@ -170,56 +209,194 @@ cleanup:
     return NULL;
 }
 
-msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx, uint32_t max_send,
-    uint32_t max_recv, uint32_t max_sge, uint32_t max_msg)
+ibv_mr *msgr_rdma_context_t::reg_mr(void *buf, size_t len)
 {
-    msgr_rdma_connection_t *conn = new msgr_rdma_connection_t;
-
-    max_sge = max_sge > ctx->attrx.orig_attr.max_sge ? ctx->attrx.orig_attr.max_sge : max_sge;
+    ibv_mr *mr = ibv_reg_mr(pd, buf, len, mr_access);
+    if (!mr)
+    {
+        fprintf(stderr, "Couldn't register RDMA memory region: %s\n", strerror(errno));
+        exit(1);
+    }
+    return mr;
+}
 
-    conn->ctx = ctx;
-    conn->max_send = max_send;
-    conn->max_recv = max_recv;
-    conn->max_sge = max_sge;
-    conn->max_msg = max_msg;
+msgr_rdma_mr_t *msgr_rdma_context_t::get_mr_chunk(void *addr)
+{
+    uintptr_t chunk = (uintptr_t)addr / RDMA_MR_CHUNK;
+    auto mr_it = mr_chunks.find(chunk);
+    if (mr_it == mr_chunks.end())
+    {
+        if (mr_chunks.size() >= RDMA_MAX_MR_CHUNKS)
+        {
+            // Evict the least recently used region which isn't referenced by any send in progress
+            auto evict_it = mr_chunks.end();
+            for (auto it = mr_chunks.begin(); it != mr_chunks.end(); it++)
+            {
+                if (!it->second.refs && (evict_it == mr_chunks.end() || evict_it->second.last_used > it->second.last_used))
+                    evict_it = it;
+            }
+            if (evict_it != mr_chunks.end())
+            {
+                ibv_dereg_mr(evict_it->second.mr);
+                mr_chunks.erase(evict_it);
+            }
+        }
+        mr_it = mr_chunks.emplace(chunk, (msgr_rdma_mr_t){
+            .mr = reg_mr((void*)(chunk*RDMA_MR_CHUNK), RDMA_MR_CHUNK),
+        }).first;
+    }
+    mr_it->second.last_used = ++mr_use_counter;
+    return &mr_it->second;
+}
 
-    ctx->used_max_cqe += max_send+max_recv;
-    if (ctx->used_max_cqe > ctx->max_cqe)
+bool msgr_rdma_context_t::reserve_cqe(int count)
+{
+    used_max_cqe += count;
+    if (used_max_cqe > max_cqe)
     {
         // Resize CQ
         // Mellanox ConnectX-4 supports up to 4194303 CQEs, so it's fine to put everything into a single CQ
-        int new_max_cqe = ctx->max_cqe;
-        while (ctx->used_max_cqe > new_max_cqe)
+        int new_max_cqe = max_cqe;
+        while (used_max_cqe > new_max_cqe)
         {
             new_max_cqe *= 2;
         }
-        if (ibv_resize_cq(ctx->cq, new_max_cqe) != 0)
+        if (ibv_resize_cq(cq, new_max_cqe) != 0)
         {
             fprintf(stderr, "Couldn't resize RDMA completion queue to %d entries\n", new_max_cqe);
-            delete conn;
-            return NULL;
+            return false;
         }
-        ctx->max_cqe = new_max_cqe;
+        max_cqe = new_max_cqe;
+    }
+    return true;
+}
+
+bool msgr_rdma_context_t::create_srq(uint32_t size, uint64_t buf_size)
+{
+    if (!attrx.orig_attr.max_srq)
+    {
+        fprintf(stderr, "RDMA device doesn't support shared receive queues\n");
+        return false;
+    }
+    if (size > (uint32_t)attrx.orig_attr.max_srq_wr)
+    {
+        size = attrx.orig_attr.max_srq_wr;
+    }
+    ibv_srq_init_attr init_attr = {
+        .attr = {
+            .max_wr  = size,
+            .max_sge = 1,
+        },
+    };
+    srq = ibv_create_srq(pd, &init_attr);
+    if (!srq)
+    {
+        fprintf(stderr, "Couldn't create RDMA shared receive queue\n");
+        return false;
+    }
+    if (!reserve_cqe(size))
+    {
+        used_max_cqe -= size;
+        ibv_destroy_srq(srq);
+        srq = NULL;
+        return false;
+    }
+    srq_size = size;
+    srq_buf_size = buf_size;
+    // Buffers are ODP, so the memory is only really used when buffers are filled
+    srq_buf = (uint8_t*)malloc_or_die(srq_size*srq_buf_size);
+    if (!mr)
+    {
+        srq_mr = reg_mr(srq_buf, srq_size*srq_buf_size);
+    }
+    for (uint32_t i = 0; i < srq_size; i++)
+    {
+        post_srq_recv(i);
+    }
+    return true;
+}
+
+void msgr_rdma_context_t::post_srq_recv(uint32_t buf_num)
+{
+    ibv_sge sge = {
+        .addr = (uintptr_t)(srq_buf + buf_num*srq_buf_size),
+        .length = (uint32_t)srq_buf_size,
+        .lkey = srq_mr ? srq_mr->lkey : mr->lkey,
+    };
+    ibv_recv_wr *bad_wr = NULL;
+    ibv_recv_wr wr = {
+        .wr_id = (uint64_t)buf_num*4 + RDMA_WR_RECV,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    int err = ibv_post_srq_recv(srq, &wr, &bad_wr);
+    if (err || bad_wr)
+    {
+        fprintf(stderr, "RDMA receive failed: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx, int peer_fd, uint32_t max_send,
+    uint32_t max_recv, uint32_t max_sge, uint32_t max_msg, uint32_t max_inline)
+{
+    msgr_rdma_connection_t *conn = new msgr_rdma_connection_t;
+
+    max_sge = max_sge > ctx->attrx.orig_attr.max_sge ? ctx->attrx.orig_attr.max_sge : max_sge;
+
+    // Receive completions from the SRQ are already accounted for in the CQ
+    max_recv = ctx->srq ? 0 : max_recv;
+
+    conn->ctx = ctx;
+    conn->max_send = max_send;
+    conn->max_recv = max_recv;
+    conn->max_sge = max_sge;
+    conn->max_msg = max_msg;
+    conn->max_read_sge = ctx->attrx.orig_attr.max_sge_rd < max_sge ? ctx->attrx.orig_attr.max_sge_rd : max_sge;
+    if (conn->max_read_sge < 1)
+        conn->max_read_sge = 1;
+
+    if (!ctx->reserve_cqe(max_send+RDMA_RDV_SEND_WR+max_recv))
+    {
+        delete conn;
+        return NULL;
     }
 
     ibv_qp_init_attr init_attr = {
         .send_cq = ctx->cq,
         .recv_cq = ctx->cq,
+        .srq     = ctx->srq,
         .cap     = {
-            .max_send_wr  = max_send,
+            .max_send_wr  = max_send+RDMA_RDV_SEND_WR,
             .max_recv_wr  = max_recv,
             .max_send_sge = max_sge,
             .max_recv_sge = max_sge,
+            .max_inline_data = max_inline,
         },
         .qp_type = IBV_QPT_RC,
     };
     conn->qp = ibv_create_qp(ctx->pd, &init_attr);
+    if (!conn->qp && max_inline > 0)
+    {
+        // The device doesn't support this much inline data, retry without it
+        init_attr.cap.max_inline_data = 0;
+        conn->qp = ibv_create_qp(ctx->pd, &init_attr);
+    }
     if (!conn->qp)
     {
         fprintf(stderr, "Couldn't create RDMA queue pair\n");
         delete conn;
         return NULL;
     }
+    if (ctx->srq)
+    {
+        ctx->srq_clients[conn->qp->qp_num] = peer_fd;
+    }
+
+    // The actual inline data size may be larger than requested
+    conn->max_inline = init_attr.cap.max_inline_data;
+    conn->send_wrs.reserve(max_send+1);
+    conn->send_sges.reserve((max_send+1)*max_sge);
 
     conn->addr.lid = ctx->my_lid;
     conn->addr.gid = ctx->my_gid;
@@ -228,7 +405,7 @@ msgr_rdma_connection_t *msgr_rdma_connection_t::create(msgr_rdma_context_t *ctx,
 
     ibv_qp_attr attr = {
         .qp_state        = IBV_QPS_INIT,
-        .qp_access_flags = 0,
+        .qp_access_flags = (unsigned)(ctx->remote_read ? IBV_ACCESS_REMOTE_READ : 0),
         .pkey_index      = 0,
         .port_num        = ctx->ib_port,
     };
@@ -277,8 +454,8 @@ int msgr_rdma_connection_t::connect(msgr_rdma_address_t *dest)
             .is_global  = (uint8_t)(dest->gid.global.interface_id ? 1 : 0),
             .port_num   = conn->ctx->ib_port,
         },
-        .max_rd_atomic  = 1,
-        .max_dest_rd_atomic = 1,
+        .max_rd_atomic  = conn->ctx->max_rd_atomic,
+        .max_dest_rd_atomic = conn->ctx->max_dest_rd_atomic,
         // Timeout and min_rnr_timer actual values seem to be 4.096us*2^(timeout+1)
         .min_rnr_timer  = 1,
         .timeout        = 14,
@@ -302,7 +479,45 @@ int msgr_rdma_connection_t::connect(msgr_rdma_address_t *dest)
     return 0;
 }
 
-bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg)
+uint32_t msgr_rdma_connection_t::use_mr(std::vector<msgr_rdma_mr_t*> & used, void *addr, uint32_t & len)
+{
+    if (ctx->mr)
+    {
+        return ctx->mr->lkey;
+    }
+    msgr_rdma_mr_t *chunk = ctx->get_mr_chunk(addr);
+    uintptr_t chunk_end = ((uintptr_t)addr / RDMA_MR_CHUNK + 1) * RDMA_MR_CHUNK;
+    if ((uintptr_t)addr + len > chunk_end)
+    {
+        len = chunk_end - (uintptr_t)addr;
+    }
+    if (!used.size() || used.back() != chunk)
+    {
+        chunk->refs++;
+        used.push_back(chunk);
+    }
+    return chunk->mr->lkey;
+}
+
+void msgr_rdma_connection_t::release_rdv_mr()
+{
+    if (rdv_mr)
+    {
+        ibv_dereg_mr(rdv_mr);
+        rdv_mr = NULL;
+    }
+}
+
+void msgr_rdma_connection_t::release_mrs(std::vector<msgr_rdma_mr_t*> & used)
+{
+    for (auto chunk: used)
+    {
+        chunk->refs--;
+    }
+    used.clear();
+}
+
+bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64_t client_max_msg, bool client_rendezvous)
 {
     // Try to connect to the peer using RDMA
     msgr_rdma_address_t addr;
@@ -312,7 +527,7 @@ bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64
         {
             client_max_msg = rdma_max_msg;
         }
-        auto rdma_conn = msgr_rdma_connection_t::create(rdma_context, rdma_max_send, rdma_max_recv, rdma_max_sge, client_max_msg);
+        auto rdma_conn = msgr_rdma_connection_t::create(rdma_context, peer_fd, rdma_max_send, rdma_max_recv, rdma_max_sge, client_max_msg, rdma_max_inline);
         if (rdma_conn)
         {
             int r = rdma_conn->connect(&addr);
@@ -329,6 +544,7 @@ bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64
                 // Remember connection, but switch to RDMA only after sending the configuration response
                 auto cl = clients.at(peer_fd);
                 cl->rdma_conn = rdma_conn;
+                cl->rdma_conn->rdv_threshold = client_rendezvous ? rdma_rendezvous_threshold : 0;
                 cl->peer_state = PEER_RDMA_CONNECTING;
                 return true;
             }
@@ -337,29 +553,141 @@ bool osd_messenger_t::connect_rdma(int peer_fd, std::string rdma_address, uint64
     return false;
 }
 
-static void try_send_rdma_wr(osd_client_t *cl, ibv_sge *sge, int op_sge)
+// wr_id of a signaled send also contains the number of sends completed with it in the upper 32 bits
+#define RDMA_WR_ID(peer_fd, wr_type, count) (((uint64_t)(count) << 32) | ((uint64_t)(peer_fd)*4 + (wr_type)))
+
+static void try_send_rdma_wr(osd_client_t *cl, ibv_sge *sge, int op_sge, uint32_t imm = 0, int wr_type = RDMA_WR_SEND)
 {
     ibv_send_wr *bad_wr = NULL;
     ibv_send_wr wr = {
-        .wr_id = (uint64_t)(cl->peer_fd*2+1),
+        .wr_id = RDMA_WR_ID(cl->peer_fd, wr_type, 1),
         .sg_list = sge,
         .num_sge = op_sge,
-        .opcode = IBV_WR_SEND,
+        .opcode = imm ? IBV_WR_SEND_WITH_IMM : IBV_WR_SEND,
         .send_flags = IBV_SEND_SIGNALED,
     };
+    wr.imm_data = htonl(imm);
     int err = ibv_post_send(cl->rdma_conn->qp, &wr, &bad_wr);
     if (err || bad_wr)
     {
         fprintf(stderr, "RDMA send failed: %s\n", strerror(err));
         exit(1);
     }
-    cl->rdma_conn->cur_send++;
+    if (wr_type == RDMA_WR_ACK)
+        cl->rdma_conn->cur_ack++;
+    else
+        cl->rdma_conn->cur_send++;
+}
+
+// Add a send to the current batch, <sge> is copied
+static void add_send_rdma_wr(msgr_rdma_connection_t *rc, ibv_sge *sge, int op_sge, uint32_t imm = 0)
+{
+    rc->send_sges.insert(rc->send_sges.end(), sge, sge+op_sge);
+    ibv_send_wr wr = {
+        .num_sge = op_sge,
+        .opcode = imm ? IBV_WR_SEND_WITH_IMM : IBV_WR_SEND,
+    };
+    wr.imm_data = htonl(imm);
+    rc->send_wrs.push_back(wr);
+}
+
+// Post the whole batch with a single ibv_post_send(). Small sends are copied inline, and only
+// every <signal_interval>-th and the last send are signaled: RC sends complete in order, so
+// the completion of a signaled send means that all previous sends are completed too
+static void post_send_rdma_wrs(osd_client_t *cl, int signal_interval)
+{
+    auto rc = cl->rdma_conn;
+    int n = rc->send_wrs.size();
+    if (!n)
+    {
+        return;
+    }
+    ibv_sge *sge = rc->send_sges.data();
+    int unsignaled = 0;
+    for (int i = 0; i < n; i++)
+    {
+        ibv_send_wr & wr = rc->send_wrs[i];
+        uint64_t len = 0;
+        for (int j = 0; j < wr.num_sge; j++)
+            len += sge[j].length;
+        wr.sg_list = sge;
+        sge += wr.num_sge;
+        wr.send_flags = len <= rc->max_inline ? IBV_SEND_INLINE : 0;
+        wr.wr_id = RDMA_WR_ID(cl->peer_fd, RDMA_WR_SEND, 0);
+        unsignaled++;
+        if (unsignaled >= signal_interval || i == n-1)
+        {
+            wr.send_flags |= IBV_SEND_SIGNALED;
+            wr.wr_id = RDMA_WR_ID(cl->peer_fd, RDMA_WR_SEND, unsignaled);
+            unsignaled = 0;
+        }
+        wr.next = i < n-1 ? &rc->send_wrs[i+1] : NULL;
+    }
+    ibv_send_wr *bad_wr = NULL;
+    int err = ibv_post_send(rc->qp, rc->send_wrs.data(), &bad_wr);
+    if (err || bad_wr)
+    {
+        fprintf(stderr, "RDMA send failed: %s\n", strerror(err));
+        exit(1);
+    }
+    rc->cur_send += n;
+    rc->send_wrs.clear();
+    rc->send_sges.clear();
+}
+
+// Send a descriptor of the iovec instead of its contents, the rest of the send list waits for the acknowledgement.
+// Returns false if the payload can't be registered for remote access, then it should be sent normally
+static bool try_send_rdma_rendezvous(osd_client_t *cl, iovec & iov)
+{
+    auto rc = cl->rdma_conn;
+    void *addr = iov.iov_base+rc->send_buf_pos;
+    uint32_t len = (uint32_t)(iov.iov_len-rc->send_buf_pos > UINT32_MAX ? UINT32_MAX : iov.iov_len-rc->send_buf_pos);
+    // The peer only gets access to this payload and only until it acknowledges the transfer
+    rc->rdv_mr = ibv_reg_mr(rc->ctx->pd, addr, len, IBV_ACCESS_REMOTE_READ | IBV_ACCESS_ON_DEMAND);
+    if (!rc->rdv_mr)
+    {
+        fprintf(stderr, "Couldn't register RDMA memory region for a rendezvous transfer: %s, disabling rendezvous for client %d\n",
+            strerror(errno), cl->peer_fd);
+        rc->rdv_threshold = 0;
+        return false;
+    }
+    uint32_t rkey = rc->rdv_mr->rkey;
+    rc->rdv_out = (msgr_rdma_rdv_t){ .addr = (uintptr_t)addr, .len = len, .rkey = rkey };
+    uint32_t rdv_len = sizeof(msgr_rdma_rdv_t);
+    ibv_sge sge = {
+        .addr = (uintptr_t)&rc->rdv_out,
+        .length = rdv_len,
+        .lkey = rc->use_mr(rc->send_mrs, &rc->rdv_out, rdv_len),
+    };
+    if (rdv_len < sizeof(msgr_rdma_rdv_t))
+    {
+        // Descriptor crosses a chunk boundary, send it as 2 parts
+        ibv_sge sge2[2] = { sge, {
+            .addr = (uintptr_t)&rc->rdv_out + rdv_len,
+            .length = (uint32_t)(sizeof(msgr_rdma_rdv_t) - rdv_len),
+        } };
+        uint32_t rest = sge2[1].length;
+        sge2[1].lkey = rc->use_mr(rc->send_mrs, (void*)sge2[1].addr, rest);
+        add_send_rdma_wr(rc, sge2, 2, RDMA_IMM_RDV);
+    }
+    else
+    {
+        add_send_rdma_wr(rc, &sge, 1, RDMA_IMM_RDV);
+    }
+    rc->rdv_wait = true;
+    rc->send_buf_pos += len;
+    if (rc->send_buf_pos >= iov.iov_len)
+    {
+        rc->send_pos++;
+        rc->send_buf_pos = 0;
+    }
+    return true;
 }
 
 bool osd_messenger_t::try_send_rdma(osd_client_t *cl)
 {
     auto rc = cl->rdma_conn;
-    if (!cl->send_list.size() || rc->cur_send > 0)
+    if (!cl->send_list.size() || rc->cur_send > 0 || rc->rdv_wait)
     {
         // Only send one batch at a time
         return true;
@@ -371,20 +699,39 @@ bool osd_messenger_t::try_send_rdma(osd_client_t *cl)
         iovec & iov = cl->send_list[rc->send_pos];
         if (op_size >= rc->max_msg || op_sge >= rc->max_sge)
         {
-            try_send_rdma_wr(cl, sge, op_sge);
+            add_send_rdma_wr(rc, sge, op_sge);
             op_sge = 0;
             op_size = 0;
-            if (rc->cur_send >= rc->max_send)
+            if (rc->send_wrs.size() >= rc->max_send)
+            {
+                break;
+            }
+        }
+        if (rc->rdv_threshold > 0 && iov.iov_len-rc->send_buf_pos >= rc->rdv_threshold)
+        {
+            // Large buffer, let the peer read it
+            if (op_sge > 0)
+            {
+                add_send_rdma_wr(rc, sge, op_sge);
+                op_sge = 0;
+                op_size = 0;
+                if (rc->send_wrs.size() >= rc->max_send)
+                {
+                    break;
+                }
+            }
+            if (try_send_rdma_rendezvous(cl, iov))
             {
                 break;
             }
         }
         uint32_t len = (uint32_t)(op_size+iov.iov_len-rc->send_buf_pos < rc->max_msg
             ? iov.iov_len-rc->send_buf_pos : rc->max_msg-op_size);
+        uint32_t lkey = rc->use_mr(rc->send_mrs, iov.iov_base+rc->send_buf_pos, len);
         sge[op_sge++] = {
             .addr = (uintptr_t)(iov.iov_base+rc->send_buf_pos),
             .length = len,
-            .lkey = rc->ctx->mr->lkey,
+            .lkey = lkey,
         };
         op_size += len;
         rc->send_buf_pos += len;
@@ -396,16 +743,141 @@ bool osd_messenger_t::try_send_rdma(osd_client_t *cl)
     }
     if (op_sge > 0)
     {
-        try_send_rdma_wr(cl, sge, op_sge);
+        add_send_rdma_wr(rc, sge, op_sge);
     }
+    post_send_rdma_wrs(cl, rdma_signal_interval);
     return true;
 }
 
+void osd_messenger_t::finish_rdma_send(osd_client_t *cl)
+{
+    // Called when the whole batch is sent and acknowledged
+    cl->rdma_conn->release_mrs(cl->rdma_conn->send_mrs);
+    for (int i = 0; i < cl->rdma_conn->send_pos; i++)
+    {
+        if (cl->outbox[i].flags & MSGR_SENDP_FREE)
+        {
+            // Reply fully sent
+            delete cl->outbox[i].op;
+        }
+    }
+    if (cl->rdma_conn->send_pos > 0)
+    {
+        cl->send_list.erase(cl->send_list.begin(), cl->send_list.begin()+cl->rdma_conn->send_pos);
+        cl->outbox.erase(cl->outbox.begin(), cl->outbox.begin()+cl->rdma_conn->send_pos);
+        cl->rdma_conn->send_pos = 0;
+    }
+    if (cl->rdma_conn->send_buf_pos > 0)
+    {
+        cl->send_list[0].iov_base += cl->rdma_conn->send_buf_pos;
+        cl->send_list[0].iov_len -= cl->rdma_conn->send_buf_pos;
+        cl->rdma_conn->send_buf_pos = 0;
+    }
+    try_send_rdma(cl);
+}
+
+// Read the incoming rendezvous buffer directly into the receive list
+bool osd_messenger_t::try_read_rdma(osd_client_t *cl)
+{
+    auto rc = cl->rdma_conn;
+    if (!rc->rdv_active)
+    {
+        return true;
+    }
+    while (rc->rdv_in.len > 0 && rc->cur_read+rc->cur_ack < RDMA_MAX_READS)
+    {
+        ibv_sge sge[rc->max_read_sge];
+        int op_sge = 0;
+        uint64_t op_size = 0;
+        while (op_sge < rc->max_read_sge && op_size < rc->rdv_in.len)
+        {
+            if (cl->recv_list.done >= cl->recv_list.count)
+            {
+                fprintf(stderr, "Client %d sent more rendezvous data than expected, stopping client\n", cl->peer_fd);
+                stop_client(cl->peer_fd);
+                return false;
+            }
+            iovec *cur = cl->recv_list.get_iovec();
+            uint32_t len = (uint32_t)(cur->iov_len < rc->rdv_in.len-op_size ? cur->iov_len : rc->rdv_in.len-op_size);
+            uint32_t lkey = rc->use_mr(rc->read_mrs, cur->iov_base, len);
+            sge[op_sge++] = {
+                .addr = (uintptr_t)cur->iov_base,
+                .length = len,
+                .lkey = lkey,
+            };
+            // Nothing else is received from the peer until the acknowledgement, so it's fine to advance now
+            cl->recv_list.eat(len);
+            cl->read_remaining -= len;
+            op_size += len;
+        }
+        ibv_send_wr *bad_wr = NULL;
+        ibv_send_wr wr = {
+            .wr_id = (uint64_t)cl->peer_fd*4 + RDMA_WR_READ,
+            .sg_list = sge,
+            .num_sge = op_sge,
+            .opcode = IBV_WR_RDMA_READ,
+            .send_flags = IBV_SEND_SIGNALED,
+        };
+        wr.wr.rdma.remote_addr = rc->rdv_in.addr;
+        wr.wr.rdma.rkey = rc->rdv_in.rkey;
+        int err = ibv_post_send(rc->qp, &wr, &bad_wr);
+        if (err || bad_wr)
+        {
+            fprintf(stderr, "RDMA read failed: %s\n", strerror(err));
+            exit(1);
+        }
+        rc->cur_read++;
+        rc->rdv_in.addr += op_size;
+        rc->rdv_in.len -= op_size;
+    }
+    if (!rc->rdv_in.len && !rc->cur_read)
+    {
+        // Transfer is finished, let the peer continue
+        rc->rdv_active = false;
+        rc->release_mrs(rc->read_mrs);
+        try_send_rdma_wr(cl, NULL, 0, RDMA_IMM_RDV_ACK, RDMA_WR_ACK);
+        if (cl->recv_list.done >= cl->recv_list.count)
+        {
+            return handle_finished_read(cl);
+        }
+    }
+    return true;
+}
+
+bool osd_messenger_t::handle_rdma_recv(osd_client_t *cl, void *buf, uint32_t len, ibv_wc *wc)
+{
+    if (!(wc->wc_flags & IBV_WC_WITH_IMM))
+    {
+        return handle_read_buffer(cl, buf, len);
+    }
+    uint32_t imm = ntohl(wc->imm_data);
+    auto rc = cl->rdma_conn;
+    if (imm == RDMA_IMM_RDV && len == sizeof(msgr_rdma_rdv_t) && !rc->rdv_active)
+    {
+        memcpy(&rc->rdv_in, buf, sizeof(msgr_rdma_rdv_t));
+        rc->rdv_active = true;
+        return try_read_rdma(cl);
+    }
+    else if (imm == RDMA_IMM_RDV_ACK && rc->rdv_wait)
+    {
+        rc->rdv_wait = false;
+        rc->release_rdv_mr();
+        if (!rc->cur_send)
+        {
+            finish_rdma_send(cl);
+        }
+        return true;
+    }
+    fprintf(stderr, "Unexpected RDMA message from client %d (immediate data %u), stopping client\n", cl->peer_fd, imm);
+    stop_client(cl->peer_fd);
+    return false;
+}
+
 static void try_recv_rdma_wr(osd_client_t *cl, ibv_sge *sge, int op_sge)
 {
     ibv_recv_wr *bad_wr = NULL;
     ibv_recv_wr wr = {
-        .wr_id = (uint64_t)(cl->peer_fd*2),
+        .wr_id = (uint64_t)cl->peer_fd*4 + RDMA_WR_RECV,
         .sg_list = sge,
         .num_sge = op_sge,
     };
@@ -421,14 +893,55 @@ static void try_recv_rdma_wr(osd_client_t *cl, ibv_sge *sge, int op_sge)
 bool osd_messenger_t::try_recv_rdma(osd_client_t *cl)
 {
     auto rc = cl->rdma_conn;
+    if (rc->ctx->srq)
+    {
+        // Receive buffers are shared, only handle messages which arrived before switching to RDMA
+        if (!rc->early_recv.size())
+        {
+            return true;
+        }
+        auto early_recv = std::move(rc->early_recv);
+        rc->early_recv.clear();
+        cl->refs++;
+        for (auto & msg: early_recv)
+        {
+            if (!handle_rdma_recv(cl, (void*)msg.first.data(), msg.first.size(), &msg.second))
+            {
+                break;
+            }
+        }
+        for (auto cb: set_immediate)
+        {
+            cb();
+        }
+        set_immediate.clear();
+        cl->refs--;
+        if (cl->peer_state == PEER_STOPPED)
+        {
+            if (cl->refs <= 0)
+            {
+                delete cl;
+            }
+            return false;
+        }
+        return true;
+    }
+    if (!rc->recv_buf)
+    {
+        // Buffers are allocated only now because max_msg may be lowered during connection setup
+        rc->recv_buf = (uint8_t*)malloc_or_die(rc->max_recv*rc->max_msg);
+        if (!rc->ctx->mr)
+        {
+            rc->recv_mr = rc->ctx->reg_mr(rc->recv_buf, rc->max_recv*rc->max_msg);
+        }
+    }
     while (rc->cur_recv < rc->max_recv)
     {
-        void *buf = malloc_or_die(rc->max_msg);
-        rc->recv_buffers.push_back(buf);
+        int buf_num = (rc->recv_pos + rc->cur_recv) % rc->max_recv;
         ibv_sge sge = {
-            .addr = (uintptr_t)buf,
+            .addr = (uintptr_t)(rc->recv_buf + buf_num*rc->max_msg),
             .length = (uint32_t)rc->max_msg,
-            .lkey = rc->ctx->mr->lkey,
+            .lkey = rc->recv_mr ? rc->recv_mr->lkey : rc->ctx->mr->lkey,
         };
         try_recv_rdma_wr(cl, &sge, 1);
     }
@@ -437,9 +950,15 @@ bool osd_messenger_t::try_recv_rdma(osd_client_t *cl)
 
 #define RDMA_EVENTS_AT_ONCE 32
 
+static uint64_t rdma_now_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000ul + now.tv_nsec/1000;
+}
+
 void osd_messenger_t::handle_rdma_events()
 {
-    // Request next notification
     ibv_cq *ev_cq;
     void *ev_ctx;
     // FIXME: This is inefficient as it calls read()...
@@ -447,23 +966,79 @@ void osd_messenger_t::handle_rdma_events()
     {
         ibv_ack_cq_events(rdma_context->cq, 1);
     }
+    if (rdma_poll_us > 0 && ringloop)
+    {
+        // Don't request the next notification, poll the CQ from the ring loop while completions
+        // keep coming and only re-arm the completion channel after <rdma_poll_us> without them
+        if (!rdma_polling)
+        {
+            rdma_polling = true;
+            ringloop->register_consumer(&rdma_poll_consumer);
+        }
+        rdma_poll_until_us = rdma_now_us() + rdma_poll_us;
+        poll_rdma_cq();
+        ringloop->wakeup();
+        return;
+    }
+    // Request next notification
     if (ibv_req_notify_cq(rdma_context->cq, 0) != 0)
     {
         fprintf(stderr, "Failed to request RDMA completion notification, exiting\n");
         exit(1);
     }
+    while (poll_rdma_cq() > 0) {}
+}
+
+void osd_messenger_t::busy_poll_rdma()
+{
+    if (poll_rdma_cq() > 0)
+    {
+        rdma_poll_until_us = rdma_now_us() + rdma_poll_us;
+    }
+    else if (rdma_now_us() >= rdma_poll_until_us)
+    {
+        // Idle, go back to waiting for notifications. Completions which arrive before re-arming
+        // don't generate an event, so poll once more after it
+        rdma_polling = false;
+        ringloop->unregister_consumer(&rdma_poll_consumer);
+        if (ibv_req_notify_cq(rdma_context->cq, 0) != 0)
+        {
+            fprintf(stderr, "Failed to request RDMA completion notification, exiting\n");
+            exit(1);
+        }
+        while (poll_rdma_cq() > 0) {}
+        return;
+    }
+    ringloop->wakeup();
+}
+
+int osd_messenger_t::poll_rdma_cq()
+{
     ibv_wc wc[RDMA_EVENTS_AT_ONCE];
-    int event_count;
+    int event_count, total = 0;
     do
     {
         event_count = ibv_poll_cq(rdma_context->cq, RDMA_EVENTS_AT_ONCE, wc);
+        total += event_count > 0 ? event_count : 0;
         for (int i = 0; i < event_count; i++)
         {
-            int client_id = wc[i].wr_id >> 1;
-            bool is_send = wc[i].wr_id & 1;
+            int client_id = (uint32_t)wc[i].wr_id >> 2;
+            int wr_type = wc[i].wr_id & 3;
+            int srq_buf_num = -1;
+            if (wr_type == RDMA_WR_RECV && rdma_context->srq)
+            {
+                // SRQ receive requests are identified by buffer, the client is found by QP number
+                srq_buf_num = client_id;
+                auto qp_it = rdma_context->srq_clients.find(wc[i].qp_num);
+                client_id = qp_it != rdma_context->srq_clients.end() ? qp_it->second : -1;
+            }
             auto cl_it = clients.find(client_id);
             if (cl_it == clients.end())
             {
+                if (srq_buf_num >= 0)
+                {
+                    rdma_context->post_srq_recv(srq_buf_num);
+                }
                 continue;
             }
             osd_client_t *cl = cl_it->second;
@@ -476,54 +1051,70 @@ void osd_messenger_t::handle_rdma_events()
                 }
                 fprintf(stderr, " with status: %s, stopping client\n", ibv_wc_status_str(wc[i].status));
                 stop_client(client_id);
+                if (srq_buf_num >= 0)
+                {
+                    rdma_context->post_srq_recv(srq_buf_num);
+                }
                 continue;
             }
-            if (!is_send)
+            auto rc = cl->rdma_conn;
+            if (srq_buf_num >= 0)
+            {
+                // Received data is copied, so the buffer may be reused immediately
+                uint8_t *buf = rdma_context->srq_buf + srq_buf_num*rdma_context->srq_buf_size;
+                if (cl->peer_state != PEER_RDMA)
+                {
+                    // The peer already switched to RDMA, but we didn't yet
+                    rc->early_recv.push_back({ std::string((char*)buf, wc[i].byte_len), wc[i] });
+                }
+                else
+                {
+                    handle_rdma_recv(cl, buf, wc[i].byte_len, &wc[i]);
+                }
+                rdma_context->post_srq_recv(srq_buf_num);
+            }
+            else if (wr_type == RDMA_WR_RECV)
             {
-                cl->rdma_conn->cur_recv--;
-                if (!handle_read_buffer(cl, cl->rdma_conn->recv_buffers[0], wc[i].byte_len))
+                void *buf = rc->recv_buf + rc->recv_pos*rc->max_msg;
+                rc->cur_recv--;
+                rc->recv_pos = (rc->recv_pos+1) % rc->max_recv;
+                if (!handle_rdma_recv(cl, buf, wc[i].byte_len, &wc[i]))
                 {
                     // handle_read_buffer may stop the client
                     continue;
                 }
-                free(cl->rdma_conn->recv_buffers[0]);
-                cl->rdma_conn->recv_buffers.erase(cl->rdma_conn->recv_buffers.begin(), cl->rdma_conn->recv_buffers.begin()+1);
                 try_recv_rdma(cl);
             }
+            else if (wr_type == RDMA_WR_READ)
+            {
+                rc->cur_read--;
+                try_read_rdma(cl);
+            }
+            else if (wr_type == RDMA_WR_ACK)
+            {
+                rc->cur_ack--;
+                if (rc->rdv_active)
+                {
+                    // A READ may be waiting for a free send queue slot
+                    try_read_rdma(cl);
+                }
+            }
             else
             {
-                cl->rdma_conn->cur_send--;
-                if (!cl->rdma_conn->cur_send)
+                // A signaled send also completes previous unsignaled ones
+                rc->cur_send -= (int)(wc[i].wr_id >> 32);
+                if (!rc->cur_send && !rc->rdv_wait)
                 {
                     // Wait for the whole batch
-                    for (int i = 0; i < cl->rdma_conn->send_pos; i++)
-                    {
-                        if (cl->outbox[i].flags & MSGR_SENDP_FREE)
-                        {
-                            // Reply fully sent
-                            delete cl->outbox[i].op;
-                        }
-                    }
-                    if (cl->rdma_conn->send_pos > 0)
-                    {
-                        cl->send_list.erase(cl->send_list.begin(), cl->send_list.begin()+cl->rdma_conn->send_pos);
-                        cl->outbox.erase(cl->outbox.begin(), cl->outbox.begin()+cl->rdma_conn->send_pos);
-                        cl->rdma_conn->send_pos = 0;
-                    }
-                    if (cl->rdma_conn->send_buf_pos > 0)
-                    {
-                        cl->send_list[0].iov_base += cl->rdma_conn->send_buf_pos;
-                        cl->send_list[0].iov_len -= cl->rdma_conn->send_buf_pos;
-                        cl->rdma_conn->send_buf_pos = 0;
-                    }
-                    try_send_rdma(cl);
+                    finish_rdma_send(cl);
                 }
             }
         }
-    } while (event_count > 0);
+    } while (event_count == RDMA_EVENTS_AT_ONCE);
     for (auto cb: set_immediate)
     {
         cb();
     }
     set_immediate.clear();
+    return total;
 }
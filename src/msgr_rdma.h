@@ -5,6 +5,16 @@
 #include <infiniband/verbs.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <unordered_map>
+
+// Send buffers are registered in aligned chunks of this size when the device can't do implicit ODP
+#define RDMA_MR_CHUNK (16*1024*1024)
+#define RDMA_MAX_MR_CHUNKS 1024
+// Maximum number of RDMA READs in flight per connection for rendezvous transfers
+#define RDMA_MAX_READS 16
+// Send queue entries reserved for rendezvous READs and acknowledgements
+#define RDMA_RDV_SEND_WR (RDMA_MAX_READS+2)
 
 struct msgr_rdma_address_t
 {
@@ -17,6 +27,22 @@ struct msgr_rdma_address_t
     static bool from_string(const char *str, msgr_rdma_address_t *dest);
 };
 
+struct msgr_rdma_mr_t
+{
+    ibv_mr *mr = NULL;
+    int refs = 0;
+    uint64_t last_used = 0;
+};
+
+// Rendezvous descriptor: sent instead of a large buffer, the peer reads it with RDMA READ
+// and acknowledges the transfer with an empty message
+struct __attribute__((__packed__)) msgr_rdma_rdv_t
+{
+    uint64_t addr;
+    uint64_t len;
+    uint32_t rkey;
+};
+
 struct msgr_rdma_context_t
 {
     ibv_context *context = NULL;
@@ -34,8 +60,33 @@ struct msgr_rdma_context_t
     uint32_t mtu;
     int max_cqe = 0;
     int used_max_cqe = 0;
+    // Long-lived regions are never remotely accessible. Rendezvous transfers register
+    // a separate remote-readable region for each payload, and only if <remote_read> is set
+    int mr_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND;
+    bool remote_read = false;
+    uint8_t max_rd_atomic = 1, max_dest_rd_atomic = 1;
+
+    // Explicit ODP memory regions by chunk number, used when <mr> (implicit ODP) isn't available
+    std::unordered_map<uintptr_t, msgr_rdma_mr_t> mr_chunks;
+    uint64_t mr_use_counter = 0;
+
+    // Shared receive queue. Each buffer is <srq_buf_size> bytes, wr_id = buffer number*2
+    ibv_srq *srq = NULL;
+    ibv_mr *srq_mr = NULL;
+    uint8_t *srq_buf = NULL;
+    uint32_t srq_size = 0;
+    uint64_t srq_buf_size = 0;
+    // Client FDs by QP number, for receive completions from the SRQ. QPs are added when they're
+    // created because the peer may start sending before the connection is switched to RDMA here
+    std::map<uint32_t, int> srq_clients;
 
-    static msgr_rdma_context_t *create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu);
+    static msgr_rdma_context_t *create(const char *ib_devname, uint8_t ib_port, uint8_t gid_index, uint32_t mtu, bool remote_read);
+    bool reserve_cqe(int count);
+    bool create_srq(uint32_t size, uint64_t buf_size);
+    void post_srq_recv(uint32_t buf_num);
+    ibv_mr *reg_mr(void *buf, size_t len);
+    // Get the memory region for the chunk containing <addr>, registering it if required
+    msgr_rdma_mr_t *get_mr_chunk(void *addr);
     ~msgr_rdma_context_t();
 };
 
@@ -47,12 +98,43 @@ struct msgr_rdma_connection_t
     int max_send = 0, max_recv = 0, max_sge = 0;
     int cur_send = 0, cur_recv = 0;
     uint64_t max_msg = 0;
+    // Sends of up to <max_inline> bytes are copied into the WQE (IBV_SEND_INLINE)
+    uint32_t max_inline = 0;
+    // WRs of the current send batch, posted together
+    std::vector<ibv_send_wr> send_wrs;
+    std::vector<ibv_sge> send_sges;
 
     int send_pos = 0, send_buf_pos = 0;
-    int recv_pos = 0, recv_buf_pos = 0;
-    std::vector<void*> recv_buffers;
+    // Buffers of at least <rdv_threshold> bytes are sent using rendezvous, 0 = disabled
+    uint64_t rdv_threshold = 0;
+    // Outgoing rendezvous waiting for the acknowledgement
+    bool rdv_wait = false;
+    msgr_rdma_rdv_t rdv_out;
+    // Remote-readable region covering exactly the outgoing rendezvous payload,
+    // deregistered when the peer acknowledges the transfer
+    ibv_mr *rdv_mr = NULL;
+    // Incoming rendezvous being read
+    bool rdv_active = false;
+    msgr_rdma_rdv_t rdv_in;
+    int cur_read = 0, cur_ack = 0, max_read_sge = 0;
+    std::vector<msgr_rdma_mr_t*> read_mrs;
+    // Memory regions referenced by the current send batch
+    std::vector<msgr_rdma_mr_t*> send_mrs;
+    // Private receive buffer ring, only used without SRQ.
+    // The receive queue is FIFO, so the next completion always refers to <recv_pos>
+    int recv_pos = 0;
+    uint8_t *recv_buf = NULL;
+    ibv_mr *recv_mr = NULL;
+    // Messages received from the SRQ before the connection is switched to RDMA, handled by try_recv_rdma()
+    std::vector<std::pair<std::string, ibv_wc>> early_recv;
 
     ~msgr_rdma_connection_t();
-    static msgr_rdma_connection_t *create(msgr_rdma_context_t *ctx, uint32_t max_send, uint32_t max_recv, uint32_t max_sge, uint32_t max_msg);
+    static msgr_rdma_connection_t *create(msgr_rdma_context_t *ctx, int peer_fd, uint32_t max_send, uint32_t max_recv,
+        uint32_t max_sge, uint32_t max_msg, uint32_t max_inline = 0);
     int connect(msgr_rdma_address_t *dest);
+    // Get lkey for <addr> and shorten <len> so that it doesn't cross a memory region
+    // boundary. The region is referenced in <used> until release_mrs(used)
+    uint32_t use_mr(std::vector<msgr_rdma_mr_t*> & used, void *addr, uint32_t & len);
+    void release_rdv_mr();
+    void release_mrs(std::vector<msgr_rdma_mr_t*> & used);
 };
@@ -1,6 +1,9 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
+#define _XOPEN_SOURCE
+#include <limits.h>
+
 #include "messenger.h"
 
 void osd_messenger_t::read_requests()
@@ -13,19 +16,28 @@ void osd_messenger_t::read_requests()
         {
             continue;
         }
-        if (cl->read_remaining < receive_buffer_size)
+        if (cl->read_remaining < direct_read_threshold)
         {
             cl->read_iov.iov_base = cl->in_buf;
             cl->read_iov.iov_len = receive_buffer_size;
+            if (cl->direct_replies_inflight > 0 && (!cl->read_op || cl->read_state == CL_READ_HDR))
+            {
+                // Stop at the end of the next header: it may be followed by a large read payload
+                cl->read_iov.iov_len = cl->read_op ? cl->read_remaining : OSD_PACKET_SIZE;
+            }
             cl->read_msg.msg_iov = &cl->read_iov;
             cl->read_msg.msg_iovlen = 1;
         }
         else
         {
+            // Read the payload directly into operation buffers, and whatever follows it
+            // (usually next headers) into in_buf. The extra iovec is removed in handle_read()
+            uint32_t extra = cl->direct_replies_inflight > 0 ? OSD_PACKET_SIZE : receive_buffer_size;
+            cl->recv_list.push_back(cl->in_buf, extra);
             cl->read_iov.iov_base = 0;
-            cl->read_iov.iov_len = cl->read_remaining;
+            cl->read_iov.iov_len = cl->read_remaining + extra;
             cl->read_msg.msg_iov = cl->recv_list.get_iovec();
-            cl->read_msg.msg_iovlen = cl->recv_list.get_size();
+            cl->read_msg.msg_iovlen = cl->recv_list.get_size() < IOV_MAX ? cl->recv_list.get_size() : IOV_MAX;
         }
         cl->refs++;
         if (ringloop && !use_sync_send_recv)
@@ -33,6 +45,8 @@ void osd_messenger_t::read_requests()
             io_uring_sqe* sqe = ringloop->get_sqe();
             if (!sqe)
             {
+                if (!cl->read_iov.iov_base)
+                    cl->recv_list.count--;
                 cl->read_msg.msg_iovlen = 0;
                 read_ready_clients.erase(read_ready_clients.begin(), read_ready_clients.begin() + i);
                 return;
@@ -54,11 +68,87 @@ void osd_messenger_t::read_requests()
     read_ready_clients.clear();
 }
 
+void osd_messenger_t::start_multishot_recv(osd_client_t *cl)
+{
+#ifdef IORING_RECV_MULTISHOT
+    io_uring_sqe* sqe = ringloop->get_sqe();
+    if (!sqe)
+    {
+        ringloop->wait_sqe([this, cl, peer_fd = cl->peer_fd]()
+        {
+            auto cl_it = clients.find(peer_fd);
+            if (cl_it != clients.end() && cl_it->second == cl && !cl->multishot_data)
+                start_multishot_recv(cl);
+        });
+        return;
+    }
+    cl->refs++;
+    ring_data_t* data = ((ring_data_t*)sqe->user_data);
+    cl->multishot_data = data;
+    data->callback = [this, cl](ring_data_t *data) { handle_multishot_recv(cl, data->res, data->cqe_flags, data->more); };
+    my_uring_prep_recv_multishot(sqe, cl->peer_fd, MSGR_BUF_GROUP);
+    ringloop->wakeup();
+#endif
+}
+
+void osd_messenger_t::handle_multishot_recv(osd_client_t *cl, int result, unsigned cqe_flags, bool more)
+{
+#ifdef IORING_RECV_MULTISHOT
+    // Data arriving over TCP after switching to RDMA is ignored, like in the epoll mode
+    if (result > 0 && (cqe_flags & IORING_CQE_F_BUFFER) &&
+        cl->peer_state != PEER_STOPPED && cl->peer_state != PEER_RDMA)
+    {
+        rearm_quickack(cl);
+        // handle_read_buffer() copies data, so the buffer is returned to the ring right away
+        handle_read_buffer(cl, ringloop->get_selected_buf(MSGR_BUF_GROUP, cqe_flags), result);
+    }
+    if (cqe_flags & IORING_CQE_F_BUFFER)
+    {
+        ringloop->recycle_buf(MSGR_BUF_GROUP, cqe_flags);
+    }
+    if (!more)
+    {
+        cl->multishot_data = NULL;
+        cl->refs--;
+        if (cl->peer_state == PEER_STOPPED)
+        {
+            if (cl->refs <= 0)
+            {
+                delete cl;
+            }
+        }
+        else if (result > 0 || result == -ENOBUFS)
+        {
+            // Multishot receive was terminated by the kernel, i.e. because all buffers were in use
+            start_multishot_recv(cl);
+        }
+        else if (cl->peer_state != PEER_RDMA)
+        {
+            if (result < 0)
+            {
+                fprintf(stderr, "Client %d socket read error: %d (%s). Disconnecting client\n", cl->peer_fd, -result, strerror(-result));
+            }
+            stop_client(cl->peer_fd);
+        }
+    }
+    for (auto cb: set_immediate)
+    {
+        cb();
+    }
+    set_immediate.clear();
+#endif
+}
+
 bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
 {
     bool ret = false;
     cl->read_msg.msg_iovlen = 0;
     cl->refs--;
+    if (!cl->read_iov.iov_base)
+    {
+        // Remove in_buf from the direct read list
+        cl->recv_list.count--;
+    }
     if (cl->peer_state == PEER_STOPPED)
     {
         if (cl->refs <= 0)
@@ -89,6 +179,7 @@ bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
     }
     if (result > 0)
     {
+        rearm_quickack(cl);
         if (cl->read_iov.iov_base == cl->in_buf)
         {
             if (!handle_read_buffer(cl, cl->in_buf, result))
@@ -99,11 +190,19 @@ bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
         else
         {
             // Long data
-            cl->read_remaining -= result;
-            cl->recv_list.eat(result);
+            int payload = result < cl->read_remaining ? result : cl->read_remaining;
+            cl->read_remaining -= payload;
+            cl->recv_list.eat(payload);
             if (cl->recv_list.done >= cl->recv_list.count)
             {
-                handle_finished_read(cl);
+                if (!handle_finished_read(cl))
+                {
+                    goto fin;
+                }
+            }
+            if (result > payload && !handle_read_buffer(cl, cl->in_buf, result-payload))
+            {
+                goto fin;
             }
         }
         if (result >= cl->read_iov.iov_len)
@@ -174,7 +273,7 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
         if (cl->read_op->req.hdr.magic == SECONDARY_OSD_REPLY_MAGIC)
             return handle_reply_hdr(cl);
         else if (cl->read_op->req.hdr.magic == SECONDARY_OSD_OP_MAGIC)
-            handle_op_hdr(cl);
+            return handle_op_hdr(cl);
         else
         {
             fprintf(stderr, "Received garbage: magic=%lx id=%lu opcode=%lx from %d\n", cl->read_op->req.hdr.magic, cl->read_op->req.hdr.id, cl->read_op->req.hdr.opcode, cl->peer_fd);
@@ -204,7 +303,7 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
     return true;
 }
 
-void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
+bool osd_messenger_t::handle_op_hdr(osd_client_t *cl)
 {
     osd_op_t *cur_op = cl->read_op;
     if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ)
@@ -248,18 +347,59 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         }
         cl->read_remaining = cur_op->req.sec_read_bmp.len;
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_BATCH)
+    {
+        if (cur_op->req.sec_batch.desc_len > OSD_RW_MAX || cur_op->req.sec_batch.data_len > OSD_RW_MAX)
+        {
+            fprintf(stderr, "Peer %d sent a too large subop batch (%lu+%lu bytes), disconnecting\n",
+                cl->peer_fd, cur_op->req.sec_batch.desc_len, cur_op->req.sec_batch.data_len);
+            stop_client(cl->peer_fd);
+            return false;
+        }
+        uint64_t len = cur_op->req.sec_batch.desc_len + cur_op->req.sec_batch.data_len;
+        if (len > 0)
+        {
+            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, len);
+            cl->recv_list.push_back(cur_op->buf, len);
+        }
+        cl->read_remaining = len;
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_LIST)
+    {
+        cl->read_remaining = 0;
+        if ((cur_op->req.sec_list.flags & OSD_LIST_CHANGED) && cur_op->req.sec_list.changed_len > 0)
+        {
+            cur_op->buf = malloc_or_die(cur_op->req.sec_list.changed_len);
+            cl->recv_list.push_back(cur_op->buf, cur_op->req.sec_list.changed_len);
+            cl->read_remaining = cur_op->req.sec_list.changed_len;
+        }
+    }
     else if (cur_op->req.hdr.opcode == OSD_OP_READ)
     {
         cl->read_remaining = 0;
     }
     else if (cur_op->req.hdr.opcode == OSD_OP_WRITE)
     {
-        if (cur_op->req.rw.len > 0)
+        uint64_t len = cur_op->req.rw.len;
+        if (cur_op->req.rw.flags & OSD_WRITE_PARITY)
+        {
+            if (cur_op->req.rw.parity_len > OSD_RW_MAX)
+            {
+                // The payload can't be skipped without reading it, so the stream is lost
+                fprintf(stderr, "Client %d sent a write with too large parity (%u bytes), disconnecting\n",
+                    cl->peer_fd, cur_op->req.rw.parity_len);
+                stop_client(cl->peer_fd);
+                return false;
+            }
+            // Parity chunks calculated by the client follow the data
+            len += cur_op->req.rw.parity_len;
+        }
+        if (len > 0)
         {
-            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.rw.len);
-            cl->recv_list.push_back(cur_op->buf, cur_op->req.rw.len);
+            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, len);
+            cl->recv_list.push_back(cur_op->buf, len);
         }
-        cl->read_remaining = cur_op->req.rw.len;
+        cl->read_remaining = len;
     }
     else if (cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)
     {
@@ -284,6 +424,15 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         cl->read_op = NULL;
         cl->read_state = 0;
     }
+    return true;
+}
+
+// Large read replies are received directly into operation buffers with <direct_read_replies>
+bool osd_messenger_t::is_direct_read_reply(osd_op_t *op)
+{
+    return direct_read_replies && !(ringloop && use_multishot_recv && multishot_recv_supported) &&
+        (op->req.hdr.opcode == OSD_OP_READ && op->req.rw.len >= direct_read_threshold ||
+        op->req.hdr.opcode == OSD_OP_SEC_READ && op->req.sec_rw.len >= direct_read_threshold);
 }
 
 bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
@@ -299,6 +448,10 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
     osd_op_t *op = req_it->second;
     memcpy(op->reply.buf, cl->read_op->req.buf, OSD_PACKET_SIZE);
     cl->sent_ops.erase(req_it);
+    if (is_direct_read_reply(op))
+    {
+        cl->direct_replies_inflight--;
+    }
     if (op->reply.hdr.opcode == OSD_OP_SEC_READ || op->reply.hdr.opcode == OSD_OP_READ)
     {
         // Read data. In this case we assume that the buffer is preallocated by the caller (!)
@@ -353,7 +506,20 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         op->buf = memalign_or_die(MEM_ALIGNMENT, cl->read_remaining);
         cl->recv_list.push_back(op->buf, cl->read_remaining);
     }
-    else if (op->reply.hdr.opcode == OSD_OP_SHOW_CONFIG && op->reply.hdr.retval > 0)
+    else if (op->reply.hdr.opcode == OSD_OP_SEC_BATCH && op->reply.hdr.retval > 0)
+    {
+        // Results and read data are copied to the batched subops by the OSD
+        delete cl->read_op;
+        cl->read_op = op;
+        cl->read_state = CL_READ_REPLY_DATA;
+        cl->read_remaining = op->reply.hdr.retval;
+        free(op->buf);
+        op->buf = memalign_or_die(MEM_ALIGNMENT, cl->read_remaining);
+        cl->recv_list.push_back(op->buf, cl->read_remaining);
+    }
+    else if ((op->reply.hdr.opcode == OSD_OP_SHOW_CONFIG || op->reply.hdr.opcode == OSD_OP_SHOW_TRACES ||
+        op->reply.hdr.opcode == OSD_OP_SHOW_MEMORY) &&
+        op->reply.hdr.retval > 0)
     {
         delete cl->read_op;
         cl->read_op = op;
@@ -386,10 +552,12 @@ void osd_messenger_t::handle_reply_ready(osd_op_t *op)
         stats.subop_stat_count[op->req.hdr.opcode]++;
         stats.subop_stat_sum[op->req.hdr.opcode] = 0;
     }
-    stats.subop_stat_sum[op->req.hdr.opcode] += (
+    uint64_t usec = (
         (tv_end.tv_sec - op->tv_begin.tv_sec)*1000000 +
         (tv_end.tv_nsec - op->tv_begin.tv_nsec)/1000
     );
+    stats.subop_stat_sum[op->req.hdr.opcode] += usec;
+    stats.subop_stat_hist[op->req.hdr.opcode].add(usec);
     set_immediate.push_back([this, op]()
     {
         // Copy lambda to be unaffected by `delete op`
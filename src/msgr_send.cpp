@@ -13,6 +13,7 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
     if (cur_op->op_type == OSD_OP_OUT)
     {
         clock_gettime(CLOCK_REALTIME, &cur_op->tv_begin);
+        cur_op->req.trace.trace_id = cur_op->trace_id;
     }
     else
     {
@@ -45,6 +46,10 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
     {
         to_send_list.push_back((iovec){ .iov_base = cur_op->req.buf, .iov_len = OSD_PACKET_SIZE });
         cl->sent_ops[cur_op->req.hdr.id] = cur_op;
+        if (is_direct_read_reply(cur_op))
+        {
+            cl->direct_replies_inflight++;
+        }
     }
     to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = MSGR_SENDP_HDR });
     // Bitmap
@@ -73,7 +78,9 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         ? (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_LIST ||
-        cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)
+        cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG ||
+        cur_op->req.hdr.opcode == OSD_OP_SHOW_TRACES ||
+        cur_op->req.hdr.opcode == OSD_OP_SHOW_MEMORY)
         : (cur_op->req.hdr.opcode == OSD_OP_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE ||
@@ -88,6 +95,12 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
             to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = 0 });
         }
     }
+    if (cur_op->req.hdr.opcode == OSD_OP_SEC_LIST && cur_op->op_type == OSD_OP_OUT &&
+        (cur_op->req.sec_list.flags & OSD_LIST_CHANGED) && cur_op->req.sec_list.changed_len > 0)
+    {
+        to_send_list.push_back((iovec){ .iov_base = cur_op->rmw_buf, .iov_len = (size_t)cur_op->req.sec_list.changed_len });
+        to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = 0 });
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_BMP)
     {
         if (cur_op->op_type == OSD_OP_IN && cur_op->reply.hdr.retval > 0)
@@ -107,7 +120,7 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         return;
     }
 #endif
-    if (!ringloop)
+    if (!ringloop && !hold_sends)
     {
         // FIXME: It's worse because it doesn't allow batching
         while (cl->outbox.size())
@@ -115,14 +128,19 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
             try_send(cl);
         }
     }
-    else if (cl->write_msg.msg_iovlen > 0 || !try_send(cl))
+    else
     {
+        // Don't send immediately: send_replies() is called at the end of the same loop iteration,
+        // before submitting SQEs, so all replies to this client are coalesced into one sendmsg
         if (cl->write_state == 0)
         {
             cl->write_state = CL_WRITE_READY;
             write_ready_clients.push_back(cur_op->peer_fd);
         }
-        ringloop->wakeup();
+        if (ringloop)
+        {
+            ringloop->wakeup();
+        }
     }
 }
 
@@ -144,10 +162,12 @@ void osd_messenger_t::measure_exec(osd_op_t *cur_op)
         stats.op_stat_sum[cur_op->req.hdr.opcode] = 0;
         stats.op_stat_bytes[cur_op->req.hdr.opcode] = 0;
     }
-    stats.op_stat_sum[cur_op->req.hdr.opcode] += (
+    uint64_t usec = (
         (cur_op->tv_end.tv_sec - cur_op->tv_begin.tv_sec)*1000000 +
         (cur_op->tv_end.tv_nsec - cur_op->tv_begin.tv_nsec)/1000
     );
+    stats.op_stat_sum[cur_op->req.hdr.opcode] += usec;
+    stats.op_stat_hist[cur_op->req.hdr.opcode].add(usec);
     if (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_WRITE)
     {
@@ -178,7 +198,30 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
         cl->write_msg.msg_iov = cl->send_list.data();
         cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
         cl->refs++;
+        stats.send_count++;
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
+#ifdef IORING_CQE_F_NOTIF
+        if (use_zerocopy_send && zerocopy_send_supported && is_zerocopy_worth(cl))
+        {
+            // Sent replies are only freed after the kernel stops referencing their buffers
+            msgr_zc_send_t *zc = new msgr_zc_send_t;
+            data->callback = [this, cl, zc](ring_data_t *data)
+            {
+                if (!zc->sent)
+                {
+                    zc->sent = true;
+                    handle_send(data->res, cl, &zc->free_ops);
+                    if (data->more)
+                        return;
+                }
+                for (auto op: zc->free_ops)
+                    delete op;
+                delete zc;
+            };
+            my_uring_prep_sendmsg_zc(sqe, peer_fd, &cl->write_msg, 0);
+            return true;
+        }
+#endif
         data->callback = [this, cl](ring_data_t *data) { handle_send(data->res, cl); };
         my_uring_prep_sendmsg(sqe, peer_fd, &cl->write_msg, 0);
     }
@@ -187,6 +230,7 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
         cl->write_msg.msg_iov = cl->send_list.data();
         cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
         cl->refs++;
+        stats.send_count++;
         int result = sendmsg(peer_fd, &cl->write_msg, MSG_NOSIGNAL);
         if (result < 0)
         {
@@ -197,22 +241,107 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
     return true;
 }
 
+// Zero-copy send has its own overhead (page pinning, notifications), so it's only used for large sends
+bool osd_messenger_t::is_zerocopy_worth(osd_client_t *cl)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < cl->write_msg.msg_iovlen; i++)
+    {
+        total += cl->write_msg.msg_iov[i].iov_len;
+        if (total >= zerocopy_send_threshold)
+            return true;
+    }
+    return false;
+}
+
+// Check if a small send to <cl> should wait for more replies. The loop is considered busy
+// if it handled completions since the previous send_replies(), so an idle loop never delays sends
+bool osd_messenger_t::should_delay_send(osd_client_t *cl, bool loop_busy, uint64_t & now_us)
+{
+    if (!loop_busy || cl->write_msg.msg_iovlen > 0 || !cl->send_list.size())
+    {
+        cl->send_delay_start_us = 0;
+        return false;
+    }
+    uint64_t bytes = 0;
+    for (auto & iov: cl->send_list)
+    {
+        bytes += iov.iov_len;
+        if (bytes >= send_batch_max_bytes)
+        {
+            cl->send_delay_start_us = 0;
+            return false;
+        }
+    }
+    if (!now_us)
+    {
+        timespec tv;
+        clock_gettime(CLOCK_MONOTONIC, &tv);
+        now_us = tv.tv_sec*1000000 + tv.tv_nsec/1000;
+    }
+    if (!cl->send_delay_start_us)
+    {
+        cl->send_delay_start_us = now_us;
+        stats.send_delayed++;
+        return true;
+    }
+    if (now_us - cl->send_delay_start_us < send_batch_delay_us)
+    {
+        return true;
+    }
+    cl->send_delay_start_us = 0;
+    return false;
+}
+
 void osd_messenger_t::send_replies()
 {
+    bool loop_busy = false;
+    uint64_t now_us = 0;
+    if (send_batch_delay_us > 0 && ringloop)
+    {
+        loop_busy = ringloop->stats.cqe_count != send_batch_cqe_count;
+        send_batch_cqe_count = ringloop->stats.cqe_count;
+    }
+    int delayed = 0;
     for (int i = 0; i < write_ready_clients.size(); i++)
     {
         int peer_fd = write_ready_clients[i];
         auto cl_it = clients.find(peer_fd);
-        if (cl_it != clients.end() && !try_send(cl_it->second))
+        if (cl_it == clients.end())
         {
-            write_ready_clients.erase(write_ready_clients.begin(), write_ready_clients.begin() + i);
+            continue;
+        }
+        if (send_batch_delay_us > 0 && should_delay_send(cl_it->second, loop_busy, now_us))
+        {
+            // Keep the client in the list for the next loop iteration
+            write_ready_clients[delayed++] = peer_fd;
+            continue;
+        }
+        if (!ringloop)
+        {
+            // Synchronous sendmsg() sends at most IOV_MAX buffers, and the client may be stopped on error
+            while (cl_it != clients.end() && cl_it->second->outbox.size())
+            {
+                try_send(cl_it->second);
+                cl_it = clients.find(peer_fd);
+            }
+            continue;
+        }
+        if (!try_send(cl_it->second))
+        {
+            // Out of SQEs, retry the rest later
+            write_ready_clients.erase(write_ready_clients.begin()+delayed, write_ready_clients.begin()+i);
             return;
         }
     }
-    write_ready_clients.clear();
+    write_ready_clients.resize(delayed);
+    if (delayed > 0 && ringloop)
+    {
+        ringloop->wakeup();
+    }
 }
 
-void osd_messenger_t::handle_send(int result, osd_client_t *cl)
+void osd_messenger_t::handle_send(int result, osd_client_t *cl, std::vector<osd_op_t*> *defer_free)
 {
     cl->write_msg.msg_iovlen = 0;
     cl->refs--;
@@ -233,6 +362,7 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
     }
     if (result >= 0)
     {
+        stats.send_bytes += result;
         int done = 0;
         while (result > 0 && done < cl->send_list.size())
         {
@@ -242,7 +372,10 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
                 if (cl->outbox[done].flags & MSGR_SENDP_FREE)
                 {
                     // Reply fully sent
-                    delete cl->outbox[done].op;
+                    if (defer_free)
+                        defer_free->push_back(cl->outbox[done].op);
+                    else
+                        delete cl->outbox[done].op;
                 }
                 result -= iov.iov_len;
                 done++;
@@ -278,8 +411,11 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
             }
             cl->peer_state = PEER_RDMA;
             tfd->set_fd_handler(cl->peer_fd, false, NULL);
-            // Add the initial receive request
-            try_recv_rdma(cl);
+            // Add the initial receive request or handle messages received before switching
+            if (!try_recv_rdma(cl))
+            {
+                return;
+            }
         }
 #endif
     }
@@ -68,10 +68,31 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
     // First set state to STOPPED so another stop_client() call doesn't try to free it again
     cl->refs++;
     cl->peer_state = PEER_STOPPED;
-    if (cl->osd_num)
+    bool extra_used = false;
+    if (cl->osd_num && cl->main_peer_fd >= 0)
+    {
+        // ...and forget the extra connection
+        auto ex_it = osd_peer_extra_fds.find(cl->osd_num);
+        if (ex_it != osd_peer_extra_fds.end())
+        {
+            for (auto fd_it = ex_it->second.begin(); fd_it != ex_it->second.end(); fd_it++)
+            {
+                if (*fd_it == peer_fd)
+                {
+                    ex_it->second.erase(fd_it);
+                    extra_used = true;
+                    break;
+                }
+            }
+            if (!ex_it->second.size())
+                osd_peer_extra_fds.erase(ex_it);
+        }
+    }
+    else if (cl->osd_num)
     {
         // ...and forget OSD peer
         osd_peer_fds.erase(cl->osd_num);
+        osd_peer_extra_fds.erase(cl->osd_num);
     }
 #ifndef __MOCK__
     // Then remove FD from the eventloop so we don't accidentally read something
@@ -98,11 +119,28 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
         }
     }
 #endif
-    if (cl->osd_num)
+    if (cl->osd_num && cl->main_peer_fd < 0)
     {
         // Then repeer PGs because cancel_op() callbacks can try to perform
         // some actions and we need correct PG states to not do something silly
         repeer_pgs(cl->osd_num);
+        // Extra connections to the same peer are dropped together with the main one
+        std::vector<int> extra_fds;
+        for (auto & cp: clients)
+        {
+            if (cp.second->main_peer_fd == peer_fd && cp.second->osd_num == cl->osd_num)
+                extra_fds.push_back(cp.first);
+        }
+        for (int extra_fd: extra_fds)
+        {
+            stop_client(extra_fd, true);
+        }
+    }
+    else if (extra_used)
+    {
+        // Subops sent through this connection are lost, so PGs must be repeered
+        // just like when the main connection breaks
+        stop_client(cl->main_peer_fd, true);
     }
     // Then cancel all operations
     if (cl->read_op)
@@ -116,9 +154,23 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
     if (cl->osd_num)
     {
         // Cancel outbound operations
+        if (cancel_peer_ops)
+        {
+            cancel_peer_ops(peer_fd);
+        }
         cancel_osd_ops(cl);
     }
 #ifndef __MOCK__
+    if (cl->multishot_data)
+    {
+        if (force_delete)
+        {
+            // The client is freed right now, so the receive must not reference it anymore
+            cl->multishot_data->callback = [](ring_data_t *data) {};
+        }
+        // Terminate the multishot receive, it ends with a 0 byte result
+        shutdown(peer_fd, SHUT_RDWR);
+    }
     // And close the FD only when everything is done
     // ...because peer_fd number can get reused after close()
     close(peer_fd);
@@ -22,6 +22,36 @@
 #define MSG_ZEROCOPY 0
 #endif
 
+// Not in older <linux/nbd.h>
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#endif
+#ifndef NBD_CMD_WRITE_ZEROES
+#define NBD_CMD_WRITE_ZEROES 6
+#endif
+#ifndef NBD_CMD_FLAG_NO_HOLE
+#define NBD_CMD_FLAG_NO_HOLE (1 << 17)
+#endif
+
+#define NBD_MAX_CONNECTIONS 16
+
+// One socket of an NBD device. The kernel spreads requests over all of them when there are several
+struct nbd_conn_t
+{
+    int fd = -1;
+    std::vector<iovec> send_list, next_send_list;
+    std::vector<void*> to_free;
+    void *recv_buf = NULL;
+    nbd_request cur_req;
+    cluster_op_t *cur_op = NULL;
+    void *cur_buf = NULL;
+    int cur_left = 0;
+    int read_state = 0;
+    int read_ready = 0;
+    msghdr read_msg = { 0 }, send_msg = { 0 };
+    iovec read_iov = { 0 };
+};
+
 const char *exe_name = NULL;
 
 class nbd_proxy
@@ -37,19 +67,8 @@ protected:
     cluster_client_t *cli = NULL;
     ring_consumer_t consumer;
 
-    std::vector<iovec> send_list, next_send_list;
-    std::vector<void*> to_free;
-    int nbd_fd = -1;
-    void *recv_buf = NULL;
+    std::vector<nbd_conn_t*> conns;
     int receive_buffer_size = 9000;
-    nbd_request cur_req;
-    cluster_op_t *cur_op = NULL;
-    void *cur_buf = NULL;
-    int cur_left = 0;
-    int read_state = 0;
-    int read_ready = 0;
-    msghdr read_msg = { 0 }, send_msg = { 0 };
-    iovec read_iov = { 0 };
 
 public:
     static json11::Json::object parse_args(int narg, const char *args[])
@@ -117,7 +136,7 @@ public:
             "Vitastor NBD proxy\n"
             "(c) Vitaliy Filippov, 2020-2021 (VNPL-1.1)\n\n"
             "USAGE:\n"
-            "  %s map [--etcd_address <etcd_address>] (--image <image> | --pool <pool> --inode <inode> --size <size in bytes>)\n"
+            "  %s map [--etcd_address <etcd_address>] (--image <image> | --pool <pool> --inode <inode> --size <size in bytes>) [--connections <N>]\n"
             "  %s unmap /dev/nbd0\n"
             "  %s list [--json]\n",
             exe_name, exe_name, exe_name
@@ -176,7 +195,7 @@ public:
         }
         // Create client
         ringloop = new ring_loop_t(512);
-        epmgr = new epoll_manager_t(ringloop);
+        epmgr = new epoll_manager_t(ringloop, cfg["use_uring_poll"].bool_value() || cfg["use_uring_poll"].uint64_value());
         cli = new cluster_client_t(ringloop, epmgr->tfd, cfg);
         if (!inode)
         {
@@ -191,20 +210,36 @@ public:
             watch = cli->st_cli.watch_inode(image_name);
             device_size = watch->cfg.size;
         }
-        // Initialize NBD
-        int sockfd[2];
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd) < 0)
+        // Initialize NBD. With multiple connections, the kernel creates a hardware queue
+        // for each of them and sends requests to all connections in parallel
+        int conn_count = cfg["connections"].uint64_value();
+        if (conn_count < 1)
+            conn_count = 1;
+        else if (conn_count > NBD_MAX_CONNECTIONS)
+            conn_count = NBD_MAX_CONNECTIONS;
+        std::vector<int> sockfd;
+        for (int i = 0; i < conn_count; i++)
         {
-            perror("socketpair");
-            exit(1);
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+            {
+                perror("socketpair");
+                exit(1);
+            }
+            fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+            nbd_conn_t *conn = new nbd_conn_t;
+            conn->fd = pair[0];
+            conns.push_back(conn);
+            sockfd.push_back(pair[1]);
         }
-        fcntl(sockfd[0], F_SETFL, fcntl(sockfd[0], F_GETFL, 0) | O_NONBLOCK);
-        nbd_fd = sockfd[0];
+        uint64_t nbd_flags = NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES;
+        if (conn_count > 1)
+            nbd_flags |= NBD_FLAG_CAN_MULTI_CONN;
         load_module();
         bool bg = cfg["foreground"].is_null();
         if (!cfg["dev_num"].is_null())
         {
-            if (run_nbd(sockfd, cfg["dev_num"].int64_value(), device_size, NBD_FLAG_SEND_FLUSH, 30, bg) < 0)
+            if (run_nbd(sockfd, cfg["dev_num"].int64_value(), device_size, nbd_flags, 30, bg) < 0)
             {
                 perror("run_nbd");
                 exit(1);
@@ -216,7 +251,7 @@ public:
             int i = 0;
             while (true)
             {
-                int r = run_nbd(sockfd, i, device_size, NBD_FLAG_SEND_FLUSH, 30, bg);
+                int r = run_nbd(sockfd, i, device_size, nbd_flags, 30, bg);
                 if (r == 0)
                 {
                     printf("/dev/nbd%d\n", i);
@@ -244,38 +279,47 @@ public:
             daemonize();
         }
         // Initialize read state
-        read_state = CL_READ_HDR;
-        recv_buf = malloc_or_die(receive_buffer_size);
-        cur_buf = &cur_req;
-        cur_left = sizeof(nbd_request);
+        for (auto conn: conns)
+        {
+            conn->read_state = CL_READ_HDR;
+            conn->recv_buf = malloc_or_die(receive_buffer_size);
+            conn->cur_buf = &conn->cur_req;
+            conn->cur_left = sizeof(nbd_request);
+        }
         consumer.loop = [this]()
         {
-            submit_read();
-            submit_send();
+            for (auto conn: conns)
+            {
+                submit_read(conn);
+                submit_send(conn);
+            }
             ringloop->submit();
         };
         ringloop->register_consumer(&consumer);
-        // Add FD to epoll
-        bool stop = false;
-        epmgr->tfd->set_fd_handler(sockfd[0], false, [this, &stop](int peer_fd, int epoll_events)
+        // Add FDs to epoll, all connections are handled by the same ring loop and cluster client
+        int active = conn_count;
+        for (auto conn: conns)
         {
-            if (epoll_events & EPOLLRDHUP)
+            epmgr->tfd->set_fd_handler(conn->fd, false, [this, conn, &active](int peer_fd, int epoll_events)
             {
-                close(peer_fd);
-                stop = true;
-            }
-            else
-            {
-                read_ready++;
-                submit_read();
-            }
-        });
-        while (!stop)
+                if (epoll_events & EPOLLRDHUP)
+                {
+                    close(peer_fd);
+                    active--;
+                }
+                else
+                {
+                    conn->read_ready++;
+                    submit_read(conn);
+                }
+            });
+        }
+        while (active > 0)
         {
             ringloop->loop();
             ringloop->wait();
         }
-        stop = false;
+        bool stop = false;
         cluster_op_t *close_sync = new cluster_op_t;
         close_sync->opcode = OSD_OP_SYNC;
         close_sync->callback = [this, &stop](cluster_op_t *op)
@@ -438,10 +482,10 @@ public:
     }
 
 protected:
-    int run_nbd(int sockfd[2], int dev_num, uint64_t size, uint64_t flags, unsigned timeout, bool bg)
+    int run_nbd(std::vector<int> & sockfd, int dev_num, uint64_t size, uint64_t flags, unsigned timeout, bool bg)
     {
         // Check handle size
-        assert(sizeof(cur_req.handle) == 8);
+        assert(sizeof(nbd_request::handle) == 8);
         char path[64] = { 0 };
         sprintf(path, "/dev/nbd%d", dev_num);
         int r, nbd = open(path, O_RDWR), qd_fd;
@@ -449,10 +493,15 @@ protected:
         {
             return -1;
         }
-        r = ioctl(nbd, NBD_SET_SOCK, sockfd[1]);
-        if (r < 0)
+        for (int i = 0; i < sockfd.size(); i++)
         {
-            goto end_close;
+            r = ioctl(nbd, NBD_SET_SOCK, sockfd[i]);
+            if (r < 0)
+            {
+                if (i > 0)
+                    goto end_unmap;
+                goto end_close;
+            }
         }
         r = ioctl(nbd, NBD_SET_BLKSIZE, 4096);
         if (r < 0)
@@ -485,7 +534,10 @@ protected:
         if (!fork())
         {
             // Run in child
-            close(sockfd[0]);
+            for (auto conn: conns)
+            {
+                close(conn->fd);
+            }
             if (bg)
             {
                 daemonize();
@@ -495,12 +547,18 @@ protected:
             {
                 fprintf(stderr, "NBD device terminated with error: %s\n", strerror(errno));
             }
-            close(sockfd[1]);
+            for (int i = 0; i < sockfd.size(); i++)
+            {
+                close(sockfd[i]);
+            }
             ioctl(nbd, NBD_CLEAR_QUE);
             ioctl(nbd, NBD_CLEAR_SOCK);
             exit(0);
         }
-        close(sockfd[1]);
+        for (int i = 0; i < sockfd.size(); i++)
+        {
+            close(sockfd[i]);
+        }
         close(nbd);
         return 0;
     end_close:
@@ -516,9 +574,9 @@ protected:
         return -3;
     }
 
-    void submit_send()
+    void submit_send(nbd_conn_t *conn)
     {
-        if (!send_list.size() || send_msg.msg_iovlen > 0)
+        if (!conn->send_list.size() || conn->send_msg.msg_iovlen > 0)
         {
             return;
         }
@@ -528,26 +586,27 @@ protected:
             return;
         }
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this](ring_data_t *data) { handle_send(data->res); };
-        send_msg.msg_iov = send_list.data();
-        send_msg.msg_iovlen = send_list.size();
-        my_uring_prep_sendmsg(sqe, nbd_fd, &send_msg, MSG_ZEROCOPY);
+        data->callback = [this, conn](ring_data_t *data) { handle_send(conn, data->res); };
+        conn->send_msg.msg_iov = conn->send_list.data();
+        conn->send_msg.msg_iovlen = conn->send_list.size();
+        my_uring_prep_sendmsg(sqe, conn->fd, &conn->send_msg, MSG_ZEROCOPY);
     }
 
-    void handle_send(int result)
+    void handle_send(nbd_conn_t *conn, int result)
     {
-        send_msg.msg_iovlen = 0;
+        conn->send_msg.msg_iovlen = 0;
         if (result < 0 && result != -EAGAIN)
         {
             fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
             exit(1);
         }
+        auto & send_list = conn->send_list;
         int to_eat = 0;
         while (result > 0 && to_eat < send_list.size())
         {
             if (result >= send_list[to_eat].iov_len)
             {
-                free(to_free[to_eat]);
+                free(conn->to_free[to_eat]);
                 result -= send_list[to_eat].iov_len;
                 to_eat++;
             }
@@ -561,22 +620,22 @@ protected:
         if (to_eat > 0)
         {
             send_list.erase(send_list.begin(), send_list.begin() + to_eat);
-            to_free.erase(to_free.begin(), to_free.begin() + to_eat);
+            conn->to_free.erase(conn->to_free.begin(), conn->to_free.begin() + to_eat);
         }
-        for (int i = 0; i < next_send_list.size(); i++)
+        for (int i = 0; i < conn->next_send_list.size(); i++)
         {
-            send_list.push_back(next_send_list[i]);
+            send_list.push_back(conn->next_send_list[i]);
         }
-        next_send_list.clear();
+        conn->next_send_list.clear();
         if (send_list.size() > 0)
         {
             ringloop->wakeup();
         }
     }
 
-    void submit_read()
+    void submit_read(nbd_conn_t *conn)
     {
-        if (!read_ready || read_msg.msg_iovlen > 0)
+        if (!conn->read_ready || conn->read_msg.msg_iovlen > 0)
         {
             return;
         }
@@ -586,70 +645,73 @@ protected:
             return;
         }
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this](ring_data_t *data) { handle_read(data->res); };
-        if (cur_left < receive_buffer_size)
+        data->callback = [this, conn](ring_data_t *data) { handle_read(conn, data->res); };
+        if (conn->cur_left < receive_buffer_size)
         {
-            read_iov.iov_base = recv_buf;
-            read_iov.iov_len = receive_buffer_size;
+            conn->read_iov.iov_base = conn->recv_buf;
+            conn->read_iov.iov_len = receive_buffer_size;
         }
         else
         {
-            read_iov.iov_base = cur_buf;
-            read_iov.iov_len = cur_left;
+            conn->read_iov.iov_base = conn->cur_buf;
+            conn->read_iov.iov_len = conn->cur_left;
         }
-        read_msg.msg_iov = &read_iov;
-        read_msg.msg_iovlen = 1;
-        my_uring_prep_recvmsg(sqe, nbd_fd, &read_msg, 0);
+        conn->read_msg.msg_iov = &conn->read_iov;
+        conn->read_msg.msg_iovlen = 1;
+        my_uring_prep_recvmsg(sqe, conn->fd, &conn->read_msg, 0);
     }
 
-    void handle_read(int result)
+    void handle_read(nbd_conn_t *conn, int result)
     {
-        read_msg.msg_iovlen = 0;
+        conn->read_msg.msg_iovlen = 0;
         if (result < 0 && result != -EAGAIN)
         {
             fprintf(stderr, "Socket disconnected: %s\n", strerror(-result));
             exit(1);
         }
-        if (result == -EAGAIN || result < read_iov.iov_len)
+        if (result == -EAGAIN || result < conn->read_iov.iov_len)
         {
-            read_ready--;
+            conn->read_ready--;
         }
-        if (read_ready > 0)
+        if (conn->read_ready > 0)
         {
             ringloop->wakeup();
         }
-        void *b = recv_buf;
+        void *b = conn->recv_buf;
         while (result > 0)
         {
-            if (read_iov.iov_base == recv_buf)
+            if (conn->read_iov.iov_base == conn->recv_buf)
             {
-                int inc = result >= cur_left ? cur_left : result;
-                memcpy(cur_buf, b, inc);
-                cur_left -= inc;
+                int inc = result >= conn->cur_left ? conn->cur_left : result;
+                memcpy(conn->cur_buf, b, inc);
+                conn->cur_left -= inc;
                 result -= inc;
-                cur_buf += inc;
+                conn->cur_buf += inc;
                 b += inc;
             }
             else
             {
-                assert(result <= cur_left);
-                cur_left -= result;
+                assert(result <= conn->cur_left);
+                conn->cur_left -= result;
                 result = 0;
             }
-            if (cur_left <= 0)
+            if (conn->cur_left <= 0)
             {
-                handle_finished_read();
+                handle_finished_read(conn);
             }
         }
     }
 
-    void handle_finished_read()
+    void handle_finished_read(nbd_conn_t *conn)
     {
-        if (read_state == CL_READ_HDR)
+        if (conn->read_state == CL_READ_HDR)
         {
-            int req_type = be32toh(cur_req.type);
+            nbd_request & cur_req = conn->cur_req;
+            uint32_t req_type_flags = be32toh(cur_req.type);
+            int req_type = req_type_flags & 0xffff;
             if (be32toh(cur_req.magic) != NBD_REQUEST_MAGIC ||
-                req_type != NBD_CMD_READ && req_type != NBD_CMD_WRITE && req_type != NBD_CMD_FLUSH)
+                req_type != NBD_CMD_READ && req_type != NBD_CMD_WRITE && req_type != NBD_CMD_FLUSH &&
+                req_type != NBD_CMD_TRIM && req_type != NBD_CMD_WRITE_ZEROES)
             {
                 printf("Unexpected request: magic=%x type=%x, terminating\n", cur_req.magic, req_type);
                 exit(1);
@@ -674,7 +736,16 @@ protected:
                 op->opcode = OSD_OP_SYNC;
                 buf = malloc_or_die(sizeof(nbd_reply));
             }
-            op->callback = [this, buf, handle](cluster_op_t *op)
+            else
+            {
+                // Not executed itself, only used to reply when all parts of the discard are done
+                op->opcode = OSD_OP_DELETE;
+                op->inode = inode ? inode : watch->cfg.num;
+                op->offset = be64toh(cur_req.from);
+                op->len = be32toh(cur_req.len);
+                buf = malloc_or_die(sizeof(nbd_reply));
+            }
+            op->callback = [this, conn, buf, handle](cluster_op_t *op)
             {
 #ifdef DEBUG
                 printf("reply %lx e=%d\n", handle, op->retval);
@@ -683,34 +754,55 @@ protected:
                 reply->magic = htobe32(NBD_REPLY_MAGIC);
                 memcpy(reply->handle, &handle, 8);
                 reply->error = htobe32(op->retval < 0 ? -op->retval : 0);
-                auto & to_list = send_msg.msg_iovlen > 0 ? next_send_list : send_list;
+                auto & to_list = conn->send_msg.msg_iovlen > 0 ? conn->next_send_list : conn->send_list;
                 if (op->retval < 0 || op->opcode != OSD_OP_READ)
                     to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) });
                 else
                     to_list.push_back({ .iov_base = buf, .iov_len = sizeof(nbd_reply) + op->len });
-                to_free.push_back(buf);
+                conn->to_free.push_back(buf);
                 delete op;
                 ringloop->wakeup();
             };
             if (req_type == NBD_CMD_WRITE)
             {
-                cur_op = op;
-                cur_buf = buf + sizeof(nbd_reply);
-                cur_left = op->len;
-                read_state = CL_READ_DATA;
+                conn->cur_op = op;
+                conn->cur_buf = buf + sizeof(nbd_reply);
+                conn->cur_left = op->len;
+                conn->read_state = CL_READ_DATA;
             }
             else
             {
-                cur_op = NULL;
-                cur_buf = &cur_req;
-                cur_left = sizeof(nbd_request);
-                read_state = CL_READ_HDR;
-                cli->execute(op);
+                conn->cur_op = NULL;
+                conn->cur_buf = &conn->cur_req;
+                conn->cur_left = sizeof(nbd_request);
+                conn->read_state = CL_READ_HDR;
+                if (op->opcode == OSD_OP_DELETE)
+                {
+                    if (watch && watch->cfg.readonly)
+                    {
+                        op->retval = -EROFS;
+                        std::function<void(cluster_op_t*)>(op->callback)(op);
+                    }
+                    else
+                    {
+                        cli->discard(op->inode, op->offset, op->len, req_type == NBD_CMD_WRITE_ZEROES,
+                            req_type_flags & NBD_CMD_FLAG_NO_HOLE, [op](int retval)
+                        {
+                            op->retval = retval;
+                            std::function<void(cluster_op_t*)>(op->callback)(op);
+                        });
+                    }
+                }
+                else
+                {
+                    cli->execute(op);
+                }
             }
         }
         else
         {
-            if (cur_op->opcode == OSD_OP_WRITE && watch->cfg.readonly)
+            cluster_op_t *cur_op = conn->cur_op;
+            if (cur_op->opcode == OSD_OP_WRITE && watch && watch->cfg.readonly)
             {
                 cur_op->retval = -EROFS;
                 std::function<void(cluster_op_t*)>(cur_op->callback)(cur_op);
@@ -719,10 +811,10 @@ protected:
             {
                 cli->execute(cur_op);
             }
-            cur_op = NULL;
-            cur_buf = &cur_req;
-            cur_left = sizeof(nbd_request);
-            read_state = CL_READ_HDR;
+            conn->cur_op = NULL;
+            conn->cur_buf = &conn->cur_req;
+            conn->cur_left = sizeof(nbd_request);
+            conn->read_state = CL_READ_HDR;
         }
     }
 };
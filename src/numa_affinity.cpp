@@ -0,0 +1,151 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "numa_affinity.h"
+
+// From <linux/mempolicy.h>, which isn't always installed
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+static std::string read_sysfs(const std::string & path)
+{
+    char buf[4096];
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return "";
+    int r = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (r <= 0)
+        return "";
+    while (r > 0 && (buf[r-1] == '\n' || buf[r-1] == ' '))
+        r--;
+    return std::string(buf, r);
+}
+
+// Walk up the sysfs device tree until a device with a known NUMA node is found
+static int find_sysfs_numa_node(const std::string & link)
+{
+    char sys_path[PATH_MAX];
+    if (!realpath(link.c_str(), sys_path))
+        return -1;
+    std::string path = sys_path;
+    while (path.size() > 1 && path != "/sys/devices")
+    {
+        std::string node = read_sysfs(path+"/numa_node");
+        if (node != "")
+            return atoi(node.c_str());
+        path = path.substr(0, path.rfind('/'));
+    }
+    return -1;
+}
+
+int get_blockdev_numa_node(const std::string & dev_path)
+{
+    struct stat st;
+    if (stat(dev_path.c_str(), &st) < 0 || !S_ISBLK(st.st_mode))
+        return -1;
+    return find_sysfs_numa_node("/sys/dev/block/"+std::to_string(major(st.st_rdev))+":"+std::to_string(minor(st.st_rdev)));
+}
+
+int get_netdev_numa_node(const std::string & bind_address, const std::string & rdma_device)
+{
+    if (rdma_device != "")
+    {
+        return find_sysfs_numa_node("/sys/class/infiniband/"+rdma_device+"/device");
+    }
+    in_addr addr;
+    if (bind_address == "" || inet_pton(AF_INET, bind_address.c_str(), &addr) != 1 || addr.s_addr == INADDR_ANY)
+    {
+        return -1;
+    }
+    ifaddrs *list = NULL;
+    if (getifaddrs(&list) < 0)
+    {
+        return -1;
+    }
+    int node = -1;
+    for (ifaddrs *ifa = list; ifa; ifa = ifa->ifa_next)
+    {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+            ((sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr == addr.s_addr)
+        {
+            node = find_sysfs_numa_node(std::string("/sys/class/net/")+ifa->ifa_name+"/device");
+            break;
+        }
+    }
+    freeifaddrs(list);
+    return node;
+}
+
+bool bind_thread_to_numa_node(int node)
+{
+    std::string cpulist = read_sysfs("/sys/devices/system/node/node"+std::to_string(node)+"/cpulist");
+    if (cpulist == "")
+    {
+        return false;
+    }
+    // cpulist looks like "0-7,16-23"
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    const char *p = cpulist.c_str();
+    while (*p)
+    {
+        char *end = NULL;
+        unsigned long first = strtoul(p, &end, 10), last = first;
+        if (end == p)
+            return false;
+        if (*end == '-')
+            last = strtoul(end+1, &end, 10);
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &cpus);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return false;
+        p = end;
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+    {
+        return false;
+    }
+    // Memory is then allocated on the first touch from the node if possible.
+    // Use the raw syscall to not depend on libnuma
+    unsigned long nodemask[16] = { 0 };
+    if (node >= sizeof(nodemask)*8)
+    {
+        return false;
+    }
+    nodemask[node / (8*sizeof(unsigned long))] |= 1ul << (node % (8*sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, sizeof(nodemask)*8) == 0;
+}
+
+void *alloc_huge_buffer(size_t size)
+{
+    void *buf = memalign(HUGE_PAGE_SIZE, size);
+    if (buf && size >= HUGE_PAGE_SIZE)
+    {
+        // Best-effort: transparent huge pages may be disabled
+        madvise(buf, (size / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+    }
+    return buf;
+}
@@ -0,0 +1,20 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <string>
+
+// NUMA node of the PCI device behind a block device (or a partition), -1 if unknown
+int get_blockdev_numa_node(const std::string & dev_path);
+
+// NUMA node of the RDMA device or, if it's empty, of the network interface having <bind_address>, -1 if unknown
+int get_netdev_numa_node(const std::string & bind_address, const std::string & rdma_device);
+
+// Pin the calling thread to CPUs of NUMA node <node> and make its allocations prefer memory of that node.
+// Threads started by it inherit both. Returns false on error
+bool bind_thread_to_numa_node(int node);
+
+// Allocate a large buffer aligned to 2 MB so that it can be backed by transparent huge pages,
+// and ask the kernel to do it. Buffer must be freed with free(). Returns NULL on failure
+void *alloc_huge_buffer(size_t size);
@@ -38,10 +38,17 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
         this->config["log_level"] = 1;
     parse_config(this->config);
 
-    epmgr = new epoll_manager_t(ringloop);
+    epmgr = new epoll_manager_t(ringloop, this->config["use_uring_poll"].bool_value() ||
+        this->config["use_uring_poll"].uint64_value());
     // FIXME: Use timerfd_interval based directly on io_uring
     this->tfd = epmgr->tfd;
 
+    if (metrics_port)
+    {
+        metrics_server = new metrics_server_t(tfd, [this]() { return get_metrics(); });
+        metrics_server->start(metrics_address, metrics_port);
+    }
+
     // FIXME: Create Blockstore from on-disk superblock config and check it against the OSD cluster config
     auto bs_cfg = json_to_bs(this->config);
     this->bs = new blockstore_t(bs_cfg, ringloop, tfd);
@@ -59,6 +66,7 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
     msgr.ringloop = this->ringloop;
     msgr.exec_op = [this](osd_op_t *op) { exec_op(op); };
     msgr.repeer_pgs = [this](osd_num_t peer_osd) { repeer_pgs(peer_osd); };
+    msgr.cancel_peer_ops = [this](int peer_fd) { cancel_subop_batch(peer_fd); };
     msgr.init();
 
     init_cluster();
@@ -70,6 +78,8 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
 osd_t::~osd_t()
 {
     ringloop->unregister_consumer(&consumer);
+    if (metrics_server)
+        delete metrics_server;
     delete epmgr;
     delete bs;
     close(listen_fd);
@@ -85,6 +95,9 @@ void osd_t::parse_config(const json11::Json & config)
     if (!osd_num)
         throw std::runtime_error("osd_num is required in the configuration");
     msgr.osd_num = osd_num;
+    msgr.peer_connections = config["osd_peer_connections"].uint64_value();
+    if (msgr.peer_connections < 1 || msgr.peer_connections > 64)
+        msgr.peer_connections = 1;
     // Vital Blockstore parameters
     bs_block_size = config["block_size"].uint64_value();
     if (!bs_block_size)
@@ -100,11 +113,20 @@ void osd_t::parse_config(const json11::Json & config)
     bind_port = config["bind_port"].uint64_value();
     if (bind_port <= 0 || bind_port > 65535)
         bind_port = 0;
+    metrics_port = config["metrics_port"].uint64_value();
+    if (metrics_port <= 0 || metrics_port > 65535)
+        metrics_port = 0;
+    metrics_address = config["metrics_address"].string_value();
+    if (metrics_address == "")
+        metrics_address = bind_address;
     // OSD configuration
     log_level = config["log_level"].uint64_value();
     etcd_report_interval = config["etcd_report_interval"].uint64_value();
     if (etcd_report_interval <= 0)
         etcd_report_interval = 30;
+    etcd_full_report_interval = config["etcd_full_report_interval"].uint64_value();
+    if (etcd_full_report_interval <= 0)
+        etcd_full_report_interval = 300;
     readonly = config["readonly"] == "true" || config["readonly"] == "1" || config["readonly"] == "yes";
     run_primary = config["run_primary"] != "false" && config["run_primary"] != "0" && config["run_primary"] != "no";
     no_rebalance = config["no_rebalance"] == "true" || config["no_rebalance"] == "1" || config["no_rebalance"] == "yes";
@@ -123,6 +145,7 @@ void osd_t::parse_config(const json11::Json & config)
         if (autosync_interval > MAX_AUTOSYNC_INTERVAL)
             autosync_interval = DEFAULT_AUTOSYNC_INTERVAL;
     }
+    autosync_writes = config["autosync_writes"].uint64_value();
     if (!config["client_queue_depth"].is_null())
     {
         client_queue_depth = config["client_queue_depth"].uint64_value();
@@ -135,12 +158,62 @@ void osd_t::parse_config(const json11::Json & config)
     recovery_sync_batch = config["recovery_sync_batch"].uint64_value();
     if (recovery_sync_batch < 1 || recovery_sync_batch > MAX_RECOVERY_QUEUE)
         recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
+    recovery_osd_queue_depth = config["recovery_osd_queue_depth"].uint64_value();
+    if (recovery_osd_queue_depth > MAX_RECOVERY_QUEUE)
+        recovery_osd_queue_depth = 0;
+    rebalance_batch_size = config["rebalance_batch_size"].uint64_value();
+    if (rebalance_batch_size > MAX_RECOVERY_QUEUE)
+        rebalance_batch_size = MAX_RECOVERY_QUEUE;
+    recovery_bandwidth_limit = config["recovery_bandwidth_limit"].uint64_value() * 1024*1024;
+    recovery_iops_limit = config["recovery_iops_limit"].uint64_value();
+    recovery_client_latency_target = config["recovery_client_latency_target"].uint64_value();
+    scrub_interval = config["scrub_interval"].uint64_value();
+    if (!config["scrub_queue_depth"].is_null())
+        scrub_queue_depth = config["scrub_queue_depth"].uint64_value();
+    if (scrub_queue_depth < 1 || scrub_queue_depth > MAX_RECOVERY_QUEUE)
+        scrub_queue_depth = 1;
+    scrub_bandwidth_limit = config["scrub_bandwidth_limit"].uint64_value() * 1024*1024;
+    scrub_iops_limit = config["scrub_iops_limit"].uint64_value();
+    if (!config["peering_log_size"].is_null())
+        peering_log_size = config["peering_log_size"].uint64_value();
+    peering_queue_depth = config["peering_queue_depth"].uint64_value();
+    if (!config["layer_bitmap_cache_size"].is_null())
+        layer_bitmap_cache_size = config["layer_bitmap_cache_size"].uint64_value();
+    copy_up_reads = config["copy_up_reads"].uint64_value();
+    if (!config["copy_up_queue_depth"].is_null())
+        copy_up_queue_depth = config["copy_up_queue_depth"].uint64_value();
+    if (copy_up_queue_depth < 1 || copy_up_queue_depth > MAX_RECOVERY_QUEUE)
+        copy_up_queue_depth = DEFAULT_COPY_UP_QUEUE_DEPTH;
     print_stats_interval = config["print_stats_interval"].uint64_value();
     if (!print_stats_interval)
         print_stats_interval = 3;
     slow_log_interval = config["slow_log_interval"].uint64_value();
     if (!slow_log_interval)
         slow_log_interval = 10;
+    trace_sample = config["trace_sample"].uint64_value();
+    if (!config["trace_buffer_size"].is_null())
+        trace_buffer_size = config["trace_buffer_size"].uint64_value();
+    if (!trace_buffer_size)
+        trace_buffer_size = DEFAULT_TRACE_BUFFER_SIZE;
+    pipeline_replication_threshold = config["pipeline_replication_threshold"].uint64_value();
+    shutdown_drain_timeout = config["shutdown_drain_timeout"].uint64_value();
+    subop_batch_max = config["subop_batch_max"].uint64_value();
+    if (config["ec_backend"] == "jerasure")
+        set_ec_backend(EC_BACKEND_JERASURE);
+    else if (config["ec_backend"] == "isal" && !set_ec_backend(EC_BACKEND_ISAL))
+        throw std::runtime_error("This OSD is built without ISA-L support, ec_backend=isal is unavailable");
+    if (!config["ec_decoding_cache"].is_null())
+        set_ec_decoding_cache_limit(config["ec_decoding_cache"].uint64_value());
+    if (config["read_balance"] == "random")
+        read_balance = READ_BALANCE_RANDOM;
+    else if (config["read_balance"] == "least_queued")
+        read_balance = READ_BALANCE_LEAST_QUEUED;
+    else if (config["read_balance"] == "lowest_latency")
+        read_balance = READ_BALANCE_LOWEST_LATENCY;
+    else if (config["read_balance"].is_null() || config["read_balance"] == "primary")
+        read_balance = READ_BALANCE_PRIMARY;
+    else
+        throw std::runtime_error("read_balance must be one of primary, random, least_queued or lowest_latency");
 }
 
 void osd_t::bind_socket()
@@ -211,6 +284,7 @@ void osd_t::loop()
 {
     handle_peers();
     msgr.read_requests();
+    flush_subop_batches();
     msgr.send_replies();
     ringloop->submit();
 }
@@ -237,10 +311,21 @@ void osd_t::exec_op(osd_op_t *cur_op)
             cur_op->req.sec_rw.offset % bs_bitmap_granularity)) ||
         ((cur_op->req.hdr.opcode == OSD_OP_READ ||
             cur_op->req.hdr.opcode == OSD_OP_WRITE ||
-            cur_op->req.hdr.opcode == OSD_OP_DELETE) &&
+            cur_op->req.hdr.opcode == OSD_OP_DELETE ||
+            cur_op->req.hdr.opcode == OSD_OP_MERGE) &&
             (cur_op->req.rw.len > OSD_RW_MAX ||
             cur_op->req.rw.len % bs_bitmap_granularity ||
-            cur_op->req.rw.offset % bs_bitmap_granularity)))
+            cur_op->req.rw.offset % bs_bitmap_granularity)) ||
+        (cur_op->req.hdr.opcode == OSD_OP_WRITE && (cur_op->req.rw.flags & OSD_WRITE_PARITY) &&
+            cur_op->req.rw.parity_len > OSD_RW_MAX) ||
+        (cur_op->req.hdr.opcode == OSD_OP_SEC_BATCH &&
+            (!cur_op->req.sec_batch.count ||
+            cur_op->req.sec_batch.desc_len > OSD_RW_MAX ||
+            cur_op->req.sec_batch.data_len > OSD_RW_MAX ||
+            cur_op->req.sec_batch.desc_len % MEM_ALIGNMENT ||
+            cur_op->req.sec_batch.count > cur_op->req.sec_batch.desc_len / sizeof(osd_sec_batch_item_t))) ||
+        // Scrub is only started by the OSD itself
+        cur_op->req.hdr.opcode == OSD_OP_SCRUB && cur_op->peer_fd)
     {
         // Bad command
         finish_op(cur_op, -EINVAL);
@@ -257,12 +342,21 @@ void osd_t::exec_op(osd_op_t *cur_op)
         cur_op->req.hdr.opcode != OSD_OP_SEC_LIST &&
         cur_op->req.hdr.opcode != OSD_OP_READ &&
         cur_op->req.hdr.opcode != OSD_OP_SEC_READ_BMP &&
-        cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG)
+        // Writes in the batch are checked by exec_sec_batch()
+        cur_op->req.hdr.opcode != OSD_OP_SEC_BATCH &&
+        cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG &&
+        cur_op->req.hdr.opcode != OSD_OP_SHOW_TRACES &&
+        cur_op->req.hdr.opcode != OSD_OP_SHOW_MEMORY &&
+        cur_op->req.hdr.opcode != OSD_OP_SCRUB)
     {
         // Readonly mode
         finish_op(cur_op, -EROFS);
         return;
     }
+    if (trace_sample && cur_op->peer_fd)
+    {
+        trace_start(cur_op);
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_TEST_SYNC_STAB_ALL)
     {
         exec_sync_stab_all(cur_op);
@@ -271,6 +365,20 @@ void osd_t::exec_op(osd_op_t *cur_op)
     {
         exec_show_config(cur_op);
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SHOW_TRACES)
+    {
+        exec_show_traces(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SHOW_MEMORY)
+    {
+        exec_show_memory(cur_op);
+    }
+    else if ((cur_op->req.hdr.opcode == OSD_OP_READ ||
+        cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+        cur_op->req.hdr.opcode == OSD_OP_DELETE) && throttle_inode_op(cur_op))
+    {
+        // Delayed by inode QoS limits, continued by continue_inode_qos()
+    }
     else if (cur_op->req.hdr.opcode == OSD_OP_READ)
     {
         continue_primary_read(cur_op);
@@ -287,12 +395,115 @@ void osd_t::exec_op(osd_op_t *cur_op)
     {
         continue_primary_del(cur_op);
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_MERGE)
+    {
+        continue_primary_merge(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_DELETE_RANGE)
+    {
+        continue_primary_delete_range(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SCRUB)
+    {
+        continue_primary_scrub(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_BATCH)
+    {
+        exec_sec_batch(cur_op);
+    }
     else
     {
         exec_secondary(cur_op);
     }
 }
 
+// Check iops_limit and bandwidth_limit of the inode of a client operation.
+// Returns true if the operation is delayed
+bool osd_t::throttle_inode_op(osd_op_t *cur_op)
+{
+    if (!cur_op->peer_fd)
+    {
+        // Internal operations (recovery, rebalance) aren't limited
+        return false;
+    }
+    auto cfg_it = st_cli.inode_config.find(cur_op->req.rw.inode);
+    if (cfg_it == st_cli.inode_config.end() || !cfg_it->second.iops_limit && !cfg_it->second.bandwidth_limit)
+    {
+        return false;
+    }
+    auto & qos = inode_qos[cur_op->req.rw.inode];
+    if (inode_qos_expire_timer_id < 0)
+    {
+        inode_qos_expire_timer_id = tfd->set_timer(1000, true, [this](int timer_id)
+        {
+            expire_inode_qos();
+        });
+    }
+    if (!qos.queue.size() && !qos.bucket.take(cfg_it->second.iops_limit, cfg_it->second.bandwidth_limit,
+        cur_op->req.hdr.opcode == OSD_OP_DELETE ? 0 : cur_op->req.rw.len))
+    {
+        return false;
+    }
+    qos.queue.push_back(cur_op);
+    if (qos.timer_id < 0)
+    {
+        continue_inode_qos(cur_op->req.rw.inode);
+    }
+    return true;
+}
+
+// Start delayed operations of the inode while its limits allow and wait for the rest
+void osd_t::continue_inode_qos(inode_t inode)
+{
+    auto qos_it = inode_qos.find(inode);
+    if (qos_it == inode_qos.end())
+    {
+        return;
+    }
+    auto & qos = qos_it->second;
+    while (qos.queue.size())
+    {
+        osd_op_t *cur_op = qos.queue.front();
+        auto cfg_it = st_cli.inode_config.find(inode);
+        uint64_t wait_us = cfg_it == st_cli.inode_config.end() ? 0 : qos.bucket.take(
+            cfg_it->second.iops_limit, cfg_it->second.bandwidth_limit,
+            cur_op->req.hdr.opcode == OSD_OP_DELETE ? 0 : cur_op->req.rw.len
+        );
+        if (wait_us > 0)
+        {
+            qos.timer_id = tfd->set_timer((wait_us+999)/1000, false, [this, inode](int timer_id)
+            {
+                inode_qos[inode].timer_id = -1;
+                continue_inode_qos(inode);
+            });
+            return;
+        }
+        qos.queue.pop_front();
+        continue_primary_op(cur_op);
+    }
+}
+
+// Remove buckets of inodes without delayed operations which weren't used for more than a second.
+// Such buckets are full and thus are the same as new ones
+void osd_t::expire_inode_qos()
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (auto qos_it = inode_qos.begin(); qos_it != inode_qos.end(); )
+    {
+        auto & qos = qos_it->second;
+        if (!qos.queue.size() && qos.timer_id < 0 && (now.tv_sec - qos.bucket.refill_time.tv_sec) > 1)
+            inode_qos.erase(qos_it++);
+        else
+            qos_it++;
+    }
+    if (!inode_qos.size())
+    {
+        tfd->clear_timer(inode_qos_expire_timer_id);
+        inode_qos_expire_timer_id = -1;
+    }
+}
+
 void osd_t::reset_stats()
 {
     msgr.stats = { 0 };
@@ -425,10 +636,15 @@ void osd_t::print_slow()
                     );
                 }
                 else if (op->req.hdr.opcode == OSD_OP_READ || op->req.hdr.opcode == OSD_OP_WRITE ||
-                    op->req.hdr.opcode == OSD_OP_DELETE)
+                    op->req.hdr.opcode == OSD_OP_DELETE || op->req.hdr.opcode == OSD_OP_MERGE)
                 {
                     bufprintf(" inode=%lx offset=%lx len=%x", op->req.rw.inode, op->req.rw.offset, op->req.rw.len);
                 }
+                else if (op->req.hdr.opcode == OSD_OP_DELETE_RANGE)
+                {
+                    bufprintf(" inode=%lx pg=%u offset=%lx", op->req.delete_range.inode,
+                        op->req.delete_range.pg_num, op->req.delete_range.start_offset);
+                }
                 if (op->req.hdr.opcode == OSD_OP_SEC_READ || op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
                     op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE || op->req.hdr.opcode == OSD_OP_SEC_DELETE ||
                     op->req.hdr.opcode == OSD_OP_SEC_SYNC || op->req.hdr.opcode == OSD_OP_SEC_LIST ||
@@ -443,10 +659,23 @@ void osd_t::print_slow()
                     }
                 }
                 else if (op->req.hdr.opcode == OSD_OP_READ || op->req.hdr.opcode == OSD_OP_WRITE ||
-                    op->req.hdr.opcode == OSD_OP_SYNC || op->req.hdr.opcode == OSD_OP_DELETE)
+                    op->req.hdr.opcode == OSD_OP_SYNC || op->req.hdr.opcode == OSD_OP_DELETE ||
+                    op->req.hdr.opcode == OSD_OP_MERGE)
                 {
                     bufprintf(" state=%d", !op->op_data ? -1 : op->op_data->st);
                 }
+                if (op->trace)
+                {
+                    // Show the last reached stage of a traced operation
+                    int last_stage = -1;
+                    for (int i = 0; i < OSD_TRACE_STAGES; i++)
+                    {
+                        if ((op->trace->stage_mask & (1 << i)) &&
+                            (last_stage < 0 || op->trace->stage_us[i] >= op->trace->stage_us[last_stage]))
+                            last_stage = i;
+                    }
+                    bufprintf(" trace=%lx last_stage=%s", op->trace_id, last_stage < 0 ? "exec" : osd_trace_stage_names[last_stage]);
+                }
 #undef bufprintf
                 printf("%s\n", alloc);
                 has_slow = true;
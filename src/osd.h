@@ -23,6 +23,10 @@
 #include "osd_peering_pg.h"
 #include "messenger.h"
 #include "etcd_state_client.h"
+#include "osd_unstable_writes.h"
+#include "inode_qos.h"
+#include "osd_trace.h"
+#include "metrics.h"
 
 #define OSD_LOADING_PGS 0x01
 #define OSD_PEERING_PGS 0x04
@@ -38,13 +42,30 @@
 #define MAX_RECOVERY_QUEUE 2048
 #define DEFAULT_RECOVERY_QUEUE 4
 #define DEFAULT_RECOVERY_BATCH 16
+#define RECOVERY_TUNE_INTERVAL_MS 1000
+#define DEFAULT_PEERING_LOG_SIZE 65536
+#define DEFAULT_LAYER_BITMAP_CACHE_SIZE 262144
+#define DEFAULT_COPY_UP_QUEUE_DEPTH 4
+#define COPY_UP_MAX_TRACKED 65536
+#define PEERING_LIST_PAGE_SIZE 131072
+#define PEERING_CALC_BATCH 65536
+#define OSD_STOP_WAIT_MS 10000
+#define SCRUB_CHECK_INTERVAL_MS 1000
+#define SCRUB_LIST_PAGE_SIZE 1024
+#define SCRUB_MAX_REPORTED_OBJECTS 100
 
 //#define OSD_STUB
 
-struct osd_object_id_t
+// Which replica serves reads of clean objects in replicated pools
+#define READ_BALANCE_PRIMARY 0
+#define READ_BALANCE_RANDOM 1
+#define READ_BALANCE_LEAST_QUEUED 2
+#define READ_BALANCE_LOWEST_LATENCY 3
+
+struct osd_read_stat_t
 {
-    osd_num_t osd_num;
-    object_id oid;
+    uint64_t inflight = 0;
+    uint64_t lat_us = 0;
 };
 
 struct osd_recovery_op_t
@@ -53,6 +74,66 @@ struct osd_recovery_op_t
     bool degraded = false;
     object_id oid = { 0 };
     osd_op_t *osd_op = NULL;
+    // Peer OSDs involved in the operation, for per-OSD limits
+    std::vector<osd_num_t> peers;
+    // Misplaced objects with the same OSD set moved together with this one, see rebalance_batch_size
+    std::vector<object_id> batch;
+    // Objects of the batch still in progress, shared by all of them. NULL if there's no batch
+    int *batch_left = NULL;
+};
+
+// Recovery scheduler state, see continue_recovery()
+struct osd_recovery_sched_t
+{
+    // Recovery operations in progress per peer OSD
+    std::map<osd_num_t, int> osd_inflight;
+    // Recovery queue slots in use, a rebalance batch takes one slot
+    int inflight = 0;
+    // Current queue depth, lowered while client latency is above the target
+    int queue_depth = 0;
+    // Set by pick_next_recovery() if objects were skipped because their OSDs were busy
+    bool skipped_busy = false;
+    // Bandwidth and iops token buckets
+    timespec refill_time = { 0 };
+    double bytes_tokens = 0, iops_tokens = 0;
+    uint64_t charged_bytes = 0;
+    int timer_id = -1;
+    // Client op latency totals at the previous tuning
+    timespec tune_time = { 0 };
+    uint64_t tune_lat_sum = 0, tune_lat_count = 0;
+};
+
+// Background scrub state, see continue_scrub()
+struct osd_scrub_sched_t
+{
+    // PG being scrubbed, pool_id = 0 if none
+    pool_pg_num_t pg = { 0 };
+    timespec start_time = { 0 };
+    // Current page of the PG object list and the start of the next page
+    std::vector<object_id> objects;
+    size_t pos = 0;
+    object_id next_start = { 0 };
+    bool listing = false, listed_all = false;
+    // Last object submitted for scrub, the next pages only include objects after it
+    object_id last_oid = { 0 };
+    int inflight = 0;
+    // Results of the current PG
+    uint64_t checked = 0, skipped = 0, inconsistent = 0;
+    json11::Json::array inconsistent_objects;
+    // Last scrub time of PGs (unix time), loaded from /pg/scrub/ in etcd
+    std::map<pool_pg_num_t, uint64_t> last_scrub;
+    time_t load_time = 0;
+    bool loaded = false, loading = false;
+    // Bandwidth and iops token buckets
+    timespec refill_time = { 0 };
+    double bytes_tokens = 0, iops_tokens = 0;
+    int timer_id = -1;
+    // Client latency sample of the last RECOVERY_TUNE_INTERVAL_MS
+    timespec lat_time = { 0 };
+    uint64_t lat_sum = 0, lat_count = 0;
+    bool lat_high = false;
+    // Totals for statistics
+    uint64_t stat_count = 0, stat_bytes = 0, stat_inconsistent = 0;
 };
 
 // Posted as /osd/inodestats/$osd, then accumulated by the monitor
@@ -66,12 +147,37 @@ struct inode_stats_t
     uint64_t op_bytes[3] = { 0 };
 };
 
+// Client operations of one inode delayed by its QoS limits
+struct osd_inode_qos_t
+{
+    inode_qos_bucket_t bucket;
+    std::deque<osd_op_t*> queue;
+    int timer_id = -1;
+};
+
+// Subops collected for one OSD_OP_SEC_BATCH and the sizes of its request and reply,
+// each of them must stay within OSD_RW_MAX
+struct osd_subop_batch_t
+{
+    std::vector<osd_op_t*> subops;
+    uint64_t desc_len = 0, data_len = 0, reply_len = 0;
+};
+
 struct bitmap_request_t
 {
     osd_num_t osd_num;
     object_id oid;
     uint64_t version;
     void *bmp_buf;
+    // Bitmap of a parent layer which may be put into the layer bitmap cache
+    bool cache = false;
+};
+
+struct osd_layer_bitmap_fetch_t
+{
+    int inflight = 0;
+    // The object was written while its bitmap was being read
+    bool stale = false;
 };
 
 inline bool operator < (const bitmap_request_t & a, const bitmap_request_t & b)
@@ -94,6 +200,7 @@ class osd_t
 
     json11::Json::object config;
     int etcd_report_interval = 30;
+    int etcd_full_report_interval = 300;
 
     bool readonly = false;
     osd_num_t osd_num = 1; // OSD numbers start with 1
@@ -102,6 +209,9 @@ class osd_t
     bool no_recovery = false;
     std::string bind_address;
     int bind_port, listen_backlog;
+    // HTTP listener for Prometheus metrics, 0 = disabled
+    std::string metrics_address;
+    int metrics_port = 0;
     // FIXME: Implement client queue depth limit
     int client_queue_depth = 128;
     bool allow_test_ops = false;
@@ -109,9 +219,35 @@ class osd_t
     int slow_log_interval = 10;
     int immediate_commit = IMMEDIATE_NONE;
     int autosync_interval = DEFAULT_AUTOSYNC_INTERVAL; // sync every 5 seconds
+    // Also sync after this number of writes not synced yet, 0 = only by interval
+    uint64_t autosync_writes = 0;
     int recovery_queue_depth = DEFAULT_RECOVERY_QUEUE;
     int recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
+    int recovery_osd_queue_depth = 0;
+    int rebalance_batch_size = 0;
+    uint64_t recovery_bandwidth_limit = 0;
+    uint64_t recovery_iops_limit = 0;
+    uint64_t recovery_client_latency_target = 0;
+    uint64_t scrub_interval = 0;
+    int scrub_queue_depth = 1;
+    uint64_t scrub_bandwidth_limit = 0;
+    uint64_t scrub_iops_limit = 0;
+    uint64_t peering_log_size = DEFAULT_PEERING_LOG_SIZE;
+    // Max. PGs listing objects at the same time during peering, 0 = unlimited
+    int peering_queue_depth = 0;
+    uint64_t layer_bitmap_cache_size = DEFAULT_LAYER_BITMAP_CACHE_SIZE;
+    // Merge parent layer data into a clone object after this many reads of it through parents, 0 = disabled
+    uint64_t copy_up_reads = 0;
+    int copy_up_queue_depth = DEFAULT_COPY_UP_QUEUE_DEPTH;
     int log_level = 0;
+    int read_balance = READ_BALANCE_PRIMARY;
+    // Replicated writes of at least this size are forwarded from replica to replica, 0 = disabled
+    uint64_t pipeline_replication_threshold = 0;
+    // Small subops to the same peer are sent in OSD_OP_SEC_BATCH by up to this number, 0 = disabled
+    uint64_t subop_batch_max = 0;
+    // Trace every Nth client operation, 0 = disabled
+    uint64_t trace_sample = 0;
+    uint64_t trace_buffer_size = DEFAULT_TRACE_BUFFER_SIZE;
 
     // cluster state
 
@@ -125,11 +261,17 @@ class osd_t
     bool pg_config_applied = false;
     bool etcd_reporting_pg_state = false;
     bool etcd_reporting_stats = false;
+    // Statistics values by etcd key (without prefix) last reported successfully and being reported now
+    std::map<std::string, std::string> etcd_reported_stats, etcd_pending_stats;
+    time_t etcd_full_report_time = 0;
 
     // peers and PGs
 
-    std::map<pool_id_t, pg_num_t> pg_counts;
+    // PG counts are indexed by pool ID, so map_to_pg() doesn't search a map on every operation
+    std::vector<pg_num_t> pg_counts = std::vector<pg_num_t>(POOL_ID_MAX);
     std::map<pool_pg_num_t, pg_t> pgs;
+    // Flat index of <pgs>: pg_index[pool_id][pg_num]. Must be updated on every PG insert/erase
+    std::vector<std::vector<pg_t*>> pg_index;
     std::set<pool_pg_num_t> dirty_pgs;
     std::set<osd_num_t> dirty_osds;
     int copies_to_delete_after_sync_count = 0;
@@ -137,16 +279,43 @@ class osd_t
     int peering_state = 0;
     std::map<object_id, osd_recovery_op_t> recovery_ops;
     int recovery_done = 0;
+    osd_recovery_sched_t recovery_sched;
+    osd_scrub_sched_t scrub_sched;
     osd_op_t *autosync_op = NULL;
+    // Writes since the last sync and autosync statistics
+    uint64_t unsynced_writes = 0;
+    uint64_t autosync_count = 0, autosync_usec = 0, autosync_skipped = 0;
+
+    // Bitmaps of parent layer objects (or their EC parts) used by chained reads, so that reads of
+    // cloned images don't read them from other OSDs every time. Entries are removed on writes
+    // to the object, the whole cache is dropped on re-peering and when it's full
+    btree::btree_map<object_id, std::vector<uint8_t>> layer_bitmaps;
+    std::map<object_id, osd_layer_bitmap_fetch_t> layer_bitmap_fetches;
+    // Reads of clone objects served from parent layers and background merges of such objects (copy-up).
+    // Counters are dropped all together when there are too many of them
+    std::map<object_id, uint32_t> copy_up_hits;
+    std::set<object_id> copy_up_inflight;
+    uint64_t copy_up_count = 0, copy_up_failed = 0;
+
+    // Balanced reads in progress and average read latency of each replica, including this OSD
+    std::map<osd_num_t, osd_read_stat_t> read_stats;
 
     // Unstable writes
-    std::map<osd_object_id_t, uint64_t> unstable_writes;
+    osd_unstable_writes_t unstable_writes;
     std::deque<osd_op_t*> syncs_in_progress;
 
     // client & peer I/O
 
     bool stopping = false;
     int inflight_ops = 0;
+    // Small subops waiting to be sent in OSD_OP_SEC_BATCH, by peer_fd
+    std::map<int, osd_subop_batch_t> subop_batches;
+    int stop_timer_id = -1, stop_wait_ticks = 0;
+    // Seconds to wait for primary PGs to move to other OSDs on stop, 0 = stop immediately
+    uint64_t shutdown_drain_timeout = 0;
+    bool stop_requested = false, draining = false;
+    timespec drain_start = { 0 };
+    int drain_timer_id = -1;
     blockstore_t *bs;
     void *zero_buffer = NULL;
     uint64_t zero_buffer_size = 0;
@@ -157,11 +326,18 @@ class osd_t
 
     int listening_port = 0;
     int listen_fd = 0;
+    metrics_server_t *metrics_server = NULL;
     ring_consumer_t consumer;
 
     // op statistics
     osd_op_stats_t prev_stats;
     std::map<uint64_t, inode_stats_t> inode_stats;
+    // Per-inode QoS state, idle buckets are removed by expire_inode_qos()
+    std::map<inode_t, osd_inode_qos_t> inode_qos;
+    int inode_qos_expire_timer_id = -1;
+    // Ring buffer of completed traced operations
+    std::vector<osd_trace_record_t> trace_ring;
+    uint64_t trace_ring_count = 0, trace_op_counter = 0, trace_seq = 0;
     const char* recovery_stat_names[2] = { "degraded", "misplaced" };
     uint64_t recovery_stat_count[2][2] = { 0 };
     uint64_t recovery_stat_bytes[2][2] = { 0 };
@@ -180,13 +356,18 @@ class osd_t
     json11::Json get_osd_state();
     void create_osd_state();
     void renew_lease();
+    void finish_stop(int exitcode);
+    void report_drain_state();
+    void check_drained();
     void print_stats();
     void print_slow();
     void reset_stats();
     json11::Json get_statistics();
+    std::string get_metrics();
     void report_statistics();
     void report_pg_state(pg_t & pg);
     void report_pg_states();
+    void apply_pool_compression();
     void apply_pg_count();
     void apply_pg_config();
 
@@ -198,9 +379,13 @@ class osd_t
     void handle_peers();
     void repeer_pgs(osd_num_t osd_num);
     void start_pg_peering(pg_t & pg);
+    void submit_peering_lists(pg_t & pg);
+    void start_queued_peerings();
     void submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *ps);
-    void submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps);
+    void submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps, object_id start_oid = {});
     void discard_list_subop(osd_op_t *list_op);
+    bool can_list_changed(pg_t & pg);
+    bool check_list_summaries(pg_t & pg);
     bool stop_pg(pg_t & pg);
     void reset_pg(pg_t & pg);
     void finish_stop_pg(pg_t & pg);
@@ -209,11 +394,25 @@ class osd_t
     void submit_pg_flush_ops(pg_t & pg);
     void handle_flush_op(bool rollback, pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t *fb, osd_num_t peer_osd, int retval);
     void submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t *fb, bool rollback, osd_num_t peer_osd, int count, obj_ver_id *data);
+    bool recovery_osd_busy(osd_num_t peer_osd);
+    void add_recovery_peer(osd_recovery_op_t &op, osd_num_t peer_osd);
     bool pick_next_recovery(osd_recovery_op_t &op);
+    void tune_recovery();
+    bool throttle_recovery();
     void submit_recovery_op(osd_recovery_op_t *op);
     bool continue_recovery();
     pg_osd_set_state_t* change_osd_set(pg_osd_set_state_t *st, pg_t *pg);
 
+    // background scrub
+    void load_scrub_times();
+    bool pick_next_scrub_pg();
+    void list_scrub_objects(pg_t & pg);
+    bool throttle_scrub();
+    bool scrub_latency_high();
+    void submit_scrub_op(object_id oid, pg_t & pg);
+    void finish_pg_scrub();
+    void continue_scrub();
+
     // op execution
     void exec_op(osd_op_t *cur_op);
     void finish_op(osd_op_t *cur_op, int retval);
@@ -222,32 +421,75 @@ class osd_t
     void exec_sync_stab_all(osd_op_t *cur_op);
     void exec_show_config(osd_op_t *cur_op);
     void exec_secondary(osd_op_t *cur_op);
+    bool throttle_inode_op(osd_op_t *cur_op);
+    void continue_inode_qos(inode_t inode);
+    void expire_inode_qos();
     void secondary_op_callback(osd_op_t *cur_op);
+    void forward_pipelined_write(osd_op_t *cur_op);
+    void exec_sec_batch(osd_op_t *cur_op);
+
+    // op tracing
+    void trace_start(osd_op_t *cur_op);
+    inline void trace_stage(osd_op_t *cur_op, int stage)
+    {
+        if (cur_op->trace)
+        {
+            timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            cur_op->trace->stage_us[stage] = (now.tv_sec - cur_op->tv_begin.tv_sec)*1000000 +
+                (now.tv_nsec - cur_op->tv_begin.tv_nsec)/1000;
+            cur_op->trace->stage_mask |= (1 << stage);
+        }
+    }
+    void trace_subop_done(osd_op_t *cur_op, osd_op_t *subop);
+    void trace_finish(osd_op_t *cur_op, int retval);
+    void exec_show_traces(osd_op_t *cur_op);
+
+    // memory accounting
+    json11::Json get_memory_stats(uint64_t max_pgs);
+    void exec_show_memory(osd_op_t *cur_op);
 
     // primary ops
     void autosync();
+    void periodic_autosync();
     bool prepare_primary_rw(osd_op_t *cur_op);
+    bool exec_replica_read(osd_op_t *cur_op, pool_config_t & pool_cfg, object_id oid, pg_num_t pg_num);
     void continue_primary_read(osd_op_t *cur_op);
     void continue_primary_write(osd_op_t *cur_op);
     void cancel_primary_write(osd_op_t *cur_op);
     void continue_primary_sync(osd_op_t *cur_op);
     void continue_primary_del(osd_op_t *cur_op);
+    void continue_primary_merge(osd_op_t *cur_op);
+    void continue_primary_delete_range(osd_op_t *cur_op);
+    void continue_primary_scrub(osd_op_t *cur_op);
+    void continue_primary_op(osd_op_t *cur_op);
     bool check_write_queue(osd_op_t *cur_op, pg_t & pg);
     void remove_object_from_state(object_id & oid, pg_osd_set_state_t *object_state, pg_t &pg);
     void free_object_state(pg_t & pg, pg_osd_set_state_t **object_state);
     bool remember_unstable_write(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set, int base_state);
     void handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op);
+    void submit_pipeline_fallback(osd_op_t *subop, osd_op_t *cur_op);
+    void queue_subop(osd_op_t *subop);
+    void flush_subop_batches();
+    void cancel_subop_batch(int peer_fd);
+    void send_subop_batch(int peer_fd, std::vector<osd_op_t*> & subops);
+    void handle_subop_batch(osd_op_t *batch, const std::vector<osd_op_t*> & subops);
     void handle_primary_bs_subop(osd_op_t *subop);
     void add_bs_subop_stats(osd_op_t *subop);
     void pg_cancel_write_queue(pg_t & pg, osd_op_t *first_op, object_id oid, int retval);
 
-    void submit_primary_subops(int submit_type, uint64_t op_version, const uint64_t* osd_set, osd_op_t *cur_op);
+    uint32_t get_bs_priority(osd_op_t *cur_op);
+    void submit_primary_subops(int submit_type, uint64_t op_version, const uint64_t* osd_set, osd_op_t *cur_op, int read_role = -1);
+    int pick_read_role(pg_t & pg);
+    void finish_balanced_read(osd_op_t *subop, osd_op_t *cur_op);
     int submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t op_version,
-        osd_rmw_stripe_t *stripes, const uint64_t* osd_set, osd_op_t *cur_op, int subop_idx, int zero_read);
+        osd_rmw_stripe_t *stripes, const uint64_t* osd_set, osd_op_t *cur_op, int subop_idx, int zero_read, int pipeline_len = 0);
     void submit_primary_del_subops(osd_op_t *cur_op, uint64_t *cur_set, uint64_t set_size, pg_osd_set_t & loc_set);
     void submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_delete, int chunks_to_delete_count);
     int submit_primary_sync_subops(osd_op_t *cur_op);
     void submit_primary_stab_subops(osd_op_t *cur_op);
+    void submit_scrub_subops(osd_op_t *cur_op, pg_t & pg);
+    int check_scrub_results(osd_op_t *cur_op, pg_t & pg, osd_num_t *bad_osds);
 
     uint64_t* get_object_osd_set(pg_t &pg, object_id &oid, uint64_t *def, pg_osd_set_state_t **object_state);
 
@@ -258,6 +500,44 @@ class osd_t
     int collect_bitmap_requests(osd_op_t *cur_op, pg_t & pg, std::vector<bitmap_request_t> & bitmap_requests);
     int submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg);
     int read_bitmaps(osd_op_t *cur_op, pg_t & pg, int base_state);
+    bool is_layer_bitmap_cacheable(pg_t & pg, const object_id & oid);
+    bool get_cached_layer_bitmap(const object_id & oid, void *bmp_buf);
+    void put_layer_bitmap(const object_id & oid, void *bmp_buf);
+    void start_layer_bitmap_fetch(const object_id & oid);
+    void finish_layer_bitmap_fetch(const object_id & oid, void *bmp_buf);
+    void invalidate_layer_bitmaps(const object_id & oid);
+    void clear_layer_bitmaps();
+    void check_copy_up(osd_op_t *cur_op);
+
+    inline pg_t *find_pg(pool_id_t pool_id, pg_num_t pg_num)
+    {
+        if (pool_id >= pg_index.size() || pg_num >= pg_index[pool_id].size())
+            return NULL;
+        return pg_index[pool_id][pg_num];
+    }
+
+    inline pg_t & get_pg(pool_id_t pool_id, pg_num_t pg_num)
+    {
+        pg_t *pg = find_pg(pool_id, pg_num);
+        if (!pg)
+            throw std::out_of_range("PG "+std::to_string(pool_id)+"/"+std::to_string(pg_num)+" does not exist");
+        return *pg;
+    }
+
+    inline void index_pg(pg_t & pg)
+    {
+        if (pg_index.size() <= pg.pool_id)
+            pg_index.resize(pg.pool_id+1);
+        if (pg_index[pg.pool_id].size() <= pg.pg_num)
+            pg_index[pg.pool_id].resize(pg.pg_num+1);
+        pg_index[pg.pool_id][pg.pg_num] = &pg;
+    }
+
+    inline void unindex_pg(pool_id_t pool_id, pg_num_t pg_num)
+    {
+        if (find_pg(pool_id, pg_num))
+            pg_index[pool_id][pg_num] = NULL;
+    }
 
     inline pg_num_t map_to_pg(object_id oid, uint64_t pg_stripe_size)
     {
@@ -271,17 +551,6 @@ public:
     osd_t(const json11::Json & config, ring_loop_t *ringloop);
     ~osd_t();
     void force_stop(int exitcode);
+    void drain_and_stop();
     bool shutdown();
 };
-
-inline bool operator == (const osd_object_id_t & a, const osd_object_id_t & b)
-{
-    return a.osd_num == b.osd_num && a.oid.inode == b.oid.inode && a.oid.stripe == b.oid.stripe;
-}
-
-inline bool operator < (const osd_object_id_t & a, const osd_object_id_t & b)
-{
-    return a.osd_num < b.osd_num || a.osd_num == b.osd_num && (
-        a.oid.inode < b.oid.inode || a.oid.inode == b.oid.inode && a.oid.stripe < b.oid.stripe
-    );
-}
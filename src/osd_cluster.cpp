@@ -6,6 +6,7 @@
 #include "etcd_state_client.h"
 #include "http_client.h"
 #include "osd_rmw.h"
+#include "buffer_pool.h"
 
 // Startup sequence:
 //   Start etcd watcher -> Load global OSD configuration -> Bind socket -> Acquire lease -> Report&lock OSD state
@@ -54,6 +55,7 @@ void osd_t::init_cluster()
                 .pg_count = 1,
                 .real_pg_count = 1,
             };
+            index_pg(pgs[{ 1, 1 }]);
             report_pg_state(pgs[{ 1, 1 }]);
             pg_counts[1] = 1;
         }
@@ -74,9 +76,20 @@ void osd_t::init_cluster()
     }
     if (run_primary && autosync_interval > 0)
     {
-        this->tfd->set_timer(autosync_interval*1000, true, [this](int timer_id)
+        // Start at an offset depending on the OSD number, so that OSDs started together don't sync at the same time
+        this->tfd->set_timer(1 + (osd_num*7919) % (autosync_interval*1000), false, [this](int timer_id)
         {
-            autosync();
+            this->tfd->set_timer(autosync_interval*1000, true, [this](int timer_id)
+            {
+                periodic_autosync();
+            });
+        });
+    }
+    if (run_primary && scrub_interval > 0)
+    {
+        this->tfd->set_timer(SCRUB_CHECK_INTERVAL_MS, true, [this](int timer_id)
+        {
+            continue_scrub();
         });
     }
 }
@@ -122,11 +135,25 @@ json11::Json osd_t::get_osd_state()
         st["addresses"] = getifaddr_list();
     st["host"] = std::string(hostname.data(), hostname.size());
     st["port"] = listening_port;
-    st["primary_enabled"] = run_primary;
+    // Monitors move primaries away from draining OSDs
+    st["primary_enabled"] = run_primary && !draining;
     st["blockstore_enabled"] = bs ? true : false;
+    st["features"] = json11::Json::object { { "list_changed", true } };
     return st;
 }
 
+// Only non-empty buckets are reported, keyed by the lowest latency of the bucket in us
+static json11::Json::object dump_latency_hist(const latency_hist_t & hist)
+{
+    json11::Json::object res;
+    for (int b = 0; b < LAT_HIST_BUCKETS; b++)
+    {
+        if (hist.buckets[b])
+            res[std::to_string(latency_hist_t::bucket_start(b))] = hist.buckets[b];
+    }
+    return res;
+}
+
 json11::Json osd_t::get_statistics()
 {
     json11::Json::object st;
@@ -149,6 +176,7 @@ json11::Json osd_t::get_statistics()
             { "count", msgr.stats.op_stat_count[i] },
             { "usec", msgr.stats.op_stat_sum[i] },
             { "bytes", msgr.stats.op_stat_bytes[i] },
+            { "usec_hist", dump_latency_hist(msgr.stats.op_stat_hist[i]) },
         };
     }
     for (int i = OSD_OP_MIN; i <= OSD_OP_MAX; i++)
@@ -156,6 +184,7 @@ json11::Json osd_t::get_statistics()
         subop_stats[osd_op_names[i]] = json11::Json::object {
             { "count", msgr.stats.subop_stat_count[i] },
             { "usec", msgr.stats.subop_stat_sum[i] },
+            { "usec_hist", dump_latency_hist(msgr.stats.subop_stat_hist[i]) },
         };
     }
     st["op_stats"] = op_stats;
@@ -170,9 +199,92 @@ json11::Json osd_t::get_statistics()
             { "bytes", recovery_stat_bytes[0][1] },
         } },
     };
+    st["recovery_progress"] = json11::Json::object {
+        { "degraded_objects", degraded_objects },
+        { "misplaced_objects", misplaced_objects },
+        { "incomplete_objects", incomplete_objects },
+        { "in_flight", recovery_ops.size() },
+    };
+    st["scrub_stats"] = json11::Json::object {
+        { "count", scrub_sched.stat_count },
+        { "bytes", scrub_sched.stat_bytes },
+        { "inconsistent", scrub_sched.stat_inconsistent },
+    };
+    st["ring_stats"] = json11::Json::object {
+        { "submit", ringloop->stats.submit_count },
+        { "submit_syscalls", ringloop->stats.submit_syscalls },
+        { "wait", ringloop->stats.wait_count },
+        { "wait_syscalls", ringloop->stats.wait_syscalls },
+        { "busy_poll_hits", ringloop->stats.busy_poll_hits },
+        { "cqe", ringloop->stats.cqe_count },
+        { "space_left", ringloop->space_left() },
+    };
+    st["msgr_stats"] = json11::Json::object {
+        { "send", msgr.stats.send_count },
+        { "send_bytes", msgr.stats.send_bytes },
+        { "send_delayed", msgr.stats.send_delayed },
+    };
+    if (bs)
+    {
+        blockstore_flusher_stats_t fl = bs->get_flusher_stats();
+        st["flusher_stats"] = json11::Json::object {
+            { "journal_used", fl.journal_used },
+            { "journal_size", fl.journal_size },
+            { "dirty_objects", fl.dirty_objects },
+            { "flush_queue", fl.flush_queue },
+            { "active_flushers", fl.active_flushers },
+            { "target_flushers", fl.target_flushers },
+            { "flush_rate", fl.flush_rate },
+        };
+    }
+    ec_decoding_cache_stats_t ec_cache = get_ec_decoding_cache_stats();
+    st["ec_decoding_cache"] = json11::Json::object {
+        { "hits", ec_cache.hits },
+        { "misses", ec_cache.misses },
+        { "evictions", ec_cache.evictions },
+        { "size", ec_cache.size },
+    };
+    ec_rmw_stats_t ec_rmw = get_ec_rmw_stats();
+    st["ec_rmw"] = json11::Json::object {
+        { "full", ec_rmw.full },
+        { "parity_delta", ec_rmw.parity_delta },
+    };
+    st["autosync_stats"] = json11::Json::object {
+        { "count", autosync_count },
+        { "usec", autosync_usec },
+        { "skipped", autosync_skipped },
+    };
+    st["copy_up"] = json11::Json::object {
+        { "count", copy_up_count },
+        { "failed", copy_up_failed },
+        { "inflight", copy_up_inflight.size() },
+    };
+    osd_op_pool_stats_t op_pool = get_osd_op_pool_stats();
+    st["op_pool"] = json11::Json::object {
+        { "used", op_pool.used },
+        { "allocated_bytes", op_pool.allocated_bytes },
+    };
+    buffer_pool_t & buf_pool = thread_buffer_pool();
+    st["buffer_pool"] = json11::Json::object {
+        { "used_bytes", buf_pool.get_used_bytes() },
+        { "allocated_bytes", buf_pool.get_allocated_bytes() },
+    };
+    st["memory"] = get_memory_stats(0);
     return st;
 }
 
+std::string osd_t::get_metrics()
+{
+    std::string out, labels = "osd_num=\""+std::to_string(osd_num)+"\"";
+    metrics_add_op_stats(out, "vitastor_osd", labels, msgr.stats, true, true);
+    // Op statistics are already added as histograms
+    json11::Json::object st = get_statistics().object_items();
+    st.erase("op_stats");
+    st.erase("subop_stats");
+    metrics_add_json(out, "vitastor_osd", labels, st);
+    return out;
+}
+
 void osd_t::report_statistics()
 {
     if (etcd_reporting_stats)
@@ -185,6 +297,7 @@ void osd_t::report_statistics()
     json11::Json::object inode_space;
     json11::Json::object last_stat;
     pool_id_t last_pool = 0;
+    auto & compr_stats = bs->get_inode_compr_stats();
     for (auto kv: bs->get_inode_space_stats())
     {
         pool_id_t pool_id = INODE_POOL(kv.first);
@@ -196,7 +309,18 @@ void osd_t::report_statistics()
             last_stat = json11::Json::object();
             last_pool = pool_id;
         }
-        last_stat[std::to_string(only_inode_num)] = kv.second;
+        auto compr_it = compr_stats.find(kv.first);
+        if (compr_it != compr_stats.end())
+        {
+            // Inodes with compressed data are reported with the logical and stored size of compressed blocks
+            last_stat[std::to_string(only_inode_num)] = json11::Json::object {
+                { "raw_used", kv.second },
+                { "compressed_raw", compr_it->second.first },
+                { "compressed_stored", compr_it->second.second },
+            };
+        }
+        else
+            last_stat[std::to_string(only_inode_num)] = kv.second;
     }
     if (last_pool)
         inode_space[std::to_string(last_pool)] = last_stat;
@@ -234,26 +358,32 @@ void osd_t::report_statistics()
     }
     if (last_pool)
         inode_ops[std::to_string(last_pool)] = last_stat;
-    json11::Json::array txn = {
-        json11::Json::object {
-            { "request_put", json11::Json::object {
-                { "key", base64_encode(st_cli.etcd_prefix+"/osd/stats/"+std::to_string(osd_num)) },
-                { "value", base64_encode(get_statistics().dump()) },
-            } },
-        },
-        json11::Json::object {
-            { "request_put", json11::Json::object {
-                { "key", base64_encode(st_cli.etcd_prefix+"/osd/space/"+std::to_string(osd_num)) },
-                { "value", base64_encode(json11::Json(inode_space).dump()) },
-            } },
-        },
-        json11::Json::object {
+    // Only put values changed since the last successful report, but repeat all of them every
+    // etcd_full_report_interval, because they may be removed by the monitor or the CLI
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bool full_report = !etcd_full_report_time || now.tv_sec >= etcd_full_report_time + etcd_full_report_interval;
+    json11::Json::array txn;
+    etcd_pending_stats.clear();
+    auto put_changed = [&](const std::string & key, const std::string & value)
+    {
+        if (!full_report)
+        {
+            auto prev_it = etcd_reported_stats.find(key);
+            if (prev_it != etcd_reported_stats.end() && prev_it->second == value)
+                return;
+        }
+        txn.push_back(json11::Json::object {
             { "request_put", json11::Json::object {
-                { "key", base64_encode(st_cli.etcd_prefix+"/osd/inodestats/"+std::to_string(osd_num)) },
-                { "value", base64_encode(json11::Json(inode_ops).dump()) },
+                { "key", base64_encode(st_cli.etcd_prefix+key) },
+                { "value", base64_encode(value) },
             } },
-        },
+        });
+        etcd_pending_stats[key] = value;
     };
+    put_changed("/osd/stats/"+std::to_string(osd_num), get_statistics().dump());
+    put_changed("/osd/space/"+std::to_string(osd_num), json11::Json(inode_space).dump());
+    put_changed("/osd/inodestats/"+std::to_string(osd_num), json11::Json(inode_ops).dump());
     for (auto & p: pgs)
     {
         auto & pg = p.second;
@@ -269,16 +399,26 @@ void osd_t::report_statistics()
         pg_stats["degraded_count"] = pg.degraded_objects.size();
         pg_stats["incomplete_count"] = pg.incomplete_objects.size();
         pg_stats["write_osd_set"] = pg.cur_set;
-        txn.push_back(json11::Json::object {
-            { "request_put", json11::Json::object {
-                { "key", base64_encode(st_cli.etcd_prefix+"/pg/stats/"+std::to_string(pg.pool_id)+"/"+std::to_string(pg.pg_num)) },
-                { "value", base64_encode(json11::Json(pg_stats).dump()) },
-            } }
-        });
+        put_changed("/pg/stats/"+std::to_string(pg.pool_id)+"/"+std::to_string(pg.pg_num), json11::Json(pg_stats).dump());
     }
-    st_cli.etcd_txn(json11::Json::object { { "success", txn } }, ETCD_SLOW_TIMEOUT, [this](std::string err, json11::Json res)
+    st_cli.etcd_txn(json11::Json::object { { "success", txn } }, ETCD_SLOW_TIMEOUT, [this, full_report, now](std::string err, json11::Json res)
     {
         etcd_reporting_stats = false;
+        if (err == "" && res["error"].string_value() == "")
+        {
+            if (full_report)
+            {
+                // Also forget PGs which are not reported anymore
+                etcd_reported_stats.swap(etcd_pending_stats);
+                etcd_full_report_time = now.tv_sec;
+            }
+            else
+            {
+                for (auto & kv: etcd_pending_stats)
+                    etcd_reported_stats[kv.first] = kv.second;
+            }
+        }
+        etcd_pending_stats.clear();
         if (err != "")
         {
             printf("[OSD %lu] Error reporting state to etcd: %s\n", this->osd_num, err.c_str());
@@ -307,10 +447,28 @@ void osd_t::on_change_osd_state_hook(osd_num_t peer_osd)
 void osd_t::on_change_etcd_state_hook(std::map<std::string, etcd_kv_t> & changes)
 {
     // FIXME apply config changes in runtime (maybe, some)
+    if (!changes.size() || changes.find(st_cli.etcd_prefix+"/config/pools") != changes.end())
+    {
+        apply_pool_compression();
+    }
     if (run_primary)
     {
-        apply_pg_count();
-        apply_pg_config();
+        // Inode metadata changes don't affect PGs, so don't recheck all PGs on every image create or resize
+        bool pgs_changed = !changes.size();
+        std::string inode_prefix = st_cli.etcd_prefix+"/config/inode/";
+        for (auto & kv: changes)
+        {
+            if (kv.first.substr(0, inode_prefix.size()) != inode_prefix)
+            {
+                pgs_changed = true;
+                break;
+            }
+        }
+        if (pgs_changed)
+        {
+            apply_pg_count();
+            apply_pg_config();
+        }
     }
 }
 
@@ -324,16 +482,15 @@ void osd_t::on_change_pg_history_hook(pool_id_t pool_id, pg_num_t pg_num)
         st_cli.pool_config[pool_id].pg_config[pg_num].epoch >= pg_it->second.epoch)
     {
         pg_it->second.reported_epoch = st_cli.pool_config[pool_id].pg_config[pg_num].epoch;
-        object_id oid = { 0 };
-        bool first = true;
-        for (auto op: pg_it->second.write_queue)
+        // Continuing writes may modify the queue, so collect them first
+        std::vector<osd_op_t*> continue_ops;
+        pg_it->second.write_queue.for_each_first([&](const object_id & oid, osd_op_t *op)
         {
-            if (first || oid != op.first)
-            {
-                oid = op.first;
-                first = false;
-                continue_primary_write(op.second);
-            }
+            continue_ops.push_back(op);
+        });
+        for (auto op: continue_ops)
+        {
+            continue_primary_write(op);
         }
     }
 }
@@ -493,14 +650,116 @@ void osd_t::force_stop(int exitcode)
             {
                 printf("Error revoking etcd lease: %s\n", err.c_str());
             }
-            printf("[OSD %lu] Force stopping\n", this->osd_num);
-            exit(exitcode);
+            finish_stop(exitcode);
         });
     }
     else
     {
-        printf("[OSD %lu] Force stopping\n", this->osd_num);
-        exit(exitcode);
+        finish_stop(exitcode);
+    }
+}
+
+void osd_t::finish_stop(int exitcode)
+{
+    // Give the blockstore some time to finish flushing and save its clean_db checkpoint
+    if (exitcode == 0 && bs && bs->has_checkpoint() && !shutdown() && stop_wait_ticks < OSD_STOP_WAIT_MS/10)
+    {
+        if (stop_timer_id < 0)
+        {
+            printf("[OSD %lu] Waiting for the blockstore to save clean_db checkpoint\n", this->osd_num);
+            stop_timer_id = tfd->set_timer(10, true, [this, exitcode](int timer_id)
+            {
+                stop_wait_ticks++;
+                finish_stop(exitcode);
+            });
+        }
+        return;
+    }
+    if (stop_timer_id >= 0)
+    {
+        tfd->clear_timer(stop_timer_id);
+        stop_timer_id = -1;
+    }
+    printf("[OSD %lu] Force stopping\n", this->osd_num);
+    exit(exitcode);
+}
+
+// Graceful stop: report primary_enabled=false so that monitors move primary PGs to other OSDs,
+// keep serving them until they're handed over and sync unstable writes, then stop. Clients then
+// switch to new primaries without waiting for a connection reset and up_wait_retry_interval.
+// A repeated stop request while draining stops without waiting for PGs to move
+void osd_t::drain_and_stop()
+{
+    if (stop_requested)
+    {
+        if (drain_timer_id >= 0)
+        {
+            printf("[OSD %lu] Stopping without waiting for %lu primary PG(s) to move\n", osd_num, pgs.size());
+            tfd->clear_timer(drain_timer_id);
+            drain_timer_id = -1;
+            force_stop(0);
+        }
+        return;
+    }
+    stop_requested = true;
+    if (!shutdown_drain_timeout || !run_primary || etcd_lease_id == "" || !pgs.size())
+    {
+        force_stop(0);
+        return;
+    }
+    printf("[OSD %lu] Moving %lu primary PG(s) to other OSDs before stopping\n", osd_num, pgs.size());
+    draining = true;
+    clock_gettime(CLOCK_REALTIME, &drain_start);
+    autosync();
+    report_drain_state();
+    drain_timer_id = tfd->set_timer(100, true, [this](int timer_id)
+    {
+        check_drained();
+    });
+}
+
+void osd_t::report_drain_state()
+{
+    self_state = get_osd_state();
+    std::string state_key = base64_encode(st_cli.etcd_prefix+"/osd/state/"+std::to_string(osd_num));
+    st_cli.etcd_txn(json11::Json::object {
+        { "success", json11::Json::array {
+            json11::Json::object {
+                { "request_put", json11::Json::object {
+                    { "key", state_key },
+                    { "value", base64_encode(self_state.dump()) },
+                    { "lease", etcd_lease_id },
+                } }
+            },
+        } },
+    }, ETCD_QUICK_TIMEOUT, [this](std::string err, json11::Json data)
+    {
+        if (err != "" && draining)
+        {
+            printf("Error reporting OSD drain state to etcd: %s, retrying\n", err.c_str());
+            tfd->set_timer(ETCD_QUICK_TIMEOUT, false, [this](int timer_id)
+            {
+                report_drain_state();
+            });
+        }
+    });
+}
+
+void osd_t::check_drained()
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    bool timed_out = now.tv_sec - drain_start.tv_sec >= shutdown_drain_timeout;
+    // PGs are forgotten after they're stopped and their offline state is reported
+    if (!pgs.size() && !autosync_op && !syncs_in_progress.size() || timed_out)
+    {
+        if (timed_out)
+            printf("[OSD %lu] %lu PG(s) are still primary after %lu s, stopping anyway\n", osd_num, pgs.size(), shutdown_drain_timeout);
+        else
+            printf("[OSD %lu] All primary PGs are moved to other OSDs\n", osd_num);
+        tfd->clear_timer(drain_timer_id);
+        drain_timer_id = -1;
+        force_stop(0);
     }
 }
 
@@ -527,11 +786,26 @@ void osd_t::on_load_pgs_hook(bool success)
     else
     {
         peering_state &= ~OSD_LOADING_PGS;
+        apply_pool_compression();
         apply_pg_count();
         apply_pg_config();
     }
 }
 
+void osd_t::apply_pool_compression()
+{
+    std::map<uint64_t, int> pool_compression;
+    for (auto & pool_item: st_cli.pool_config)
+    {
+        if (pool_item.second.exists && pool_item.second.compression != "")
+        {
+            pool_compression[pool_item.first] = pool_item.second.compression == "zstd"
+                ? BS_COMPRESS_ZSTD : BS_COMPRESS_LZ4;
+        }
+    }
+    bs->set_pool_compression(pool_compression);
+}
+
 void osd_t::apply_pg_count()
 {
     for (auto & pool_item: st_cli.pool_config)
@@ -673,6 +947,7 @@ void osd_t::apply_pg_config()
                     .all_peers = std::vector<osd_num_t>(all_peers.begin(), all_peers.end()),
                     .target_set = pg_cfg.target_set,
                 };
+                index_pg(pg);
                 if (pg.scheme == POOL_SCHEME_JERASURE)
                 {
                     use_jerasure(pg.pg_size, pg.pg_data_size, true);
@@ -790,11 +1065,18 @@ void osd_t::report_pg_states()
                 // Prevent race conditions (for the case when the monitor is updating this key at the same time)
                 pg.history_changed = false;
                 std::string history_key = base64_encode(st_cli.etcd_prefix+"/pg/history/"+std::to_string(pg.pool_id)+"/"+std::to_string(pg.pg_num));
+                // Store history compactly: target_set OSDs are peered anyway, and histories
+                // of clean PGs are reduced to just the epoch
+                std::vector<std::vector<osd_num_t>> osd_sets = pg.target_history;
+                std::vector<osd_num_t> all_peers = pg.all_peers;
+                compact_pg_history(osd_sets, all_peers, pg.target_set);
                 json11::Json::object history_value = {
                     { "epoch", pg.epoch },
-                    { "all_peers", pg.all_peers },
-                    { "osd_sets", pg.target_history },
                 };
+                if (all_peers.size())
+                    history_value["all_peers"] = all_peers;
+                if (osd_sets.size())
+                    history_value["osd_sets"] = osd_sets;
                 checks.push_back(json11::Json::object {
                     { "target", "MOD" },
                     { "key", history_key },
@@ -880,6 +1162,7 @@ void osd_t::report_pg_states()
                     {
                         use_jerasure(pg_it->second.pg_size, pg_it->second.pg_data_size, false);
                     }
+                    unindex_pg(pg_it->first.pool_id, pg_it->first.pg_num);
                     this->pgs.erase(pg_it);
                 }
             }
@@ -108,14 +108,16 @@ void osd_t::handle_flush_op(bool rollback, pool_id_t pool_id, pg_num_t pg_num, p
                     .inode = prev_it->first.oid.inode,
                     .stripe = (prev_it->first.oid.stripe & ~STRIPE_MASK),
                 });
-                auto wr_it = pg.write_queue.find((object_id){
+                invalidate_layer_bitmaps(prev_it->first.oid);
+                object_id wr_oid = {
                     .inode = prev_it->first.oid.inode,
                     .stripe = (prev_it->first.oid.stripe & ~STRIPE_MASK),
-                });
-                if (wr_it != pg.write_queue.end())
+                };
+                osd_op_t *wr_op = pg.write_queue.first(wr_oid);
+                if (wr_op)
                 {
-                    continue_ops.push_back(wr_it->second);
-                    pg.write_queue.erase(wr_it);
+                    continue_ops.push_back(wr_op);
+                    pg.write_queue.pop(wr_oid);
                 }
             }
             if ((it == pg.flush_actions.end() || !it->second.submitted) &&
@@ -147,7 +149,7 @@ void osd_t::handle_flush_op(bool rollback, pool_id_t pool_id, pg_num_t pg_num, p
         }
         for (osd_op_t *op: continue_ops)
         {
-            continue_primary_write(op);
+            continue_primary_op(op);
         }
         if ((pg.state & PG_STOPPING) && pg.inflight == 0 && !pg.flush_batch)
         {
@@ -211,24 +213,101 @@ void osd_t::submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t
     }
 }
 
+bool osd_t::recovery_osd_busy(osd_num_t peer_osd)
+{
+    if (!recovery_osd_queue_depth || !peer_osd || peer_osd == this->osd_num)
+    {
+        return false;
+    }
+    auto it = recovery_sched.osd_inflight.find(peer_osd);
+    return it != recovery_sched.osd_inflight.end() && it->second >= recovery_osd_queue_depth;
+}
+
+void osd_t::add_recovery_peer(osd_recovery_op_t &op, osd_num_t peer_osd)
+{
+    if (peer_osd && peer_osd != this->osd_num &&
+        std::find(op.peers.begin(), op.peers.end(), peer_osd) == op.peers.end())
+    {
+        op.peers.push_back(peer_osd);
+    }
+}
+
+// Objects are picked in PG order, but PGs and objects whose OSDs already run
+// <recovery_osd_queue_depth> recovery operations are skipped, so a single slow OSD
+// doesn't occupy the whole recovery queue while the rest of the OSDs are idle.
+// Recovery writes go to all OSDs of the PG's current set, so it's checked first,
+// and OSDs only holding the old copies of the object are checked for each object.
+// Up to <rebalance_batch_size>-1 following misplaced objects with the same OSD set are
+// picked into op.batch to be moved together
 bool osd_t::pick_next_recovery(osd_recovery_op_t &op)
 {
-    if (!no_recovery)
+    auto pg_busy = [this](pg_t & pg)
     {
-        for (auto pg_it = pgs.begin(); pg_it != pgs.end(); pg_it++)
+        for (osd_num_t peer_osd: pg.cur_set)
+            if (recovery_osd_busy(peer_osd))
+                return true;
+        return false;
+    };
+    auto pick_obj = [&](pg_t & pg, btree::btree_map<object_id, pg_osd_set_state_t*> & objects, bool degraded)
+    {
+        pg_osd_set_state_t *busy_state = NULL;
+        for (auto obj_it = objects.begin(); obj_it != objects.end(); obj_it++)
         {
-            if ((pg_it->second.state & (PG_ACTIVE | PG_HAS_DEGRADED)) == (PG_ACTIVE | PG_HAS_DEGRADED))
+            if (obj_it->second == busy_state || recovery_ops.find(obj_it->first) != recovery_ops.end())
+            {
+                continue;
+            }
+            bool busy = false;
+            for (auto & loc: obj_it->second->osd_set)
             {
-                for (auto obj_it = pg_it->second.degraded_objects.begin(); obj_it != pg_it->second.degraded_objects.end(); obj_it++)
+                if (recovery_osd_busy(loc.osd_num))
+                {
+                    busy = true;
+                    break;
+                }
+            }
+            if (busy)
+            {
+                // Objects with the same OSD set share the state
+                busy_state = obj_it->second;
+                recovery_sched.skipped_busy = true;
+                continue;
+            }
+            op.degraded = degraded;
+            op.oid = obj_it->first;
+            op.peers.clear();
+            for (osd_num_t peer_osd: pg.cur_set)
+                add_recovery_peer(op, peer_osd);
+            for (auto & loc: obj_it->second->osd_set)
+                add_recovery_peer(op, loc.osd_num);
+            op.batch.clear();
+            if (!degraded && rebalance_batch_size > 1)
+            {
+                // Take the following objects while they have the same OSD set
+                auto state = obj_it->second;
+                for (obj_it++; obj_it != objects.end() && obj_it->second == state &&
+                    op.batch.size() < rebalance_batch_size-1; obj_it++)
                 {
                     if (recovery_ops.find(obj_it->first) == recovery_ops.end())
-                    {
-                        op.degraded = true;
-                        op.oid = obj_it->first;
-                        return true;
-                    }
+                        op.batch.push_back(obj_it->first);
                 }
             }
+            return true;
+        }
+        return false;
+    };
+    recovery_sched.skipped_busy = false;
+    if (!no_recovery)
+    {
+        for (auto pg_it = pgs.begin(); pg_it != pgs.end(); pg_it++)
+        {
+            if ((pg_it->second.state & (PG_ACTIVE | PG_HAS_DEGRADED)) == (PG_ACTIVE | PG_HAS_DEGRADED))
+            {
+                if (pg_busy(pg_it->second))
+                    recovery_sched.skipped_busy = true;
+                else if (pick_obj(pg_it->second, pg_it->second.degraded_objects, true))
+                    return true;
+            }
         }
     }
     if (!no_rebalance)
@@ -238,15 +317,10 @@ bool osd_t::pick_next_recovery(osd_recovery_op_t &op)
             // Don't try to "recover" misplaced objects if "recovery" would make them degraded
             if ((pg_it->second.state & (PG_ACTIVE | PG_DEGRADED | PG_HAS_MISPLACED)) == (PG_ACTIVE | PG_HAS_MISPLACED))
             {
-                for (auto obj_it = pg_it->second.misplaced_objects.begin(); obj_it != pg_it->second.misplaced_objects.end(); obj_it++)
-                {
-                    if (recovery_ops.find(obj_it->first) == recovery_ops.end())
-                    {
-                        op.degraded = false;
-                        op.oid = obj_it->first;
-                        return true;
-                    }
-                }
+                if (pg_busy(pg_it->second))
+                    recovery_sched.skipped_busy = true;
+                else if (pick_obj(pg_it->second, pg_it->second.misplaced_objects, false))
+                    return true;
             }
         }
     }
@@ -292,6 +366,18 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
                 throw std::runtime_error("Failed to recover an object");
             }
         }
+        if (!op->batch_left || !--(*op->batch_left))
+        {
+            // The whole batch is done, free its slot
+            delete op->batch_left;
+            recovery_sched.inflight--;
+            for (osd_num_t peer_osd: op->peers)
+            {
+                auto it = recovery_sched.osd_inflight.find(peer_osd);
+                if (it != recovery_sched.osd_inflight.end() && !--it->second)
+                    recovery_sched.osd_inflight.erase(it);
+            }
+        }
         // CAREFUL! op = &recovery_ops[op->oid]. Don't access op->* after recovery_ops.erase()
         op->osd_op = NULL;
         recovery_ops.erase(op->oid);
@@ -312,19 +398,135 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
     exec_op(op->osd_op);
 }
 
-// Just trigger write requests for degraded objects. They'll be recovered during writing
+// Lower the recovery queue depth twice if average client op latency during the last
+// RECOVERY_TUNE_INTERVAL_MS is above <recovery_client_latency_target>, raise it by 1 otherwise
+void osd_t::tune_recovery()
+{
+    auto & rs = recovery_sched;
+    if (!recovery_client_latency_target || !rs.queue_depth)
+    {
+        rs.queue_depth = recovery_queue_depth;
+        if (!recovery_client_latency_target)
+            return;
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (rs.tune_time.tv_sec && (now.tv_sec - rs.tune_time.tv_sec)*1000 +
+        (now.tv_nsec - rs.tune_time.tv_nsec)/1000000 < RECOVERY_TUNE_INTERVAL_MS)
+    {
+        return;
+    }
+    rs.tune_time = now;
+    uint64_t lat_sum = msgr.stats.op_stat_sum[OSD_OP_READ] + msgr.stats.op_stat_sum[OSD_OP_WRITE];
+    uint64_t lat_count = msgr.stats.op_stat_count[OSD_OP_READ] + msgr.stats.op_stat_count[OSD_OP_WRITE];
+    // Statistics may be reset in-between
+    if (lat_count > rs.tune_lat_count && lat_sum >= rs.tune_lat_sum &&
+        (lat_sum - rs.tune_lat_sum) / (lat_count - rs.tune_lat_count) > recovery_client_latency_target)
+    {
+        if (rs.queue_depth > 1)
+        {
+            rs.queue_depth /= 2;
+            if (log_level > 0)
+                printf("[OSD %lu] Client latency is too high, reducing recovery queue depth to %d\n", osd_num, rs.queue_depth);
+        }
+    }
+    else if (rs.queue_depth < recovery_queue_depth)
+    {
+        rs.queue_depth++;
+    }
+    rs.tune_lat_sum = lat_sum;
+    rs.tune_lat_count = lat_count;
+}
+
+// Check <recovery_bandwidth_limit> and <recovery_iops_limit>. Bandwidth is accounted
+// after the fact, from recovered bytes, so an operation is allowed to overdraw it.
+// Buckets hold up to 1 second of the limit. Returns true and sets a timer to resume
+// recovery if the next operation must wait
+bool osd_t::throttle_recovery()
+{
+    auto & rs = recovery_sched;
+    if (!recovery_bandwidth_limit && !recovery_iops_limit)
+    {
+        return false;
+    }
+    if (rs.timer_id >= 0)
+    {
+        return true;
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t recovered = recovery_stat_bytes[0][0] + recovery_stat_bytes[0][1];
+    if (!rs.refill_time.tv_sec)
+    {
+        rs.bytes_tokens = recovery_bandwidth_limit;
+        rs.iops_tokens = recovery_iops_limit;
+        rs.charged_bytes = recovered;
+    }
+    else
+    {
+        double elapsed = (now.tv_sec - rs.refill_time.tv_sec) + (now.tv_nsec - rs.refill_time.tv_nsec)/1000000000.0;
+        rs.bytes_tokens = std::min(rs.bytes_tokens + elapsed*recovery_bandwidth_limit, (double)recovery_bandwidth_limit);
+        rs.iops_tokens = std::min(rs.iops_tokens + elapsed*recovery_iops_limit, (double)recovery_iops_limit);
+    }
+    rs.refill_time = now;
+    // Statistics may be reset in-between
+    rs.bytes_tokens -= recovered > rs.charged_bytes ? recovered - rs.charged_bytes : 0;
+    rs.charged_bytes = recovered;
+    double wait = 0;
+    if (recovery_bandwidth_limit && rs.bytes_tokens < 0)
+        wait = -rs.bytes_tokens / recovery_bandwidth_limit;
+    if (recovery_iops_limit && rs.iops_tokens < 1)
+        wait = std::max(wait, (1-rs.iops_tokens) / recovery_iops_limit);
+    if (wait <= 0)
+    {
+        return false;
+    }
+    rs.timer_id = tfd->set_timer((int)(wait*1000)+1, false, [this](int timer_id)
+    {
+        recovery_sched.timer_id = -1;
+        continue_recovery();
+    });
+    return true;
+}
+
+// Just trigger write requests for degraded objects. They'll be recovered during writing.
+// Objects of a rebalance batch are submitted at once, so that their reads and writes
+// are sent to the same peers together and may be merged (see subop_batch_max).
+// Returns false only when there are no more objects to recover: objects delayed by
+// the rate limit or skipped because of busy OSDs still count as recovery work
 bool osd_t::continue_recovery()
 {
-    while (recovery_ops.size() < recovery_queue_depth)
+    tune_recovery();
+    while (recovery_sched.inflight < recovery_sched.queue_depth)
     {
+        if (throttle_recovery())
+        {
+            return true;
+        }
         osd_recovery_op_t op;
         if (pick_next_recovery(op))
         {
-            recovery_ops[op.oid] = op;
-            submit_recovery_op(&recovery_ops[op.oid]);
+            for (osd_num_t peer_osd: op.peers)
+                recovery_sched.osd_inflight[peer_osd]++;
+            recovery_sched.inflight++;
+            std::vector<object_id> batch;
+            batch.swap(op.batch);
+            batch.insert(batch.begin(), op.oid);
+            recovery_sched.iops_tokens -= batch.size();
+            op.batch_left = batch.size() > 1 ? new int(batch.size()) : NULL;
+            // Insert all objects first, so that they're not picked again during submit
+            for (auto & oid: batch)
+            {
+                op.oid = oid;
+                recovery_ops[oid] = op;
+            }
+            for (auto & oid: batch)
+            {
+                submit_recovery_op(&recovery_ops[oid]);
+            }
         }
         else
-            return false;
+            return recovery_sched.skipped_busy;
     }
     return true;
 }
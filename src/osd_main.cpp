@@ -2,23 +2,74 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "osd.h"
+#include "numa_affinity.h"
+#include "http_client.h"
 
 #include <signal.h>
 
 static osd_t *osd = NULL;
-static bool force_stopping = false;
+// 1st stop signal drains primary PGs, 2nd stops without draining, 3rd exits immediately
+static int stop_requests = 0;
 
 static void handle_sigint(int sig)
 {
-    if (osd && !force_stopping)
+    if (osd && stop_requests++ < 2)
     {
-        force_stopping = true;
-        osd->force_stop(0);
+        osd->drain_and_stop();
         return;
     }
     exit(0);
 }
 
+static ring_loop_t *create_ringloop(json11::Json::object & config)
+{
+    ring_loop_config_t ring_cfg;
+    json11::Json sqpoll = config["ring_sqpoll"];
+    ring_cfg.sqpoll = sqpoll == "true" || sqpoll == "1" || sqpoll == "yes";
+    if (!config["ring_sqpoll_cpu"].is_null())
+        ring_cfg.sqpoll_cpu = config["ring_sqpoll_cpu"].uint64_value();
+    if (!config["ring_sqpoll_idle"].is_null())
+        ring_cfg.sqpoll_idle_ms = config["ring_sqpoll_idle"].uint64_value();
+    ring_cfg.busy_poll_us = config["ring_busy_poll"].uint64_value();
+    json11::Json passthru = config["nvme_passthrough"];
+    ring_cfg.big_sqe = passthru == "true" || passthru == "1" || passthru == "yes";
+    return new ring_loop_t(512, ring_cfg);
+}
+
+// Pin the OSD to the NUMA node of the OSD's data device (or NIC) before creating the OSD
+// so that the blockstore, messenger and ring buffers are allocated from the memory of that node
+static void setup_numa(json11::Json::object & config)
+{
+    std::string numa_node = config["numa_node"].string_value();
+    if (numa_node == "")
+        return;
+    int node = -1;
+    if (numa_node == "auto")
+    {
+        int dev_node = get_blockdev_numa_node(config["data_device"].string_value());
+        int net_node = get_netdev_numa_node(config["bind_address"].string_value(), config["rdma_device"].string_value());
+        if (dev_node >= 0 && net_node >= 0 && dev_node != net_node)
+        {
+            printf(
+                "Warning: data device is attached to NUMA node %d, but the network interface is attached to node %d\n",
+                dev_node, net_node
+            );
+        }
+        node = dev_node >= 0 ? dev_node : net_node;
+        if (node < 0)
+        {
+            printf("Failed to detect NUMA node of the data device and the network interface, not binding\n");
+            return;
+        }
+    }
+    else
+        node = stoull_full(numa_node);
+    if (!bind_thread_to_numa_node(node))
+        printf("Failed to bind to NUMA node %d: %s\n", node, strerror(errno));
+    else
+        printf("Bound to NUMA node %d\n", node);
+}
+
 int main(int narg, char *args[])
 {
     setvbuf(stdout, NULL, _IONBF, 0);
@@ -40,7 +91,8 @@ int main(int narg, char *args[])
     }
     signal(SIGINT, handle_sigint);
     signal(SIGTERM, handle_sigint);
-    ring_loop_t *ringloop = new ring_loop_t(512);
+    setup_numa(config);
+    ring_loop_t *ringloop = create_ringloop(config);
     osd = new osd_t(config, ringloop);
     while (1)
     {
@@ -0,0 +1,102 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <algorithm>
+#include "osd.h"
+#include "buffer_pool.h"
+
+// Estimated memory usage of the biggest OSD structures, in bytes unless noted otherwise.
+// Containers are estimated by their element counts, so the numbers are approximate,
+// but they're enough to size RAM and to notice leaks or PGs with bloated object state maps
+json11::Json osd_t::get_memory_stats(uint64_t max_pgs)
+{
+    json11::Json::object res;
+    if (bs)
+    {
+        blockstore_memory_stats_t bm = bs->get_memory_stats();
+        res["blockstore"] = json11::Json::object {
+            { "clean_db", bm.clean_db },
+            { "clean_bitmaps", bm.clean_bitmaps },
+            { "metadata_buffer", bm.metadata_buffer },
+            { "dirty_db", bm.dirty_db },
+            { "unstable_writes", bm.unstable_writes },
+            { "meta_sectors", bm.meta_sectors },
+            { "journal_buffers", bm.journal_buffers },
+            { "read_cache", bm.read_cache },
+        };
+    }
+    uint64_t pg_bytes = 0;
+    std::vector<std::pair<uint64_t, pool_pg_num_t>> pg_sizes;
+    for (auto & pp: pgs)
+    {
+        uint64_t bytes = pp.second.object_state_bytes();
+        pg_bytes += bytes;
+        if (max_pgs)
+            pg_sizes.push_back({ bytes, pp.first });
+    }
+    json11::Json::object pg_res = json11::Json::object {
+        { "count", pgs.size() },
+        { "object_states", pg_bytes },
+    };
+    if (max_pgs)
+    {
+        // Largest first
+        std::sort(pg_sizes.begin(), pg_sizes.end(), [](auto & a, auto & b) { return a.first > b.first; });
+        if (pg_sizes.size() > max_pgs)
+            pg_sizes.resize(max_pgs);
+        json11::Json::array largest;
+        for (auto & ps: pg_sizes)
+        {
+            pg_t & pg = pgs.at(ps.second);
+            largest.push_back(json11::Json::object {
+                { "pool_id", (uint64_t)pg.pool_id },
+                { "pg_num", (uint64_t)pg.pg_num },
+                { "object_states", ps.first },
+                { "state_dict", pg.state_dict.size() },
+                { "incomplete_objects", pg.incomplete_objects.size() },
+                { "degraded_objects", pg.degraded_objects.size() },
+                { "misplaced_objects", pg.misplaced_objects.size() },
+                { "flush_actions", pg.flush_actions.size() },
+                { "ver_override", pg.ver_override.size() },
+                { "changed_objects", pg.changed_objects.size() },
+            });
+        }
+        pg_res["largest"] = largest;
+    }
+    res["pgs"] = pg_res;
+    res["unstable_writes"] = unstable_writes.bytes_used();
+    osd_msgr_memory_stats_t mm = msgr.get_memory_stats();
+    res["messenger"] = json11::Json::object {
+        { "connections", msgr.clients.size() },
+        { "clients", mm.clients },
+        { "receive_buffers", mm.receive_buffers },
+        { "send_lists", mm.send_lists },
+        { "rdma_buffers", mm.rdma_buffers },
+    };
+    osd_op_pool_stats_t op_pool = get_osd_op_pool_stats();
+    res["ops"] = json11::Json::object {
+        { "inflight", inflight_ops },
+        { "sent", mm.sent_ops },
+        { "pool_used", op_pool.used },
+        { "pool_allocated", op_pool.allocated_bytes },
+    };
+    buffer_pool_t & buf_pool = thread_buffer_pool();
+    res["buffer_pool"] = json11::Json::object {
+        { "used", buf_pool.get_used_bytes() },
+        { "allocated", buf_pool.get_allocated_bytes() },
+    };
+    res["inode_stats"] = inode_stats.size() * (sizeof(std::pair<uint64_t, inode_stats_t>) + 32);
+    res["trace_ring"] = trace_ring.size() * sizeof(osd_trace_record_t);
+    return res;
+}
+
+void osd_t::exec_show_memory(osd_op_t *cur_op)
+{
+    if (cur_op->buf)
+        free(cur_op->buf);
+    std::string res_str = get_memory_stats(cur_op->req.show_memory.max_pgs).dump();
+    cur_op->buf = malloc_or_die(res_str.size()+1);
+    memcpy(cur_op->buf, res_str.c_str(), res_str.size()+1);
+    cur_op->iov.push_back(cur_op->buf, res_str.size()+1);
+    finish_op(cur_op, res_str.size()+1);
+}
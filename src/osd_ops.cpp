@@ -21,4 +21,10 @@ const char* osd_op_names[] = {
     "primary_delete",
     "ping",
     "sec_read_bmp",
+    "primary_merge",
+    "primary_delete_range",
+    "primary_scrub",
+    "show_traces",
+    "sec_batch",
+    "show_memory",
 };
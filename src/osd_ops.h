@@ -29,7 +29,13 @@
 #define OSD_OP_DELETE               14
 #define OSD_OP_PING                 15
 #define OSD_OP_SEC_READ_BMP         16
-#define OSD_OP_MAX                  16
+#define OSD_OP_MERGE                17
+#define OSD_OP_DELETE_RANGE         18
+#define OSD_OP_SCRUB                19
+#define OSD_OP_SHOW_TRACES          20
+#define OSD_OP_SEC_BATCH            21
+#define OSD_OP_SHOW_MEMORY          22
+#define OSD_OP_MAX                  22
 // Alignment & limit for read/write operations
 #ifndef MEM_ALIGNMENT
 #define MEM_ALIGNMENT               512
@@ -37,6 +43,21 @@
 #define OSD_RW_MAX                  64*1024*1024
 #define OSD_PROTOCOL_VERSION        1
 
+// Maximum number of OSDs a SEC_WRITE can be forwarded to in pipelined replication
+#define OSD_SEC_PIPELINE_MAX        6
+
+// Maximum length of a read or write subop sent in OSD_OP_SEC_BATCH
+#define OSD_SEC_BATCH_ITEM_MAX      128*1024
+
+// OSD_OP_WRITE flags
+// Parity chunks of a whole-object write to an EC/XOR pool are calculated by the client
+// and follow the data in the payload (parity_len bytes)
+#define OSD_WRITE_PARITY            1
+
+// SEC_LIST flags
+// Only list versions of objects from the request payload, summarize all others
+#define OSD_LIST_CHANGED            1
+
 // common request and reply headers
 struct __attribute__((__packed__)) osd_op_header_t
 {
@@ -75,7 +96,10 @@ struct __attribute__((__packed__)) osd_op_sec_rw_t
     uint32_t len;
     // bitmap/attribute length - bitmap comes after header, but before data
     uint32_t attr_len;
-    uint32_t pad0;
+    // blockstore priority class (BS_PRIO_*), 0 = client. Was padding, so older OSDs always send 0
+    uint32_t priority;
+    // for writes: OSDs to forward the write to, one after another (pipelined replication), 0-terminated
+    osd_num_t pipeline[OSD_SEC_PIPELINE_MAX];
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_rw_t
@@ -85,7 +109,8 @@ struct __attribute__((__packed__)) osd_reply_sec_rw_t
     uint64_t version;
     // for reads: bitmap/attribute length (just to double-check)
     uint32_t attr_len;
-    uint32_t pad0;
+    // for pipelined writes: number of OSDs from the request pipeline which have completed the write
+    uint32_t pipeline_done;
 };
 
 // delete object on the secondary OSD
@@ -144,6 +169,46 @@ struct __attribute__((__packed__)) osd_reply_sec_read_bmp_t
     osd_reply_header_t header;
 };
 
+// batch of small reads and writes of different objects to the secondary OSD
+struct __attribute__((__packed__)) osd_op_sec_batch_t
+{
+    osd_op_header_t header;
+    // number of osd_sec_batch_item_t in the payload
+    uint64_t count;
+    // length of descriptors followed by bitmaps of writes, aligned to MEM_ALIGNMENT
+    uint64_t desc_len;
+    // total length of write data following the descriptors
+    uint64_t data_len;
+};
+
+struct __attribute__((__packed__)) osd_sec_batch_item_t
+{
+    // OSD_OP_SEC_READ, OSD_OP_SEC_WRITE or OSD_OP_SEC_WRITE_STABLE
+    uint32_t opcode;
+    // blockstore priority class (BS_PRIO_*)
+    uint32_t priority;
+    object_id oid;
+    uint64_t version;
+    uint32_t offset;
+    uint32_t len;
+    // bitmap length, sent for writes and returned for reads
+    uint32_t attr_len;
+    uint32_t pad0;
+};
+
+struct __attribute__((__packed__)) osd_sec_batch_result_t
+{
+    int64_t retval;
+    uint64_t version;
+};
+
+struct __attribute__((__packed__)) osd_reply_sec_batch_t
+{
+    // retval is payload length in bytes. payload is osd_sec_batch_result_t[count] followed by
+    // bitmaps of reads, aligned to MEM_ALIGNMENT, and then by data of reads
+    osd_reply_header_t header;
+};
+
 // show configuration
 struct __attribute__((__packed__)) osd_op_show_config_t
 {
@@ -157,6 +222,34 @@ struct __attribute__((__packed__)) osd_reply_show_config_t
     osd_reply_header_t header;
 };
 
+// dump the latest traced operations of the OSD, reply data is a JSON array of retval bytes
+struct __attribute__((__packed__)) osd_op_show_traces_t
+{
+    osd_op_header_t header;
+    // return at most this number of the latest records, 0 = all
+    uint64_t max_count;
+    // only return operations which took at least this number of microseconds
+    uint64_t min_us;
+};
+
+struct __attribute__((__packed__)) osd_reply_show_traces_t
+{
+    osd_reply_header_t header;
+};
+
+// estimate memory usage of OSD structures, reply data is a JSON object of retval bytes
+struct __attribute__((__packed__)) osd_op_show_memory_t
+{
+    osd_op_header_t header;
+    // also list this number of PGs with the largest object state maps
+    uint64_t max_pgs;
+};
+
+struct __attribute__((__packed__)) osd_reply_show_memory_t
+{
+    osd_reply_header_t header;
+};
+
 // list objects on replica
 struct __attribute__((__packed__)) osd_op_sec_list_t
 {
@@ -167,6 +260,25 @@ struct __attribute__((__packed__)) osd_op_sec_list_t
     uint64_t pg_stripe_size;
     // inode range (used to select pools)
     uint64_t min_inode, max_inode;
+    // OSD_LIST_CHANGED or 0
+    uint64_t flags;
+    // length of the sorted object_id array following the request, with OSD_LIST_CHANGED
+    uint64_t changed_len;
+    // start listing from this object and only return a page of about <max_count> objects,
+    // 0 = return all objects (see blockstore_list_page_t)
+    object_id start_oid;
+    uint64_t max_count;
+};
+
+// Summary of object versions not returned because of OSD_LIST_CHANGED
+struct __attribute__((__packed__)) osd_list_summary_t
+{
+    uint64_t count;
+    // sum of hashes of (object without the role, version) and the same sum with each
+    // hash multiplied by (role+1), to compare object sets without transferring them
+    uint64_t hash, role_hash;
+    uint64_t max_version;
+    uint64_t unstable_count;
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_list_t
@@ -175,6 +287,10 @@ struct __attribute__((__packed__)) osd_reply_sec_list_t
     // stable object version count. header.retval = total object version count
     // FIXME: maybe change to the number of bytes in the reply...
     uint64_t stable_count;
+    // only filled with OSD_LIST_CHANGED
+    osd_list_summary_t other;
+    // object to continue listing from, { 0, 0 } if all objects are listed
+    object_id next_oid;
 };
 
 // read or write to the primary OSD (must be within individual stripe)
@@ -187,15 +303,25 @@ struct __attribute__((__packed__)) osd_op_rw_t
     uint64_t offset;
     // length
     uint32_t len;
-    // flags (for future)
+    // flags (OSD_WRITE_PARITY for writes)
     uint32_t flags;
     // inode metadata revision
     uint64_t meta_revision;
     // object version for atomic "CAS" (compare-and-set) writes
     // writes and deletes fail with -EINTR if object version differs from (version-1)
     uint64_t version;
+    // for writes with OSD_WRITE_PARITY: length of parity chunks after the data
+    uint32_t parity_len;
 };
 
+// OSD_OP_MERGE uses osd_op_rw_t with len=0: the primary OSD reads the whole object at <offset>
+// through its parent layers from the same pool and writes data missing in the object itself
+// back into it, using CAS. It fails with -EINTR if the object is modified in the meantime
+
+// OSD_OP_SCRUB also uses osd_op_rw_t with len=0, but it's internal to the primary OSD and isn't
+// accepted from the network: it reads all copies (or EC chunks) of the object at <offset> and
+// compares them. Result is the number of inconsistent copies, their OSD numbers are in op->buf
+
 struct __attribute__((__packed__)) osd_reply_rw_t
 {
     osd_reply_header_t header;
@@ -217,6 +343,40 @@ struct __attribute__((__packed__)) osd_reply_sync_t
     osd_reply_header_t header;
 };
 
+// delete objects of an inode in a PG on the primary OSD. objects are taken from the primary's
+// own object list, so it's only allowed in clean PGs (other PGs return -EBUSY)
+struct __attribute__((__packed__)) osd_op_delete_range_t
+{
+    osd_op_header_t header;
+    // inode
+    uint64_t inode;
+    // start deleting from this offset
+    uint64_t start_offset;
+    // placement group number in the inode's pool
+    pg_num_t pg_num;
+    // delete at most <max_count> objects in this request
+    uint32_t max_count;
+    // delete at most <iodepth> objects in parallel
+    uint32_t iodepth;
+};
+
+struct __attribute__((__packed__)) osd_reply_delete_range_t
+{
+    osd_reply_header_t header;
+    // header.retval = deleted object count
+    // offset to continue from, or UINT64_MAX if all objects of the inode in the PG are processed
+    uint64_t next_offset;
+};
+
+// Trace ID is stored in the last 8 bytes of every request packet, which are unused by all
+// request types, so that it's compatible with older peers sending zeroes there.
+// Non-zero ID means that the operation is traced and OSDs propagate it to their subops
+struct __attribute__((__packed__)) osd_op_trace_id_t
+{
+    uint8_t pad[OSD_PACKET_SIZE-sizeof(uint64_t)];
+    uint64_t trace_id;
+};
+
 // FIXME it would be interesting to try to unify blockstore_op and osd_op formats
 union osd_any_op_t
 {
@@ -226,10 +386,15 @@ union osd_any_op_t
     osd_op_sec_sync_t sec_sync;
     osd_op_sec_stab_t sec_stab;
     osd_op_sec_read_bmp_t sec_read_bmp;
+    osd_op_sec_batch_t sec_batch;
     osd_op_sec_list_t sec_list;
     osd_op_show_config_t show_conf;
     osd_op_rw_t rw;
     osd_op_sync_t sync;
+    osd_op_delete_range_t delete_range;
+    osd_op_show_traces_t show_traces;
+    osd_op_show_memory_t show_memory;
+    osd_op_trace_id_t trace;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -241,10 +406,14 @@ union osd_any_reply_t
     osd_reply_sec_sync_t sec_sync;
     osd_reply_sec_stab_t sec_stab;
     osd_reply_sec_read_bmp_t sec_read_bmp;
+    osd_reply_sec_batch_t sec_batch;
     osd_reply_sec_list_t sec_list;
     osd_reply_show_config_t show_conf;
     osd_reply_rw_t rw;
     osd_reply_sync_t sync;
+    osd_reply_delete_range_t delete_range;
+    osd_reply_show_traces_t show_traces;
+    osd_reply_show_memory_t show_memory;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
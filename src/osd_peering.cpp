@@ -15,13 +15,31 @@ void osd_t::handle_peers()
     if (peering_state & OSD_PEERING_PGS)
     {
         bool still = false;
+        // Object states are calculated in steps to not block client I/O of other PGs
+        uint64_t calc_budget = PEERING_CALC_BATCH;
         for (auto & p: pgs)
         {
             if (p.second.state == PG_PEERING)
             {
-                if (!p.second.peering_state->list_ops.size())
+                if (p.second.peering_state->queued)
                 {
-                    p.second.calc_object_states(log_level);
+                    still = true;
+                }
+                else if (!p.second.peering_state->list_ops.size())
+                {
+                    if (!p.second.peering_state->calc && p.second.peering_state->list_changed &&
+                        calc_budget > 0 && !check_list_summaries(p.second))
+                    {
+                        still = true;
+                        continue;
+                    }
+                    if (!p.second.calc_object_states(log_level, calc_budget))
+                    {
+                        // Continue in the next loop iteration
+                        still = true;
+                        ringloop->wakeup();
+                        continue;
+                    }
                     report_pg_state(p.second);
                     incomplete_objects += p.second.incomplete_objects.size();
                     misplaced_objects += p.second.misplaced_objects.size();
@@ -43,6 +61,10 @@ void osd_t::handle_peers()
             // Done all PGs
             peering_state = peering_state & ~OSD_PEERING_PGS;
         }
+        else if (peering_queue_depth > 0)
+        {
+            start_queued_peerings();
+        }
     }
     if ((peering_state & OSD_FLUSHING_PGS) && !readonly)
     {
@@ -111,6 +133,21 @@ void osd_t::repeer_pgs(osd_num_t peer_osd)
 // Reset PG state (when peering or stopping)
 void osd_t::reset_pg(pg_t & pg)
 {
+    pg.cancel_object_states();
+    clear_layer_bitmaps();
+    // Objects which may be inconsistent now must be listed during the next peering
+    for (auto & obj: pg.incomplete_objects)
+        pg.log_change(obj.first, peering_log_size);
+    for (auto & obj: pg.misplaced_objects)
+        pg.log_change(obj.first, peering_log_size);
+    for (auto & obj: pg.degraded_objects)
+        pg.log_change(obj.first, peering_log_size);
+    for (auto & act: pg.flush_actions)
+        pg.log_change(act.first.oid, peering_log_size);
+    pg.write_queue.for_each_first([&](const object_id & oid, osd_op_t *op)
+    {
+        pg.log_change(oid, peering_log_size);
+    });
     pg.cur_peers.clear();
     pg.state_dict.clear();
     copies_to_delete_after_sync_count -= pg.copies_to_delete_after_sync.size();
@@ -128,20 +165,24 @@ void osd_t::reset_pg(pg_t & pg)
         delete pg.flush_batch;
     }
     pg.flush_batch = NULL;
-    for (auto p: pg.write_queue)
+    std::vector<osd_op_t*> cancel_ops;
+    pg.write_queue.for_each([&](osd_op_t *op) { cancel_ops.push_back(op); });
+    pg.write_queue.clear();
+    for (auto op: cancel_ops)
     {
-        cancel_primary_write(p.second);
+        cancel_primary_write(op);
     }
-    pg.write_queue.clear();
     uint64_t pg_stripe_size = st_cli.pool_config[pg.pool_id].pg_stripe_size;
-    for (auto it = unstable_writes.begin(); it != unstable_writes.end(); )
+    // Forget this PG's unstable writes
+    unstable_writes.erase_if([&](const object_id & oid)
     {
-        // Forget this PG's unstable writes
-        if (INODE_POOL(it->first.oid.inode) == pg.pool_id && map_to_pg(it->first.oid, pg_stripe_size) == pg.pg_num)
-            unstable_writes.erase(it++);
-        else
-            it++;
-    }
+        if (INODE_POOL(oid.inode) == pg.pool_id && map_to_pg(oid, pg_stripe_size) == pg.pg_num)
+        {
+            pg.log_change(oid, peering_log_size);
+            return true;
+        }
+        return false;
+    });
     dirty_pgs.erase({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
 }
 
@@ -233,12 +274,21 @@ void osd_t::start_pg_peering(pg_t & pg)
         }
     }
     pg.cur_peers.insert(pg.cur_peers.begin(), cur_peers.begin(), cur_peers.end());
+    bool list_changed = can_list_changed(pg);
     if (pg.peering_state)
     {
         // Adjust the peering operation that's still in progress - discard unneeded results
+        // Results of a listing of changed objects are only kept if it's still possible
+        bool relist = pg.peering_state->list_changed &&
+            (!list_changed || pg.peering_state->changed_objects.size() != pg.changed_objects.size());
+        if (relist)
+        {
+            pg.peering_state->list_changed = false;
+            pg.peering_state->changed_objects.clear();
+        }
         for (auto it = pg.peering_state->list_ops.begin(); it != pg.peering_state->list_ops.end();)
         {
-            if (pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
+            if (pg.state == PG_INCOMPLETE || relist || cur_peers.find(it->first) == cur_peers.end())
             {
                 // Discard the result after completion, which, chances are, will be unsuccessful
                 discard_list_subop(it->second);
@@ -249,7 +299,7 @@ void osd_t::start_pg_peering(pg_t & pg)
         }
         for (auto it = pg.peering_state->list_results.begin(); it != pg.peering_state->list_results.end();)
         {
-            if (pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
+            if (pg.state == PG_INCOMPLETE || relist || cur_peers.find(it->first) == cur_peers.end())
             {
                 if (it->second.buf)
                 {
@@ -275,8 +325,28 @@ void osd_t::start_pg_peering(pg_t & pg)
         pg.peering_state = new pg_peering_state_t();
         pg.peering_state->pool_id = pg.pool_id;
         pg.peering_state->pg_num = pg.pg_num;
+        if (list_changed)
+        {
+            pg.peering_state->list_changed = true;
+            pg.peering_state->changed_objects.assign(pg.changed_objects.begin(), pg.changed_objects.end());
+        }
+    }
+    if (peering_queue_depth > 0 && (pg.peering_state->queued ||
+        !pg.peering_state->list_ops.size() && !pg.peering_state->list_results.size()))
+    {
+        // Listing is started by start_queued_peerings() when there's a free slot
+        pg.peering_state->queued = true;
     }
-    for (osd_num_t peer_osd: cur_peers)
+    else
+    {
+        submit_peering_lists(pg);
+    }
+    ringloop->wakeup();
+}
+
+void osd_t::submit_peering_lists(pg_t & pg)
+{
+    for (osd_num_t peer_osd: pg.cur_peers)
     {
         if (pg.peering_state->list_ops.find(peer_osd) != pg.peering_state->list_ops.end() ||
             pg.peering_state->list_results.find(peer_osd) != pg.peering_state->list_results.end())
@@ -285,7 +355,32 @@ void osd_t::start_pg_peering(pg_t & pg)
         }
         submit_sync_and_list_subop(peer_osd, pg.peering_state);
     }
-    ringloop->wakeup();
+}
+
+// After an OSD failure all its PGs are repeered at once and their listings compete with each other,
+// so at most <peering_queue_depth> PGs are peered at the same time. PGs which clients wait for go first
+void osd_t::start_queued_peerings()
+{
+    int running = 0;
+    std::vector<pg_t*> queued, client_queued;
+    for (auto & p: pgs)
+    {
+        if (p.second.state == PG_PEERING)
+        {
+            if (!p.second.peering_state->queued)
+                running++;
+            else if (p.second.peering_state->client_waiting)
+                client_queued.push_back(&p.second);
+            else
+                queued.push_back(&p.second);
+        }
+    }
+    queued.insert(queued.begin(), client_queued.begin(), client_queued.end());
+    for (int i = 0; i < queued.size() && running < peering_queue_depth; i++, running++)
+    {
+        queued[i]->peering_state->queued = false;
+        submit_peering_lists(*queued[i]);
+    }
 }
 
 void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
@@ -359,7 +454,9 @@ void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *p
     }
 }
 
-void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
+// Objects are listed in pages of PEERING_LIST_PAGE_SIZE, so that peers don't have to build
+// and send the whole list in one huge buffer
+void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps, object_id start_oid)
 {
     if (role_osd == this->osd_num)
     {
@@ -375,6 +472,10 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
         op->bs_op->version = ((uint64_t)(ps->pool_id+1) << (64 - POOL_ID_BITS)) - 1;
         op->bs_op->len = pg_counts[ps->pool_id];
         op->bs_op->offset = ps->pg_num-1;
+        blockstore_list_page_t *page = (blockstore_list_page_t*)malloc_or_die(sizeof(blockstore_list_page_t));
+        *page = (blockstore_list_page_t){ .start = start_oid, .max_count = PEERING_LIST_PAGE_SIZE };
+        op->rmw_buf = page;
+        op->bs_op->bitmap = page;
         op->bs_op->callback = [this, ps, op, role_osd](blockstore_op_t *bs_op)
         {
             if (op->bs_op->retval < 0)
@@ -382,19 +483,31 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 throw std::runtime_error("local OP_LIST failed");
             }
             add_bs_subop_stats(op);
-            printf(
-                "[PG %u/%u] Got object list from OSD %lu (local): %d object versions (%lu of them stable)\n",
-                ps->pool_id, ps->pg_num, role_osd, bs_op->retval, bs_op->version
-            );
-            ps->list_results[role_osd] = {
-                .buf = (obj_ver_id*)op->bs_op->buf,
-                .total_count = (uint64_t)op->bs_op->retval,
-                .stable_count = op->bs_op->version,
-            };
+            obj_ver_id *buf = (obj_ver_id*)op->bs_op->buf;
+            uint64_t total_count = op->bs_op->retval, stable_count = op->bs_op->version;
+            osd_list_summary_t other = {};
+            if (ps->list_changed)
+            {
+                filter_changed_objects(buf, total_count, stable_count,
+                    ps->changed_objects.data(), ps->changed_objects.size(), other);
+            }
+            object_id next_oid = ((blockstore_list_page_t*)op->rmw_buf)->next;
+            auto & res = ps->list_results[role_osd];
+            res.append_page(buf, total_count, stable_count, other, !next_oid.inode);
             ps->list_ops.erase(role_osd);
             delete op->bs_op;
             op->bs_op = NULL;
             delete op;
+            if (next_oid.inode)
+            {
+                submit_list_subop(role_osd, ps, next_oid);
+                return;
+            }
+            printf(
+                "[PG %u/%u] Got object list from OSD %lu (local): %lu object versions (%lu of them stable)%s\n",
+                ps->pool_id, ps->pg_num, role_osd, res.total_count, res.stable_count,
+                ps->list_changed ? (" + "+std::to_string(res.other.count)+" unchanged").c_str() : ""
+            );
         };
         bs->enqueue_op(op->bs_op);
         ps->list_ops[role_osd] = op;
@@ -417,8 +530,21 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 .pg_stripe_size = st_cli.pool_config[ps->pool_id].pg_stripe_size,
                 .min_inode = ((uint64_t)(ps->pool_id) << (64 - POOL_ID_BITS)),
                 .max_inode = ((uint64_t)(ps->pool_id+1) << (64 - POOL_ID_BITS)) - 1,
+                .start_oid = start_oid,
+                .max_count = PEERING_LIST_PAGE_SIZE,
             },
         };
+        if (ps->list_changed)
+        {
+            // The copy is owned by the operation, so it outlives a discarded peering
+            op->req.sec_list.flags = OSD_LIST_CHANGED;
+            op->req.sec_list.changed_len = ps->changed_objects.size() * sizeof(object_id);
+            if (op->req.sec_list.changed_len > 0)
+            {
+                op->rmw_buf = malloc_or_die(op->req.sec_list.changed_len);
+                memcpy(op->rmw_buf, ps->changed_objects.data(), op->req.sec_list.changed_len);
+            }
+        }
         op->callback = [this, ps, role_osd](osd_op_t *op)
         {
             if (op->reply.hdr.retval < 0)
@@ -426,23 +552,37 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 printf("Failed to get object list from OSD %lu (retval=%ld), disconnecting peer\n", role_osd, op->reply.hdr.retval);
                 int fail_fd = op->peer_fd;
                 ps->list_ops.erase(role_osd);
+                // Forget previous pages, the peer will be listed from the beginning
+                auto res_it = ps->list_results.find(role_osd);
+                if (res_it != ps->list_results.end())
+                {
+                    if (res_it->second.buf)
+                        free(res_it->second.buf);
+                    ps->list_results.erase(res_it);
+                }
                 delete op;
                 msgr.stop_client(fail_fd);
                 return;
             }
-            printf(
-                "[PG %u/%u] Got object list from OSD %lu: %ld object versions (%lu of them stable)\n",
-                ps->pool_id, ps->pg_num, role_osd, op->reply.hdr.retval, op->reply.sec_list.stable_count
-            );
-            ps->list_results[role_osd] = {
-                .buf = (obj_ver_id*)op->buf,
-                .total_count = (uint64_t)op->reply.hdr.retval,
-                .stable_count = op->reply.sec_list.stable_count,
-            };
+            // Peers without pagination support return everything with next_oid = 0
+            object_id next_oid = op->reply.sec_list.next_oid;
+            auto & res = ps->list_results[role_osd];
+            res.append_page((obj_ver_id*)op->buf, op->reply.hdr.retval, op->reply.sec_list.stable_count,
+                op->reply.sec_list.other, !next_oid.inode);
             // set op->buf to NULL so it doesn't get freed
             op->buf = NULL;
             ps->list_ops.erase(role_osd);
             delete op;
+            if (next_oid.inode)
+            {
+                submit_list_subop(role_osd, ps, next_oid);
+                return;
+            }
+            printf(
+                "[PG %u/%u] Got object list from OSD %lu: %lu object versions (%lu of them stable)%s\n",
+                ps->pool_id, ps->pg_num, role_osd, res.total_count, res.stable_count,
+                ps->list_changed ? (" + "+std::to_string(res.other.count)+" unchanged").c_str() : ""
+            );
         };
         msgr.outbox_push(op);
         ps->list_ops[role_osd] = op;
@@ -473,11 +613,83 @@ void osd_t::discard_list_subop(osd_op_t *list_op)
     }
 }
 
+// Peers only have to list objects changed since the last active+clean state if all of
+// them support it and are in the current OSD set, so all other objects must be the same
+bool osd_t::can_list_changed(pg_t & pg)
+{
+    if (!peering_log_size || !pg.changes_valid)
+    {
+        return false;
+    }
+    for (osd_num_t peer_osd: pg.cur_peers)
+    {
+        if (std::find(pg.cur_set.begin(), pg.cur_set.end(), peer_osd) == pg.cur_set.end())
+        {
+            return false;
+        }
+        if (peer_osd != this->osd_num)
+        {
+            auto st_it = st_cli.peer_states.find(peer_osd);
+            if (st_it == st_cli.peer_states.end() || !st_it->second["features"]["list_changed"].bool_value())
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Check that unchanged objects are really the same on all peers. Otherwise the change log
+// is incomplete (for example, the PG was active on another OSD), so list all objects again
+bool osd_t::check_list_summaries(pg_t & pg)
+{
+    auto ps = pg.peering_state;
+    osd_list_summary_t *first = NULL;
+    bool ok = true;
+    for (auto & lr: ps->list_results)
+    {
+        auto & other = lr.second.other;
+        uint64_t role = 0;
+        if (pg.scheme != POOL_SCHEME_REPLICATED)
+        {
+            role = std::find(pg.cur_set.begin(), pg.cur_set.end(), lr.first) - pg.cur_set.begin();
+        }
+        if (other.unstable_count > 0 || other.role_hash != other.hash*(role+1) ||
+            first && (other.count != first->count || other.hash != first->hash))
+        {
+            ok = false;
+            break;
+        }
+        first = &other;
+    }
+    if (ok)
+    {
+        return true;
+    }
+    printf("[PG %u/%u] Unchanged objects differ between OSDs, listing all objects\n", pg.pool_id, pg.pg_num);
+    for (auto & lr: ps->list_results)
+    {
+        if (lr.second.buf)
+        {
+            free(lr.second.buf);
+        }
+    }
+    ps->list_results.clear();
+    ps->list_changed = false;
+    ps->changed_objects.clear();
+    for (osd_num_t peer_osd: pg.cur_peers)
+    {
+        submit_list_subop(peer_osd, ps);
+    }
+    return false;
+}
+
 bool osd_t::stop_pg(pg_t & pg)
 {
     if (pg.peering_state)
     {
         // Stop peering
+        pg.cancel_object_states();
         for (auto it = pg.peering_state->list_ops.begin(); it != pg.peering_state->list_ops.end(); it++)
         {
             discard_list_subop(it->second);
@@ -517,6 +729,9 @@ void osd_t::finish_stop_pg(pg_t & pg)
 {
     pg.state = PG_OFFLINE;
     reset_pg(pg);
+    // Changes aren't tracked while the PG is inactive
+    pg.changed_objects.clear();
+    pg.changes_valid = false;
     report_pg_state(pg);
 }
 
@@ -524,6 +739,12 @@ void osd_t::report_pg_state(pg_t & pg)
 {
     pg.print_state();
     this->pg_state_dirty.insert({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+    if (pg.state == PG_ACTIVE)
+    {
+        // All objects are the same on all OSDs, start a new change log
+        pg.changed_objects.clear();
+        pg.changes_valid = true;
+    }
     if (pg.state == PG_ACTIVE && (pg.target_history.size() > 0 || pg.all_peers.size() > pg.target_set.size()))
     {
         // Clear history of active+clean PGs
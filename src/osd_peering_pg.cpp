@@ -1,7 +1,9 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <string.h>
 #include <unordered_map>
+#include "malloc_or_die.h"
 #include "osd_peering_pg.h"
 
 struct obj_ver_role
@@ -34,11 +36,36 @@ struct obj_piece_ver_t
     uint64_t max_target = 0;
 };
 
+#define PG_CALC_COPY 0
+#define PG_CALC_MERGE 1
+#define PG_CALC_WALK 2
+#define PG_CALC_FREE 3
+#define PG_CALC_RUN_BITS 16
+#define PG_CALC_RUN_SIZE (1 << PG_CALC_RUN_BITS)
+
+struct list_run_t
+{
+    uint32_t run, pos, end;
+};
+
+// Object state calculation is split into steps, so that peering of a large PG doesn't block the
+// event loop: object lists are copied in runs of PG_CALC_RUN_SIZE which are sorted separately,
+// then runs are merged by building a sorted index, then the index is walked, then runs are freed.
+// Runs are allocated separately because even freeing the whole list at once takes too long.
 struct pg_obj_state_check_t
 {
     pg_t *pg;
     bool replicated = false;
-    std::vector<obj_ver_role> list;
+    int stage = 0;
+    std::map<osd_num_t, pg_list_result_t>::iterator copy_it;
+    uint64_t copy_pos = 0;
+    std::vector<std::vector<obj_ver_role>> runs;
+    uint64_t list_size = 0;
+    std::vector<list_run_t> merge_heap;
+    // sorted order of all runs as (run << PG_CALC_RUN_BITS) | position, empty if there's only one run
+    std::vector<uint32_t> order;
+    uint64_t epoch = 0, other_count = 0;
+    int pg_state = 0;
     int list_pos;
     int obj_start = 0, obj_end = 0, ver_start = 0, ver_end = 0;
     object_id oid = { 0 };
@@ -50,21 +77,130 @@ struct pg_obj_state_check_t
     pg_osd_set_t osd_set;
     int log_level;
 
-    void walk();
+    inline obj_ver_role & at(int i)
+    {
+        return order.size()
+            ? runs[order[i] >> PG_CALC_RUN_BITS][order[i] & (PG_CALC_RUN_SIZE-1)]
+            : runs[0][i];
+    }
+
+    void copy_run();
+    void start_merge();
+    void merge_step(uint64_t & budget);
+    void start_walk();
+    bool walk_step(uint64_t & budget);
+    void finish_walk();
+    bool free_step(uint64_t & budget);
     void start_object();
     void handle_version();
     void finish_object();
 };
 
-void pg_obj_state_check_t::walk()
+void pg_obj_state_check_t::copy_run()
+{
+    auto ps = pg->peering_state;
+    auto & res = copy_it->second;
+    if (!copy_pos && ps->list_changed)
+    {
+        // With OSD_LIST_CHANGED, all peers have the same set of other objects, all of them clean
+        other_count = res.other.count;
+        if ((res.other.max_version >> (64-PG_EPOCH_BITS)) > epoch)
+        {
+            epoch = (res.other.max_version >> (64-PG_EPOCH_BITS));
+        }
+    }
+    uint64_t n = res.total_count-copy_pos;
+    if (n > PG_CALC_RUN_SIZE)
+    {
+        n = PG_CALC_RUN_SIZE;
+    }
+    if (n > 0)
+    {
+        runs.emplace_back(n);
+        auto & list = runs.back();
+        obj_ver_id *ov = res.buf + copy_pos;
+        for (uint64_t i = 0; i < n; i++, ov++)
+        {
+            if ((ov->version >> (64-PG_EPOCH_BITS)) > epoch)
+            {
+                epoch = (ov->version >> (64-PG_EPOCH_BITS));
+            }
+            list[i] = {
+                .oid = ov->oid,
+                .version = ov->version,
+                .osd_num = copy_it->first,
+                .is_stable = copy_pos+i < res.stable_count,
+            };
+        }
+        std::sort(list.begin(), list.end());
+        list_size += n;
+        copy_pos += n;
+    }
+    if (copy_pos >= res.total_count)
+    {
+        free(res.buf);
+        res.buf = NULL;
+        copy_it++;
+        copy_pos = 0;
+    }
+}
+
+void pg_obj_state_check_t::start_merge()
+{
+    if (runs.size() <= 1)
+    {
+        return;
+    }
+    order.reserve(list_size);
+    for (uint32_t i = 0; i < runs.size(); i++)
+    {
+        merge_heap.push_back((list_run_t){ .run = i, .pos = 0, .end = (uint32_t)runs[i].size() });
+    }
+    std::make_heap(merge_heap.begin(), merge_heap.end(), [this](const list_run_t & a, const list_run_t & b)
+    {
+        return runs[b.run][b.pos] < runs[a.run][a.pos];
+    });
+}
+
+void pg_obj_state_check_t::merge_step(uint64_t & budget)
+{
+    auto cmp = [this](const list_run_t & a, const list_run_t & b)
+    {
+        return runs[b.run][b.pos] < runs[a.run][a.pos];
+    };
+    while (budget > 0 && merge_heap.size() > 0)
+    {
+        std::pop_heap(merge_heap.begin(), merge_heap.end(), cmp);
+        auto & run = merge_heap.back();
+        order.push_back((run.run << PG_CALC_RUN_BITS) | run.pos);
+        run.pos++;
+        if (run.pos < run.end)
+            std::push_heap(merge_heap.begin(), merge_heap.end(), cmp);
+        else
+            merge_heap.pop_back();
+        budget--;
+    }
+}
+
+void pg_obj_state_check_t::start_walk()
 {
     pg->clean_count = 0;
     pg->total_count = 0;
-    pg->state = 0;
-    for (list_pos = 0; list_pos < list.size(); list_pos++)
+    pg_state = 0;
+    list_pos = 0;
+}
+
+bool pg_obj_state_check_t::walk_step(uint64_t & budget)
+{
+    for (; list_pos < list_size; list_pos++)
     {
-        if (oid.inode != list[list_pos].oid.inode ||
-            oid.stripe != (list[list_pos].oid.stripe & ~STRIPE_MASK))
+        if (!budget)
+        {
+            return false;
+        }
+        budget--;
+        if (oid.inode != at(list_pos).oid.inode ||
+            oid.stripe != (at(list_pos).oid.stripe & ~STRIPE_MASK))
         {
             if (oid.inode != 0)
             {
@@ -74,32 +210,57 @@ void pg_obj_state_check_t::walk()
         }
         handle_version();
     }
+    return true;
+}
+
+void pg_obj_state_check_t::finish_walk()
+{
     if (oid.inode != 0)
     {
         finish_object();
     }
-    if (pg->state & PG_HAS_INVALID)
+    if (pg_state & PG_HAS_INVALID)
     {
         // Stop PGs with "invalid" objects
-        pg->state = PG_INCOMPLETE | PG_HAS_INVALID;
+        pg_state = PG_INCOMPLETE | PG_HAS_INVALID;
         return;
     }
     if (pg->pg_cursize < pg->pg_size)
     {
-        pg->state |= PG_DEGRADED;
+        pg_state |= PG_DEGRADED;
+    }
+    pg_state |= PG_ACTIVE;
+    if (pg_state == PG_ACTIVE && pg->cur_peers.size() < pg->all_peers.size())
+    {
+        pg_state |= PG_LEFT_ON_DEAD;
+    }
+}
+
+bool pg_obj_state_check_t::free_step(uint64_t & budget)
+{
+    if (order.size())
+    {
+        order.clear();
+        order.shrink_to_fit();
     }
-    pg->state |= PG_ACTIVE;
-    if (pg->state == PG_ACTIVE && pg->cur_peers.size() < pg->all_peers.size())
+    while (runs.size() > 0)
     {
-        pg->state |= PG_LEFT_ON_DEAD;
+        if (!budget)
+        {
+            return false;
+        }
+        // Freeing is much cheaper than sorting or walking
+        budget = budget > PG_CALC_RUN_SIZE/16 ? budget-PG_CALC_RUN_SIZE/16 : 0;
+        runs.pop_back();
     }
+    return true;
 }
 
 void pg_obj_state_check_t::start_object()
 {
     obj_start = list_pos;
-    oid = { .inode = list[list_pos].oid.inode, .stripe = list[list_pos].oid.stripe & ~STRIPE_MASK };
-    last_ver = max_ver = list[list_pos].version;
+    oid = { .inode = at(list_pos).oid.inode, .stripe = at(list_pos).oid.stripe & ~STRIPE_MASK };
+    last_ver = max_ver = at(list_pos).version;
     target_ver = 0;
     ver_start = list_pos;
     has_roles = n_copies = n_roles = n_stable = n_mismatched = 0;
@@ -108,7 +269,7 @@ void pg_obj_state_check_t::start_object()
 
 void pg_obj_state_check_t::handle_version()
 {
-    if (!target_ver && last_ver != list[list_pos].version && (n_stable > 0 || n_roles >= pg->pg_data_size))
+    if (!target_ver && last_ver != at(list_pos).version && (n_stable > 0 || n_roles >= pg->pg_data_size))
     {
         // Version is either stable or recoverable
         target_ver = last_ver;
@@ -116,13 +277,13 @@ void pg_obj_state_check_t::handle_version()
     }
     if (!target_ver)
     {
-        if (last_ver != list[list_pos].version)
+        if (last_ver != at(list_pos).version)
         {
             ver_start = list_pos;
             has_roles = n_copies = n_roles = n_stable = n_mismatched = 0;
-            last_ver = list[list_pos].version;
+            last_ver = at(list_pos).version;
         }
-        unsigned replica = (list[list_pos].oid.stripe & STRIPE_MASK);
+        unsigned replica = (at(list_pos).oid.stripe & STRIPE_MASK);
         n_copies++;
         if (replicated && replica > 0 || replica >= pg->pg_size)
         {
@@ -130,7 +291,7 @@ void pg_obj_state_check_t::handle_version()
         }
         else
         {
-            if (list[list_pos].is_stable)
+            if (at(list_pos).is_stable)
             {
                 n_stable++;
             }
@@ -139,7 +300,7 @@ void pg_obj_state_check_t::handle_version()
                 int i;
                 for (i = 0; i < pg->cur_set.size(); i++)
                 {
-                    if (pg->cur_set[i] == list[list_pos].osd_num)
+                    if (pg->cur_set[i] == at(list_pos).osd_num)
                     {
                         break;
                     }
@@ -151,7 +312,7 @@ void pg_obj_state_check_t::handle_version()
             }
             else
             {
-                if (pg->cur_set[replica] != list[list_pos].osd_num)
+                if (pg->cur_set[replica] != at(list_pos).osd_num)
                 {
                     n_mismatched++;
                 }
@@ -163,7 +324,7 @@ void pg_obj_state_check_t::handle_version()
             }
         }
     }
-    if (!list[list_pos].is_stable)
+    if (!at(list_pos).is_stable)
     {
         n_unstable++;
     }
@@ -185,28 +346,28 @@ void pg_obj_state_check_t::finish_object()
         // It's not allowed to change the replication scheme for a pool other than by recreating it
         // So we must bring the PG offline
         state = OBJ_INCOMPLETE;
-        pg->state |= PG_HAS_INVALID;
+        pg_state |= PG_HAS_INVALID;
         pg->total_count++;
         return;
     }
     if (n_unstable > 0)
     {
-        pg->state |= PG_HAS_UNCLEAN;
+        pg_state |= PG_HAS_UNCLEAN;
         std::unordered_map<obj_piece_id_t, obj_piece_ver_t> pieces;
         for (int i = obj_start; i < obj_end; i++)
         {
-            auto & pcs = pieces[(obj_piece_id_t){ .oid = list[i].oid, .osd_num = list[i].osd_num }];
+            auto & pcs = pieces[(obj_piece_id_t){ .oid = at(i).oid, .osd_num = at(i).osd_num }];
             if (!pcs.max_ver)
             {
-                pcs.max_ver = list[i].version;
+                pcs.max_ver = at(i).version;
             }
-            if (list[i].is_stable && !pcs.stable_ver)
+            if (at(i).is_stable && !pcs.stable_ver)
             {
-                pcs.stable_ver = list[i].version;
+                pcs.stable_ver = at(i).version;
             }
-            if (list[i].version <= target_ver && !pcs.max_target)
+            if (at(i).version <= target_ver && !pcs.max_target)
             {
-                pcs.max_target = list[i].version;
+                pcs.max_target = at(i).version;
             }
         }
         for (auto pp: pieces)
@@ -240,7 +401,7 @@ void pg_obj_state_check_t::finish_object()
             printf("Object is incomplete: %lx:%lx version=%lu/%lu\n", oid.inode, oid.stripe, target_ver, max_ver);
         }
         state = OBJ_INCOMPLETE;
-        pg->state = pg->state | PG_HAS_INCOMPLETE;
+        pg_state = pg_state | PG_HAS_INCOMPLETE;
     }
     else if ((replicated ? n_copies : n_roles) < pg->pg_cursize)
     {
@@ -249,7 +410,7 @@ void pg_obj_state_check_t::finish_object()
             printf("Object is degraded: %lx:%lx version=%lu/%lu\n", oid.inode, oid.stripe, target_ver, max_ver);
         }
         state = OBJ_DEGRADED;
-        pg->state = pg->state | PG_HAS_DEGRADED;
+        pg_state = pg_state | PG_HAS_DEGRADED;
     }
     else if (n_mismatched > 0)
     {
@@ -258,15 +419,15 @@ void pg_obj_state_check_t::finish_object()
             printf("Object is misplaced: %lx:%lx version=%lu/%lu\n", oid.inode, oid.stripe, target_ver, max_ver);
         }
         state |= OBJ_MISPLACED;
-        pg->state = pg->state | PG_HAS_MISPLACED;
+        pg_state = pg_state | PG_HAS_MISPLACED;
     }
     if (log_level > 1 && (state & (OBJ_INCOMPLETE | OBJ_DEGRADED)) ||
         log_level > 2 && (state & OBJ_MISPLACED))
     {
         for (int i = obj_start; i < obj_end; i++)
         {
-            printf("v%lu present on: osd %lu, role %ld%s\n", list[i].version, list[i].osd_num,
-                (list[i].oid.stripe & STRIPE_MASK), list[i].is_stable ? " (stable)" : "");
+            printf("v%lu present on: osd %lu, role %ld%s\n", at(i).version, at(i).osd_num,
+                (at(i).oid.stripe & STRIPE_MASK), at(i).is_stable ? " (stable)" : "");
         }
     }
     pg->total_count++;
@@ -276,8 +437,8 @@ void pg_obj_state_check_t::finish_object()
         for (int i = ver_start; i < ver_end; i++)
         {
             osd_set.push_back((pg_obj_loc_t){
-                .role = (list[i].oid.stripe & STRIPE_MASK),
-                .osd_num = list[i].osd_num,
+                .role = (at(i).oid.stripe & STRIPE_MASK),
+                .osd_num = at(i).osd_num,
                 .outdated = false,
             });
         }
@@ -290,22 +451,22 @@ void pg_obj_state_check_t::finish_object()
             int j;
             for (j = 0; j < osd_set.size(); j++)
             {
-                if (osd_set[j].osd_num == list[i].osd_num)
+                if (osd_set[j].osd_num == at(i).osd_num)
                 {
                     break;
                 }
             }
-            if (j >= osd_set.size() && pg->cur_set[list[i].oid.stripe & STRIPE_MASK] != list[i].osd_num)
+            if (j >= osd_set.size() && pg->cur_set[at(i).oid.stripe & STRIPE_MASK] != at(i).osd_num)
             {
                 osd_set.push_back((pg_obj_loc_t){
-                    .role = (list[i].oid.stripe & STRIPE_MASK),
-                    .osd_num = list[i].osd_num,
+                    .role = (at(i).oid.stripe & STRIPE_MASK),
+                    .osd_num = at(i).osd_num,
                     .outdated = true,
                 });
                 if (!(state & (OBJ_INCOMPLETE | OBJ_DEGRADED)))
                 {
                     state |= OBJ_MISPLACED;
-                    pg->state = pg->state | PG_HAS_MISPLACED;
+                    pg_state = pg_state | PG_HAS_MISPLACED;
                 }
             }
         }
@@ -381,50 +542,192 @@ void pg_obj_state_check_t::finish_object()
     }
 }
 
-// FIXME: Write at least some tests for this function
 void pg_t::calc_object_states(int log_level)
 {
-    // Copy all object lists into one array
-    pg_obj_state_check_t st;
-    st.log_level = log_level;
-    st.pg = this;
-    st.replicated = (this->scheme == POOL_SCHEME_REPLICATED);
+    uint64_t budget = UINT64_MAX;
+    calc_object_states(log_level, budget);
+}
+
+bool pg_t::calc_object_states(int log_level, uint64_t & budget)
+{
     auto ps = peering_state;
-    epoch = 0;
-    for (auto it: ps->list_results)
-    {
-        auto nstab = it.second.stable_count;
-        auto n = it.second.total_count;
-        auto osd_num = it.first;
-        uint64_t start = st.list.size();
-        st.list.resize(start + n);
-        obj_ver_id *ov = it.second.buf;
-        for (uint64_t i = 0; i < n; i++, ov++)
+    if (!budget)
+    {
+        return false;
+    }
+    if (!ps->calc)
+    {
+        ps->calc = new pg_obj_state_check_t();
+        ps->calc->log_level = log_level;
+        ps->calc->pg = this;
+        ps->calc->replicated = (this->scheme == POOL_SCHEME_REPLICATED);
+        ps->calc->copy_it = ps->list_results.begin();
+    }
+    auto & st = *ps->calc;
+    while (budget > 0)
+    {
+        if (st.stage == PG_CALC_COPY)
         {
-            if ((ov->version >> (64-PG_EPOCH_BITS)) > epoch)
+            if (st.copy_it == ps->list_results.end())
             {
-                epoch = (ov->version >> (64-PG_EPOCH_BITS));
+                ps->list_results.clear();
+                st.start_merge();
+                st.stage = PG_CALC_MERGE;
+                continue;
+            }
+            // Copying and sorting a run is not interrupted
+            st.copy_run();
+            budget = budget > PG_CALC_RUN_SIZE ? budget-PG_CALC_RUN_SIZE : 0;
+        }
+        else if (st.stage == PG_CALC_MERGE)
+        {
+            st.merge_step(budget);
+            if (!st.merge_heap.size())
+            {
+                st.merge_heap.shrink_to_fit();
+                st.start_walk();
+                st.stage = PG_CALC_WALK;
             }
-            st.list[start+i] = {
-                .oid = ov->oid,
-                .version = ov->version,
-                .osd_num = osd_num,
-                .is_stable = i < nstab,
-            };
         }
-        free(it.second.buf);
-        it.second.buf = NULL;
+        else if (st.stage == PG_CALC_WALK)
+        {
+            if (st.walk_step(budget))
+            {
+                st.finish_walk();
+                st.stage = PG_CALC_FREE;
+            }
+        }
+        else if (st.free_step(budget))
+        {
+            this->state = st.pg_state;
+            total_count += st.other_count;
+            clean_count += st.other_count;
+            epoch = st.epoch;
+            if (this->state & (PG_DEGRADED|PG_LEFT_ON_DEAD))
+            {
+                assert(epoch != ((1ul << PG_EPOCH_BITS)-1));
+                epoch++;
+            }
+            delete ps->calc;
+            ps->calc = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Forget results of an unfinished calc_object_states()
+void pg_t::cancel_object_states()
+{
+    if (!peering_state || !peering_state->calc)
+    {
+        return;
     }
-    ps->list_results.clear();
-    // Sort
-    std::sort(st.list.begin(), st.list.end());
-    // Walk over it and check object states
-    st.walk();
-    if (this->state & (PG_DEGRADED|PG_LEFT_ON_DEAD))
+    delete peering_state->calc;
+    peering_state->calc = NULL;
+    for (auto & lr: peering_state->list_results)
     {
-        assert(epoch != ((1ul << PG_EPOCH_BITS)-1));
-        epoch++;
+        if (lr.second.buf)
+            free(lr.second.buf);
     }
+    peering_state->list_results.clear();
+    incomplete_objects.clear();
+    misplaced_objects.clear();
+    degraded_objects.clear();
+    state_dict.clear();
+    flush_actions.clear();
+    ver_override.clear();
+}
+
+pg_peering_state_t::~pg_peering_state_t()
+{
+    if (calc)
+    {
+        delete calc;
+    }
+}
+
+// Stable versions of all pages go first, so unstable ones are collected separately until the last page
+void pg_list_result_t::append_page(obj_ver_id *page, uint64_t page_total, uint64_t page_stable,
+    const osd_list_summary_t & page_other, bool last)
+{
+    other.count += page_other.count;
+    other.hash += page_other.hash;
+    other.role_hash += page_other.role_hash;
+    other.unstable_count += page_other.unstable_count;
+    if (other.max_version < page_other.max_version)
+        other.max_version = page_other.max_version;
+    if (!buf && last)
+    {
+        // Single page
+        buf = page;
+        total_count = page_total;
+        stable_count = page_stable;
+        return;
+    }
+    if (page_stable > 0)
+    {
+        buf = (obj_ver_id*)realloc_or_die(buf, sizeof(obj_ver_id) * (stable_count+page_stable));
+        memcpy(buf+stable_count, page, sizeof(obj_ver_id) * page_stable);
+        stable_count += page_stable;
+    }
+    unstable.insert(unstable.end(), page+page_stable, page+page_total);
+    if (page)
+        free(page);
+    if (last && unstable.size())
+    {
+        buf = (obj_ver_id*)realloc_or_die(buf, sizeof(obj_ver_id) * (stable_count+unstable.size()));
+        memcpy(buf+stable_count, unstable.data(), sizeof(obj_ver_id) * unstable.size());
+        total_count = stable_count+unstable.size();
+        unstable.clear();
+        unstable.shrink_to_fit();
+    }
+    else
+        total_count = stable_count;
+}
+
+static inline uint64_t mix_hash(uint64_t h)
+{
+    // splitmix64 finalizer
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111eb;
+    h ^= h >> 31;
+    return h;
+}
+
+void filter_changed_objects(obj_ver_id *list, uint64_t & total_count, uint64_t & stable_count,
+    const object_id *changed, uint64_t changed_count, osd_list_summary_t & other)
+{
+    other = {};
+    uint64_t pos = 0, new_stable = 0;
+    for (uint64_t i = 0; i < total_count; i++)
+    {
+        object_id oid = { .inode = list[i].oid.inode, .stripe = list[i].oid.stripe & ~STRIPE_MASK };
+        if (std::binary_search(changed, changed+changed_count, oid))
+        {
+            // Stable versions go first, so the order is preserved
+            list[pos++] = list[i];
+            if (i < stable_count)
+                new_stable++;
+        }
+        else if (i >= stable_count)
+        {
+            other.unstable_count++;
+        }
+        else
+        {
+            uint64_t h = mix_hash(mix_hash(mix_hash(oid.inode) ^ oid.stripe) ^ list[i].version);
+            other.count++;
+            other.hash += h;
+            other.role_hash += h * ((list[i].oid.stripe & STRIPE_MASK) + 1);
+            if (other.max_version < list[i].version)
+                other.max_version = list[i].version;
+        }
+    }
+    total_count = pos;
+    stable_count = new_stable;
 }
 
 void pg_t::print_state()
@@ -448,3 +751,22 @@ void pg_t::print_state()
         total_count
     );
 }
+
+// btree nodes are dense, so their entries are counted without overhead,
+// std::map nodes are counted with 32 bytes of overhead
+uint64_t pg_t::object_state_bytes()
+{
+    uint64_t bytes = 0;
+    for (auto & sp: state_dict)
+    {
+        bytes += sizeof(sp) + 32 + (sp.first.size() + sp.second.osd_set.size()) * sizeof(pg_obj_loc_t) +
+            sp.second.read_target.size() * sizeof(osd_num_t);
+    }
+    bytes += (incomplete_objects.size() + misplaced_objects.size() + degraded_objects.size()) *
+        (sizeof(object_id) + sizeof(pg_osd_set_state_t*));
+    bytes += flush_actions.size() * (sizeof(obj_piece_id_t) + sizeof(flush_action_t) + 32);
+    bytes += copies_to_delete_after_sync.size() * sizeof(obj_ver_osd_t);
+    bytes += ver_override.size() * (sizeof(object_id) + sizeof(uint64_t));
+    bytes += changed_objects.size() * sizeof(object_id);
+    return bytes;
+}
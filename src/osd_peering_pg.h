@@ -2,14 +2,17 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
 
 #include "cpp-btree/btree_map.h"
+#include "cpp-btree/btree_set.h"
 
 #include "object_id.h"
 #include "osd_ops.h"
 #include "pg_states.h"
+#include "slab_allocator.h"
 
 #define PG_EPOCH_BITS 48
 
@@ -35,11 +38,18 @@ struct pg_osd_set_state_t
 struct pg_list_result_t
 {
     obj_ver_id *buf = NULL;
-    uint64_t total_count;
-    uint64_t stable_count;
+    uint64_t total_count = 0;
+    uint64_t stable_count = 0;
+    // objects not listed because of OSD_LIST_CHANGED
+    osd_list_summary_t other = {};
+    // unstable versions from previous pages, moved to the end of buf after the last page
+    std::vector<obj_ver_id> unstable;
+
+    void append_page(obj_ver_id *page, uint64_t page_total, uint64_t page_stable, const osd_list_summary_t & page_other, bool last);
 };
 
 struct osd_op_t;
+struct pg_obj_state_check_t;
 
 struct pg_peering_state_t
 {
@@ -48,6 +58,17 @@ struct pg_peering_state_t
     std::map<osd_num_t, pg_list_result_t> list_results;
     pool_id_t pool_id = 0;
     pg_num_t pg_num = 0;
+    // only list pg.changed_objects (copied here), see check_list_summaries()
+    bool list_changed = false;
+    std::vector<object_id> changed_objects;
+    // unfinished object state calculation
+    pg_obj_state_check_t *calc = NULL;
+    // waiting for a free slot to start listing, see peering_queue_depth
+    bool queued = false;
+    // a client operation was refused because of this peering, so it's started first
+    bool client_waiting = false;
+
+    ~pg_peering_state_t();
 };
 
 struct obj_piece_id_t
@@ -78,6 +99,91 @@ struct pg_flush_batch_t
     int flush_objects = 0;
 };
 
+// Writes of a PG, per object, in the order of arrival. The first write of every object
+// is the one being executed, others wait for it. Most objects only have one write at
+// a time, so it's stored separately and the vector only allocates memory for waiters.
+struct pg_obj_writes_t
+{
+    osd_op_t *first = NULL;
+    std::vector<osd_op_t*> waiting;
+};
+
+class pg_write_queue_t
+{
+    std::unordered_map<object_id, pg_obj_writes_t, std::hash<object_id>, std::equal_to<object_id>,
+        slab_allocator_t<std::pair<const object_id, pg_obj_writes_t>>> objects;
+
+public:
+    // Returns true if <op> is the first write of the object
+    inline bool push(const object_id & oid, osd_op_t *op)
+    {
+        auto & obj = objects[oid];
+        if (!obj.first)
+        {
+            obj.first = op;
+            return true;
+        }
+        obj.waiting.push_back(op);
+        return false;
+    }
+
+    inline osd_op_t *first(const object_id & oid)
+    {
+        auto it = objects.find(oid);
+        return it == objects.end() ? NULL : it->second.first;
+    }
+
+    // Removes the first write of the object and returns the next one
+    inline osd_op_t *pop(const object_id & oid)
+    {
+        auto it = objects.find(oid);
+        if (it == objects.end())
+            return NULL;
+        if (!it->second.waiting.size())
+        {
+            objects.erase(it);
+            return NULL;
+        }
+        it->second.first = it->second.waiting[0];
+        it->second.waiting.erase(it->second.waiting.begin());
+        return it->second.first;
+    }
+
+    // Removes all writes of the object and appends them to <ops>
+    inline void pop_all(const object_id & oid, std::vector<osd_op_t*> & ops)
+    {
+        auto it = objects.find(oid);
+        if (it == objects.end())
+            return;
+        ops.push_back(it->second.first);
+        ops.insert(ops.end(), it->second.waiting.begin(), it->second.waiting.end());
+        objects.erase(it);
+    }
+
+    // Calls cb(oid, first_op)
+    template<class F> void for_each_first(F cb)
+    {
+        for (auto & obj: objects)
+            cb(obj.first, obj.second.first);
+    }
+
+    // Calls cb(op) for all writes
+    template<class F> void for_each(F cb)
+    {
+        for (auto & obj: objects)
+        {
+            cb(obj.second.first);
+            for (auto op: obj.second.waiting)
+                cb(op);
+        }
+    }
+
+    inline void clear()
+    {
+        objects.clear();
+    }
+};
+
 struct pg_t
 {
     int state = 0;
@@ -114,12 +220,41 @@ struct pg_t
     pg_flush_batch_t *flush_batch = NULL;
 
     int inflight = 0; // including write_queue
-    std::multimap<object_id, osd_op_t*> write_queue;
+    pg_write_queue_t write_queue;
+    // objects that may differ between OSDs since the PG was last active+clean,
+    // only they are listed during the next peering. invalid until the PG becomes
+    // active+clean and after an overflow
+    btree::btree_set<object_id> changed_objects;
+    bool changes_valid = false;
+
+    inline void log_change(const object_id & oid, uint64_t max_changes)
+    {
+        if (!changes_valid)
+            return;
+        if (changed_objects.size() >= max_changes)
+        {
+            changed_objects.clear();
+            changes_valid = false;
+            return;
+        }
+        changed_objects.insert((object_id){ .inode = oid.inode, .stripe = oid.stripe & ~STRIPE_MASK });
+    }
 
     void calc_object_states(int log_level);
+    // Same, but only does about <budget> steps at a time and decreases it.
+    // Returns false if the calculation isn't finished yet
+    bool calc_object_states(int log_level, uint64_t & budget);
+    void cancel_object_states();
     void print_state();
+    // Estimated memory used by object state maps in bytes
+    uint64_t object_state_bytes();
 };
 
+// Leave only versions of <changed> objects (sorted, without role) in the object list
+// returned by BS_OP_LIST and summarize all other versions
+void filter_changed_objects(obj_ver_id *list, uint64_t & total_count, uint64_t & stable_count,
+    const object_id *changed, uint64_t changed_count, osd_list_summary_t & other);
+
 inline bool operator < (const pg_obj_loc_t &a, const pg_obj_loc_t &b)
 {
     return a.outdated < b.outdated ||
@@ -3,6 +3,7 @@
 
 #define _LARGEFILE64_SOURCE
 
+#include <time.h>
 #include "malloc_or_die.h"
 #include "osd_peering_pg.h"
 #define STRIPE_SHIFT 12
@@ -20,39 +21,101 @@
  *    v1=1s,2s,6s -> misplaced
  * 2) ...
  */
-int main(int argc, char *argv[])
+
+#define OBJ_COUNT (10*1024*1024)
+
+static uint64_t now_us()
 {
-    pg_t pg = {
-        .state = PG_PEERING,
-        .pg_num = 1,
-        .target_set = { 1, 2, 3 },
-        .cur_set = { 1, 2, 3 },
-        .peering_state = new pg_peering_state_t(),
-    };
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000000 + tv.tv_nsec/1000;
+}
+
+// 3 replicas of OBJ_COUNT objects, OSD 1 has 10 unstable newer versions, OSD 3 misses every 1000th object
+static void fill_lists(pg_t & pg)
+{
+    pg.peering_state = new pg_peering_state_t();
     for (uint64_t osd_num = 1; osd_num <= 3; osd_num++)
     {
         pg_list_result_t r = {
-            .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * 1024*1024*8),
-            .total_count = 1024*1024*8,
-            .stable_count = (uint64_t)(1024*1024*8 - (osd_num == 1 ? 10 : 0)),
+            .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * OBJ_COUNT),
+            .total_count = 0,
+            .stable_count = 0,
         };
-        for (uint64_t i = 0; i < r.total_count; i++)
+        for (uint64_t i = 0; i < OBJ_COUNT; i++)
         {
-            r.buf[i] = {
+            if (osd_num == 3 && !(i % 1000))
+                continue;
+            r.buf[r.total_count++] = {
                 .oid = {
                     .inode = 1,
-                    .stripe = (i << STRIPE_SHIFT) | (osd_num-1),
+                    .stripe = (i << STRIPE_SHIFT),
                 },
-                .version = (uint64_t)(osd_num == 1 && i >= r.total_count - 10 ? 2 : 1),
+                .version = (uint64_t)(osd_num == 1 && i >= OBJ_COUNT - 10 ? 2 : 1),
             };
         }
+        r.stable_count = r.total_count - (osd_num == 1 ? 10 : 0);
         pg.peering_state->list_results[osd_num] = r;
     }
+}
+
+int main(int argc, char *argv[])
+{
+    pg_t pg = {
+        .state = PG_PEERING,
+        .scheme = POOL_SCHEME_REPLICATED,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 1,
+        .pg_num = 1,
+        .all_peers = { 1, 2, 3 },
+        .cur_peers = { 1, 2, 3 },
+        .target_set = { 1, 2, 3 },
+        .cur_set = { 1, 2, 3 },
+    };
+    // In one go
+    fill_lists(pg);
+    uint64_t start = now_us();
     pg.calc_object_states(0);
-    printf("deviation variants=%ld clean=%lu\n", pg.state_dict.size(), pg.clean_count);
-    for (auto it: pg.state_dict)
+    uint64_t full_us = now_us()-start;
+    int full_state = pg.state;
+    uint64_t full_clean = pg.clean_count, full_degraded = pg.degraded_objects.size();
+    printf("%d objects: full calculation took %lu ms, state=%x clean=%lu degraded=%lu unclean=%lu\n",
+        OBJ_COUNT, full_us/1000, full_state, full_clean, full_degraded, pg.flush_actions.size());
+    delete pg.peering_state;
+    pg.state = PG_PEERING;
+    pg.state_dict.clear();
+    pg.degraded_objects.clear();
+    pg.misplaced_objects.clear();
+    pg.incomplete_objects.clear();
+    pg.flush_actions.clear();
+    pg.ver_override.clear();
+    // In steps
+    fill_lists(pg);
+    uint64_t steps = 0, max_step_us = 0;
+    start = now_us();
+    while (true)
+    {
+        uint64_t step_start = now_us();
+        uint64_t budget = 65536;
+        bool done = pg.calc_object_states(0, budget);
+        uint64_t step_us = now_us()-step_start;
+        if (max_step_us < step_us)
+            max_step_us = step_us;
+        steps++;
+        if (done)
+            break;
+    }
+    printf("%d objects: calculation in %lu steps took %lu ms, longest step %lu us\n",
+        OBJ_COUNT, steps, (now_us()-start)/1000, max_step_us);
+    delete pg.peering_state;
+    pg.peering_state = NULL;
+    if (pg.state != full_state || pg.clean_count != full_clean || pg.degraded_objects.size() != full_degraded ||
+        pg.flush_actions.size() != 10)
     {
-        printf("dev: state=%lx\n", it.second.state);
+        printf("Results differ: state=%x clean=%lu degraded=%lu\n", pg.state, pg.clean_count, pg.degraded_objects.size());
+        return 1;
     }
     return 0;
 }
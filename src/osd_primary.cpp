@@ -37,9 +37,26 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
         .stripe = (cur_op->req.rw.offset/pg_block_size)*pg_block_size,
     };
     pg_num_t pg_num = (oid.stripe/pool_cfg.pg_stripe_size) % pg_counts[pool_id] + 1; // like map_to_pg()
-    auto pg_it = pgs.find({ .pool_id = pool_id, .pg_num = pg_num });
-    if (pg_it == pgs.end() || !(pg_it->second.state & PG_ACTIVE))
+    if (cur_op->req.hdr.opcode == OSD_OP_MERGE || cur_op->req.hdr.opcode == OSD_OP_SCRUB)
     {
+        // Merge and scrub always process the whole object
+        cur_op->req.rw.offset = oid.stripe;
+        cur_op->req.rw.len = pg_block_size;
+    }
+    pg_t *pg = find_pg(pool_id, pg_num);
+    if (!pg || !(pg->state & PG_ACTIVE))
+    {
+        if (pg && pg->state == PG_PEERING && pg->peering_state->queued && !pg->peering_state->client_waiting)
+        {
+            // Peer this PG before the ones nobody is waiting for
+            pg->peering_state->client_waiting = true;
+            ringloop->wakeup();
+        }
+        if (cur_op->req.hdr.opcode == OSD_OP_READ && exec_replica_read(cur_op, pool_cfg, oid, pg_num))
+        {
+            // Client reads directly from a secondary replica
+            return false;
+        }
         // This OSD is not primary for this PG or the PG is inactive
         // FIXME: Allow reads from PGs degraded under pg_minsize, but don't allow writes
         finish_op(cur_op, -EPIPE);
@@ -52,9 +69,11 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
         finish_op(cur_op, -EINVAL);
         return false;
     }
-    int stripe_count = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pg_it->second.pg_size);
+    // Scrub reads every replica into a separate stripe
+    int stripe_count = (pool_cfg.scheme == POOL_SCHEME_REPLICATED && cur_op->req.hdr.opcode != OSD_OP_SCRUB ? 1 : pg->pg_size);
     int chain_size = 0;
-    if (cur_op->req.hdr.opcode == OSD_OP_READ && cur_op->req.rw.meta_revision > 0)
+    if ((cur_op->req.hdr.opcode == OSD_OP_READ || cur_op->req.hdr.opcode == OSD_OP_MERGE) &&
+        cur_op->req.rw.meta_revision > 0)
     {
         // Chained read
         auto inode_it = st_cli.inode_config.find(cur_op->req.rw.inode);
@@ -67,7 +86,7 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
         }
         // Find parents from the same pool. Optimized reads only work within pools
         while (inode_it != st_cli.inode_config.end() && inode_it->second.parent_id &&
-            INODE_POOL(inode_it->second.parent_id) == pg_it->second.pool_id &&
+            INODE_POOL(inode_it->second.parent_id) == pg->pool_id &&
             // Check for loops
             inode_it->second.parent_id != cur_op->req.rw.inode)
         {
@@ -93,7 +112,7 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
             // - bitmap buffers for chained read
             stripe_count * clean_entry_bitmap_size +
             // - 'missing' flags for chained reads
-            (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 0 : pg_it->second.pg_size)
+            (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 0 : pg->pg_size)
         )
     );
     void *data_buf = ((void*)op_data) + sizeof(osd_primary_op_data_t);
@@ -103,7 +122,7 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
     data_buf += sizeof(osd_rmw_stripe_t) * stripe_count;
     op_data->scheme = pool_cfg.scheme;
     op_data->pg_data_size = pg_data_size;
-    op_data->pg_size = pg_it->second.pg_size;
+    op_data->pg_size = pg->pg_size;
     cur_op->op_data = op_data;
     split_stripes(pg_data_size, bs_block_size, (uint32_t)(cur_op->req.rw.offset - oid.stripe), cur_op->req.rw.len, op_data->stripes);
     // Allocate bitmaps along with stripes to avoid extra allocations and fragmentation
@@ -120,13 +139,13 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
         op_data->snapshot_bitmaps = data_buf;
         data_buf += chain_size * stripe_count * clean_entry_bitmap_size;
         op_data->missing_flags = (uint8_t*)data_buf;
-        data_buf += chain_size * (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 0 : pg_it->second.pg_size);
+        data_buf += chain_size * (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 0 : pg->pg_size);
         // Copy chain
         int chain_num = 0;
         op_data->read_chain[chain_num++] = cur_op->req.rw.inode;
         auto inode_it = st_cli.inode_config.find(cur_op->req.rw.inode);
         while (inode_it != st_cli.inode_config.end() && inode_it->second.parent_id &&
-            INODE_POOL(inode_it->second.parent_id) == pg_it->second.pool_id &&
+            INODE_POOL(inode_it->second.parent_id) == pg->pool_id &&
             // Check for loops
             inode_it->second.parent_id != cur_op->req.rw.inode)
         {
@@ -134,7 +153,63 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
             inode_it = st_cli.inode_config.find(inode_it->second.parent_id);
         }
     }
-    pg_it->second.inflight++;
+    pg->inflight++;
+    return true;
+}
+
+// Serve a client read from the local replica of a clean replicated PG for which this OSD
+// is a secondary. Only possible when the read doesn't need the PG state of the primary:
+// the object is in a clean PG and it has no parent layers in the same pool.
+bool osd_t::exec_replica_read(osd_op_t *cur_op, pool_config_t & pool_cfg, object_id oid, pg_num_t pg_num)
+{
+    if (!bs || pool_cfg.scheme != POOL_SCHEME_REPLICATED)
+        return false;
+    auto pg_it = pool_cfg.pg_config.find(pg_num);
+    if (pg_it == pool_cfg.pg_config.end() || pg_it->second.cur_state != PG_ACTIVE ||
+        pg_it->second.pause || !pg_it->second.cur_primary || pg_it->second.cur_primary == this->osd_num ||
+        std::find(pg_it->second.target_set.begin(), pg_it->second.target_set.end(), this->osd_num) == pg_it->second.target_set.end())
+    {
+        return false;
+    }
+    auto inode_it = st_cli.inode_config.find(cur_op->req.rw.inode);
+    if (inode_it != st_cli.inode_config.end() && inode_it->second.parent_id &&
+        INODE_POOL(inode_it->second.parent_id) == pool_cfg.id)
+    {
+        return false;
+    }
+    if ((cur_op->req.rw.offset + cur_op->req.rw.len) > (oid.stripe + bs_block_size))
+    {
+        finish_op(cur_op, -EINVAL);
+        return true;
+    }
+    // Bitmap is stored after the data
+    cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.rw.len + clean_entry_bitmap_size);
+    cur_op->bs_op = new blockstore_op_t({
+        .opcode = BS_OP_READ,
+        .callback = [this, cur_op](blockstore_op_t *bs_op)
+        {
+            int retval = bs_op->retval;
+            cur_op->reply.rw.version = bs_op->version;
+            delete bs_op;
+            cur_op->bs_op = NULL;
+            if (retval != cur_op->req.rw.len)
+            {
+                finish_op(cur_op, retval < 0 ? retval : -EIO);
+                return;
+            }
+            cur_op->reply.rw.bitmap_len = clean_entry_bitmap_size;
+            cur_op->iov.push_back(cur_op->buf + cur_op->req.rw.len, clean_entry_bitmap_size);
+            cur_op->iov.push_back(cur_op->buf, cur_op->req.rw.len);
+            finish_op(cur_op, cur_op->req.rw.len);
+        },
+        .oid = oid,
+        .version = UINT64_MAX,
+        .offset = (uint32_t)(cur_op->req.rw.offset - oid.stripe),
+        .len = cur_op->req.rw.len,
+        .buf = cur_op->buf,
+        .bitmap = cur_op->buf + cur_op->req.rw.len,
+    });
+    bs->enqueue_op(cur_op->bs_op);
     return true;
 }
 
@@ -167,6 +242,57 @@ uint64_t* osd_t::get_object_osd_set(pg_t &pg, object_id &oid, uint64_t *def, pg_
     return def;
 }
 
+// Pick the replica to read a clean object from, according to read_balance
+int osd_t::pick_read_role(pg_t & pg)
+{
+    int n = 0, local_role = -1;
+    int roles[pg.pg_size];
+    for (int role = 0; role < pg.pg_size; role++)
+    {
+        osd_num_t role_osd = pg.cur_set[role];
+        if (role_osd == this->osd_num)
+            local_role = role;
+        if (role_osd == this->osd_num || role_osd != 0 && msgr.osd_peer_fds.find(role_osd) != msgr.osd_peer_fds.end())
+            roles[n++] = role;
+    }
+    if (!n)
+        return local_role;
+    if (read_balance == READ_BALANCE_RANDOM ||
+        // Sometimes retry other replicas so their latency estimate doesn't get stale
+        read_balance == READ_BALANCE_LOWEST_LATENCY && !(rand() % 32))
+    {
+        return roles[rand() % n];
+    }
+    int best = local_role >= 0 ? local_role : roles[0];
+    uint64_t best_cost = UINT64_MAX;
+    for (int i = 0; i < n; i++)
+    {
+        auto & st = read_stats[pg.cur_set[roles[i]]];
+        uint64_t cost = read_balance == READ_BALANCE_LEAST_QUEUED ? st.inflight : st.lat_us * (st.inflight+1);
+        // Prefer the local replica when costs are equal
+        if (cost < best_cost || cost == best_cost && roles[i] == local_role)
+        {
+            best = roles[i];
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+void osd_t::finish_balanced_read(osd_op_t *subop, osd_op_t *cur_op)
+{
+    auto & st = read_stats[cur_op->op_data->read_osd];
+    cur_op->op_data->read_osd = 0;
+    st.inflight--;
+    timespec tv_end;
+    clock_gettime(CLOCK_REALTIME, &tv_end);
+    uint64_t usec = (
+        (tv_end.tv_sec - subop->tv_begin.tv_sec)*1000000 +
+        (tv_end.tv_nsec - subop->tv_begin.tv_nsec)/1000
+    );
+    st.lat_us = st.lat_us ? (st.lat_us*7 + usec)/8 : usec;
+}
+
 void osd_t::continue_primary_read(osd_op_t *cur_op)
 {
     if (!cur_op->op_data && !prepare_primary_rw(cur_op))
@@ -183,9 +309,10 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
         goto resume_1;
     else if (op_data->st == 2)
         goto resume_2;
+    trace_stage(cur_op, OSD_TRACE_START);
     cur_op->reply.rw.bitmap_len = 0;
     {
-        auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+        auto & pg = get_pg(INODE_POOL(op_data->oid.inode), op_data->pg_num);
         for (int role = 0; role < op_data->pg_data_size; role++)
         {
             op_data->stripes[role].read_start = op_data->stripes[role].req_start;
@@ -197,8 +324,20 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
         if (pg.state == PG_ACTIVE || op_data->scheme == POOL_SCHEME_REPLICATED)
         {
             // Fast happy-path
+            int read_role = -1;
+            if (read_balance != READ_BALANCE_PRIMARY && pg.state == PG_ACTIVE &&
+                op_data->scheme == POOL_SCHEME_REPLICATED && op_data->target_ver == UINT64_MAX)
+            {
+                // All replicas of a clean object are the same, so any of them may serve the read
+                read_role = pick_read_role(pg);
+                if (read_role >= 0)
+                {
+                    op_data->read_osd = pg.cur_set[read_role];
+                    read_stats[op_data->read_osd].inflight++;
+                }
+            }
             cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0);
-            submit_primary_subops(SUBMIT_RMW_READ, op_data->target_ver, pg.cur_set.data(), cur_op);
+            submit_primary_subops(SUBMIT_RMW_READ, op_data->target_ver, pg.cur_set.data(), cur_op, read_role);
             op_data->st = 1;
         }
         else
@@ -318,7 +457,7 @@ void osd_t::continue_primary_del(osd_op_t *cur_op)
         return;
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
-    auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+    auto & pg = get_pg(INODE_POOL(op_data->oid.inode), op_data->pg_num);
     if (op_data->st == 1)      goto resume_1;
     else if (op_data->st == 2) goto resume_2;
     else if (op_data->st == 3) goto resume_3;
@@ -336,6 +475,7 @@ void osd_t::continue_primary_del(osd_op_t *cur_op)
         return;
     }
 resume_1:
+    trace_stage(cur_op, OSD_TRACE_START);
     // Determine which OSDs contain this object and delete it
     op_data->prev_set = get_object_osd_set(pg, op_data->oid, pg.cur_set.data(), &op_data->object_state);
     // Submit 1 read to determine the actual version number
@@ -386,17 +526,172 @@ resume_5:
     cur_op->reply.hdr.retval = 0;
 continue_others:
     osd_op_t *next_op = NULL;
-    auto next_it = pg.write_queue.find(op_data->oid);
-    if (next_it != pg.write_queue.end() && next_it->second == cur_op)
+    if (pg.write_queue.first(op_data->oid) == cur_op)
     {
-        pg.write_queue.erase(next_it++);
-        if (next_it != pg.write_queue.end() && next_it->first == op_data->oid)
-            next_op = next_it->second;
+        next_op = pg.write_queue.pop(op_data->oid);
     }
     finish_op(cur_op, cur_op->reply.hdr.retval);
     if (next_op)
     {
         // Continue next write to the same object
-        continue_primary_write(next_op);
+        continue_primary_op(next_op);
+    }
+}
+
+// Delete objects of an inode in a PG in batches, taking the object list from the local blockstore,
+// so that the client doesn't have to list and delete every object itself
+void osd_t::continue_primary_delete_range(osd_op_t *cur_op)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (op_data)
+    {
+        if (op_data->st == 1)
+            goto resume_1;
+        else if (op_data->st == 2)
+            goto resume_2;
+        else if (op_data->st == 3)
+            goto resume_3;
+    }
+    {
+        inode_t inode = cur_op->req.delete_range.inode;
+        pool_id_t pool_id = INODE_POOL(inode);
+        auto pool_cfg_it = st_cli.pool_config.find(pool_id);
+        pg_t *pg = pool_cfg_it != st_cli.pool_config.end() ? find_pg(pool_id, cur_op->req.delete_range.pg_num) : NULL;
+        if (!pg || !(pg->state & PG_ACTIVE))
+        {
+            // This OSD is not primary for this PG or the PG is inactive
+            finish_op(cur_op, -EPIPE);
+            return;
+        }
+        if (pg->state != PG_ACTIVE)
+        {
+            // Some objects may be absent on this OSD, they must be listed from all OSDs and deleted one by one
+            finish_op(cur_op, -EBUSY);
+            return;
+        }
+        op_data = (osd_primary_op_data_t*)calloc_or_die(1, sizeof(osd_primary_op_data_t));
+        op_data->pg_num = pg->pg_num;
+        op_data->oid.inode = inode;
+        cur_op->op_data = op_data;
+        pg->inflight++;
+        // List a page of objects
+        blockstore_list_page_t *page = (blockstore_list_page_t*)malloc_or_die(sizeof(blockstore_list_page_t));
+        *page = (blockstore_list_page_t){
+            .start = { .inode = inode, .stripe = cur_op->req.delete_range.start_offset },
+            .max_count = cur_op->req.delete_range.max_count ? cur_op->req.delete_range.max_count : 1024,
+        };
+        // freed with the operation
+        cur_op->rmw_buf = page;
+        cur_op->bs_op = new blockstore_op_t();
+        cur_op->bs_op->opcode = BS_OP_LIST;
+        cur_op->bs_op->oid.stripe = pool_cfg_it->second.pg_stripe_size;
+        cur_op->bs_op->len = pg_counts[pool_id];
+        cur_op->bs_op->offset = pg->pg_num - 1;
+        cur_op->bs_op->oid.inode = inode;
+        cur_op->bs_op->version = inode;
+        cur_op->bs_op->bitmap = page;
+        cur_op->bs_op->callback = [this, cur_op](blockstore_op_t *bs_op)
+        {
+            cur_op->op_data->st = 1;
+            continue_primary_delete_range(cur_op);
+        };
+        bs->enqueue_op(cur_op->bs_op);
+        return;
+    }
+resume_1:
+    {
+        blockstore_list_page_t *page = (blockstore_list_page_t*)cur_op->rmw_buf;
+        int total = cur_op->bs_op->retval;
+        obj_ver_id *list = (obj_ver_id*)cur_op->bs_op->buf;
+        delete cur_op->bs_op;
+        cur_op->bs_op = NULL;
+        if (total < 0)
+        {
+            finish_op(cur_op, total);
+            return;
+        }
+        cur_op->reply.delete_range.next_offset = page->next.inode ? (page->next.stripe & ~STRIPE_MASK) : UINT64_MAX;
+        // Objects may be listed multiple times (with different versions or EC chunk numbers)
+        for (int i = 0; i < total; i++)
+        {
+            list[i].oid.stripe &= ~STRIPE_MASK;
+        }
+        std::sort(list, list+total);
+        op_data->del_objects = (object_id*)malloc_or_die(sizeof(object_id) * (total > 0 ? total : 1));
+        op_data->del_count = 0;
+        for (int i = 0; i < total; i++)
+        {
+            // Deleted objects are listed with version 0
+            if (list[i].version != 0 && (!op_data->del_count || !(op_data->del_objects[op_data->del_count-1] == list[i].oid)) &&
+                (!page->next.inode || list[i].oid.stripe < cur_op->reply.delete_range.next_offset))
+            {
+                op_data->del_objects[op_data->del_count++] = list[i].oid;
+            }
+        }
+        free(list);
+        op_data->del_pos = 0;
+        op_data->done = op_data->errors = op_data->epipe = 0;
+        op_data->n_subops = 0;
+    }
+resume_2:
+    // Delete objects using normal primary deletes, at most <iodepth> at once
+    while (op_data->del_pos < op_data->del_count && (op_data->n_subops - op_data->done - op_data->errors) <
+        (cur_op->req.delete_range.iodepth ? cur_op->req.delete_range.iodepth : 1))
+    {
+        osd_op_t *del_op = new osd_op_t();
+        del_op->op_type = OSD_OP_OUT;
+        del_op->req = (osd_any_op_t){
+            .rw = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = 1,
+                    .opcode = OSD_OP_DELETE,
+                },
+                .inode = op_data->del_objects[op_data->del_pos].inode,
+                .offset = op_data->del_objects[op_data->del_pos].stripe,
+                .len = 0,
+            },
+        };
+        del_op->callback = [this, cur_op](osd_op_t *del_op)
+        {
+            osd_primary_op_data_t *op_data = cur_op->op_data;
+            if (del_op->reply.hdr.retval < 0)
+            {
+                printf(
+                    "Failed to delete object %lx:%lx in range delete: %ld (%s)\n", del_op->req.rw.inode,
+                    del_op->req.rw.offset, -del_op->reply.hdr.retval, strerror(-del_op->reply.hdr.retval)
+                );
+                if (del_op->reply.hdr.retval == -EPIPE)
+                    op_data->epipe++;
+                op_data->errors++;
+            }
+            else
+                op_data->done++;
+            delete del_op;
+            if (op_data->st == 3)
+            {
+                op_data->st = 2;
+                continue_primary_delete_range(cur_op);
+            }
+        };
+        op_data->del_pos++;
+        op_data->n_subops++;
+        // Deletes may complete synchronously, so don't resume from the callback while submitting
+        op_data->st = 2;
+        exec_op(del_op);
+    }
+    if (op_data->done + op_data->errors < op_data->n_subops)
+    {
+        op_data->st = 3;
+resume_3:
+        return;
+    }
+    free(op_data->del_objects);
+    op_data->del_objects = NULL;
+    if (op_data->errors > 0)
+    {
+        finish_op(cur_op, op_data->epipe > 0 ? -EPIPE : -EIO);
+        return;
     }
+    finish_op(cur_op, op_data->done);
 }
@@ -29,6 +29,8 @@ struct osd_primary_op_data_t
     osd_rmw_stripe_t *stripes;
     osd_op_t *subops = NULL;
     uint64_t *prev_set = NULL;
+    // OSD chosen by read balancing, if any
+    osd_num_t read_osd;
     pg_osd_set_state_t *object_state = NULL;
 
     union
@@ -54,6 +56,20 @@ struct osd_primary_op_data_t
             int chain_size;
             osd_chain_read_t *chain_reads;
             int chain_read_count;
+            // for merge: bitmap position to continue writing from
+            uint32_t merge_pos;
+        };
+        struct
+        {
+            // for delete_range
+            object_id *del_objects;
+            int del_count, del_pos;
+        };
+        struct
+        {
+            // for scrub: read results and versions of all copies, by role
+            int *scrub_retvals;
+            uint64_t *scrub_versions;
         };
     };
 };
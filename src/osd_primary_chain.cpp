@@ -3,11 +3,12 @@
 
 #include "osd_primary.h"
 #include "allocator.h"
+#include "buffer_pool.h"
 
 void osd_t::continue_chained_read(osd_op_t *cur_op)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
-    auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+    auto & pg = get_pg(INODE_POOL(op_data->oid.inode), op_data->pg_num);
     if (op_data->st == 1)
         goto resume_1;
     else if (op_data->st == 2)
@@ -45,10 +46,132 @@ resume_4:
         finish_op(cur_op, op_data->epipe > 0 ? -EPIPE : -EIO);
         return;
     }
+    if (cur_op->req.hdr.opcode == OSD_OP_READ)
+    {
+        check_copy_up(cur_op);
+    }
     send_chained_read_results(pg, cur_op);
+    if (cur_op->req.hdr.opcode == OSD_OP_MERGE)
+    {
+        // Write the result back into the object
+        op_data->st = 5;
+        continue_primary_merge(cur_op);
+        return;
+    }
     finish_op(cur_op, cur_op->req.rw.len);
 }
 
+void osd_t::continue_primary_merge(osd_op_t *cur_op)
+{
+    if (!cur_op->op_data && !prepare_primary_rw(cur_op))
+    {
+        return;
+    }
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (op_data->st == 5)
+        goto resume_5;
+    else if (op_data->st == 6)
+        goto resume_6;
+    else if (op_data->st == 7)
+        goto resume_7;
+    else if (op_data->st > 0)
+    {
+        continue_chained_read(cur_op);
+        return;
+    }
+    {
+        // Data of parents from other pools isn't available on this OSD
+        inode_t last_inode = op_data->chain_size > 0 ? op_data->read_chain[op_data->chain_size-1] : op_data->oid.inode;
+        auto inode_it = st_cli.inode_config.find(last_inode);
+        if (inode_it != st_cli.inode_config.end() && inode_it->second.parent_id &&
+            inode_it->second.parent_id != op_data->oid.inode)
+        {
+            finish_op(cur_op, -EINVAL);
+            return;
+        }
+    }
+    if (!op_data->chain_size)
+    {
+        // No parents, nothing to merge
+        finish_op(cur_op, 0);
+        return;
+    }
+    continue_chained_read(cur_op);
+    return;
+resume_5:
+    {
+        // Gather the merged object into a single buffer, skipping the bitmap
+        void *merge_buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.rw.len);
+        uint64_t pos = 0;
+        for (int i = 1; i < cur_op->iov.count; i++)
+        {
+            memcpy(merge_buf + pos, cur_op->iov.buf[i].iov_base, cur_op->iov.buf[i].iov_len);
+            pos += cur_op->iov.buf[i].iov_len;
+        }
+        assert(pos == cur_op->req.rw.len);
+        cur_op->iov.reset();
+        buffer_free(cur_op->buf);
+        cur_op->buf = merge_buf;
+        op_data->merge_pos = 0;
+    }
+resume_6:
+    {
+        // Write ranges present in parents, but missing in the object itself, one by one,
+        // using CAS so that concurrent client writes are never overwritten with older data
+        uint8_t *global_bitmap = (uint8_t*)op_data->stripes[0].bmp_buf;
+        uint8_t *own_bitmap = (uint8_t*)op_data->snapshot_bitmaps;
+        uint32_t end = cur_op->req.rw.len/bs_bitmap_granularity;
+        uint32_t start = op_data->merge_pos;
+        while (start < end && (!((global_bitmap[start>>3] >> (start&7)) & 1) || ((own_bitmap[start>>3] >> (start&7)) & 1)))
+            start++;
+        uint32_t cur = start;
+        while (cur < end && ((global_bitmap[cur>>3] >> (cur&7)) & 1) && !((own_bitmap[cur>>3] >> (cur&7)) & 1))
+            cur++;
+        if (start >= end)
+        {
+            finish_op(cur_op, 0);
+            return;
+        }
+        op_data->merge_pos = cur;
+        osd_op_t *write_op = new osd_op_t();
+        write_op->op_type = OSD_OP_OUT;
+        write_op->req = (osd_any_op_t){
+            .rw = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = 1,
+                    .opcode = OSD_OP_WRITE,
+                },
+                .inode = op_data->oid.inode,
+                .offset = op_data->oid.stripe + start*bs_bitmap_granularity,
+                .len = (cur-start)*bs_bitmap_granularity,
+                .version = cur_op->reply.rw.version+1,
+            },
+        };
+        // Points into cur_op->buf, so it's unset before deleting write_op
+        write_op->buf = cur_op->buf + start*bs_bitmap_granularity;
+        write_op->callback = [this, cur_op](osd_op_t *write_op)
+        {
+            int retval = write_op->reply.hdr.retval;
+            bool ok = retval == write_op->req.rw.len;
+            write_op->buf = NULL;
+            delete write_op;
+            if (!ok)
+            {
+                finish_op(cur_op, retval < 0 ? retval : -EIO);
+                return;
+            }
+            cur_op->reply.rw.version++;
+            cur_op->op_data->st = 6;
+            continue_primary_merge(cur_op);
+        };
+        op_data->st = 7;
+        exec_op(write_op);
+    }
+resume_7:
+    return;
+}
+
 int osd_t::read_bitmaps(osd_op_t *cur_op, pg_t & pg, int base_state)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
@@ -130,8 +253,14 @@ int osd_t::collect_bitmap_requests(osd_op_t *cur_op, pg_t & pg, std::vector<bitm
         uint64_t target_version = vo_it != pg.ver_override.end() ? vo_it->second : UINT64_MAX;
         pg_osd_set_state_t *object_state;
         uint64_t* cur_set = get_object_osd_set(pg, cur_oid, pg.cur_set.data(), &object_state);
+        // Bitmaps of parent layers are cached, the top layer is always read because its version is returned
+        bool cache = chain_num > 0 && layer_bitmap_cache_size > 0 && is_layer_bitmap_cacheable(pg, cur_oid);
         if (pg.scheme == POOL_SCHEME_REPLICATED)
         {
+            if (cache && get_cached_layer_bitmap(cur_oid, op_data->snapshot_bitmaps + chain_num*clean_entry_bitmap_size))
+            {
+                continue;
+            }
             osd_num_t read_target = 0;
             for (int i = 0; i < pg.pg_size; i++)
             {
@@ -147,6 +276,7 @@ int osd_t::collect_bitmap_requests(osd_op_t *cur_op, pg_t & pg, std::vector<bitm
                 .oid = cur_oid,
                 .version = target_version,
                 .bmp_buf = op_data->snapshot_bitmaps + chain_num*clean_entry_bitmap_size,
+                .cache = cache,
             });
         }
         else
@@ -161,7 +291,10 @@ int osd_t::collect_bitmap_requests(osd_op_t *cur_op, pg_t & pg, std::vector<bitm
             int need_at_least = 0;
             for (int i = 0; i < pg.pg_size; i++)
             {
-                if (local_stripes[i].read_end != 0 && cur_set[i] == 0)
+                object_id part_oid = { .inode = cur_oid.inode, .stripe = cur_oid.stripe | i };
+                void *bmp_buf = op_data->snapshot_bitmaps + (chain_num*pg.pg_size + i)*clean_entry_bitmap_size;
+                if (local_stripes[i].read_end != 0 && cur_set[i] == 0 &&
+                    !(cache && get_cached_layer_bitmap(part_oid, bmp_buf)))
                 {
                     // We need this part of the bitmap, but it's unavailable
                     need_at_least = pg.pg_data_size;
@@ -177,17 +310,21 @@ int osd_t::collect_bitmap_requests(osd_op_t *cur_op, pg_t & pg, std::vector<bitm
             {
                 if (cur_set[i] != 0 && (local_stripes[i].read_end != 0 || found < need_at_least))
                 {
+                    object_id part_oid = { .inode = cur_oid.inode, .stripe = cur_oid.stripe | i };
+                    void *bmp_buf = op_data->snapshot_bitmaps + (chain_num*pg.pg_size + i)*clean_entry_bitmap_size;
+                    found++;
+                    if (cache && get_cached_layer_bitmap(part_oid, bmp_buf))
+                    {
+                        continue;
+                    }
                     // Read part of the bitmap
                     bitmap_requests.push_back((bitmap_request_t){
                         .osd_num = cur_set[i],
-                        .oid = {
-                            .inode = cur_oid.inode,
-                            .stripe = cur_oid.stripe | i,
-                        },
+                        .oid = part_oid,
                         .version = target_version,
-                        .bmp_buf = op_data->snapshot_bitmaps + (chain_num*pg.pg_size + i)*clean_entry_bitmap_size,
+                        .bmp_buf = bmp_buf,
+                        .cache = cache,
                     });
-                    found++;
                 }
             }
             // Already checked by extend_missing_stripes, so it's fine to use assert
@@ -235,6 +372,10 @@ int osd_t::submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg)
                         (*bitmap_requests)[j].oid, (*bitmap_requests)[j].version, (*bitmap_requests)[j].bmp_buf,
                         (*bitmap_requests)[j].oid.inode == cur_op->req.rw.inode ? &cur_op->reply.rw.version : NULL
                     );
+                    if ((*bitmap_requests)[j].cache)
+                    {
+                        put_layer_bitmap((*bitmap_requests)[j].oid, (*bitmap_requests)[j].bmp_buf);
+                    }
                 }
             }
             else
@@ -260,16 +401,21 @@ int osd_t::submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg)
                 {
                     ov->oid = (*bitmap_requests)[j].oid;
                     ov->version = (*bitmap_requests)[j].version;
+                    if ((*bitmap_requests)[j].cache)
+                    {
+                        start_layer_bitmap_fetch((*bitmap_requests)[j].oid);
+                    }
                 }
                 subop->callback = [cur_op, bitmap_requests, prev, i, this](osd_op_t *subop)
                 {
                     int requested_count = subop->req.sec_read_bmp.len / sizeof(obj_ver_id);
-                    if (subop->reply.hdr.retval == requested_count * (8 + clean_entry_bitmap_size))
+                    bool success = subop->reply.hdr.retval == requested_count * (8 + clean_entry_bitmap_size);
+                    if (success)
                     {
                         void *cur_buf = subop->buf + 8;
                         for (int j = prev; j <= i; j++)
                         {
-                            memcpy((*bitmap_requests)[j].bmp_buf, cur_buf, clean_entry_bitmap_size);
+                            bitmap_copy((*bitmap_requests)[j].bmp_buf, cur_buf, clean_entry_bitmap_size);
                             if ((*bitmap_requests)[j].oid.inode == cur_op->req.rw.inode)
                             {
                                 memcpy(&cur_op->reply.rw.version, cur_buf-8, 8);
@@ -277,6 +423,13 @@ int osd_t::submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg)
                             cur_buf += 8 + clean_entry_bitmap_size;
                         }
                     }
+                    for (int j = prev; j <= i; j++)
+                    {
+                        if ((*bitmap_requests)[j].cache)
+                        {
+                            finish_layer_bitmap_fetch((*bitmap_requests)[j].oid, success ? (*bitmap_requests)[j].bmp_buf : NULL);
+                        }
+                    }
                     if ((cur_op->op_data->errors + cur_op->op_data->done + 1) >= cur_op->op_data->n_subops)
                     {
                         delete bitmap_requests;
@@ -296,6 +449,170 @@ int osd_t::submit_bitmap_subops(osd_op_t *cur_op, pg_t & pg)
     return 0;
 }
 
+// Bitmaps of objects being written or rolled back can't be cached
+bool osd_t::is_layer_bitmap_cacheable(pg_t & pg, const object_id & oid)
+{
+    if (pg.ver_override.find(oid) != pg.ver_override.end() || pg.write_queue.first(oid))
+    {
+        return false;
+    }
+    auto act_it = pg.flush_actions.lower_bound((obj_piece_id_t){ .oid = oid, .osd_num = 0 });
+    return act_it == pg.flush_actions.end() || act_it->first.oid.inode != oid.inode ||
+        (act_it->first.oid.stripe & ~STRIPE_MASK) != oid.stripe;
+}
+
+bool osd_t::get_cached_layer_bitmap(const object_id & oid, void *bmp_buf)
+{
+    auto it = layer_bitmaps.find(oid);
+    if (it == layer_bitmaps.end())
+    {
+        return false;
+    }
+    bitmap_copy(bmp_buf, it->second.data(), clean_entry_bitmap_size);
+    return true;
+}
+
+void osd_t::put_layer_bitmap(const object_id & oid, void *bmp_buf)
+{
+    if (layer_bitmaps.size() >= layer_bitmap_cache_size)
+    {
+        layer_bitmaps.clear();
+    }
+    layer_bitmaps[oid] = std::vector<uint8_t>((uint8_t*)bmp_buf, (uint8_t*)bmp_buf + clean_entry_bitmap_size);
+}
+
+void osd_t::start_layer_bitmap_fetch(const object_id & oid)
+{
+    layer_bitmap_fetches[oid].inflight++;
+}
+
+// <bmp_buf> is NULL if the bitmap wasn't read
+void osd_t::finish_layer_bitmap_fetch(const object_id & oid, void *bmp_buf)
+{
+    auto it = layer_bitmap_fetches.find(oid);
+    assert(it != layer_bitmap_fetches.end());
+    bool stale = it->second.stale;
+    if (!--it->second.inflight)
+    {
+        layer_bitmap_fetches.erase(it);
+    }
+    if (bmp_buf && !stale)
+    {
+        put_layer_bitmap(oid, bmp_buf);
+    }
+}
+
+// Called on writes, deletes and rollbacks of an object (with any role bits in <oid>)
+void osd_t::invalidate_layer_bitmaps(const object_id & oid)
+{
+    object_id first = { .inode = oid.inode, .stripe = oid.stripe & ~STRIPE_MASK };
+    if (layer_bitmaps.size())
+    {
+        auto it = layer_bitmaps.lower_bound(first), end = it;
+        while (end != layer_bitmaps.end() && end->first.inode == first.inode &&
+            (end->first.stripe & ~STRIPE_MASK) == first.stripe)
+        {
+            end++;
+        }
+        layer_bitmaps.erase(it, end);
+    }
+    for (auto it = layer_bitmap_fetches.lower_bound(first); it != layer_bitmap_fetches.end() &&
+        it->first.inode == first.inode && (it->first.stripe & ~STRIPE_MASK) == first.stripe; it++)
+    {
+        it->second.stale = true;
+    }
+}
+
+// Called on re-peering or stop of any PG: other OSDs may have been its primary in the meantime
+void osd_t::clear_layer_bitmaps()
+{
+    layer_bitmaps.clear();
+    for (auto & fetch: layer_bitmap_fetches)
+    {
+        fetch.second.stale = true;
+    }
+}
+
+// Objects of clones read from their parent layers <copy_up_reads> times are merged (OSD_OP_MERGE)
+// in the background, so that later reads don't go through the chain to the parents' OSDs
+void osd_t::check_copy_up(osd_op_t *cur_op)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (!copy_up_reads || readonly || copy_up_inflight.size() >= copy_up_queue_depth)
+    {
+        return;
+    }
+    bool from_parents = false;
+    for (int i = 0; i < op_data->chain_read_count; i++)
+    {
+        if (op_data->chain_reads[i].chain_pos > 0)
+            from_parents = true;
+    }
+    object_id oid = op_data->oid;
+    if (!from_parents || copy_up_inflight.find(oid) != copy_up_inflight.end())
+    {
+        return;
+    }
+    auto inode_it = st_cli.inode_config.find(oid.inode);
+    if (inode_it == st_cli.inode_config.end() || inode_it->second.readonly)
+    {
+        return;
+    }
+    // Parents from other pools can't be merged on this OSD, like in continue_primary_merge()
+    auto last_it = st_cli.inode_config.find(op_data->read_chain[op_data->chain_size-1]);
+    if (last_it != st_cli.inode_config.end() && last_it->second.parent_id &&
+        last_it->second.parent_id != oid.inode)
+    {
+        return;
+    }
+    if (copy_up_hits.size() >= COPY_UP_MAX_TRACKED)
+    {
+        copy_up_hits.clear();
+    }
+    if (++copy_up_hits[oid] < copy_up_reads)
+    {
+        return;
+    }
+    copy_up_hits.erase(oid);
+    copy_up_inflight.insert(oid);
+    osd_op_t *merge_op = new osd_op_t();
+    merge_op->op_type = OSD_OP_OUT;
+    merge_op->req = (osd_any_op_t){
+        .rw = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = 1,
+                .opcode = OSD_OP_MERGE,
+            },
+            .inode = oid.inode,
+            .offset = oid.stripe,
+            .len = 0,
+            // Parent chain is only resolved for requests with the current metadata revision
+            .meta_revision = inode_it->second.mod_revision,
+        },
+    };
+    merge_op->callback = [this, oid](osd_op_t *merge_op)
+    {
+        copy_up_inflight.erase(oid);
+        // -EINTR means that the object was modified during merge, it'll be retried after more reads
+        if (merge_op->reply.hdr.retval < 0 && merge_op->reply.hdr.retval != -EINTR)
+        {
+            copy_up_failed++;
+            if (log_level > 0)
+            {
+                printf("Failed to copy up object %lx:%lx from parent layers: %s\n",
+                    oid.inode, oid.stripe, strerror(-merge_op->reply.hdr.retval));
+            }
+        }
+        else if (merge_op->reply.hdr.retval >= 0)
+        {
+            copy_up_count++;
+        }
+        delete merge_op;
+    };
+    exec_op(merge_op);
+}
+
 std::vector<osd_chain_read_t> osd_t::collect_chained_read_requests(osd_op_t *cur_op)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
@@ -5,7 +5,7 @@
 
 void osd_t::autosync()
 {
-    // FIXME Autosync based on the number of unstable writes to prevent
+    // Also triggered by the number of unsynced writes (autosync_writes) to prevent
     // "journal_sector_buffer_count is too low for this batch" errors
     if (immediate_commit != IMMEDIATE_ALL && !autosync_op)
     {
@@ -26,6 +26,10 @@ void osd_t::autosync()
             {
                 printf("Warning: automatic sync resulted in an error: %ld (%s)\n", -op->reply.hdr.retval, strerror(-op->reply.hdr.retval));
             }
+            timespec tv_end;
+            clock_gettime(CLOCK_REALTIME, &tv_end);
+            autosync_count++;
+            autosync_usec += (tv_end.tv_sec - op->tv_begin.tv_sec)*1000000 + (tv_end.tv_nsec - op->tv_begin.tv_nsec)/1000;
             delete autosync_op;
             autosync_op = NULL;
         };
@@ -33,9 +37,26 @@ void osd_t::autosync()
     }
 }
 
+// Client syncs also sync all other writes of this OSD and clear dirty_osds, so the periodic
+// autosync is skipped if nothing was written after them. A recent client sync alone isn't enough:
+// writes made after it would otherwise stay unsynced for another interval
+void osd_t::periodic_autosync()
+{
+    if (!dirty_osds.size())
+    {
+        autosync_skipped++;
+        return;
+    }
+    autosync();
+}
+
 void osd_t::finish_op(osd_op_t *cur_op, int retval)
 {
     inflight_ops--;
+    if (cur_op->trace)
+    {
+        trace_finish(cur_op, retval);
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_DELETE)
@@ -63,7 +84,7 @@ void osd_t::finish_op(osd_op_t *cur_op, int retval)
     {
         if (cur_op->op_data->pg_num > 0)
         {
-            auto & pg = pgs.at({ .pool_id = INODE_POOL(cur_op->op_data->oid.inode), .pg_num = cur_op->op_data->pg_num });
+            auto & pg = get_pg(INODE_POOL(cur_op->op_data->oid.inode), cur_op->op_data->pg_num);
             pg.inflight--;
             assert(pg.inflight >= 0);
             if ((pg.state & PG_STOPPING) && pg.inflight == 0 && !pg.flush_batch)
@@ -81,6 +102,7 @@ void osd_t::finish_op(osd_op_t *cur_op, int retval)
     }
     if (!cur_op->peer_fd)
     {
+        cur_op->reply.hdr.retval = retval;
         // Copy lambda to be unaffected by `delete op`
         std::function<void(osd_op_t*)>(cur_op->callback)(cur_op);
     }
@@ -103,7 +125,15 @@ void osd_t::finish_op(osd_op_t *cur_op, int retval)
     }
 }
 
-void osd_t::submit_primary_subops(int submit_type, uint64_t op_version, const uint64_t* osd_set, osd_op_t *cur_op)
+// Internal primary operations without a client connection are recovery or rebalance
+uint32_t osd_t::get_bs_priority(osd_op_t *cur_op)
+{
+    if (cur_op->req.hdr.opcode == OSD_OP_SCRUB)
+        return BS_PRIO_SCRUB;
+    return cur_op->peer_fd ? BS_PRIO_CLIENT : BS_PRIO_RECOVERY;
+}
+
+void osd_t::submit_primary_subops(int submit_type, uint64_t op_version, const uint64_t* osd_set, osd_op_t *cur_op, int read_role)
 {
     bool wr = submit_type == SUBMIT_WRITE;
     osd_primary_op_data_t *op_data = cur_op->op_data;
@@ -119,25 +149,47 @@ void osd_t::submit_primary_subops(int submit_type, uint64_t op_version, const ui
             n_subops++;
     }
     if (!n_subops && (submit_type == SUBMIT_RMW_READ || rep))
+    {
         n_subops = 1;
+        if (read_role >= 0)
+            zero_read = read_role;
+    }
     else
         zero_read = -1;
+    // Large replicated writes may be sent only to the first remote replica which forwards
+    // them to the next one and so on, so that the primary sends the data only once
+    int pipeline_len = 0;
+    if (wr && rep && pipeline_replication_threshold > 0 &&
+        stripes[0].write_end - stripes[0].write_start >= pipeline_replication_threshold)
+    {
+        int remote = 0;
+        for (int role = 0; role < op_data->pg_size; role++)
+        {
+            if (osd_set[role] != 0 && osd_set[role] != this->osd_num)
+                remote++;
+        }
+        if (remote > 1 && remote-1 <= OSD_SEC_PIPELINE_MAX)
+            pipeline_len = remote-1;
+    }
+    // Subops for the rest of the pipeline are only sent if it breaks, but have their place reserved
     osd_op_t *subops = new osd_op_t[n_subops];
     op_data->fact_ver = 0;
     op_data->done = op_data->errors = 0;
-    op_data->n_subops = n_subops;
+    op_data->n_subops = n_subops-pipeline_len;
     op_data->subops = subops;
-    int sent = submit_primary_subop_batch(submit_type, op_data->oid.inode, op_version, op_data->stripes, osd_set, cur_op, 0, zero_read);
-    assert(sent == n_subops);
+    int sent = submit_primary_subop_batch(submit_type, op_data->oid.inode, op_version, op_data->stripes, osd_set, cur_op, 0, zero_read, pipeline_len);
+    assert(sent == n_subops-pipeline_len);
+    trace_stage(cur_op, OSD_TRACE_SUBOPS_SENT);
 }
 
 int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t op_version,
-    osd_rmw_stripe_t *stripes, const uint64_t* osd_set, osd_op_t *cur_op, int subop_idx, int zero_read)
+    osd_rmw_stripe_t *stripes, const uint64_t* osd_set, osd_op_t *cur_op, int subop_idx, int zero_read, int pipeline_len)
 {
     bool wr = submit_type == SUBMIT_WRITE;
     osd_primary_op_data_t *op_data = cur_op->op_data;
     bool rep = op_data->scheme == POOL_SCHEME_REPLICATED;
     int i = subop_idx;
+    bool pipeline_sent = false;
     for (int role = 0; role < op_data->pg_size; role++)
     {
         // We always submit zero-length writes to all replicas, even if the stripe is not modified
@@ -152,6 +204,8 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
             osd_op_t *subop = op_data->subops + i;
             if (role_osd_num == this->osd_num)
             {
+                // Subop arrays are recycled, don't let handle_primary_subop() see a stale request
+                memset(&subop->req, 0, sizeof(subop->req));
                 clock_gettime(CLOCK_REALTIME, &subop->tv_begin);
                 subop->op_type = (uint64_t)cur_op;
                 subop->bitmap = stripes[stripe_num].bmp_buf;
@@ -171,6 +225,8 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     .len = wr ? stripes[stripe_num].write_end - stripes[stripe_num].write_start : stripes[stripe_num].read_end - stripes[stripe_num].read_start,
                     .buf = wr ? stripes[stripe_num].write_buf : stripes[stripe_num].read_buf,
                     .bitmap = stripes[stripe_num].bmp_buf,
+                    .priority = get_bs_priority(cur_op),
+                    .trace = cur_op->trace ? &cur_op->trace->bs : NULL,
                 });
 #ifdef OSD_DEBUG
                 printf(
@@ -181,10 +237,16 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
 #endif
                 bs->enqueue_op(subop->bs_op);
             }
+            else if (pipeline_sent)
+            {
+                // The write is forwarded to this OSD by the previous one
+                continue;
+            }
             else
             {
                 subop->op_type = OSD_OP_OUT;
-                subop->peer_fd = msgr.osd_peer_fds.at(role_osd_num);
+                subop->peer_fd = msgr.get_peer_fd(role_osd_num, inode ^ op_data->oid.stripe);
+                subop->trace_id = cur_op->trace_id;
                 subop->bitmap = stripes[stripe_num].bmp_buf;
                 subop->bitmap_len = clean_entry_bitmap_size;
                 subop->req.sec_rw = {
@@ -201,7 +263,19 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     .offset = wr ? stripes[stripe_num].write_start : stripes[stripe_num].read_start,
                     .len = wr ? stripes[stripe_num].write_end - stripes[stripe_num].write_start : stripes[stripe_num].read_end - stripes[stripe_num].read_start,
                     .attr_len = wr ? clean_entry_bitmap_size : 0,
+                    .priority = get_bs_priority(cur_op),
                 };
+                if (pipeline_len > 0)
+                {
+                    int pos = 0;
+                    for (int next_role = role+1; next_role < op_data->pg_size; next_role++)
+                    {
+                        if (osd_set[next_role] != 0 && osd_set[next_role] != this->osd_num)
+                            subop->req.sec_rw.pipeline[pos++] = osd_set[next_role];
+                    }
+                    assert(pos == pipeline_len);
+                    pipeline_sent = true;
+                }
 #ifdef OSD_DEBUG
                 printf(
                     "Submit %s to osd %lu: %lx:%lx v%lu %u-%u\n", wr ? "write" : "read", role_osd_num,
@@ -227,7 +301,7 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                 {
                     handle_primary_subop(subop, cur_op);
                 };
-                msgr.outbox_push(subop);
+                queue_subop(subop);
             }
             i++;
         }
@@ -289,10 +363,12 @@ void osd_t::add_bs_subop_stats(osd_op_t *subop)
         msgr.stats.op_stat_sum[opcode] = 0;
         msgr.stats.op_stat_bytes[opcode] = 0;
     }
-    msgr.stats.op_stat_sum[opcode] += (
+    uint64_t usec = (
         (tv_end.tv_sec - subop->tv_begin.tv_sec)*1000000 +
         (tv_end.tv_nsec - subop->tv_begin.tv_nsec)/1000
     );
+    msgr.stats.op_stat_sum[opcode] += usec;
+    msgr.stats.op_stat_hist[opcode].add(usec);
     if (opcode == OSD_OP_SEC_READ || opcode == OSD_OP_SEC_WRITE)
     {
         msgr.stats.op_stat_bytes[opcode] += subop->bs_op->len;
@@ -311,6 +387,18 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
     else
         expected = 0;
     osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (op_data->read_osd && opcode == OSD_OP_SEC_READ)
+    {
+        finish_balanced_read(subop, cur_op);
+    }
+    bool scrub = cur_op->req.hdr.opcode == OSD_OP_SCRUB;
+    if (scrub)
+    {
+        // Scrub subops are submitted one per role, see submit_scrub_subops()
+        int role = subop - op_data->subops;
+        op_data->scrub_retvals[role] = retval;
+        op_data->scrub_versions[role] = retval == expected ? subop->reply.sec_rw.version : 0;
+    }
     if (retval != expected)
     {
         printf("%s subop failed: retval = %d (expected %d)\n", osd_op_names[opcode], retval, expected);
@@ -319,7 +407,8 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
             op_data->epipe++;
         }
         op_data->errors++;
-        if (subop->peer_fd >= 0)
+        // Read errors of single copies are what scrub looks for, don't drop the connection
+        if (subop->peer_fd >= 0 && (!scrub || retval == -EPIPE || retval >= 0))
         {
             // Drop connection on any error
             msgr.stop_client(subop->peer_fd);
@@ -347,33 +436,317 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
                 }
                 op_data->fact_ver = version;
             }
+            if (subop->peer_fd >= 0 && opcode != OSD_OP_SEC_READ && subop->req.sec_rw.pipeline[0])
+            {
+                submit_pipeline_fallback(subop, cur_op);
+            }
         }
     }
+    if (cur_op->trace)
+    {
+        trace_subop_done(cur_op, subop);
+    }
     if ((op_data->errors + op_data->done) >= op_data->n_subops)
     {
+        trace_stage(cur_op, opcode == OSD_OP_SEC_SYNC || opcode == OSD_OP_SEC_STABILIZE
+            ? OSD_TRACE_SYNC_DONE : OSD_TRACE_SUBOPS_DONE);
         delete[] op_data->subops;
         op_data->subops = NULL;
         op_data->st++;
-        if (cur_op->req.hdr.opcode == OSD_OP_READ)
+        continue_primary_op(cur_op);
+    }
+}
+
+// Write directly to the replicas which the pipelined write didn't reach
+void osd_t::submit_pipeline_fallback(osd_op_t *subop, osd_op_t *cur_op)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    int pipeline_len = 0;
+    while (pipeline_len < OSD_SEC_PIPELINE_MAX && subop->req.sec_rw.pipeline[pipeline_len])
+        pipeline_len++;
+    int pos = subop->reply.sec_rw.pipeline_done;
+    if (pos >= pipeline_len)
+    {
+        return;
+    }
+    for (; pos < pipeline_len; pos++)
+    {
+        osd_num_t peer_osd = subop->req.sec_rw.pipeline[pos];
+        // Places for these subops are reserved by submit_primary_subops()
+        osd_op_t *direct = op_data->subops + op_data->n_subops;
+        op_data->n_subops++;
+        if (msgr.osd_peer_fds.find(peer_osd) == msgr.osd_peer_fds.end())
+        {
+            // The PG is repeered when an OSD peer disconnects
+            op_data->errors++;
+            op_data->epipe++;
+            continue;
+        }
+        direct->op_type = OSD_OP_OUT;
+        direct->peer_fd = msgr.get_peer_fd(peer_osd, subop->req.sec_rw.oid.inode ^ (subop->req.sec_rw.oid.stripe & ~STRIPE_MASK));
+        direct->trace_id = cur_op->trace_id;
+        direct->bitmap = subop->bitmap;
+        direct->bitmap_len = subop->bitmap_len;
+        direct->req.sec_rw = subop->req.sec_rw;
+        direct->req.sec_rw.header.id = msgr.next_subop_id++;
+        memset(direct->req.sec_rw.pipeline, 0, sizeof(direct->req.sec_rw.pipeline));
+        for (int i = 0; i < subop->iov.count; i++)
+        {
+            direct->iov.push_back(subop->iov.buf[i].iov_base, subop->iov.buf[i].iov_len);
+        }
+        direct->callback = [cur_op, this](osd_op_t *direct)
+        {
+            handle_primary_subop(direct, cur_op);
+        };
+        msgr.outbox_push(direct);
+    }
+}
+
+// Small reads and writes to the same peer are collected during one event loop iteration
+// and sent in one OSD_OP_SEC_BATCH to save per-operation overhead, mostly during recovery
+void osd_t::queue_subop(osd_op_t *subop)
+{
+    if (subop_batch_max <= 1 || subop->req.sec_rw.len > OSD_SEC_BATCH_ITEM_MAX ||
+        subop->req.sec_rw.pipeline[0])
+    {
+        msgr.outbox_push(subop);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &subop->tv_begin);
+    int peer_fd = subop->peer_fd;
+    bool rd = subop->req.hdr.opcode == OSD_OP_SEC_READ;
+    uint64_t desc_len = sizeof(osd_sec_batch_item_t) + (rd ? 0 : subop->req.sec_rw.attr_len);
+    uint64_t data_len = rd ? 0 : subop->req.sec_rw.len;
+    uint64_t reply_len = sizeof(osd_sec_batch_result_t) + (rd ? subop->bitmap_len + subop->req.sec_rw.len : 0);
+    auto & batch = subop_batches[peer_fd];
+    // Descriptors and results are padded to MEM_ALIGNMENT, leave room for it
+    if (batch.subops.size() > 0 && (batch.desc_len+desc_len > OSD_RW_MAX-MEM_ALIGNMENT ||
+        batch.data_len+data_len > OSD_RW_MAX || batch.reply_len+reply_len > OSD_RW_MAX-MEM_ALIGNMENT))
+    {
+        std::vector<osd_op_t*> subops;
+        subops.swap(batch.subops);
+        batch = osd_subop_batch_t();
+        send_subop_batch(peer_fd, subops);
+    }
+    batch.subops.push_back(subop);
+    batch.desc_len += desc_len;
+    batch.data_len += data_len;
+    batch.reply_len += reply_len;
+    if (batch.subops.size() >= subop_batch_max)
+    {
+        std::vector<osd_op_t*> subops;
+        subops.swap(batch.subops);
+        subop_batches.erase(peer_fd);
+        send_subop_batch(peer_fd, subops);
+    }
+    else if (batch.subops.size() == 1)
+    {
+        // Make sure that loop() runs and sends it
+        ringloop->wakeup();
+    }
+}
+
+void osd_t::flush_subop_batches()
+{
+    if (!subop_batches.size())
+    {
+        return;
+    }
+    std::map<int, osd_subop_batch_t> batches;
+    batches.swap(subop_batches);
+    for (auto & bp: batches)
+    {
+        send_subop_batch(bp.first, bp.second.subops);
+    }
+}
+
+// The connection is stopped, so its FD number may be reused by another peer before the batch is sent
+void osd_t::cancel_subop_batch(int peer_fd)
+{
+    auto batch_it = subop_batches.find(peer_fd);
+    if (batch_it == subop_batches.end())
+    {
+        return;
+    }
+    std::vector<osd_op_t*> subops;
+    subops.swap(batch_it->second.subops);
+    subop_batches.erase(batch_it);
+    for (auto subop: subops)
+    {
+        subop->reply.hdr.retval = -EPIPE;
+        // Copy lambda to be unaffected by `delete subop`
+        std::function<void(osd_op_t*)>(subop->callback)(subop);
+    }
+}
+
+void osd_t::send_subop_batch(int peer_fd, std::vector<osd_op_t*> & subops)
+{
+    auto cl_it = msgr.clients.find(peer_fd);
+    if (cl_it == msgr.clients.end() || cl_it->second->peer_state == PEER_STOPPED)
+    {
+        // The peer disconnected before the batch was sent
+        for (auto subop: subops)
         {
-            continue_primary_read(cur_op);
+            subop->reply.hdr.retval = -EPIPE;
+            // Copy lambda to be unaffected by `delete subop`
+            std::function<void(osd_op_t*)>(subop->callback)(subop);
         }
-        else if (cur_op->req.hdr.opcode == OSD_OP_WRITE)
+        return;
+    }
+    if (subops.size() == 1)
+    {
+        msgr.outbox_push(subops[0]);
+        return;
+    }
+    uint64_t count = subops.size();
+    uint64_t desc_len = count*sizeof(osd_sec_batch_item_t), data_len = 0;
+    for (auto subop: subops)
+    {
+        if (subop->req.hdr.opcode != OSD_OP_SEC_READ)
         {
-            continue_primary_write(cur_op);
+            desc_len += subop->req.sec_rw.attr_len;
+            data_len += subop->req.sec_rw.len;
         }
-        else if (cur_op->req.hdr.opcode == OSD_OP_SYNC)
+    }
+    // Keep write data aligned for the blockstore
+    desc_len = ((desc_len + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT) * MEM_ALIGNMENT;
+    osd_op_t *batch = new osd_op_t();
+    batch->op_type = OSD_OP_OUT;
+    batch->peer_fd = peer_fd;
+    batch->buf = memalign_or_die(MEM_ALIGNMENT, desc_len);
+    memset(batch->buf, 0, desc_len);
+    batch->req.sec_batch = {
+        .header = {
+            .magic = SECONDARY_OSD_OP_MAGIC,
+            .id = msgr.next_subop_id++,
+            .opcode = OSD_OP_SEC_BATCH,
+        },
+        .count = count,
+        .desc_len = desc_len,
+        .data_len = data_len,
+    };
+    osd_sec_batch_item_t *items = (osd_sec_batch_item_t*)batch->buf;
+    void *bmp = batch->buf + count*sizeof(osd_sec_batch_item_t);
+    batch->iov.push_back(batch->buf, desc_len);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        osd_op_t *subop = subops[i];
+        bool rd = subop->req.hdr.opcode == OSD_OP_SEC_READ;
+        items[i] = (osd_sec_batch_item_t){
+            .opcode = (uint32_t)subop->req.hdr.opcode,
+            .priority = subop->req.sec_rw.priority,
+            .oid = subop->req.sec_rw.oid,
+            .version = subop->req.sec_rw.version,
+            .offset = subop->req.sec_rw.offset,
+            .len = subop->req.sec_rw.len,
+            .attr_len = rd ? (uint32_t)subop->bitmap_len : subop->req.sec_rw.attr_len,
+        };
+        if (!rd)
         {
-            continue_primary_sync(cur_op);
+            memcpy(bmp, subop->bitmap, subop->req.sec_rw.attr_len);
+            bmp += subop->req.sec_rw.attr_len;
+            for (int j = 0; j < subop->iov.count; j++)
+            {
+                batch->iov.push_back(subop->iov.buf[j].iov_base, subop->iov.buf[j].iov_len);
+            }
         }
-        else if (cur_op->req.hdr.opcode == OSD_OP_DELETE)
+    }
+    batch->callback = [this, subops](osd_op_t *batch)
+    {
+        handle_subop_batch(batch, subops);
+    };
+    msgr.outbox_push(batch);
+}
+
+// Pass results and read data of a batch to its subops as if they were sent separately
+void osd_t::handle_subop_batch(osd_op_t *batch, const std::vector<osd_op_t*> & subops)
+{
+    uint64_t count = subops.size();
+    uint64_t res_len = count*sizeof(osd_sec_batch_result_t), read_len = 0;
+    for (auto subop: subops)
+    {
+        if (subop->req.hdr.opcode == OSD_OP_SEC_READ)
         {
-            continue_primary_del(cur_op);
+            res_len += subop->bitmap_len;
+            read_len += subop->req.sec_rw.len;
         }
-        else
+    }
+    res_len = ((res_len + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT) * MEM_ALIGNMENT;
+    int64_t batch_retval = batch->reply.hdr.retval;
+    if (batch_retval >= 0 && batch_retval != res_len+read_len)
+    {
+        printf("sec_batch subop returned %ld bytes instead of %lu\n", batch_retval, res_len+read_len);
+        batch_retval = -EIO;
+    }
+    osd_sec_batch_result_t *results = (osd_sec_batch_result_t*)batch->buf;
+    void *rd_bmp = batch->buf + count*sizeof(osd_sec_batch_result_t);
+    void *rd_data = batch->buf + res_len;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        osd_op_t *subop = subops[i];
+        bool rd = subop->req.hdr.opcode == OSD_OP_SEC_READ;
+        subop->reply.hdr = (osd_reply_header_t){
+            .magic = SECONDARY_OSD_REPLY_MAGIC,
+            .id = subop->req.hdr.id,
+            .opcode = subop->req.hdr.opcode,
+            .retval = batch_retval < 0 ? batch_retval : results[i].retval,
+        };
+        if (batch_retval >= 0)
         {
-            throw std::runtime_error("BUG: unknown opcode");
+            subop->reply.sec_rw.version = results[i].version;
+            if (rd && results[i].retval >= 0)
+            {
+                subop->reply.sec_rw.attr_len = subop->bitmap_len;
+                memcpy(subop->bitmap, rd_bmp, subop->bitmap_len);
+                void *pos = rd_data;
+                for (int j = 0; j < subop->iov.count; j++)
+                {
+                    memcpy(subop->iov.buf[j].iov_base, pos, subop->iov.buf[j].iov_len);
+                    pos += subop->iov.buf[j].iov_len;
+                }
+            }
+            if (rd)
+            {
+                rd_bmp += subop->bitmap_len;
+                rd_data += subop->req.sec_rw.len;
+            }
         }
+        // Copy lambda to be unaffected by `delete subop`
+        std::function<void(osd_op_t*)>(subop->callback)(subop);
+    }
+    delete batch;
+}
+
+// Resume a primary operation after its subops or after waiting in the PG write queue
+void osd_t::continue_primary_op(osd_op_t *cur_op)
+{
+    if (cur_op->req.hdr.opcode == OSD_OP_READ)
+    {
+        continue_primary_read(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_WRITE)
+    {
+        continue_primary_write(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SYNC)
+    {
+        continue_primary_sync(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_DELETE)
+    {
+        continue_primary_del(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_MERGE)
+    {
+        continue_primary_merge(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SCRUB)
+    {
+        continue_primary_scrub(cur_op);
+    }
+    else
+    {
+        throw std::runtime_error("BUG: unknown opcode");
     }
 }
 
@@ -459,13 +832,16 @@ void osd_t::submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_
                 },
                 .oid = chunk.oid,
                 .version = chunk.version,
+                .priority = get_bs_priority(cur_op),
+                .trace = cur_op->trace ? &cur_op->trace->bs : NULL,
             });
             bs->enqueue_op(subops[i].bs_op);
         }
         else
         {
             subops[i].op_type = OSD_OP_OUT;
-            subops[i].peer_fd = msgr.osd_peer_fds.at(chunk.osd_num);
+            subops[i].peer_fd = msgr.get_peer_fd(chunk.osd_num, chunk.oid.inode ^ (chunk.oid.stripe & ~STRIPE_MASK));
+            subops[i].trace_id = cur_op->trace_id;
             subops[i].req = (osd_any_op_t){ .sec_del = {
                 .header = {
                     .magic = SECONDARY_OSD_OP_MAGIC,
@@ -506,6 +882,7 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
                 {
                     handle_primary_bs_subop(subop);
                 },
+                .trace = cur_op->trace ? &cur_op->trace->bs : NULL,
             });
             bs->enqueue_op(subops[i].bs_op);
         }
@@ -513,6 +890,7 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
         {
             subops[i].op_type = OSD_OP_OUT;
             subops[i].peer_fd = peer_it->second;
+            subops[i].trace_id = cur_op->trace_id;
             subops[i].req = (osd_any_op_t){ .sec_sync = {
                 .header = {
                     .magic = SECONDARY_OSD_OP_MAGIC,
@@ -537,6 +915,7 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
         op_data->subops = NULL;
         return 0;
     }
+    trace_stage(cur_op, OSD_TRACE_SYNC_SENT);
     return 1;
 }
 
@@ -563,6 +942,7 @@ void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
                 },
                 .len = (uint32_t)stab_osd.len,
                 .buf = (void*)(op_data->unstable_writes + stab_osd.start),
+                .trace = cur_op->trace ? &cur_op->trace->bs : NULL,
             });
             bs->enqueue_op(subops[i].bs_op);
         }
@@ -570,6 +950,7 @@ void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
         {
             subops[i].op_type = OSD_OP_OUT;
             subops[i].peer_fd = msgr.osd_peer_fds.at(stab_osd.osd_num);
+            subops[i].trace_id = cur_op->trace_id;
             subops[i].req = (osd_any_op_t){ .sec_stab = {
                 .header = {
                     .magic = SECONDARY_OSD_OP_MAGIC,
@@ -586,33 +967,27 @@ void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
             msgr.outbox_push(&subops[i]);
         }
     }
+    trace_stage(cur_op, OSD_TRACE_SYNC_SENT);
 }
 
 void osd_t::pg_cancel_write_queue(pg_t & pg, osd_op_t *first_op, object_id oid, int retval)
 {
-    auto st_it = pg.write_queue.find(oid), it = st_it;
-    if (it == pg.write_queue.end() || it->second != first_op)
+    // A failed write may be applied only on some OSDs
+    pg.log_change(oid, peering_log_size);
+    if (pg.write_queue.first(oid) != first_op)
     {
         // Write queue doesn't match the first operation.
         // first_op is a leftover operation from the previous peering of the same PG.
         finish_op(first_op, retval);
         return;
     }
+    // First erase them and then run finish_op() for the sake of reenterability
+    // Calling finish_op() on a live iterator previously triggered a bug where some
+    // of the OSDs were looping infinitely if you stopped all of them with kill -INT during recovery
     std::vector<osd_op_t*> cancel_ops;
-    while (it != pg.write_queue.end() && it->first == oid)
+    pg.write_queue.pop_all(oid, cancel_ops);
+    for (auto op: cancel_ops)
     {
-        cancel_ops.push_back(it->second);
-        it++;
-    }
-    if (st_it != it)
-    {
-        // First erase them and then run finish_op() for the sake of reenterability
-        // Calling finish_op() on a live iterator previously triggered a bug where some
-        // of the OSDs were looping infinitely if you stopped all of them with kill -INT during recovery
-        pg.write_queue.erase(st_it, it);
-        for (auto op: cancel_ops)
-        {
-            finish_op(op, retval);
-        }
+        finish_op(op, retval);
     }
 }
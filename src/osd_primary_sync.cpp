@@ -34,6 +34,7 @@ resume_1:
         syncs_in_progress.push_back(cur_op);
     }
 resume_2:
+    trace_stage(cur_op, OSD_TRACE_START);
     if (dirty_osds.size() == 0)
     {
         // Nothing to sync
@@ -46,38 +47,14 @@ resume_2:
     {
         op_data->unstable_write_osds = new std::vector<unstable_osd_num_t>();
         op_data->unstable_writes = new obj_ver_id[this->unstable_writes.size()];
-        osd_num_t last_osd = 0;
-        int last_start = 0, last_end = 0;
-        for (auto it = this->unstable_writes.begin(); it != this->unstable_writes.end(); it++)
-        {
-            if (last_osd != it->first.osd_num)
-            {
-                if (last_osd != 0)
-                {
-                    op_data->unstable_write_osds->push_back((unstable_osd_num_t){
-                        .osd_num = last_osd,
-                        .start = last_start,
-                        .len = last_end - last_start,
-                    });
-                }
-                last_osd = it->first.osd_num;
-                last_start = last_end;
-            }
-            op_data->unstable_writes[last_end] = (obj_ver_id){
-                .oid = it->first.oid,
-                .version = it->second,
-            };
-            last_end++;
-        }
-        if (last_osd != 0)
+        this->unstable_writes.drain(op_data->unstable_writes, [&](osd_num_t osd_num, int start, int len)
         {
             op_data->unstable_write_osds->push_back((unstable_osd_num_t){
-                .osd_num = last_osd,
-                .start = last_start,
-                .len = last_end - last_start,
+                .osd_num = osd_num,
+                .start = start,
+                .len = len,
             });
-        }
-        this->unstable_writes.clear();
+        });
     }
     {
         void *dirty_buf = malloc_or_die(
@@ -121,6 +98,7 @@ resume_2:
             op_data->dirty_osds[dpg++] = osd_num;
         }
         dirty_osds.clear();
+        unsynced_writes = 0;
     }
     if (immediate_commit != IMMEDIATE_ALL)
     {
@@ -166,18 +144,14 @@ resume_6:
                 for (int i = 0; i < unstable_osd.len; i++)
                 {
                     // Except those from peered PGs
-                    auto & w = op_data->unstable_writes[i];
+                    auto & w = op_data->unstable_writes[unstable_osd.start + i];
                     pool_pg_num_t wpg = {
                         .pool_id = INODE_POOL(w.oid.inode),
                         .pg_num = map_to_pg(w.oid, st_cli.pool_config.at(INODE_POOL(w.oid.inode)).pg_stripe_size),
                     };
                     if (pgs.at(wpg).state & PG_ACTIVE)
                     {
-                        uint64_t & dest = this->unstable_writes[(osd_object_id_t){
-                            .osd_num = unstable_osd.osd_num,
-                            .oid = w.oid,
-                        }];
-                        dest = dest < w.version ? w.version : dest;
+                        this->unstable_writes.set_max(unstable_osd.osd_num, w.oid, w.version);
                         dirty_pgs.insert(wpg);
                     }
                 }
@@ -7,6 +7,8 @@
 bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
+    // The object may be a parent layer of some image
+    invalidate_layer_bitmaps(op_data->oid);
     // Check if actions are pending for this object
     auto act_it = pg.flush_actions.lower_bound((obj_piece_id_t){
         .oid = op_data->oid,
@@ -16,18 +18,20 @@ bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
         act_it->first.oid.inode == op_data->oid.inode &&
         (act_it->first.oid.stripe & ~STRIPE_MASK) == op_data->oid.stripe)
     {
-        pg.write_queue.emplace(op_data->oid, cur_op);
+        pg.write_queue.push(op_data->oid, cur_op);
         return false;
     }
+    if (pg.state != PG_ACTIVE)
+    {
+        // The write may leave the object in different states on different OSDs
+        pg.log_change(op_data->oid, peering_log_size);
+    }
     // Check if there are other write requests to the same object
-    auto vo_it = pg.write_queue.find(op_data->oid);
-    if (vo_it != pg.write_queue.end())
+    if (!pg.write_queue.push(op_data->oid, cur_op))
     {
         op_data->st = 1;
-        pg.write_queue.emplace(op_data->oid, cur_op);
         return false;
     }
-    pg.write_queue.emplace(op_data->oid, cur_op);
     return true;
 }
 
@@ -38,7 +42,7 @@ void osd_t::continue_primary_write(osd_op_t *cur_op)
         return;
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
-    auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+    auto & pg = get_pg(INODE_POOL(op_data->oid.inode), op_data->pg_num);
     if (op_data->st == 1)      goto resume_1;
     else if (op_data->st == 2) goto resume_2;
     else if (op_data->st == 3) goto resume_3;
@@ -55,10 +59,16 @@ void osd_t::continue_primary_write(osd_op_t *cur_op)
         return;
     }
 resume_1:
+    trace_stage(cur_op, OSD_TRACE_START);
     // Determine blocks to read and write
     // Missing chunks are allowed to be overwritten even in incomplete objects
     // FIXME: Allow to do small writes to the old (degraded/misplaced) OSD set for lower performance impact
     op_data->prev_set = get_object_osd_set(pg, op_data->oid, pg.cur_set.data(), &op_data->object_state);
+    if (op_data->scheme == POOL_SCHEME_REPLICATED && (cur_op->req.rw.flags & OSD_WRITE_PARITY))
+    {
+        cur_op->reply.hdr.retval = -EINVAL;
+        goto continue_others;
+    }
     if (op_data->scheme == POOL_SCHEME_REPLICATED)
     {
         // Simplified algorithm
@@ -84,6 +94,15 @@ resume_1:
             cur_op->reply.hdr.retval = -EINVAL;
             goto continue_others;
         }
+        if ((cur_op->req.rw.flags & OSD_WRITE_PARITY) &&
+            (cur_op->req.rw.offset != op_data->oid.stripe ||
+            cur_op->req.rw.len != op_data->pg_data_size*bs_block_size ||
+            cur_op->req.rw.parity_len != (pg.pg_size-op_data->pg_data_size)*bs_block_size))
+        {
+            // Parity from the client is only accepted for whole-object writes to EC/XOR pools
+            cur_op->reply.hdr.retval = -EINVAL;
+            goto continue_others;
+        }
     }
     // Read required blocks
     submit_primary_subops(SUBMIT_RMW_READ, UINT64_MAX, op_data->prev_set, cur_op);
@@ -127,8 +146,31 @@ resume_3:
         // For EC/XOR pools, save version override to make it impossible
         // for parallel reads to read different versions of data and parity
         pg.ver_override[op_data->oid] = op_data->fact_ver;
+        if (cur_op->req.rw.flags & OSD_WRITE_PARITY)
+        {
+            // Whole object is overwritten and parity is calculated by the client,
+            // only calculate parity bitmaps
+            void *parity_bmps[pg.pg_size-op_data->pg_data_size];
+            for (int role = 0; role < pg.pg_size; role++)
+            {
+                if (role < op_data->pg_data_size)
+                {
+                    bitmap_set(op_data->stripes[role].bmp_buf, 0, bs_block_size, bs_bitmap_granularity);
+                    continue;
+                }
+                op_data->stripes[role].write_buf = cur_op->buf + cur_op->req.rw.len +
+                    (role-op_data->pg_data_size)*bs_block_size;
+                op_data->stripes[role].write_start = 0;
+                op_data->stripes[role].write_end = bs_block_size;
+                parity_bmps[role-op_data->pg_data_size] = op_data->stripes[role].bmp_buf;
+            }
+            if (pg.scheme == POOL_SCHEME_XOR)
+                calc_full_parity_xor(op_data->stripes, pg.pg_size, NULL, parity_bmps, 0, clean_entry_bitmap_size);
+            else
+                calc_full_parity_jerasure(op_data->stripes, pg.pg_size, op_data->pg_data_size, NULL, parity_bmps, 0, clean_entry_bitmap_size);
+        }
         // Recover missing stripes, calculate parity
-        if (pg.scheme == POOL_SCHEME_XOR)
+        else if (pg.scheme == POOL_SCHEME_XOR)
         {
             calc_rmw_parity_xor(op_data->stripes, pg.pg_size, op_data->prev_set, pg.cur_set.data(), bs_block_size, clean_entry_bitmap_size);
         }
@@ -264,20 +306,16 @@ resume_9:
     cur_op->reply.rw.version = op_data->fact_ver;
 continue_others:
     osd_op_t *next_op = NULL;
-    auto next_it = pg.write_queue.find(op_data->oid);
     // Remove the operation from queue before calling finish_op so it doesn't see the completed operation in queue
-    if (next_it != pg.write_queue.end() && next_it->second == cur_op)
+    if (pg.write_queue.first(op_data->oid) == cur_op)
     {
-        pg.write_queue.erase(next_it++);
-        if (next_it != pg.write_queue.end() && next_it->first == op_data->oid)
-            next_op = next_it->second;
+        next_op = pg.write_queue.pop(op_data->oid);
     }
-    // finish_op would invalidate next_it if it cleared pg.write_queue, but it doesn't do that :)
     finish_op(cur_op, cur_op->reply.hdr.retval);
     if (next_op)
     {
         // Continue next write to the same object
-        continue_primary_write(next_op);
+        continue_primary_op(next_op);
     }
 }
 
@@ -359,13 +397,10 @@ lazy:
             for (auto & chunk: loc_set)
             {
                 this->dirty_osds.insert(chunk.osd_num);
-                this->unstable_writes[(osd_object_id_t){
-                    .osd_num = chunk.osd_num,
-                    .oid = {
-                        .inode = op_data->oid.inode,
-                        .stripe = op_data->oid.stripe | chunk.role,
-                    },
-                }] = op_data->fact_ver;
+                this->unstable_writes.set(chunk.osd_num, (object_id){
+                    .inode = op_data->oid.inode,
+                    .stripe = op_data->oid.stripe | chunk.role,
+                }, op_data->fact_ver);
             }
         }
         else
@@ -376,6 +411,12 @@ lazy:
                 this->dirty_osds.insert(chunk.osd_num);
             }
         }
+        // Sync in smaller batches instead of a huge one every autosync_interval
+        unsynced_writes++;
+        if (autosync_writes && unsynced_writes >= autosync_writes)
+        {
+            autosync();
+        }
         // Remember PG as dirty to drop the connection when PG goes offline
         // (this is required because of the "lazy sync")
         auto cl_it = msgr.clients.find(cur_op->peer_fd);
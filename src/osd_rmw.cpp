@@ -6,11 +6,16 @@
 #include <assert.h>
 #include <jerasure/reed_sol.h>
 #include <jerasure.h>
+#ifdef WITH_ISAL
+#include <isa-l/erasure_code.h>
+#endif
 #include <map>
+#include <list>
 #include "allocator.h"
 #include "xor.h"
 #include "osd_rmw.h"
 #include "malloc_or_die.h"
+#include "buffer_pool.h"
 
 #define OSD_JERASURE_W 8
 
@@ -84,44 +89,28 @@ void split_stripes(uint64_t pg_minsize, uint32_t bs_block_size, uint32_t start,
 
 void reconstruct_stripes_xor(osd_rmw_stripe_t *stripes, int pg_size, uint32_t bitmap_size)
 {
+    const void *srcs[pg_size], *bmp_srcs[pg_size];
     for (int role = 0; role < pg_size; role++)
     {
         if (stripes[role].read_end != 0 && stripes[role].missing)
         {
-            // Reconstruct missing stripe (XOR k+1)
-            int prev = -2;
+            // Reconstruct missing stripe (XOR k+1) in a single pass
+            int n = 0;
             for (int other = 0; other < pg_size; other++)
             {
                 if (other != role)
                 {
-                    if (prev == -2)
-                    {
-                        prev = other;
-                    }
-                    else if (prev >= 0)
-                    {
-                        assert(stripes[role].read_start >= stripes[prev].read_start &&
-                            stripes[role].read_start >= stripes[other].read_start);
-                        memxor(
-                            stripes[prev].read_buf + (stripes[role].read_start - stripes[prev].read_start),
-                            stripes[other].read_buf + (stripes[role].read_start - stripes[other].read_start),
-                            stripes[role].read_buf, stripes[role].read_end - stripes[role].read_start
-                        );
-                        memxor(stripes[prev].bmp_buf, stripes[other].bmp_buf, stripes[role].bmp_buf, bitmap_size);
-                        prev = -1;
-                    }
-                    else
-                    {
-                        assert(stripes[role].read_start >= stripes[other].read_start);
-                        memxor(
-                            stripes[role].read_buf,
-                            stripes[other].read_buf + (stripes[role].read_start - stripes[other].read_start),
-                            stripes[role].read_buf, stripes[role].read_end - stripes[role].read_start
-                        );
-                        memxor(stripes[role].bmp_buf, stripes[other].bmp_buf, stripes[role].bmp_buf, bitmap_size);
-                    }
+                    assert(stripes[role].read_start >= stripes[other].read_start);
+                    srcs[n] = stripes[other].read_buf + (stripes[role].read_start - stripes[other].read_start);
+                    bmp_srcs[n] = stripes[other].bmp_buf;
+                    n++;
                 }
             }
+            if (n > 0)
+            {
+                memxor_multi(srcs, n, stripes[role].read_buf, stripes[role].read_end - stripes[role].read_start);
+                memxor_multi(bmp_srcs, n, stripes[role].bmp_buf, bitmap_size);
+            }
         }
     }
 }
@@ -136,22 +125,99 @@ inline bool operator < (const reed_sol_erased_t &a, const reed_sol_erased_t &b)
 {
     for (int i = 0; i < a.size && i < b.size; i++)
     {
-        if (a.data[i] < b.data[i])
-            return -1;
-        else if (a.data[i] > b.data[i])
-            return 1;
+        if (a.data[i] != b.data[i])
+            return a.data[i] < b.data[i];
     }
-    return 0;
+    return a.size < b.size;
 }
 
+struct reed_sol_decoding_t
+{
+    // Single allocation: dm_ids[pg_minsize], decoding matrix[pg_minsize*pg_minsize], erased[pg_size]
+    int *dm_ids;
+    int *decoding_matrix;
+#ifdef WITH_ISAL
+    // ISA-L multiplication tables for each row of the decoding matrix
+    uint8_t *isal_tables;
+#endif
+    // Position in the LRU list of the matrix
+    std::list<reed_sol_erased_t>::iterator lru_it;
+};
+
 struct reed_sol_matrix_t
 {
     int refs = 0;
     int *data;
-    std::map<reed_sol_erased_t, int*> decodings;
+#ifdef WITH_ISAL
+    uint8_t *isal_tables;
+#endif
+    std::map<reed_sol_erased_t, reed_sol_decoding_t> decodings;
+    // Most recently used erasure patterns first
+    std::list<reed_sol_erased_t> decodings_lru;
 };
 
-std::map<uint64_t, reed_sol_matrix_t> matrices;
+// Matrices are per-thread because they're used without locks, e.g. by threads of a multi-threaded client
+static thread_local std::map<uint64_t, reed_sol_matrix_t> matrices;
+static thread_local uint64_t decoding_cache_limit = EC_DEFAULT_DECODING_CACHE;
+static thread_local ec_decoding_cache_stats_t decoding_cache_stats;
+
+void set_ec_decoding_cache_limit(uint64_t limit)
+{
+    decoding_cache_limit = limit > 0 ? limit : 1;
+}
+
+ec_decoding_cache_stats_t get_ec_decoding_cache_stats()
+{
+    ec_decoding_cache_stats_t st = decoding_cache_stats;
+    st.size = 0;
+    for (auto & mp: matrices)
+        st.size += mp.second.decodings.size();
+    return st;
+}
+
+// The backend is per-thread like the matrices and tables built for it
+#ifdef WITH_ISAL
+static thread_local int ec_backend = EC_BACKEND_ISAL;
+#else
+static thread_local int ec_backend = EC_BACKEND_JERASURE;
+#endif
+
+bool set_ec_backend(int backend)
+{
+#ifndef WITH_ISAL
+    if (backend == EC_BACKEND_ISAL)
+        return false;
+#endif
+    ec_backend = backend;
+    return true;
+}
+
+int get_ec_backend()
+{
+    return ec_backend;
+}
+
+#ifdef WITH_ISAL
+// ISA-L uses the same GF(2^8) as jerasure with w=8, so tables built from the jerasure
+// matrix produce exactly the same chunks and both backends may be switched freely
+static uint8_t* make_isal_tables(int *matrix, int rows, int k)
+{
+    uint8_t bytes[rows*k];
+    for (int i = 0; i < rows*k; i++)
+        bytes[i] = matrix[i];
+    uint8_t *tables = (uint8_t*)malloc_or_die(rows*k*32);
+    ec_init_tables(k, rows, bytes, tables);
+    return tables;
+}
+#endif
+
+static void free_decoding(reed_sol_decoding_t & dec)
+{
+    free(dec.dm_ids);
+#ifdef WITH_ISAL
+    free(dec.isal_tables);
+#endif
+}
 
 void use_jerasure(int pg_size, int pg_minsize, bool use)
 {
@@ -167,6 +233,9 @@ void use_jerasure(int pg_size, int pg_minsize, bool use)
         matrices[key] = (reed_sol_matrix_t){
             .refs = 0,
             .data = matrix,
+#ifdef WITH_ISAL
+            .isal_tables = make_isal_tables(matrix, pg_size-pg_minsize, pg_minsize),
+#endif
         };
         rs_it = matrices.find(key);
     }
@@ -174,11 +243,14 @@ void use_jerasure(int pg_size, int pg_minsize, bool use)
     if (rs_it->second.refs <= 0)
     {
         free(rs_it->second.data);
+#ifdef WITH_ISAL
+        free(rs_it->second.isal_tables);
+#endif
         for (auto dec_it = rs_it->second.decodings.begin(); dec_it != rs_it->second.decodings.end();)
         {
-            int *data = dec_it->second;
+            reed_sol_decoding_t dec = dec_it->second;
             rs_it->second.decodings.erase(dec_it++);
-            free(data);
+            free_decoding(dec);
         }
         matrices.erase(rs_it);
     }
@@ -199,7 +271,7 @@ reed_sol_matrix_t* get_jerasure_matrix(int pg_size, int pg_minsize)
 // we don't need it. also it makes an extra allocation of int *erased on every call and doesn't cache
 // the decoding matrix.
 // all these flaws are fixed in this function:
-int* get_jerasure_decoding_matrix(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize)
+reed_sol_decoding_t* get_jerasure_decoding_matrix(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize)
 {
     int edd = 0;
     int erased[pg_size] = { 0 };
@@ -213,12 +285,25 @@ int* get_jerasure_decoding_matrix(osd_rmw_stripe_t *stripes, int pg_size, int pg
         return NULL;
     reed_sol_matrix_t *matrix = get_jerasure_matrix(pg_size, pg_minsize);
     auto dec_it = matrix->decodings.find((reed_sol_erased_t){ .data = erased, .size = pg_size });
-    if (dec_it == matrix->decodings.end())
+    if (dec_it != matrix->decodings.end())
+    {
+        decoding_cache_stats.hits++;
+        matrix->decodings_lru.splice(matrix->decodings_lru.begin(), matrix->decodings_lru, dec_it->second.lru_it);
+    }
+    else
     {
+        decoding_cache_stats.misses++;
+        while (matrix->decodings.size() >= decoding_cache_limit)
+        {
+            auto evict_it = matrix->decodings.find(matrix->decodings_lru.back());
+            reed_sol_decoding_t dec = evict_it->second;
+            matrix->decodings.erase(evict_it);
+            matrix->decodings_lru.pop_back();
+            free_decoding(dec);
+            decoding_cache_stats.evictions++;
+        }
         int *dm_ids = (int*)malloc_or_die(sizeof(int)*(pg_minsize + pg_minsize*pg_minsize + pg_size));
         int *decoding_matrix = dm_ids + pg_minsize;
-        if (!dm_ids)
-            throw std::bad_alloc();
         // we always use row_k_ones=1 and w=8 (OSD_JERASURE_W)
         if (jerasure_make_decoding_matrix(pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data, erased, decoding_matrix, dm_ids) < 0)
         {
@@ -227,20 +312,89 @@ int* get_jerasure_decoding_matrix(osd_rmw_stripe_t *stripes, int pg_size, int pg
         }
         int *erased_copy = dm_ids + pg_minsize + pg_minsize*pg_minsize;
         memcpy(erased_copy, erased, pg_size*sizeof(int));
-        matrix->decodings.emplace((reed_sol_erased_t){ .data = erased_copy, .size = pg_size }, dm_ids);
-        return dm_ids;
+        reed_sol_erased_t key = { .data = erased_copy, .size = pg_size };
+        matrix->decodings_lru.push_front(key);
+        dec_it = matrix->decodings.emplace(key, (reed_sol_decoding_t){
+            .dm_ids = dm_ids,
+            .decoding_matrix = decoding_matrix,
+#ifdef WITH_ISAL
+            .isal_tables = make_isal_tables(decoding_matrix, pg_minsize, pg_minsize),
+#endif
+            .lru_it = matrix->decodings_lru.begin(),
+        }).first;
     }
-    return dec_it->second;
+    return &dec_it->second;
+}
+
+// Calculate all coding chunks: data_ptrs[pg_minsize..pg_size-1] from data_ptrs[0..pg_minsize-1]
+static void ec_encode(reed_sol_matrix_t *matrix, int pg_size, int pg_minsize, char **data_ptrs, int size)
+{
+#ifdef WITH_ISAL
+    if (ec_backend == EC_BACKEND_ISAL)
+    {
+        ec_encode_data(size, pg_minsize, pg_size-pg_minsize, matrix->isal_tables,
+            (uint8_t**)data_ptrs, (uint8_t**)data_ptrs+pg_minsize);
+        return;
+    }
+#endif
+    jerasure_matrix_encode(
+        pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data,
+        data_ptrs, data_ptrs+pg_minsize, size
+    );
+}
+
+// Restore chunk <role> from the chunks listed in dec->dm_ids
+static void ec_decode_chunk(reed_sol_decoding_t *dec, int pg_minsize, int role, char **data_ptrs, int size)
+{
+#ifdef WITH_ISAL
+    if (ec_backend == EC_BACKEND_ISAL)
+    {
+        uint8_t *srcs[pg_minsize];
+        for (int i = 0; i < pg_minsize; i++)
+            srcs[i] = (uint8_t*)data_ptrs[dec->dm_ids[i]];
+        ec_encode_data(size, pg_minsize, 1, dec->isal_tables + role*pg_minsize*32, srcs, (uint8_t**)data_ptrs+role);
+        return;
+    }
+#endif
+    jerasure_matrix_dotprod(
+        pg_minsize, OSD_JERASURE_W, dec->decoding_matrix+(role*pg_minsize), dec->dm_ids, role,
+        data_ptrs, data_ptrs+pg_minsize, size
+    );
+}
+
+// Add the change of data chunk <role> (<delta> = old XOR new) to all coding chunks:
+// coding_ptrs[i] ^= matrix[i][role] * delta. <tmp_ptrs> are scratch buffers of <size> bytes.
+// <matrix> is NULL for XOR
+static void ec_add_delta(reed_sol_matrix_t *matrix, int pg_size, int pg_minsize, int role,
+    uint8_t *delta, uint8_t **coding_ptrs, uint8_t **tmp_ptrs, int size)
+{
+    if (!matrix)
+    {
+        memxor(coding_ptrs[0], delta, coding_ptrs[0], size);
+        return;
+    }
+#ifdef WITH_ISAL
+    if (ec_backend == EC_BACKEND_ISAL)
+    {
+        ec_encode_data_update(size, pg_minsize, pg_size-pg_minsize, role, matrix->isal_tables, delta, coding_ptrs);
+        return;
+    }
+#endif
+    int column[pg_size-pg_minsize];
+    for (int i = 0; i < pg_size-pg_minsize; i++)
+        column[i] = matrix->data[i*pg_minsize + role];
+    jerasure_matrix_encode(1, pg_size-pg_minsize, OSD_JERASURE_W, column, (char**)&delta, (char**)tmp_ptrs, size);
+    for (int i = 0; i < pg_size-pg_minsize; i++)
+        memxor(coding_ptrs[i], tmp_ptrs[i], coding_ptrs[i], size);
 }
 
 void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, uint32_t bitmap_size)
 {
-    int *dm_ids = get_jerasure_decoding_matrix(stripes, pg_size, pg_minsize);
-    if (!dm_ids)
+    reed_sol_decoding_t *dec = get_jerasure_decoding_matrix(stripes, pg_size, pg_minsize);
+    if (!dec)
     {
         return;
     }
-    int *decoding_matrix = dm_ids + pg_minsize;
     char *data_ptrs[pg_size] = { 0 };
     for (int role = 0; role < pg_minsize; role++)
     {
@@ -258,10 +412,7 @@ void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg
                     }
                 }
                 data_ptrs[role] = (char*)stripes[role].read_buf;
-                jerasure_matrix_dotprod(
-                    pg_minsize, OSD_JERASURE_W, decoding_matrix+(role*pg_minsize), dm_ids, role,
-                    data_ptrs, data_ptrs+pg_minsize, stripes[role].read_end - stripes[role].read_start
-                );
+                ec_decode_chunk(dec, pg_minsize, role, data_ptrs, stripes[role].read_end - stripes[role].read_start);
             }
             for (int other = 0; other < pg_size; other++)
             {
@@ -271,10 +422,7 @@ void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg
                 }
             }
             data_ptrs[role] = (char*)stripes[role].bmp_buf;
-            jerasure_matrix_dotprod(
-                pg_minsize, OSD_JERASURE_W, decoding_matrix+(role*pg_minsize), dm_ids, role,
-                data_ptrs, data_ptrs+pg_minsize, bitmap_size
-            );
+            ec_decode_chunk(dec, pg_minsize, role, data_ptrs, bitmap_size);
         }
     }
 }
@@ -323,8 +471,8 @@ void* alloc_read_buffer(osd_rmw_stripe_t *stripes, int read_pg_size, uint64_t ad
             buf_size += stripes[role].read_end - stripes[role].read_start;
         }
     }
-    // Allocate buffer
-    void *buf = memalign_or_die(MEM_ALIGNMENT, buf_size);
+    // Allocate buffer from the pool, it's freed with buffer_free()
+    void *buf = buffer_alloc(buf_size);
     uint64_t buf_pos = add_size;
     for (int role = 0; role < read_pg_size; role++)
     {
@@ -337,6 +485,33 @@ void* alloc_read_buffer(osd_rmw_stripe_t *stripes, int read_pg_size, uint64_t ad
     return buf;
 }
 
+static thread_local ec_rmw_stats_t rmw_stats;
+
+ec_rmw_stats_t get_ec_rmw_stats()
+{
+    return rmw_stats;
+}
+
+// Parity may be updated in two ways:
+// 1) Read the rest of the data chunks in [start, end) and recalculate parity from scratch
+// 2) Read old versions of modified data ranges and old parity in [start, end), then add
+//    the difference between old and new data, multiplied by coding coefficients, to parity
+// The second one is better when a small part of a wide stripe is modified, i.e. when
+// the number of touched data chunks is small compared to the number of untouched ones.
+// Choose the one which reads less
+static bool use_parity_delta(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, uint32_t start, uint32_t end)
+{
+    uint64_t full_read = 0, delta_read = (uint64_t)(pg_size-pg_minsize) * (end-start);
+    for (int role = 0; role < pg_minsize; role++)
+    {
+        osd_rmw_stripe_t tmp = stripes[role];
+        cover_read(start, end, tmp);
+        full_read += tmp.read_end - tmp.read_start;
+        delta_read += stripes[role].req_end - stripes[role].req_start;
+    }
+    return delta_read < full_read;
+}
+
 void* calc_rmw(void *request_buf, osd_rmw_stripe_t *stripes, uint64_t *read_osd_set,
     uint64_t pg_size, uint64_t pg_minsize, uint64_t pg_cursize, uint64_t *write_osd_set,
     uint64_t chunk_size, uint32_t bitmap_size)
@@ -379,9 +554,33 @@ void* calc_rmw(void *request_buf, osd_rmw_stripe_t *stripes, uint64_t *read_osd_
     }
     if (write_parity)
     {
-        for (int role = 0; role < pg_minsize; role++)
+        if (write_osd_set == read_osd_set && pg_cursize == pg_size &&
+            use_parity_delta(stripes, pg_size, pg_minsize, start, end))
         {
-            cover_read(start, end, stripes[role]);
+            // Read old versions of modified data ranges and old parity
+            for (int role = 0; role < pg_size; role++)
+            {
+                if (role >= pg_minsize)
+                {
+                    stripes[role].read_start = start;
+                    stripes[role].read_end = end;
+                    stripes[role].parity_delta = true;
+                }
+                else if (stripes[role].req_end != 0)
+                {
+                    stripes[role].read_start = stripes[role].req_start;
+                    stripes[role].read_end = stripes[role].req_end;
+                }
+            }
+            rmw_stats.parity_delta++;
+        }
+        else
+        {
+            for (int role = 0; role < pg_minsize; role++)
+            {
+                cover_read(start, end, stripes[role]);
+            }
+            rmw_stats.full++;
         }
     }
     if (write_osd_set != read_osd_set)
@@ -507,35 +706,37 @@ static void get_old_new_buffers(osd_rmw_stripe_t & stripe, uint32_t wr_start, ui
     }
 }
 
-static void xor_multiple_buffers(buf_len_t *xor1, int n1, buf_len_t *xor2, int n2, void *dest, uint32_t len)
+// XOR <n> buffer lists, each covering <len> bytes in up to 3 parts, into <dest>
+static void xor_multiple_buffers(buf_len_t bufs[][3], int *nbuf, int n, void *dest, uint32_t len)
 {
-    assert(n1 > 0 && n2 > 0);
-    int i1 = 0, i2 = 0;
-    uint32_t start1 = 0, start2 = 0, end1 = xor1[0].len, end2 = xor2[0].len;
+    assert(n > 0);
+    int curbuf[n] = { 0 };
+    uint32_t positions[n] = { 0 };
+    const void *ptrs[n];
     uint32_t pos = 0;
     while (pos < len)
     {
-        // We know for sure that ranges overlap
-        uint32_t end = std::min(end1, end2);
-        memxor(xor1[i1].buf + pos-start1, xor2[i2].buf + pos-start2, dest+pos, end-pos);
-        pos = end;
-        if (pos >= end1)
+        uint32_t next_end = len;
+        for (int i = 0; i < n; i++)
         {
-            i1++;
-            if (i1 >= n1)
-            {
-                assert(pos >= end2);
-                return;
-            }
-            start1 = end1;
-            end1 += xor1[i1].len;
+            assert(curbuf[i] < nbuf[i]);
+            ptrs[i] = bufs[i][curbuf[i]].buf + pos-positions[i];
+            uint32_t this_end = bufs[i][curbuf[i]].len + positions[i];
+            if (next_end > this_end)
+                next_end = this_end;
         }
-        if (pos >= end2)
+        assert(next_end > pos);
+        for (int i = 0; i < n; i++)
         {
-            i2++;
-            start2 = end2;
-            end2 += xor2[i2].len;
+            uint32_t this_end = bufs[i][curbuf[i]].len + positions[i];
+            if (next_end >= this_end)
+            {
+                positions[i] += bufs[i][curbuf[i]].len;
+                curbuf[i]++;
+            }
         }
+        memxor_multi(ptrs, n, dest+pos, next_end-pos);
+        pos = next_end;
     }
 }
 
@@ -637,43 +838,81 @@ static void calc_rmw_parity_copy_parity(osd_rmw_stripe_t *stripes, int pg_size,
 #endif
 }
 
+// Parity delta update, see use_parity_delta(). Old data and old parity are overwritten:
+// data read buffers receive the delta and parity read buffers receive the new parity
+static void calc_rmw_parity_delta(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize,
+    reed_sol_matrix_t *matrix, uint32_t chunk_size, uint32_t bitmap_size)
+{
+    uint32_t bitmap_granularity = bitmap_size > 0 ? chunk_size / bitmap_size / 8 : 0;
+    int coding_count = pg_size-pg_minsize;
+    uint32_t start = stripes[pg_minsize].read_start;
+    uint8_t *coding_ptrs[coding_count], *tmp_ptrs[coding_count];
+    for (int i = 0; i < coding_count; i++)
+    {
+        // Parity write buffers are free until the end, use them as scratch space
+        tmp_ptrs[i] = (uint8_t*)stripes[pg_minsize+i].write_buf;
+    }
+    for (int role = 0; role < pg_minsize; role++)
+    {
+        osd_rmw_stripe_t & s = stripes[role];
+        if (s.req_end == 0)
+        {
+            continue;
+        }
+        uint32_t len = s.req_end - s.req_start;
+        memxor(s.read_buf, s.write_buf, s.read_buf, len);
+        for (int i = 0; i < coding_count; i++)
+            coding_ptrs[i] = (uint8_t*)stripes[pg_minsize+i].read_buf + s.req_start - start;
+        ec_add_delta(matrix, pg_size, pg_minsize, role, (uint8_t*)s.read_buf, coding_ptrs, tmp_ptrs, len);
+        if (bitmap_granularity > 0)
+        {
+            uint8_t bmp_delta[bitmap_size], tmp_bmps[coding_count][bitmap_size];
+            memcpy(bmp_delta, s.bmp_buf, bitmap_size);
+            bitmap_set(s.bmp_buf, s.req_start, len, bitmap_granularity);
+            memxor(bmp_delta, s.bmp_buf, bmp_delta, bitmap_size);
+            for (int i = 0; i < coding_count; i++)
+            {
+                coding_ptrs[i] = (uint8_t*)stripes[pg_minsize+i].bmp_buf;
+                tmp_ptrs[i] = tmp_bmps[i];
+            }
+            ec_add_delta(matrix, pg_size, pg_minsize, role, bmp_delta, coding_ptrs, tmp_ptrs, bitmap_size);
+            for (int i = 0; i < coding_count; i++)
+                tmp_ptrs[i] = (uint8_t*)stripes[pg_minsize+i].write_buf;
+        }
+    }
+    for (int role = pg_minsize; role < pg_size; role++)
+    {
+        stripes[role].write_buf = stripes[role].read_buf;
+    }
+}
+
 void calc_rmw_parity_xor(osd_rmw_stripe_t *stripes, int pg_size, uint64_t *read_osd_set, uint64_t *write_osd_set,
     uint32_t chunk_size, uint32_t bitmap_size)
 {
     uint32_t bitmap_granularity = bitmap_size > 0 ? chunk_size / bitmap_size / 8 : 0;
     int pg_minsize = pg_size-1;
+    if (stripes[pg_minsize].parity_delta)
+    {
+        calc_rmw_parity_delta(stripes, pg_size, pg_minsize, NULL, chunk_size, bitmap_size);
+        return;
+    }
     reconstruct_stripes_xor(stripes, pg_size, bitmap_size);
     uint32_t start = 0, end = 0;
     calc_rmw_parity_copy_mod(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, bitmap_granularity, start, end);
     if (write_osd_set[pg_minsize] != 0 && end != 0)
     {
-        // Calculate new parity (XOR k+1)
-        int parity = pg_minsize, prev = -2;
+        // Calculate new parity (XOR k+1) in a single pass over all data chunks
+        int parity = pg_minsize;
+        buf_len_t bufs[pg_minsize][3];
+        int nbuf[pg_minsize] = { 0 };
+        const void *bmp_srcs[pg_minsize];
         for (int other = 0; other < pg_minsize; other++)
         {
-            if (prev == -2)
-            {
-                prev = other;
-            }
-            else
-            {
-                int n1 = 0, n2 = 0;
-                buf_len_t xor1[3], xor2[3];
-                if (prev == -1)
-                {
-                    xor1[n1++] = { .buf = stripes[parity].write_buf, .len = end-start };
-                    memxor(stripes[parity].bmp_buf, stripes[other].bmp_buf, stripes[parity].bmp_buf, bitmap_size);
-                }
-                else
-                {
-                    memxor(stripes[prev].bmp_buf, stripes[other].bmp_buf, stripes[parity].bmp_buf, bitmap_size);
-                    get_old_new_buffers(stripes[prev], start, end, xor1, n1);
-                    prev = -1;
-                }
-                get_old_new_buffers(stripes[other], start, end, xor2, n2);
-                xor_multiple_buffers(xor1, n1, xor2, n2, stripes[parity].write_buf, end-start);
-            }
+            get_old_new_buffers(stripes[other], start, end, bufs[other], nbuf[other]);
+            bmp_srcs[other] = stripes[other].bmp_buf;
         }
+        memxor_multi(bmp_srcs, pg_minsize, stripes[parity].bmp_buf, bitmap_size);
+        xor_multiple_buffers(bufs, nbuf, pg_minsize, stripes[parity].write_buf, end-start);
     }
     calc_rmw_parity_copy_parity(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, start, end);
 }
@@ -683,6 +922,11 @@ void calc_rmw_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_min
 {
     uint32_t bitmap_granularity = bitmap_size > 0 ? chunk_size / bitmap_size / 8 : 0;
     reed_sol_matrix_t *matrix = get_jerasure_matrix(pg_size, pg_minsize);
+    if (stripes[pg_minsize].parity_delta)
+    {
+        calc_rmw_parity_delta(stripes, pg_size, pg_minsize, matrix, chunk_size, bitmap_size);
+        return;
+    }
     reconstruct_stripes_jerasure(stripes, pg_size, pg_minsize, bitmap_size);
     uint32_t start = 0, end = 0;
     calc_rmw_parity_copy_mod(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, bitmap_granularity, start, end);
@@ -734,21 +978,49 @@ void calc_rmw_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_min
                         curbuf[i]++;
                     }
                 }
-                jerasure_matrix_encode(
-                    pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data,
-                    (char**)data_ptrs, (char**)data_ptrs+pg_minsize, next_end-pos
-                );
+                ec_encode(matrix, pg_size, pg_minsize, (char**)data_ptrs, next_end-pos);
                 pos = next_end;
             }
             for (int i = 0; i < pg_size; i++)
             {
                 data_ptrs[i] = stripes[i].bmp_buf;
             }
-            jerasure_matrix_encode(
-                pg_minsize, pg_size-pg_minsize, OSD_JERASURE_W, matrix->data,
-                (char**)data_ptrs, (char**)data_ptrs+pg_minsize, bitmap_size
-            );
+            ec_encode(matrix, pg_size, pg_minsize, (char**)data_ptrs, bitmap_size);
         }
     }
     calc_rmw_parity_copy_parity(stripes, pg_size, pg_minsize, read_osd_set, write_osd_set, chunk_size, start, end);
 }
+
+void calc_full_parity_xor(osd_rmw_stripe_t *stripes, int pg_size, void **parity_bufs, void **parity_bmps,
+    uint32_t chunk_size, uint32_t bitmap_size)
+{
+    const void *srcs[pg_size], *bmp_srcs[pg_size];
+    for (int role = 0; role < pg_size-1; role++)
+    {
+        srcs[role] = stripes[role].read_buf;
+        bmp_srcs[role] = stripes[role].bmp_buf;
+    }
+    if (chunk_size > 0)
+        memxor_multi(srcs, pg_size-1, parity_bufs[0], chunk_size);
+    if (bitmap_size > 0)
+        memxor_multi(bmp_srcs, pg_size-1, parity_bmps[0], bitmap_size);
+}
+
+void calc_full_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, void **parity_bufs, void **parity_bmps,
+    uint32_t chunk_size, uint32_t bitmap_size)
+{
+    reed_sol_matrix_t *matrix = get_jerasure_matrix(pg_size, pg_minsize);
+    char *data_ptrs[pg_size];
+    if (chunk_size > 0)
+    {
+        for (int role = 0; role < pg_size; role++)
+            data_ptrs[role] = (char*)(role < pg_minsize ? stripes[role].read_buf : parity_bufs[role-pg_minsize]);
+        ec_encode(matrix, pg_size, pg_minsize, data_ptrs, chunk_size);
+    }
+    if (bitmap_size > 0)
+    {
+        for (int role = 0; role < pg_size; role++)
+            data_ptrs[role] = (char*)(role < pg_minsize ? stripes[role].bmp_buf : parity_bmps[role-pg_minsize]);
+        ec_encode(matrix, pg_size, pg_minsize, data_ptrs, bitmap_size);
+    }
+}
@@ -25,6 +25,8 @@ struct osd_rmw_stripe_t
     uint32_t read_start, read_end;
     uint32_t write_start, write_end;
     bool missing;
+    // Parity chunk is updated incrementally: its read_buf holds old parity in [write_start, write_end)
+    bool parity_delta;
 };
 
 // Here pg_minsize is the number of data chunks, not the minimum number of alive OSDs for the PG to operate
@@ -41,12 +43,53 @@ void* calc_rmw(void *request_buf, osd_rmw_stripe_t *stripes, uint64_t *read_osd_
     uint64_t pg_size, uint64_t pg_minsize, uint64_t pg_cursize, uint64_t *write_osd_set,
     uint64_t chunk_size, uint32_t bitmap_size);
 
+// Number of parity updates done by recalculating parity from all data chunks
+// or by adding the data delta to the old parity, per thread, i.e. per OSD
+struct ec_rmw_stats_t
+{
+    uint64_t full, parity_delta;
+};
+
+ec_rmw_stats_t get_ec_rmw_stats();
+
 void calc_rmw_parity_xor(osd_rmw_stripe_t *stripes, int pg_size, uint64_t *read_osd_set, uint64_t *write_osd_set,
     uint32_t chunk_size, uint32_t bitmap_size);
 
+#define EC_BACKEND_JERASURE 0
+#define EC_BACKEND_ISAL 1
+
+// Select the implementation used for jerasure-scheme pools by the calling thread. ISA-L is only
+// available if the OSD is built with it (WITH_ISAL). Returns false if the backend isn't available
+bool set_ec_backend(int backend);
+
+int get_ec_backend();
+
+// Default number of cached decoding matrices (erasure patterns) per (pg_size, pg_minsize)
+#define EC_DEFAULT_DECODING_CACHE 256
+
+struct ec_decoding_cache_stats_t
+{
+    uint64_t hits, misses, evictions, size;
+};
+
+// Decoding matrix cache is per-thread, i.e. per OSD
+void set_ec_decoding_cache_limit(uint64_t limit);
+
+ec_decoding_cache_stats_t get_ec_decoding_cache_stats();
+
 void use_jerasure(int pg_size, int pg_minsize, bool use);
 
 void reconstruct_stripes_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, uint32_t bitmap_size);
 
 void calc_rmw_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize,
     uint64_t *read_osd_set, uint64_t *write_osd_set, uint32_t chunk_size, uint32_t bitmap_size);
+
+// Recalculate parity chunks of a whole object from its data chunks (read_buf and bmp_buf
+// of roles 0..pg_minsize-1) into parity_bufs[i] and parity_bmps[i], i = role-pg_minsize.
+// Used by scrub to check parity chunks read from OSDs and by clients to send parity of whole-object
+// writes. With chunk_size = 0 only bitmaps are calculated, with bitmap_size = 0 only data
+void calc_full_parity_xor(osd_rmw_stripe_t *stripes, int pg_size, void **parity_bufs, void **parity_bmps,
+    uint32_t chunk_size, uint32_t bitmap_size);
+
+void calc_full_parity_jerasure(osd_rmw_stripe_t *stripes, int pg_size, int pg_minsize, void **parity_bufs, void **parity_bmps,
+    uint32_t chunk_size, uint32_t bitmap_size);
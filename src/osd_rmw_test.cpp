@@ -4,6 +4,7 @@
 #define RMW_DEBUG
 
 #include <string.h>
+#include <time.h>
 #include "osd_rmw.cpp"
 #include "test_pattern.h"
 
@@ -20,6 +21,13 @@ void test11();
 void test12();
 void test13();
 void test14();
+void test15();
+void test_memxor();
+void test_decoding_cache();
+void test_full_parity();
+#ifdef WITH_ISAL
+void test_isal();
+#endif
 
 int main(int narg, char *args[])
 {
@@ -47,6 +55,18 @@ int main(int narg, char *args[])
     test13();
     // Test 14
     test14();
+    // Test 15
+    test15();
+    // XOR kernels
+    test_memxor();
+    // Decoding matrix LRU
+    test_decoding_cache();
+    // Parity recalculation for scrub
+    test_full_parity();
+#ifdef WITH_ISAL
+    // ISA-L vs jerasure
+    test_isal();
+#endif
     // End
     printf("all ok\n");
     return 0;
@@ -163,7 +183,7 @@ void test4()
     check_pattern(stripes[2].write_buf, 4096, PATTERN0^PATTERN1); // new parity
     check_pattern(stripes[2].write_buf+4096, 128*1024-4096*2, 0); // new parity
     check_pattern(stripes[2].write_buf+128*1024-4096, 4096, PATTERN0^PATTERN1); // new parity
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -204,7 +224,7 @@ void test5()
     assert(stripes[0].write_buf == write_buf);
     assert(stripes[1].write_buf == write_buf+128*1024);
     assert(stripes[2].write_buf == rmw_buf);
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -241,7 +261,7 @@ void test6()
     assert(stripes[0].write_buf == write_buf);
     assert(stripes[1].write_buf == write_buf+128*1024);
     assert(stripes[2].write_buf == rmw_buf);
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -299,7 +319,7 @@ void test7()
     check_pattern(stripes[2].write_buf, 4096, PATTERN0^PATTERN1); // new parity
     check_pattern(stripes[2].write_buf+4096, 128*1024-4096*2, 0); // new parity
     check_pattern(stripes[2].write_buf+128*1024-4096, 4096, PATTERN0^PATTERN1); // new parity
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -349,7 +369,7 @@ void test8()
     assert(stripes[2].write_buf == rmw_buf);                                 // recheck again
     check_pattern(stripes[2].write_buf, 4096, 0); // new parity
     check_pattern(stripes[2].write_buf+4096, 128*1024-4096, PATTERN0^PATTERN1); // new parity
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -408,7 +428,7 @@ void test9()
     assert(stripes[2].write_buf == NULL);
     check_pattern(stripes[0].read_buf, 128*1024, PATTERN1);
     check_pattern(stripes[0].write_buf, 128*1024, PATTERN1);
-    free(rmw_buf);
+    buffer_free(rmw_buf);
 }
 
 /***
@@ -463,7 +483,7 @@ void test10()
     assert(stripes[1].write_buf == write_buf+128*1024);
     assert(stripes[2].write_buf == rmw_buf);
     check_pattern(stripes[2].write_buf, 128*1024, PATTERN1^PATTERN2);
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -519,7 +539,7 @@ void test11()
     assert(stripes[1].write_buf == write_buf);
     assert(stripes[2].write_buf == rmw_buf);
     check_pattern(stripes[2].write_buf, 128*1024, PATTERN1^PATTERN2);
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
 }
 
@@ -574,7 +594,7 @@ void test12()
     assert(stripes[1].write_buf == NULL);
     assert(stripes[2].write_buf == rmw_buf);
     check_pattern(stripes[2].write_buf, 128*1024, PATTERN1^PATTERN2);
-    free(rmw_buf);
+    buffer_free(rmw_buf);
 }
 
 /***
@@ -668,7 +688,7 @@ void test13()
     check_pattern(stripes[0].read_buf+128*1024-4096, 4096, PATTERN3);
     check_pattern(stripes[1].read_buf, 4096, PATTERN3);
     check_pattern(stripes[1].read_buf+4096, 128*1024-4096, PATTERN2);
-    free(read_buf);
+    buffer_free(read_buf);
     // Test 13.4 - partial decode (only 1st chunk) and verify
     memset(stripes, 0, sizeof(stripes));
     split_stripes(2, 128*1024, 0, 128*1024, stripes);
@@ -697,9 +717,9 @@ void test13()
     reconstruct_stripes_jerasure(stripes, 4, 2, 0);
     check_pattern(stripes[0].read_buf, 128*1024-4096, PATTERN1);
     check_pattern(stripes[0].read_buf+128*1024-4096, 4096, PATTERN3);
-    free(read_buf);
+    buffer_free(read_buf);
     // Huh done
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
     use_jerasure(4, 2, false);
 }
@@ -796,9 +816,314 @@ void test14()
     reconstruct_stripes_jerasure(stripes, 3, 2, bmp);
     check_pattern(stripes[0].read_buf, 128*1024-4096, PATTERN1);
     check_pattern(stripes[0].read_buf+128*1024-4096, 4096, PATTERN3);
-    free(read_buf);
+    buffer_free(read_buf);
     // Huh done
-    free(rmw_buf);
+    buffer_free(rmw_buf);
     free(write_buf);
     use_jerasure(3, 2, false);
 }
+
+/***
+
+15. Parity delta update in a 6+2 EC pool:
+   calc_rmw(offset=128K+8K, len=4K, osd_set=[1,2,3,4,5,6,7,8], write_set=[1,2,3,4,5,6,7,8])
+   = { read: [ [ 0, 0 ], [ 8K, 12K ], [ 0, 0 ] x4, [ 8K, 12K ], [ 8K, 12K ] ] }
+   i.e. 12K instead of 20K with full parity recalculation, and the resulting parity
+   must be the same as parity calculated from the full new stripe
+
+***/
+
+static void test15_encode_full(osd_rmw_stripe_t *stripes, void *data, uint8_t bitmaps[][4], void *parity, uint8_t *parity_bmp)
+{
+    osd_num_t osd_set[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    memset(stripes, 0, sizeof(osd_rmw_stripe_t)*8);
+    memset(bitmaps, 0, 8*4);
+    split_stripes(6, 128*1024, 0, 6*128*1024, stripes);
+    for (int i = 0; i < 8; i++)
+        stripes[i].bmp_buf = bitmaps[i];
+    void *rmw_buf = calc_rmw(data, stripes, osd_set, 8, 6, 8, osd_set, 128*1024, 4);
+    assert(rmw_buf);
+    assert(!stripes[6].parity_delta && !stripes[7].parity_delta);
+    calc_rmw_parity_jerasure(stripes, 8, 6, osd_set, osd_set, 128*1024, 4);
+    memcpy(parity, stripes[6].write_buf, 128*1024);
+    memcpy(parity+128*1024, stripes[7].write_buf, 128*1024);
+    memcpy(parity_bmp, bitmaps[6], 2*4);
+    buffer_free(rmw_buf);
+}
+
+void test15()
+{
+    use_jerasure(8, 6, true);
+    osd_num_t osd_set[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    osd_rmw_stripe_t stripes[8] = { 0 };
+    uint8_t bitmaps[8][4];
+    uint64_t patterns[4] = { PATTERN0, PATTERN1, PATTERN2, PATTERN3 };
+    void *data = malloc_or_die(6*128*1024);
+    for (int role = 0; role < 6; role++)
+        set_pattern(data+role*128*1024, 128*1024, patterns[role % 4]);
+    void *old_parity = malloc_or_die(2*128*1024), *new_parity = malloc_or_die(2*128*1024);
+    uint8_t old_bmp[8], new_bmp[8];
+    test15_encode_full(stripes, data, bitmaps, old_parity, old_bmp);
+    set_pattern(data+128*1024+8192, 4096, PATTERN3);
+    test15_encode_full(stripes, data, bitmaps, new_parity, new_bmp);
+    // Test 15.1 - only the modified range of data and parity is read
+    void *write_buf = malloc_or_die(4096);
+    set_pattern(write_buf, 4096, PATTERN3);
+    memset(stripes, 0, sizeof(stripes));
+    memset(bitmaps, 0xff, sizeof(bitmaps));
+    memcpy(bitmaps[6], old_bmp, 2*4);
+    split_stripes(6, 128*1024, 128*1024+8192, 4096, stripes);
+    for (int i = 0; i < 8; i++)
+        stripes[i].bmp_buf = bitmaps[i];
+    ec_rmw_stats_t before = get_ec_rmw_stats();
+    void *rmw_buf = calc_rmw(write_buf, stripes, osd_set, 8, 6, 8, osd_set, 128*1024, 4);
+    assert(rmw_buf);
+    assert(get_ec_rmw_stats().parity_delta == before.parity_delta+1);
+    assert(get_ec_rmw_stats().full == before.full);
+    for (int i = 0; i < 8; i++)
+    {
+        if (i == 1 || i >= 6)
+            assert(stripes[i].read_start == 8192 && stripes[i].read_end == 12288);
+        else
+            assert(stripes[i].read_end == 0);
+        assert(stripes[i].parity_delta == (i >= 6));
+    }
+    // Test 15.2 - delta gives the same parity
+    set_pattern(stripes[1].read_buf, 4096, PATTERN1);
+    memcpy(stripes[6].read_buf, old_parity+8192, 4096);
+    memcpy(stripes[7].read_buf, old_parity+128*1024+8192, 4096);
+    calc_rmw_parity_jerasure(stripes, 8, 6, osd_set, osd_set, 128*1024, 4);
+    assert(stripes[1].write_start == 8192 && stripes[1].write_end == 12288);
+    assert(stripes[1].write_buf == write_buf);
+    for (int i = 6; i < 8; i++)
+    {
+        assert(stripes[i].write_start == 8192 && stripes[i].write_end == 12288);
+        assert(stripes[i].write_buf == stripes[i].read_buf);
+    }
+    assert(memcmp(stripes[6].write_buf, new_parity+8192, 4096) == 0);
+    assert(memcmp(stripes[7].write_buf, new_parity+128*1024+8192, 4096) == 0);
+    assert(memcmp(bitmaps[6], new_bmp, 2*4) == 0);
+    buffer_free(rmw_buf);
+    free(write_buf);
+    free(new_parity);
+    free(old_parity);
+    free(data);
+    use_jerasure(8, 6, false);
+}
+
+/***
+
+memxor kernels: compare with the generic one on unaligned buffers of different sizes,
+then measure throughput of 2-source XOR and 4-source single-pass XOR
+
+***/
+
+static double memxor_bench(const memxor_kernel_t *k, const void **srcs, int n, void *dest, unsigned len, int iters)
+{
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    for (int i = 0; i < iters; i++)
+    {
+        if (n == 2)
+            k->xor2(srcs[0], srcs[1], dest, len);
+        else
+            k->xorn(srcs, n, dest, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tv_end);
+    double sec = (tv_end.tv_sec - tv_begin.tv_sec) + (tv_end.tv_nsec - tv_begin.tv_nsec) / 1000000000.0;
+    // Count bytes read from all sources
+    return sec > 0 ? (double)len*n*iters / sec / 1024/1024/1024 : 0;
+}
+
+void test_memxor()
+{
+    const int n = 4;
+    const unsigned max_len = 128*1024;
+    uint8_t *bufs[n+2];
+    for (int i = 0; i < n+2; i++)
+    {
+        bufs[i] = (uint8_t*)malloc_or_die(max_len+64);
+        for (int j = 0; j < max_len+64; j++)
+            bufs[i][j] = (uint8_t)(j*(i+3) + (j >> 8));
+    }
+    const memxor_kernel_t *generic = NULL;
+    for (int i = 0; i < memxor_kernel_count(); i++)
+        if (!strcmp(memxor_kernel(i)->name, "generic"))
+            generic = memxor_kernel(i);
+    assert(generic);
+    unsigned lens[] = { 0, 1, 7, 15, 63, 64, 65, 255, 257, 4096, 4099, max_len };
+    for (int i = 0; i < memxor_kernel_count(); i++)
+    {
+        const memxor_kernel_t *k = memxor_kernel(i);
+        if (!k->supported())
+        {
+            printf("memxor %s: not supported\n", k->name);
+            continue;
+        }
+        for (int l = 0; l < sizeof(lens)/sizeof(lens[0]); l++)
+        {
+            for (int off = 0; off < 3; off++)
+            {
+                const void *srcs[n];
+                for (int j = 0; j < n; j++)
+                    srcs[j] = bufs[j] + off + j;
+                uint8_t *expected = bufs[n], *actual = bufs[n+1];
+                generic->xor2(srcs[0], srcs[1], expected, lens[l]);
+                k->xor2(srcs[0], srcs[1], actual+off, lens[l]);
+                assert(!memcmp(expected, actual+off, lens[l]));
+                generic->xorn(srcs, n, expected, lens[l]);
+                k->xorn(srcs, n, actual+off, lens[l]);
+                assert(!memcmp(expected, actual+off, lens[l]));
+                // XOR in place
+                memcpy(actual, srcs[0], lens[l]);
+                srcs[0] = actual;
+                k->xorn(srcs, n, actual, lens[l]);
+                assert(!memcmp(expected, actual, lens[l]));
+            }
+        }
+        const void *srcs[n] = { bufs[0], bufs[1], bufs[2], bufs[3] };
+        double xor2_gbs = memxor_bench(k, srcs, 2, bufs[n], max_len, 2048);
+        double xorn_gbs = memxor_bench(k, srcs, n, bufs[n], max_len, 1024);
+        printf("memxor %s: %.2f GB/s (2 sources), %.2f GB/s (%d sources)\n", k->name, xor2_gbs, xorn_gbs, n);
+    }
+    printf("memxor default: %s\n", memxor_impl->name);
+    for (int i = 0; i < n+2; i++)
+        free(bufs[i]);
+}
+
+/***
+
+Decoding matrix cache: with limit=2 and patterns A, B, A, C, B
+we expect hits=1 (A), misses=4 and evictions=2 (B, then A)
+
+***/
+
+void test_decoding_cache()
+{
+    const int pg_size = 5, pg_minsize = 3;
+    use_jerasure(pg_size, pg_minsize, true);
+    set_ec_decoding_cache_limit(2);
+    ec_decoding_cache_stats_t before = get_ec_decoding_cache_stats();
+    int patterns[5] = { 0, 1, 0, 2, 1 };
+    for (int p = 0; p < 5; p++)
+    {
+        osd_rmw_stripe_t stripes[pg_size] = { 0 };
+        for (int i = 0; i < pg_size; i++)
+        {
+            stripes[i].read_end = 4096;
+            stripes[i].missing = (i == patterns[p] || i == 4);
+        }
+        assert(get_jerasure_decoding_matrix(stripes, pg_size, pg_minsize) != NULL);
+    }
+    ec_decoding_cache_stats_t after = get_ec_decoding_cache_stats();
+    assert(after.hits-before.hits == 1);
+    assert(after.misses-before.misses == 4);
+    assert(after.evictions-before.evictions == 2);
+    assert(after.size == 2);
+    set_ec_decoding_cache_limit(EC_DEFAULT_DECODING_CACHE);
+    use_jerasure(pg_size, pg_minsize, false);
+    assert(get_ec_decoding_cache_stats().size == 0);
+    printf("decoding cache ok\n");
+}
+
+/***
+
+Parity recalculated from whole data chunks by calc_full_parity_*() for scrub must
+match parity written by the normal full-object write path, including bitmaps
+
+***/
+
+void test_full_parity()
+{
+    const uint32_t chunk = 128*1024, bmp = 4;
+    for (int jerasure = 0; jerasure < 2; jerasure++)
+    {
+        const int pg_size = jerasure ? 4 : 3, pg_minsize = 2;
+        if (jerasure)
+            use_jerasure(pg_size, pg_minsize, true);
+        osd_num_t osd_set[4] = { 1, 2, 3, 4 };
+        osd_rmw_stripe_t stripes[4] = { 0 };
+        unsigned bitmaps[4] = { 0x0f, 0x35, 0, 0 };
+        void *write_buf = malloc_or_die(pg_minsize*chunk);
+        set_pattern(write_buf, chunk, PATTERN1);
+        set_pattern(write_buf+chunk, chunk, PATTERN2);
+        split_stripes(pg_minsize, chunk, 0, pg_minsize*chunk, stripes);
+        for (int i = 0; i < pg_size; i++)
+            stripes[i].bmp_buf = bitmaps+i;
+        void *rmw_buf = calc_rmw(write_buf, stripes, osd_set, pg_size, pg_minsize, pg_size, osd_set, chunk, bmp);
+        assert(rmw_buf);
+        if (jerasure)
+            calc_rmw_parity_jerasure(stripes, pg_size, pg_minsize, osd_set, osd_set, chunk, bmp);
+        else
+            calc_rmw_parity_xor(stripes, pg_size, osd_set, osd_set, chunk, bmp);
+        // Now "read" data chunks and recalculate parity
+        osd_rmw_stripe_t read_stripes[4] = { 0 };
+        unsigned parity_bitmaps[2] = { 0 };
+        void *parity_bufs[2], *parity_bmps[2];
+        for (int i = 0; i < pg_minsize; i++)
+        {
+            read_stripes[i].read_buf = write_buf + i*chunk;
+            read_stripes[i].bmp_buf = bitmaps+i;
+        }
+        for (int i = 0; i < pg_size-pg_minsize; i++)
+        {
+            parity_bufs[i] = malloc_or_die(chunk);
+            parity_bmps[i] = parity_bitmaps+i;
+        }
+        if (jerasure)
+            calc_full_parity_jerasure(read_stripes, pg_size, pg_minsize, parity_bufs, parity_bmps, chunk, bmp);
+        else
+            calc_full_parity_xor(read_stripes, pg_size, parity_bufs, parity_bmps, chunk, bmp);
+        for (int i = pg_minsize; i < pg_size; i++)
+        {
+            assert(memcmp(parity_bufs[i-pg_minsize], stripes[i].write_buf, chunk) == 0);
+            assert(parity_bitmaps[i-pg_minsize] == bitmaps[i]);
+            free(parity_bufs[i-pg_minsize]);
+        }
+        if (!jerasure)
+            assert(parity_bitmaps[0] == (bitmaps[0] ^ bitmaps[1]));
+        buffer_free(rmw_buf);
+        free(write_buf);
+        if (jerasure)
+            use_jerasure(pg_size, pg_minsize, false);
+    }
+    printf("full parity ok\n");
+}
+
+#ifdef WITH_ISAL
+/***
+
+ISA-L backend must produce exactly the same parity chunks as jerasure,
+so that both backends may be used for the same pools
+
+***/
+
+void test_isal()
+{
+    const int pg_size = 5, pg_minsize = 3, len = 64*1024;
+    use_jerasure(pg_size, pg_minsize, true);
+    reed_sol_matrix_t *matrix = get_jerasure_matrix(pg_size, pg_minsize);
+    char *bufs[2][pg_size];
+    for (int b = 0; b < 2; b++)
+        for (int i = 0; i < pg_size; i++)
+            bufs[b][i] = (char*)malloc_or_die(len);
+    srand(42);
+    for (int i = 0; i < pg_minsize; i++)
+    {
+        for (int j = 0; j < len; j++)
+            bufs[0][i][j] = rand();
+        memcpy(bufs[1][i], bufs[0][i], len);
+    }
+    assert(set_ec_backend(EC_BACKEND_JERASURE));
+    ec_encode(matrix, pg_size, pg_minsize, bufs[0], len);
+    assert(set_ec_backend(EC_BACKEND_ISAL));
+    ec_encode(matrix, pg_size, pg_minsize, bufs[1], len);
+    for (int i = pg_minsize; i < pg_size; i++)
+        assert(memcmp(bufs[0][i], bufs[1][i], len) == 0);
+    for (int b = 0; b < 2; b++)
+        for (int i = 0; i < pg_size; i++)
+            free(bufs[b][i]);
+    use_jerasure(pg_size, pg_minsize, false);
+    printf("isa-l encoding matches jerasure\n");
+}
+#endif
@@ -0,0 +1,677 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd_primary.h"
+#include "base64.h"
+
+// Background deep scrub
+//
+// The primary OSD scrubs its active+clean PGs one by one, <scrub_interval> seconds after
+// the previous scrub of each PG. Objects are listed from the local blockstore page by page
+// and up to <scrub_queue_depth> of them are checked in parallel by OSD_OP_SCRUB operations,
+// each of which reads all copies (or all EC chunks) of an object and compares them.
+// Scrub doesn't run while recovery is in progress, pauses while client latency is above
+// <recovery_client_latency_target> and is limited by <scrub_bandwidth_limit> and <scrub_iops_limit>.
+// Results and the time of the last scrub of each PG are saved in /pg/scrub/<pool>/<pg>.
+
+void osd_t::continue_primary_scrub(osd_op_t *cur_op)
+{
+    if (!cur_op->op_data && !prepare_primary_rw(cur_op))
+    {
+        return;
+    }
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    auto & pg = get_pg(INODE_POOL(op_data->oid.inode), op_data->pg_num);
+    if (op_data->st == 1)      goto resume_1;
+    else if (op_data->st == 2) goto resume_2;
+    else if (op_data->st == 3) goto resume_3;
+    assert(op_data->st == 0);
+    // Only copies of clean objects are expected to be identical
+    if (pg.state != PG_ACTIVE)
+    {
+        finish_op(cur_op, -EBUSY);
+        return;
+    }
+    // Wait for writes to the object so that all copies are read at the same version
+    if (!check_write_queue(cur_op, pg))
+    {
+        return;
+    }
+resume_1:
+    if (pg.state != PG_ACTIVE)
+    {
+        cur_op->reply.hdr.retval = -EBUSY;
+        goto continue_others;
+    }
+    // Retvals and versions of all copies, freed with the operation
+    cur_op->rmw_buf = malloc_or_die(pg.pg_size * (sizeof(int) + sizeof(uint64_t)));
+    op_data->scrub_versions = (uint64_t*)cur_op->rmw_buf;
+    op_data->scrub_retvals = (int*)(op_data->scrub_versions + pg.pg_size);
+    for (int role = 0; role < pg.pg_size; role++)
+    {
+        op_data->stripes[role].read_start = 0;
+        op_data->stripes[role].read_end = bs_block_size;
+    }
+    cur_op->buf = alloc_read_buffer(op_data->stripes, pg.pg_size, 0);
+    submit_scrub_subops(cur_op, pg);
+    op_data->st = 2;
+resume_2:
+    return;
+resume_3:
+    if (op_data->epipe > 0 || pg.state != PG_ACTIVE)
+    {
+        cur_op->reply.hdr.retval = -EPIPE;
+        goto continue_others;
+    }
+    {
+        osd_num_t bad_osds[pg.pg_size];
+        int bad_count = check_scrub_results(cur_op, pg, bad_osds);
+        // Return OSD numbers of inconsistent copies in the read buffer, it's not needed anymore
+        memcpy(cur_op->buf, bad_osds, sizeof(osd_num_t) * bad_count);
+        cur_op->reply.hdr.retval = bad_count;
+    }
+continue_others:
+    osd_op_t *next_op = NULL;
+    if (pg.write_queue.first(op_data->oid) == cur_op)
+    {
+        next_op = pg.write_queue.pop(op_data->oid);
+    }
+    finish_op(cur_op, cur_op->reply.hdr.retval);
+    if (next_op)
+    {
+        continue_primary_op(next_op);
+    }
+}
+
+// Read the whole object from every OSD of the PG: the same object from all replicas
+// in replicated pools or all chunks in EC pools. Subop <i> always reads role <i>
+void osd_t::submit_scrub_subops(osd_op_t *cur_op, pg_t & pg)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    bool rep = op_data->scheme == POOL_SCHEME_REPLICATED;
+    // Versions are compared in check_scrub_results(), don't check them in handle_primary_subop()
+    op_data->fact_ver = UINT64_MAX;
+    op_data->done = op_data->errors = op_data->epipe = 0;
+    op_data->n_subops = pg.pg_size;
+    op_data->subops = new osd_op_t[pg.pg_size];
+    for (int role = 0; role < pg.pg_size; role++)
+    {
+        osd_num_t role_osd_num = pg.cur_set[role];
+        osd_rmw_stripe_t & stripe = op_data->stripes[role];
+        osd_op_t *subop = op_data->subops + role;
+        object_id oid = {
+            .inode = op_data->oid.inode,
+            .stripe = op_data->oid.stripe | (rep ? 0 : role),
+        };
+        subop->bitmap = stripe.bmp_buf;
+        subop->bitmap_len = clean_entry_bitmap_size;
+        if (role_osd_num == this->osd_num)
+        {
+            clock_gettime(CLOCK_REALTIME, &subop->tv_begin);
+            subop->op_type = (uint64_t)cur_op;
+            subop->bs_op = new blockstore_op_t({
+                .opcode = BS_OP_READ,
+                .callback = [subop, this](blockstore_op_t *bs_subop)
+                {
+                    handle_primary_bs_subop(subop);
+                },
+                .oid = oid,
+                .version = UINT64_MAX,
+                .offset = 0,
+                .len = bs_block_size,
+                .buf = stripe.read_buf,
+                .bitmap = stripe.bmp_buf,
+                .priority = BS_PRIO_SCRUB,
+            });
+            bs->enqueue_op(subop->bs_op);
+        }
+        else
+        {
+            subop->op_type = OSD_OP_OUT;
+            subop->peer_fd = msgr.get_peer_fd(role_osd_num, oid.inode ^ oid.stripe);
+            subop->req.sec_rw = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = msgr.next_subop_id++,
+                    .opcode = OSD_OP_SEC_READ,
+                },
+                .oid = oid,
+                .version = UINT64_MAX,
+                .offset = 0,
+                .len = bs_block_size,
+                .priority = BS_PRIO_SCRUB,
+            };
+            subop->iov.push_back(stripe.read_buf, bs_block_size);
+            subop->callback = [cur_op, this](osd_op_t *subop)
+            {
+                handle_primary_subop(subop, cur_op);
+            };
+            msgr.outbox_push(subop);
+        }
+    }
+}
+
+// Compare copies of the object and return OSDs holding inconsistent ones.
+// Copies which can't be read (for example, failing the blockstore checksum check)
+// or having a version different from the most common one are always inconsistent.
+// Replicas are then grouped by contents and all outside the largest group are
+// inconsistent. EC parity chunks are recalculated from data chunks and compared.
+// If there's no majority or all parity chunks differ, the faulty copy can't be
+// determined and all copies are reported
+int osd_t::check_scrub_results(osd_op_t *cur_op, pg_t & pg, osd_num_t *bad_osds)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    osd_rmw_stripe_t *stripes = op_data->stripes;
+    int n = pg.pg_size;
+    bool bad[n];
+    int ok = 0;
+    for (int role = 0; role < n; role++)
+    {
+        bad[role] = op_data->scrub_retvals[role] != bs_block_size;
+        ok += !bad[role];
+    }
+    // Find the most common version
+    uint64_t version = 0;
+    int version_count = 0;
+    for (int role = 0; role < n; role++)
+    {
+        if (bad[role])
+            continue;
+        int count = 0;
+        for (int other = 0; other < n; other++)
+            count += !bad[other] && op_data->scrub_versions[other] == op_data->scrub_versions[role];
+        if (count > version_count)
+        {
+            version = op_data->scrub_versions[role];
+            version_count = count;
+        }
+    }
+    for (int role = 0; role < n; role++)
+    {
+        if (!bad[role] && op_data->scrub_versions[role] != version)
+        {
+            bad[role] = true;
+            ok--;
+        }
+    }
+    cur_op->reply.rw.version = version;
+    bool all = false;
+    if (op_data->scheme == POOL_SCHEME_REPLICATED)
+    {
+        // Group identical replicas: group[i] = the first replica equal to i
+        int group[n], best = -1, best_count = 0;
+        for (int role = 0; role < n; role++)
+        {
+            group[role] = -1;
+            if (bad[role])
+                continue;
+            for (int other = 0; other < role && group[role] < 0; other++)
+            {
+                if (group[other] == other &&
+                    !memcmp(stripes[role].read_buf, stripes[other].read_buf, bs_block_size) &&
+                    !memcmp(stripes[role].bmp_buf, stripes[other].bmp_buf, clean_entry_bitmap_size))
+                {
+                    group[role] = other;
+                }
+            }
+            if (group[role] < 0)
+                group[role] = role;
+            int count = 0;
+            for (int other = 0; other <= role; other++)
+                count += group[other] == group[role];
+            if (count > best_count)
+            {
+                best = group[role];
+                best_count = count;
+            }
+        }
+        if (best_count*2 <= ok)
+            all = true;
+        else
+            for (int role = 0; role < n; role++)
+                bad[role] = bad[role] || group[role] != best;
+    }
+    else
+    {
+        int pg_minsize = pg.pg_data_size;
+        bool data_ok = true;
+        for (int role = 0; role < pg_minsize; role++)
+            data_ok = data_ok && !bad[role];
+        if (data_ok)
+        {
+            int parity_count = n-pg_minsize;
+            void *parity_buf = memalign_or_die(MEM_ALIGNMENT, parity_count * (bs_block_size + clean_entry_bitmap_size));
+            void *parity_bufs[parity_count], *parity_bmps[parity_count];
+            for (int i = 0; i < parity_count; i++)
+            {
+                parity_bufs[i] = parity_buf + i*bs_block_size;
+                parity_bmps[i] = parity_buf + parity_count*bs_block_size + i*clean_entry_bitmap_size;
+            }
+            if (op_data->scheme == POOL_SCHEME_XOR)
+                calc_full_parity_xor(stripes, n, parity_bufs, parity_bmps, bs_block_size, clean_entry_bitmap_size);
+            else
+                calc_full_parity_jerasure(stripes, n, pg_minsize, parity_bufs, parity_bmps, bs_block_size, clean_entry_bitmap_size);
+            int mismatch = 0, checked = 0;
+            bool parity_bad[parity_count];
+            for (int i = 0; i < parity_count; i++)
+            {
+                parity_bad[i] = false;
+                if (bad[pg_minsize+i])
+                    continue;
+                checked++;
+                if (memcmp(parity_bufs[i], stripes[pg_minsize+i].read_buf, bs_block_size) ||
+                    memcmp(parity_bmps[i], stripes[pg_minsize+i].bmp_buf, clean_entry_bitmap_size))
+                {
+                    parity_bad[i] = true;
+                    mismatch++;
+                }
+            }
+            free(parity_buf);
+            if (mismatch > 0 && mismatch == checked)
+                all = true;
+            else
+                for (int i = 0; i < parity_count; i++)
+                    bad[pg_minsize+i] = bad[pg_minsize+i] || parity_bad[i];
+        }
+    }
+    int bad_count = 0;
+    for (int role = 0; role < n; role++)
+    {
+        if (bad[role] || all)
+            bad_osds[bad_count++] = pg.cur_set[role];
+    }
+    return bad_count;
+}
+
+void osd_t::load_scrub_times()
+{
+    auto & ss = scrub_sched;
+    ss.loading = true;
+    st_cli.etcd_txn(json11::Json::object {
+        { "success", json11::Json::array {
+            json11::Json::object {
+                { "request_range", json11::Json::object {
+                    { "key", base64_encode(st_cli.etcd_prefix+"/pg/scrub/") },
+                    { "range_end", base64_encode(st_cli.etcd_prefix+"/pg/scrub0") },
+                } },
+            },
+        } },
+    }, ETCD_SLOW_TIMEOUT, [this](std::string err, json11::Json data)
+    {
+        auto & ss = scrub_sched;
+        ss.loading = false;
+        ss.load_time = time(NULL);
+        if (err != "")
+        {
+            printf("[OSD %lu] Error loading PG scrub times from etcd: %s\n", osd_num, err.c_str());
+            return;
+        }
+        for (auto & res: data["responses"].array_items())
+        {
+            for (auto & kv_json: res["response_range"]["kvs"].array_items())
+            {
+                auto kv = st_cli.parse_etcd_kv(kv_json);
+                // <etcd_prefix>/pg/scrub/%d/%d
+                pool_id_t pool_id = 0;
+                pg_num_t pg_num = 0;
+                char null_byte = 0;
+                sscanf(kv.key.c_str() + st_cli.etcd_prefix.length()+10, "%u/%u%c", &pool_id, &pg_num, &null_byte);
+                if (pool_id && pg_num && !null_byte)
+                {
+                    // Keep the time of scrubs finished while loading
+                    uint64_t & last = ss.last_scrub[(pool_pg_num_t){ .pool_id = pool_id, .pg_num = pg_num }];
+                    last = std::max(last, kv.value["time"].uint64_value());
+                }
+            }
+        }
+        ss.loaded = true;
+        continue_scrub();
+    });
+}
+
+// Pick the active+clean PG which wasn't scrubbed for the longest time, if it's due
+bool osd_t::pick_next_scrub_pg()
+{
+    auto & ss = scrub_sched;
+    time_t now = time(NULL);
+    pool_pg_num_t best = { 0 };
+    uint64_t best_time = UINT64_MAX;
+    for (auto & pp: pgs)
+    {
+        if (pp.second.state != PG_ACTIVE)
+            continue;
+        auto last_it = ss.last_scrub.find(pp.first);
+        uint64_t last = last_it != ss.last_scrub.end() ? last_it->second : 0;
+        if (last + scrub_interval <= now && last < best_time)
+        {
+            best = pp.first;
+            best_time = last;
+        }
+    }
+    if (!best.pool_id)
+    {
+        return false;
+    }
+    if (!ss.loaded || now >= ss.load_time + etcd_report_interval)
+    {
+        // The PG may have been scrubbed by its previous primary OSD, reload times first
+        load_scrub_times();
+        return false;
+    }
+    ss.pg = best;
+    clock_gettime(CLOCK_REALTIME, &ss.start_time);
+    ss.objects.clear();
+    ss.pos = 0;
+    ss.next_start = { 0 };
+    ss.last_oid = { 0 };
+    ss.listed_all = false;
+    ss.checked = ss.skipped = ss.inconsistent = 0;
+    ss.inconsistent_objects.clear();
+    if (log_level > 0)
+    {
+        printf("[OSD %lu] Scrubbing PG %u/%u\n", osd_num, best.pool_id, best.pg_num);
+    }
+    return true;
+}
+
+void osd_t::list_scrub_objects(pg_t & pg)
+{
+    auto & ss = scrub_sched;
+    blockstore_list_page_t *page = (blockstore_list_page_t*)malloc_or_die(sizeof(blockstore_list_page_t));
+    *page = (blockstore_list_page_t){
+        .start = ss.next_start,
+        .max_count = SCRUB_LIST_PAGE_SIZE,
+    };
+    ss.listing = true;
+    blockstore_op_t *op = new blockstore_op_t();
+    op->opcode = BS_OP_LIST;
+    op->oid.stripe = st_cli.pool_config.at(pg.pool_id).pg_stripe_size;
+    op->len = pg_counts[pg.pool_id];
+    op->offset = pg.pg_num - 1;
+    op->oid.inode = ((uint64_t)pg.pool_id << (64 - POOL_ID_BITS));
+    op->version = ((uint64_t)(pg.pool_id+1) << (64 - POOL_ID_BITS)) - 1;
+    op->bitmap = page;
+    op->callback = [this, page](blockstore_op_t *op)
+    {
+        auto & ss = scrub_sched;
+        ss.listing = false;
+        int total = op->retval;
+        obj_ver_id *list = (obj_ver_id*)op->buf;
+        if (total < 0)
+        {
+            printf(
+                "[OSD %lu] Failed to list objects of PG %u/%u for scrub: %d (%s)\n",
+                osd_num, ss.pg.pool_id, ss.pg.pg_num, total, strerror(-total)
+            );
+            ss.listed_all = true;
+        }
+        else
+        {
+            // Objects may be listed multiple times (with different versions or EC chunk numbers)
+            for (int i = 0; i < total; i++)
+                list[i].oid.stripe &= ~STRIPE_MASK;
+            std::sort(list, list+total);
+            ss.objects.clear();
+            ss.pos = 0;
+            for (int i = 0; i < total; i++)
+            {
+                // Deleted objects are listed with version 0. Pages are split by chunk OIDs, so
+                // other chunks of objects already scrubbed may start the next page
+                if (list[i].version != 0 && (!ss.objects.size() || !(ss.objects.back() == list[i].oid)) &&
+                    (!ss.last_oid.inode || ss.last_oid < list[i].oid))
+                {
+                    ss.objects.push_back(list[i].oid);
+                }
+            }
+            ss.next_start = page->next;
+            ss.listed_all = !page->next.inode;
+        }
+        free(list);
+        free(page);
+        delete op;
+        continue_scrub();
+    };
+    bs->enqueue_op(op);
+}
+
+// Check if the average client latency over the last RECOVERY_TUNE_INTERVAL_MS is above
+// <recovery_client_latency_target>. Unlike tune_recovery(), it doesn't change the recovery
+// queue depth, scrub just waits for the next check
+bool osd_t::scrub_latency_high()
+{
+    auto & ss = scrub_sched;
+    if (!recovery_client_latency_target)
+    {
+        return false;
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (ss.lat_time.tv_sec && (now.tv_sec - ss.lat_time.tv_sec)*1000 +
+        (now.tv_nsec - ss.lat_time.tv_nsec)/1000000 < RECOVERY_TUNE_INTERVAL_MS)
+    {
+        return ss.lat_high;
+    }
+    uint64_t lat_sum = msgr.stats.op_stat_sum[OSD_OP_READ] + msgr.stats.op_stat_sum[OSD_OP_WRITE];
+    uint64_t lat_count = msgr.stats.op_stat_count[OSD_OP_READ] + msgr.stats.op_stat_count[OSD_OP_WRITE];
+    // Statistics may be reset in-between
+    ss.lat_high = ss.lat_time.tv_sec && lat_count > ss.lat_count && lat_sum >= ss.lat_sum &&
+        (lat_sum - ss.lat_sum) / (lat_count - ss.lat_count) > recovery_client_latency_target;
+    ss.lat_time = now;
+    ss.lat_sum = lat_sum;
+    ss.lat_count = lat_count;
+    return ss.lat_high;
+}
+
+// Same as throttle_recovery(), but the cost of an object is charged in advance
+bool osd_t::throttle_scrub()
+{
+    auto & ss = scrub_sched;
+    if (!scrub_bandwidth_limit && !scrub_iops_limit)
+    {
+        return false;
+    }
+    if (ss.timer_id >= 0)
+    {
+        return true;
+    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!ss.refill_time.tv_sec)
+    {
+        ss.bytes_tokens = scrub_bandwidth_limit;
+        ss.iops_tokens = scrub_iops_limit;
+    }
+    else
+    {
+        double elapsed = (now.tv_sec - ss.refill_time.tv_sec) + (now.tv_nsec - ss.refill_time.tv_nsec)/1000000000.0;
+        ss.bytes_tokens = std::min(ss.bytes_tokens + elapsed*scrub_bandwidth_limit, (double)scrub_bandwidth_limit);
+        ss.iops_tokens = std::min(ss.iops_tokens + elapsed*scrub_iops_limit, (double)scrub_iops_limit);
+    }
+    ss.refill_time = now;
+    double wait = 0;
+    if (scrub_bandwidth_limit && ss.bytes_tokens < 0)
+        wait = -ss.bytes_tokens / scrub_bandwidth_limit;
+    if (scrub_iops_limit && ss.iops_tokens < 1)
+        wait = std::max(wait, (1-ss.iops_tokens) / scrub_iops_limit);
+    if (wait <= 0)
+    {
+        return false;
+    }
+    ss.timer_id = tfd->set_timer((int)(wait*1000)+1, false, [this](int timer_id)
+    {
+        scrub_sched.timer_id = -1;
+        continue_scrub();
+    });
+    return true;
+}
+
+void osd_t::submit_scrub_op(object_id oid, pg_t & pg)
+{
+    auto & ss = scrub_sched;
+    osd_op_t *op = new osd_op_t();
+    op->op_type = OSD_OP_OUT;
+    op->req = (osd_any_op_t){
+        .rw = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = 1,
+                .opcode = OSD_OP_SCRUB,
+            },
+            .inode = oid.inode,
+            .offset = oid.stripe,
+            .len = 0,
+        },
+    };
+    uint64_t bytes = pg.pg_size * bs_block_size;
+    op->callback = [this, bytes](osd_op_t *op)
+    {
+        auto & ss = scrub_sched;
+        int retval = op->reply.hdr.retval;
+        if (retval < 0)
+        {
+            // PG is inactive or one of the OSDs is gone, the scrub of the PG is then restarted later
+            ss.skipped++;
+        }
+        else
+        {
+            ss.checked++;
+            ss.stat_count++;
+            ss.stat_bytes += bytes;
+        }
+        if (retval > 0)
+        {
+            json11::Json::array osds;
+            std::string osd_str;
+            for (int i = 0; i < retval; i++)
+            {
+                osd_num_t bad_osd = ((osd_num_t*)op->buf)[i];
+                osds.push_back(bad_osd);
+                osd_str += (i > 0 ? ", " : "")+std::to_string(bad_osd);
+            }
+            printf(
+                "[OSD %lu] Scrub found inconsistent object %lx:%lx v%lu on OSD(s) %s\n",
+                osd_num, op->req.rw.inode, op->req.rw.offset, op->reply.rw.version, osd_str.c_str()
+            );
+            ss.inconsistent++;
+            ss.stat_inconsistent++;
+            if (ss.inconsistent_objects.size() < SCRUB_MAX_REPORTED_OBJECTS)
+            {
+                ss.inconsistent_objects.push_back(json11::Json::object {
+                    { "inode", (uint64_t)op->req.rw.inode },
+                    { "stripe", (uint64_t)op->req.rw.offset },
+                    { "version", (uint64_t)op->reply.rw.version },
+                    { "osds", osds },
+                });
+            }
+        }
+        ss.inflight--;
+        delete op;
+        continue_scrub();
+    };
+    ss.inflight++;
+    ss.iops_tokens--;
+    ss.bytes_tokens -= bytes;
+    exec_op(op);
+}
+
+void osd_t::finish_pg_scrub()
+{
+    auto & ss = scrub_sched;
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ss.last_scrub[ss.pg] = now.tv_sec;
+    printf(
+        "[OSD %lu] PG %u/%u scrubbed: %lu objects checked, %lu inconsistent, %lu skipped\n",
+        osd_num, ss.pg.pool_id, ss.pg.pg_num, ss.checked, ss.inconsistent, ss.skipped
+    );
+    json11::Json::object result = {
+        { "time", (uint64_t)now.tv_sec },
+        { "duration", (uint64_t)(now.tv_sec - ss.start_time.tv_sec) },
+        { "primary", osd_num },
+        { "object_count", ss.checked },
+        { "skipped_count", ss.skipped },
+        { "inconsistent_count", ss.inconsistent },
+        { "inconsistent", ss.inconsistent_objects },
+    };
+    std::string key = "/pg/scrub/"+std::to_string(ss.pg.pool_id)+"/"+std::to_string(ss.pg.pg_num);
+    st_cli.etcd_txn(json11::Json::object {
+        { "success", json11::Json::array {
+            json11::Json::object {
+                { "request_put", json11::Json::object {
+                    { "key", base64_encode(st_cli.etcd_prefix+key) },
+                    { "value", base64_encode(json11::Json(result).dump()) },
+                } },
+            },
+        } },
+    }, ETCD_SLOW_TIMEOUT, [this, key](std::string err, json11::Json res)
+    {
+        if (err != "")
+        {
+            printf("[OSD %lu] Error reporting scrub results to etcd %s: %s\n", osd_num, key.c_str(), err.c_str());
+        }
+    });
+    ss.pg = { 0 };
+    ss.objects.clear();
+    ss.inconsistent_objects.clear();
+}
+
+void osd_t::continue_scrub()
+{
+    auto & ss = scrub_sched;
+    if (!scrub_interval || stopping || ss.loading || !st_cli.etcd_addresses.size())
+    {
+        return;
+    }
+    if (!ss.pg.pool_id && !pick_next_scrub_pg())
+    {
+        return;
+    }
+    pg_t *pg = find_pg(ss.pg.pool_id, ss.pg.pg_num);
+    if (!pg || pg->state != PG_ACTIVE)
+    {
+        // PG is stopped or isn't clean anymore, it'll be scrubbed from the beginning later
+        if (!ss.inflight && !ss.listing)
+        {
+            if (log_level > 0)
+                printf("[OSD %lu] Scrub of PG %u/%u interrupted\n", osd_num, ss.pg.pool_id, ss.pg.pg_num);
+            ss.pg = { 0 };
+            ss.objects.clear();
+            ss.inconsistent_objects.clear();
+        }
+        return;
+    }
+    // Recovery and client I/O go first
+    if (recovery_ops.size() > 0 || recovery_sched.timer_id >= 0 || scrub_latency_high())
+    {
+        return;
+    }
+    pool_pg_num_t cur_pg = ss.pg;
+    while (ss.inflight < scrub_queue_depth && ss.pg.pool_id == cur_pg.pool_id && ss.pg.pg_num == cur_pg.pg_num)
+    {
+        if (ss.pos >= ss.objects.size())
+        {
+            if (ss.listing)
+            {
+                return;
+            }
+            if (!ss.listed_all)
+            {
+                list_scrub_objects(*pg);
+                return;
+            }
+            if (!ss.inflight)
+            {
+                finish_pg_scrub();
+            }
+            return;
+        }
+        if (throttle_scrub())
+        {
+            return;
+        }
+        // Scrub operations may complete synchronously and call continue_scrub() recursively,
+        // it may finish this PG and start another one, so the loop checks the current PG
+        ss.last_oid = ss.objects[ss.pos++];
+        submit_scrub_op(ss.last_oid, *pg);
+    }
+}
@@ -28,6 +28,21 @@ void osd_t::secondary_op_callback(osd_op_t *op)
     }
     else if (op->req.hdr.opcode == OSD_OP_SEC_LIST)
     {
+        if (op->req.sec_list.flags & OSD_LIST_CHANGED)
+        {
+            // op->buf is the list of changed objects received with the request
+            if (op->bs_op->retval > 0)
+            {
+                uint64_t total_count = op->bs_op->retval;
+                filter_changed_objects(
+                    (obj_ver_id*)op->bs_op->buf, total_count, op->bs_op->version,
+                    (object_id*)op->buf, op->req.sec_list.changed_len / sizeof(object_id), op->reply.sec_list.other
+                );
+                op->bs_op->retval = total_count;
+            }
+            if (op->buf)
+                free(op->buf);
+        }
         // allocated by blockstore
         op->buf = op->bs_op->buf;
         if (op->bs_op->retval > 0)
@@ -35,6 +50,10 @@ void osd_t::secondary_op_callback(osd_op_t *op)
             op->iov.push_back(op->buf, op->bs_op->retval * sizeof(obj_ver_id));
         }
         op->reply.sec_list.stable_count = op->bs_op->version;
+        if (op->bs_op->bitmap)
+        {
+            op->reply.sec_list.next_oid = ((blockstore_list_page_t*)op->bs_op->bitmap)->next;
+        }
     }
     int retval = op->bs_op->retval;
     delete op->bs_op;
@@ -74,6 +93,10 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         : (cur_op->req.hdr.opcode == OSD_OP_SEC_DELETE ? BS_OP_DELETE
         : (cur_op->req.hdr.opcode == OSD_OP_SEC_LIST ? BS_OP_LIST
         : -1))))))));
+    if (cur_op->trace)
+    {
+        cur_op->bs_op->trace = &cur_op->trace->bs;
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)
@@ -94,8 +117,17 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         cur_op->bs_op->len = cur_op->req.sec_rw.len;
         cur_op->bs_op->buf = cur_op->buf;
         cur_op->bs_op->bitmap = cur_op->bitmap;
+        cur_op->bs_op->priority = cur_op->req.sec_rw.priority;
 #ifdef OSD_STUB
         cur_op->bs_op->retval = cur_op->bs_op->len;
+#else
+        cur_op->reply.sec_rw.pipeline_done = 0;
+        // Only forward if pipelining is enabled here too, otherwise the primary writes to the rest itself
+        if (pipeline_replication_threshold > 0 && cur_op->req.hdr.opcode != OSD_OP_SEC_READ &&
+            cur_op->req.sec_rw.pipeline[0])
+        {
+            forward_pipelined_write(cur_op);
+        }
 #endif
     }
     else if (cur_op->req.hdr.opcode == OSD_OP_SEC_DELETE)
@@ -130,6 +162,17 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         cur_op->bs_op->offset = cur_op->req.sec_list.list_pg - 1;
         cur_op->bs_op->oid.inode = cur_op->req.sec_list.min_inode;
         cur_op->bs_op->version = cur_op->req.sec_list.max_inode;
+        if (cur_op->req.sec_list.max_count)
+        {
+            blockstore_list_page_t *page = (blockstore_list_page_t*)malloc_or_die(sizeof(blockstore_list_page_t));
+            *page = (blockstore_list_page_t){
+                .start = cur_op->req.sec_list.start_oid,
+                .max_count = cur_op->req.sec_list.max_count,
+            };
+            // freed with the operation
+            cur_op->rmw_buf = page;
+            cur_op->bs_op->bitmap = page;
+        }
 #ifdef OSD_STUB
         cur_op->bs_op->retval = 0;
         cur_op->bs_op->buf = NULL;
@@ -142,6 +185,172 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
 #endif
 }
 
+// Pipelined replication: pass the write to the next OSD of the pipeline while writing it
+// locally and reply when both are done. The primary writes to OSDs not reached this way itself
+void osd_t::forward_pipelined_write(osd_op_t *cur_op)
+{
+    osd_num_t next_osd = cur_op->req.sec_rw.pipeline[0];
+    int pipeline_len = 0;
+    while (pipeline_len < OSD_SEC_PIPELINE_MAX && cur_op->req.sec_rw.pipeline[pipeline_len])
+        pipeline_len++;
+    if (msgr.osd_peer_fds.find(next_osd) == msgr.osd_peer_fds.end())
+    {
+        // Connect so that the pipeline works for next writes
+        if (msgr.wanted_peers.find(next_osd) == msgr.wanted_peers.end() &&
+            st_cli.peer_states.find(next_osd) != st_cli.peer_states.end())
+        {
+            msgr.connect_peer(next_osd, st_cli.peer_states[next_osd]);
+        }
+        return;
+    }
+    osd_op_t *fwd = new osd_op_t();
+    fwd->op_type = OSD_OP_OUT;
+    fwd->peer_fd = msgr.get_peer_fd(next_osd, cur_op->req.sec_rw.oid.inode ^ (cur_op->req.sec_rw.oid.stripe & ~STRIPE_MASK));
+    fwd->trace_id = cur_op->trace_id;
+    fwd->bitmap = cur_op->bitmap;
+    fwd->bitmap_len = cur_op->req.sec_rw.attr_len;
+    fwd->req.sec_rw = cur_op->req.sec_rw;
+    fwd->req.sec_rw.header.id = msgr.next_subop_id++;
+    memmove(fwd->req.sec_rw.pipeline, fwd->req.sec_rw.pipeline+1, sizeof(osd_num_t)*(OSD_SEC_PIPELINE_MAX-1));
+    fwd->req.sec_rw.pipeline[OSD_SEC_PIPELINE_MAX-1] = 0;
+    if (cur_op->req.sec_rw.len > 0)
+    {
+        fwd->iov.push_back(cur_op->buf, cur_op->req.sec_rw.len);
+    }
+    // Buffers of cur_op are shared with the forwarded write, so reply only after both are done
+    int *pending = new int(2);
+    auto done = [this, cur_op, pending]()
+    {
+        if (!--(*pending))
+        {
+            delete pending;
+            secondary_op_callback(cur_op);
+        }
+    };
+    cur_op->bs_op->callback = [done](blockstore_op_t *bs_op)
+    {
+        done();
+    };
+    fwd->callback = [cur_op, pipeline_len, done](osd_op_t *fwd)
+    {
+        if (fwd->reply.hdr.retval == fwd->req.sec_rw.len)
+        {
+            uint32_t next_done = 1 + fwd->reply.sec_rw.pipeline_done;
+            cur_op->reply.sec_rw.pipeline_done = next_done < pipeline_len ? next_done : pipeline_len;
+        }
+        delete fwd;
+        done();
+    };
+    msgr.outbox_push(fwd);
+}
+
+struct osd_sec_batch_state_t
+{
+    blockstore_op_t *bs_ops;
+    int pending;
+    uint64_t reply_len;
+};
+
+// Execute small reads and writes of different objects sent in one operation (see queue_subop())
+// and reply when all of them are done. Each of them has its own result
+void osd_t::exec_sec_batch(osd_op_t *cur_op)
+{
+    uint64_t count = cur_op->req.sec_batch.count;
+    osd_sec_batch_item_t *items = (osd_sec_batch_item_t*)cur_op->buf;
+    uint64_t desc_len = count*sizeof(osd_sec_batch_item_t), data_len = 0;
+    uint64_t res_len = count*sizeof(osd_sec_batch_result_t), read_len = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        bool rd = items[i].opcode == OSD_OP_SEC_READ;
+        if (!rd && items[i].opcode != OSD_OP_SEC_WRITE && items[i].opcode != OSD_OP_SEC_WRITE_STABLE ||
+            items[i].len > OSD_SEC_BATCH_ITEM_MAX ||
+            items[i].len % bs_bitmap_granularity ||
+            items[i].offset % bs_bitmap_granularity ||
+            items[i].attr_len != clean_entry_bitmap_size)
+        {
+            finish_op(cur_op, -EINVAL);
+            return;
+        }
+        if (!rd && readonly)
+        {
+            finish_op(cur_op, -EROFS);
+            return;
+        }
+        if (rd)
+        {
+            res_len += items[i].attr_len;
+            read_len += items[i].len;
+        }
+        else
+        {
+            desc_len += items[i].attr_len;
+            data_len += items[i].len;
+        }
+    }
+    res_len = ((res_len + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT) * MEM_ALIGNMENT;
+    if (desc_len > cur_op->req.sec_batch.desc_len || data_len != cur_op->req.sec_batch.data_len ||
+        res_len+read_len > OSD_RW_MAX)
+    {
+        finish_op(cur_op, -EINVAL);
+        return;
+    }
+    // freed with the operation
+    cur_op->rmw_buf = memalign_or_die(MEM_ALIGNMENT, res_len+read_len);
+    memset(cur_op->rmw_buf, 0, res_len);
+    void *wr_bmp = cur_op->buf + count*sizeof(osd_sec_batch_item_t);
+    void *wr_data = cur_op->buf + cur_op->req.sec_batch.desc_len;
+    void *rd_bmp = cur_op->rmw_buf + count*sizeof(osd_sec_batch_result_t);
+    void *rd_data = cur_op->rmw_buf + res_len;
+    blockstore_op_t *bs_ops = new blockstore_op_t[count];
+    // Blockstore callbacks can only capture 32 bytes, so the rest is kept here
+    osd_sec_batch_state_t *state = new osd_sec_batch_state_t({
+        .bs_ops = bs_ops,
+        .pending = (int)count,
+        .reply_len = res_len+read_len,
+    });
+    for (uint64_t i = 0; i < count; i++)
+    {
+        bool rd = items[i].opcode == OSD_OP_SEC_READ;
+        bs_ops[i].opcode = rd ? BS_OP_READ : (items[i].opcode == OSD_OP_SEC_WRITE ? BS_OP_WRITE : BS_OP_WRITE_STABLE);
+        bs_ops[i].oid = items[i].oid;
+        bs_ops[i].version = items[i].version;
+        bs_ops[i].offset = items[i].offset;
+        bs_ops[i].len = items[i].len;
+        bs_ops[i].priority = items[i].priority;
+        bs_ops[i].bitmap = rd ? rd_bmp : wr_bmp;
+        bs_ops[i].buf = rd ? rd_data : wr_data;
+        if (rd)
+        {
+            rd_bmp += items[i].attr_len;
+            rd_data += items[i].len;
+        }
+        else
+        {
+            wr_bmp += items[i].attr_len;
+            wr_data += items[i].len;
+        }
+        bs_ops[i].callback = [this, cur_op, state, i](blockstore_op_t *bs_op)
+        {
+            osd_sec_batch_result_t *results = (osd_sec_batch_result_t*)cur_op->rmw_buf;
+            results[i].retval = bs_op->retval;
+            results[i].version = bs_op->version;
+            if (!--state->pending)
+            {
+                uint64_t reply_len = state->reply_len;
+                delete[] state->bs_ops;
+                delete state;
+                cur_op->iov.push_back(cur_op->rmw_buf, reply_len);
+                finish_op(cur_op, reply_len);
+            }
+        };
+    }
+    // The last callback frees bs_ops, but only after all of them are enqueued
+    for (uint64_t i = 0; i < count; i++)
+    {
+        bs->enqueue_op(&bs_ops[i]);
+    }
+}
+
 void osd_t::exec_show_config(osd_op_t *cur_op)
 {
     std::string json_err;
@@ -169,12 +378,15 @@ void osd_t::exec_show_config(osd_op_t *cur_op)
         if (req_json["connect_rdma"].is_string())
         {
             // Peer is trying to connect using RDMA, try to satisfy him
-            bool ok = msgr.connect_rdma(cur_op->peer_fd, req_json["connect_rdma"].string_value(), req_json["rdma_max_msg"].uint64_value());
+            bool ok = msgr.connect_rdma(cur_op->peer_fd, req_json["connect_rdma"].string_value(),
+                req_json["rdma_max_msg"].uint64_value(), req_json["rdma_rendezvous"].bool_value());
             if (ok)
             {
                 auto rc = msgr.clients.at(cur_op->peer_fd)->rdma_conn;
                 wire_config["rdma_address"] = rc->addr.to_string();
                 wire_config["rdma_max_msg"] = rc->max_msg;
+                // Peer may send us rendezvous descriptors
+                wire_config["rdma_rendezvous"] = true;
             }
         }
     }
@@ -0,0 +1,154 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd.h"
+
+#include "json11/json11.hpp"
+
+const char* osd_trace_stage_names[] = {
+    "start",
+    "subops_sent",
+    "subops_done",
+    "sync_sent",
+    "sync_done",
+};
+
+void osd_t::trace_start(osd_op_t *cur_op)
+{
+    // Operations sent by other OSDs keep the trace ID of the client operation
+    uint64_t trace_id = cur_op->req.trace.trace_id;
+    if (!trace_id && (cur_op->req.hdr.opcode == OSD_OP_READ ||
+        cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+        cur_op->req.hdr.opcode == OSD_OP_SYNC ||
+        cur_op->req.hdr.opcode == OSD_OP_DELETE) && !(++trace_op_counter % trace_sample))
+    {
+        // Unique in the cluster: OSD number in the upper bits
+        trace_id = (osd_num << 40) | (++trace_seq & ((1l << 40) - 1));
+    }
+    if (!trace_id)
+    {
+        return;
+    }
+    cur_op->trace_id = trace_id;
+    cur_op->trace = (osd_op_trace_t*)calloc_or_die(1, sizeof(osd_op_trace_t));
+}
+
+void osd_t::trace_subop_done(osd_op_t *cur_op, osd_op_t *subop)
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint32_t usec = (now.tv_sec - subop->tv_begin.tv_sec)*1000000 + (now.tv_nsec - subop->tv_begin.tv_nsec)/1000;
+    if (usec >= cur_op->trace->subop_max_us)
+    {
+        cur_op->trace->subop_max_us = usec;
+        auto cl_it = subop->peer_fd >= 0 ? msgr.clients.find(subop->peer_fd) : msgr.clients.end();
+        cur_op->trace->subop_max_osd = cl_it != msgr.clients.end() ? cl_it->second->osd_num : this->osd_num;
+    }
+}
+
+void osd_t::trace_finish(osd_op_t *cur_op, int retval)
+{
+    if (trace_ring.size() != trace_buffer_size)
+    {
+        trace_ring.clear();
+        trace_ring.resize(trace_buffer_size);
+        trace_ring_count = 0;
+    }
+    osd_trace_record_t & rec = trace_ring[trace_ring_count % trace_ring.size()];
+    trace_ring_count++;
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    auto cl_it = cur_op->peer_fd ? msgr.clients.find(cur_op->peer_fd) : msgr.clients.end();
+    rec = (osd_trace_record_t){
+        .trace_id = cur_op->trace_id,
+        .opcode = cur_op->req.hdr.opcode,
+        .peer_osd = cl_it != msgr.clients.end() ? cl_it->second->osd_num : 0,
+        .retval = retval,
+        .tv_begin = cur_op->tv_begin,
+        .total_us = (uint32_t)((now.tv_sec - cur_op->tv_begin.tv_sec)*1000000 + (now.tv_nsec - cur_op->tv_begin.tv_nsec)/1000),
+        .trace = *cur_op->trace,
+    };
+    if (rec.opcode == OSD_OP_READ || rec.opcode == OSD_OP_WRITE || rec.opcode == OSD_OP_DELETE)
+    {
+        rec.inode = cur_op->req.rw.inode;
+        rec.offset = cur_op->req.rw.offset;
+        rec.len = cur_op->req.rw.len;
+    }
+    else if (rec.opcode == OSD_OP_SEC_READ || rec.opcode == OSD_OP_SEC_WRITE ||
+        rec.opcode == OSD_OP_SEC_WRITE_STABLE)
+    {
+        // Object (stripe with the role number) and the offset within it
+        rec.inode = cur_op->req.sec_rw.oid.inode;
+        rec.offset = cur_op->req.sec_rw.oid.stripe + cur_op->req.sec_rw.offset;
+        rec.len = cur_op->req.sec_rw.len;
+    }
+    else if (rec.opcode == OSD_OP_SEC_DELETE)
+    {
+        rec.inode = cur_op->req.sec_del.oid.inode;
+        rec.offset = cur_op->req.sec_del.oid.stripe;
+    }
+    free(cur_op->trace);
+    cur_op->trace = NULL;
+}
+
+void osd_t::exec_show_traces(osd_op_t *cur_op)
+{
+    uint64_t max_count = cur_op->req.show_traces.max_count;
+    uint64_t min_us = cur_op->req.show_traces.min_us;
+    json11::Json::array res;
+    uint64_t n = trace_ring_count < trace_ring.size() ? trace_ring_count : trace_ring.size();
+    // Newest first
+    for (uint64_t i = 0; i < n && (!max_count || res.size() < max_count); i++)
+    {
+        osd_trace_record_t & rec = trace_ring[(trace_ring_count-1-i) % trace_ring.size()];
+        if (rec.total_us < min_us)
+        {
+            continue;
+        }
+        json11::Json::object stages;
+        for (int s = 0; s < OSD_TRACE_STAGES; s++)
+        {
+            if (rec.trace.stage_mask & (1 << s))
+                stages[osd_trace_stage_names[s]] = (uint64_t)rec.trace.stage_us[s];
+        }
+        json11::Json::object item = json11::Json::object {
+            { "trace_id", rec.trace_id },
+            { "op", osd_op_names[rec.opcode] },
+            { "time", (double)rec.tv_begin.tv_sec + rec.tv_begin.tv_nsec/1000000000.0 },
+            { "total_us", (uint64_t)rec.total_us },
+            { "retval", rec.retval },
+            { "stages", stages },
+        };
+        if (rec.peer_osd)
+            item["peer_osd"] = rec.peer_osd;
+        if (rec.inode)
+        {
+            item["inode"] = rec.inode;
+            item["offset"] = rec.offset;
+            item["len"] = (uint64_t)rec.len;
+        }
+        if (rec.trace.subop_max_osd)
+        {
+            item["subop_max_us"] = (uint64_t)rec.trace.subop_max_us;
+            item["subop_max_osd"] = rec.trace.subop_max_osd;
+        }
+        if (rec.trace.bs.total_us)
+        {
+            item["bs"] = json11::Json::object {
+                { "queue_us", (uint64_t)rec.trace.bs.queue_us },
+                { "wait_sqe_us", (uint64_t)rec.trace.bs.wait_sqe_us },
+                { "wait_journal_us", (uint64_t)rec.trace.bs.wait_journal_us },
+                { "wait_free_us", (uint64_t)rec.trace.bs.wait_free_us },
+                { "total_us", (uint64_t)rec.trace.bs.total_us },
+            };
+        }
+        res.push_back(item);
+    }
+    if (cur_op->buf)
+        free(cur_op->buf);
+    std::string res_str = json11::Json(res).dump();
+    cur_op->buf = malloc_or_die(res_str.size()+1);
+    memcpy(cur_op->buf, res_str.c_str(), res_str.size()+1);
+    cur_op->iov.push_back(cur_op->buf, res_str.size()+1);
+    finish_op(cur_op, res_str.size()+1);
+}
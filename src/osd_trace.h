@@ -0,0 +1,56 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <time.h>
+#include "blockstore.h"
+#include "osd_id.h"
+
+// Operation tracing: a sample of client operations gets a trace ID which is propagated
+// to subops on other OSDs, every OSD records stage timestamps of traced operations and puts
+// them into a ring buffer when they complete. The buffer is read with OSD_OP_SHOW_TRACES.
+// Records with the same trace ID from different OSDs describe the same client operation
+
+// Stages of a traced operation, their times are counted from osd_op_t::tv_begin (exec_op())
+// Passed inode QoS limits and the write queue of the object
+#define OSD_TRACE_START 0
+// Read or write subops are sent (the last round for read-modify-write)
+#define OSD_TRACE_SUBOPS_SENT 1
+// The last read or write subop is completed
+#define OSD_TRACE_SUBOPS_DONE 2
+// Sync or stabilize subops are sent
+#define OSD_TRACE_SYNC_SENT 3
+// The last sync or stabilize subop is completed
+#define OSD_TRACE_SYNC_DONE 4
+#define OSD_TRACE_STAGES 5
+
+extern const char* osd_trace_stage_names[];
+
+#define DEFAULT_TRACE_BUFFER_SIZE 1024
+
+struct osd_op_trace_t
+{
+    uint32_t stage_us[OSD_TRACE_STAGES];
+    // Bit mask of reached stages
+    uint32_t stage_mask;
+    // The slowest subop, including network time for subops sent to other OSDs
+    uint32_t subop_max_us;
+    osd_num_t subop_max_osd;
+    // Local blockstore operation (the last one if there were several)
+    blockstore_op_trace_t bs;
+};
+
+struct osd_trace_record_t
+{
+    uint64_t trace_id;
+    uint64_t opcode;
+    // Sender of the operation, 0 if it's not an OSD
+    osd_num_t peer_osd;
+    uint64_t inode, offset;
+    uint32_t len;
+    int retval;
+    timespec tv_begin;
+    uint32_t total_us;
+    osd_op_trace_t trace;
+};
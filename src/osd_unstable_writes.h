@@ -0,0 +1,89 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <map>
+#include <unordered_map>
+#include "object_id.h"
+#include "osd_id.h"
+
+// Unstable object versions written to peer OSDs, waiting for the next SYNC to be stabilized.
+// Writes are hashed per peer OSD, so remembering a version is O(1), and the whole set
+// is drained into one array grouped by OSD without sorting. Per-OSD hash tables are
+// kept between drains so the steady state doesn't allocate buckets again.
+class osd_unstable_writes_t
+{
+    std::map<osd_num_t, std::unordered_map<object_id, uint64_t>> by_osd;
+    uint64_t count = 0;
+
+public:
+    inline uint64_t size()
+    {
+        return count;
+    }
+
+    // Estimated memory usage with 16 bytes of overhead per hash table node and 8 bytes per bucket
+    inline uint64_t bytes_used()
+    {
+        uint64_t bytes = 0;
+        for (auto & osd_it: by_osd)
+            bytes += osd_it.second.size() * (sizeof(std::pair<object_id, uint64_t>) + 16) + osd_it.second.bucket_count() * sizeof(void*);
+        return bytes;
+    }
+
+    inline void set(osd_num_t osd_num, const object_id & oid, uint64_t version)
+    {
+        auto ins = by_osd[osd_num].emplace(oid, version);
+        if (ins.second)
+            count++;
+        else
+            ins.first->second = version;
+    }
+
+    // Same as set(), but never lowers the remembered version
+    inline void set_max(osd_num_t osd_num, const object_id & oid, uint64_t version)
+    {
+        auto ins = by_osd[osd_num].emplace(oid, version);
+        if (ins.second)
+            count++;
+        else if (ins.first->second < version)
+            ins.first->second = version;
+    }
+
+    // Move all writes to <out> (size() items), calls osd_cb(osd_num, start, len) for each
+    // peer OSD in the order of OSD numbers
+    template<class F> void drain(obj_ver_id *out, F osd_cb)
+    {
+        int pos = 0;
+        for (auto & osd_it: by_osd)
+        {
+            if (!osd_it.second.size())
+                continue;
+            int start = pos;
+            for (auto & w: osd_it.second)
+                out[pos++] = (obj_ver_id){ .oid = w.first, .version = w.second };
+            osd_it.second.clear();
+            osd_cb(osd_it.first, start, pos-start);
+        }
+        count = 0;
+    }
+
+    // Forget all writes for which pred(oid) is true
+    template<class F> void erase_if(F pred)
+    {
+        for (auto & osd_it: by_osd)
+        {
+            for (auto it = osd_it.second.begin(); it != osd_it.second.end(); )
+            {
+                if (pred(it->first))
+                {
+                    it = osd_it.second.erase(it);
+                    count--;
+                }
+                else
+                    it++;
+            }
+        }
+    }
+};
@@ -36,9 +36,20 @@ void DSO_STAMP_FUN(void)
 {
 }
 
+// Client of an additional AioContext, used with multiqueue virtio-blk (iothread-vq-mapping)
+typedef struct VitastorQueue
+{
+    AioContext *ctx;
+    void *proxy;
+    QemuMutex mutex;
+    struct VitastorQueue *next;
+} VitastorQueue;
+
 typedef struct VitastorClient
 {
+    AioContext *ctx;
     void *proxy;
+    VitastorQueue *queues;
     void *watch;
     char *config_path;
     char *etcd_host;
@@ -53,6 +64,8 @@ typedef struct VitastorClient
     int rdma_port_num;
     int rdma_gid_index;
     int rdma_mtu;
+    // Set once the main client has write-back cache or read-ahead enabled
+    int cached;
     QemuMutex mutex;
 } VitastorClient;
 
@@ -63,6 +76,7 @@ typedef struct VitastorRPC
     QEMUIOVector *iov;
     long ret;
     int complete;
+    int left;
 } VitastorRPC;
 
 static void vitastor_co_init_task(BlockDriverState *bs, VitastorRPC *task);
@@ -70,6 +84,21 @@ static void vitastor_co_generic_bh_cb(void *opaque, long retval);
 static void vitastor_co_read_cb(void *opaque, long retval, uint64_t version);
 static void vitastor_close(BlockDriverState *bs);
 
+#if QEMU_VERSION_MAJOR > 8 || QEMU_VERSION_MAJOR == 8 && QEMU_VERSION_MINOR >= 1
+static void vitastor_aio_set_fd_handler(void *ctx, int fd, int is_external, IOHandler *fd_read, IOHandler *fd_write, void *poll_fn, void *opaque)
+{
+    aio_set_fd_handler(ctx, fd, fd_read, fd_write, poll_fn, NULL, opaque);
+}
+#elif QEMU_VERSION_MAJOR > 6 || QEMU_VERSION_MAJOR == 6 && QEMU_VERSION_MINOR >= 2
+static void vitastor_aio_set_fd_handler(void *ctx, int fd, int is_external, IOHandler *fd_read, IOHandler *fd_write, void *poll_fn, void *opaque)
+{
+    // poll_fn handles events itself, so there's no separate io_poll_ready
+    aio_set_fd_handler(ctx, fd, is_external, fd_read, fd_write, poll_fn, NULL, opaque);
+}
+#else
+#define vitastor_aio_set_fd_handler ((QEMUSetFDHandler*)aio_set_fd_handler)
+#endif
+
 static char *qemu_vitastor_next_tok(char *src, char delim, char **p)
 {
     char *end;
@@ -177,6 +206,54 @@ out:
     return;
 }
 
+static void *vitastor_create_proxy(VitastorClient *client, AioContext *ctx)
+{
+    return vitastor_c_create_qemu(
+        vitastor_aio_set_fd_handler, ctx, client->config_path, client->etcd_host, client->etcd_prefix,
+        client->use_rdma, client->rdma_device, client->rdma_port_num, client->rdma_gid_index, client->rdma_mtu, 0
+    );
+}
+
+// Requests may come from several iothreads at once with multiqueue virtio-blk. Each AioContext
+// gets its own vitastor client so that its completions are handled (and polled) in the same thread
+// and iothreads don't contend for one set of OSD connections. Additional clients share the etcd
+// connection of the first one and have no caches of their own. Write-back cache and read-ahead
+// of the first client can't be shared with them, so while (and after) it uses them, all requests
+// go through it. Returns the client locked with <*mutex>
+static void *vitastor_lock_proxy(VitastorClient *client, QemuMutex **mutex)
+{
+#if QEMU_VERSION_MAJOR >= 3
+    AioContext *ctx = qemu_get_current_aio_context();
+    qemu_mutex_lock(&client->mutex);
+    if (!client->cached && vitastor_c_uses_cache(client->proxy))
+    {
+        client->cached = 1;
+    }
+    if (ctx != client->ctx && !client->cached)
+    {
+        VitastorQueue *q;
+        for (q = client->queues; q && q->ctx != ctx; q = q->next) {}
+        if (!q)
+        {
+            q = g_new0(VitastorQueue, 1);
+            q->ctx = ctx;
+            q->proxy = vitastor_c_create_qemu_queue(client->proxy, vitastor_aio_set_fd_handler, ctx);
+            qemu_mutex_init(&q->mutex);
+            q->next = client->queues;
+            client->queues = q;
+        }
+        qemu_mutex_unlock(&client->mutex);
+        *mutex = &q->mutex;
+        qemu_mutex_lock(*mutex);
+        return q->proxy;
+    }
+#else
+    qemu_mutex_lock(&client->mutex);
+#endif
+    *mutex = &client->mutex;
+    return client->proxy;
+}
+
 static void coroutine_fn vitastor_co_get_metadata(VitastorRPC *task)
 {
     BlockDriverState *bs = task->bs;
@@ -207,10 +284,9 @@ static int vitastor_file_open(BlockDriverState *bs, QDict *options, int flags, E
     client->rdma_port_num = qdict_get_try_int(options, "rdma_port_num", 0);
     client->rdma_gid_index = qdict_get_try_int(options, "rdma_gid_index", 0);
     client->rdma_mtu = qdict_get_try_int(options, "rdma_mtu", 0);
-    client->proxy = vitastor_c_create_qemu(
-        (QEMUSetFDHandler*)aio_set_fd_handler, bdrv_get_aio_context(bs), client->config_path, client->etcd_host, client->etcd_prefix,
-        client->use_rdma, client->rdma_device, client->rdma_port_num, client->rdma_gid_index, client->rdma_mtu, 0
-    );
+    client->ctx = bdrv_get_aio_context(bs);
+    client->queues = NULL;
+    client->proxy = vitastor_create_proxy(client, client->ctx);
     client->image = g_strdup(qdict_get_try_str(options, "image"));
     client->readonly = (flags & BDRV_O_RDWR) ? 1 : 0;
     if (client->image)
@@ -259,6 +335,9 @@ static int vitastor_file_open(BlockDriverState *bs, QDict *options, int flags, E
         return -1;
     }
     bs->total_sectors = client->size / BDRV_SECTOR_SIZE;
+#if QEMU_VERSION_MAJOR >= 3
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+#endif
     //client->aio_context = bdrv_get_aio_context(bs);
     qdict_del(options, "use_rdma");
     qdict_del(options, "rdma_mtu");
@@ -278,6 +357,14 @@ static int vitastor_file_open(BlockDriverState *bs, QDict *options, int flags, E
 static void vitastor_close(BlockDriverState *bs)
 {
     VitastorClient *client = bs->opaque;
+    while (client->queues)
+    {
+        VitastorQueue *q = client->queues;
+        client->queues = q->next;
+        vitastor_c_destroy(q->proxy);
+        qemu_mutex_destroy(&q->mutex);
+        g_free(q);
+    }
     vitastor_c_destroy(client->proxy);
     qemu_mutex_destroy(&client->mutex);
     if (client->config_path)
@@ -290,6 +377,25 @@ static void vitastor_close(BlockDriverState *bs)
         g_free(client->image);
 }
 
+// The block device is moved to another iothread (or back to the main loop)
+static void vitastor_detach_aio_context(BlockDriverState *bs)
+{
+    VitastorClient *client = bs->opaque;
+    qemu_mutex_lock(&client->mutex);
+    vitastor_c_qemu_set_aio_context(client->proxy, NULL);
+    client->ctx = NULL;
+    qemu_mutex_unlock(&client->mutex);
+}
+
+static void vitastor_attach_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    VitastorClient *client = bs->opaque;
+    qemu_mutex_lock(&client->mutex);
+    client->ctx = new_context;
+    vitastor_c_qemu_set_aio_context(client->proxy, new_context);
+    qemu_mutex_unlock(&client->mutex);
+}
+
 #if QEMU_VERSION_MAJOR >= 3
 static int vitastor_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
 {
@@ -422,9 +528,10 @@ static int coroutine_fn vitastor_co_preadv(BlockDriverState *bs, uint64_t offset
     task.iov = iov;
 
     uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
-    qemu_mutex_lock(&client->mutex);
-    vitastor_c_read(client->proxy, inode, offset, bytes, iov->iov, iov->niov, vitastor_co_read_cb, &task);
-    qemu_mutex_unlock(&client->mutex);
+    QemuMutex *mutex;
+    void *proxy = vitastor_lock_proxy(client, &mutex);
+    vitastor_c_read(proxy, inode, offset, bytes, iov->iov, iov->niov, vitastor_co_read_cb, &task);
+    qemu_mutex_unlock(mutex);
 
     while (!task.complete)
     {
@@ -442,9 +549,60 @@ static int coroutine_fn vitastor_co_pwritev(BlockDriverState *bs, uint64_t offse
     task.iov = iov;
 
     uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
-    qemu_mutex_lock(&client->mutex);
-    vitastor_c_write(client->proxy, inode, offset, bytes, 0, iov->iov, iov->niov, vitastor_co_generic_bh_cb, &task);
-    qemu_mutex_unlock(&client->mutex);
+    QemuMutex *mutex;
+    void *proxy = vitastor_lock_proxy(client, &mutex);
+    vitastor_c_write(proxy, inode, offset, bytes, 0, iov->iov, iov->niov, vitastor_co_generic_bh_cb, &task);
+    qemu_mutex_unlock(mutex);
+
+    while (!task.complete)
+    {
+        qemu_coroutine_yield();
+    }
+
+    return task.ret;
+}
+
+#if QEMU_VERSION_MAJOR >= 3
+#if QEMU_VERSION_MAJOR >= 7
+static int coroutine_fn vitastor_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+#else
+static int coroutine_fn vitastor_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
+#endif
+{
+    VitastorClient *client = bs->opaque;
+    VitastorRPC task;
+    vitastor_co_init_task(bs, &task);
+
+    uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
+    QemuMutex *mutex;
+    void *proxy = vitastor_lock_proxy(client, &mutex);
+    vitastor_c_discard(proxy, inode, offset, bytes, vitastor_co_generic_bh_cb, &task);
+    qemu_mutex_unlock(mutex);
+
+    while (!task.complete)
+    {
+        qemu_coroutine_yield();
+    }
+
+    return task.ret;
+}
+
+#if QEMU_VERSION_MAJOR >= 7
+static int coroutine_fn vitastor_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes, BdrvRequestFlags flags)
+#else
+static int coroutine_fn vitastor_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes, BdrvRequestFlags flags)
+#endif
+{
+    VitastorClient *client = bs->opaque;
+    VitastorRPC task;
+    vitastor_co_init_task(bs, &task);
+
+    uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
+    QemuMutex *mutex;
+    void *proxy = vitastor_lock_proxy(client, &mutex);
+    // Objects may only be deleted if the guest allows to unmap the range
+    vitastor_c_write_zeroes(proxy, inode, offset, bytes, !(flags & BDRV_REQ_MAY_UNMAP), vitastor_co_generic_bh_cb, &task);
+    qemu_mutex_unlock(mutex);
 
     while (!task.complete)
     {
@@ -453,6 +611,68 @@ static int coroutine_fn vitastor_co_pwritev(BlockDriverState *bs, uint64_t offse
 
     return task.ret;
 }
+#endif
+
+#if QEMU_VERSION_MAJOR >= 3
+typedef struct VitastorBlockStatusRPC
+{
+    VitastorRPC task;
+    uint64_t offset;
+    int allocated;
+} VitastorBlockStatusRPC;
+
+static void vitastor_co_block_status_cb(void *opaque, long retval, uint64_t granularity, uint8_t *bitmap)
+{
+    VitastorBlockStatusRPC *bst = opaque;
+    if (retval > 0)
+    {
+        // Length of the run of equal bitmap bits starting at the requested offset
+        uint64_t start = bst->offset / granularity * granularity;
+        uint64_t bit = (bst->offset - start) / granularity;
+        uint64_t bits = (bst->offset + retval - start + granularity - 1) / granularity;
+        int allocated = (bitmap[bit/8] >> (bit%8)) & 1;
+        uint64_t end = bit+1;
+        while (end < bits && ((bitmap[end/8] >> (end%8)) & 1) == allocated)
+            end++;
+        retval = end*granularity + start < bst->offset + retval ? end*granularity + start - bst->offset : retval;
+        bst->allocated = allocated;
+    }
+    vitastor_co_generic_bh_cb(&bst->task, retval);
+}
+
+// Allows qemu-img convert and block jobs to skip unallocated areas of sparse images
+#if QEMU_VERSION_MAJOR > 10 || QEMU_VERSION_MAJOR == 10 && QEMU_VERSION_MINOR >= 1
+static int coroutine_fn vitastor_co_block_status(BlockDriverState *bs, unsigned int mode,
+#else
+static int coroutine_fn vitastor_co_block_status(BlockDriverState *bs, bool want_zero,
+#endif
+    int64_t offset, int64_t bytes, int64_t *pnum, int64_t *map, BlockDriverState **file)
+{
+    VitastorClient *client = bs->opaque;
+    VitastorBlockStatusRPC bst = { .offset = offset };
+    vitastor_co_init_task(bs, &bst.task);
+
+    uint64_t inode = client->watch ? vitastor_c_inode_get_num(client->watch) : client->inode;
+    QemuMutex *mutex;
+    void *proxy = vitastor_lock_proxy(client, &mutex);
+    vitastor_c_block_status(proxy, inode, offset, bytes, vitastor_co_block_status_cb, &bst);
+    qemu_mutex_unlock(mutex);
+
+    while (!bst.task.complete)
+    {
+        qemu_coroutine_yield();
+    }
+
+    if (bst.task.ret < 0)
+    {
+        return bst.task.ret;
+    }
+    *pnum = bst.task.ret > 0 && bst.task.ret < bytes ? bst.task.ret : bytes;
+    *map = offset;
+    *file = bs;
+    return (bst.task.ret == 0 || bst.allocated ? BDRV_BLOCK_DATA : BDRV_BLOCK_ZERO) | BDRV_BLOCK_OFFSET_VALID;
+}
+#endif
 
 #if QEMU_VERSION_MAJOR < 3
 static int coroutine_fn vitastor_co_readv(BlockDriverState *bs, int64_t sector_num, int nb_sectors, QEMUIOVector *iov)
@@ -466,6 +686,58 @@ static int coroutine_fn vitastor_co_writev(BlockDriverState *bs, int64_t sector_
 }
 #endif
 
+#if QEMU_VERSION_MAJOR >= 3
+// Sync of one of the clients, run in the thread of its AioContext
+typedef struct VitastorSyncPart
+{
+    VitastorRPC *task;
+    AioContext *task_ctx;
+    void *proxy;
+    QemuMutex *mutex;
+} VitastorSyncPart;
+
+static void vitastor_sync_done_bh(void *opaque)
+{
+    VitastorRPC *task = opaque;
+    vitastor_co_generic_bh_cb(task, task->ret);
+}
+
+static void vitastor_co_sync_part_cb(void *opaque, long retval)
+{
+    VitastorSyncPart *part = opaque;
+    VitastorRPC *task = part->task;
+    AioContext *task_ctx = part->task_ctx;
+    g_free(part);
+    if (retval < 0)
+        __atomic_store_n(&task->ret, retval, __ATOMIC_SEQ_CST);
+    if (__atomic_sub_fetch(&task->left, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        // Complete the task in its own thread, after the coroutine yields
+        aio_bh_schedule_oneshot(task_ctx, vitastor_sync_done_bh, task);
+    }
+}
+
+static void vitastor_sync_part_bh(void *opaque)
+{
+    VitastorSyncPart *part = opaque;
+    // <part> may be freed by the callback
+    QemuMutex *mutex = part->mutex;
+    qemu_mutex_lock(mutex);
+    vitastor_c_sync(part->proxy, vitastor_co_sync_part_cb, part);
+    qemu_mutex_unlock(mutex);
+}
+
+static void vitastor_sync_part(VitastorRPC *task, AioContext *ctx, void *proxy, QemuMutex *mutex)
+{
+    VitastorSyncPart *part = g_new0(VitastorSyncPart, 1);
+    part->task = task;
+    part->task_ctx = qemu_get_current_aio_context();
+    part->proxy = proxy;
+    part->mutex = mutex;
+    aio_bh_schedule_oneshot(ctx, vitastor_sync_part_bh, part);
+}
+#endif
+
 static int coroutine_fn vitastor_co_flush(BlockDriverState *bs)
 {
     VitastorClient *client = bs->opaque;
@@ -473,7 +745,23 @@ static int coroutine_fn vitastor_co_flush(BlockDriverState *bs)
     vitastor_co_init_task(bs, &task);
 
     qemu_mutex_lock(&client->mutex);
-    vitastor_c_sync(client->proxy, vitastor_co_generic_bh_cb, &task);
+#if QEMU_VERSION_MAJOR >= 3
+    if (client->queues)
+    {
+        // Each client only syncs its own writes, so all of them are synced
+        VitastorQueue *q;
+        task.left = 1;
+        for (q = client->queues; q; q = q->next)
+            task.left++;
+        vitastor_sync_part(&task, client->ctx, client->proxy, &client->mutex);
+        for (q = client->queues; q; q = q->next)
+            vitastor_sync_part(&task, q->ctx, q->proxy, &q->mutex);
+    }
+    else
+#endif
+    {
+        vitastor_c_sync(client->proxy, vitastor_co_generic_bh_cb, &task);
+    }
     qemu_mutex_unlock(&client->mutex);
 
     while (!task.complete)
@@ -539,6 +827,9 @@ static BlockDriver bdrv_vitastor = {
     .bdrv_file_open                 = vitastor_file_open,
     .bdrv_close                     = vitastor_close,
 
+    .bdrv_detach_aio_context        = vitastor_detach_aio_context,
+    .bdrv_attach_aio_context        = vitastor_attach_aio_context,
+
     // Option list for the create operation
 #if QEMU_VERSION_MAJOR >= 3
     .create_opts                    = &vitastor_create_opts,
@@ -558,6 +849,9 @@ static BlockDriver bdrv_vitastor = {
 
     .bdrv_co_preadv                 = vitastor_co_preadv,
     .bdrv_co_pwritev                = vitastor_co_pwritev,
+    .bdrv_co_block_status           = vitastor_co_block_status,
+    .bdrv_co_pdiscard               = vitastor_co_pdiscard,
+    .bdrv_co_pwrite_zeroes          = vitastor_co_pwrite_zeroes,
 #else
     .bdrv_co_readv                  = vitastor_co_readv,
     .bdrv_co_writev                 = vitastor_co_writev,
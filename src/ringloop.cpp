@@ -1,15 +1,40 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
+#include <errno.h>
 #include <stdlib.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <stdexcept>
 
 #include "ringloop.h"
 
-ring_loop_t::ring_loop_t(int qd)
+ring_loop_t::ring_loop_t(int qd, const ring_loop_config_t & config)
 {
-    int ret = io_uring_queue_init(qd, &ring, 0);
+    this->config = config;
+    io_uring_params params = { 0 };
+    if (config.sqpoll)
+    {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = config.sqpoll_idle_ms;
+        if (config.sqpoll_cpu >= 0)
+        {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = config.sqpoll_cpu;
+        }
+    }
+#ifdef IORING_SETUP_SQE128
+    if (config.big_sqe)
+    {
+        params.flags |= IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    }
+#endif
+    int ret = io_uring_queue_init_params(qd, &ring, &params);
     if (ret < 0)
     {
         throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
@@ -30,11 +55,336 @@ ring_loop_t::ring_loop_t(int qd)
 
 ring_loop_t::~ring_loop_t()
 {
+#ifdef IORING_RECV_MULTISHOT
+    while (buf_rings.size())
+        free_buf_ring(buf_rings.begin()->first);
+#endif
     free(free_ring_data);
     free(ring_datas);
     io_uring_queue_exit(&ring);
+    if (fixed_buf_placeholder)
+        free(fixed_buf_placeholder);
+}
+
+#define FIXED_FILE_SLOTS 16
+#define FIXED_BUFFER_SLOTS 64
+// The kernel doesn't accept larger registered buffers
+#define MAX_FIXED_BUFFER (1024*1024*1024)
+
+bool ring_loop_t::register_fd(int fd)
+{
+    if (fixed_files_failed)
+        return false;
+    int slot = -1;
+    for (int i = 0; i < fixed_fds.size(); i++)
+    {
+        if (fixed_fds[i] == fd)
+            return true;
+        else if (fixed_fds[i] == -1 && slot < 0)
+            slot = i;
+    }
+    if (!fixed_files_registered)
+    {
+        // Register a sparse table once and then only update it
+        fixed_fds.resize(FIXED_FILE_SLOTS, -1);
+        int r = io_uring_register_files(&ring, fixed_fds.data(), fixed_fds.size());
+        if (r < 0)
+        {
+            fixed_fds.clear();
+            fixed_files_failed = true;
+            return false;
+        }
+        fixed_files_registered = true;
+        slot = 0;
+    }
+    if (slot < 0)
+        return false;
+    int r = io_uring_register_files_update(&ring, slot, &fd, 1);
+    if (r < 0)
+        return false;
+    fixed_fds[slot] = fd;
+    return true;
+}
+
+void ring_loop_t::unregister_fd(int fd)
+{
+    for (int i = 0; i < fixed_fds.size(); i++)
+    {
+        if (fixed_fds[i] == fd)
+        {
+            int empty = -1;
+            io_uring_register_files_update(&ring, i, &empty, 1);
+            fixed_fds[i] = -1;
+        }
+    }
+}
+
+bool ring_loop_t::update_fixed_buffers()
+{
+    io_uring_unregister_buffers(&ring);
+    int r = fixed_bufs.size() > 0 ? io_uring_register_buffers(&ring, fixed_bufs.data(), fixed_bufs.size()) : 0;
+    return r >= 0;
+}
+
+bool ring_loop_t::update_fixed_buffer(int slot)
+{
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    if (fixed_bufs_sparse)
+    {
+        return io_uring_register_buffers_update_tag(&ring, slot, &fixed_bufs[slot], NULL, 1) >= 0;
+    }
+#endif
+    return update_fixed_buffers();
+}
+
+iovec ring_loop_t::free_fixed_buffer()
+{
+    if (fixed_bufs_sparse)
+        return (iovec){ .iov_base = NULL, .iov_len = 0 };
+    if (!fixed_buf_placeholder)
+        fixed_buf_placeholder = memalign(4096, 4096);
+    return (iovec){ .iov_base = fixed_buf_placeholder, .iov_len = 4096 };
+}
+
+bool ring_loop_t::register_buffer(void *buf, size_t len)
+{
+    if (fixed_bufs_failed || !buf || !len || len > MAX_FIXED_BUFFER)
+        return false;
+    if (!fixed_bufs_registered)
+    {
+        fixed_bufs_registered = true;
+#ifdef IORING_RSRC_REGISTER_SPARSE
+        // Register a sparse table once and then only update it, so that buffers may be
+        // added while I/O is in progress, for example new buffer pool chunks
+        fixed_bufs_sparse = io_uring_register_buffers_sparse(&ring, FIXED_BUFFER_SLOTS) >= 0;
+#endif
+    }
+    iovec free_iov = free_fixed_buffer();
+    int slot = -1;
+    for (int i = 0; i < fixed_bufs.size(); i++)
+    {
+        if (fixed_bufs[i].iov_base == free_iov.iov_base)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0)
+    {
+        if (fixed_bufs_sparse && fixed_bufs.size() >= FIXED_BUFFER_SLOTS)
+            return false;
+        slot = fixed_bufs.size();
+        fixed_bufs.push_back((iovec){ .iov_base = buf, .iov_len = len });
+    }
+    else
+        fixed_bufs[slot] = (iovec){ .iov_base = buf, .iov_len = len };
+    if (!update_fixed_buffer(slot))
+    {
+        if (fixed_bufs_sparse)
+        {
+            // Other buffers stay registered, just don't use this one
+            fixed_bufs[slot] = free_iov;
+            while (fixed_bufs.size() > 0 && fixed_bufs.back().iov_base == free_iov.iov_base)
+                fixed_bufs.pop_back();
+            return false;
+        }
+        // Most likely RLIMIT_MEMLOCK is too low, don't try again
+        fixed_bufs.clear();
+        fixed_bufs_failed = true;
+        update_fixed_buffers();
+        return false;
+    }
+    return true;
+}
+
+void ring_loop_t::unregister_buffer(void *buf)
+{
+    bool changed = false;
+    iovec free_iov = free_fixed_buffer();
+    for (int i = 0; i < fixed_bufs.size(); i++)
+    {
+        if (fixed_bufs[i].iov_base == buf)
+        {
+            fixed_bufs[i] = free_iov;
+            if (fixed_bufs_sparse)
+                update_fixed_buffer(i);
+            changed = true;
+        }
+    }
+    while (fixed_bufs.size() > 0 && fixed_bufs.back().iov_base == free_iov.iov_base)
+    {
+        fixed_bufs.pop_back();
+    }
+    if (changed && !fixed_bufs_sparse)
+    {
+        update_fixed_buffers();
+    }
+}
+
+#ifdef WITH_NVME_PASSTHRU
+bool ring_loop_t::register_nvme_passthru(int fd, int ng_fd, uint32_t nsid, unsigned lba_shift, uint64_t start,
+    uint64_t max_len, unsigned max_vecs, bool fua)
+{
+    if (!(ring.flags & IORING_SETUP_SQE128) || !is_op_supported(IORING_OP_URING_CMD))
+        return false;
+    unregister_nvme_passthru(fd);
+    register_fd(ng_fd);
+    nvme_devs.push_back((nvme_passthru_t){
+        .fd = fd,
+        .ng_fd = ng_fd,
+        .nsid = nsid,
+        .lba_shift = lba_shift,
+        .start = start,
+        .max_len = max_len,
+        .max_vecs = max_vecs,
+        .fua = fua,
+    });
+    return true;
+}
+
+void ring_loop_t::unregister_nvme_passthru(int fd)
+{
+    for (int i = 0; i < nvme_devs.size(); i++)
+    {
+        if (nvme_devs[i].fd == fd)
+        {
+            unregister_fd(nvme_devs[i].ng_fd);
+            nvme_devs.erase(nvme_devs.begin()+i, nvme_devs.begin()+i+1);
+            return;
+        }
+    }
+}
+#endif
+
+void ring_loop_t::register_dax(int fd, void *addr, uint64_t size)
+{
+    unregister_dax(fd);
+    dax_devs.push_back((dax_mapping_t){ .fd = fd, .addr = (uint8_t*)addr, .size = size });
 }
 
+void ring_loop_t::unregister_dax(int fd)
+{
+    for (int i = 0; i < dax_devs.size(); i++)
+    {
+        if (dax_devs[i].fd == fd)
+        {
+            dax_devs.erase(dax_devs.begin()+i, dax_devs.begin()+i+1);
+            return;
+        }
+    }
+}
+
+// Copy <len> bytes to persistent memory so that they're durable when the function returns
+static void pmem_copy(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // Non-temporal stores bypass the cache, the unaligned head and tail go through it and are flushed
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > len)
+        head = len;
+    if (head)
+    {
+        memcpy(dst, src, head);
+        _mm_clflush(dst);
+        _mm_clflush(dst+head-1);
+        dst += head;
+        src += head;
+        len -= head;
+    }
+    for (; len >= 16; dst += 16, src += 16, len -= 16)
+    {
+        _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    }
+    if (len)
+    {
+        memcpy(dst, src, len);
+        _mm_clflush(dst);
+        _mm_clflush(dst+len-1);
+    }
+    _mm_sfence();
+#else
+    memcpy(dst, src, len);
+    uintptr_t page = (uintptr_t)dst & ~(uintptr_t)4095;
+    msync((void*)page, (uintptr_t)dst + len - page, MS_SYNC);
+#endif
+}
+
+bool ring_loop_t::prep_dax(int op, struct io_uring_sqe *sqe, int fd, const struct iovec *iov, unsigned nr_vecs, off_t offset)
+{
+    dax_mapping_t *dev = NULL;
+    for (auto & d: dax_devs)
+    {
+        if (d.fd == fd)
+        {
+            dev = &d;
+            break;
+        }
+    }
+    if (!dev)
+        return false;
+    uint64_t len = 0;
+    for (unsigned i = 0; i < nr_vecs; i++)
+        len += iov[i].iov_len;
+    if (offset < 0 || offset + len > dev->size)
+    {
+        // Out of range, the caller sees a short read or write
+        len = 0;
+    }
+    else if (op == IORING_OP_READV)
+    {
+        uint8_t *pos = dev->addr + offset;
+        for (unsigned i = 0; i < nr_vecs; pos += iov[i].iov_len, i++)
+            memcpy(iov[i].iov_base, pos, iov[i].iov_len);
+    }
+    else if (op == IORING_OP_WRITEV)
+    {
+        uint8_t *pos = dev->addr + offset;
+        for (unsigned i = 0; i < nr_vecs; pos += iov[i].iov_len, i++)
+            pmem_copy(pos, (const uint8_t*)iov[i].iov_base, iov[i].iov_len);
+    }
+    // The completion reports <len> like for NVMe passthrough commands
+    my_uring_prep_nop(sqe);
+    ring_data_t *data = (ring_data_t*)sqe->user_data;
+    data->passthru = true;
+    data->passthru_len = len;
+    return true;
+}
+
+#ifdef IORING_RECV_MULTISHOT
+bool ring_loop_t::setup_buf_ring(int bgid, unsigned count, unsigned buf_size)
+{
+    // The ring size must be a power of 2
+    unsigned n = 1;
+    while (n < count)
+        n <<= 1;
+    int r = 0;
+    io_uring_buf_ring *br = io_uring_setup_buf_ring(&ring, n, bgid, 0, &r);
+    if (!br)
+        return false;
+    uint8_t *bufs = (uint8_t*)memalign(4096, (size_t)n*buf_size);
+    if (!bufs)
+    {
+        io_uring_free_buf_ring(&ring, br, n, bgid);
+        throw std::bad_alloc();
+    }
+    for (unsigned i = 0; i < n; i++)
+        io_uring_buf_ring_add(br, bufs + (size_t)i*buf_size, buf_size, i, io_uring_buf_ring_mask(n), i);
+    io_uring_buf_ring_advance(br, n);
+    buf_rings[bgid] = (buf_ring_t){ .br = br, .bufs = bufs, .count = n, .buf_size = buf_size };
+    return true;
+}
+
+void ring_loop_t::free_buf_ring(int bgid)
+{
+    auto it = buf_rings.find(bgid);
+    if (it == buf_rings.end())
+        return;
+    io_uring_free_buf_ring(&ring, it->second.br, it->second.count, bgid);
+    free(it->second.bufs);
+    buf_rings.erase(it);
+}
+#endif
+
 void ring_loop_t::register_consumer(ring_consumer_t *consumer)
 {
     unregister_consumer(consumer);
@@ -63,7 +413,26 @@ void ring_loop_t::loop()
     struct io_uring_cqe *cqe;
     while (!io_uring_peek_cqe(&ring, &cqe))
     {
+        stats.cqe_count++;
         struct ring_data_t *d = (struct ring_data_t*)cqe->user_data;
+        int res = cqe->res;
+        if (d->passthru)
+        {
+            // Positive result of a passthrough command is an NVMe status code
+            res = res > 0 ? -EIO : (res == 0 ? d->passthru_len : res);
+        }
+#ifdef IORING_CQE_F_MORE
+        if (d->callback && (cqe->flags & IORING_CQE_F_MORE))
+        {
+            // The SQE isn't finished yet, so keep its ring_data
+            d->res = res;
+            d->more = true;
+            d->cqe_flags = cqe->flags;
+            d->callback(d);
+            io_uring_cqe_seen(&ring, cqe);
+            continue;
+        }
+#endif
         if (d->callback)
         {
             // First free ring_data item, then call the callback
@@ -71,8 +440,10 @@ void ring_loop_t::loop()
             // which is required for EPOLLET to function properly
             struct ring_data_t dl;
             dl.iov = d->iov;
-            dl.res = cqe->res;
-            dl.callback.swap(d->callback);
+            dl.res = res;
+            dl.more = false;
+            dl.cqe_flags = cqe->flags;
+            dl.callback = std::move(d->callback);
             free_ring_data[free_ring_data_ptr++] = d - ring_datas;
             dl.callback(&dl);
         }
@@ -98,6 +469,44 @@ void ring_loop_t::loop()
     } while (loop_again);
 }
 
+bool ring_loop_t::is_op_supported(int opcode)
+{
+    io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    if (!probe)
+        return false;
+    bool supported = io_uring_opcode_supported(probe, opcode);
+    io_uring_free_probe(probe);
+    return supported;
+}
+
+// Spin until a completion arrives or busy_poll_us pass without any events,
+// in the latter case the caller falls back to sleeping in io_uring_wait_cqe()
+bool ring_loop_t::busy_poll()
+{
+    timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct io_uring_cqe *cqe;
+    while (1)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            if (!io_uring_peek_cqe(&ring, &cqe))
+            {
+                stats.busy_poll_hits++;
+                return true;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000 >= config.busy_poll_us)
+        {
+            return false;
+        }
+    }
+}
+
 unsigned ring_loop_t::save()
 {
     return ring.sq.sqe_tail;
@@ -108,7 +517,13 @@ void ring_loop_t::restore(unsigned sqe_tail)
     assert(ring.sq.sqe_tail >= sqe_tail);
     for (unsigned i = sqe_tail; i < ring.sq.sqe_tail; i++)
     {
-        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data) - ring_datas;
+        unsigned pos = (i & *ring.sq.kring_mask);
+#ifdef IORING_SETUP_SQE128
+        // SQEs are 128 bytes, i.e. 2 regular SQE slots, with IORING_SETUP_SQE128
+        if (ring.flags & IORING_SETUP_SQE128)
+            pos <<= 1;
+#endif
+        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[pos].user_data) - ring_datas;
     }
     ring.sq.sqe_tail = sqe_tail;
 }
@@ -7,13 +7,18 @@
 #define _LARGEFILE64_SOURCE
 #endif
 
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <liburing.h>
+#include <linux/nvme_ioctl.h>
 
 #include <string>
 #include <functional>
 #include <vector>
+#include <map>
+
+#include "small_function.h"
 
 static inline void my_uring_prep_rw(int op, struct io_uring_sqe *sqe, int fd, const void *addr, unsigned len, off_t offset)
 {
@@ -62,12 +67,90 @@ static inline void my_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const
     sqe->msg_flags = flags;
 }
 
+#ifdef IORING_CQE_F_NOTIF
+// Zero-copy sendmsg (Linux 6.1+): posts a result CQE with IORING_CQE_F_MORE and then
+// a notification CQE when the kernel doesn't reference the buffers anymore
+static inline void my_uring_prep_sendmsg_zc(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags)
+{
+    my_uring_prep_rw(IORING_OP_SENDMSG_ZC, sqe, fd, msg, 1, 0);
+    sqe->msg_flags = flags;
+}
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+// Multishot recv (Linux 6.0+): posts a CQE with IORING_CQE_F_MORE for every received chunk of data,
+// each in a buffer selected from the provided buffer ring <bgid>
+static inline void my_uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, int bgid)
+{
+    my_uring_prep_rw(IORING_OP_RECV, sqe, fd, NULL, 0, 0);
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+}
+#endif
+
+#if defined(IORING_SETUP_SQE128) && defined(NVME_URING_CMD_IO_VEC)
+#define WITH_NVME_PASSTHRU
+// NVMe I/O command set opcodes and the Force Unit Access bit of the read/write CDW12
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+#define NVME_RW_FUA (1 << 30)
+
+// NVMe passthrough command (Linux 5.19+), requires a ring with IORING_SETUP_SQE128|IORING_SETUP_CQE32.
+// <iov> is either an iovec array (NVME_URING_CMD_IO_VEC) or NULL for commands without data
+static inline void my_uring_prep_nvme_cmd(struct io_uring_sqe *sqe, int ng_fd, uint32_t nsid, uint8_t opcode,
+    const struct iovec *iov, unsigned nr_vecs, uint64_t slba, uint32_t cdw12)
+{
+    my_uring_prep_rw(IORING_OP_URING_CMD, sqe, ng_fd, NULL, 0, 0);
+    sqe->cmd_op = iov ? NVME_URING_CMD_IO_VEC : NVME_URING_CMD_IO;
+    struct nvme_uring_cmd *cmd = (struct nvme_uring_cmd*)sqe->cmd;
+    memset(cmd, 0, sizeof(struct nvme_uring_cmd));
+    cmd->opcode = opcode;
+    cmd->nsid = nsid;
+    cmd->addr = (uint64_t)iov;
+    cmd->data_len = iov ? nr_vecs : 0;
+    cmd->cdw10 = slba & 0xffffffff;
+    cmd->cdw11 = slba >> 32;
+    cmd->cdw12 = cdw12;
+}
+#endif
+
+#if defined(IORING_SETUP_SQE128)
+#define WITH_URING_DISCARD
+#ifndef BLOCK_URING_CMD_DISCARD
+// From linux/fs.h of Linux 6.12+, older kernels fail the command with -EOPNOTSUPP
+#define BLOCK_URING_CMD_DISCARD _IO(0x12, 0)
+#endif
+
+// Asynchronous BLKDISCARD of a block device range
+static inline void my_uring_prep_cmd_discard(struct io_uring_sqe *sqe, int fd, uint64_t offset, uint64_t len)
+{
+    my_uring_prep_rw(IORING_OP_URING_CMD, sqe, fd, NULL, 0, 0);
+    sqe->cmd_op = BLOCK_URING_CMD_DISCARD;
+    sqe->addr = offset;
+    sqe->addr3 = len;
+}
+#endif
+
 static inline void my_uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, short poll_mask)
 {
     my_uring_prep_rw(IORING_OP_POLL_ADD, sqe, fd, NULL, 0, 0);
     sqe->poll_events = poll_mask;
 }
 
+#ifdef IORING_POLL_ADD_MULTI
+// Multishot poll (Linux 5.13+): a CQE with IORING_CQE_F_MORE is posted for every readiness event
+static inline void my_uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, unsigned poll_mask)
+{
+    my_uring_prep_rw(IORING_OP_POLL_ADD, sqe, fd, NULL, IORING_POLL_ADD_MULTI, 0);
+#if __BYTE_ORDER == __BIG_ENDIAN
+    poll_mask = __swahw32(poll_mask);
+#endif
+    sqe->poll32_events = poll_mask;
+}
+#endif
+
 static inline void my_uring_prep_poll_remove(struct io_uring_sqe *sqe, void *user_data)
 {
     my_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, 0, user_data, 0, 0);
@@ -79,6 +162,11 @@ static inline void my_uring_prep_fsync(struct io_uring_sqe *sqe, int fd, unsigne
     sqe->fsync_flags = fsync_flags;
 }
 
+static inline void my_uring_prep_fallocate(struct io_uring_sqe *sqe, int fd, int mode, off_t offset, off_t len)
+{
+    my_uring_prep_rw(IORING_OP_FALLOCATE, sqe, fd, (const void *)(unsigned long)len, (unsigned)mode, offset);
+}
+
 static inline void my_uring_prep_nop(struct io_uring_sqe *sqe)
 {
     my_uring_prep_rw(IORING_OP_NOP, sqe, 0, NULL, 0, 0);
@@ -108,11 +196,25 @@ static inline void my_uring_prep_cancel(struct io_uring_sqe *sqe, void *user_dat
     sqe->cancel_flags = flags;
 }
 
+struct ring_data_t;
+
+// Completion callback, stored inline in ring_data_t without heap allocation
+typedef small_function_t<void(ring_data_t*), 32> ring_callback_t;
+
 struct ring_data_t
 {
     struct iovec iov; // for single-entry read/write operations
     int res;
-    std::function<void(ring_data_t*)> callback;
+    // true if more CQEs will follow for the same SQE (IORING_CQE_F_MORE),
+    // the callback is then called again for each of them
+    bool more;
+    // CQE flags, i.e. the selected buffer ID for IOSQE_BUFFER_SELECT operations
+    unsigned cqe_flags;
+    // true for NVMe passthrough commands and DAX I/O: their CQE holds 0 or an NVMe status instead of
+    // the byte count, ring_loop_t translates it to passthru_len or -EIO
+    bool passthru;
+    unsigned passthru_len;
+    ring_callback_t callback;
 };
 
 struct ring_consumer_t
@@ -120,6 +222,30 @@ struct ring_consumer_t
     std::function<void(void)> loop;
 };
 
+struct ring_loop_config_t
+{
+    // Submit through a kernel polling thread (IORING_SETUP_SQPOLL)
+    bool sqpoll = false;
+    // Pin the polling thread to this CPU, -1 means not pinned
+    int sqpoll_cpu = -1;
+    // The polling thread goes to sleep after this many idle milliseconds
+    unsigned sqpoll_idle_ms = 1000;
+    // Spin on the completion queue for this many microseconds before sleeping, 0 = disabled
+    unsigned busy_poll_us = 0;
+    // Use 128-byte SQEs and 32-byte CQEs (IORING_SETUP_SQE128|CQE32), required for NVMe passthrough
+    bool big_sqe = false;
+};
+
+struct ring_loop_stats_t
+{
+    uint64_t submit_count = 0, submit_syscalls = 0;
+    uint64_t wait_count = 0, wait_syscalls = 0;
+    // Completions handled, used to detect whether the loop is busy
+    uint64_t cqe_count = 0;
+    // Waits satisfied by spinning on the completion queue
+    uint64_t busy_poll_hits = 0;
+};
+
 class ring_loop_t
 {
     std::vector<std::pair<int,std::function<void()>>> get_sqe_queue;
@@ -130,8 +256,148 @@ class ring_loop_t
     unsigned free_ring_data_ptr;
     bool loop_again;
     struct io_uring ring;
+    ring_loop_config_t config;
+
+    bool busy_poll();
+    // Registered files (IOSQE_FIXED_FILE): fixed_fds[index] = fd or -1
+    std::vector<int> fixed_fds;
+    bool fixed_files_registered = false, fixed_files_failed = false;
+    // Registered buffers (IORING_OP_READ_FIXED/WRITE_FIXED). If the kernel supports sparse
+    // buffer tables, slots are updated one by one without affecting other buffers. Otherwise
+    // the whole set is re-registered on every change and free slots point to a single
+    // placeholder page to keep indexes stable
+    std::vector<iovec> fixed_bufs;
+    void *fixed_buf_placeholder = NULL;
+    bool fixed_bufs_registered = false, fixed_bufs_sparse = false, fixed_bufs_failed = false;
+
+    bool update_fixed_buffers();
+    bool update_fixed_buffer(int slot);
+    iovec free_fixed_buffer();
+#ifdef IORING_RECV_MULTISHOT
+    // Provided buffer rings (IORING_REGISTER_PBUF_RING) by buffer group ID
+    struct buf_ring_t
+    {
+        io_uring_buf_ring *br;
+        uint8_t *bufs;
+        unsigned count, buf_size;
+    };
+    std::map<int, buf_ring_t> buf_rings;
+#endif
+
+#ifdef WITH_NVME_PASSTHRU
+    // Block devices which are accessed through their NVMe generic char devices (/dev/ngXnY)
+    struct nvme_passthru_t
+    {
+        int fd, ng_fd;
+        uint32_t nsid;
+        unsigned lba_shift;
+        // Partition start offset within the namespace
+        uint64_t start;
+        // Maximum transfer size and iovec count, larger requests go through the block device
+        uint64_t max_len;
+        unsigned max_vecs;
+        // Write with FUA instead of relying on fsyncs
+        bool fua;
+    };
+    std::vector<nvme_passthru_t> nvme_devs;
+
+    inline nvme_passthru_t *find_nvme(int fd)
+    {
+        for (auto & dev: nvme_devs)
+        {
+            if (dev.fd == fd)
+                return &dev;
+        }
+        return NULL;
+    }
+
+    inline bool prep_nvme_rw(uint8_t opcode, struct io_uring_sqe *sqe, int fd, const struct iovec *iov, unsigned nr_vecs, off_t offset, int rw_flags)
+    {
+        nvme_passthru_t *dev = find_nvme(fd);
+        if (!dev)
+            return false;
+        uint64_t len = 0;
+        for (unsigned i = 0; i < nr_vecs; i++)
+            len += iov[i].iov_len;
+        bool fua = opcode == NVME_CMD_WRITE && (dev->fua || (rw_flags & RWF_DSYNC));
+        uint64_t lba_mask = (1ul << dev->lba_shift) - 1;
+        if (!len || len > dev->max_len || nr_vecs > dev->max_vecs || (len & lba_mask) || (offset & lba_mask))
+        {
+            // Unsuitable for passthrough, the block device still has to honor FUA.
+            // The SQE may be re-prepared in place after a passthrough command, so reset it
+            ring_data_t *data = (ring_data_t*)sqe->user_data;
+            *sqe = { 0 };
+            io_uring_sqe_set_data(sqe, data);
+            data->passthru = false;
+            prep_rw_fixed(opcode == NVME_CMD_READ ? IORING_OP_READV : IORING_OP_WRITEV,
+                opcode == NVME_CMD_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED, sqe, fd, iov, nr_vecs, offset);
+            sqe->rw_flags = rw_flags | (fua ? RWF_DSYNC : 0);
+            return true;
+        }
+        my_uring_prep_nvme_cmd(sqe, dev->ng_fd, dev->nsid, opcode, iov, nr_vecs, (dev->start + offset) >> dev->lba_shift,
+            ((len >> dev->lba_shift) - 1) | (fua ? NVME_RW_FUA : 0));
+        ring_data_t *data = (ring_data_t*)sqe->user_data;
+        data->passthru = true;
+        data->passthru_len = len;
+        use_fixed_file(sqe);
+        return true;
+    }
+#endif
+
+    // Persistent memory devices mapped with DAX: their reads and writes are done by the CPU
+    // while the SQE is prepared, the SQE becomes a NOP only used to deliver the completion
+    struct dax_mapping_t
+    {
+        int fd;
+        uint8_t *addr;
+        uint64_t size;
+    };
+    std::vector<dax_mapping_t> dax_devs;
+
+    bool prep_dax(int op, struct io_uring_sqe *sqe, int fd, const struct iovec *iov, unsigned nr_vecs, off_t offset);
+
+    inline int find_fixed_buffer(const void *buf, size_t len)
+    {
+        for (int i = 0; i < fixed_bufs.size(); i++)
+        {
+            if (buf >= fixed_bufs[i].iov_base &&
+                (uint8_t*)buf+len <= (uint8_t*)fixed_bufs[i].iov_base+fixed_bufs[i].iov_len)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    inline void use_fixed_file(struct io_uring_sqe *sqe)
+    {
+        for (int i = 0; i < fixed_fds.size(); i++)
+        {
+            if (fixed_fds[i] == sqe->fd)
+            {
+                sqe->fd = i;
+                sqe->flags |= IOSQE_FIXED_FILE;
+                return;
+            }
+        }
+    }
+
+    inline void prep_rw_fixed(int op, int fixed_op, struct io_uring_sqe *sqe, int fd, const struct iovec *iov, unsigned nr_vecs, off_t offset)
+    {
+        int buf_index = nr_vecs == 1 ? find_fixed_buffer(iov->iov_base, iov->iov_len) : -1;
+        if (buf_index >= 0)
+        {
+            my_uring_prep_rw(fixed_op, sqe, fd, iov->iov_base, iov->iov_len, offset);
+            sqe->buf_index = buf_index;
+        }
+        else
+            my_uring_prep_rw(op, sqe, fd, iov, nr_vecs, offset);
+        use_fixed_file(sqe);
+    }
 public:
-    ring_loop_t(int qd);
+    ring_loop_stats_t stats;
+
+    ring_loop_t(int qd, const ring_loop_config_t & config = ring_loop_config_t());
     ~ring_loop_t();
     void register_consumer(ring_consumer_t *consumer);
     void unregister_consumer(ring_consumer_t *consumer);
@@ -144,7 +410,9 @@ public:
         if (sqe)
         {
             *sqe = { 0 };
-            io_uring_sqe_set_data(sqe, ring_datas + free_ring_data[--free_ring_data_ptr]);
+            ring_data_t *data = ring_datas + free_ring_data[--free_ring_data_ptr];
+            data->passthru = false;
+            io_uring_sqe_set_data(sqe, data);
         }
         return sqe;
     }
@@ -165,11 +433,21 @@ public:
     }
     inline int submit()
     {
+        stats.submit_count++;
+        // With SQPOLL, io_uring_submit() only enters the kernel to wake up the polling thread
+        if (config.sqpoll ? (__atomic_load_n(ring.sq.kflags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) : (ring.sq.sqe_tail != ring.sq.sqe_head))
+            stats.submit_syscalls++;
         return io_uring_submit(&ring);
     }
     inline int wait()
     {
         struct io_uring_cqe *cqe;
+        stats.wait_count++;
+        if (!io_uring_peek_cqe(&ring, &cqe))
+            return 0;
+        if (config.busy_poll_us > 0 && busy_poll())
+            return 0;
+        stats.wait_syscalls++;
         return io_uring_wait_cqe(&ring, &cqe);
     }
     inline unsigned space_left()
@@ -184,6 +462,105 @@ public:
     void loop();
     void wakeup();
 
+    // Register long-lived fds and buffers with the ring to save fd lookups and page pinning
+    // on every I/O. Registration is best-effort: it may be unsupported by the kernel or
+    // exceed RLIMIT_MEMLOCK, in that case the prep_* methods just use regular fds and buffers
+    bool register_fd(int fd);
+    void unregister_fd(int fd);
+    bool register_buffer(void *buf, size_t len);
+    void unregister_buffer(void *buf);
+
+#ifdef WITH_NVME_PASSTHRU
+    // Send reads, writes and fsyncs of block device <fd> to its NVMe generic char device <ng_fd>
+    // as passthrough commands. Requires big_sqe, returns false if it's not supported by the ring or the kernel
+    bool register_nvme_passthru(int fd, int ng_fd, uint32_t nsid, unsigned lba_shift, uint64_t start,
+        uint64_t max_len, unsigned max_vecs, bool fua);
+    void unregister_nvme_passthru(int fd);
+#endif
+
+    // Do reads and writes of <fd> through its DAX mapping <addr> of <size> bytes with CPU loads and
+    // non-temporal stores, writes are durable on completion and fsyncs are no-ops
+    void register_dax(int fd, void *addr, uint64_t size);
+    void unregister_dax(int fd);
+
+    // Check if the kernel supports an io_uring opcode
+    bool is_op_supported(int opcode);
+
+#ifdef IORING_RECV_MULTISHOT
+    // Set up a ring of <count> provided buffers of <buf_size> bytes for operations with IOSQE_BUFFER_SELECT.
+    // Returns false if it's not supported by the kernel (Linux 5.19+)
+    bool setup_buf_ring(int bgid, unsigned count, unsigned buf_size);
+    void free_buf_ring(int bgid);
+    // Get the buffer selected by the kernel for a completion
+    inline uint8_t *get_selected_buf(int bgid, unsigned cqe_flags)
+    {
+        auto & r = buf_rings.at(bgid);
+        return r.bufs + (cqe_flags >> IORING_CQE_BUFFER_SHIFT) * r.buf_size;
+    }
+    // Give the buffer back to the kernel
+    inline void recycle_buf(int bgid, unsigned cqe_flags)
+    {
+        auto & r = buf_rings.at(bgid);
+        unsigned bid = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+        io_uring_buf_ring_add(r.br, r.bufs + bid*r.buf_size, r.buf_size, bid, io_uring_buf_ring_mask(r.count), 0);
+        io_uring_buf_ring_advance(r.br, 1);
+    }
+#endif
+
+    // Same as my_uring_prep_*, but use registered files and buffers when possible
+    inline void prep_readv(struct io_uring_sqe *sqe, int fd, const struct iovec *iov, unsigned nr_vecs, off_t offset)
+    {
+        if (dax_devs.size() && prep_dax(IORING_OP_READV, sqe, fd, iov, nr_vecs, offset))
+            return;
+#ifdef WITH_NVME_PASSTHRU
+        if (nvme_devs.size() && prep_nvme_rw(NVME_CMD_READ, sqe, fd, iov, nr_vecs, offset, 0))
+            return;
+#endif
+        prep_rw_fixed(IORING_OP_READV, IORING_OP_READ_FIXED, sqe, fd, iov, nr_vecs, offset);
+    }
+    // <rw_flags> are RWF_* flags, i.e. RWF_DSYNC for a write which is durable on completion (FUA)
+    inline void prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov, unsigned nr_vecs, off_t offset, int rw_flags = 0)
+    {
+        if (dax_devs.size() && prep_dax(IORING_OP_WRITEV, sqe, fd, iov, nr_vecs, offset))
+            return;
+#ifdef WITH_NVME_PASSTHRU
+        if (nvme_devs.size() && prep_nvme_rw(NVME_CMD_WRITE, sqe, fd, iov, nr_vecs, offset, rw_flags))
+            return;
+#endif
+        prep_rw_fixed(IORING_OP_WRITEV, IORING_OP_WRITE_FIXED, sqe, fd, iov, nr_vecs, offset);
+        sqe->rw_flags = rw_flags;
+    }
+    inline void prep_fallocate(struct io_uring_sqe *sqe, int fd, int mode, off_t offset, off_t len)
+    {
+        my_uring_prep_fallocate(sqe, fd, mode, offset, len);
+        use_fixed_file(sqe);
+    }
+#ifdef WITH_URING_DISCARD
+    inline void prep_discard(struct io_uring_sqe *sqe, int fd, uint64_t offset, uint64_t len)
+    {
+        my_uring_prep_cmd_discard(sqe, fd, offset, len);
+        use_fixed_file(sqe);
+    }
+#endif
+    inline void prep_fsync(struct io_uring_sqe *sqe, int fd, unsigned fsync_flags)
+    {
+        if (dax_devs.size() && prep_dax(IORING_OP_FSYNC, sqe, fd, NULL, 0, 0))
+            return;
+#ifdef WITH_NVME_PASSTHRU
+        nvme_passthru_t *dev = nvme_devs.size() ? find_nvme(fd) : NULL;
+        if (dev)
+        {
+            my_uring_prep_nvme_cmd(sqe, dev->ng_fd, dev->nsid, NVME_CMD_FLUSH, NULL, 0, 0, 0);
+            ((ring_data_t*)sqe->user_data)->passthru = true;
+            ((ring_data_t*)sqe->user_data)->passthru_len = 0;
+            use_fixed_file(sqe);
+            return;
+        }
+#endif
+        my_uring_prep_fsync(sqe, fd, fsync_flags);
+        use_fixed_file(sqe);
+    }
+
     unsigned save();
     void restore(unsigned sqe_tail);
 };
@@ -0,0 +1,154 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "malloc_or_die.h"
+
+// Fixed-size item pool. Items are carved from large slabs and recycled through
+// an intrusive free list, so node-based containers (std::map and friends) don't
+// call malloc/free on every insert/erase and their nodes stay close in memory.
+// Slabs are only returned to the system when the pool itself is destroyed.
+class slab_pool_t
+{
+    size_t item_size = 0;
+    size_t slab_items;
+    void *free_list = NULL;
+    std::vector<void*> slabs;
+    uint64_t used_count = 0;
+    // Counter shared by pools of all threads when items may be released into another thread's pool,
+    // per-pool counters would skew in that case
+    std::atomic<int64_t> *shared_used = NULL;
+
+    void add_slab()
+    {
+        uint8_t *slab = (uint8_t*)malloc_or_die(item_size * slab_items);
+        slabs.push_back(slab);
+        for (size_t i = slab_items; i > 0; i--)
+        {
+            *(void**)(slab + (i-1)*item_size) = free_list;
+            free_list = slab + (i-1)*item_size;
+        }
+    }
+
+public:
+    slab_pool_t(size_t slab_items = 1024, std::atomic<int64_t> *shared_used = NULL)
+    {
+        this->slab_items = slab_items;
+        this->shared_used = shared_used;
+    }
+
+    ~slab_pool_t()
+    {
+        for (auto slab: slabs)
+            free(slab);
+    }
+
+    // Keep items pointer-aligned, free list pointers are stored inside them
+    static inline size_t round_size(size_t size)
+    {
+        return (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    }
+
+    // The pool is bound to the size of the first requested item
+    inline bool fits(size_t size)
+    {
+        return !item_size || item_size == round_size(size);
+    }
+
+    inline void *alloc(size_t size)
+    {
+        if (!item_size)
+            item_size = round_size(size);
+        if (!free_list)
+            add_slab();
+        void *item = free_list;
+        free_list = *(void**)item;
+        if (shared_used)
+            shared_used->fetch_add(1, std::memory_order_relaxed);
+        else
+            used_count++;
+        return item;
+    }
+
+    inline void release(void *item)
+    {
+        *(void**)item = free_list;
+        free_list = item;
+        if (shared_used)
+            shared_used->fetch_sub(1, std::memory_order_relaxed);
+        else
+            used_count--;
+    }
+
+    inline size_t get_item_size() { return item_size; }
+    // With a shared counter, the number of items used from all pools sharing it
+    inline uint64_t get_used_count() { return shared_used ? shared_used->load(std::memory_order_relaxed) : used_count; }
+    inline uint64_t get_allocated_bytes() { return slabs.size() * slab_items * item_size; }
+};
+
+// STL allocator on top of slab_pool_t. Single-item allocations of the first
+// requested type go to the shared pool, everything else goes to malloc.
+// Default-constructed allocators create their own pool, so containers using it
+// may be declared as plain members without extra initialisation.
+template<class T> class slab_allocator_t
+{
+public:
+    typedef T value_type;
+
+    std::shared_ptr<slab_pool_t> pool;
+
+    slab_allocator_t(): pool(std::make_shared<slab_pool_t>())
+    {
+    }
+
+    slab_allocator_t(const std::shared_ptr<slab_pool_t> & pool): pool(pool)
+    {
+    }
+
+    template<class U> slab_allocator_t(const slab_allocator_t<U> & other): pool(other.pool)
+    {
+    }
+
+    inline T *allocate(size_t n)
+    {
+        if (n == 1 && pool->fits(sizeof(T)))
+            return (T*)pool->alloc(sizeof(T));
+        return (T*)malloc_or_die(n * sizeof(T));
+    }
+
+    inline void deallocate(T *p, size_t n)
+    {
+        if (n == 1 && pool->get_item_size() && pool->fits(sizeof(T)))
+            pool->release(p);
+        else
+            free(p);
+    }
+
+    template<class U> inline bool operator == (const slab_allocator_t<U> & other) const
+    {
+        return pool == other.pool;
+    }
+
+    template<class U> inline bool operator != (const slab_allocator_t<U> & other) const
+    {
+        return pool != other.pool;
+    }
+};
+
+// Per-thread pool for class-specific operator new/delete of T. Pools are never destroyed:
+// an object may be freed by another thread or outlive the thread that allocated it.
+// So the used item count is shared by pools of all threads
+template<class T> inline slab_pool_t & thread_slab_pool(size_t slab_items = 256)
+{
+    static std::atomic<int64_t> used(0);
+    static thread_local slab_pool_t *pool = new slab_pool_t(slab_items, &used);
+    return *pool;
+}
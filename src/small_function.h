@@ -0,0 +1,165 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// std::function replacement for per-I/O callbacks which never allocates memory:
+// the callable is always stored inline, in a buffer of <Size> bytes. Callables
+// that don't fit are rejected at compile time instead of silently going to the heap
+// (libstdc++ std::function only keeps up to 16 bytes of captures inline).
+template<typename Sig, size_t Size> class small_function_t;
+
+template<typename R, typename... Args, size_t Size> class small_function_t<R(Args...), Size>
+{
+    enum manage_op_t { MANAGE_COPY, MANAGE_MOVE, MANAGE_DESTROY };
+
+    alignas(max_align_t) unsigned char storage[Size];
+    R (*invoke_fn)(void *storage, Args... args) = NULL;
+    void (*manage_fn)(manage_op_t op, void *dst, void *src) = NULL;
+
+    template<typename F> static R invoke(void *storage, Args... args)
+    {
+        return (*(F*)storage)(std::forward<Args>(args)...);
+    }
+
+    template<typename F> static void manage(manage_op_t op, void *dst, void *src)
+    {
+        if (op == MANAGE_COPY)
+            new(dst) F(*(const F*)src);
+        else if (op == MANAGE_MOVE)
+        {
+            new(dst) F(std::move(*(F*)src));
+            ((F*)src)->~F();
+        }
+        else
+            ((F*)dst)->~F();
+    }
+
+    void copy_from(const small_function_t & other)
+    {
+        if (other.invoke_fn)
+        {
+            other.manage_fn(MANAGE_COPY, storage, (void*)other.storage);
+            invoke_fn = other.invoke_fn;
+            manage_fn = other.manage_fn;
+        }
+    }
+
+    void move_from(small_function_t & other)
+    {
+        if (other.invoke_fn)
+        {
+            other.manage_fn(MANAGE_MOVE, storage, other.storage);
+            invoke_fn = other.invoke_fn;
+            manage_fn = other.manage_fn;
+            other.invoke_fn = NULL;
+            other.manage_fn = NULL;
+        }
+    }
+
+public:
+    small_function_t()
+    {
+    }
+
+    small_function_t(std::nullptr_t)
+    {
+    }
+
+    small_function_t(const small_function_t & other)
+    {
+        copy_from(other);
+    }
+
+    small_function_t(small_function_t && other)
+    {
+        move_from(other);
+    }
+
+    template<typename F, typename FT = typename std::decay<F>::type,
+        typename = typename std::enable_if<!std::is_same<FT, small_function_t>::value>::type,
+        typename = decltype(std::declval<FT&>()(std::declval<Args>()...))>
+    small_function_t(F && f)
+    {
+        static_assert(sizeof(FT) <= Size, "callback captures too much to be stored inline");
+        static_assert(alignof(FT) <= alignof(max_align_t), "callback alignment is too large");
+        new(storage) FT(std::forward<F>(f));
+        invoke_fn = &invoke<FT>;
+        manage_fn = &manage<FT>;
+    }
+
+    ~small_function_t()
+    {
+        reset();
+    }
+
+    small_function_t & operator = (const small_function_t & other)
+    {
+        if (this != &other)
+        {
+            reset();
+            copy_from(other);
+        }
+        return *this;
+    }
+
+    small_function_t & operator = (small_function_t && other)
+    {
+        if (this != &other)
+        {
+            reset();
+            move_from(other);
+        }
+        return *this;
+    }
+
+    small_function_t & operator = (std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    template<typename F, typename FT = typename std::decay<F>::type,
+        typename = typename std::enable_if<!std::is_same<FT, small_function_t>::value>::type,
+        typename = decltype(std::declval<FT&>()(std::declval<Args>()...))>
+    small_function_t & operator = (F && f)
+    {
+        // <f> may reference the currently stored callable, so destroy it only after copying <f>
+        small_function_t tmp(std::forward<F>(f));
+        reset();
+        move_from(tmp);
+        return *this;
+    }
+
+    void reset()
+    {
+        if (invoke_fn)
+        {
+            manage_fn(MANAGE_DESTROY, storage, NULL);
+            invoke_fn = NULL;
+            manage_fn = NULL;
+        }
+    }
+
+    void swap(small_function_t & other)
+    {
+        small_function_t tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    explicit operator bool() const
+    {
+        return invoke_fn != NULL;
+    }
+
+    R operator () (Args... args) const
+    {
+        return invoke_fn((void*)storage, std::forward<Args>(args)...);
+    }
+};
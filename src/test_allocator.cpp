@@ -3,7 +3,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <map>
 #include "allocator.h"
+#include "slab_allocator.h"
 
 void alloc_all(int size)
 {
@@ -39,10 +42,144 @@ void alloc_all(int size)
     delete a;
 }
 
+void alloc_hint_test()
+{
+    allocator *a = new allocator(10000);
+    for (int i = 0; i < 10000; i += 2)
+        a->set(i, true);
+    // Hinted allocation returns the next free block and wraps around
+    if (a->find_free(5000) != 5001 || a->find_free(5001) != 5001 || a->find_free(20000) != 1)
+    {
+        printf("incorrect hinted allocation\n");
+        exit(1);
+    }
+    for (int i = 5001; i < 10000; i += 2)
+        a->set(i, true);
+    if (a->find_free(5000) != 1)
+    {
+        printf("hinted allocation doesn't wrap around\n");
+        exit(1);
+    }
+    // Only blocks 1, 3 ... 4999 are free now, so no 2 contiguous ones
+    if (a->find_free_range(2) != UINT64_MAX)
+    {
+        printf("found a range in fully fragmented space\n");
+        exit(1);
+    }
+    for (int i = 7000; i < 7100; i++)
+        a->set(i, false);
+    for (int i = 2990; i < 3110; i++)
+        a->set(i, i >= 3000 && i < 3100 ? false : true);
+    if (a->find_free_range(100) != 3000 || a->find_free_range(100, 3001) != 7000 ||
+        a->find_free_range(100, 8000) != 3000 || a->find_free_range(101) != UINT64_MAX ||
+        a->find_free_range(50, 7060) != 3000 || a->find_free_range(40, 7060) != 7060)
+    {
+        printf("incorrect range allocation\n");
+        exit(1);
+    }
+    delete a;
+}
+
+static double elapsed(timespec & start)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+// Allocate and free random blocks in a mostly full allocator, measure allocation
+// throughput with and without a hint and how many contiguous 16-block ranges are left
+void alloc_bench(bool use_hint)
+{
+    const uint64_t size = 1024*1024;
+    allocator *a = new allocator(size);
+    srand(1);
+    for (uint64_t i = 0; i < size*9/10; i++)
+        a->set(a->find_free(), true);
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t ops = 0, hint = 0, contiguous = 0;
+    for (; ops < 1000000; ops++)
+    {
+        // Free runs of 4 blocks to keep some contiguous space
+        uint64_t freed = (rand() % (size/4)) * 4;
+        for (uint64_t i = 0; i < 4; i++)
+            a->set(freed+i, false);
+        for (uint64_t i = 0; i < 4; i++)
+        {
+            uint64_t x = use_hint ? a->find_free(hint) : a->find_free();
+            a->set(x, true);
+            contiguous += (x == hint);
+            hint = x+1;
+        }
+    }
+    double t = elapsed(start);
+    printf(
+        "%s find_free: %.1f M allocations/s, %.1f%% contiguous\n", use_hint ? "hinted" : "lowest-first",
+        ops*4/t/1000000, contiguous*100.0/ops/4
+    );
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t ranges = 0, next = 0;
+    while (1)
+    {
+        // Stop when the search wraps around
+        uint64_t pos = a->find_free_range(16, next);
+        if (pos == UINT64_MAX || pos < next)
+            break;
+        ranges++;
+        next = pos+16;
+    }
+    printf("free 16-block ranges: %lu, found in %.3f ms\n", ranges, elapsed(start)*1000);
+    delete a;
+}
+
+void slab_map_test()
+{
+    std::map<uint64_t, uint64_t, std::less<uint64_t>, slab_allocator_t<std::pair<const uint64_t, uint64_t>>> m;
+    for (uint64_t i = 0; i < 10000; i++)
+    {
+        m[i] = i*2;
+    }
+    auto it = m.find(5001);
+    for (uint64_t i = 0; i < 10000; i += 2)
+    {
+        m.erase(i);
+    }
+    for (uint64_t i = 10000; i < 15000; i++)
+    {
+        m[i] = i*2;
+    }
+    // Iterators must survive inserts and erases of other items
+    if (it->first != 5001 || it->second != 10002)
+    {
+        printf("slab map iterator invalidated\n");
+        exit(1);
+    }
+    if (m.size() != 10000 || m.get_allocator().pool->get_used_count() != 10000)
+    {
+        printf("slab map has %lu items, pool has %lu\n", m.size(), m.get_allocator().pool->get_used_count());
+        exit(1);
+    }
+    uint64_t prev = 0;
+    for (auto & kv: m)
+    {
+        if (kv.second != kv.first*2 || prev && kv.first <= prev)
+        {
+            printf("slab map is corrupted at %lu\n", kv.first);
+            exit(1);
+        }
+        prev = kv.first;
+    }
+}
+
 int main(int narg, char *args[])
 {
     alloc_all(8192);
     alloc_all(8062);
     alloc_all(4096);
+    alloc_hint_test();
+    alloc_bench(false);
+    alloc_bench(true);
+    slab_map_test();
     return 0;
 }
@@ -0,0 +1,60 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Check that busy_rate_t only measures busy time: idle gaps between bursts of work
+// must not lower the rate and work done while idle must not raise it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "busy_rate.h"
+
+static void check_rate(const busy_rate_t & r, uint64_t expected, const char *what)
+{
+    if (r.rate != expected)
+    {
+        printf("%s: rate is %lu, expected %lu\n", what, r.rate, expected);
+        exit(1);
+    }
+}
+
+int main(int narg, char *args[])
+{
+    // 100 MB/s in 10 ms bursts separated by 90 ms idle gaps
+    {
+        busy_rate_t r;
+        uint64_t now = 0;
+        for (int i = 0; i < 100; i++)
+        {
+            r.set_busy(true, now);
+            for (int j = 0; j < 10; j++)
+            {
+                now += 1000;
+                r.add(100000, now);
+            }
+            r.set_busy(false, now);
+            now += 90000;
+        }
+        check_rate(r, 100000000, "bursts");
+    }
+    // Work done while idle isn't counted and doesn't start a window
+    {
+        busy_rate_t r;
+        r.add(1000000000, 2000000);
+        check_rate(r, 0, "idle");
+        r.set_busy(true, 3000000);
+        r.add(50000000, 3500000);
+        check_rate(r, 0, "half window");
+        r.add(50000000, 4000000);
+        check_rate(r, 100000000, "one window");
+    }
+    // Moving average: the new window has 1/4 weight
+    {
+        busy_rate_t r;
+        r.set_busy(true, 0);
+        r.add(100000000, 1000000);
+        r.add(500000000, 2000000);
+        check_rate(r, 200000000, "average");
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 #include "cluster_client.h"
 
 void configure_single_pg_pool(cluster_client_t *cli)
@@ -47,11 +48,11 @@ void configure_single_pg_pool(cluster_client_t *cli)
     cli->st_cli.on_change_hook(changes);
 }
 
-int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c, std::function<void()> cb = NULL)
+int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c, std::function<void()> cb = NULL, bool instant = false)
 {
     printf("Post write %lx+%lx\n", offset, len);
     int *r = new int;
-    *r = -1;
+    *r = instant ? -2 : -1;
     cluster_op_t *op = new cluster_op_t();
     op->opcode = OSD_OP_WRITE;
     op->inode = 0x1000000000001;
@@ -75,6 +76,31 @@ int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c,
     return r;
 }
 
+int *test_read(cluster_client_t *cli, uint64_t offset, uint64_t len, bool instant = false)
+{
+    printf("Post read %lx+%lx\n", offset, len);
+    int *r = new int;
+    *r = instant ? -2 : -1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_READ;
+    op->inode = 0x1000000000001;
+    op->offset = offset;
+    op->len = len;
+    op->iov.push_back(malloc_or_die(len), len);
+    op->callback = [r](cluster_op_t *op)
+    {
+        if (*r == -1)
+            printf("Error: Not allowed to complete yet\n");
+        assert(*r != -1);
+        *r = op->retval == op->len ? 1 : 0;
+        free(op->iov.buf[0].iov_base);
+        printf("Done read %lx+%lx r=%d\n", op->offset, op->len, op->retval);
+        delete op;
+    };
+    cli->execute(op);
+    return r;
+}
+
 int *test_sync(cluster_client_t *cli)
 {
     printf("Post sync\n");
@@ -361,31 +387,20 @@ void test2()
     op->offset = 4096;
     memset(op->iov.buf[0].iov_base, 0x77, op->iov.buf[0].iov_len);
     cluster_client_t::copy_write(op, unsynced_writes);
-    // check it
-    assert(unsynced_writes.size() == 4);
+    // check it: adjacent parts are appended to previous buffers
+    assert(unsynced_writes.size() == 2);
     auto uit = unsynced_writes.begin();
     int i;
     assert(uit->first.inode == 1);
     assert(uit->first.stripe == 0);
-    assert(uit->second.len == 4096);
-    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x55; i++) {}
-    assert(i == uit->second.len);
-    uit++;
-    assert(uit->first.inode == 1);
-    assert(uit->first.stripe == 4096);
-    assert(uit->second.len == 4096);
-    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
+    assert(uit->second.len == 8192);
+    for (i = 0; i < 4096 && ((uint8_t*)uit->second.buf)[i] == 0x55; i++) {}
+    for (; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
     assert(i == uit->second.len);
     uit++;
     assert(uit->first.inode == 1);
     assert(uit->first.stripe == 8192);
-    assert(uit->second.len == 4096);
-    for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
-    assert(i == uit->second.len);
-    uit++;
-    assert(uit->first.inode == 1);
-    assert(uit->first.stripe == 12*1024);
-    assert(uit->second.len == 1016*1024);
+    assert(uit->second.len == 1020*1024);
     for (i = 0; i < uit->second.len && ((uint8_t*)uit->second.buf)[i] == 0x77; i++) {}
     assert(i == uit->second.len);
     uit++;
@@ -399,9 +414,344 @@ void test2()
     printf("[ok] copy_write test\n");
 }
 
+void test_writeback()
+{
+    json11::Json config = json11::Json::object { { "client_enable_writeback", true } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+
+    // Writes complete instantly and aren't sent
+    int *r1 = test_write(cli, 0, 0x1000, 0x55, NULL, true);
+    check_completed(r1);
+    r1 = test_write(cli, 0x1000, 0x1000, 0x66, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+
+    // Reads covered by buffered writes are served from memory
+    {
+        int done = 0;
+        cluster_op_t *op = new cluster_op_t();
+        op->opcode = OSD_OP_READ;
+        op->inode = 0x1000000000001;
+        op->offset = 0x800;
+        op->len = 0x1000;
+        op->iov.push_back(malloc_or_die(op->len), op->len);
+        op->callback = [&done](cluster_op_t *op)
+        {
+            assert(op->retval == op->len);
+            for (uint64_t i = 0; i < op->len; i++)
+                assert(((uint8_t*)op->iov.buf[0].iov_base)[i] == (i < 0x800 ? 0x55 : 0x66));
+            free(op->iov.buf[0].iov_base);
+            delete op;
+            done = 1;
+        };
+        cli->execute(op);
+        assert(done);
+        check_op_count(cli, 1, 0);
+    }
+
+    // Sync sends adjacent buffers with one write first
+    int *r2 = test_sync(cli);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x2000), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r2);
+
+    // Sync fails if the write-back fails, buffers are sent again with the next sync
+    r1 = test_write(cli, 0, 0x1000, 0x77, NULL, true);
+    check_completed(r1);
+    r2 = test_sync(cli);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), -EIO);
+    assert(*r2 == 0);
+    delete r2;
+    check_op_count(cli, 1, 0);
+    r2 = test_sync(cli);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r2);
+
+    delete cli;
+    delete tfd;
+
+    // Writes stop completing instantly when buffers hold client_max_dirty_bytes
+    config = json11::Json::object { { "client_enable_writeback", true }, { "client_max_dirty_bytes", 0x2000 } };
+    tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+    r1 = test_write(cli, 0, 0x1000, 0x55, NULL, true);
+    check_completed(r1);
+    r1 = test_write(cli, 0x1000, 0x1000, 0x66, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+    // The limit is reached: buffered writes are flushed by an extra sync
+    // and the new write waits for it and then for the OSD
+    r1 = test_write(cli, 0x2000, 0x1000, 0x77);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x2000), 0);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x2000, 0x1000), 0);
+    check_completed(r1);
+    // The sync freed the buffers, so writes complete instantly again
+    r1 = test_write(cli, 0x3000, 0x1000, 0x88, NULL, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+
+    delete cli;
+    delete tfd;
+    printf("[ok] write-back test\n");
+}
+
+void test_readahead()
+{
+    json11::Json config = json11::Json::object { { "client_readahead", 0x40000 } };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+
+    // The first reads are sent as is
+    int *r1 = test_read(cli, 0, 0x1000);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 0x1000), 0);
+    check_completed(r1);
+    r1 = test_read(cli, 0x1000, 0x1000);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x1000, 0x1000), 0);
+    check_completed(r1);
+    check_op_count(cli, 1, 0);
+
+    // Then whole objects are prefetched and the read waits for the first one
+    r1 = test_read(cli, 0x2000, 0x1000);
+    check_op_count(cli, 1, 3);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 0x20000), 0);
+    check_completed(r1);
+    check_op_count(cli, 1, 2);
+
+    // Subsequent reads are served from memory
+    r1 = test_read(cli, 0x3000, 0x1000, true);
+    check_completed(r1);
+    check_op_count(cli, 1, 2);
+
+    // Writes invalidate prefetched data
+    int *r2 = test_write(cli, 0x4000, 0x1000, 0x55);
+    check_op_count(cli, 1, 3);
+    r1 = test_read(cli, 0x4000, 0x1000);
+    check_op_count(cli, 1, 4);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x4000, 0x1000), 0);
+    check_completed(r2);
+    // Prefetch started before the write completion is discarded and the read is sent as is
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 0x20000), 0);
+    check_op_count(cli, 1, 3);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x4000, 0x1000), 0);
+    check_completed(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x20000, 0x20000), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x40000, 0x20000), 0);
+    check_op_count(cli, 1, 0);
+
+    delete cli;
+    delete tfd;
+    printf("[ok] read-ahead test\n");
+}
+
+void test_batch()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+
+    // Two writes, a read and a sync in one batch
+    int done = 0;
+    cluster_op_t *ops[4];
+    for (int i = 0; i < 4; i++)
+    {
+        cluster_op_t *op = ops[i] = new cluster_op_t();
+        op->opcode = i < 2 ? OSD_OP_WRITE : (i == 2 ? OSD_OP_READ : OSD_OP_SYNC);
+        if (op->opcode != OSD_OP_SYNC)
+        {
+            op->inode = 0x1000000000001;
+            op->offset = i*0x1000;
+            op->len = 0x1000;
+            op->iov.push_back(malloc_or_die(op->len), op->len);
+        }
+        op->callback = [&done](cluster_op_t *op)
+        {
+            assert(op->retval == op->len);
+            if (op->iov.count)
+                free(op->iov.buf[0].iov_base);
+            delete op;
+            done++;
+        };
+    }
+    cli->execute_batch(ops, 4);
+    assert(!cli->msgr.hold_sends);
+    // Reads and writes are all sent at once, the sync still waits for the writes
+    check_op_count(cli, 1, 3);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 0x1000), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0x2000, 0x1000), 0);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0x1000, 0x1000), 0);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_op_count(cli, 1, 0);
+    assert(done == 4);
+
+    delete cli;
+    delete tfd;
+    printf("[ok] batch test\n");
+}
+
+void test_merge()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    cli->continue_ops(true);
+
+    // Merges are only allowed for whole objects
+    int retval = 1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_MERGE;
+    op->inode = 0x1000000000001;
+    op->offset = 0x1000;
+    op->callback = [&retval](cluster_op_t *op)
+    {
+        retval = op->retval;
+        delete op;
+    };
+    cli->execute(op);
+    assert(retval == -EINVAL);
+    check_op_count(cli, 1, 0);
+
+    // The merge is sent to the primary as a single zero-length operation
+    retval = 1;
+    op = new cluster_op_t();
+    op->opcode = OSD_OP_MERGE;
+    op->inode = 0x1000000000001;
+    op->offset = 0x20000;
+    op->callback = [&retval](cluster_op_t *op)
+    {
+        retval = op->retval;
+        delete op;
+    };
+    cli->execute(op);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_MERGE, 0x20000, 0), 0);
+    assert(retval == 0);
+
+    // Merged data is unsynced on the OSD, so the following sync is sent to it
+    int *r = test_sync(cli);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r);
+
+    delete cli;
+    delete tfd;
+    printf("[ok] merge test\n");
+}
+
+// Measure the rate of copy_write() with 32 MB of dirty data
+void bench_copy_write()
+{
+    const uint64_t dirty_size = 32*1024*1024, write_size = 4096;
+    std::map<object_id, cluster_buffer_t> unsynced_writes;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_WRITE;
+    op->inode = 1;
+    op->len = write_size;
+    op->iov.push_back(malloc_or_die(write_size), write_size);
+    memset(op->iov.buf[0].iov_base, 0x55, write_size);
+    for (int random = 0; random < 2; random++)
+    {
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t i = 0; i < dirty_size/write_size; i++)
+        {
+            op->offset = random ? (lrand48() % (dirty_size/write_size))*write_size : i*write_size;
+            cluster_client_t::copy_write(op, unsynced_writes);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1000000000.0;
+        printf("copy_write, %s 4k writes over 32 MB: %.0f writes/s, %lu buffers\n", random ? "random" : "sequential",
+            (dirty_size/write_size)/sec, unsynced_writes.size());
+        for (auto p: unsynced_writes)
+        {
+            free(p.second.buf);
+        }
+        unsynced_writes.clear();
+    }
+    free(op->iov.buf[0].iov_base);
+    delete op;
+}
+
+// Measure the rate of applying inode config changes received from etcd one by one
+void bench_inode_config()
+{
+    const uint64_t inode_count = 100000;
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    std::string prefix = cli->st_cli.etcd_prefix+"/config/inode/1/";
+    for (int action = 0; action < 3; action++)
+    {
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t i = 1; i <= inode_count; i++)
+        {
+            etcd_kv_t kv = { .key = prefix+std::to_string(i) };
+            if (action < 2)
+            {
+                kv.value = json11::Json::object {
+                    { "name", "img"+std::to_string(i) },
+                    { "size", (action+1)*1024*1024*1024ul },
+                };
+            }
+            cli->st_cli.parse_state(kv);
+            std::map<std::string, etcd_kv_t> changes = { { kv.key, kv } };
+            cli->st_cli.on_change_hook(changes);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1000000000.0;
+        printf("%s %lu inodes: %.0f changes/s\n", action == 0 ? "create" : (action == 1 ? "resize" : "delete"),
+            inode_count, inode_count/sec);
+        assert(cli->st_cli.inode_config.size() == (action < 2 ? inode_count : 0));
+        assert(cli->st_cli.inode_by_name.size() == (action < 2 ? inode_count : 0));
+    }
+    delete cli;
+    delete tfd;
+}
+
 int main(int narg, char *args[])
 {
     test1();
     test2();
+    test_writeback();
+    test_readahead();
+    test_batch();
+    test_merge();
+    bench_copy_write();
+    bench_inode_config();
     return 0;
 }
@@ -0,0 +1,848 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+/**
+ * Deterministic cluster simulator: many real cluster_client_t instances running on the mock
+ * messenger and the virtual clock (src/mock) against modelled OSDs, peering and monitor, so
+ * that client retry logic and cluster reaction to failures can be evaluated at the scale of
+ * thousands of OSDs on a single machine. The same options and seed always give the same result.
+ *
+ * test_cluster_sim [options]
+ *
+ * Cluster: --osds 1000, --osds_per_host 10 (hosts are failure domains), --pg_count 4096,
+ * --pg_size 3, --pg_minsize 2.
+ * Clients: --clients 32, --iodepth 16 (per client), --bs 4096, --write_pct 50,
+ * --image_size 1073741824 (every client uses its own image), --sync_every 0 (writes between
+ * syncs, 0 means immediate_commit=all), --up_wait_retry_interval 500 (ms).
+ * Latencies in microseconds: --net_us 20 (one way), --osd_us 50 (service time, every OSD
+ * serves operations one by one, writes also wait for replicas), --jitter_pct 20.
+ * Failures: --fail_osds 0 (number of OSDs to kill), --fail_hosts 0 (number of hosts to kill),
+ * --fail_at 10 (s), --fail_for 0 (s, 0 = forever).
+ * Reaction times in milliseconds: --detect_ms 0 (until connections to a dead OSD break),
+ * --lease_ms 10000 (until the monitor notices a dead OSD and picks other primaries for its PGs),
+ * --peering_ms 5 (peering of one PG, every OSD peers its PGs one by one), --out_ms 30000
+ * (until the monitor moves PGs out of dead OSDs, 0 = never), --etcd_ms 5 (delivery of etcd
+ * changes to clients), --reconnect_ms 5000 (retry interval of failed connections).
+ * Other: --runtime 60 (virtual seconds), --seed 1, --timeline 1 (print per-second stats),
+ * --verbose 1 (don't hide client messages).
+ *
+ * Reports client operation latency percentiles, time until all PGs are active again after
+ * failures, and real (wall clock) time of placement recomputation and of applying the new
+ * PG configuration on all clients.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <stdexcept>
+
+#include "cluster_client.h"
+#include "pg_states.h"
+#include "latency_hist.h"
+#include "mock_sim.h"
+
+struct sim_osd_t
+{
+    uint64_t host = 0;
+    bool up = true;
+    // Incremented on failures and restarts, replies of lost operations are dropped
+    uint64_t incarnation = 0;
+    uint64_t busy_until = 0, peer_busy_until = 0;
+};
+
+struct sim_pg_t
+{
+    std::vector<osd_num_t> osd_set;
+    osd_num_t primary = 0;
+    int state = PG_ACTIVE;
+    uint64_t peering_epoch = 0;
+};
+
+struct sim_client_t
+{
+    cluster_client_t *cli = NULL;
+    inode_t inode = 0;
+    void *buf = NULL;
+    int next_fd = 10;
+    int inflight = 0;
+    uint64_t writes_since_sync = 0;
+};
+
+struct cluster_sim_t
+{
+    uint64_t osd_count = 1000, osds_per_host = 10, pg_count = 4096, pg_size = 3, pg_minsize = 2;
+    uint64_t client_count = 32, iodepth = 16, bs = 4096, write_pct = 50, image_size = 1024*1024*1024;
+    uint64_t sync_every = 0, up_wait_retry_interval = 500;
+    uint64_t net_us = 20, osd_us = 50, jitter_pct = 20;
+    uint64_t fail_osds = 0, fail_hosts = 0, fail_at = 10, fail_for = 0;
+    uint64_t detect_ms = 0, lease_ms = 10000, peering_ms = 5, out_ms = 30000, etcd_ms = 5, reconnect_ms = 5000;
+    uint64_t runtime = 60, seed = 1;
+    bool timeline = false, verbose = false;
+
+    uint64_t rng_state = 0;
+    timerfd_manager_t *tfd = NULL;
+    std::vector<sim_osd_t> osds;
+    std::vector<sim_pg_t> pgs;
+    std::vector<sim_client_t*> clients;
+    std::map<osd_messenger_t*, sim_client_t*> client_by_msgr;
+    uint64_t pg_stripe_size = 0, block_size = 0;
+    bool stopping = false;
+
+    // PG states and configuration waiting to be delivered to clients
+    std::set<pg_num_t> dirty_pg_states;
+    bool pg_config_dirty = false, publish_scheduled = false;
+    uint64_t inactive_pgs = 0;
+    uint64_t last_failure_us = 0;
+    bool waiting_active = false;
+
+    latency_hist_t hist = {};
+    uint64_t op_count = 0, op_errors = 0, lat_sum = 0, lat_max = 0, sync_count = 0;
+    uint64_t sec_ops = 0, sec_lat_sum = 0, sec_lat_max = 0;
+    uint64_t placement_us = 0, placement_runs = 0, apply_config_us = 0, apply_config_runs = 0;
+
+    void parse_args(int narg, char *args[]);
+    uint64_t rand();
+    uint64_t jitter(uint64_t us);
+    void run();
+    void place_pgs();
+    void set_pg_state(sim_pg_t & pg, int state);
+    void schedule_publish();
+    void publish();
+    json11::Json pg_state_json(sim_pg_t & pg);
+    json11::Json pg_config_json();
+    void start_client(int i);
+    void submit_op(sim_client_t *c);
+    void on_outbox_push(sim_client_t *c, osd_op_t *op);
+    void reply_op(sim_client_t *c, int peer_fd, uint64_t op_id, int64_t retval);
+    void on_connect_peer(sim_client_t *c, osd_num_t osd_num);
+    void fail_osd(osd_num_t osd_num);
+    void restore_osd(osd_num_t osd_num);
+    void mon_pick_primaries();
+    void mon_move_out();
+    void start_peering(pg_num_t pg_num);
+    void print_second();
+    void print_results();
+};
+
+static uint64_t wall_us()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000000 + tv.tv_nsec/1000;
+}
+
+void cluster_sim_t::parse_args(int narg, char *args[])
+{
+    std::map<std::string, uint64_t*> opts = {
+        { "osds", &osd_count }, { "osds_per_host", &osds_per_host }, { "pg_count", &pg_count },
+        { "pg_size", &pg_size }, { "pg_minsize", &pg_minsize }, { "clients", &client_count },
+        { "iodepth", &iodepth }, { "bs", &bs }, { "write_pct", &write_pct }, { "image_size", &image_size },
+        { "sync_every", &sync_every }, { "up_wait_retry_interval", &up_wait_retry_interval },
+        { "net_us", &net_us }, { "osd_us", &osd_us }, { "jitter_pct", &jitter_pct },
+        { "fail_osds", &fail_osds }, { "fail_hosts", &fail_hosts }, { "fail_at", &fail_at }, { "fail_for", &fail_for },
+        { "detect_ms", &detect_ms }, { "lease_ms", &lease_ms }, { "peering_ms", &peering_ms }, { "out_ms", &out_ms },
+        { "etcd_ms", &etcd_ms }, { "reconnect_ms", &reconnect_ms }, { "runtime", &runtime }, { "seed", &seed },
+    };
+    for (int i = 1; i < narg; i++)
+    {
+        if (args[i][0] != '-' || args[i][1] != '-' || i >= narg-1)
+        {
+            throw std::runtime_error(std::string("unexpected argument: ")+args[i]);
+        }
+        std::string opt = args[i]+2;
+        char *end = NULL;
+        uint64_t value = strtoull(args[++i], &end, 10);
+        if (*end)
+        {
+            throw std::runtime_error("--"+opt+" must be a number");
+        }
+        if (opt == "timeline")
+            timeline = value != 0;
+        else if (opt == "verbose")
+            verbose = value != 0;
+        else if (opts.find(opt) != opts.end())
+            *opts[opt] = value;
+        else
+            throw std::runtime_error("unknown option: --"+opt);
+    }
+    if (!osds_per_host || osd_count < osds_per_host*pg_size)
+    {
+        throw std::runtime_error("there must be at least --pg_size hosts");
+    }
+    if (!pg_count || !pg_size || pg_minsize > pg_size || !client_count || !iodepth ||
+        !bs || (bs % 4096) || image_size < bs || !runtime)
+    {
+        throw std::runtime_error("invalid options");
+    }
+    if (fail_osds > osd_count || fail_hosts > osd_count/osds_per_host)
+    {
+        throw std::runtime_error("can't kill more OSDs or hosts than there are");
+    }
+}
+
+// splitmix64, so that results don't depend on the libc
+uint64_t cluster_sim_t::rand()
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+uint64_t cluster_sim_t::jitter(uint64_t us)
+{
+    uint64_t range = us*jitter_pct/100;
+    return range ? us - range + rand() % (2*range+1) : us;
+}
+
+// Pick OSDs from different hosts for every PG. The first one is the primary
+void cluster_sim_t::place_pgs()
+{
+    uint64_t host_count = osd_count/osds_per_host;
+    pgs.resize(pg_count);
+    for (auto & pg: pgs)
+    {
+        std::set<uint64_t> used_hosts;
+        pg.osd_set.clear();
+        while (pg.osd_set.size() < pg_size)
+        {
+            uint64_t host = rand() % host_count;
+            if (used_hosts.find(host) == used_hosts.end())
+            {
+                used_hosts.insert(host);
+                pg.osd_set.push_back(host*osds_per_host + rand() % osds_per_host + 1);
+            }
+        }
+        pg.primary = pg.osd_set[0];
+    }
+}
+
+void cluster_sim_t::set_pg_state(sim_pg_t & pg, int state)
+{
+    if ((pg.state & PG_ACTIVE) && !(state & PG_ACTIVE))
+        inactive_pgs++;
+    else if (!(pg.state & PG_ACTIVE) && (state & PG_ACTIVE))
+        inactive_pgs--;
+    pg.state = state;
+    dirty_pg_states.insert(&pg - pgs.data() + 1);
+    schedule_publish();
+    if (waiting_active && !inactive_pgs)
+    {
+        waiting_active = false;
+        printf("All PGs are active %lu ms after the failure\n", (sim_now_us()-last_failure_us)/1000);
+    }
+}
+
+json11::Json cluster_sim_t::pg_state_json(sim_pg_t & pg)
+{
+    if (!pg.primary || pg.state == PG_OFFLINE)
+    {
+        return json11::Json();
+    }
+    json11::Json::array state, peers;
+    for (int i = 0; i < pg_state_bit_count; i++)
+    {
+        if (pg.state & pg_state_bits[i])
+            state.push_back(pg_state_names[i]);
+    }
+    for (auto osd_num: pg.osd_set)
+    {
+        if (osds[osd_num].up)
+            peers.push_back(osd_num);
+    }
+    return json11::Json::object {
+        { "primary", pg.primary },
+        { "state", state },
+        { "peers", peers },
+    };
+}
+
+json11::Json cluster_sim_t::pg_config_json()
+{
+    json11::Json::object items;
+    for (uint64_t i = 0; i < pg_count; i++)
+    {
+        items[std::to_string(i+1)] = json11::Json::object {
+            { "osd_set", pgs[i].osd_set },
+            { "primary", pgs[i].primary },
+        };
+    }
+    return json11::Json::object { { "items", json11::Json::object { { "1", items } } } };
+}
+
+void cluster_sim_t::schedule_publish()
+{
+    if (!publish_scheduled)
+    {
+        publish_scheduled = true;
+        sim_schedule(etcd_ms*1000, [this]() { publish(); });
+    }
+}
+
+// Deliver changes to all clients like an etcd watch does: in one batch
+void cluster_sim_t::publish()
+{
+    publish_scheduled = false;
+    json11::Json pg_config;
+    uint64_t start = wall_us();
+    if (pg_config_dirty)
+    {
+        pg_config_dirty = false;
+        pg_config = pg_config_json();
+    }
+    std::vector<std::pair<pg_num_t, json11::Json>> states;
+    for (auto pg_num: dirty_pg_states)
+    {
+        states.push_back({ pg_num, pg_state_json(pgs[pg_num-1]) });
+    }
+    dirty_pg_states.clear();
+    for (auto c: clients)
+    {
+        std::string prefix = c->cli->st_cli.etcd_prefix;
+        if (!pg_config.is_null())
+        {
+            c->cli->st_cli.parse_state((etcd_kv_t){ .key = prefix+"/config/pgs", .value = pg_config });
+        }
+        for (auto & st: states)
+        {
+            c->cli->st_cli.parse_state((etcd_kv_t){ .key = prefix+"/pg/state/1/"+std::to_string(st.first), .value = st.second });
+        }
+        std::map<std::string, etcd_kv_t> changes;
+        c->cli->st_cli.on_change_hook(changes);
+    }
+    if (!pg_config.is_null())
+    {
+        apply_config_us += wall_us()-start;
+        apply_config_runs++;
+    }
+}
+
+void cluster_sim_t::start_client(int i)
+{
+    sim_client_t *c = new sim_client_t();
+    json11::Json config = json11::Json::object {
+        { "up_wait_retry_interval", up_wait_retry_interval },
+    };
+    c->cli = new cluster_client_t(NULL, tfd, config);
+    c->inode = INODE_WITH_POOL(1, i+1);
+    c->buf = malloc_or_die(bs);
+    memset(c->buf, 0x55, bs);
+    client_by_msgr[&c->cli->msgr] = c;
+    clients.push_back(c);
+    json11::Json::object global_config;
+    if (!sync_every)
+        global_config["immediate_commit"] = "all";
+    c->cli->st_cli.on_load_config_hook(global_config);
+    std::string prefix = c->cli->st_cli.etcd_prefix;
+    c->cli->st_cli.parse_state((etcd_kv_t){
+        .key = prefix+"/config/pools",
+        .value = json11::Json::object {
+            { "1", json11::Json::object {
+                { "name", "simpool" },
+                { "scheme", "replicated" },
+                { "pg_size", pg_size },
+                { "pg_minsize", pg_minsize },
+                { "pg_count", pg_count },
+                { "failure_domain", "host" },
+            } }
+        },
+    });
+    c->cli->st_cli.parse_state((etcd_kv_t){ .key = prefix+"/config/pgs", .value = pg_config_json() });
+    for (uint64_t pg_num = 1; pg_num <= pg_count; pg_num++)
+    {
+        c->cli->st_cli.parse_state((etcd_kv_t){
+            .key = prefix+"/pg/state/1/"+std::to_string(pg_num),
+            .value = pg_state_json(pgs[pg_num-1]),
+        });
+    }
+    c->cli->st_cli.on_load_pgs_hook(true);
+    if (!pg_stripe_size)
+    {
+        pg_stripe_size = c->cli->st_cli.pool_config.at(1).pg_stripe_size;
+        block_size = c->cli->get_bs_block_size();
+    }
+    for (uint64_t j = 0; j < iodepth; j++)
+    {
+        submit_op(c);
+    }
+}
+
+void cluster_sim_t::submit_op(sim_client_t *c)
+{
+    cluster_op_t *op = new cluster_op_t();
+    bool write = rand() % 100 < write_pct;
+    op->opcode = write ? OSD_OP_WRITE : OSD_OP_READ;
+    op->inode = c->inode;
+    op->offset = (rand() % (image_size/bs)) * bs;
+    op->len = bs;
+    // Data isn't checked, so all operations of a client share the buffer
+    op->iov.push_back(c->buf, bs);
+    uint64_t start = sim_now_us();
+    op->callback = [this, c, start](cluster_op_t *op)
+    {
+        uint64_t lat = sim_now_us()-start;
+        if (op->retval != op->len)
+            op_errors++;
+        hist.add(lat);
+        op_count++;
+        lat_sum += lat;
+        lat_max = lat > lat_max ? lat : lat_max;
+        sec_ops++;
+        sec_lat_sum += lat;
+        sec_lat_max = lat > sec_lat_max ? lat : sec_lat_max;
+        c->inflight--;
+        delete op;
+        if (!stopping)
+            submit_op(c);
+    };
+    c->inflight++;
+    c->cli->execute(op);
+    if (write && sync_every && ++c->writes_since_sync >= sync_every)
+    {
+        c->writes_since_sync = 0;
+        cluster_op_t *sync_op = new cluster_op_t();
+        sync_op->opcode = OSD_OP_SYNC;
+        sync_op->callback = [this](cluster_op_t *sync_op)
+        {
+            if (sync_op->retval != 0)
+                op_errors++;
+            sync_count++;
+            delete sync_op;
+        };
+        c->cli->execute(sync_op);
+    }
+}
+
+void cluster_sim_t::on_outbox_push(sim_client_t *c, osd_op_t *op)
+{
+    osd_num_t osd_num = c->cli->msgr.clients.at(op->peer_fd)->osd_num;
+    sim_osd_t & osd = osds[osd_num];
+    if (!osd.up)
+    {
+        // Lost, the connection is broken by fail_osd()
+        return;
+    }
+    int64_t retval = 0;
+    uint64_t service = jitter(osd_us), extra = 0;
+    if (op->req.hdr.opcode != OSD_OP_SYNC)
+    {
+        uint64_t stripe = (op->req.rw.offset / block_size) * block_size;
+        sim_pg_t & pg = pgs[(stripe / pg_stripe_size) % pg_count];
+        if (pg.primary != osd_num || !(pg.state & PG_ACTIVE))
+        {
+            // Like prepare_primary_rw() of an OSD which isn't the active primary of the PG
+            retval = -EPIPE;
+            service = 0;
+        }
+        else
+        {
+            retval = op->req.rw.len;
+            if (op->req.hdr.opcode == OSD_OP_WRITE)
+            {
+                // Replicas are written in parallel
+                extra = 2*jitter(net_us) + jitter(osd_us);
+            }
+        }
+    }
+    uint64_t now = sim_now_us();
+    uint64_t start = now + jitter(net_us);
+    if (service)
+    {
+        start = start < osd.busy_until ? osd.busy_until : start;
+        osd.busy_until = start + service;
+    }
+    uint64_t done = start + service + extra + jitter(net_us);
+    uint64_t incarnation = osd.incarnation;
+    int peer_fd = op->peer_fd;
+    uint64_t op_id = op->req.hdr.id;
+    sim_schedule(done-now, [this, c, osd_num, incarnation, peer_fd, op_id, retval]()
+    {
+        if (osds[osd_num].incarnation == incarnation)
+            reply_op(c, peer_fd, op_id, retval);
+    });
+}
+
+void cluster_sim_t::reply_op(sim_client_t *c, int peer_fd, uint64_t op_id, int64_t retval)
+{
+    auto cl_it = c->cli->msgr.clients.find(peer_fd);
+    if (cl_it == c->cli->msgr.clients.end())
+    {
+        return;
+    }
+    auto op_it = cl_it->second->sent_ops.find(op_id);
+    if (op_it == cl_it->second->sent_ops.end())
+    {
+        return;
+    }
+    osd_op_t *op = op_it->second;
+    cl_it->second->sent_ops.erase(op_it);
+    op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+    op->reply.hdr.id = op->req.hdr.id;
+    op->reply.hdr.opcode = op->req.hdr.opcode;
+    op->reply.hdr.retval = retval;
+    // Copy lambda to be unaffected by `delete op`
+    std::function<void(osd_op_t*)>(op->callback)(op);
+}
+
+void cluster_sim_t::on_connect_peer(sim_client_t *c, osd_num_t osd_num)
+{
+    sim_schedule(jitter(2*net_us), [this, c, osd_num]()
+    {
+        auto & msgr = c->cli->msgr;
+        if (msgr.osd_peer_fds.find(osd_num) != msgr.osd_peer_fds.end())
+        {
+            return;
+        }
+        if (!osds[osd_num].up)
+        {
+            // The messenger retries failed connections after peer_connect_interval
+            sim_schedule(reconnect_ms*1000, [c, osd_num]()
+            {
+                auto & msgr = c->cli->msgr;
+                if (msgr.osd_peer_fds.find(osd_num) == msgr.osd_peer_fds.end())
+                {
+                    msgr.wanted_peers.erase(osd_num);
+                    c->cli->continue_ops();
+                }
+            });
+            return;
+        }
+        int peer_fd = c->next_fd++;
+        osd_client_t *cl = new osd_client_t();
+        cl->peer_fd = peer_fd;
+        cl->osd_num = osd_num;
+        cl->peer_state = PEER_CONNECTED;
+        msgr.clients[peer_fd] = cl;
+        msgr.osd_peer_fds[osd_num] = peer_fd;
+        msgr.wanted_peers.erase(osd_num);
+        msgr.repeer_pgs(osd_num);
+    });
+}
+
+void cluster_sim_t::start_peering(pg_num_t pg_num)
+{
+    sim_pg_t & pg = pgs[pg_num-1];
+    set_pg_state(pg, PG_PEERING);
+    uint64_t epoch = ++pg.peering_epoch;
+    osd_num_t primary = pg.primary;
+    sim_osd_t & p = osds[primary];
+    uint64_t now = sim_now_us();
+    p.peer_busy_until = (p.peer_busy_until < now ? now : p.peer_busy_until) + jitter(peering_ms*1000);
+    uint64_t incarnation = p.incarnation;
+    sim_schedule(p.peer_busy_until-now, [this, pg_num, epoch, primary, incarnation]()
+    {
+        sim_pg_t & pg = pgs[pg_num-1];
+        if (pg.peering_epoch != epoch || pg.primary != primary || osds[primary].incarnation != incarnation)
+        {
+            return;
+        }
+        uint64_t alive = 0;
+        for (auto osd_num: pg.osd_set)
+        {
+            if (osds[osd_num].up)
+                alive++;
+        }
+        set_pg_state(pg, alive < pg_minsize ? PG_INCOMPLETE : (PG_ACTIVE | (alive < pg_size ? PG_DEGRADED : 0)));
+    });
+}
+
+void cluster_sim_t::fail_osd(osd_num_t osd_num)
+{
+    osds[osd_num].up = false;
+    osds[osd_num].incarnation++;
+    sim_schedule(detect_ms*1000, [this, osd_num]()
+    {
+        for (auto c: clients)
+        {
+            auto fd_it = c->cli->msgr.osd_peer_fds.find(osd_num);
+            if (fd_it != c->cli->msgr.osd_peer_fds.end())
+                c->cli->msgr.stop_client(fd_it->second);
+        }
+        // Primaries notice the dead peer and repeer their PGs
+        for (uint64_t i = 0; i < pg_count; i++)
+        {
+            auto & set = pgs[i].osd_set;
+            if (pgs[i].primary != osd_num && osds[pgs[i].primary].up &&
+                std::find(set.begin(), set.end(), osd_num) != set.end())
+            {
+                start_peering(i+1);
+            }
+        }
+    });
+    // The monitor notices the dead OSD when its etcd lease expires
+    sim_schedule(lease_ms*1000, [this]() { mon_pick_primaries(); });
+    if (out_ms)
+    {
+        sim_schedule(out_ms*1000, [this, osd_num]()
+        {
+            if (!osds[osd_num].up)
+                mon_move_out();
+        });
+    }
+}
+
+void cluster_sim_t::restore_osd(osd_num_t osd_num)
+{
+    osds[osd_num].up = true;
+    osds[osd_num].incarnation++;
+    for (uint64_t i = 0; i < pg_count; i++)
+    {
+        auto & set = pgs[i].osd_set;
+        if (std::find(set.begin(), set.end(), osd_num) != set.end() && osds[pgs[i].primary].up && pgs[i].primary)
+            start_peering(i+1);
+    }
+    sim_schedule(etcd_ms*1000, [this]() { mon_pick_primaries(); });
+}
+
+// Like the monitor: PGs of dead primaries get other primaries from their OSD sets
+void cluster_sim_t::mon_pick_primaries()
+{
+    uint64_t start = wall_us();
+    std::vector<pg_num_t> changed;
+    for (uint64_t i = 0; i < pg_count; i++)
+    {
+        sim_pg_t & pg = pgs[i];
+        if (pg.primary && osds[pg.primary].up)
+            continue;
+        osd_num_t new_primary = 0;
+        for (auto osd_num: pg.osd_set)
+        {
+            if (osds[osd_num].up)
+            {
+                new_primary = osd_num;
+                break;
+            }
+        }
+        if (new_primary != pg.primary)
+        {
+            pg.primary = new_primary;
+            changed.push_back(i+1);
+        }
+    }
+    placement_us += wall_us()-start;
+    placement_runs++;
+    if (changed.size())
+    {
+        pg_config_dirty = true;
+        for (auto pg_num: changed)
+        {
+            if (pgs[pg_num-1].primary)
+                start_peering(pg_num);
+            else
+                set_pg_state(pgs[pg_num-1], PG_OFFLINE);
+        }
+    }
+}
+
+// Like the monitor after osd_out_time: dead OSDs are replaced with live ones from other hosts
+void cluster_sim_t::mon_move_out()
+{
+    uint64_t start = wall_us();
+    uint64_t host_count = osd_count/osds_per_host;
+    std::vector<pg_num_t> changed;
+    for (uint64_t i = 0; i < pg_count; i++)
+    {
+        sim_pg_t & pg = pgs[i];
+        bool pg_changed = false;
+        for (auto & osd_num: pg.osd_set)
+        {
+            if (osds[osd_num].up)
+                continue;
+            for (int attempt = 0; attempt < 100; attempt++)
+            {
+                uint64_t host = rand() % host_count;
+                osd_num_t candidate = host*osds_per_host + rand() % osds_per_host + 1;
+                bool same_host = false;
+                for (auto other: pg.osd_set)
+                {
+                    if (osds[other].host == host)
+                        same_host = true;
+                }
+                if (osds[candidate].up && !same_host)
+                {
+                    osd_num = candidate;
+                    pg_changed = true;
+                    break;
+                }
+            }
+        }
+        if (pg_changed)
+        {
+            if (!pg.primary || !osds[pg.primary].up)
+                pg.primary = pg.osd_set[0];
+            changed.push_back(i+1);
+        }
+    }
+    placement_us += wall_us()-start;
+    placement_runs++;
+    if (changed.size())
+    {
+        pg_config_dirty = true;
+        for (auto pg_num: changed)
+            start_peering(pg_num);
+        printf("Monitor moved %lu PGs out of dead OSDs\n", changed.size());
+    }
+}
+
+void cluster_sim_t::print_second()
+{
+    printf(
+        "t=%lus ops=%lu avg_lat=%luus max_lat=%luus inactive_pgs=%lu\n", sim_now_us()/1000000,
+        sec_ops, sec_ops ? sec_lat_sum/sec_ops : 0, sec_lat_max, inactive_pgs
+    );
+    sec_ops = sec_lat_sum = sec_lat_max = 0;
+}
+
+void cluster_sim_t::run()
+{
+    rng_state = seed;
+    if (!verbose)
+    {
+        // Clients report every failed operation
+        freopen("/dev/null", "w", stderr);
+    }
+    tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    sim_outbox_push_hook = [this](osd_messenger_t *msgr, osd_op_t *op)
+    {
+        on_outbox_push(client_by_msgr.at(msgr), op);
+    };
+    sim_connect_peer_hook = [this](osd_messenger_t *msgr, uint64_t peer_osd)
+    {
+        on_connect_peer(client_by_msgr.at(msgr), peer_osd);
+    };
+    osds.resize(osd_count+1);
+    for (uint64_t i = 1; i <= osd_count; i++)
+    {
+        osds[i].host = (i-1)/osds_per_host;
+    }
+    uint64_t start = wall_us();
+    place_pgs();
+    placement_us += wall_us()-start;
+    placement_runs++;
+    start = wall_us();
+    for (uint64_t i = 0; i < client_count; i++)
+    {
+        start_client(i);
+    }
+    apply_config_us += wall_us()-start;
+    apply_config_runs++;
+    printf(
+        "%lu OSDs on %lu hosts, %lu PGs of size %lu, %lu clients with iodepth %lu\n",
+        osd_count, osd_count/osds_per_host, pg_count, pg_size, client_count, iodepth
+    );
+    if (fail_osds || fail_hosts)
+    {
+        sim_schedule(fail_at*1000000, [this]()
+        {
+            std::vector<osd_num_t> victims;
+            uint64_t host_count = osd_count/osds_per_host;
+            std::set<uint64_t> hosts;
+            while (hosts.size() < fail_hosts)
+                hosts.insert(rand() % host_count);
+            for (auto host: hosts)
+            {
+                for (uint64_t j = 1; j <= osds_per_host; j++)
+                    victims.push_back(host*osds_per_host + j);
+            }
+            std::set<osd_num_t> single;
+            while (single.size() < fail_osds)
+            {
+                osd_num_t osd_num = rand() % osd_count + 1;
+                if (hosts.find(osds[osd_num].host) == hosts.end())
+                    single.insert(osd_num);
+            }
+            victims.insert(victims.end(), single.begin(), single.end());
+            printf("t=%lus: killing %lu OSDs\n", sim_now_us()/1000000, victims.size());
+            last_failure_us = sim_now_us();
+            waiting_active = true;
+            for (auto osd_num: victims)
+                fail_osd(osd_num);
+            if (fail_for)
+            {
+                sim_schedule(fail_for*1000000, [this, victims]()
+                {
+                    printf("t=%lus: restarting %lu OSDs\n", sim_now_us()/1000000, victims.size());
+                    for (auto osd_num: victims)
+                        restore_osd(osd_num);
+                });
+            }
+        });
+    }
+    std::function<void()> tick;
+    tick = [this, &tick]()
+    {
+        if (timeline)
+            print_second();
+        else
+            sec_ops = sec_lat_sum = sec_lat_max = 0;
+        if (sim_now_us() < runtime*1000000)
+            sim_schedule(1000000, tick);
+    };
+    sim_schedule(1000000, tick);
+    sim_schedule(runtime*1000000, [this]() { stopping = true; });
+    start = wall_us();
+    // Operations of offline PGs are retried forever, so wait for the rest only for a while
+    uint64_t deadline = (runtime+10)*1000000;
+    while (sim_step())
+    {
+        uint64_t inflight = 0;
+        if (stopping)
+        {
+            for (auto c: clients)
+                inflight += c->inflight;
+        }
+        if (stopping && (!inflight || sim_now_us() >= deadline))
+            break;
+    }
+    uint64_t wall = wall_us()-start;
+    print_results();
+    printf("Simulation took %.2f s of real time, %.2f us per operation\n", wall/1000000.0, op_count ? (double)wall/op_count : 0);
+}
+
+void cluster_sim_t::print_results()
+{
+    uint64_t stuck = 0;
+    for (auto c: clients)
+        stuck += c->inflight;
+    printf(
+        "Operations: %lu (%lu errors, %lu syncs, %lu not finished), %.0f iops\n",
+        op_count, op_errors, sync_count, stuck, (double)op_count/runtime
+    );
+    printf(
+        "Latency: avg %lu us, p50 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+        op_count ? lat_sum/op_count : 0, hist.percentile(op_count, 50), hist.percentile(op_count, 99),
+        hist.percentile(op_count, 99.9), lat_max
+    );
+    if (waiting_active)
+    {
+        printf("%lu PGs are still inactive\n", inactive_pgs);
+    }
+    printf(
+        "Placement recomputation: %lu runs, %.3f ms avg\n",
+        placement_runs, placement_runs ? placement_us/1000.0/placement_runs : 0
+    );
+    printf(
+        "Applying PG configuration on %lu clients: %lu runs, %.3f ms avg\n",
+        client_count, apply_config_runs, apply_config_runs ? apply_config_us/1000.0/apply_config_runs : 0
+    );
+}
+
+int main(int narg, char *args[])
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    cluster_sim_t *sim = new cluster_sim_t();
+    try
+    {
+        sim->parse_args(narg, args);
+        sim->run();
+    }
+    catch (std::exception & e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
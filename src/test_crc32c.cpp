@@ -0,0 +1,80 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Check all CRC-32C implementations supported by the CPU against the software one
+// and measure their throughput on 512 byte - 1 MB buffers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crc32c.h"
+
+static double elapsed(timespec & start)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+void crc32c_check(const crc32c_impl_t *impls, int count, uint8_t *buf, size_t max_len)
+{
+    const crc32c_impl_t & sw = impls[count-1];
+    if (crc32c(0, "123456789", 9) != 0xe3069283)
+    {
+        printf("crc32c of the check string is incorrect: %08x\n", crc32c(0, "123456789", 9));
+        exit(1);
+    }
+    srand(1);
+    // Cover all unaligned starts and tails and multi-block paths of every implementation
+    for (size_t len = 0; len <= max_len; len += (len < 4096 ? 1 : 4093))
+    {
+        for (int offset = 0; offset < 8; offset++)
+        {
+            uint32_t init = rand();
+            uint32_t expected = sw.fn(init, buf+offset, len);
+            for (int i = 0; i < count-1; i++)
+            {
+                uint32_t crc = impls[i].fn(init, buf+offset, len);
+                if (crc != expected)
+                {
+                    printf("%s: incorrect crc32c of %lu bytes at offset %d: %08x, expected %08x\n",
+                        impls[i].name, len, offset, crc, expected);
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+void crc32c_bench(const crc32c_impl_t & impl, uint8_t *buf, size_t len)
+{
+    // Process 256 MB (64 MB with the slow software version) per buffer size
+    const size_t total = (strcmp(impl.name, "sw") != 0 ? 256 : 64)*1024*1024;
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t crc = 0;
+    for (size_t done = 0; done < total; done += len)
+        crc = impl.fn(crc, buf, len);
+    double t = elapsed(start);
+    printf("%-20s %8lu bytes: %8.2f GB/s (crc %08x)\n", impl.name, len, total/t/1024/1024/1024, crc);
+}
+
+int main(int narg, char *args[])
+{
+    const crc32c_impl_t *impls = crc32c_impls();
+    int count = 0;
+    while (impls[count].name)
+        count++;
+    const size_t max_len = 1024*1024;
+    uint8_t *buf = (uint8_t*)malloc(max_len+8);
+    for (size_t i = 0; i < max_len+8; i++)
+        buf[i] = rand();
+    crc32c_check(impls, count, buf, 128*1024);
+    printf("OK: %d implementations checked, %s is used\n", count, impls[0].name);
+    for (int i = 0; i < count; i++)
+        for (size_t len = 512; len <= max_len; len *= 2)
+            crc32c_bench(impls[i], buf, len);
+    free(buf);
+    return 0;
+}
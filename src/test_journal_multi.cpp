@@ -0,0 +1,106 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Check that object version lists of JE_STABLE_MULTI / JE_ROLLBACK_MULTI entries
+// decode to exactly what was encoded, and that truncated lists are rejected
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include "blockstore_impl.h"
+
+static std::vector<uint8_t> encode_list(const std::vector<obj_ver_id> & list)
+{
+    std::vector<uint8_t> encoded(list.size() * JE_MULTI_MAX_ITEM);
+    obj_ver_id prev = { 0 };
+    int pos = 0;
+    for (auto & ov: list)
+    {
+        int len = je_multi_encode(encoded.data() + pos, prev, ov);
+        if (len > JE_MULTI_MAX_ITEM)
+        {
+            printf("%lx:%lx v%lu encoded into %d bytes, more than JE_MULTI_MAX_ITEM\n",
+                ov.oid.inode, ov.oid.stripe, ov.version, len);
+            exit(1);
+        }
+        pos += len;
+        prev = ov;
+    }
+    encoded.resize(pos);
+    return encoded;
+}
+
+static void check_round_trip(std::vector<obj_ver_id> list, const char *what)
+{
+    std::sort(list.begin(), list.end());
+    std::vector<uint8_t> encoded = encode_list(list);
+    const uint8_t *item = encoded.data(), *end = encoded.data() + encoded.size();
+    const uint8_t *last_item = item;
+    obj_ver_id ov = { 0 };
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        last_item = item;
+        if (!je_multi_decode(item, end, ov))
+        {
+            printf("%s: item %lu failed to decode\n", what, i);
+            exit(1);
+        }
+        if (ov.oid.inode != list[i].oid.inode || ov.oid.stripe != list[i].oid.stripe || ov.version != list[i].version)
+        {
+            printf("%s: item %lu decoded as %lx:%lx v%lu, expected %lx:%lx v%lu\n", what, i,
+                ov.oid.inode, ov.oid.stripe, ov.version, list[i].oid.inode, list[i].oid.stripe, list[i].version);
+            exit(1);
+        }
+    }
+    if (item != end)
+    {
+        printf("%s: %ld bytes left after decoding\n", what, end-item);
+        exit(1);
+    }
+    // Every truncation of the last item must fail to decode
+    for (const uint8_t *trunc_end = last_item; trunc_end < end; trunc_end++)
+    {
+        item = encoded.data();
+        ov = { 0 };
+        size_t i = 0;
+        while (i < list.size() && je_multi_decode(item, trunc_end, ov))
+            i++;
+        if (i != list.size()-1)
+        {
+            printf("%s: list truncated to %ld bytes decoded %lu items instead of %lu\n",
+                what, trunc_end-encoded.data(), i, list.size()-1);
+            exit(1);
+        }
+    }
+}
+
+int main(int narg, char *args[])
+{
+    check_round_trip({}, "empty");
+    check_round_trip({ { .oid = { .inode = 0, .stripe = 0 }, .version = 0 } }, "zero");
+    // Extreme values take the longest varints
+    check_round_trip({
+        { .oid = { .inode = UINT64_MAX, .stripe = UINT64_MAX }, .version = UINT64_MAX },
+        { .oid = { .inode = 1, .stripe = UINT64_MAX }, .version = 1 },
+        { .oid = { .inode = 1, .stripe = 0 }, .version = UINT64_MAX },
+        { .oid = { .inode = UINT64_MAX, .stripe = 0 }, .version = 0x80 },
+    }, "extremes");
+    // Many objects of the same inode, several inodes and random values
+    srand(1);
+    for (int n = 0; n < 100; n++)
+    {
+        std::vector<obj_ver_id> list;
+        int count = 1 + rand() % 1000;
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t inode = (uint64_t)(rand() % 4) << (rand() % 64);
+            uint64_t stripe = (rand() % 2) ? ((uint64_t)rand() << 32 | rand()) : (uint64_t)(rand() % 1024) << 17;
+            uint64_t version = (uint64_t)rand() << (rand() % 33);
+            list.push_back({ .oid = { .inode = inode, .stripe = stripe }, .version = version });
+        }
+        check_round_trip(list, "random");
+    }
+    printf("OK\n");
+    return 0;
+}
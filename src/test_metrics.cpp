@@ -0,0 +1,177 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Check the Prometheus exposition output and that the metrics listener survives
+// scrapers disconnecting in the middle of a response
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <set>
+#include "metrics.h"
+#include "messenger.h"
+#include "timerfd_manager.h"
+
+static std::vector<std::string> split_lines(const std::string & out)
+{
+    std::vector<std::string> lines;
+    size_t pos = 0, next;
+    while ((next = out.find('\n', pos)) != std::string::npos)
+    {
+        lines.push_back(out.substr(pos, next-pos));
+        pos = next+1;
+    }
+    if (pos != out.size())
+    {
+        printf("output doesn't end with a newline\n");
+        exit(1);
+    }
+    return lines;
+}
+
+// Every sample must belong to a family declared with exactly one # TYPE line before it
+static void check_types(const std::string & out)
+{
+    std::set<std::string> types;
+    for (auto & line: split_lines(out))
+    {
+        if (line.substr(0, 7) == "# TYPE ")
+        {
+            std::string name = line.substr(7, line.find(' ', 7)-7);
+            if (types.find(name) != types.end())
+            {
+                printf("duplicate TYPE for %s\n", name.c_str());
+                exit(1);
+            }
+            types.insert(name);
+            continue;
+        }
+        std::string name = line.substr(0, line.find_first_of("{ "));
+        bool found = types.find(name) != types.end();
+        for (auto suffix: { "_bucket", "_sum", "_count" })
+        {
+            size_t sl = strlen(suffix);
+            if (!found && name.size() > sl && name.substr(name.size()-sl) == suffix)
+                found = types.find(name.substr(0, name.size()-sl)) != types.end();
+        }
+        if (!found)
+        {
+            printf("sample without TYPE: %s\n", line.c_str());
+            exit(1);
+        }
+    }
+}
+
+static void expect_line(const std::string & out, const std::string & line)
+{
+    if (out.find(line+"\n") == std::string::npos)
+    {
+        printf("expected line not found: %s\noutput:\n%s", line.c_str(), out.c_str());
+        exit(1);
+    }
+}
+
+void test_exposition()
+{
+    osd_op_stats_t stats;
+    stats.op_stat_count[OSD_OP_READ] = 3;
+    stats.op_stat_sum[OSD_OP_READ] = 1+100+5000;
+    stats.op_stat_bytes[OSD_OP_READ] = 12288;
+    stats.op_stat_hist[OSD_OP_READ].add(1);
+    stats.op_stat_hist[OSD_OP_READ].add(100);
+    stats.op_stat_hist[OSD_OP_READ].add(5000);
+    stats.subop_stat_count[OSD_OP_SEC_WRITE] = 1;
+    stats.subop_stat_sum[OSD_OP_SEC_WRITE] = 50;
+    stats.subop_stat_hist[OSD_OP_SEC_WRITE].add(50);
+    std::string out;
+    metrics_add_op_stats(out, "test", "osd_num=\"1\"", stats, true, true);
+    metrics_add_json(out, "test", "osd_num=\"1\"", json11::Json::object {
+        { "recovery", json11::Json::object { { "degraded-count", 5 }, { "ratio", 0.5 } } },
+        { "readonly", true },
+        { "name", "skipped" },
+    });
+    check_types(out);
+    std::string rd = std::string("op=\"")+osd_op_names[OSD_OP_READ]+"\"";
+    std::string wr = std::string("op=\"")+osd_op_names[OSD_OP_SEC_WRITE]+"\"";
+    expect_line(out, "# TYPE test_op_latency_usec histogram");
+    expect_line(out, "test_op_latency_usec_bucket{osd_num=\"1\","+rd+",le=\"2\"} 1");
+    expect_line(out, "test_op_latency_usec_bucket{osd_num=\"1\","+rd+",le=\"128\"} 2");
+    expect_line(out, "test_op_latency_usec_bucket{osd_num=\"1\","+rd+",le=\"8192\"} 3");
+    expect_line(out, "test_op_latency_usec_bucket{osd_num=\"1\","+rd+",le=\"+Inf\"} 3");
+    expect_line(out, "test_op_latency_usec_sum{osd_num=\"1\","+rd+"} 5101");
+    expect_line(out, "test_op_latency_usec_count{osd_num=\"1\","+rd+"} 3");
+    expect_line(out, "test_op_bytes{osd_num=\"1\","+rd+"} 12288");
+    expect_line(out, "test_subop_latency_usec_count{osd_num=\"1\","+wr+"} 1");
+    expect_line(out, "# TYPE test_recovery_degraded_count gauge");
+    expect_line(out, "test_recovery_degraded_count{osd_num=\"1\"} 5");
+    expect_line(out, "test_recovery_ratio{osd_num=\"1\"} 0.5");
+    expect_line(out, "test_readonly{osd_num=\"1\"} 1");
+    if (out.find("test_op_bytes{osd_num=\"1\","+wr) != std::string::npos || out.find("skipped") != std::string::npos)
+    {
+        printf("unexpected samples in output:\n%s", out.c_str());
+        exit(1);
+    }
+    // Buckets are cumulative
+    uint64_t prev = 0;
+    for (auto & line: split_lines(out))
+    {
+        if (line.find("test_op_latency_usec_bucket{") == 0)
+        {
+            uint64_t v = strtoull(line.substr(line.rfind(' ')+1).c_str(), NULL, 10);
+            if (v < prev)
+            {
+                printf("histogram buckets aren't cumulative: %s\n", line.c_str());
+                exit(1);
+            }
+            prev = v;
+        }
+    }
+    printf("exposition format OK\n");
+}
+
+void test_disconnect()
+{
+    timerfd_manager_t tfd([](int fd, bool wr, std::function<void(int, int)> callback) {});
+    // Larger than socket buffers, so that the reply is sent in several parts
+    std::string body(16*1024*1024, '#');
+    metrics_server_t srv(&tfd, [&]() { return body; });
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        exit(1);
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    srv.conns[fds[0]] = metrics_server_t::conn_t();
+    const char *req = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (write(fds[1], req, strlen(req)) != strlen(req))
+    {
+        perror("write");
+        exit(1);
+    }
+    srv.handle_conn(fds[0], EPOLLIN);
+    if (srv.conns.find(fds[0]) == srv.conns.end() || !srv.conns[fds[0]].sent)
+    {
+        printf("reply should be partially sent\n");
+        exit(1);
+    }
+    // The scraper disconnects in the middle of the response
+    close(fds[1]);
+    srv.handle_conn(fds[0], EPOLLOUT);
+    if (srv.conns.size())
+    {
+        printf("connection should be closed\n");
+        exit(1);
+    }
+    printf("disconnect OK\n");
+}
+
+int main(int narg, char *args[])
+{
+    test_exposition();
+    test_disconnect();
+    return 0;
+}
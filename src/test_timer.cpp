@@ -0,0 +1,158 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "timerfd_manager.h"
+
+static uint64_t now_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000ul + now.tv_nsec/1000;
+}
+
+struct test_loop_t
+{
+    int fd = -1;
+    std::function<void(int, int)> handler;
+    timerfd_manager_t *tfd;
+
+    test_loop_t()
+    {
+        tfd = new timerfd_manager_t([this](int fd, bool wr, std::function<void(int, int)> callback)
+        {
+            this->fd = fd;
+            this->handler = callback;
+        });
+    }
+
+    ~test_loop_t()
+    {
+        delete tfd;
+    }
+
+    void run_until(std::function<bool()> done)
+    {
+        while (!done())
+        {
+            pollfd pfd = { .fd = fd, .events = POLLIN };
+            if (poll(&pfd, 1, 1000) <= 0)
+            {
+                printf("timer didn't fire in 1 second\n");
+                exit(1);
+            }
+            handler(fd, POLLIN);
+        }
+    }
+};
+
+// Timers fire in order, not earlier than requested, cleared timers don't fire
+void test_expiration()
+{
+    test_loop_t loop;
+    const int n = 2000;
+    std::vector<uint64_t> deadline(n), fired(n);
+    std::vector<int> ids(n);
+    int done = 0, expected = 0;
+    uint64_t start = now_us();
+    for (int i = 0; i < n; i++)
+    {
+        // Up to 300 ms to cross level 0 of the wheel, but not earlier than the setup ends
+        uint64_t us = 50000 + (uint64_t)rand() % 250000;
+        deadline[i] = start + us;
+        ids[i] = loop.tfd->set_timer_us(us, false, [&, i](int timer_id)
+        {
+            if (timer_id != ids[i] || fired[i])
+            {
+                printf("timer %d fired twice or with wrong id\n", i);
+                exit(1);
+            }
+            fired[i] = now_us();
+            done++;
+        });
+    }
+    for (int i = 0; i < n; i += 3)
+    {
+        loop.tfd->clear_timer(ids[i]);
+        deadline[i] = 0;
+    }
+    for (int i = 0; i < n; i++)
+        expected += deadline[i] ? 1 : 0;
+    loop.run_until([&]() { return done == expected; });
+    uint64_t max_late = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!deadline[i] && fired[i])
+        {
+            printf("cleared timer %d fired\n", i);
+            exit(1);
+        }
+        if (deadline[i] && fired[i] < deadline[i])
+        {
+            printf("timer %d fired %lu us too early\n", i, deadline[i]-fired[i]);
+            exit(1);
+        }
+        if (deadline[i] && fired[i]-deadline[i] > max_late)
+            max_late = fired[i]-deadline[i];
+    }
+    printf("%d timers fired, max delay %lu us\n", expected, max_late);
+}
+
+// Repeating timers keep their period and may be cleared from the callback
+void test_repeat()
+{
+    test_loop_t loop;
+    int count = 0;
+    uint64_t start = now_us();
+    loop.tfd->set_timer(7, true, [&](int timer_id)
+    {
+        count++;
+        if (count == 20)
+            loop.tfd->clear_timer(timer_id);
+    });
+    loop.run_until([&]() { return count >= 20; });
+    uint64_t elapsed = now_us()-start;
+    if (elapsed < 140000)
+    {
+        printf("repeating timer is too fast: 20 periods of 7 ms in %lu us\n", elapsed);
+        exit(1);
+    }
+    printf("repeating timer OK, 20 periods of 7 ms in %lu us\n", elapsed);
+}
+
+// Long timers are moved down through all wheel levels when cleared timers and
+// short timers are added in between, and add/clear is O(1) with many timers
+void bench_add_clear()
+{
+    test_loop_t loop;
+    const int n = 1000000;
+    std::vector<int> ids(n);
+    uint64_t start = now_us();
+    for (int i = 0; i < n; i++)
+    {
+        // From 1 ms to ~1 day, like connection idle and retry timers
+        ids[i] = loop.tfd->set_timer(1 + (uint64_t)rand() % 86400000, false, [](int) {});
+    }
+    uint64_t added = now_us();
+    for (int i = 0; i < n; i++)
+    {
+        loop.tfd->clear_timer(ids[(i*7919ul) % n]);
+    }
+    uint64_t cleared = now_us();
+    printf("%d timers: set_timer %.1f ns/op, clear_timer %.1f ns/op\n", n,
+        (added-start)*1000.0/n, (cleared-added)*1000.0/n);
+}
+
+int main(int narg, char *args[])
+{
+    srand(time(NULL));
+    test_expiration();
+    test_repeat();
+    bench_add_clear();
+    printf("OK\n");
+    return 0;
+}
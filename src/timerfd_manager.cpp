@@ -11,10 +11,28 @@
 #include <stdexcept>
 #include "timerfd_manager.h"
 
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE-1)
+
+static uint64_t monotonic_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000ul + now.tv_nsec/1000;
+}
+
+// Distance from <pos> to the next used slot after it (1..TIMER_WHEEL_SIZE, circular), 0 if there are none
+static inline int next_used_slot(uint64_t used, int pos)
+{
+    if (!used)
+        return 0;
+    int shift = (pos+1) & TIMER_WHEEL_MASK;
+    uint64_t rotated = shift ? ((used >> shift) | (used << (TIMER_WHEEL_SIZE-shift))) : used;
+    return __builtin_ctzll(rotated) + 1;
+}
+
 timerfd_manager_t::timerfd_manager_t(std::function<void(int, bool, std::function<void(int, int)>)> set_fd_handler)
 {
     this->set_fd_handler = set_fd_handler;
-    wait_state = 0;
     timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
     if (timerfd < 0)
     {
@@ -30,17 +48,52 @@ timerfd_manager_t::~timerfd_manager_t()
 {
     set_fd_handler(timerfd, false, NULL);
     close(timerfd);
+    for (auto & tp: timers)
+    {
+        delete tp.second;
+    }
 }
 
-void timerfd_manager_t::inc_timer(timerfd_timer_t & t)
+void timerfd_manager_t::wheel_add(timerfd_timer_t *t)
 {
-    t.next.tv_sec += t.micros/1000000;
-    t.next.tv_nsec += (t.micros%1000000)*1000;
-    if (t.next.tv_nsec > 1000000000)
+    uint64_t tick = t->next_us / TIMER_TICK_US;
+    if (tick < cur_tick)
+    {
+        tick = cur_tick;
+    }
+    uint64_t delta = tick - cur_tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS-1 && delta >= (1ul << TIMER_WHEEL_BITS*(level+1)))
+    {
+        level++;
+    }
+    if (delta >= (1ul << TIMER_WHEEL_BITS*(level+1)))
+    {
+        // Too far, put it into the last slot, it will be moved again when the wheel reaches it
+        tick = cur_tick + (1ul << TIMER_WHEEL_BITS*(level+1)) - 1;
+    }
+    t->level = level;
+    t->slot = (tick >> TIMER_WHEEL_BITS*level) & TIMER_WHEEL_MASK;
+    t->prev = NULL;
+    t->next = wheel[level][t->slot];
+    if (t->next)
     {
-        t.next.tv_sec++;
-        t.next.tv_nsec -= 1000000000;
+        t->next->prev = t;
     }
+    wheel[level][t->slot] = t;
+    wheel_used[level] |= (1ul << t->slot);
+}
+
+void timerfd_manager_t::wheel_remove(timerfd_timer_t *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        wheel[t->level][t->slot] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    if (!wheel[t->level][t->slot])
+        wheel_used[t->level] &= ~(1ul << t->slot);
 }
 
 int timerfd_manager_t::set_timer(uint64_t millis, bool repeat, std::function<void(int)> callback)
@@ -51,119 +104,192 @@ int timerfd_manager_t::set_timer(uint64_t millis, bool repeat, std::function<voi
 int timerfd_manager_t::set_timer_us(uint64_t micros, bool repeat, std::function<void(int)> callback)
 {
     int timer_id = id++;
-    timespec start;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    timers.push_back({
+    uint64_t now_us = monotonic_us();
+    if (!timers.size())
+    {
+        // The wheel is empty, skip idle time
+        cur_tick = now_us / TIMER_TICK_US;
+    }
+    timerfd_timer_t *t = new timerfd_timer_t({
         .id = timer_id,
         .micros = micros,
-        .start = start,
-        .next = start,
+        .next_us = now_us + micros,
         .repeat = repeat,
         .callback = callback,
     });
-    inc_timer(timers[timers.size()-1]);
+    timers[timer_id] = t;
+    wheel_add(t);
     set_nearest();
     return timer_id;
 }
 
 void timerfd_manager_t::clear_timer(int timer_id)
 {
-    for (int i = 0; i < timers.size(); i++)
+    auto t_it = timers.find(timer_id);
+    if (t_it != timers.end())
+    {
+        wheel_remove(t_it->second);
+        delete t_it->second;
+        timers.erase(t_it);
+        set_nearest();
+    }
+}
+
+// Find the nearest tick after cur_tick when a level 0 slot has to be run or
+// a higher level slot has to be moved down. UINT64_MAX if the wheel is empty
+uint64_t timerfd_manager_t::next_event_tick(bool *is_move)
+{
+    uint64_t nearest = UINT64_MAX;
+    *is_move = false;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
     {
-        if (timers[i].id == timer_id)
+        uint64_t base = cur_tick >> TIMER_WHEEL_BITS*level;
+        int dist = next_used_slot(wheel_used[level], base & TIMER_WHEEL_MASK);
+        if (dist)
         {
-            timers.erase(timers.begin()+i, timers.begin()+i+1);
-            if (nearest == i)
+            uint64_t tick = (base + dist) << TIMER_WHEEL_BITS*level;
+            if (tick < nearest || (tick == nearest && level > 0))
             {
-                nearest = -1;
-                wait_state = wait_state & ~1;
+                nearest = tick;
+                *is_move = level > 0;
             }
-            else if (nearest > i)
-            {
-                nearest--;
-            }
-            set_nearest();
-            break;
         }
     }
+    return nearest;
 }
 
-void timerfd_manager_t::set_nearest()
+// Move timers from higher level slots starting at <tick> to lower levels
+void timerfd_manager_t::move_down(uint64_t tick)
 {
-again:
-    if (!timers.size())
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
     {
-        nearest = -1;
-        itimerspec exp = { 0 };
-        if (timerfd_settime(timerfd, 0, &exp, NULL))
+        if (tick & ((1ul << TIMER_WHEEL_BITS*level) - 1))
+        {
+            break;
+        }
+        int slot = (tick >> TIMER_WHEEL_BITS*level) & TIMER_WHEEL_MASK;
+        timerfd_timer_t *t = wheel[level][slot];
+        wheel[level][slot] = NULL;
+        wheel_used[level] &= ~(1ul << slot);
+        while (t)
         {
-            throw std::runtime_error(std::string("timerfd_settime: ") + strerror(errno));
+            timerfd_timer_t *next = t->next;
+            wheel_add(t);
+            t = next;
         }
-        wait_state = wait_state & ~1;
     }
-    else
+}
+
+void timerfd_manager_t::run_timers(uint64_t now_us)
+{
+    uint64_t now_tick = now_us / TIMER_TICK_US;
+    while (true)
     {
-        nearest = 0;
-        for (int i = 1; i < timers.size(); i++)
+        // Trigger expired timers of the current tick one by one because
+        // callbacks may add and clear timers, including timers of this slot
+    again:
+        for (timerfd_timer_t *t = wheel[0][cur_tick & TIMER_WHEEL_MASK]; t; t = t->next)
         {
-            if (timers[i].next.tv_sec < timers[nearest].next.tv_sec ||
-                timers[i].next.tv_sec == timers[nearest].next.tv_sec &&
-                timers[i].next.tv_nsec < timers[nearest].next.tv_nsec)
+            if (t->next_us <= now_us)
             {
-                nearest = i;
+                trigger(t);
+                goto again;
             }
         }
-        timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        itimerspec exp = {
-            .it_interval = { 0 },
-            .it_value = timers[nearest].next,
-        };
-        exp.it_value.tv_sec -= now.tv_sec;
-        exp.it_value.tv_nsec -= now.tv_nsec;
-        if (exp.it_value.tv_nsec < 0)
+        if (cur_tick >= now_tick)
         {
-            exp.it_value.tv_sec--;
-            exp.it_value.tv_nsec += 1000000000;
-        }
-        if (exp.it_value.tv_sec < 0 || exp.it_value.tv_sec == 0 && exp.it_value.tv_nsec <= 0)
-        {
-            // It already happened
-            trigger_nearest();
-            goto again;
+            break;
         }
-        if (timerfd_settime(timerfd, 0, &exp, NULL))
+        bool is_move;
+        uint64_t next_tick = next_event_tick(&is_move);
+        if (next_tick > now_tick)
         {
-            throw std::runtime_error(std::string("timerfd_settime: ") + strerror(errno));
+            cur_tick = now_tick;
+            break;
         }
-        wait_state = wait_state | 1;
+        cur_tick = next_tick;
+        move_down(cur_tick);
     }
 }
 
-void timerfd_manager_t::handle_readable()
+void timerfd_manager_t::trigger(timerfd_timer_t *t)
 {
-    uint64_t n;
-    size_t res = read(timerfd, &n, 8);
-    if (res == 8 && nearest >= 0)
+    int timer_id = t->id;
+    auto cb = t->callback;
+    wheel_remove(t);
+    if (t->repeat)
     {
-        trigger_nearest();
+        t->next_us += t->micros;
+        wheel_add(t);
     }
-    wait_state = 0;
-    set_nearest();
+    else
+    {
+        timers.erase(timer_id);
+        delete t;
+    }
+    cb(timer_id);
 }
 
-void timerfd_manager_t::trigger_nearest()
+void timerfd_manager_t::set_nearest()
 {
-    int nearest_id = timers[nearest].id;
-    auto cb = timers[nearest].callback;
-    if (timers[nearest].repeat)
+again:
+    uint64_t wake_us = 0;
+    if (timers.size())
     {
-        inc_timer(timers[nearest]);
+        wake_us = UINT64_MAX;
+        uint64_t tick = cur_tick;
+        bool is_move = false;
+        if (!wheel[0][cur_tick & TIMER_WHEEL_MASK])
+        {
+            tick = next_event_tick(&is_move);
+        }
+        if (is_move)
+        {
+            wake_us = tick*TIMER_TICK_US;
+        }
+        else
+        {
+            // All timers of a level 0 slot expire during the same tick, wake up at the exact time
+            for (timerfd_timer_t *t = wheel[0][tick & TIMER_WHEEL_MASK]; t; t = t->next)
+            {
+                if (t->next_us < wake_us)
+                    wake_us = t->next_us;
+            }
+        }
+        uint64_t now_us = monotonic_us();
+        if (wake_us <= now_us)
+        {
+            // It already happened
+            run_timers(now_us);
+            goto again;
+        }
     }
-    else
+    if (wake_us == armed_us)
+    {
+        return;
+    }
+    itimerspec exp = {
+        .it_interval = { 0 },
+        .it_value = {
+            .tv_sec = (time_t)(wake_us / 1000000),
+            .tv_nsec = (long)(wake_us % 1000000) * 1000,
+        },
+    };
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &exp, NULL))
     {
-        timers.erase(timers.begin()+nearest, timers.begin()+nearest+1);
+        throw std::runtime_error(std::string("timerfd_settime: ") + strerror(errno));
     }
-    nearest = -1;
-    cb(nearest_id);
+    armed_us = wake_us;
+}
+
+void timerfd_manager_t::handle_readable()
+{
+    uint64_t n;
+    size_t res = read(timerfd, &n, 8);
+    if (res == 8)
+    {
+        armed_us = 0;
+        run_timers(monotonic_us());
+    }
+    set_nearest();
 }
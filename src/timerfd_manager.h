@@ -4,29 +4,51 @@
 #pragma once
 
 #include <time.h>
-#include <vector>
+#include <stdint.h>
+#include <unordered_map>
 #include <functional>
 
+// Timers are kept in a hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of 64 slots each,
+// a slot of level L covers 64^L ticks of TIMER_TICK_US. Adding and removing a timer is O(1),
+// timers are moved to lower levels when the wheel reaches their slot. timerfd is armed
+// to the exact time of the nearest timer or to the nearest such move
+#define TIMER_TICK_US 1000
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 6
+
 struct timerfd_timer_t
 {
     int id;
     uint64_t micros;
-    timespec start, next;
+    // CLOCK_MONOTONIC time of the next expiration in microseconds
+    uint64_t next_us;
     bool repeat;
     std::function<void(int)> callback;
+    // Position in the wheel
+    int level, slot;
+    timerfd_timer_t *prev, *next;
 };
 
 class timerfd_manager_t
 {
-    int wait_state = 0;
     int timerfd;
-    int nearest = -1;
     int id = 1;
-    std::vector<timerfd_timer_t> timers;
+    // Ticks before cur_tick are already processed
+    uint64_t cur_tick = 0;
+    // Absolute time timerfd is armed to, 0 if it's disarmed
+    uint64_t armed_us = 0;
+    std::unordered_map<int, timerfd_timer_t*> timers;
+    timerfd_timer_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE] = {};
+    uint64_t wheel_used[TIMER_WHEEL_LEVELS] = {};
 
-    void inc_timer(timerfd_timer_t & t);
+    void wheel_add(timerfd_timer_t *t);
+    void wheel_remove(timerfd_timer_t *t);
+    uint64_t next_event_tick(bool *is_move);
+    void move_down(uint64_t tick);
+    void run_timers(uint64_t now_us);
+    void trigger(timerfd_timer_t *t);
     void set_nearest();
-    void trigger_nearest();
     void handle_readable();
 public:
     std::function<void(int, bool, std::function<void(int, int)>)> set_fd_handler;
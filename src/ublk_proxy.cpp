@@ -0,0 +1,661 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+// Block device frontend based on Linux ublk (6.0+). Unlike NBD, requests are received through io_uring
+// commands on /dev/ublkcN and their data is copied by the kernel directly to/from our buffers
+
+#include <linux/ublk_cmd.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+
+#include "epoll_manager.h"
+#include "cluster_client.h"
+
+// Newer kernels use ioctl-encoded command opcodes and may have legacy ones disabled
+#ifdef UBLK_U_CMD_ADD_DEV
+#define UBLK_CTRL_CMD(cmd) UBLK_U_CMD_##cmd
+#define UBLK_IO_CMD(cmd) UBLK_U_IO_##cmd
+#else
+#define UBLK_CTRL_CMD(cmd) UBLK_CMD_##cmd
+#define UBLK_IO_CMD(cmd) UBLK_IO_##cmd
+#endif
+
+#define UBLK_CONTROL_PATH "/dev/ublk-control"
+#define UBLK_DEFAULT_QUEUE_DEPTH 128
+#define UBLK_DEFAULT_MAX_IO_SIZE 1024*1024
+
+const char *exe_name = NULL;
+
+// One hardware queue of the ublk device, the kernel has one queue per CPU by default
+struct ublk_queue_t
+{
+    int q_id = 0;
+    // I/O descriptors written by the kernel, indexed by tag
+    ublksrv_io_desc *descs = NULL;
+    size_t descs_size = 0;
+    std::vector<void*> bufs;
+};
+
+// Command to submit to /dev/ublkcN
+struct ublk_cmd_t
+{
+    ublk_queue_t *q;
+    int tag;
+    int result;
+};
+
+class ublk_proxy
+{
+protected:
+    std::string image_name;
+    uint64_t inode = 0;
+    uint64_t device_size = 0;
+    inode_watch_t *watch = NULL;
+
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    cluster_client_t *cli = NULL;
+    ring_consumer_t consumer;
+
+    int ctrl_fd = -1, cdev_fd = -1;
+    io_uring ctrl_ring;
+    ublksrv_ctrl_dev_info dev_info = { 0 };
+    std::vector<ublk_queue_t*> queues;
+    std::vector<ublk_cmd_t> to_fetch, to_commit;
+    // Tags still owned by the kernel, 0 after the device is stopped
+    int active_tags = 0;
+
+public:
+    static json11::Json::object parse_args(int narg, const char *args[])
+    {
+        json11::Json::object cfg;
+        int pos = 0;
+        for (int i = 1; i < narg; i++)
+        {
+            if (!strcmp(args[i], "-h") || !strcmp(args[i], "--help"))
+            {
+                help();
+            }
+            else if (args[i][0] == '-' && args[i][1] == '-')
+            {
+                const char *opt = args[i]+2;
+                cfg[opt] = !strcmp(opt, "json") || i == narg-1 ? "1" : args[++i];
+            }
+            else if (pos == 0)
+            {
+                cfg["command"] = args[i];
+                pos++;
+            }
+            else if (pos == 1 && (cfg["command"] == "map" || cfg["command"] == "unmap"))
+            {
+                int n = 0;
+                if (sscanf(args[i], "/dev/ublkb%d", &n) > 0)
+                    cfg["dev_num"] = n;
+                else
+                    cfg["dev_num"] = args[i];
+                pos++;
+            }
+        }
+        return cfg;
+    }
+
+    void exec(json11::Json cfg)
+    {
+        if (cfg["command"] == "map")
+        {
+            start(cfg);
+        }
+        else if (cfg["command"] == "unmap")
+        {
+            if (cfg["dev_num"].is_null())
+            {
+                fprintf(stderr, "device name or number is missing\n");
+                exit(1);
+            }
+            unmap(cfg["dev_num"].uint64_value());
+        }
+        else if (cfg["command"] == "list" || cfg["command"] == "list-mapped")
+        {
+            auto mapped = list_mapped();
+            print_mapped(mapped, !cfg["json"].is_null());
+        }
+        else
+        {
+            help();
+        }
+    }
+
+    static void help()
+    {
+        printf(
+            "Vitastor ublk block device frontend\n"
+            "(c) Vitaliy Filippov, 2020-2021 (VNPL-1.1)\n\n"
+            "USAGE:\n"
+            "  %s map [--etcd_address <etcd_address>] (--image <image> | --pool <pool> --inode <inode> --size <size in bytes>)\n"
+            "    [--queues <N>] [--queue_depth <N>] [--max_io_size <bytes>]\n"
+            "  %s unmap /dev/ublkb0\n"
+            "  %s list [--json]\n",
+            exe_name, exe_name, exe_name
+        );
+        exit(0);
+    }
+
+    void unmap(int dev_num)
+    {
+        open_control();
+        // STOP_DEV waits until all requests are completed and DEL_DEV waits until the daemon exits
+        int r = ctrl_cmd(UBLK_CTRL_CMD(STOP_DEV), dev_num, NULL, 0, 0);
+        if (r < 0)
+        {
+            fprintf(stderr, "UBLK_CMD_STOP_DEV: %s\n", strerror(-r));
+            exit(1);
+        }
+        r = ctrl_cmd(UBLK_CTRL_CMD(DEL_DEV), dev_num, NULL, 0, 0);
+        if (r < 0)
+        {
+            fprintf(stderr, "UBLK_CMD_DEL_DEV: %s\n", strerror(-r));
+            exit(1);
+        }
+    }
+
+    void start(json11::Json cfg)
+    {
+        // Check options
+        if (cfg["image"].string_value() != "")
+        {
+            // Use image name
+            image_name = cfg["image"].string_value();
+            inode = 0;
+        }
+        else
+        {
+            // Use pool, inode number and size
+            if (!cfg["size"].uint64_value())
+            {
+                fprintf(stderr, "device size is missing\n");
+                exit(1);
+            }
+            device_size = cfg["size"].uint64_value();
+            inode = cfg["inode"].uint64_value();
+            uint64_t pool = cfg["pool"].uint64_value();
+            if (pool)
+            {
+                inode = (inode & ((1l << (64-POOL_ID_BITS)) - 1)) | (pool << (64-POOL_ID_BITS));
+            }
+            if (!(inode >> (64-POOL_ID_BITS)))
+            {
+                fprintf(stderr, "pool is missing\n");
+                exit(1);
+            }
+        }
+        int queue_count = cfg["queues"].uint64_value();
+        if (!queue_count)
+            queue_count = sysconf(_SC_NPROCESSORS_ONLN);
+        int queue_depth = cfg["queue_depth"].uint64_value();
+        if (!queue_depth)
+            queue_depth = UBLK_DEFAULT_QUEUE_DEPTH;
+        else if (queue_depth > UBLK_MAX_QUEUE_DEPTH)
+            queue_depth = UBLK_MAX_QUEUE_DEPTH;
+        uint32_t max_io_size = cfg["max_io_size"].uint64_value();
+        if (!max_io_size)
+            max_io_size = UBLK_DEFAULT_MAX_IO_SIZE;
+        max_io_size = ((max_io_size + 4095) / 4096) * 4096;
+        // Create client. All queues are served by the same ring loop and client: the kernel only requires
+        // each queue to be served by a single thread, and blk-mq still gets a separate queue for each CPU
+        ringloop = new ring_loop_t(512);
+        epmgr = new epoll_manager_t(ringloop, cfg["use_uring_poll"].bool_value() || cfg["use_uring_poll"].uint64_value());
+        cli = new cluster_client_t(ringloop, epmgr->tfd, cfg);
+        if (!inode)
+        {
+            // Load image metadata
+            while (!cli->is_ready())
+            {
+                ringloop->loop();
+                if (cli->is_ready())
+                    break;
+                ringloop->wait();
+            }
+            watch = cli->st_cli.watch_inode(image_name);
+            device_size = watch->cfg.size;
+        }
+        // Create the device
+        load_module();
+        open_control();
+        dev_info.nr_hw_queues = queue_count;
+        dev_info.queue_depth = queue_depth;
+        dev_info.max_io_buf_bytes = max_io_size;
+        dev_info.dev_id = cfg["dev_num"].is_null() ? (uint32_t)-1 : cfg["dev_num"].uint64_value();
+        dev_info.flags = UBLK_F_URING_CMD_COMP_IN_TASK;
+        int r = ctrl_cmd(UBLK_CTRL_CMD(ADD_DEV), dev_info.dev_id, &dev_info, sizeof(dev_info), 0);
+        if (r < 0)
+        {
+            fprintf(stderr, "UBLK_CMD_ADD_DEV: %s\n", strerror(-r));
+            exit(1);
+        }
+        ublk_params params = { 0 };
+        params.len = sizeof(params);
+        params.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD;
+        // Writes are only persisted after a sync, so the device has a volatile write cache
+        params.basic.attrs = UBLK_ATTR_VOLATILE_CACHE | (watch && watch->cfg.readonly ? UBLK_ATTR_READ_ONLY : 0);
+        params.basic.logical_bs_shift = 9;
+        params.basic.physical_bs_shift = 12;
+        params.basic.io_min_shift = 12;
+        params.basic.io_opt_shift = 12;
+        params.basic.max_sectors = max_io_size >> 9;
+        params.basic.dev_sectors = device_size >> 9;
+        params.discard.discard_granularity = 4096;
+        params.discard.max_discard_sectors = UINT32_MAX >> 9;
+        params.discard.max_write_zeroes_sectors = max_io_size >> 9;
+        params.discard.max_discard_segments = 1;
+        r = ctrl_cmd(UBLK_CTRL_CMD(SET_PARAMS), dev_info.dev_id, &params, sizeof(params), 0);
+        if (r < 0)
+        {
+            fprintf(stderr, "UBLK_CMD_SET_PARAMS: %s\n", strerror(-r));
+            ctrl_cmd(UBLK_CTRL_CMD(DEL_DEV), dev_info.dev_id, NULL, 0, 0);
+            exit(1);
+        }
+        printf("/dev/ublkb%u\n", dev_info.dev_id);
+        if (cfg["foreground"].is_null())
+        {
+            // Daemonize before fetching requests: the kernel binds each queue to the task which fetches them
+            daemonize();
+        }
+        if (!open_queues(queue_count, queue_depth, max_io_size))
+        {
+            ctrl_cmd(UBLK_CTRL_CMD(DEL_DEV), dev_info.dev_id, NULL, 0, 0);
+            exit(1);
+        }
+        consumer.loop = [this]()
+        {
+            submit_cmds();
+            ringloop->submit();
+        };
+        ringloop->register_consumer(&consumer);
+        // START_DEV waits until all tags are fetched
+        submit_cmds();
+        ringloop->submit();
+        r = ctrl_cmd(UBLK_CTRL_CMD(START_DEV), dev_info.dev_id, NULL, 0, getpid());
+        if (r < 0)
+        {
+            fprintf(stderr, "UBLK_CMD_START_DEV: %s\n", strerror(-r));
+            ctrl_cmd(UBLK_CTRL_CMD(DEL_DEV), dev_info.dev_id, NULL, 0, 0);
+            exit(1);
+        }
+        while (active_tags > 0)
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+        // The device is stopped
+        bool stop = false;
+        cluster_op_t *close_sync = new cluster_op_t;
+        close_sync->opcode = OSD_OP_SYNC;
+        close_sync->callback = [&stop](cluster_op_t *op)
+        {
+            stop = true;
+            delete op;
+        };
+        cli->execute(close_sync);
+        while (!stop)
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+        ringloop->unregister_consumer(&consumer);
+        for (auto q: queues)
+        {
+            munmap(q->descs, q->descs_size);
+            for (auto buf: q->bufs)
+                free(buf);
+            delete q;
+        }
+        queues.clear();
+        close(cdev_fd);
+        delete cli;
+        delete epmgr;
+        delete ringloop;
+    }
+
+    void load_module()
+    {
+        if (access(UBLK_CONTROL_PATH, F_OK) == 0)
+        {
+            return;
+        }
+        int r;
+        if ((r = system("modprobe ublk_drv")) != 0)
+        {
+            if (r < 0)
+                perror("Failed to load ublk kernel module");
+            else
+                fprintf(stderr, "Failed to load ublk kernel module\n");
+            exit(1);
+        }
+    }
+
+    void daemonize()
+    {
+        if (fork())
+            exit(0);
+        setsid();
+        if (fork())
+            exit(0);
+        chdir("/");
+        close(0);
+        close(1);
+        close(2);
+        open("/dev/null", O_RDONLY);
+        open("/dev/null", O_WRONLY);
+        open("/dev/null", O_WRONLY);
+    }
+
+    json11::Json::object list_mapped()
+    {
+        const char *self_filename = exe_name;
+        for (int i = 0; exe_name[i] != 0; i++)
+        {
+            if (exe_name[i] == '/')
+                self_filename = exe_name+i+1;
+        }
+        json11::Json::object mapped;
+        DIR *dir = opendir("/sys/block");
+        if (!dir)
+        {
+            return mapped;
+        }
+        open_control();
+        dirent *ent;
+        while ((ent = readdir(dir)) != NULL)
+        {
+            int dev_num;
+            if (sscanf(ent->d_name, "ublkb%d", &dev_num) < 1)
+                continue;
+            ublksrv_ctrl_dev_info info = { 0 };
+            if (ctrl_cmd(UBLK_CTRL_CMD(GET_DEV_INFO), dev_num, &info, sizeof(info), 0) < 0 || info.ublksrv_pid <= 0)
+                continue;
+            char path[64] = { 0 };
+            sprintf(path, "/proc/%d/cmdline", info.ublksrv_pid);
+            std::string cmdline = read_file(path);
+            std::vector<const char*> argv;
+            int last = 0;
+            for (int i = 0; i < cmdline.size(); i++)
+            {
+                if (cmdline[i] == 0)
+                {
+                    argv.push_back(cmdline.c_str()+last);
+                    last = i+1;
+                }
+            }
+            if (argv.size() > 0)
+            {
+                const char *pid_filename = argv[0];
+                for (int i = 0; argv[0][i] != 0; i++)
+                {
+                    if (argv[0][i] == '/')
+                        pid_filename = argv[0]+i+1;
+                }
+                if (!strcmp(pid_filename, self_filename))
+                {
+                    json11::Json::object cfg = ublk_proxy::parse_args(argv.size(), argv.data());
+                    if (cfg["command"] == "map")
+                    {
+                        cfg.erase("command");
+                        cfg["pid"] = info.ublksrv_pid;
+                        mapped["/dev/ublkb"+std::to_string(dev_num)] = cfg;
+                    }
+                }
+            }
+        }
+        closedir(dir);
+        return mapped;
+    }
+
+    void print_mapped(json11::Json mapped, bool json)
+    {
+        if (json)
+        {
+            printf("%s\n", mapped.dump().c_str());
+        }
+        else
+        {
+            for (auto & dev: mapped.object_items())
+            {
+                printf("%s\n", dev.first.c_str());
+                for (auto & k: dev.second.object_items())
+                {
+                    printf("%s: %s\n", k.first.c_str(), k.second.string_value().c_str());
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    std::string read_file(char *path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+                return "";
+            auto err = "open "+std::string(path);
+            perror(err.c_str());
+            exit(1);
+        }
+        std::string r;
+        while (true)
+        {
+            int l = r.size();
+            r.resize(l + 1024);
+            int rd = read(fd, (void*)(r.c_str() + l), 1024);
+            if (rd <= 0)
+            {
+                r.resize(l);
+                break;
+            }
+            r.resize(l + rd);
+        }
+        close(fd);
+        return r;
+    }
+
+protected:
+    void open_control()
+    {
+        ctrl_fd = open(UBLK_CONTROL_PATH, O_RDWR);
+        if (ctrl_fd < 0)
+        {
+            perror("open " UBLK_CONTROL_PATH);
+            exit(1);
+        }
+        // Control commands don't fit into 64-byte SQEs
+        int r = io_uring_queue_init(4, &ctrl_ring, IORING_SETUP_SQE128);
+        if (r < 0)
+        {
+            fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-r));
+            exit(1);
+        }
+    }
+
+    // Control commands are rare, so they're just executed synchronously
+    int ctrl_cmd(uint32_t cmd_op, uint32_t dev_id, void *buf, uint16_t len, uint64_t data)
+    {
+        io_uring_sqe *sqe = io_uring_get_sqe(&ctrl_ring);
+        memset(sqe, 0, 2*sizeof(io_uring_sqe));
+        sqe->opcode = IORING_OP_URING_CMD;
+        sqe->fd = ctrl_fd;
+        sqe->cmd_op = cmd_op;
+        ublksrv_ctrl_cmd *cmd = (ublksrv_ctrl_cmd*)sqe->cmd;
+        cmd->dev_id = dev_id;
+        cmd->queue_id = (uint16_t)-1;
+        cmd->addr = (uint64_t)buf;
+        cmd->len = len;
+        cmd->data[0] = data;
+        int r = io_uring_submit_and_wait(&ctrl_ring, 1);
+        if (r < 0)
+        {
+            return r;
+        }
+        io_uring_cqe *cqe;
+        r = io_uring_wait_cqe(&ctrl_ring, &cqe);
+        if (r < 0)
+        {
+            return r;
+        }
+        r = cqe->res;
+        io_uring_cqe_seen(&ctrl_ring, cqe);
+        return r;
+    }
+
+    bool open_queues(int queue_count, int queue_depth, uint32_t max_io_size)
+    {
+        char path[64] = { 0 };
+        sprintf(path, "/dev/ublkc%u", dev_info.dev_id);
+        // The character device may be created by udev with a small delay
+        for (int i = 0; i < 100 && cdev_fd < 0; i++)
+        {
+            cdev_fd = open(path, O_RDWR);
+            if (cdev_fd < 0)
+                usleep(10000);
+        }
+        if (cdev_fd < 0)
+        {
+            fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t max_descs_size = ((UBLK_MAX_QUEUE_DEPTH * sizeof(ublksrv_io_desc) + page_size - 1) / page_size) * page_size;
+        for (int q_id = 0; q_id < queue_count; q_id++)
+        {
+            ublk_queue_t *q = new ublk_queue_t;
+            q->q_id = q_id;
+            q->descs_size = ((queue_depth * sizeof(ublksrv_io_desc) + page_size - 1) / page_size) * page_size;
+            q->descs = (ublksrv_io_desc*)mmap(NULL, q->descs_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                cdev_fd, UBLKSRV_CMD_BUF_OFFSET + q_id*max_descs_size);
+            if (q->descs == MAP_FAILED)
+            {
+                perror("mmap ublk I/O descriptors");
+                delete q;
+                return false;
+            }
+            queues.push_back(q);
+            for (int tag = 0; tag < queue_depth; tag++)
+            {
+                q->bufs.push_back(memalign_or_die(page_size, max_io_size));
+                to_fetch.push_back((ublk_cmd_t){ .q = q, .tag = tag, .result = 0 });
+            }
+        }
+        active_tags = queue_count*queue_depth;
+        return true;
+    }
+
+    void submit_cmds()
+    {
+        while (to_fetch.size() > 0 || to_commit.size() > 0)
+        {
+            io_uring_sqe* sqe = ringloop->get_sqe();
+            if (!sqe)
+            {
+                return;
+            }
+            bool commit = to_commit.size() > 0;
+            ublk_cmd_t uc = commit ? to_commit.back() : to_fetch.back();
+            if (commit)
+                to_commit.pop_back();
+            else
+                to_fetch.pop_back();
+            ring_data_t* data = ((ring_data_t*)sqe->user_data);
+            ublk_queue_t *q = uc.q;
+            int tag = uc.tag;
+            data->callback = [this, q, tag](ring_data_t *data) { handle_cmd(q, tag, data->res); };
+            my_uring_prep_rw(IORING_OP_URING_CMD, sqe, cdev_fd, NULL, 0, 0);
+            sqe->cmd_op = commit ? UBLK_IO_CMD(COMMIT_AND_FETCH_REQ) : UBLK_IO_CMD(FETCH_REQ);
+            ublksrv_io_cmd *cmd = (ublksrv_io_cmd*)sqe->cmd;
+            cmd->q_id = q->q_id;
+            cmd->tag = tag;
+            cmd->result = uc.result;
+            cmd->addr = (uint64_t)q->bufs[tag];
+        }
+    }
+
+    void handle_cmd(ublk_queue_t *q, int tag, int res)
+    {
+        if (res == UBLK_IO_RES_ABORT)
+        {
+            // The device is being stopped
+            active_tags--;
+            return;
+        }
+        if (res != UBLK_IO_RES_OK)
+        {
+            fprintf(stderr, "ublk command failed: %s\n", strerror(res < 0 ? -res : EINVAL));
+            exit(1);
+        }
+        const ublksrv_io_desc *iod = &q->descs[tag];
+        uint8_t io_op = ublksrv_get_op(iod);
+        uint64_t offset = iod->start_sector << 9;
+        uint64_t len = (uint64_t)iod->nr_sectors << 9;
+        uint64_t op_inode = inode ? inode : watch->cfg.num;
+        if (io_op == UBLK_IO_OP_DISCARD || io_op == UBLK_IO_OP_WRITE_ZEROES)
+        {
+            if (watch && watch->cfg.readonly)
+            {
+                commit(q, tag, -EROFS);
+                return;
+            }
+            cli->discard(op_inode, offset, len, io_op == UBLK_IO_OP_WRITE_ZEROES,
+                iod->op_flags & UBLK_IO_F_NOUNMAP, [this, q, tag](int retval)
+            {
+                commit(q, tag, retval);
+            });
+            return;
+        }
+        if (io_op != UBLK_IO_OP_READ && io_op != UBLK_IO_OP_WRITE && io_op != UBLK_IO_OP_FLUSH)
+        {
+            commit(q, tag, -EOPNOTSUPP);
+            return;
+        }
+        if (io_op == UBLK_IO_OP_WRITE && watch && watch->cfg.readonly)
+        {
+            commit(q, tag, -EROFS);
+            return;
+        }
+        cluster_op_t *op = new cluster_op_t;
+        if (io_op == UBLK_IO_OP_FLUSH)
+        {
+            op->opcode = OSD_OP_SYNC;
+        }
+        else
+        {
+            op->opcode = io_op == UBLK_IO_OP_READ ? OSD_OP_READ : OSD_OP_WRITE;
+            op->inode = op_inode;
+            op->offset = offset;
+            op->len = len;
+            op->iov.push_back(q->bufs[tag], len);
+        }
+        op->callback = [this, q, tag](cluster_op_t *op)
+        {
+            int retval = op->retval;
+            delete op;
+            commit(q, tag, retval);
+        };
+        cli->execute(op);
+    }
+
+    void commit(ublk_queue_t *q, int tag, int result)
+    {
+        to_commit.push_back((ublk_cmd_t){ .q = q, .tag = tag, .result = result });
+        ringloop->wakeup();
+    }
+};
+
+int main(int narg, const char *args[])
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    setvbuf(stderr, NULL, _IONBF, 0);
+    exe_name = args[0];
+    ublk_proxy *p = new ublk_proxy();
+    p->exec(ublk_proxy::parse_args(narg, args));
+    return 0;
+}
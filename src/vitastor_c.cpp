@@ -5,19 +5,55 @@
 // Also acts as a C-C++ proxy for the QEMU driver (QEMU headers don't compile with g++)
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <mutex>
+#include <thread>
 
 #include "ringloop.h"
 #include "epoll_manager.h"
 #include "cluster_client.h"
+#include "metrics.h"
 
 #include "vitastor_c.h"
 
+// Maximum number of objects checked by one vitastor_c_block_status() call in each layer
+#define VITASTOR_C_BLOCK_STATUS_OBJECTS 1024
+// Protects vitastor_c_block_status() from parent loops
+#define VITASTOR_C_MAX_LAYERS 256
+
 struct vitastor_qemu_fd_t
 {
     int fd;
+    bool wr;
     std::function<void(int, int)> callback;
 };
 
+// Functions posted to another thread, it's woken up through an eventfd
+struct vitastor_c_queue_t
+{
+    int efd = -1;
+    std::mutex mu;
+    std::vector<std::function<void()>> fns;
+};
+
+// Worker thread of a multi-threaded client with its own ring loop, messenger and OSD connections
+struct vitastor_c_worker_t
+{
+    std::thread thread;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    cluster_client_t *cli = NULL;
+    vitastor_c_queue_t queue;
+    bool stopped = false;
+};
+
+struct vitastor_c_etcd_group_t;
+
 struct vitastor_c
 {
     std::map<int, vitastor_qemu_fd_t> handlers;
@@ -28,8 +64,221 @@ struct vitastor_c
 
     QEMUSetFDHandler *aio_set_fd_handler = NULL;
     void *aio_ctx = NULL;
+
+    // Functions posted to the client thread: completions of worker operations and mirrored etcd state
+    vitastor_c_queue_t queue;
+    // Multi-threaded mode: <cli> only talks to etcd and mirrors its state to workers
+    std::vector<vitastor_c_worker_t*> workers;
+    vitastor_c_etcd_group_t *etcd_group = NULL;
+    json11::Json cfg_json;
+};
+
+// Clients of the same cluster in one process share one etcd connection: the first one (<owner>)
+// loads the state and watches etcd, others receive a copy of it. When the owner is destroyed,
+// the next client takes over
+struct vitastor_c_etcd_group_t
+{
+    std::string key;
+    vitastor_c *owner = NULL;
+    std::vector<vitastor_c*> members;
+    // Last state of the owner to start new members
+    bool config_loaded = false, state_loaded = false;
+    json11::Json::object global_config;
+    std::map<std::string, etcd_kv_t> kvs;
+};
+
+static std::mutex etcd_groups_mu;
+static std::map<std::string, vitastor_c_etcd_group_t*> etcd_groups;
+
+struct vitastor_c_sync_t
+{
+    int left;
+    long retval;
 };
 
+static void vitastor_c_post(vitastor_c_queue_t & queue, std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mu);
+        queue.fns.push_back(fn);
+    }
+    uint64_t one = 1;
+    write(queue.efd, &one, sizeof(one));
+}
+
+static void vitastor_c_run_posted(vitastor_c_queue_t & queue)
+{
+    // Reset the eventfd before taking functions so that later posts wake us up again
+    uint64_t count;
+    read(queue.efd, &count, sizeof(count));
+    std::vector<std::function<void()>> fns;
+    {
+        std::lock_guard<std::mutex> lock(queue.mu);
+        fns.swap(queue.fns);
+    }
+    for (auto & fn: fns)
+    {
+        fn();
+    }
+}
+
+// Forward etcd state to workers and, if the client owns the shared etcd connection, to other clients
+static void vitastor_c_set_mirror_hooks(vitastor_c *self)
+{
+    self->cli->st_cli.on_mirror_config_hook = [self](const json11::Json::object & global_config)
+    {
+        for (auto worker: self->workers)
+        {
+            vitastor_c_post(worker->queue, [worker, global_config]()
+            {
+                worker->cli->st_cli.apply_mirror_config(global_config);
+            });
+        }
+        std::lock_guard<std::mutex> lock(etcd_groups_mu);
+        auto group = self->etcd_group;
+        if (group->owner == self)
+        {
+            group->config_loaded = true;
+            group->global_config = global_config;
+            for (auto member: group->members)
+            {
+                if (member != self)
+                {
+                    vitastor_c_post(member->queue, [member, global_config]()
+                    {
+                        member->cli->st_cli.apply_mirror_config(global_config);
+                    });
+                }
+            }
+        }
+    };
+    self->cli->st_cli.on_mirror_state_hook = [self](const std::vector<etcd_kv_t> & kvs, bool loaded)
+    {
+        for (auto worker: self->workers)
+        {
+            vitastor_c_post(worker->queue, [worker, kvs, loaded]()
+            {
+                worker->cli->st_cli.apply_mirror_state(kvs, loaded);
+            });
+        }
+        std::lock_guard<std::mutex> lock(etcd_groups_mu);
+        auto group = self->etcd_group;
+        if (group->owner == self)
+        {
+            group->state_loaded = group->state_loaded || loaded;
+            for (auto & kv: kvs)
+            {
+                if (kv.value.is_null())
+                    group->kvs.erase(kv.key);
+                else
+                    group->kvs[kv.key] = kv;
+            }
+            for (auto member: group->members)
+            {
+                if (member != self)
+                {
+                    vitastor_c_post(member->queue, [member, kvs, loaded]()
+                    {
+                        member->cli->st_cli.apply_mirror_state(kvs, loaded);
+                    });
+                }
+            }
+        }
+    };
+}
+
+static void vitastor_c_start(vitastor_c *self, json11::Json cfg_json)
+{
+    timerfd_manager_t *tfd = self->epmgr ? self->epmgr->tfd : self->tfd;
+    self->queue.efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (self->queue.efd < 0)
+    {
+        throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+    }
+    tfd->set_fd_handler(self->queue.efd, false, [self](int fd, int events)
+    {
+        vitastor_c_run_posted(self->queue);
+    });
+    self->cfg_json = cfg_json;
+    std::lock_guard<std::mutex> lock(etcd_groups_mu);
+    // Cache options don't affect the etcd connection
+    json11::Json::object key_cfg = cfg_json.object_items();
+    key_cfg.erase("client_enable_writeback");
+    key_cfg.erase("client_readahead");
+    std::string key = json11::Json(key_cfg).dump();
+    auto & group = etcd_groups[key];
+    if (!group)
+    {
+        group = new vitastor_c_etcd_group_t;
+        group->key = key;
+    }
+    self->etcd_group = group;
+    self->cli = new cluster_client_t(self->ringloop, tfd, cfg_json, group->owner != NULL);
+    vitastor_c_set_mirror_hooks(self);
+    group->members.push_back(self);
+    if (!group->owner)
+    {
+        group->owner = self;
+    }
+    else
+    {
+        // Start from the state already loaded by the owner
+        if (group->config_loaded)
+        {
+            auto global_config = group->global_config;
+            vitastor_c_post(self->queue, [self, global_config]()
+            {
+                self->cli->st_cli.apply_mirror_config(global_config);
+            });
+        }
+        if (group->state_loaded)
+        {
+            std::vector<etcd_kv_t> kvs;
+            for (auto & kv: group->kvs)
+                kvs.push_back(kv.second);
+            vitastor_c_post(self->queue, [self, kvs]()
+            {
+                self->cli->st_cli.apply_mirror_state(kvs, true);
+            });
+        }
+    }
+}
+
+static void vitastor_c_stop(vitastor_c *self)
+{
+    {
+        std::lock_guard<std::mutex> lock(etcd_groups_mu);
+        auto group = self->etcd_group;
+        for (int i = 0; i < group->members.size(); i++)
+        {
+            if (group->members[i] == self)
+            {
+                group->members.erase(group->members.begin()+i);
+                break;
+            }
+        }
+        if (!group->members.size())
+        {
+            etcd_groups.erase(group->key);
+            delete group;
+        }
+        else if (group->owner == self)
+        {
+            // Next client starts talking to etcd itself
+            auto owner = group->owner = group->members[0];
+            vitastor_c_post(owner->queue, [owner]()
+            {
+                owner->cli->st_cli.mirror_mode = false;
+                owner->cli->st_cli.load_global_config();
+            });
+        }
+        self->etcd_group = NULL;
+    }
+    timerfd_manager_t *tfd = self->epmgr ? self->epmgr->tfd : self->tfd;
+    tfd->set_fd_handler(self->queue.efd, false, NULL);
+    close(self->queue.efd);
+}
+
 extern "C" {
 
 static json11::Json vitastor_c_common_config(const char *config_path, const char *etcd_host, const char *etcd_prefix,
@@ -70,14 +319,28 @@ static void vitastor_c_write_handler(void *opaque)
     data->callback(data->fd, EPOLLOUT);
 }
 
-vitastor_c *vitastor_c_create_qemu(QEMUSetFDHandler *aio_set_fd_handler, void *aio_context,
-    const char *config_path, const char *etcd_host, const char *etcd_prefix,
-    int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level)
+// Called by QEMU adaptive polling (poll-max-ns of the iothread) instead of sleeping in ppoll():
+// checks the socket without blocking and handles incoming data right away
+static bool vitastor_c_poll_handler(void *opaque)
+{
+    vitastor_qemu_fd_t *data = (vitastor_qemu_fd_t *)opaque;
+    pollfd pfd = { .fd = data->fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) <= 0 || !pfd.revents)
+    {
+        return false;
+    }
+    data->callback(data->fd, EPOLLIN);
+    return true;
+}
+
+static void vitastor_c_qemu_set_handler(vitastor_c *self, vitastor_qemu_fd_t *data)
+{
+    self->aio_set_fd_handler(self->aio_ctx, data->fd, false, vitastor_c_read_handler,
+        data->wr ? vitastor_c_write_handler : NULL, (void*)vitastor_c_poll_handler, data);
+}
+
+static vitastor_c *vitastor_c_create_qemu_cfg(QEMUSetFDHandler *aio_set_fd_handler, void *aio_context, json11::Json cfg_json)
 {
-    json11::Json cfg_json = vitastor_c_common_config(
-        config_path, etcd_host, etcd_prefix, use_rdma,
-        rdma_device, rdma_port_num, rdma_gid_index, rdma_mtu, log_level
-    );
     vitastor_c *self = new vitastor_c;
     self->aio_set_fd_handler = aio_set_fd_handler;
     self->aio_ctx = aio_context;
@@ -85,20 +348,55 @@ vitastor_c *vitastor_c_create_qemu(QEMUSetFDHandler *aio_set_fd_handler, void *a
     {
         if (callback != NULL)
         {
-            self->handlers[fd] = { .fd = fd, .callback = callback };
-            self->aio_set_fd_handler(self->aio_ctx, fd, false,
-                vitastor_c_read_handler, wr ? vitastor_c_write_handler : NULL, NULL, &self->handlers[fd]);
+            self->handlers[fd] = { .fd = fd, .wr = wr, .callback = callback };
+            if (self->aio_ctx)
+                vitastor_c_qemu_set_handler(self, &self->handlers[fd]);
         }
         else
         {
             self->handlers.erase(fd);
-            self->aio_set_fd_handler(self->aio_ctx, fd, false, NULL, NULL, NULL, NULL);
+            if (self->aio_ctx)
+                self->aio_set_fd_handler(self->aio_ctx, fd, false, NULL, NULL, NULL, NULL);
         }
     });
-    self->cli = new cluster_client_t(NULL, self->tfd, cfg_json);
+    vitastor_c_start(self, cfg_json);
     return self;
 }
 
+vitastor_c *vitastor_c_create_qemu(QEMUSetFDHandler *aio_set_fd_handler, void *aio_context,
+    const char *config_path, const char *etcd_host, const char *etcd_prefix,
+    int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level)
+{
+    json11::Json cfg_json = vitastor_c_common_config(
+        config_path, etcd_host, etcd_prefix, use_rdma,
+        rdma_device, rdma_port_num, rdma_gid_index, rdma_mtu, log_level
+    );
+    return vitastor_c_create_qemu_cfg(aio_set_fd_handler, aio_context, cfg_json);
+}
+
+vitastor_c *vitastor_c_create_qemu_queue(vitastor_c *main_client, QEMUSetFDHandler *aio_set_fd_handler, void *aio_context)
+{
+    json11::Json::object cfg = main_client->cfg_json.object_items();
+    cfg["client_enable_writeback"] = false;
+    cfg["client_readahead"] = 0;
+    return vitastor_c_create_qemu_cfg(aio_set_fd_handler, aio_context, cfg);
+}
+
+void vitastor_c_qemu_set_aio_context(vitastor_c *client, void *aio_context)
+{
+    if (client->aio_ctx)
+    {
+        for (auto & hp: client->handlers)
+            client->aio_set_fd_handler(client->aio_ctx, hp.first, false, NULL, NULL, NULL, NULL);
+    }
+    client->aio_ctx = aio_context;
+    if (client->aio_ctx)
+    {
+        for (auto & hp: client->handlers)
+            vitastor_c_qemu_set_handler(client, &hp.second);
+    }
+}
+
 vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level)
 {
@@ -108,8 +406,9 @@ vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_ho
     );
     vitastor_c *self = new vitastor_c;
     self->ringloop = new ring_loop_t(512);
-    self->epmgr = new epoll_manager_t(self->ringloop);
-    self->cli = new cluster_client_t(self->ringloop, self->epmgr->tfd, cfg_json);
+    self->epmgr = new epoll_manager_t(self->ringloop, cfg_json["use_uring_poll"].bool_value() ||
+        cfg_json["use_uring_poll"].uint64_value());
+    vitastor_c_start(self, cfg_json);
     return self;
 }
 
@@ -123,13 +422,122 @@ vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len)
     json11::Json cfg_json(cfg);
     vitastor_c *self = new vitastor_c;
     self->ringloop = new ring_loop_t(512);
-    self->epmgr = new epoll_manager_t(self->ringloop);
-    self->cli = new cluster_client_t(self->ringloop, self->epmgr->tfd, cfg_json);
+    self->epmgr = new epoll_manager_t(self->ringloop, cfg_json["use_uring_poll"].bool_value() ||
+        cfg_json["use_uring_poll"].uint64_value());
+    vitastor_c_start(self, cfg_json);
+    return self;
+}
+
+static void vitastor_c_worker_loop(vitastor_c_worker_t *worker, json11::Json cfg_json)
+{
+    worker->ringloop = new ring_loop_t(512);
+    worker->epmgr = new epoll_manager_t(worker->ringloop, cfg_json["use_uring_poll"].bool_value() ||
+        cfg_json["use_uring_poll"].uint64_value());
+    worker->cli = new cluster_client_t(worker->ringloop, worker->epmgr->tfd, cfg_json, true);
+    worker->epmgr->set_fd_handler(worker->queue.efd, false, [worker](int fd, int events)
+    {
+        vitastor_c_run_posted(worker->queue);
+    });
+    vitastor_c_run_posted(worker->queue);
+    while (!worker->stopped)
+    {
+        worker->ringloop->loop();
+        if (worker->stopped)
+            break;
+        worker->ringloop->wait();
+    }
+    worker->epmgr->set_fd_handler(worker->queue.efd, false, NULL);
+    delete worker->cli;
+    delete worker->epmgr;
+    delete worker->ringloop;
+}
+
+vitastor_c *vitastor_c_create_uring_threads(const char *config_path, const char *etcd_host, const char *etcd_prefix,
+    int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level, int threads)
+{
+    vitastor_c *self = vitastor_c_create_uring(config_path, etcd_host, etcd_prefix,
+        use_rdma, rdma_device, rdma_port_num, rdma_gid_index, rdma_mtu, log_level);
+    if (threads <= 0)
+    {
+        return self;
+    }
+    json11::Json::object worker_cfg = vitastor_c_common_config(
+        config_path, etcd_host, etcd_prefix, use_rdma,
+        rdma_device, rdma_port_num, rdma_gid_index, rdma_mtu, log_level
+    ).object_items();
+    // Write-back and read-ahead caches are per cluster_client_t and operations on the same
+    // object may go to different workers, so workers can't use them without losing coherence
+    worker_cfg["client_enable_writeback"] = false;
+    worker_cfg["client_readahead"] = 0;
+    json11::Json cfg_json(worker_cfg);
+    for (int i = 0; i < threads; i++)
+    {
+        auto worker = new vitastor_c_worker_t;
+        worker->queue.efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (worker->queue.efd < 0)
+        {
+            throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+        }
+        worker->thread = std::thread(vitastor_c_worker_loop, worker, cfg_json);
+        self->workers.push_back(worker);
+    }
     return self;
 }
 
+// Pick the worker by the PG of the first object of the operation, so that each PG
+// and thus mostly each primary OSD connection is handled by one worker
+static int vitastor_c_pick_worker(vitastor_c *client, cluster_op_t *op)
+{
+    auto & st_cli = client->cli->st_cli;
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(op->inode));
+    if (op->opcode == OSD_OP_SYNC || pool_it == st_cli.pool_config.end() || !pool_it->second.real_pg_count)
+    {
+        return 0;
+    }
+    auto & pool_cfg = pool_it->second;
+    uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t pg_block_size = client->cli->get_bs_block_size() * pg_data_size;
+    uint64_t stripe = (op->offset / pg_block_size) * pg_block_size;
+    pg_num_t pg_num = (stripe/pool_cfg.pg_stripe_size) % pool_cfg.real_pg_count + 1; // like map_to_pg()
+    return (pool_cfg.id + pg_num) % client->workers.size();
+}
+
+static void vitastor_c_execute(vitastor_c *client, cluster_op_t *op, int worker_num = -1)
+{
+    if (!client->workers.size())
+    {
+        client->cli->execute(op);
+        return;
+    }
+    auto worker = client->workers[worker_num >= 0 ? worker_num : vitastor_c_pick_worker(client, op)];
+    // Call the completion callback in the client thread
+    auto callback = op->callback;
+    op->callback = [client, callback](cluster_op_t *op)
+    {
+        vitastor_c_post(client->queue, [op, callback]()
+        {
+            callback(op);
+        });
+    };
+    vitastor_c_post(worker->queue, [worker, op]()
+    {
+        worker->cli->execute(op);
+    });
+}
+
 void vitastor_c_destroy(vitastor_c *client)
 {
+    for (auto worker: client->workers)
+    {
+        vitastor_c_post(worker->queue, [worker]()
+        {
+            worker->stopped = true;
+        });
+        worker->thread.join();
+        close(worker->queue.efd);
+        delete worker;
+    }
+    vitastor_c_stop(client);
     delete client->cli;
     if (client->epmgr)
         delete client->epmgr;
@@ -145,6 +553,11 @@ int vitastor_c_is_ready(vitastor_c *client)
     return client->cli->is_ready();
 }
 
+int vitastor_c_uses_cache(vitastor_c *client)
+{
+    return client->cli->uses_cache();
+}
+
 void vitastor_c_uring_wait_ready(vitastor_c *client)
 {
     while (!client->cli->is_ready())
@@ -166,57 +579,283 @@ void vitastor_c_uring_wait_events(vitastor_c *client)
     client->ringloop->wait();
 }
 
-void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
-    struct iovec *iov, int iovcnt, VitastorReadHandler cb, void *opaque)
+static cluster_op_t *vitastor_c_rw_op(uint64_t opcode, uint64_t inode, uint64_t offset, uint64_t len,
+    uint64_t version, struct iovec *iov, int iovcnt)
 {
     cluster_op_t *op = new cluster_op_t;
-    op->opcode = OSD_OP_READ;
+    op->opcode = opcode;
     op->inode = inode;
     op->offset = offset;
     op->len = len;
+    op->version = version;
     for (int i = 0; i < iovcnt; i++)
     {
         op->iov.push_back(iov[i].iov_base, iov[i].iov_len);
     }
+    return op;
+}
+
+void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    struct iovec *iov, int iovcnt, VitastorReadHandler cb, void *opaque)
+{
+    cluster_op_t *op = vitastor_c_rw_op(OSD_OP_READ, inode, offset, len, 0, iov, iovcnt);
     op->callback = [cb, opaque](cluster_op_t *op)
     {
         cb(opaque, op->retval, op->version);
         delete op;
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
 }
 
 void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, uint64_t check_version,
     struct iovec *iov, int iovcnt, VitastorIOHandler cb, void *opaque)
 {
-    cluster_op_t *op = new cluster_op_t;
-    op->opcode = OSD_OP_WRITE;
-    op->inode = inode;
-    op->offset = offset;
-    op->len = len;
-    op->version = check_version;
-    for (int i = 0; i < iovcnt; i++)
-    {
-        op->iov.push_back(iov[i].iov_base, iov[i].iov_len);
-    }
+    cluster_op_t *op = vitastor_c_rw_op(OSD_OP_WRITE, inode, offset, len, check_version, iov, iovcnt);
     op->callback = [cb, opaque](cluster_op_t *op)
     {
         cb(opaque, op->retval);
         delete op;
     };
-    client->cli->execute(op);
+    vitastor_c_execute(client, op);
+}
+
+// Create SYNC operations: one per worker in multi-threaded mode, each of them syncs its own writes
+static std::vector<cluster_op_t*> vitastor_c_sync_ops(vitastor_c *client, VitastorReadHandler cb, void *opaque)
+{
+    std::vector<cluster_op_t*> ops;
+    int count = client->workers.size() ? client->workers.size() : 1;
+    auto sync = new vitastor_c_sync_t{ .left = count, .retval = 0 };
+    for (int i = 0; i < count; i++)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_SYNC;
+        op->callback = [cb, opaque, sync](cluster_op_t *op)
+        {
+            if (op->retval < 0 && !sync->retval)
+                sync->retval = op->retval;
+            delete op;
+            if (!--sync->left)
+            {
+                cb(opaque, sync->retval, 0);
+                delete sync;
+            }
+        };
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+static void vitastor_c_io_to_read_handler(void *opaque, long retval, uint64_t version)
+{
+    auto cb = (std::pair<VitastorIOHandler*, void*>*)opaque;
+    cb->first(cb->second, retval);
+    delete cb;
 }
 
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque)
 {
-    cluster_op_t *op = new cluster_op_t;
-    op->opcode = OSD_OP_SYNC;
-    op->callback = [cb, opaque](cluster_op_t *op)
+    auto ops = vitastor_c_sync_ops(client, vitastor_c_io_to_read_handler,
+        new std::pair<VitastorIOHandler*, void*>(cb, opaque));
+    for (int i = 0; i < ops.size(); i++)
     {
-        cb(opaque, op->retval);
-        delete op;
-    };
-    client->cli->execute(op);
+        vitastor_c_execute(client, ops[i], i);
+    }
+}
+
+void vitastor_c_submit_batch(vitastor_c *client, struct vitastor_c_op *ops, int count)
+{
+    // Operations of each worker (or all operations in single-threaded mode) in submission order
+    std::vector<std::vector<cluster_op_t*>> batches(client->workers.size() ? client->workers.size() : 1);
+    for (int i = 0; i < count; i++)
+    {
+        auto cb = ops[i].cb;
+        auto opaque = ops[i].opaque;
+        if (ops[i].opcode == VITASTOR_C_OP_SYNC)
+        {
+            auto sync_ops = vitastor_c_sync_ops(client, cb, opaque);
+            for (int j = 0; j < sync_ops.size(); j++)
+                batches[j].push_back(sync_ops[j]);
+            continue;
+        }
+        if (ops[i].opcode != VITASTOR_C_OP_READ && ops[i].opcode != VITASTOR_C_OP_WRITE)
+        {
+            cb(opaque, -EINVAL, 0);
+            continue;
+        }
+        cluster_op_t *op = vitastor_c_rw_op(ops[i].opcode == VITASTOR_C_OP_READ ? OSD_OP_READ : OSD_OP_WRITE,
+            ops[i].inode, ops[i].offset, ops[i].len, ops[i].opcode == VITASTOR_C_OP_WRITE ? ops[i].version : 0,
+            ops[i].iov, ops[i].iovcnt);
+        op->callback = [cb, opaque](cluster_op_t *op)
+        {
+            cb(opaque, op->retval, op->opcode == OSD_OP_READ ? op->version : 0);
+            delete op;
+        };
+        batches[client->workers.size() ? vitastor_c_pick_worker(client, op) : 0].push_back(op);
+    }
+    if (!client->workers.size())
+    {
+        client->cli->execute_batch(batches[0].data(), batches[0].size());
+        return;
+    }
+    for (int i = 0; i < batches.size(); i++)
+    {
+        if (!batches[i].size())
+            continue;
+        for (auto op: batches[i])
+        {
+            // Call the completion callback in the client thread
+            auto callback = op->callback;
+            op->callback = [client, callback](cluster_op_t *op)
+            {
+                vitastor_c_post(client->queue, [op, callback]()
+                {
+                    callback(op);
+                });
+            };
+        }
+        auto worker = client->workers[i];
+        vitastor_c_post(worker->queue, [worker, batch = std::move(batches[i])]() mutable
+        {
+            worker->cli->execute_batch(batch.data(), batch.size());
+        });
+    }
+}
+
+static void vitastor_c_discard_range(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    bool write_zeroes, bool no_hole, VitastorIOHandler cb, void *opaque)
+{
+    if (!client->workers.size())
+    {
+        client->cli->discard(inode, offset, len, write_zeroes, no_hole, [cb, opaque](int retval)
+        {
+            cb(opaque, retval);
+        });
+        return;
+    }
+    // The whole request is handled by the worker of its first object
+    cluster_op_t pick_op;
+    pick_op.inode = inode;
+    pick_op.offset = offset;
+    auto worker = client->workers[vitastor_c_pick_worker(client, &pick_op)];
+    vitastor_c_post(worker->queue, [=]()
+    {
+        worker->cli->discard(inode, offset, len, write_zeroes, no_hole, [=](int retval)
+        {
+            vitastor_c_post(client->queue, [=]()
+            {
+                cb(opaque, retval);
+            });
+        });
+    });
+}
+
+void vitastor_c_discard(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque)
+{
+    vitastor_c_discard_range(client, inode, offset, len, false, false, cb, opaque);
+}
+
+void vitastor_c_write_zeroes(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, int no_hole,
+    VitastorIOHandler cb, void *opaque)
+{
+    vitastor_c_discard_range(client, inode, offset, len, true, no_hole, cb, opaque);
+}
+
+struct vitastor_c_block_status_t
+{
+    uint64_t offset, start, end, granularity;
+    int left;
+    long retval;
+    std::vector<uint8_t> bitmap;
+    VitastorBlockStatusHandler *cb;
+    void *opaque;
+};
+
+void vitastor_c_block_status(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorBlockStatusHandler cb, void *opaque)
+{
+    cluster_client_t *cli = client->cli;
+    uint64_t granularity = cli->get_bs_bitmap_granularity();
+    auto ino_it = cli->st_cli.inode_config.find(inode);
+    if (!granularity || ino_it == cli->st_cli.inode_config.end())
+    {
+        cb(opaque, !granularity ? -EAGAIN : -ENOENT, 0, NULL);
+        return;
+    }
+    // All layers of the image, the range is allocated if it's written in any of them
+    std::vector<inode_t> layers;
+    while (ino_it != cli->st_cli.inode_config.end() && layers.size() < VITASTOR_C_MAX_LAYERS)
+    {
+        layers.push_back(ino_it->first);
+        ino_it = ino_it->second.parent_id ? cli->st_cli.inode_config.find(ino_it->second.parent_id)
+            : cli->st_cli.inode_config.end();
+    }
+    auto st = new vitastor_c_block_status_t;
+    st->offset = offset;
+    st->start = offset / granularity * granularity;
+    st->end = offset + len;
+    st->granularity = granularity;
+    st->left = 1;
+    st->retval = 0;
+    st->cb = cb;
+    st->opaque = opaque;
+    // Limit the number of objects checked at once, callers repeat the query for the rest
+    uint64_t max_len = VITASTOR_C_BLOCK_STATUS_OBJECTS * cli->get_bs_block_size();
+    if (st->end - st->start > max_len)
+        st->end = st->start + max_len;
+    st->bitmap.resize(((st->end - st->start + granularity - 1) / granularity + 7) / 8);
+    for (inode_t layer: layers)
+    {
+        auto pool_it = cli->st_cli.pool_config.find(INODE_POOL(layer));
+        if (pool_it == cli->st_cli.pool_config.end())
+            continue;
+        auto & pool_cfg = pool_it->second;
+        uint64_t pg_block_size = cli->get_bs_block_size() * (pool_cfg.scheme == POOL_SCHEME_REPLICATED
+            ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        for (uint64_t stripe = st->start / pg_block_size * pg_block_size; stripe < st->end; stripe += pg_block_size)
+        {
+            // READ_BITMAP returns the bitmap of the whole object
+            cluster_op_t *op = new cluster_op_t;
+            op->opcode = OSD_OP_READ_BITMAP;
+            op->inode = layer;
+            op->offset = stripe;
+            op->len = 0;
+            op->callback = [st, pg_block_size](cluster_op_t *op)
+            {
+                if (op->retval < 0 && !st->retval)
+                {
+                    st->retval = op->retval;
+                }
+                else if (op->retval >= 0)
+                {
+                    uint64_t from = op->offset < st->start ? st->start : op->offset;
+                    uint64_t to = op->offset + pg_block_size < st->end ? op->offset + pg_block_size : st->end;
+                    for (uint64_t pos = from; pos < to; pos += st->granularity)
+                    {
+                        uint64_t obj_bit = (pos - op->offset) / st->granularity;
+                        if ((((uint8_t*)op->bitmap_buf)[obj_bit/8] >> (obj_bit%8)) & 1)
+                        {
+                            uint64_t bit = (pos - st->start) / st->granularity;
+                            st->bitmap[bit/8] |= (1 << (bit%8));
+                        }
+                    }
+                }
+                delete op;
+                if (!--st->left)
+                {
+                    st->cb(st->opaque, st->retval < 0 ? st->retval : st->end-st->offset, st->granularity, st->bitmap.data());
+                    delete st;
+                }
+            };
+            st->left++;
+            vitastor_c_execute(client, op);
+        }
+    }
+    if (!--st->left)
+    {
+        st->cb(st->opaque, st->retval < 0 ? st->retval : st->end-st->offset, st->granularity, st->bitmap.data());
+        delete st;
+    }
 }
 
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque)
@@ -251,4 +890,32 @@ int vitastor_c_inode_get_readonly(void *handle)
     return watch->cfg.readonly;
 }
 
+char *vitastor_c_get_metrics(vitastor_c *client, const char *labels)
+{
+    // Counters of workers are read without locking, they may be slightly inconsistent
+    osd_op_stats_t *sum = new osd_op_stats_t(client->cli->msgr.stats);
+    for (auto w: client->workers)
+    {
+        osd_op_stats_t & st = w->cli->msgr.stats;
+        for (int i = OSD_OP_MIN; i <= OSD_OP_MAX; i++)
+        {
+            sum->subop_stat_sum[i] += st.subop_stat_sum[i];
+            sum->subop_stat_count[i] += st.subop_stat_count[i];
+            for (int b = 0; b < LAT_HIST_BUCKETS; b++)
+                sum->subop_stat_hist[i].buckets[b] += st.subop_stat_hist[i].buckets[b];
+        }
+        sum->send_count += st.send_count;
+        sum->send_bytes += st.send_bytes;
+    }
+    std::string out;
+    std::string lbl = labels ? labels : "";
+    metrics_add_op_stats(out, "vitastor_client", lbl, *sum, false, true);
+    metrics_add_json(out, "vitastor_client_msgr", lbl, json11::Json::object {
+        { "send", sum->send_count },
+        { "send_bytes", sum->send_bytes },
+    });
+    delete sum;
+    return strdup(out.c_str());
+}
+
 }
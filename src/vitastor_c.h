@@ -29,24 +29,79 @@ typedef void QEMUSetFDHandler(void *ctx, int fd, int is_external, IOHandler *fd_
 vitastor_c *vitastor_c_create_qemu(QEMUSetFDHandler *aio_set_fd_handler, void *aio_context,
     const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level);
+// Additional QEMU client for another AioContext with the configuration of <main_client>. It shares
+// the etcd connection of <main_client> and has client write-back cache and read-ahead disabled
+// because they would be separate from the caches of <main_client>
+vitastor_c *vitastor_c_create_qemu_queue(vitastor_c *main_client, QEMUSetFDHandler *aio_set_fd_handler, void *aio_context);
+// Move fd handlers of a QEMU client to another AioContext, NULL just removes them
+void vitastor_c_qemu_set_aio_context(vitastor_c *client, void *aio_context);
 vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level);
 vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len);
+// Same as vitastor_c_create_uring(), but operations are handled by <threads> worker threads, each with its
+// own io_uring, messenger and OSD connections, and distributed over them by PG. etcd is still used only
+// by the calling thread which must drive the client with vitastor_c_uring_*() and receives all callbacks
+vitastor_c *vitastor_c_create_uring_threads(const char *config_path, const char *etcd_host, const char *etcd_prefix,
+    int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level, int threads);
 void vitastor_c_destroy(vitastor_c *client);
 int vitastor_c_is_ready(vitastor_c *client);
+// Returns 1 if the client currently has write-back cache or read-ahead enabled
+int vitastor_c_uses_cache(vitastor_c *client);
 void vitastor_c_uring_wait_ready(vitastor_c *client);
 void vitastor_c_uring_handle_events(vitastor_c *client);
 void vitastor_c_uring_wait_events(vitastor_c *client);
+// Data of reads is received into <iov> directly, except for the cases listed for
+// the tcp_direct_read_replies option in README.md
 void vitastor_c_read(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
     struct iovec *iov, int iovcnt, VitastorReadHandler cb, void *opaque);
 void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, uint64_t check_version,
     struct iovec *iov, int iovcnt, VitastorIOHandler cb, void *opaque);
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque);
+// Discard and write-zeroes delete whole objects in the range instead of writing data.
+// Discard ignores unaligned ends, write-zeroes writes zeroes there. With <no_hole>, or if the image
+// has a parent, write-zeroes writes zeroes to the whole range. The callback receives 0 or an error code
+void vitastor_c_discard(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorIOHandler cb, void *opaque);
+void vitastor_c_write_zeroes(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len, int no_hole,
+    VitastorIOHandler cb, void *opaque);
+
+// Allocation status of image data, including its parent layers, for SEEK_HOLE/block status queries.
+// <retval> is the number of bytes from <offset> covered by <bitmap> (it may be less than <len>) or a negative
+// error code. Every bit of <bitmap> describes <granularity> bytes starting from <offset> rounded down
+// to <granularity>: 1 means the data is written, 0 means the area isn't written and reads as zeroes.
+// <bitmap> is only valid during the callback
+typedef void VitastorBlockStatusHandler(void *opaque, long retval, uint64_t granularity, uint8_t *bitmap);
+void vitastor_c_block_status(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
+    VitastorBlockStatusHandler cb, void *opaque);
+
+#define VITASTOR_C_OP_READ 1
+#define VITASTOR_C_OP_WRITE 2
+#define VITASTOR_C_OP_SYNC 3
+
+// One operation of vitastor_c_submit_batch(). <version> is the check_version for writes.
+// The callback receives the version of read data for reads and 0 for writes and syncs
+struct vitastor_c_op
+{
+    int opcode;
+    uint64_t inode, offset, len, version;
+    struct iovec *iov;
+    int iovcnt;
+    VitastorReadHandler *cb;
+    void *opaque;
+};
+
+// Submit <count> operations at once. They're all queued before starting any of them,
+// so requests to the same OSD are coalesced into fewer sendmsg calls
+void vitastor_c_submit_batch(vitastor_c *client, struct vitastor_c_op *ops, int count);
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque);
 void vitastor_c_close_watch(vitastor_c *client, void *handle);
 uint64_t vitastor_c_inode_get_size(void *handle);
 uint64_t vitastor_c_inode_get_num(void *handle);
 int vitastor_c_inode_get_readonly(void *handle);
+// Operation latency histograms and counters of the client (including all of its worker threads)
+// in Prometheus text format. <labels> are added to every sample, for example "image=\"testimg\"",
+// and may be NULL. The result must be freed with free()
+char *vitastor_c_get_metrics(vitastor_c *client, const char *labels);
 
 #ifdef __cplusplus
 }
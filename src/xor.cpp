@@ -0,0 +1,349 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <string.h>
+#include <assert.h>
+
+#include "xor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEMXOR_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define MEMXOR_NEON
+#endif
+
+static inline void memxor_tail(const void *r1, const void *r2, void *res, unsigned int i, unsigned int len)
+{
+    for (; i+8 <= len; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, (uint8_t*)r1+i, 8);
+        memcpy(&b, (uint8_t*)r2+i, 8);
+        a ^= b;
+        memcpy((uint8_t*)res+i, &a, 8);
+    }
+    for (; i < len; i++)
+    {
+        ((uint8_t*)res)[i] = ((uint8_t*)r1)[i] ^ ((uint8_t*)r2)[i];
+    }
+}
+
+static inline void memxor_multi_tail(const void **srcs, int n, void *res, unsigned int i, unsigned int len)
+{
+    for (; i+8 <= len; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, (uint8_t*)srcs[0]+i, 8);
+        for (int j = 1; j < n; j++)
+        {
+            memcpy(&b, (uint8_t*)srcs[j]+i, 8);
+            a ^= b;
+        }
+        memcpy((uint8_t*)res+i, &a, 8);
+    }
+    for (; i < len; i++)
+    {
+        uint8_t a = ((uint8_t*)srcs[0])[i];
+        for (int j = 1; j < n; j++)
+            a ^= ((uint8_t*)srcs[j])[i];
+        ((uint8_t*)res)[i] = a;
+    }
+}
+
+static bool generic_supported()
+{
+    return true;
+}
+
+static void memxor_generic(const void *r1, const void *r2, void *res, unsigned int len)
+{
+    memxor_tail(r1, r2, res, 0, len);
+}
+
+static void memxor_multi_generic(const void **srcs, int n, void *res, unsigned int len)
+{
+    assert(n > 0);
+    memxor_multi_tail(srcs, n, res, 0, len);
+}
+
+#ifdef MEMXOR_X86
+
+static bool sse2_supported()
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static void memxor_sse2(const void *r1, const void *r2, void *res, unsigned int len)
+{
+    unsigned int i = 0;
+    for (; i+64 <= len; i += 64)
+    {
+        const __m128i *a = (const __m128i*)((uint8_t*)r1+i), *b = (const __m128i*)((uint8_t*)r2+i);
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128(a), _mm_loadu_si128(b));
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128(a+1), _mm_loadu_si128(b+1));
+        __m128i x2 = _mm_xor_si128(_mm_loadu_si128(a+2), _mm_loadu_si128(b+2));
+        __m128i x3 = _mm_xor_si128(_mm_loadu_si128(a+3), _mm_loadu_si128(b+3));
+        __m128i *d = (__m128i*)((uint8_t*)res+i);
+        _mm_storeu_si128(d, x0);
+        _mm_storeu_si128(d+1, x1);
+        _mm_storeu_si128(d+2, x2);
+        _mm_storeu_si128(d+3, x3);
+    }
+    for (; i+16 <= len; i += 16)
+    {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)((uint8_t*)r1+i)), _mm_loadu_si128((const __m128i*)((uint8_t*)r2+i)));
+        _mm_storeu_si128((__m128i*)((uint8_t*)res+i), x);
+    }
+    memxor_tail(r1, r2, res, i, len);
+}
+
+__attribute__((target("sse2")))
+static void memxor_multi_sse2(const void **srcs, int n, void *res, unsigned int len)
+{
+    assert(n > 0);
+    unsigned int i = 0;
+    for (; i+64 <= len; i += 64)
+    {
+        const __m128i *s = (const __m128i*)((uint8_t*)srcs[0]+i);
+        __m128i x0 = _mm_loadu_si128(s), x1 = _mm_loadu_si128(s+1), x2 = _mm_loadu_si128(s+2), x3 = _mm_loadu_si128(s+3);
+        for (int j = 1; j < n; j++)
+        {
+            s = (const __m128i*)((uint8_t*)srcs[j]+i);
+            x0 = _mm_xor_si128(x0, _mm_loadu_si128(s));
+            x1 = _mm_xor_si128(x1, _mm_loadu_si128(s+1));
+            x2 = _mm_xor_si128(x2, _mm_loadu_si128(s+2));
+            x3 = _mm_xor_si128(x3, _mm_loadu_si128(s+3));
+        }
+        __m128i *d = (__m128i*)((uint8_t*)res+i);
+        _mm_storeu_si128(d, x0);
+        _mm_storeu_si128(d+1, x1);
+        _mm_storeu_si128(d+2, x2);
+        _mm_storeu_si128(d+3, x3);
+    }
+    memxor_multi_tail(srcs, n, res, i, len);
+}
+
+static bool avx2_supported()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void memxor_avx2(const void *r1, const void *r2, void *res, unsigned int len)
+{
+    unsigned int i = 0;
+    for (; i+128 <= len; i += 128)
+    {
+        const __m256i *a = (const __m256i*)((uint8_t*)r1+i), *b = (const __m256i*)((uint8_t*)r2+i);
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256(a), _mm256_loadu_si256(b));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256(a+1), _mm256_loadu_si256(b+1));
+        __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256(a+2), _mm256_loadu_si256(b+2));
+        __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256(a+3), _mm256_loadu_si256(b+3));
+        __m256i *d = (__m256i*)((uint8_t*)res+i);
+        _mm256_storeu_si256(d, x0);
+        _mm256_storeu_si256(d+1, x1);
+        _mm256_storeu_si256(d+2, x2);
+        _mm256_storeu_si256(d+3, x3);
+    }
+    for (; i+32 <= len; i += 32)
+    {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)((uint8_t*)r1+i)), _mm256_loadu_si256((const __m256i*)((uint8_t*)r2+i)));
+        _mm256_storeu_si256((__m256i*)((uint8_t*)res+i), x);
+    }
+    memxor_tail(r1, r2, res, i, len);
+}
+
+__attribute__((target("avx2")))
+static void memxor_multi_avx2(const void **srcs, int n, void *res, unsigned int len)
+{
+    assert(n > 0);
+    unsigned int i = 0;
+    for (; i+128 <= len; i += 128)
+    {
+        const __m256i *s = (const __m256i*)((uint8_t*)srcs[0]+i);
+        __m256i x0 = _mm256_loadu_si256(s), x1 = _mm256_loadu_si256(s+1), x2 = _mm256_loadu_si256(s+2), x3 = _mm256_loadu_si256(s+3);
+        for (int j = 1; j < n; j++)
+        {
+            s = (const __m256i*)((uint8_t*)srcs[j]+i);
+            x0 = _mm256_xor_si256(x0, _mm256_loadu_si256(s));
+            x1 = _mm256_xor_si256(x1, _mm256_loadu_si256(s+1));
+            x2 = _mm256_xor_si256(x2, _mm256_loadu_si256(s+2));
+            x3 = _mm256_xor_si256(x3, _mm256_loadu_si256(s+3));
+        }
+        __m256i *d = (__m256i*)((uint8_t*)res+i);
+        _mm256_storeu_si256(d, x0);
+        _mm256_storeu_si256(d+1, x1);
+        _mm256_storeu_si256(d+2, x2);
+        _mm256_storeu_si256(d+3, x3);
+    }
+    memxor_multi_tail(srcs, n, res, i, len);
+}
+
+static bool avx512_supported()
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+__attribute__((target("avx512f")))
+static void memxor_avx512(const void *r1, const void *r2, void *res, unsigned int len)
+{
+    unsigned int i = 0;
+    for (; i+256 <= len; i += 256)
+    {
+        const uint8_t *a = (const uint8_t*)r1+i, *b = (const uint8_t*)r2+i;
+        __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(a), _mm512_loadu_si512(b));
+        __m512i x1 = _mm512_xor_si512(_mm512_loadu_si512(a+64), _mm512_loadu_si512(b+64));
+        __m512i x2 = _mm512_xor_si512(_mm512_loadu_si512(a+128), _mm512_loadu_si512(b+128));
+        __m512i x3 = _mm512_xor_si512(_mm512_loadu_si512(a+192), _mm512_loadu_si512(b+192));
+        uint8_t *d = (uint8_t*)res+i;
+        _mm512_storeu_si512(d, x0);
+        _mm512_storeu_si512(d+64, x1);
+        _mm512_storeu_si512(d+128, x2);
+        _mm512_storeu_si512(d+192, x3);
+    }
+    for (; i+64 <= len; i += 64)
+    {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512((uint8_t*)r1+i), _mm512_loadu_si512((uint8_t*)r2+i));
+        _mm512_storeu_si512((uint8_t*)res+i, x);
+    }
+    memxor_tail(r1, r2, res, i, len);
+}
+
+__attribute__((target("avx512f")))
+static void memxor_multi_avx512(const void **srcs, int n, void *res, unsigned int len)
+{
+    assert(n > 0);
+    unsigned int i = 0;
+    for (; i+256 <= len; i += 256)
+    {
+        const uint8_t *s = (const uint8_t*)srcs[0]+i;
+        __m512i x0 = _mm512_loadu_si512(s), x1 = _mm512_loadu_si512(s+64), x2 = _mm512_loadu_si512(s+128), x3 = _mm512_loadu_si512(s+192);
+        for (int j = 1; j < n; j++)
+        {
+            s = (const uint8_t*)srcs[j]+i;
+            x0 = _mm512_xor_si512(x0, _mm512_loadu_si512(s));
+            x1 = _mm512_xor_si512(x1, _mm512_loadu_si512(s+64));
+            x2 = _mm512_xor_si512(x2, _mm512_loadu_si512(s+128));
+            x3 = _mm512_xor_si512(x3, _mm512_loadu_si512(s+192));
+        }
+        uint8_t *d = (uint8_t*)res+i;
+        _mm512_storeu_si512(d, x0);
+        _mm512_storeu_si512(d+64, x1);
+        _mm512_storeu_si512(d+128, x2);
+        _mm512_storeu_si512(d+192, x3);
+    }
+    memxor_multi_tail(srcs, n, res, i, len);
+}
+
+#endif
+
+#ifdef MEMXOR_NEON
+
+// NEON is mandatory on AArch64
+static bool neon_supported()
+{
+    return true;
+}
+
+static void memxor_neon(const void *r1, const void *r2, void *res, unsigned int len)
+{
+    unsigned int i = 0;
+    for (; i+64 <= len; i += 64)
+    {
+        const uint8_t *a = (const uint8_t*)r1+i, *b = (const uint8_t*)r2+i;
+        uint8x16_t x0 = veorq_u8(vld1q_u8(a), vld1q_u8(b));
+        uint8x16_t x1 = veorq_u8(vld1q_u8(a+16), vld1q_u8(b+16));
+        uint8x16_t x2 = veorq_u8(vld1q_u8(a+32), vld1q_u8(b+32));
+        uint8x16_t x3 = veorq_u8(vld1q_u8(a+48), vld1q_u8(b+48));
+        uint8_t *d = (uint8_t*)res+i;
+        vst1q_u8(d, x0);
+        vst1q_u8(d+16, x1);
+        vst1q_u8(d+32, x2);
+        vst1q_u8(d+48, x3);
+    }
+    memxor_tail(r1, r2, res, i, len);
+}
+
+static void memxor_multi_neon(const void **srcs, int n, void *res, unsigned int len)
+{
+    assert(n > 0);
+    unsigned int i = 0;
+    for (; i+64 <= len; i += 64)
+    {
+        const uint8_t *s = (const uint8_t*)srcs[0]+i;
+        uint8x16_t x0 = vld1q_u8(s), x1 = vld1q_u8(s+16), x2 = vld1q_u8(s+32), x3 = vld1q_u8(s+48);
+        for (int j = 1; j < n; j++)
+        {
+            s = (const uint8_t*)srcs[j]+i;
+            x0 = veorq_u8(x0, vld1q_u8(s));
+            x1 = veorq_u8(x1, vld1q_u8(s+16));
+            x2 = veorq_u8(x2, vld1q_u8(s+32));
+            x3 = veorq_u8(x3, vld1q_u8(s+48));
+        }
+        uint8_t *d = (uint8_t*)res+i;
+        vst1q_u8(d, x0);
+        vst1q_u8(d+16, x1);
+        vst1q_u8(d+32, x2);
+        vst1q_u8(d+48, x3);
+    }
+    memxor_multi_tail(srcs, n, res, i, len);
+}
+
+#endif
+
+// In order of preference
+static const memxor_kernel_t memxor_kernels[] = {
+#ifdef MEMXOR_X86
+    { "avx512", avx512_supported, memxor_avx512, memxor_multi_avx512 },
+    { "avx2", avx2_supported, memxor_avx2, memxor_multi_avx2 },
+    { "sse2", sse2_supported, memxor_sse2, memxor_multi_sse2 },
+#endif
+#ifdef MEMXOR_NEON
+    { "neon", neon_supported, memxor_neon, memxor_multi_neon },
+#endif
+    { "generic", generic_supported, memxor_generic, memxor_multi_generic },
+};
+
+static const memxor_kernel_t *memxor_detect()
+{
+#ifdef MEMXOR_X86
+    // May be called before libgcc's own constructor
+    __builtin_cpu_init();
+#endif
+    for (int i = 0; i < sizeof(memxor_kernels)/sizeof(memxor_kernels[0]); i++)
+    {
+        if (memxor_kernels[i].supported())
+            return &memxor_kernels[i];
+    }
+    return &memxor_kernels[sizeof(memxor_kernels)/sizeof(memxor_kernels[0]) - 1];
+}
+
+const memxor_kernel_t *memxor_impl = memxor_detect();
+
+int memxor_kernel_count()
+{
+    return sizeof(memxor_kernels)/sizeof(memxor_kernels[0]);
+}
+
+const memxor_kernel_t *memxor_kernel(int i)
+{
+    return i >= 0 && i < memxor_kernel_count() ? &memxor_kernels[i] : NULL;
+}
+
+bool memxor_select(const char *name)
+{
+    for (int i = 0; i < memxor_kernel_count(); i++)
+    {
+        if (!strcmp(memxor_kernels[i].name, name))
+        {
+            if (!memxor_kernels[i].supported())
+                return false;
+            memxor_impl = &memxor_kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
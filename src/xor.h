@@ -5,11 +5,32 @@
 
 #include <stdint.h>
 
+// XOR kernel set. The best kernel supported by the CPU is selected at startup,
+// all kernels accept unaligned buffers and allow <res> to be equal to any source
+struct memxor_kernel_t
+{
+    const char *name;
+    bool (*supported)();
+    // res = r1 ^ r2
+    void (*xor2)(const void *r1, const void *r2, void *res, unsigned int len);
+    // res = srcs[0] ^ srcs[1] ^ ... ^ srcs[n-1], in a single pass over memory
+    void (*xorn)(const void **srcs, int n, void *res, unsigned int len);
+};
+
+extern const memxor_kernel_t *memxor_impl;
+
 inline void memxor(const void *r1, const void *r2, void *res, unsigned int len)
 {
-    unsigned int i;
-    for (i = 0; i < len; ++i)
-    {
-        ((uint8_t*)res)[i] = ((uint8_t*)r1)[i] ^ ((uint8_t*)r2)[i];
-    }
+    memxor_impl->xor2(r1, r2, res, len);
 }
+
+inline void memxor_multi(const void **srcs, int n, void *res, unsigned int len)
+{
+    memxor_impl->xorn(srcs, n, res, len);
+}
+
+// For tests and benchmarks: all compiled-in kernels, supported or not
+int memxor_kernel_count();
+const memxor_kernel_t *memxor_kernel(int i);
+// Returns false if the kernel isn't found or isn't supported by the CPU
+bool memxor_select(const char *name);
@@ -4,6 +4,12 @@
 
 OSD_SIZE=${OSD_SIZE:-1024}
 PG_COUNT=${PG_COUNT:-1}
+SCHEME=${SCHEME:-xor}
+if [ "$SCHEME" = "replicated" ]; then
+    POOLCFG='"scheme":"replicated","pg_size":3,"pg_minsize":2'
+else
+    POOLCFG='"scheme":"xor","pg_size":3,"pg_minsize":2,"parity_chunks":1'
+fi
 
 dd if=/dev/zero of=./testdata/test_osd1.bin bs=1024 count=1 seek=$((OSD_SIZE*1024-1))
 dd if=/dev/zero of=./testdata/test_osd2.bin bs=1024 count=1 seek=$((OSD_SIZE*1024-1))
@@ -26,7 +32,7 @@ if [ -n "$GLOBAL_CONF" ]; then
     $ETCDCTL put /vitastor/config/global "$GLOBAL_CONF"
 fi
 
-$ETCDCTL put /vitastor/config/pools '{"1":{"name":"testpool","scheme":"xor","pg_size":3,"pg_minsize":2,"parity_chunks":1,"pg_count":'$PG_COUNT',"failure_domain":"osd"}}'
+$ETCDCTL put /vitastor/config/pools '{"1":{"name":"testpool",'$POOLCFG',"pg_count":'$PG_COUNT',"failure_domain":"osd"}}'
 
 sleep 2
 
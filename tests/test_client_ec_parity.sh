@@ -0,0 +1,38 @@
+#!/bin/bash -ex
+
+# Whole-object writes to an XOR pool with parity calculated by the client: the primary must
+# accept it and store the same parity it would calculate itself, so data is still readable
+# after losing a data chunk
+
+GLOBAL_CONF='{"client_ec_parity":true}'
+
+. `dirname $0`/run_3osds.sh
+
+# 256 KB = 2 data chunks of 128 KB, every write covers whole objects
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=256k -direct=1 -iodepth=16 -fsync=16 \
+        -rw=write -verify=crc32c -do_verify=0 -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M
+
+for i in 1 2 3; do
+    if ! kill -0 $(eval echo \$OSD${i}_PID); then
+        format_error "FAILED: OSD $i DIED"
+    fi
+done
+
+if grep -q "too large parity" ./testdata/osd*.log; then
+    format_error "FAILED: PARITY REJECTED"
+fi
+
+# Read everything with one data chunk reconstructed from the parity sent by the client
+kill -INT $OSD1_PID
+sleep 3
+
+if ! ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active","degraded"]'); then
+    format_error "FAILED: PG NOT ACTIVE+DEGRADED"
+fi
+
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=256k -direct=1 -iodepth=4 \
+        -rw=write -verify=crc32c -verify_only=1 -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M
+
+format_green OK
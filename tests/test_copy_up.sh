@@ -0,0 +1,45 @@
+#!/bin/bash -ex
+
+# Copy-up: objects of a clone read from the parent layer often enough are merged into the clone
+
+SCHEME=replicated
+PG_COUNT=16
+OSD_ARGS="--copy_up_reads 2 --copy_up_queue_depth 64 $OSD_ARGS"
+
+. `dirname $0`/run_3osds.sh
+
+$ETCDCTL put /vitastor/config/inode/1/2 '{"name":"testimg@0","size":'$((4*1024*1024))'}'
+
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=1M -direct=1 -iodepth=1 -fsync=1 -rw=write \
+        -buffer_pattern=0xdeadface -etcd=$ETCD_URL -pool=1 -inode=2 -size=4M
+
+$ETCDCTL put /vitastor/config/inode/1/3 '{"parent_id":2,"name":"testimg","size":'$((4*1024*1024))'}'
+
+# Read every object of the clone several times
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=128k -direct=1 -iodepth=1 -rw=read \
+        -loops=4 -etcd=$ETCD_URL -pool=1 -inode=3 -size=4M
+
+sleep 2
+
+qemu-img convert -S 4096 -p \
+    -f raw "vitastor:etcd_host=127.0.0.1\:$ETCD_PORT/v3:image=testimg@0" \
+    -O raw ./testdata/parent.bin
+
+# Detach the clone from its parent: if objects were copied up, its data is still the same
+$ETCDCTL put /vitastor/config/inode/1/3 '{"name":"testimg","size":'$((4*1024*1024))'}'
+
+qemu-img convert -S 4096 -p \
+    -f raw "vitastor:etcd_host=127.0.0.1\:$ETCD_PORT/v3:image=testimg" \
+    -O raw ./testdata/clone.bin
+
+if ! cmp ./testdata/parent.bin ./testdata/clone.bin; then
+    format_error "FAILED: CLONE OBJECTS NOT COPIED UP"
+fi
+
+if grep -q "Failed to copy up" ./testdata/osd*.log; then
+    format_error "FAILED: COPY-UP ERRORS"
+fi
+
+format_green OK
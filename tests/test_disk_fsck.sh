@@ -0,0 +1,56 @@
+#!/bin/bash -ex
+
+# Offline fsck of an OSD with the journal striped over two devices, and of a metadata area
+# too small to contain the superblock
+
+. `dirname $0`/common.sh
+
+JOURNAL_SIZE=$((16*1024*1024))
+STRIPE_SIZE=$((256*1024))
+
+dd if=/dev/zero of=./testdata/test_osd1.bin bs=1024 count=1 seek=$((1024*1024-1))
+dd if=/dev/zero of=./testdata/test_journal1.bin bs=1024 count=1 seek=$((JOURNAL_SIZE/1024-1))
+dd if=/dev/zero of=./testdata/test_journal2.bin bs=1024 count=1 seek=$((JOURNAL_SIZE/1024-1))
+
+eval $(node mon/simple-offsets.js --format env --journal_size 0 --device ./testdata/test_osd1.bin 2>/dev/null)
+
+build/src/vitastor-osd --osd_num 1 --bind_address 127.0.0.1 $OSD_ARGS --etcd_address $ETCD_URL \
+    --data_device ./testdata/test_osd1.bin --meta_offset $meta_offset --data_offset $data_offset \
+    --journal_device ./testdata/test_journal1.bin,./testdata/test_journal2.bin --journal_offset 0 \
+    --journal_stripe_size $STRIPE_SIZE &>./testdata/osd1.log &
+OSD1_PID=$!
+
+cd mon
+npm install
+cd ..
+node mon/mon-main.js --etcd_url http://$ETCD_URL --etcd_prefix "/vitastor" &>./testdata/mon.log &
+MON_PID=$!
+
+$ETCDCTL put /vitastor/config/pools '{"1":{"name":"testpool","scheme":"replicated","pg_size":1,"pg_minsize":1,"pg_count":1,"failure_domain":"osd"}}'
+
+sleep 3
+
+if ! ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active"]'); then
+    format_error "FAILED: PG NOT UP"
+fi
+
+# Small writes go to both journal devices, full-block writes go to the data area
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bssplit=4k/70:128k/30 -direct=1 -iodepth=16 \
+        -rw=randwrite -fsync=32 -etcd=$ETCD_URL -pool=1 -inode=1 -size=64M -number_ios=4096
+
+kill -INT $OSD1_PID
+wait $OSD1_PID || true
+
+if ! build/src/vitastor-disk fsck --journal_stripe_size $STRIPE_SIZE ./testdata/test_osd1.bin $meta_offset $((data_offset-meta_offset)) \
+    ./testdata/test_journal1.bin,./testdata/test_journal2.bin 4096 0 $JOURNAL_SIZE > ./testdata/fsck.log; then
+    cat ./testdata/fsck.log
+    format_error "FAILED: FSCK FOUND ERRORS IN THE STRIPED JOURNAL"
+fi
+
+if build/src/vitastor-disk fsck ./testdata/test_osd1.bin $meta_offset 16 > ./testdata/fsck-small.log; then
+    format_error "FAILED: FSCK ACCEPTED A TOO SMALL METADATA AREA"
+fi
+grep -q "too small" ./testdata/fsck-small.log
+
+format_green OK
@@ -0,0 +1,30 @@
+#!/bin/bash -ex
+
+# Pipelined replication and subop batches: large writes are forwarded between replicas,
+# small ones are batched, and local subops reuse the same recycled subop arrays
+
+SCHEME=replicated
+PG_COUNT=16
+OSD_ARGS="--pipeline_replication_threshold 131072 --subop_batch_max 32 $OSD_ARGS"
+
+. `dirname $0`/run_3osds.sh
+
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bssplit=4k/40:128k/30:1M/30 -direct=1 -iodepth=16 \
+        -rw=randwrite -verify=crc32c -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M -number_ios=4096
+
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4M -direct=1 -iodepth=4 -fsync=8 \
+        -rw=write -verify=crc32c -etcd=$ETCD_URL -pool=1 -inode=1 -size=128M
+
+for i in 1 2 3; do
+    if ! kill -0 $(eval echo \$OSD${i}_PID); then
+        format_error "FAILED: OSD $i DIED"
+    fi
+done
+
+if grep -q "subop failed" ./testdata/osd*.log; then
+    format_error "FAILED: SUBOPS FAILED"
+fi
+
+format_green OK
@@ -0,0 +1,47 @@
+#!/bin/bash -ex
+
+# Recovery with huge subop batches: batches must be split before they exceed
+# the maximum request or reply size, otherwise peers reject them and repeer in a loop
+
+SCHEME=replicated
+OSD_ARGS="--subop_batch_max 2048 --recovery_queue_depth 2048 $OSD_ARGS"
+
+. `dirname $0`/run_3osds.sh
+
+kill -INT $OSD3_PID
+sleep 3
+
+if ! ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active","degraded"]'); then
+    format_error "FAILED: PG NOT ACTIVE+DEGRADED"
+fi
+
+# 4096 objects of 128 KB degraded at once
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4M -direct=1 -iodepth=4 -fsync=16 \
+        -rw=write -verify=crc32c -do_verify=0 -etcd=$ETCD_URL -pool=1 -inode=1 -size=512M
+
+build/src/vitastor-osd --osd_num 3 --bind_address 127.0.0.1 $OSD_ARGS --etcd_address $ETCD_URL $(node mon/simple-offsets.js --format options --device ./testdata/test_osd3.bin 2>/dev/null) &>./testdata/osd3.log &
+OSD3_PID=$!
+
+for i in {1..60}; do
+    ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active"]') && break
+    sleep 1
+done
+
+if ! ($ETCDCTL get /vitastor/pg/state/1/1 --print-value-only | jq -s -e '(. | length) != 0 and .[0].state == ["active"]'); then
+    format_error "FAILED: PG NOT RECOVERED"
+fi
+
+if grep -q "subop failed" ./testdata/osd*.log; then
+    format_error "FAILED: SUBOPS FAILED DURING RECOVERY"
+fi
+
+# Read everything from the recovered OSD and the one which was the source
+kill -INT $OSD1_PID
+sleep 3
+
+LD_PRELOAD="libasan.so.5 build/src/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/libfio_vitastor.so -bs=4M -direct=1 -iodepth=4 \
+        -rw=write -verify=crc32c -verify_only=1 -etcd=$ETCD_URL -pool=1 -inode=1 -size=512M
+
+format_green OK